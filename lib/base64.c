@@ -101,6 +101,21 @@ base64_encode (const char *restrict in, size_t inlen,
       return;
     }
 
+  /* Encode complete groups of three bytes (which is all but the tail
+     in base64_encode_alloc case) without per-byte length checks.  */
+  {
+    size_t groups = inlen / 3;
+
+    if (groups > outlen / 4)
+      groups = outlen / 4;
+
+    base64_encode_fast (in, groups * 3, out);
+    in += groups * 3;
+    inlen -= groups * 3;
+    out += groups * 4;
+    outlen -= groups * 4;
+  }
+
   while (inlen && outlen)
     {
       *out++ = b64c[to_uchar (in[0]) >> 2];
@@ -385,6 +400,44 @@ get_4 (struct base64_decode_context *ctx,
   }
 }
 
+/* Decode complete quadruples of alphabet characters from IN into OUT,
+   stop at the first padding, newline or invalid character, or if less
+   than three bytes are left in OUT.  Return number of input bytes
+   consumed, the rest is handled by decode_4.  */
+static size_t
+decode_fast (char const *restrict in, size_t inlen,
+             char *restrict out, size_t outleft)
+{
+  char const *start = in;
+
+  while (inlen >= 4 && outleft >= 3)
+    {
+      int a = b64[to_uchar (in[0])];
+      int b = b64[to_uchar (in[1])];
+      int c = b64[to_uchar (in[2])];
+      int d = b64[to_uchar (in[3])];
+      unsigned int v;
+
+      /* invalid character maps to -1 */
+      if ((a | b | c | d) < 0
+          || !uchar_in_range (to_uchar (in[0])) || !uchar_in_range (to_uchar (in[1]))
+          || !uchar_in_range (to_uchar (in[2])) || !uchar_in_range (to_uchar (in[3])))
+        break;
+
+      v = ((unsigned int) a << 18) | ((unsigned int) b << 12)
+          | ((unsigned int) c << 6) | (unsigned int) d;
+      *out++ = (char) (v >> 16);
+      *out++ = (char) (v >> 8);
+      *out++ = (char) v;
+
+      in += 4;
+      inlen -= 4;
+      outleft -= 3;
+    }
+
+  return in - start;
+}
+
 #define return_false                            \
   do                                            \
     {                                           \
@@ -506,6 +559,13 @@ base64_decode_ctx (struct base64_decode_context *ctx,
       size_t outleft_save = outleft;
       if (ctx_i == 0 && !flush_ctx)
         {
+          size_t done = decode_fast (in, inlen, out, outleft);
+
+          in += done;
+          inlen -= done;
+          out += done / 4 * 3;
+          outleft -= done / 4 * 3;
+
           while (true)
             {
               /* Save a copy of outleft, in case we need to re-parse this
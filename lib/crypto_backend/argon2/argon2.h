@@ -221,6 +221,15 @@ typedef enum Argon2_type {
   Argon2_id = 2
 } argon2_type;
 
+/* Block filling implementation (instruction set) */
+typedef enum Argon2_impl {
+    ARGON2_IMPL_REF = 0,
+    ARGON2_IMPL_SSE2 = 1,
+    ARGON2_IMPL_SSSE3 = 2,
+    ARGON2_IMPL_AVX2 = 3,
+    ARGON2_IMPL_NEON = 4
+} argon2_impl;
+
 /* Version of the algorithm */
 typedef enum Argon2_version {
     ARGON2_VERSION_10 = 0x10,
@@ -427,6 +436,14 @@ ARGON2_PUBLIC size_t argon2_encodedlen(uint32_t t_cost, uint32_t m_cost,
                                        uint32_t parallelism, uint32_t saltlen,
                                        uint32_t hashlen, argon2_type type);
 
+/**
+ * Select block filling implementation used by all following hash calls.
+ * The caller is responsible for checking that CPU supports it.
+ * @param impl  Requested implementation
+ * @return  ARGON2_OK if selected, ARGON2_INCORRECT_TYPE if not compiled in
+ */
+ARGON2_PUBLIC int argon2_select_impl(argon2_impl impl);
+
 #if defined(__cplusplus)
 }
 #endif
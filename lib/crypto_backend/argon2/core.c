@@ -245,6 +245,43 @@ uint32_t index_alpha(const argon2_instance_t *instance,
     return absolute_position;
 }
 
+/***************Block filling implementation selection**********/
+static void (*fill_segment_impl)(const argon2_instance_t *instance,
+                                 argon2_position_t position) = fill_segment_ref;
+
+int argon2_select_impl(argon2_impl impl) {
+    switch (impl) {
+    case ARGON2_IMPL_REF:
+        fill_segment_impl = fill_segment_ref;
+        break;
+#if defined(ARGON2_SIMD_X86)
+    case ARGON2_IMPL_SSE2:
+        fill_segment_impl = fill_segment_sse2;
+        break;
+    case ARGON2_IMPL_SSSE3:
+        fill_segment_impl = fill_segment_ssse3;
+        break;
+    case ARGON2_IMPL_AVX2:
+        fill_segment_impl = fill_segment_avx2;
+        break;
+#endif
+#if defined(ARGON2_SIMD_NEON)
+    case ARGON2_IMPL_NEON:
+        fill_segment_impl = fill_segment_neon;
+        break;
+#endif
+    default:
+        return ARGON2_INCORRECT_TYPE;
+    }
+
+    return ARGON2_OK;
+}
+
+void fill_segment(const argon2_instance_t *instance,
+                  argon2_position_t position) {
+    fill_segment_impl(instance, position);
+}
+
 /* Single-threaded version for p=1 case */
 static int fill_memory_blocks_st(argon2_instance_t *instance) {
     uint32_t r, s, l;
@@ -265,11 +302,168 @@ static int fill_memory_blocks_st(argon2_instance_t *instance) {
 
 #if !defined(ARGON2_NO_THREADS)
 
-#ifdef _WIN32
-static unsigned __stdcall fill_segment_thr(void *thread_data)
-#else
-static void *fill_segment_thr(void *thread_data)
+#if !defined(_WIN32)
+
+/*
+ * Worker set shared by one derivation. Workers are started once and then
+ * woken for every slice; lanes are distributed round-robin (lane % threads),
+ * the calling thread takes its own share. Lanes inside a slice are
+ * independent, so the assignment does not change the output. Workers
+ * inherit the CPU affinity of the calling thread.
+ */
+typedef struct Argon2_workers {
+    argon2_instance_t *instance;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    argon2_position_t position;
+    uint32_t generation;
+    uint32_t pending;
+    int stop;
+} argon2_workers;
+
+typedef struct Argon2_worker {
+    argon2_workers *set;
+    uint32_t id;
+} argon2_worker;
+
+static void fill_slice_share(argon2_instance_t *instance,
+                             argon2_position_t position, uint32_t id) {
+    uint32_t l;
+
+    for (l = id; l < instance->lanes; l += instance->threads) {
+        position.lane = l;
+        position.index = 0;
+        fill_segment(instance, position);
+    }
+}
+
+static void *fill_segment_worker(void *thread_data)
+{
+    argon2_worker *me = thread_data;
+    argon2_workers *set = me->set;
+    argon2_position_t position;
+    uint32_t generation = 0;
+
+    for (;;) {
+        pthread_mutex_lock(&set->lock);
+        while (!set->stop && set->generation == generation)
+            pthread_cond_wait(&set->start, &set->lock);
+        if (set->stop) {
+            pthread_mutex_unlock(&set->lock);
+            break;
+        }
+        generation = set->generation;
+        position = set->position;
+        pthread_mutex_unlock(&set->lock);
+
+        fill_slice_share(set->instance, position, me->id);
+
+        pthread_mutex_lock(&set->lock);
+        if (--set->pending == 0)
+            pthread_cond_signal(&set->done);
+        pthread_mutex_unlock(&set->lock);
+    }
+
+    return NULL;
+}
+
+/* Multi-threaded version for p > 1 case */
+static int fill_memory_blocks_mt(argon2_instance_t *instance) {
+    uint32_t r, s, i, workers, started = 0;
+    argon2_thread_handle_t *thread = NULL;
+    argon2_worker *thr_data = NULL;
+    argon2_workers set;
+    int rc = ARGON2_OK;
+
+    workers = instance->threads - 1;
+
+    memset(&set, 0, sizeof(set));
+    set.instance = instance;
+    if (pthread_mutex_init(&set.lock, NULL))
+        return ARGON2_THREAD_FAIL;
+    if (pthread_cond_init(&set.start, NULL)) {
+        pthread_mutex_destroy(&set.lock);
+        return ARGON2_THREAD_FAIL;
+    }
+    if (pthread_cond_init(&set.done, NULL)) {
+        pthread_cond_destroy(&set.start);
+        pthread_mutex_destroy(&set.lock);
+        return ARGON2_THREAD_FAIL;
+    }
+
+    /* 1. Start workers, the calling thread is worker 0 */
+    thread = calloc(workers, sizeof(argon2_thread_handle_t));
+    thr_data = calloc(workers, sizeof(argon2_worker));
+    if (thread == NULL || thr_data == NULL) {
+        rc = ARGON2_MEMORY_ALLOCATION_ERROR;
+        goto fail;
+    }
+
+    for (i = 0; i < workers; ++i) {
+        thr_data[i].set = &set;
+        thr_data[i].id = i + 1;
+        if (argon2_thread_create(&thread[i], &fill_segment_worker,
+                                 (void *)&thr_data[i])) {
+            rc = ARGON2_THREAD_FAIL;
+            goto fail;
+        }
+        started++;
+    }
+
+    /* 2. Run every slice, one barrier per sync point */
+    for (r = 0; r < instance->passes; ++r) {
+        for (s = 0; s < ARGON2_SYNC_POINTS; ++s) {
+            argon2_position_t position;
+
+            position.pass = r;
+            position.lane = 0;
+            position.slice = (uint8_t)s;
+            position.index = 0;
+
+            pthread_mutex_lock(&set.lock);
+            set.position = position;
+            set.pending = workers;
+            set.generation++;
+            pthread_cond_broadcast(&set.start);
+            pthread_mutex_unlock(&set.lock);
+
+            fill_slice_share(instance, position, 0);
+
+            pthread_mutex_lock(&set.lock);
+            while (set.pending)
+                pthread_cond_wait(&set.done, &set.lock);
+            pthread_mutex_unlock(&set.lock);
+        }
+
+#ifdef GENKAT
+        internal_kat(instance, r); /* Print all memory blocks */
 #endif
+    }
+
+fail:
+    /* 3. Stop and join workers */
+    pthread_mutex_lock(&set.lock);
+    set.stop = 1;
+    pthread_cond_broadcast(&set.start);
+    pthread_mutex_unlock(&set.lock);
+
+    for (i = 0; i < started; ++i) {
+        if (argon2_thread_join(thread[i]))
+            rc = ARGON2_THREAD_FAIL;
+    }
+
+    pthread_cond_destroy(&set.done);
+    pthread_cond_destroy(&set.start);
+    pthread_mutex_destroy(&set.lock);
+    free(thread);
+    free(thr_data);
+    return rc;
+}
+
+#else /* _WIN32 */
+
+static unsigned __stdcall fill_segment_thr(void *thread_data)
 {
     argon2_thread_data *my_data = thread_data;
     fill_segment(my_data->instance_ptr, my_data->pos);
@@ -357,6 +551,7 @@ fail:
     return rc;
 }
 
+#endif /* _WIN32 */
 #endif /* ARGON2_NO_THREADS */
 
 int fill_memory_blocks(argon2_instance_t *instance) {
@@ -217,6 +217,21 @@ void finalize(const argon2_context *context, argon2_instance_t *instance);
 void fill_segment(const argon2_instance_t *instance,
                   argon2_position_t position);
 
+/*
+ * Block filling implementations, fill_segment() dispatches to the one
+ * selected by argon2_select_impl()
+ */
+void fill_segment_ref(const argon2_instance_t *instance,
+                      argon2_position_t position);
+void fill_segment_sse2(const argon2_instance_t *instance,
+                       argon2_position_t position);
+void fill_segment_ssse3(const argon2_instance_t *instance,
+                        argon2_position_t position);
+void fill_segment_avx2(const argon2_instance_t *instance,
+                       argon2_position_t position);
+void fill_segment_neon(const argon2_instance_t *instance,
+                       argon2_position_t position);
+
 /*
  * Function that fills the entire memory t_cost times based on the first two
  * blocks in each lane
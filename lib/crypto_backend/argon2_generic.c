@@ -20,6 +20,20 @@
  */
 
 #include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 #include "crypto_backend.h"
 #if HAVE_ARGON2_H
 #include <argon2.h>
@@ -29,10 +43,323 @@
 
 #define CONST_CAST(x) (x)(uintptr_t)
 
-int argon2(const char *type, const char *password, size_t password_length,
-	   const char *salt, size_t salt_length,
-	   char *key, size_t key_length,
-	   uint32_t iterations, uint32_t memory, uint32_t parallel)
+#if USE_INTERNAL_ARGON2 && !HAVE_ARGON2_H
+/* Pick the fastest bundled block filling code the CPU can run */
+static void argon2_select_cpu_impl(void)
+{
+	static int selected = 0;
+
+	if (selected)
+		return;
+	selected = 1;
+
+#if ARGON2_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") &&
+	    argon2_select_impl(ARGON2_IMPL_AVX2) == ARGON2_OK)
+		return;
+	if (__builtin_cpu_supports("ssse3") &&
+	    argon2_select_impl(ARGON2_IMPL_SSSE3) == ARGON2_OK)
+		return;
+	if (__builtin_cpu_supports("sse2") &&
+	    argon2_select_impl(ARGON2_IMPL_SSE2) == ARGON2_OK)
+		return;
+#elif ARGON2_SIMD_NEON
+	if (argon2_select_impl(ARGON2_IMPL_NEON) == ARGON2_OK)
+		return;
+#endif
+	(void)argon2_select_impl(ARGON2_IMPL_REF);
+}
+#endif
+
+/*
+ * Argon2 block memory
+ *
+ * Memory is mmap-ed directly (hugetlb pages if reserved, otherwise
+ * transparent hugepages are requested), locked and excluded from core dumps.
+ * While the pool has users (repeated derivations in benchmark, concurrent
+ * or serial keyslot unlock), released areas are kept mapped and reused,
+ * so page faults are paid only once. Argon2 wipes the memory before
+ * it is released (free_memory), the pool never hands out stale content.
+ */
+#if USE_INTERNAL_ARGON2 || HAVE_ARGON2_H
+#define ARGON2_POOL_SLOTS	8
+#define ARGON2_HUGEPAGE_SIZE	(2 * 1024 * 1024)
+
+static struct {
+	pthread_mutex_t lock;
+	unsigned users;
+	struct {
+		uint8_t *memory;
+		size_t size;
+		int node;
+		int busy;
+	} slot[ARGON2_POOL_SLOTS];
+} argon2_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* NUMA node the running derivation is placed on (-1 for none) */
+static __thread int argon2_node = -1;
+
+static size_t argon2_map_size(size_t size)
+{
+	return size >= ARGON2_HUGEPAGE_SIZE ?
+		(size + ARGON2_HUGEPAGE_SIZE - 1) & ~((size_t)ARGON2_HUGEPAGE_SIZE - 1) : size;
+}
+
+static uint8_t *argon2_map(size_t size)
+{
+	void *p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	if (size >= ARGON2_HUGEPAGE_SIZE)
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		(void)madvise(p, size, MADV_HUGEPAGE);
+#endif
+	}
+#ifdef MADV_DONTDUMP
+	(void)madvise(p, size, MADV_DONTDUMP);
+#endif
+	/* Best effort only, RLIMIT_MEMLOCK can be too low */
+	(void)mlock(p, size);
+
+	return p;
+}
+
+static int argon2_pool_alloc(uint8_t **memory, size_t size)
+{
+	int i, best = -1, empty = -1;
+
+	size = argon2_map_size(size);
+
+	pthread_mutex_lock(&argon2_pool.lock);
+	for (i = 0; argon2_pool.users && i < ARGON2_POOL_SLOTS; i++) {
+		if (!argon2_pool.slot[i].memory) {
+			if (empty < 0 && !argon2_pool.slot[i].busy)
+				empty = i;
+		} else if (!argon2_pool.slot[i].busy && argon2_pool.slot[i].size >= size &&
+			   argon2_pool.slot[i].node == argon2_node &&
+			   (best < 0 || argon2_pool.slot[i].size < argon2_pool.slot[best].size))
+			best = i;
+	}
+
+	if (best >= 0) {
+		argon2_pool.slot[best].busy = 1;
+		*memory = argon2_pool.slot[best].memory;
+		pthread_mutex_unlock(&argon2_pool.lock);
+		return 0;
+	}
+
+	/* reserve slot, mapping is done without lock */
+	if (empty >= 0) {
+		argon2_pool.slot[empty].busy = 1;
+		argon2_pool.slot[empty].size = size;
+		argon2_pool.slot[empty].node = argon2_node;
+	}
+	pthread_mutex_unlock(&argon2_pool.lock);
+
+	*memory = argon2_map(size);
+
+	if (empty >= 0) {
+		pthread_mutex_lock(&argon2_pool.lock);
+		argon2_pool.slot[empty].memory = *memory;
+		argon2_pool.slot[empty].busy = *memory ? 1 : 0;
+		pthread_mutex_unlock(&argon2_pool.lock);
+	}
+
+	return *memory ? 0 : -1;
+}
+
+static void argon2_pool_free(uint8_t *memory, size_t size)
+{
+	int i;
+
+	size = argon2_map_size(size);
+
+	pthread_mutex_lock(&argon2_pool.lock);
+	for (i = 0; i < ARGON2_POOL_SLOTS; i++) {
+		if (argon2_pool.slot[i].memory != memory)
+			continue;
+		/* pooled area can be larger than requested */
+		size = argon2_pool.slot[i].size;
+		if (argon2_pool.users) {
+			argon2_pool.slot[i].busy = 0;
+			pthread_mutex_unlock(&argon2_pool.lock);
+			return;
+		}
+		argon2_pool.slot[i].memory = NULL;
+		argon2_pool.slot[i].busy = 0;
+		break;
+	}
+	pthread_mutex_unlock(&argon2_pool.lock);
+
+	munmap(memory, size);
+}
+
+void crypt_argon2_pool_get(void)
+{
+	pthread_mutex_lock(&argon2_pool.lock);
+	argon2_pool.users++;
+	pthread_mutex_unlock(&argon2_pool.lock);
+}
+
+void crypt_argon2_pool_put(void)
+{
+	int i;
+
+	pthread_mutex_lock(&argon2_pool.lock);
+	if (argon2_pool.users && !--argon2_pool.users) {
+		for (i = 0; i < ARGON2_POOL_SLOTS; i++) {
+			if (!argon2_pool.slot[i].memory || argon2_pool.slot[i].busy)
+				continue;
+			munmap(argon2_pool.slot[i].memory, argon2_pool.slot[i].size);
+			argon2_pool.slot[i].memory = NULL;
+		}
+	}
+	pthread_mutex_unlock(&argon2_pool.lock);
+}
+
+/*
+ * NUMA placement
+ *
+ * On machines with more memory nodes, derivation runs on CPUs of one node
+ * (node of the calling CPU unless set by crypt_argon2_set_numa_node())
+ * if the node has enough allowed CPUs for all lanes. Lane threads inherit
+ * affinity of the calling thread and fault in block memory themselves,
+ * so memory is node-local. Benchmark uses the same placement as unlock.
+ */
+#define ARGON2_NUMA_NODES_MAX 64
+
+static int argon2_numa_policy = CRYPT_ARGON2_NUMA_AUTO;
+
+static struct {
+	pthread_once_t once;
+	int nodes;
+	cpu_set_t cpus[ARGON2_NUMA_NODES_MAX];
+} argon2_numa = { .once = PTHREAD_ONCE_INIT };
+
+/* Parse sysfs list format, e.g. "0-3,8-11" */
+static int numa_read_list(const char *path, cpu_set_t *set)
+{
+	char buf[4096], *p, *end;
+	unsigned long a, b;
+	FILE *f;
+	int r = -EINVAL;
+
+	CPU_ZERO(set);
+
+	if (!(f = fopen(path, "r")))
+		return -EINVAL;
+
+	if (fgets(buf, sizeof(buf), f)) {
+		for (p = buf; *p && *p != '\n'; p = end) {
+			a = b = strtoul(p, &end, 10);
+			if (end == p)
+				break;
+			if (*end == '-')
+				b = strtoul(end + 1, &end, 10);
+			for (; a <= b && a < CPU_SETSIZE; a++)
+				CPU_SET(a, set);
+			if (*end == ',')
+				end++;
+		}
+		r = 0;
+	}
+
+	fclose(f);
+	return r;
+}
+
+static void numa_init(void)
+{
+	char path[64];
+	cpu_set_t nodes;
+	int i;
+
+	if (numa_read_list("/sys/devices/system/node/online", &nodes))
+		return;
+
+	for (i = 0; i < ARGON2_NUMA_NODES_MAX; i++) {
+		if (!CPU_ISSET(i, &nodes))
+			continue;
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", i);
+		if (numa_read_list(path, &argon2_numa.cpus[i]))
+			return;
+		argon2_numa.nodes = i + 1;
+	}
+
+	if (CPU_COUNT(&nodes) < 2)
+		argon2_numa.nodes = 0;
+}
+
+static int numa_node_of_cpu(int cpu)
+{
+	int i;
+
+	for (i = 0; cpu >= 0 && i < argon2_numa.nodes; i++)
+		if (CPU_ISSET(cpu, &argon2_numa.cpus[i]))
+			return i;
+
+	return -1;
+}
+
+static int argon2_numa_enter(uint32_t threads, cpu_set_t *saved)
+{
+	cpu_set_t set;
+	int node = argon2_numa_policy;
+
+	if (node == CRYPT_ARGON2_NUMA_NONE)
+		return -1;
+
+	pthread_once(&argon2_numa.once, numa_init);
+	if (!argon2_numa.nodes)
+		return -1;
+
+	if (node == CRYPT_ARGON2_NUMA_AUTO)
+		node = numa_node_of_cpu(sched_getcpu());
+	if (node < 0 || node >= argon2_numa.nodes)
+		return -1;
+
+	if (sched_getaffinity(0, sizeof(*saved), saved))
+		return -1;
+
+	CPU_AND(&set, &argon2_numa.cpus[node], saved);
+	if (CPU_COUNT(&set) < (int)threads || CPU_EQUAL(&set, saved))
+		return -1;
+
+	if (sched_setaffinity(0, sizeof(set), &set))
+		return -1;
+
+	return node;
+}
+
+static void argon2_numa_leave(int node, const cpu_set_t *saved)
+{
+	if (node >= 0)
+		(void)sched_setaffinity(0, sizeof(*saved), saved);
+}
+
+void crypt_argon2_set_numa_node(int node)
+{
+	argon2_numa_policy = node;
+}
+#else
+void crypt_argon2_pool_get(void) {}
+void crypt_argon2_pool_put(void) {}
+void crypt_argon2_set_numa_node(int node) {}
+#endif
+
+static int argon2_local(const char *type, const char *password, size_t password_length,
+			const char *salt, size_t salt_length,
+			char *key, size_t key_length,
+			uint32_t iterations, uint32_t memory, uint32_t parallel)
 {
 #if !USE_INTERNAL_ARGON2 && !HAVE_ARGON2_H
 	return -EINVAL;
@@ -51,7 +378,10 @@ int argon2(const char *type, const char *password, size_t password_length,
 		.pwdlen = (uint32_t)password_length,
 		.salt = CONST_CAST(uint8_t *)salt,
 		.saltlen = (uint32_t)salt_length,
+		.allocate_cbk = argon2_pool_alloc,
+		.free_cbk = argon2_pool_free,
 	};
+	cpu_set_t saved;
 	int r;
 
 	if (!strcmp(type, "argon2i"))
@@ -61,7 +391,16 @@ int argon2(const char *type, const char *password, size_t password_length,
 	else
 		return -EINVAL;
 
-	switch (argon2_ctx(&context, atype)) {
+#if USE_INTERNAL_ARGON2 && !HAVE_ARGON2_H
+	argon2_select_cpu_impl();
+#endif
+
+	argon2_node = argon2_numa_enter(context.threads, &saved);
+	r = argon2_ctx(&context, atype);
+	argon2_numa_leave(argon2_node, &saved);
+	argon2_node = -1;
+
+	switch (r) {
 	case ARGON2_OK:
 		r = 0;
 		break;
@@ -78,6 +417,537 @@ int argon2(const char *type, const char *password, size_t password_length,
 #endif
 }
 
+#if USE_INTERNAL_ARGON2 || HAVE_ARGON2_H
+/*
+ * Out-of-process executor
+ *
+ * Helpers are forked in advance; each one owns a socketpair and one locked
+ * shared page. A request (parameters, password and salt) is sent over the socket,
+ * the helper derives the key, stores it to the shared page and answers with
+ * the result code. Helpers keep their Argon2 memory mapped in the pool
+ * (pre-reserved at start), so the caller process never maps the Argon2 arena.
+ * One derivation runs per helper at a time, callers wait for a free helper.
+ * Helpers are forked only from crypt_argon2_helpers_start(), never from
+ * a derivation thread. A crashed or killed helper is dropped and its request
+ * runs in-process; helper exits on EOF of its socket (the parent is gone).
+ */
+#define ARGON2_HELPERS_MAX	64
+
+struct argon2_helper_req {
+	char type[16];
+	uint32_t iterations, memory, parallel;
+	uint32_t password_length, salt_length, key_length;
+};
+
+struct argon2_helper {
+	pid_t pid;
+	int fd;
+	char *page;
+	int busy;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct argon2_helper helper[ARGON2_HELPERS_MAX];
+	unsigned count;
+	uint32_t memory_kb;
+	size_t page_size;
+} argon2_helpers = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Set in helper process, derivation then runs locally */
+static int argon2_in_helper = 0;
+
+static int helper_io(int fd, void *buf, size_t length, int wr)
+{
+	ssize_t r;
+	size_t done = 0;
+
+	while (done < length) {
+		if (wr)
+			r = send(fd, (char *)buf + done, length - done, MSG_NOSIGNAL);
+		else
+			r = recv(fd, (char *)buf + done, length - done, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -EIO;
+		done += r;
+	}
+
+	return 0;
+}
+
+static void helper_main(int fd, char *page, size_t page_size, uint32_t memory_kb)
+{
+	struct argon2_helper_req req;
+	char *buf;
+	int32_t r;
+	size_t len;
+
+	argon2_in_helper = 1;
+	crypt_argon2_pool_get();
+
+	/* Pre-reserve (map and fault in) the arena of the maximal request */
+	if (memory_kb && !argon2_pool_alloc((uint8_t **)&buf, (size_t)memory_kb * 1024))
+		argon2_pool_free((uint8_t *)buf, (size_t)memory_kb * 1024);
+
+	while (!helper_io(fd, &req, sizeof(req), 0)) {
+		req.type[sizeof(req.type) - 1] = '\0';
+		len = (size_t)req.password_length + req.salt_length;
+		buf = malloc(len ?: 1);
+		if (!buf)
+			break;
+
+		r = helper_io(fd, buf, len, 0);
+		if (!r && req.key_length > page_size)
+			r = -EINVAL;
+		if (!r)
+			r = argon2_local(req.type, buf, req.password_length,
+					 buf + req.password_length, req.salt_length,
+					 page, req.key_length,
+					 req.iterations, req.memory, req.parallel);
+
+		crypt_backend_memzero(buf, len);
+		free(buf);
+
+		if (helper_io(fd, &r, sizeof(r), 1))
+			break;
+	}
+
+	crypt_backend_memzero(page, page_size);
+	_exit(0);
+}
+
+/* Called with argon2_helpers.lock held */
+static int helper_spawn(struct argon2_helper *h)
+{
+	int sv[2];
+	unsigned i;
+	pid_t pid;
+
+	if (!h->page) {
+		h->page = mmap(NULL, argon2_helpers.page_size, PROT_READ | PROT_WRITE,
+			       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (h->page == MAP_FAILED) {
+			h->page = NULL;
+			return -ENOMEM;
+		}
+#ifdef MADV_DONTDUMP
+		(void)madvise(h->page, argon2_helpers.page_size, MADV_DONTDUMP);
+#endif
+		(void)mlock(h->page, argon2_helpers.page_size);
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+		return -errno;
+
+	pid = fork();
+	if (pid < 0) {
+		close(sv[0]);
+		close(sv[1]);
+		return -errno;
+	}
+
+	if (!pid) {
+		close(sv[0]);
+		for (i = 0; i < ARGON2_HELPERS_MAX; i++)
+			if (argon2_helpers.helper[i].pid > 0)
+				close(argon2_helpers.helper[i].fd);
+		helper_main(sv[1], h->page, argon2_helpers.page_size, argon2_helpers.memory_kb);
+	}
+
+	close(sv[1]);
+	h->pid = pid;
+	h->fd = sv[0];
+	h->busy = 0;
+	return 0;
+}
+
+/* Called with argon2_helpers.lock held */
+static void helper_kill(struct argon2_helper *h)
+{
+	if (h->pid <= 0)
+		return;
+
+	close(h->fd);
+	(void)kill(h->pid, SIGKILL);
+	while (waitpid(h->pid, NULL, 0) < 0 && errno == EINTR)
+		;
+	h->pid = 0;
+	h->fd = -1;
+}
+
+static int argon2_helper_run(const char *type, const char *password, size_t password_length,
+			     const char *salt, size_t salt_length,
+			     char *key, size_t key_length,
+			     uint32_t iterations, uint32_t memory, uint32_t parallel)
+{
+	struct argon2_helper_req req = {
+		.iterations = iterations,
+		.memory = memory,
+		.parallel = parallel,
+		.password_length = password_length,
+		.salt_length = salt_length,
+		.key_length = key_length,
+	};
+	struct argon2_helper *h = NULL;
+	unsigned i, alive;
+	int32_t res;
+	int r, dead;
+
+	if (argon2_in_helper)
+		return -ENOENT;
+
+	pthread_mutex_lock(&argon2_helpers.lock);
+	if (argon2_helpers.count && (key_length > argon2_helpers.page_size ||
+	    strlen(type) >= sizeof(req.type) ||
+	    password_length > UINT32_MAX || salt_length > UINT32_MAX)) {
+		pthread_mutex_unlock(&argon2_helpers.lock);
+		return -EINVAL;
+	}
+	strncpy(req.type, type, sizeof(req.type) - 1);
+
+	while (argon2_helpers.count && !h) {
+		for (i = 0, alive = 0; i < argon2_helpers.count && !h; i++) {
+			if (argon2_helpers.helper[i].pid <= 0)
+				continue;
+			alive++;
+			if (!argon2_helpers.helper[i].busy)
+				h = &argon2_helpers.helper[i];
+		}
+		if (!h && !alive)
+			break;
+		if (!h)
+			pthread_cond_wait(&argon2_helpers.cond, &argon2_helpers.lock);
+	}
+	if (!h) {
+		pthread_mutex_unlock(&argon2_helpers.lock);
+		return -ENOENT;
+	}
+	h->busy = 1;
+	pthread_mutex_unlock(&argon2_helpers.lock);
+
+	r = helper_io(h->fd, &req, sizeof(req), 1);
+	if (!r)
+		r = helper_io(h->fd, CONST_CAST(char *)password, password_length, 1);
+	if (!r)
+		r = helper_io(h->fd, CONST_CAST(char *)salt, salt_length, 1);
+	if (!r)
+		r = helper_io(h->fd, &res, sizeof(res), 0);
+	dead = r;
+	if (!r) {
+		r = res;
+		if (!r)
+			memcpy(key, h->page, key_length);
+	}
+	crypt_backend_memzero(h->page, key_length);
+
+	pthread_mutex_lock(&argon2_helpers.lock);
+	/* Helper died (or protocol broken), drop it and retry in-process */
+	if (dead) {
+		helper_kill(h);
+		r = -ENOENT;
+	}
+	h->busy = 0;
+	pthread_cond_broadcast(&argon2_helpers.cond);
+	pthread_mutex_unlock(&argon2_helpers.lock);
+
+	return r;
+}
+
+int crypt_argon2_helpers_start(unsigned count, uint32_t memory_kb)
+{
+	unsigned i;
+	int r = 0;
+
+	if (count > ARGON2_HELPERS_MAX)
+		return -EINVAL;
+
+	crypt_argon2_helpers_stop();
+
+	pthread_mutex_lock(&argon2_helpers.lock);
+	argon2_helpers.page_size = (size_t)sysconf(_SC_PAGESIZE);
+	argon2_helpers.memory_kb = memory_kb;
+	for (i = 0; i < count && !r; i++)
+		r = helper_spawn(&argon2_helpers.helper[i]);
+	if (!r)
+		argon2_helpers.count = count;
+	pthread_mutex_unlock(&argon2_helpers.lock);
+
+	if (r)
+		crypt_argon2_helpers_stop();
+	return r;
+}
+
+void crypt_argon2_helpers_stop(void)
+{
+	struct argon2_helper *h;
+	unsigned i, count;
+
+	pthread_mutex_lock(&argon2_helpers.lock);
+	/* No new derivation can start, wait for running ones */
+	count = argon2_helpers.count;
+	argon2_helpers.count = 0;
+	for (i = 0; i < count; i++)
+		while (argon2_helpers.helper[i].busy)
+			pthread_cond_wait(&argon2_helpers.cond, &argon2_helpers.lock);
+
+	for (i = 0; i < ARGON2_HELPERS_MAX; i++) {
+		h = &argon2_helpers.helper[i];
+		helper_kill(h);
+		if (h->page)
+			munmap(h->page, argon2_helpers.page_size);
+		h->page = NULL;
+	}
+	pthread_cond_broadcast(&argon2_helpers.cond);
+	pthread_mutex_unlock(&argon2_helpers.lock);
+}
+#else
+static int argon2_helper_run(const char *type, const char *password, size_t password_length,
+			     const char *salt, size_t salt_length,
+			     char *key, size_t key_length,
+			     uint32_t iterations, uint32_t memory, uint32_t parallel)
+{
+	return -ENOENT;
+}
+
+int crypt_argon2_helpers_start(unsigned count, uint32_t memory_kb)
+{
+	return count ? -ENOTSUP : 0;
+}
+
+void crypt_argon2_helpers_stop(void) {}
+#endif
+
+/*
+ * Admission control
+ *
+ * Sum of memory cost of running derivations is kept under a budget
+ * (half of physical memory unless set). A derivation that does not fit
+ * waits until running ones finish, waiters are admitted in arrival order.
+ * A derivation is always admitted if nothing else runs, so costs larger
+ * than the budget only run alone. Optionally the budget is shared with other
+ * processes through a SysV semaphore keyed by a file in the locking directory;
+ * with SEM_UNDO the kernel returns units held by a crashed process.
+ */
+#define ARGON2_SEM_UNITS_MAX	32767	/* SEMVMX */
+
+enum { ARGON2_SEM_FREE = 0, ARGON2_SEM_UNITS, ARGON2_SEM_UNIT_MB, ARGON2_SEM_COUNT };
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_once_t once;
+	uint64_t budget_kb, busy_kb;
+	unsigned running;
+	uint64_t next_ticket, serving;
+	int semid;
+	unsigned sem_units, sem_unit_mb;
+} argon2_admit = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.once = PTHREAD_ONCE_INIT,
+	.semid = -1,
+};
+
+static uint64_t argon2_default_budget_kb(void)
+{
+	long pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGESIZE);
+
+	if (pages <= 0 || page_size <= 0)
+		return 0;
+
+	return (uint64_t)pages * (page_size / 1024) / 2;
+}
+
+static void argon2_admit_init(void)
+{
+	pthread_mutex_lock(&argon2_admit.lock);
+	if (!argon2_admit.budget_kb)
+		argon2_admit.budget_kb = argon2_default_budget_kb();
+	pthread_mutex_unlock(&argon2_admit.lock);
+}
+
+/* Attach to (or create) shared budget; the creator defines its size */
+static int argon2_sem_open(const char *path, uint64_t budget_kb,
+			   int *semid, unsigned *units, unsigned *unit_mb)
+{
+	struct sembuf op = { .sem_num = ARGON2_SEM_FREE };
+	struct semid_ds ds;
+	union { int val; struct semid_ds *buf; } arg;
+	key_t key;
+	int fd, id, tries, r;
+
+	fd = open(path, O_RDONLY | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		return -errno;
+	close(fd);
+
+	key = ftok(path, 'K');
+	if (key == (key_t)-1)
+		return -errno;
+
+	id = semget(key, ARGON2_SEM_COUNT, IPC_CREAT | IPC_EXCL | S_IRUSR | S_IWUSR);
+	if (id >= 0) {
+		*unit_mb = (budget_kb / 1024 + ARGON2_SEM_UNITS_MAX - 1) / ARGON2_SEM_UNITS_MAX ?: 1;
+		*units = budget_kb / 1024 / *unit_mb ?: 1;
+		arg.val = *units;
+		r = semctl(id, ARGON2_SEM_UNITS, SETVAL, arg);
+		arg.val = *unit_mb;
+		if (!r)
+			r = semctl(id, ARGON2_SEM_UNIT_MB, SETVAL, arg);
+		/* First semop() sets sem_otime, semaphore is then initialised */
+		op.sem_op = *units;
+		if (!r)
+			r = semop(id, &op, 1);
+		if (r) {
+			r = -errno;
+			(void)semctl(id, 0, IPC_RMID);
+			return r;
+		}
+		*semid = id;
+		return 0;
+	}
+
+	if (errno != EEXIST)
+		return -errno;
+
+	id = semget(key, ARGON2_SEM_COUNT, 0);
+	if (id < 0)
+		return -errno;
+
+	arg.buf = &ds;
+	for (tries = 0; tries < 100; tries++) {
+		if (semctl(id, 0, IPC_STAT, arg))
+			return -errno;
+		if (ds.sem_otime)
+			break;
+		usleep(10000);
+	}
+	if (!ds.sem_otime)
+		return -ETIMEDOUT;
+
+	r = semctl(id, ARGON2_SEM_UNITS, GETVAL);
+	if (r <= 0)
+		return -EINVAL;
+	*units = r;
+	r = semctl(id, ARGON2_SEM_UNIT_MB, GETVAL);
+	if (r <= 0)
+		return -EINVAL;
+	*unit_mb = r;
+	*semid = id;
+	return 0;
+}
+
+int crypt_argon2_set_budget(uint64_t budget_kb, const char *shared_path)
+{
+	unsigned units = 0, unit_mb = 0;
+	int semid = -1, r;
+
+	if (!budget_kb)
+		budget_kb = argon2_default_budget_kb();
+
+	if (shared_path) {
+		r = argon2_sem_open(shared_path, budget_kb, &semid, &units, &unit_mb);
+		if (r)
+			return r;
+	}
+
+	pthread_once(&argon2_admit.once, argon2_admit_init);
+	pthread_mutex_lock(&argon2_admit.lock);
+	argon2_admit.budget_kb = budget_kb;
+	argon2_admit.semid = semid;
+	argon2_admit.sem_units = units;
+	argon2_admit.sem_unit_mb = unit_mb;
+	pthread_cond_broadcast(&argon2_admit.cond);
+	pthread_mutex_unlock(&argon2_admit.lock);
+
+	return 0;
+}
+
+static unsigned argon2_sem_units(uint32_t memory)
+{
+	uint64_t units = ((uint64_t)memory + argon2_admit.sem_unit_mb * 1024 - 1) /
+			 (argon2_admit.sem_unit_mb * 1024);
+
+	return units > argon2_admit.sem_units ? argon2_admit.sem_units : units ?: 1;
+}
+
+/* Returns semaphore units taken (to be released), -1 if semaphore not used */
+static int argon2_admit_enter(uint32_t memory, int *semid)
+{
+	struct sembuf op = { .sem_num = ARGON2_SEM_FREE, .sem_flg = SEM_UNDO };
+	uint64_t ticket;
+	int units = -1;
+
+	pthread_once(&argon2_admit.once, argon2_admit_init);
+
+	pthread_mutex_lock(&argon2_admit.lock);
+	ticket = argon2_admit.next_ticket++;
+	while (ticket != argon2_admit.serving ||
+	       (argon2_admit.running && argon2_admit.budget_kb &&
+		argon2_admit.busy_kb + memory > argon2_admit.budget_kb))
+		pthread_cond_wait(&argon2_admit.cond, &argon2_admit.lock);
+	argon2_admit.serving++;
+	argon2_admit.busy_kb += memory;
+	argon2_admit.running++;
+
+	*semid = argon2_admit.semid;
+	if (*semid >= 0)
+		units = argon2_sem_units(memory);
+	pthread_cond_broadcast(&argon2_admit.cond);
+	pthread_mutex_unlock(&argon2_admit.lock);
+
+	/* Other processes, blocks until enough units are free */
+	if (units > 0) {
+		op.sem_op = -units;
+		while (semop(*semid, &op, 1))
+			if (errno != EINTR) {
+				units = -1;
+				break;
+			}
+	}
+
+	return units;
+}
+
+static void argon2_admit_leave(uint32_t memory, int semid, int units)
+{
+	struct sembuf op = { .sem_num = ARGON2_SEM_FREE, .sem_op = units, .sem_flg = SEM_UNDO };
+
+	if (units > 0)
+		(void)semop(semid, &op, 1);
+
+	pthread_mutex_lock(&argon2_admit.lock);
+	argon2_admit.busy_kb -= memory;
+	argon2_admit.running--;
+	pthread_cond_broadcast(&argon2_admit.cond);
+	pthread_mutex_unlock(&argon2_admit.lock);
+}
+
+int argon2(const char *type, const char *password, size_t password_length,
+	   const char *salt, size_t salt_length,
+	   char *key, size_t key_length,
+	   uint32_t iterations, uint32_t memory, uint32_t parallel)
+{
+	int semid, units, r;
+
+	units = argon2_admit_enter(memory, &semid);
+
+	r = argon2_helper_run(type, password, password_length, salt, salt_length,
+			      key, key_length, iterations, memory, parallel);
+	if (r == -ENOENT)
+		r = argon2_local(type, password, password_length, salt, salt_length,
+				 key, key_length, iterations, memory, parallel);
+
+	argon2_admit_leave(memory, semid, units);
+	return r;
+}
+
 #if 0
 #include <stdio.h>
 
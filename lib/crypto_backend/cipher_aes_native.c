@@ -0,0 +1,511 @@
+/*
+ * Built-in AES (ECB, CBC, CTR, XTS) using CPU AES instructions
+ * (x86 AES-NI, ARMv8 Crypto Extensions), selected at runtime.
+ *
+ * Copyright (C) 2026, cryptsetup contributors
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * This file is compiled with instruction set flags (-maes or +crypto),
+ * no function here may be used before aes_native_supported() check.
+ * All operations use only AES instructions and table-free code,
+ * there is no secret dependent memory access or branch.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include "crypto_backend.h"
+
+#if defined(AES_NATIVE_X86)
+#include <immintrin.h>
+
+typedef __m128i aes_block;
+
+#define aes_load(p)		_mm_loadu_si128((const __m128i *)(const void *)(p))
+#define aes_store(p, b)		_mm_storeu_si128((__m128i *)(void *)(p), (b))
+#define aes_xor(a, b)		_mm_xor_si128((a), (b))
+#define aes_imc(k)		_mm_aesimc_si128(k)
+
+static int aes_native_supported(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse2");
+}
+
+/* SubBytes of one word: all columns equal, ShiftRows has no effect */
+static uint32_t aes_sub_word(uint32_t w)
+{
+	return (uint32_t)_mm_cvtsi128_si32(
+		_mm_aesenclast_si128(_mm_set1_epi32((int)w), _mm_setzero_si128()));
+}
+
+/* AddRoundKey, nr-1 full rounds and final round */
+#define AES_ENC(b, rk, nr) do { int _i; \
+	b = _mm_xor_si128(b, (rk)[0]); \
+	for (_i = 1; _i < (nr); _i++) \
+		b = _mm_aesenc_si128(b, (rk)[_i]); \
+	b = _mm_aesenclast_si128(b, (rk)[nr]); \
+} while (0)
+
+#define AES_DEC(b, dk, nr) do { int _i; \
+	b = _mm_xor_si128(b, (dk)[0]); \
+	for (_i = 1; _i < (nr); _i++) \
+		b = _mm_aesdec_si128(b, (dk)[_i]); \
+	b = _mm_aesdeclast_si128(b, (dk)[nr]); \
+} while (0)
+
+#define AES_ENC4(b0, b1, b2, b3, rk, nr) do { int _i; aes_block _k = (rk)[0]; \
+	b0 = _mm_xor_si128(b0, _k); b1 = _mm_xor_si128(b1, _k); \
+	b2 = _mm_xor_si128(b2, _k); b3 = _mm_xor_si128(b3, _k); \
+	for (_i = 1; _i < (nr); _i++) { _k = (rk)[_i]; \
+		b0 = _mm_aesenc_si128(b0, _k); b1 = _mm_aesenc_si128(b1, _k); \
+		b2 = _mm_aesenc_si128(b2, _k); b3 = _mm_aesenc_si128(b3, _k); } \
+	_k = (rk)[nr]; \
+	b0 = _mm_aesenclast_si128(b0, _k); b1 = _mm_aesenclast_si128(b1, _k); \
+	b2 = _mm_aesenclast_si128(b2, _k); b3 = _mm_aesenclast_si128(b3, _k); \
+} while (0)
+
+#define AES_DEC4(b0, b1, b2, b3, dk, nr) do { int _i; aes_block _k = (dk)[0]; \
+	b0 = _mm_xor_si128(b0, _k); b1 = _mm_xor_si128(b1, _k); \
+	b2 = _mm_xor_si128(b2, _k); b3 = _mm_xor_si128(b3, _k); \
+	for (_i = 1; _i < (nr); _i++) { _k = (dk)[_i]; \
+		b0 = _mm_aesdec_si128(b0, _k); b1 = _mm_aesdec_si128(b1, _k); \
+		b2 = _mm_aesdec_si128(b2, _k); b3 = _mm_aesdec_si128(b3, _k); } \
+	_k = (dk)[nr]; \
+	b0 = _mm_aesdeclast_si128(b0, _k); b1 = _mm_aesdeclast_si128(b1, _k); \
+	b2 = _mm_aesdeclast_si128(b2, _k); b3 = _mm_aesdeclast_si128(b3, _k); \
+} while (0)
+
+/* XTS tweak multiplication by x in GF(2^128), little endian */
+static aes_block aes_xts_mul_x(aes_block t)
+{
+	const __m128i poly = _mm_set_epi32(1, 1, 1, 0x87);
+	__m128i carry = _mm_and_si128(_mm_shuffle_epi32(_mm_srai_epi32(t, 31), 0x93), poly);
+
+	return _mm_xor_si128(_mm_slli_epi32(t, 1), carry);
+}
+
+#elif defined(AES_NATIVE_ARMV8)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+
+#ifndef HWCAP_AES
+#define HWCAP_AES (1 << 3)
+#endif
+
+typedef uint8x16_t aes_block;
+
+#define aes_load(p)		vld1q_u8((const uint8_t *)(const void *)(p))
+#define aes_store(p, b)		vst1q_u8((uint8_t *)(void *)(p), (b))
+#define aes_xor(a, b)		veorq_u8((a), (b))
+#define aes_imc(k)		vaesimcq_u8(k)
+
+static int aes_native_supported(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_AES) ? 1 : 0;
+}
+
+/* SubBytes of one word: all columns equal, ShiftRows has no effect */
+static uint32_t aes_sub_word(uint32_t w)
+{
+	return vgetq_lane_u32(vreinterpretq_u32_u8(
+		vaeseq_u8(vreinterpretq_u8_u32(vdupq_n_u32(w)), vdupq_n_u8(0))), 0);
+}
+
+/* AESE includes AddRoundKey before SubBytes, last key is added separately */
+#define AES_ENC(b, rk, nr) do { int _i; \
+	for (_i = 0; _i < (nr) - 1; _i++) \
+		b = vaesmcq_u8(vaeseq_u8(b, (rk)[_i])); \
+	b = veorq_u8(vaeseq_u8(b, (rk)[(nr) - 1]), (rk)[nr]); \
+} while (0)
+
+#define AES_DEC(b, dk, nr) do { int _i; \
+	for (_i = 0; _i < (nr) - 1; _i++) \
+		b = vaesimcq_u8(vaesdq_u8(b, (dk)[_i])); \
+	b = veorq_u8(vaesdq_u8(b, (dk)[(nr) - 1]), (dk)[nr]); \
+} while (0)
+
+#define AES_ENC4(b0, b1, b2, b3, rk, nr) do { int _i; aes_block _k; \
+	for (_i = 0; _i < (nr) - 1; _i++) { _k = (rk)[_i]; \
+		b0 = vaesmcq_u8(vaeseq_u8(b0, _k)); b1 = vaesmcq_u8(vaeseq_u8(b1, _k)); \
+		b2 = vaesmcq_u8(vaeseq_u8(b2, _k)); b3 = vaesmcq_u8(vaeseq_u8(b3, _k)); } \
+	_k = (rk)[(nr) - 1]; \
+	b0 = vaeseq_u8(b0, _k); b1 = vaeseq_u8(b1, _k); \
+	b2 = vaeseq_u8(b2, _k); b3 = vaeseq_u8(b3, _k); \
+	_k = (rk)[nr]; \
+	b0 = veorq_u8(b0, _k); b1 = veorq_u8(b1, _k); \
+	b2 = veorq_u8(b2, _k); b3 = veorq_u8(b3, _k); \
+} while (0)
+
+#define AES_DEC4(b0, b1, b2, b3, dk, nr) do { int _i; aes_block _k; \
+	for (_i = 0; _i < (nr) - 1; _i++) { _k = (dk)[_i]; \
+		b0 = vaesimcq_u8(vaesdq_u8(b0, _k)); b1 = vaesimcq_u8(vaesdq_u8(b1, _k)); \
+		b2 = vaesimcq_u8(vaesdq_u8(b2, _k)); b3 = vaesimcq_u8(vaesdq_u8(b3, _k)); } \
+	_k = (dk)[(nr) - 1]; \
+	b0 = vaesdq_u8(b0, _k); b1 = vaesdq_u8(b1, _k); \
+	b2 = vaesdq_u8(b2, _k); b3 = vaesdq_u8(b3, _k); \
+	_k = (dk)[nr]; \
+	b0 = veorq_u8(b0, _k); b1 = veorq_u8(b1, _k); \
+	b2 = veorq_u8(b2, _k); b3 = veorq_u8(b3, _k); \
+} while (0)
+
+/* XTS tweak multiplication by x in GF(2^128), little endian */
+static aes_block aes_xts_mul_x(aes_block t)
+{
+	const int32x4_t poly = { 0x87, 1, 1, 1 };
+	int32x4_t v = vreinterpretq_s32_u8(t);
+	int32x4_t carry = vandq_s32(vextq_s32(vshrq_n_s32(v, 31), vshrq_n_s32(v, 31), 3), poly);
+
+	return vreinterpretq_u8_s32(veorq_s32(vshlq_n_s32(v, 1), carry));
+}
+#endif
+
+#if defined(AES_NATIVE_X86) || defined(AES_NATIVE_ARMV8)
+
+#define AES_BLOCK_SIZE	16
+#define AES_MAX_ROUNDS	14
+
+enum aes_mode { AES_ECB, AES_CBC, AES_CTR, AES_XTS };
+
+struct crypt_aes_native {
+	aes_block rk[AES_MAX_ROUNDS + 1];	/* encryption round keys */
+	aes_block dk[AES_MAX_ROUNDS + 1];	/* decryption round keys */
+	aes_block tk[AES_MAX_ROUNDS + 1];	/* XTS tweak round keys */
+	int nr;
+	enum aes_mode mode;
+};
+
+static int aes_key_rounds(size_t key_length)
+{
+	switch (key_length) {
+	case 16: return 10;
+	case 24: return 12;
+	case 32: return 14;
+	}
+	return -EINVAL;
+}
+
+/* FIPS-197 key expansion, words are in memory (little endian) byte order */
+static void aes_expand_key(aes_block *rk, aes_block *dk, const void *key, size_t key_length)
+{
+	static const uint8_t rcon[10] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36 };
+	uint32_t w[4 * (AES_MAX_ROUNDS + 1)], t;
+	int i, nk = key_length / 4, nr = nk + 6;
+
+	memcpy(w, key, key_length);
+	for (i = nk; i < 4 * (nr + 1); i++) {
+		t = w[i - 1];
+		if (i % nk == 0)
+			t = aes_sub_word((t >> 8) | (t << 24)) ^ rcon[i / nk - 1];
+		else if (nk > 6 && i % nk == 4)
+			t = aes_sub_word(t);
+		w[i] = w[i - nk] ^ t;
+	}
+
+	for (i = 0; i <= nr; i++)
+		rk[i] = aes_load(&w[4 * i]);
+
+	/* Equivalent inverse cipher schedule */
+	if (dk) {
+		dk[0] = rk[nr];
+		for (i = 1; i < nr; i++)
+			dk[i] = aes_imc(rk[nr - i]);
+		dk[nr] = rk[0];
+	}
+
+	crypt_backend_memzero(w, sizeof(w));
+}
+
+static int aes_native_setkey(struct crypt_aes_native *ctx, const void *key, size_t key_length)
+{
+	int nr;
+
+	if (ctx->mode == AES_XTS) {
+		if (key_length % 2)
+			return -EINVAL;
+		key_length /= 2;
+	}
+
+	nr = aes_key_rounds(key_length);
+	if (nr < 0)
+		return nr;
+
+	ctx->nr = nr;
+	aes_expand_key(ctx->rk, ctx->mode == AES_CTR ? NULL : ctx->dk, key, key_length);
+	if (ctx->mode == AES_XTS)
+		aes_expand_key(ctx->tk, NULL, (const char *)key + key_length, key_length);
+
+	return 0;
+}
+
+static void aes_ecb(const struct crypt_aes_native *ctx, const char *in, char *out,
+		    size_t blocks, int encrypt)
+{
+	aes_block b0, b1, b2, b3;
+	int nr = ctx->nr;
+
+	for (; blocks >= 4; blocks -= 4, in += 4 * AES_BLOCK_SIZE, out += 4 * AES_BLOCK_SIZE) {
+		b0 = aes_load(in);
+		b1 = aes_load(in + AES_BLOCK_SIZE);
+		b2 = aes_load(in + 2 * AES_BLOCK_SIZE);
+		b3 = aes_load(in + 3 * AES_BLOCK_SIZE);
+		if (encrypt)
+			AES_ENC4(b0, b1, b2, b3, ctx->rk, nr);
+		else
+			AES_DEC4(b0, b1, b2, b3, ctx->dk, nr);
+		aes_store(out, b0);
+		aes_store(out + AES_BLOCK_SIZE, b1);
+		aes_store(out + 2 * AES_BLOCK_SIZE, b2);
+		aes_store(out + 3 * AES_BLOCK_SIZE, b3);
+	}
+
+	for (; blocks; blocks--, in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE) {
+		b0 = aes_load(in);
+		if (encrypt)
+			AES_ENC(b0, ctx->rk, nr);
+		else
+			AES_DEC(b0, ctx->dk, nr);
+		aes_store(out, b0);
+	}
+}
+
+/* CBC encryption is serial, decryption runs 4 blocks in parallel */
+static void aes_cbc(const struct crypt_aes_native *ctx, const char *in, char *out,
+		    size_t blocks, const char *iv, int encrypt)
+{
+	aes_block b0, b1, b2, b3, c0, c1, c2, c3, prev = aes_load(iv);
+	int nr = ctx->nr;
+
+	if (encrypt) {
+		for (; blocks; blocks--, in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE) {
+			b0 = aes_xor(aes_load(in), prev);
+			AES_ENC(b0, ctx->rk, nr);
+			aes_store(out, b0);
+			prev = b0;
+		}
+		return;
+	}
+
+	for (; blocks >= 4; blocks -= 4, in += 4 * AES_BLOCK_SIZE, out += 4 * AES_BLOCK_SIZE) {
+		c0 = b0 = aes_load(in);
+		c1 = b1 = aes_load(in + AES_BLOCK_SIZE);
+		c2 = b2 = aes_load(in + 2 * AES_BLOCK_SIZE);
+		c3 = b3 = aes_load(in + 3 * AES_BLOCK_SIZE);
+		AES_DEC4(b0, b1, b2, b3, ctx->dk, nr);
+		aes_store(out, aes_xor(b0, prev));
+		aes_store(out + AES_BLOCK_SIZE, aes_xor(b1, c0));
+		aes_store(out + 2 * AES_BLOCK_SIZE, aes_xor(b2, c1));
+		aes_store(out + 3 * AES_BLOCK_SIZE, aes_xor(b3, c2));
+		prev = c3;
+	}
+
+	for (; blocks; blocks--, in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE) {
+		c0 = b0 = aes_load(in);
+		AES_DEC(b0, ctx->dk, nr);
+		aes_store(out, aes_xor(b0, prev));
+		prev = c0;
+	}
+}
+
+/* 128-bit big endian counter increment (as the kernel ctr template) */
+static void aes_ctr_inc(uint8_t *ctr)
+{
+	unsigned int i, c = 1;
+
+	for (i = AES_BLOCK_SIZE; i > 0; i--) {
+		c += ctr[i - 1];
+		ctr[i - 1] = (uint8_t)c;
+		c >>= 8;
+	}
+}
+
+static void aes_ctr(const struct crypt_aes_native *ctx, const char *in, char *out,
+		    size_t length, const char *iv)
+{
+	uint8_t ctr[4][AES_BLOCK_SIZE], tail[AES_BLOCK_SIZE];
+	aes_block b0, b1, b2, b3;
+	int i, nr = ctx->nr;
+
+	memcpy(ctr[0], iv, AES_BLOCK_SIZE);
+
+	for (; length >= 4 * AES_BLOCK_SIZE; length -= 4 * AES_BLOCK_SIZE,
+	     in += 4 * AES_BLOCK_SIZE, out += 4 * AES_BLOCK_SIZE) {
+		for (i = 1; i < 4; i++) {
+			memcpy(ctr[i], ctr[i - 1], AES_BLOCK_SIZE);
+			aes_ctr_inc(ctr[i]);
+		}
+		b0 = aes_load(ctr[0]); b1 = aes_load(ctr[1]);
+		b2 = aes_load(ctr[2]); b3 = aes_load(ctr[3]);
+		AES_ENC4(b0, b1, b2, b3, ctx->rk, nr);
+		aes_store(out, aes_xor(b0, aes_load(in)));
+		aes_store(out + AES_BLOCK_SIZE, aes_xor(b1, aes_load(in + AES_BLOCK_SIZE)));
+		aes_store(out + 2 * AES_BLOCK_SIZE, aes_xor(b2, aes_load(in + 2 * AES_BLOCK_SIZE)));
+		aes_store(out + 3 * AES_BLOCK_SIZE, aes_xor(b3, aes_load(in + 3 * AES_BLOCK_SIZE)));
+		memcpy(ctr[0], ctr[3], AES_BLOCK_SIZE);
+		aes_ctr_inc(ctr[0]);
+	}
+
+	for (; length; in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE) {
+		b0 = aes_load(ctr[0]);
+		AES_ENC(b0, ctx->rk, nr);
+		aes_ctr_inc(ctr[0]);
+		if (length < AES_BLOCK_SIZE) {
+			memset(tail, 0, sizeof(tail));
+			memcpy(tail, in, length);
+			aes_store(tail, aes_xor(b0, aes_load(tail)));
+			memcpy(out, tail, length);
+			crypt_backend_memzero(tail, sizeof(tail));
+			break;
+		}
+		aes_store(out, aes_xor(b0, aes_load(in)));
+		length -= AES_BLOCK_SIZE;
+	}
+
+	crypt_backend_memzero(ctr, sizeof(ctr));
+}
+
+/* XTS without ciphertext stealing, whole buffer uses one tweak (IV) */
+static void aes_xts(const struct crypt_aes_native *ctx, const char *in, char *out,
+		    size_t blocks, const char *iv, int encrypt)
+{
+	aes_block b0, b1, b2, b3, t0, t1, t2, t3, t = aes_load(iv);
+	int nr = ctx->nr;
+
+	AES_ENC(t, ctx->tk, nr);
+
+	for (; blocks >= 4; blocks -= 4, in += 4 * AES_BLOCK_SIZE, out += 4 * AES_BLOCK_SIZE) {
+		t0 = t;
+		t1 = aes_xts_mul_x(t0);
+		t2 = aes_xts_mul_x(t1);
+		t3 = aes_xts_mul_x(t2);
+		t = aes_xts_mul_x(t3);
+		b0 = aes_xor(aes_load(in), t0);
+		b1 = aes_xor(aes_load(in + AES_BLOCK_SIZE), t1);
+		b2 = aes_xor(aes_load(in + 2 * AES_BLOCK_SIZE), t2);
+		b3 = aes_xor(aes_load(in + 3 * AES_BLOCK_SIZE), t3);
+		if (encrypt)
+			AES_ENC4(b0, b1, b2, b3, ctx->rk, nr);
+		else
+			AES_DEC4(b0, b1, b2, b3, ctx->dk, nr);
+		aes_store(out, aes_xor(b0, t0));
+		aes_store(out + AES_BLOCK_SIZE, aes_xor(b1, t1));
+		aes_store(out + 2 * AES_BLOCK_SIZE, aes_xor(b2, t2));
+		aes_store(out + 3 * AES_BLOCK_SIZE, aes_xor(b3, t3));
+	}
+
+	for (; blocks; blocks--, in += AES_BLOCK_SIZE, out += AES_BLOCK_SIZE) {
+		b0 = aes_xor(aes_load(in), t);
+		if (encrypt)
+			AES_ENC(b0, ctx->rk, nr);
+		else
+			AES_DEC(b0, ctx->dk, nr);
+		aes_store(out, aes_xor(b0, t));
+		t = aes_xts_mul_x(t);
+	}
+}
+
+/*
+ * ENOTSUP - CPU instructions not available or mode not implemented
+ * (caller should use other implementation)
+ */
+int crypt_aes_native_init(struct crypt_aes_native **ctx, const char *mode,
+			  const void *key, size_t key_length)
+{
+	struct crypt_aes_native *h;
+	enum aes_mode m;
+	void *p;
+	int r;
+
+	if (!strcmp(mode, "ecb"))
+		m = AES_ECB;
+	else if (!strcmp(mode, "cbc"))
+		m = AES_CBC;
+	else if (!strcmp(mode, "ctr"))
+		m = AES_CTR;
+	else if (!strcmp(mode, "xts"))
+		m = AES_XTS;
+	else
+		return -ENOTSUP;
+
+	if (!aes_native_supported())
+		return -ENOTSUP;
+
+	if (posix_memalign(&p, AES_BLOCK_SIZE, sizeof(*h)))
+		return -ENOMEM;
+	h = p;
+	memset(h, 0, sizeof(*h));
+	h->mode = m;
+
+	r = aes_native_setkey(h, key, key_length);
+	if (r < 0) {
+		crypt_aes_native_destroy(h);
+		return r;
+	}
+
+	*ctx = h;
+	return 0;
+}
+
+int crypt_aes_native_setkey(struct crypt_aes_native *ctx, const void *key, size_t key_length)
+{
+	return aes_native_setkey(ctx, key, key_length);
+}
+
+int crypt_aes_native_crypt(struct crypt_aes_native *ctx, const char *in, char *out,
+			   size_t length, const char *iv, size_t iv_length, int encrypt)
+{
+	if (!in || !out || !length)
+		return -EINVAL;
+
+	if (ctx->mode == AES_ECB) {
+		if (iv_length)
+			return -EINVAL;
+	} else if (!iv || iv_length != AES_BLOCK_SIZE)
+		return -EINVAL;
+
+	if (ctx->mode != AES_CTR && length % AES_BLOCK_SIZE)
+		return -EINVAL;
+
+	switch (ctx->mode) {
+	case AES_ECB:
+		aes_ecb(ctx, in, out, length / AES_BLOCK_SIZE, encrypt);
+		break;
+	case AES_CBC:
+		aes_cbc(ctx, in, out, length / AES_BLOCK_SIZE, iv, encrypt);
+		break;
+	case AES_CTR:
+		aes_ctr(ctx, in, out, length, iv);
+		break;
+	case AES_XTS:
+		aes_xts(ctx, in, out, length / AES_BLOCK_SIZE, iv, encrypt);
+		break;
+	}
+
+	return 0;
+}
+
+void crypt_aes_native_destroy(struct crypt_aes_native *ctx)
+{
+	if (!ctx)
+		return;
+
+	crypt_backend_memzero(ctx, sizeof(*ctx));
+	free(ctx);
+}
+#endif /* AES_NATIVE_X86 || AES_NATIVE_ARMV8 */
@@ -39,6 +39,15 @@
  */
 
 #include <stdio.h>
+#include <endian.h>
+#include <pthread.h>
+#if defined(__aarch64__) && defined(__GNUC__)
+#include <sys/auxv.h>
+#include <arm_acle.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
 
 #include "crypto_backend.h"
 
@@ -98,19 +107,119 @@ static const uint32_t crc32_tab[] = {
 	0x2d02ef8dL
 };
 
+/* Slice-by-8 tables, crc32_slice[0] is crc32_tab */
+static uint32_t crc32_slice[8][256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc32_fn)(uint32_t crc, const unsigned char *p, size_t len);
+
+static uint32_t crc32_bytes(uint32_t crc, const unsigned char *p, size_t len)
+{
+	while (len--)
+		crc = crc32_tab[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+static uint32_t crc32_slice8(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint32_t lo, hi;
+
+	/* Align for the 32-bit loads */
+	for (; len && ((uintptr_t)p & 3); len--)
+		crc = crc32_tab[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+	for (; len >= 8; len -= 8, p += 8) {
+		lo = *(const uint32_t *)(const void *)p ^ crc;
+		hi = *(const uint32_t *)(const void *)(p + 4);
+		crc = crc32_slice[7][lo & 0xff] ^
+		      crc32_slice[6][(lo >> 8) & 0xff] ^
+		      crc32_slice[5][(lo >> 16) & 0xff] ^
+		      crc32_slice[4][lo >> 24] ^
+		      crc32_slice[3][hi & 0xff] ^
+		      crc32_slice[2][(hi >> 8) & 0xff] ^
+		      crc32_slice[1][(hi >> 16) & 0xff] ^
+		      crc32_slice[0][hi >> 24];
+	}
+
+	return crc32_bytes(crc, p, len);
+}
+#endif
+
+#if defined(__aarch64__) && defined(__GNUC__)
+/* ARMv8 CRC32 instructions use the same (reflected) polynomial */
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8(uint32_t crc, const unsigned char *p, size_t len)
+{
+	for (; len && ((uintptr_t)p & 7); len--)
+		crc = __crc32b(crc, *p++);
+
+	for (; len >= 8; len -= 8, p += 8)
+		crc = __crc32d(crc, *(const uint64_t *)(const void *)p);
+
+	for (; len; len--)
+		crc = __crc32b(crc, *p++);
+
+	return crc;
+}
+#endif
+
+static void crc32_init(void)
+{
+	unsigned i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc32_slice[0][i] = crc32_tab[i];
+		for (k = 1; k < 8; k++)
+			crc32_slice[k][i] = (crc32_slice[k - 1][i] >> 8) ^
+					    crc32_tab[crc32_slice[k - 1][i] & 0xff];
+	}
+
+	crc32_fn = crc32_bytes;
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	crc32_fn = crc32_slice8;
+#endif
+#if defined(__aarch64__) && defined(__GNUC__)
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+		crc32_fn = crc32_armv8;
+#endif
+}
+
 /*
  * This a generic crc32() function, it takes seed as an argument,
  * and does __not__ xor at the end. Then individual users can do
  * whatever they need.
  */
 uint32_t crypt_crc32(uint32_t seed, const unsigned char *buf, size_t len)
+{
+	/* Short buffers are not worth the dispatch */
+	if (len < 16)
+		return crc32_bytes(seed, buf, len);
+
+	pthread_once(&crc32_once, crc32_init);
+	return crc32_fn(seed, buf, len);
+}
+
+/*
+ * Running CRC of every prefix of buf added (big-endian) into a circular
+ * pool (pool_len multiple of 4), as used by TrueCrypt keyfile pooling.
+ * Returns the final CRC.
+ */
+uint32_t crypt_crc32_pool(uint32_t seed, const unsigned char *buf, size_t len,
+			  unsigned char *pool, size_t pool_len)
 {
 	uint32_t crc = seed;
-	const unsigned char *p = buf;
+	size_t j = 0;
 
-	while(len-- > 0)
-		crc = crc32_tab[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	while (len--) {
+		crc = crc32_tab[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+		pool[j++] += (unsigned char)(crc >> 24);
+		pool[j++] += (unsigned char)(crc >> 16);
+		pool[j++] += (unsigned char)(crc >>  8);
+		pool[j++] += (unsigned char)(crc);
+		if (j >= pool_len)
+			j = 0;
+	}
 
 	return crc;
 }
-
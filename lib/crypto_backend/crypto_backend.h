@@ -42,6 +42,9 @@ const char *crypt_backend_version(void);
 /* HASH */
 int crypt_hash_size(const char *name);
 int crypt_hash_init(struct crypt_hash **ctx, const char *name);
+int crypt_hash_copy(struct crypt_hash **dst, struct crypt_hash *src);
+int crypt_hash_reset(struct crypt_hash *ctx);
+int crypt_hash_restore(struct crypt_hash *ctx, struct crypt_hash *src);
 int crypt_hash_write(struct crypt_hash *ctx, const char *buffer, size_t length);
 int crypt_hash_final(struct crypt_hash *ctx, char *buffer, size_t length);
 void crypt_hash_destroy(struct crypt_hash *ctx);
@@ -87,6 +90,13 @@ int pkcs5_pbkdf2(const char *hash,
 		 unsigned int c,
 		 unsigned int dkLen, char *DK,
 		 unsigned int hash_block_size);
+int pkcs5_pbkdf2_blocks(unsigned int l, unsigned int unit,
+			int (*fn)(void *arg, unsigned int i, unsigned int n),
+			void *arg);
+int pkcs5_pbkdf2_sha(const char *hash,
+		     const char *P, size_t Plen,
+		     const char *S, size_t Slen,
+		     unsigned int c, unsigned int dkLen, char *DK);
 #endif
 
 /* Argon2 implementation wrapper */
@@ -95,8 +105,27 @@ int argon2(const char *type, const char *password, size_t password_length,
 	   char *key, size_t key_length,
 	   uint32_t iterations, uint32_t memory, uint32_t parallel);
 
+/* Keep Argon2 memory mapped for reuse until the last pool user is gone */
+void crypt_argon2_pool_get(void);
+void crypt_argon2_pool_put(void);
+
+/* Argon2 NUMA placement: node number or one of */
+#define CRYPT_ARGON2_NUMA_AUTO	-1	/* node of the calling CPU */
+#define CRYPT_ARGON2_NUMA_NONE	-2	/* no placement */
+void crypt_argon2_set_numa_node(int node);
+
+/* Run Argon2 in pre-forked helper processes (count 0 means in-process) */
+int crypt_argon2_helpers_start(unsigned count, uint32_t memory_kb);
+void crypt_argon2_helpers_stop(void);
+
+/* Memory budget of concurrent Argon2 runs (0 = half of physical memory),
+ * shared with other processes if path of semaphore key file is set */
+int crypt_argon2_set_budget(uint64_t budget_kb, const char *shared_path);
+
 /* CRC32 */
 uint32_t crypt_crc32(uint32_t seed, const unsigned char *buf, size_t len);
+uint32_t crypt_crc32_pool(uint32_t seed, const unsigned char *buf, size_t len,
+			  unsigned char *pool, size_t pool_len);
 
 /* ciphers */
 int crypt_cipher_blocksize(const char *name);
@@ -104,6 +133,7 @@ int crypt_cipher_wrapped_key(const char *name);
 int crypt_cipher_init(struct crypt_cipher **ctx, const char *name,
 		    const char *mode, const void *key, size_t key_length);
 void crypt_cipher_destroy(struct crypt_cipher *ctx);
+int crypt_cipher_setkey(struct crypt_cipher *ctx, const void *key, size_t key_length);
 int crypt_cipher_encrypt(struct crypt_cipher *ctx,
 			 const char *in, char *out, size_t length,
 			 const char *iv, size_t iv_length);
@@ -111,10 +141,25 @@ int crypt_cipher_decrypt(struct crypt_cipher *ctx,
 			 const char *in, char *out, size_t length,
 			 const char *iv, size_t iv_length);
 
+/* built-in AES (CPU instructions), used by crypt_cipher_* for aes if available */
+#if defined(AES_NATIVE_X86) || defined(AES_NATIVE_ARMV8)
+#define AES_NATIVE 1
+struct crypt_aes_native;
+int crypt_aes_native_init(struct crypt_aes_native **ctx, const char *mode,
+			  const void *key, size_t key_length);
+int crypt_aes_native_setkey(struct crypt_aes_native *ctx, const void *key, size_t key_length);
+int crypt_aes_native_crypt(struct crypt_aes_native *ctx, const char *in, char *out,
+			   size_t length, const char *iv, size_t iv_length, int encrypt);
+void crypt_aes_native_destroy(struct crypt_aes_native *ctx);
+#endif
+
 /* storage encryption wrappers */
 int crypt_storage_init(struct crypt_storage **ctx, uint64_t sector_start,
 		       const char *cipher, const char *cipher_mode,
 		       const void *key, size_t key_length);
+int crypt_storage_init_sector(struct crypt_storage **ctx, uint64_t sector_start,
+		       size_t sector_size, const char *cipher, const char *cipher_mode,
+		       const void *key, size_t key_length);
 void crypt_storage_destroy(struct crypt_storage *ctx);
 int crypt_storage_decrypt(struct crypt_storage *ctx, uint64_t sector,
 			  size_t count, char *buffer);
@@ -24,8 +24,10 @@
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include "crypto_backend.h"
 
 #ifdef ENABLE_AF_ALG
@@ -39,9 +41,33 @@
 #define SOL_ALG 279
 #endif
 
+/* Largest IV the cached control message can carry */
+#define CIPHER_IV_MAX 64
+
+/*
+ * Inputs of at least this size that are page aligned are spliced into
+ * the op socket instead of being copied by sendmsg.
+ */
+#define CIPHER_SPLICE_MIN (16 * 1024)
+
 struct crypt_cipher {
+#if AES_NATIVE
+	struct crypt_aes_native *aes;	/* if set, no AF_ALG socket is used */
+#endif
 	int tfmfd;
 	int opfd;
+	int pipefd[2];
+	int null_cipher;
+	int splice;		/* 1 usable, 0 not tried yet, -1 unsupported */
+	size_t splice_max;	/* op socket send buffer limit */
+	size_t page_size;
+
+	/* Control message is rebuilt only if direction or IV length changes */
+	uint32_t msg_direction;
+	size_t msg_iv_length;
+	size_t msg_length;
+	char msg[CMSG_SPACE(sizeof(uint32_t)) +
+		 CMSG_SPACE(sizeof(struct af_alg_iv) + CIPHER_IV_MAX)];
 };
 
 /*
@@ -59,6 +85,9 @@ int crypt_cipher_init(struct crypt_cipher **ctx, const char *name,
 		.salg_family = AF_ALG,
 		.salg_type = "skcipher",
 	};
+#if AES_NATIVE
+	int r;
+#endif
 
 	h = malloc(sizeof(*h));
 	if (!h)
@@ -67,7 +96,22 @@ int crypt_cipher_init(struct crypt_cipher **ctx, const char *name,
 	snprintf((char *)sa.salg_name, sizeof(sa.salg_name),
 		 "%s(%s)", mode, name);
 
-	h->opfd = -1;
+	memset(h, 0, sizeof(*h));
+	h->tfmfd = h->opfd = -1;
+	h->pipefd[0] = h->pipefd[1] = -1;
+#if AES_NATIVE
+	if (!strcmp(name, "aes")) {
+		r = crypt_aes_native_init(&h->aes, mode, key, key_length);
+		if (r != -ENOTSUP) {
+			if (r < 0)
+				free(h);
+			else
+				*ctx = h;
+			return r;
+		}
+	}
+#endif
+	h->page_size = (size_t)sysconf(_SC_PAGESIZE);
 	h->tfmfd = socket(AF_ALG, SOCK_SEQPACKET, 0);
 	if (h->tfmfd < 0) {
 		crypt_cipher_destroy(h);
@@ -79,8 +123,10 @@ int crypt_cipher_init(struct crypt_cipher **ctx, const char *name,
 		return -ENOENT;
 	}
 
-	if (!strcmp(name, "cipher_null"))
+	if (!strcmp(name, "cipher_null")) {
+		h->null_cipher = 1;
 		key_length = 0;
+	}
 
 	if (setsockopt(h->tfmfd, SOL_ALG, ALG_SET_KEY, key, key_length) < 0) {
 		crypt_cipher_destroy(h);
@@ -97,7 +143,110 @@ int crypt_cipher_init(struct crypt_cipher **ctx, const char *name,
 	return 0;
 }
 
-/* The in/out should be aligned to page boundary */
+static void *cipher_msg_build(struct crypt_cipher *ctx, uint32_t direction,
+			      size_t iv_length)
+{
+	struct msghdr msg = {
+		.msg_control = ctx->msg,
+		.msg_controllen = sizeof(ctx->msg),
+	};
+	struct af_alg_iv *alg_iv;
+	struct cmsghdr *header;
+
+	if (ctx->msg_length && ctx->msg_direction == direction &&
+	    ctx->msg_iv_length == iv_length)
+		goto out;
+
+	memset(ctx->msg, 0, sizeof(ctx->msg));
+	ctx->msg_length = CMSG_SPACE(sizeof(uint32_t)) +
+		(iv_length ? CMSG_SPACE(sizeof(*alg_iv) + iv_length) : 0);
+	msg.msg_controllen = ctx->msg_length;
+
+	/* Set encrypt/decrypt operation */
+	header = CMSG_FIRSTHDR(&msg);
+	header->cmsg_level = SOL_ALG;
+	header->cmsg_type = ALG_SET_OP;
+	header->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+	*(uint32_t *)(void *)CMSG_DATA(header) = direction;
+
+	/* Set IV header, the IV itself is filled for every call */
+	if (iv_length) {
+		header = CMSG_NXTHDR(&msg, header);
+		header->cmsg_level = SOL_ALG;
+		header->cmsg_type = ALG_SET_IV;
+		header->cmsg_len = CMSG_LEN(sizeof(*alg_iv) + iv_length);
+		alg_iv = (void*)CMSG_DATA(header);
+		alg_iv->ivlen = iv_length;
+	}
+
+	ctx->msg_direction = direction;
+	ctx->msg_iv_length = iv_length;
+out:
+	if (!iv_length)
+		return NULL;
+
+	msg.msg_controllen = ctx->msg_length;
+	header = CMSG_NXTHDR(&msg, CMSG_FIRSTHDR(&msg));
+	return ((struct af_alg_iv *)(void *)CMSG_DATA(header))->iv;
+}
+
+static int cipher_splice_init(struct crypt_cipher *ctx)
+{
+	int sndbuf;
+	socklen_t optlen = sizeof(sndbuf);
+
+	if (ctx->splice)
+		return ctx->splice > 0 ? 0 : -ENOTSUP;
+
+	ctx->splice = -1;
+
+	if (getsockopt(ctx->opfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &optlen) < 0 ||
+	    sndbuf < (int)ctx->page_size)
+		return -ENOTSUP;
+
+	if (pipe2(ctx->pipefd, O_CLOEXEC) < 0) {
+		ctx->pipefd[0] = ctx->pipefd[1] = -1;
+		return -ENOTSUP;
+	}
+
+	ctx->splice_max = (size_t)sndbuf & ~(ctx->page_size - 1);
+	ctx->splice = 1;
+	return 0;
+}
+
+/*
+ * Map user pages of the whole input into the op socket through the pipe,
+ * all chunks but the last with SPLICE_F_MORE so the kernel sees a single
+ * request (and chains IV over the whole buffer as sendmsg would).
+ * Returns -ENOTSUP if nothing was queued and copy path can be used instead.
+ */
+static int cipher_splice_in(struct crypt_cipher *ctx, const char *in, size_t length)
+{
+	struct iovec iov;
+	ssize_t len, spliced;
+	size_t done = 0;
+
+	while (done < length) {
+		iov.iov_base = (void*)(uintptr_t)(in + done);
+		iov.iov_len = length - done;
+
+		len = vmsplice(ctx->pipefd[1], &iov, 1, 0);
+		if (len <= 0)
+			return done ? -EIO : -ENOTSUP;
+
+		while (len) {
+			spliced = splice(ctx->pipefd[0], NULL, ctx->opfd, NULL, len,
+				(done + len < length) ? SPLICE_F_MORE : 0);
+			if (spliced <= 0)
+				return -EIO;
+			len -= spliced;
+			done += spliced;
+		}
+	}
+
+	return 0;
+}
+
 static int crypt_cipher_crypt(struct crypt_cipher *ctx,
 			 const char *in, char *out, size_t length,
 			 const char *iv, size_t iv_length,
@@ -105,63 +254,64 @@ static int crypt_cipher_crypt(struct crypt_cipher *ctx,
 {
 	int r = 0;
 	ssize_t len;
-	struct af_alg_iv *alg_iv;
-	struct cmsghdr *header;
-	uint32_t *type;
+	char *msg_iv;
 	struct iovec iov = {
 		.iov_base = (void*)(uintptr_t)in,
 		.iov_len = length,
 	};
-	int iv_msg_size = iv ? CMSG_SPACE(sizeof(*alg_iv) + iv_length) : 0;
-	char buffer[CMSG_SPACE(sizeof(*type)) + iv_msg_size];
 	struct msghdr msg = {
-		.msg_control = buffer,
-		.msg_controllen = sizeof(buffer),
+		.msg_control = ctx->msg,
 		.msg_iov = &iov,
 		.msg_iovlen = 1,
 	};
 
+#if AES_NATIVE
+	if (ctx->aes)
+		return crypt_aes_native_crypt(ctx->aes, in, out, length, iv, iv_length,
+					      direction == ALG_OP_ENCRYPT);
+#endif
 	if (!in || !out || !length)
 		return -EINVAL;
 
-	if ((!iv && iv_length) || (iv && !iv_length))
+	if ((!iv && iv_length) || (iv && !iv_length) || iv_length > CIPHER_IV_MAX)
 		return -EINVAL;
 
-	memset(buffer, 0, sizeof(buffer));
+	msg_iv = cipher_msg_build(ctx, direction, iv_length);
+	if (msg_iv)
+		memcpy(msg_iv, iv, iv_length);
+	msg.msg_controllen = ctx->msg_length;
 
-	/* Set encrypt/decrypt operation */
-	header = CMSG_FIRSTHDR(&msg);
-	if (!header)
-		return -EINVAL;
-
-	header->cmsg_level = SOL_ALG;
-	header->cmsg_type = ALG_SET_OP;
-	header->cmsg_len = CMSG_LEN(sizeof(*type));
-	type = (void*)CMSG_DATA(header);
-	*type = direction;
+	if (length >= CIPHER_SPLICE_MIN &&
+	    !((uintptr_t)in & (ctx->page_size - 1)) &&
+	    !(length & (ctx->page_size - 1)) &&
+	    !cipher_splice_init(ctx) && length <= ctx->splice_max) {
+		/* Control message only, data follows through splice */
+		msg.msg_iov = NULL;
+		msg.msg_iovlen = 0;
+		if (sendmsg(ctx->opfd, &msg, MSG_MORE) < 0)
+			return -EIO;
 
-	/* Set IV */
-	if (iv) {
-		header = CMSG_NXTHDR(&msg, header);
-		header->cmsg_level = SOL_ALG;
-		header->cmsg_type = ALG_SET_IV;
-		header->cmsg_len = iv_msg_size;
-		alg_iv = (void*)CMSG_DATA(header);
-		alg_iv->ivlen = iv_length;
-		memcpy(alg_iv->iv, iv, iv_length);
+		r = cipher_splice_in(ctx, in, length);
+		if (r == -ENOTSUP) {
+			/* Queued op without data is overridden by the next sendmsg */
+			ctx->splice = -1;
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			r = 0;
+		} else if (r < 0)
+			return r;
+		else
+			goto out;
 	}
 
 	len = sendmsg(ctx->opfd, &msg, 0);
-	if (len != (ssize_t)length) {
-		r = -EIO;
-		goto bad;
-	}
-
+	if (len != (ssize_t)length)
+		return -EIO;
+out:
 	len = read(ctx->opfd, out, length);
 	if (len != (ssize_t)length)
 		r = -EIO;
-bad:
-	crypt_backend_memzero(buffer, sizeof(buffer));
+
 	return r;
 }
 
@@ -181,16 +331,104 @@ int crypt_cipher_decrypt(struct crypt_cipher *ctx,
 				  iv, iv_length, ALG_OP_DECRYPT);
 }
 
+/*
+ * Replace key of already bound transformation (no new socket and algorithm lookup).
+ * Kernel refuses key change while an op socket exists, so it is accepted again.
+ */
+int crypt_cipher_setkey(struct crypt_cipher *ctx, const void *key, size_t key_length)
+{
+#if AES_NATIVE
+	if (ctx->aes)
+		return crypt_aes_native_setkey(ctx->aes, key, key_length);
+#endif
+	if (ctx->opfd >= 0) {
+		close(ctx->opfd);
+		ctx->opfd = -1;
+	}
+
+	if (ctx->null_cipher)
+		key_length = 0;
+
+	if (setsockopt(ctx->tfmfd, SOL_ALG, ALG_SET_KEY, key, key_length) < 0)
+		return -EINVAL;
+
+	ctx->opfd = accept(ctx->tfmfd, NULL, 0);
+	if (ctx->opfd < 0)
+		return -EINVAL;
+
+	return 0;
+}
+
 void crypt_cipher_destroy(struct crypt_cipher *ctx)
 {
+#if AES_NATIVE
+	crypt_aes_native_destroy(ctx->aes);
+#endif
 	if (ctx->tfmfd >= 0)
 		close(ctx->tfmfd);
 	if (ctx->opfd >= 0)
 		close(ctx->opfd);
-	memset(ctx, 0, sizeof(*ctx));
+	if (ctx->pipefd[0] >= 0)
+		close(ctx->pipefd[0]);
+	if (ctx->pipefd[1] >= 0)
+		close(ctx->pipefd[1]);
+	crypt_backend_memzero(ctx, sizeof(*ctx));
 	free(ctx);
 }
 
+#elif AES_NATIVE /* ENABLE_AF_ALG */
+/* Without AF_ALG only built-in AES is available */
+struct crypt_cipher {
+	struct crypt_aes_native *aes;
+};
+
+int crypt_cipher_init(struct crypt_cipher **ctx, const char *name,
+		    const char *mode, const void *key, size_t key_length)
+{
+	struct crypt_cipher *h;
+	int r;
+
+	if (strcmp(name, "aes"))
+		return -ENOTSUP;
+
+	h = malloc(sizeof(*h));
+	if (!h)
+		return -ENOMEM;
+
+	r = crypt_aes_native_init(&h->aes, mode, key, key_length);
+	if (r < 0) {
+		free(h);
+		return r;
+	}
+
+	*ctx = h;
+	return 0;
+}
+
+void crypt_cipher_destroy(struct crypt_cipher *ctx)
+{
+	crypt_aes_native_destroy(ctx->aes);
+	free(ctx);
+}
+
+int crypt_cipher_setkey(struct crypt_cipher *ctx, const void *key, size_t key_length)
+{
+	return crypt_aes_native_setkey(ctx->aes, key, key_length);
+}
+
+int crypt_cipher_encrypt(struct crypt_cipher *ctx,
+			 const char *in, char *out, size_t length,
+			 const char *iv, size_t iv_length)
+{
+	return crypt_aes_native_crypt(ctx->aes, in, out, length, iv, iv_length, 1);
+}
+
+int crypt_cipher_decrypt(struct crypt_cipher *ctx,
+			 const char *in, char *out, size_t length,
+			 const char *iv, size_t iv_length)
+{
+	return crypt_aes_native_crypt(ctx->aes, in, out, length, iv, iv_length, 0);
+}
 #else /* ENABLE_AF_ALG */
 int crypt_cipher_init(struct crypt_cipher **ctx, const char *name,
 		    const char *mode, const void *buffer, size_t length)
@@ -203,6 +441,11 @@ void crypt_cipher_destroy(struct crypt_cipher *ctx)
 	return;
 }
 
+int crypt_cipher_setkey(struct crypt_cipher *ctx, const void *key, size_t key_length)
+{
+	return -ENOTSUP;
+}
+
 int crypt_cipher_encrypt(struct crypt_cipher *ctx,
 			 const char *in, char *out, size_t length,
 			 const char *iv, size_t iv_length)
@@ -22,10 +22,11 @@
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
-#include <assert.h>
+#include <pthread.h>
 #include <gcrypt.h>
 #include "crypto_backend.h"
 
+static pthread_mutex_t crypto_backend_lock = PTHREAD_MUTEX_INITIALIZER;
 static int crypto_backend_initialised = 0;
 static int crypto_backend_secmem = 1;
 static int crypto_backend_whirlpool_bug = -1;
@@ -83,11 +84,15 @@ static void crypt_hash_test_whirlpool_bug(void)
 
 int crypt_backend_init(struct crypt_device *ctx)
 {
-	if (crypto_backend_initialised)
+	pthread_mutex_lock(&crypto_backend_lock);
+	if (crypto_backend_initialised) {
+		pthread_mutex_unlock(&crypto_backend_lock);
 		return 0;
+	}
 
 	if (!gcry_control (GCRYCTL_INITIALIZATION_FINISHED_P)) {
 		if (!gcry_check_version (GCRYPT_REQ_VERSION)) {
+			pthread_mutex_unlock(&crypto_backend_lock);
 			return -ENOSYS;
 		}
 
@@ -118,9 +123,16 @@ int crypt_backend_init(struct crypt_device *ctx)
 		 crypto_backend_whirlpool_bug > 0 ? ", flawed whirlpool" : ""
 		);
 
+	pthread_mutex_unlock(&crypto_backend_lock);
 	return 0;
 }
 
+/* Backend is initialised on first use if crypt_backend_init() was not called */
+static int crypt_backend_lazy_init(void)
+{
+	return crypto_backend_initialised ? 0 : crypt_backend_init(NULL);
+}
+
 void crypt_backend_destroy(void)
 {
 	if (crypto_backend_initialised)
@@ -161,7 +173,8 @@ int crypt_hash_size(const char *name)
 {
 	int hash_id;
 
-	assert(crypto_backend_initialised);
+	if (crypt_backend_lazy_init())
+		return -ENOSYS;
 
 	hash_id = gcry_md_map_name(crypt_hash_compat_name(name, NULL));
 	if (!hash_id)
@@ -175,7 +188,8 @@ int crypt_hash_init(struct crypt_hash **ctx, const char *name)
 	struct crypt_hash *h;
 	unsigned int flags = 0;
 
-	assert(crypto_backend_initialised);
+	if (crypt_backend_lazy_init())
+		return -ENOSYS;
 
 	h = malloc(sizeof(*h));
 	if (!h)
@@ -202,6 +216,43 @@ static void crypt_hash_restart(struct crypt_hash *ctx)
 	gcry_md_reset(ctx->hd);
 }
 
+int crypt_hash_copy(struct crypt_hash **dst, struct crypt_hash *src)
+{
+	struct crypt_hash *h;
+
+	h = malloc(sizeof(*h));
+	if (!h)
+		return -ENOMEM;
+
+	*h = *src;
+	if (gcry_md_copy(&h->hd, src->hd)) {
+		free(h);
+		return -EINVAL;
+	}
+
+	*dst = h;
+	return 0;
+}
+
+int crypt_hash_reset(struct crypt_hash *ctx)
+{
+	crypt_hash_restart(ctx);
+	return 0;
+}
+
+int crypt_hash_restore(struct crypt_hash *ctx, struct crypt_hash *src)
+{
+	gcry_md_hd_t hd;
+
+	/* gcrypt cannot copy into existing handle */
+	if (gcry_md_copy(&hd, src->hd))
+		return -EINVAL;
+
+	gcry_md_close(ctx->hd);
+	ctx->hd = hd;
+	return 0;
+}
+
 int crypt_hash_write(struct crypt_hash *ctx, const char *buffer, size_t length)
 {
 	gcry_md_write(ctx->hd, buffer, length);
@@ -244,7 +295,8 @@ int crypt_hmac_init(struct crypt_hmac **ctx, const char *name,
 	struct crypt_hmac *h;
 	unsigned int flags = GCRY_MD_FLAG_HMAC;
 
-	assert(crypto_backend_initialised);
+	if (crypt_backend_lazy_init())
+		return -ENOSYS;
 
 	h = malloc(sizeof(*h));
 	if (!h)
@@ -310,6 +362,9 @@ void crypt_hmac_destroy(struct crypt_hmac *ctx)
 /* RNG */
 int crypt_backend_rng(char *buffer, size_t length, int quality, int fips)
 {
+	if (crypt_backend_lazy_init())
+		return -ENOSYS;
+
 	switch(quality) {
 	case CRYPT_RND_NORMAL:
 		gcry_randomize(buffer, length, GCRY_STRONG_RANDOM);
@@ -358,6 +413,9 @@ int crypt_pbkdf(const char *kdf, const char *hash,
 	if (!kdf)
 		return -EINVAL;
 
+	if (crypt_backend_lazy_init())
+		return -ENOSYS;
+
 	if (!strcmp(kdf, "pbkdf2"))
 		return pbkdf2(hash, password, password_length, salt, salt_length,
 			      key, key_length, iterations);
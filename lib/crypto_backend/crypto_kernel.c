@@ -24,6 +24,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/utsname.h>
 #include <linux/if_alg.h>
@@ -56,10 +57,19 @@ static struct hash_alg hash_algs[] = {
 	{ NULL,        NULL,      0,   0 }
 };
 
+/*
+ * Unkeyed hash tfm sockets are shared by all contexts of the process
+ * (one per algorithm), a context only owns its op socket accepted from it.
+ */
+#define HASH_ALGS_COUNT (sizeof(hash_algs) / sizeof(hash_algs[0]) - 1)
+static int hash_tfm[HASH_ALGS_COUNT] = { -1, -1, -1, -1, -1 };
+static pthread_mutex_t hash_tfm_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct crypt_hash {
-	int tfmfd;
+	int tfmfd;	/* shared, not owned */
 	int opfd;
 	int hash_len;
+	int dirty;	/* data written since last final */
 };
 
 struct crypt_hmac {
@@ -128,6 +138,16 @@ int crypt_backend_init(struct crypt_device *ctx)
 
 void crypt_backend_destroy(void)
 {
+	unsigned i;
+
+	pthread_mutex_lock(&hash_tfm_lock);
+	for (i = 0; i < HASH_ALGS_COUNT; i++) {
+		if (hash_tfm[i] >= 0)
+			close(hash_tfm[i]);
+		hash_tfm[i] = -1;
+	}
+	pthread_mutex_unlock(&hash_tfm_lock);
+
 	crypto_backend_initialised = 0;
 }
 
@@ -161,34 +181,111 @@ int crypt_hash_size(const char *name)
 	return ha ? ha->length : -EINVAL;
 }
 
-int crypt_hash_init(struct crypt_hash **ctx, const char *name)
+static int hash_tfm_get(struct hash_alg *ha)
 {
-	struct crypt_hash *h;
-	struct hash_alg *ha;
 	struct sockaddr_alg sa = {
 		.salg_family = AF_ALG,
 		.salg_type = "hash",
 	};
+	unsigned idx = ha - hash_algs;
+	int fd;
+
+	pthread_mutex_lock(&hash_tfm_lock);
+	fd = hash_tfm[idx];
+	if (fd < 0) {
+		strncpy((char *)sa.salg_name, ha->kernel_name, sizeof(sa.salg_name));
+
+		fd = socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		if (fd >= 0 && bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+			close(fd);
+			fd = -1;
+		}
+		hash_tfm[idx] = fd;
+	}
+	pthread_mutex_unlock(&hash_tfm_lock);
+
+	return fd;
+}
+
+int crypt_hash_init(struct crypt_hash **ctx, const char *name)
+{
+	struct crypt_hash *h;
+	struct hash_alg *ha;
+
+	ha = _get_alg(name);
+	if (!ha)
+		return -EINVAL;
 
 	h = malloc(sizeof(*h));
 	if (!h)
 		return -ENOMEM;
 
-	ha = _get_alg(name);
-	if (!ha) {
+	h->hash_len = ha->length;
+	h->dirty = 0;
+	h->tfmfd = hash_tfm_get(ha);
+	h->opfd = h->tfmfd < 0 ? -1 : accept4(h->tfmfd, NULL, 0, SOCK_CLOEXEC);
+	if (h->opfd < 0) {
 		free(h);
 		return -EINVAL;
 	}
-	h->hash_len = ha->length;
 
-	strncpy((char *)sa.salg_name, ha->kernel_name, sizeof(sa.salg_name));
+	*ctx = h;
+	return 0;
+}
 
-	if (crypt_kernel_socket_init(&sa, &h->tfmfd, &h->opfd, NULL, 0) < 0) {
+/*
+ * Accepting on an op socket clones its partial hash state,
+ * accepting on the tfm socket gives a fresh one.
+ */
+int crypt_hash_copy(struct crypt_hash **dst, struct crypt_hash *src)
+{
+	struct crypt_hash *h;
+
+	h = malloc(sizeof(*h));
+	if (!h)
+		return -ENOMEM;
+
+	*h = *src;
+	h->opfd = accept4(src->dirty ? src->opfd : src->tfmfd, NULL, 0, SOCK_CLOEXEC);
+	if (h->opfd < 0) {
 		free(h);
 		return -EINVAL;
 	}
 
-	*ctx = h;
+	*dst = h;
+	return 0;
+}
+
+int crypt_hash_reset(struct crypt_hash *ctx)
+{
+	int fd;
+
+	/* Pending MSG_MORE data cannot be dropped, replace the op socket */
+	if (!ctx->dirty)
+		return 0;
+
+	fd = accept4(ctx->tfmfd, NULL, 0, SOCK_CLOEXEC);
+	if (fd < 0)
+		return -EINVAL;
+
+	close(ctx->opfd);
+	ctx->opfd = fd;
+	ctx->dirty = 0;
+	return 0;
+}
+
+/* Accept on an op socket clones its hash state */
+int crypt_hash_restore(struct crypt_hash *ctx, struct crypt_hash *src)
+{
+	int fd;
+
+	fd = accept4(src->dirty ? src->opfd : src->tfmfd, NULL, 0, SOCK_CLOEXEC);
+	if (fd < 0)
+		return -EINVAL;
+
+	close(ctx->opfd);
+	ctx->opfd = fd;
+	ctx->dirty = src->dirty;
 	return 0;
 }
 
@@ -200,6 +297,7 @@ int crypt_hash_write(struct crypt_hash *ctx, const char *buffer, size_t length)
 	if (r < 0 || (size_t)r < length)
 		return -EIO;
 
+	ctx->dirty = 1;
 	return 0;
 }
 
@@ -211,6 +309,7 @@ int crypt_hash_final(struct crypt_hash *ctx, char *buffer, size_t length)
 		return -EINVAL;
 
 	r = read(ctx->opfd, buffer, length);
+	ctx->dirty = 0;
 	if (r < 0)
 		return -EIO;
 
@@ -219,8 +318,6 @@ int crypt_hash_final(struct crypt_hash *ctx, char *buffer, size_t length)
 
 void crypt_hash_destroy(struct crypt_hash *ctx)
 {
-	if (ctx->tfmfd >= 0)
-		close(ctx->tfmfd);
 	if (ctx->opfd >= 0)
 		close(ctx->opfd);
 	memset(ctx, 0, sizeof(*ctx));
@@ -315,6 +412,7 @@ int crypt_pbkdf(const char *kdf, const char *hash,
 		uint32_t iterations, uint32_t memory, uint32_t parallel)
 {
 	struct hash_alg *ha;
+	int r;
 
 	if (!kdf)
 		return -EINVAL;
@@ -324,6 +422,12 @@ int crypt_pbkdf(const char *kdf, const char *hash,
 		if (!ha)
 			return -EINVAL;
 
+		/* Every HMAC call is a socket round trip, avoid them if possible */
+		r = pkcs5_pbkdf2_sha(hash, password, password_length, salt, salt_length,
+				     iterations, key_length, key);
+		if (r != -ENOTSUP)
+			return r;
+
 		return pkcs5_pbkdf2(hash, password, password_length, salt, salt_length,
 				    iterations, key_length, key, ha->block_length);
 	} else if (!strncmp(kdf, "argon2", 6)) {
@@ -186,6 +186,34 @@ static void crypt_hash_restart(struct crypt_hash *ctx)
 	ctx->hash->init(&ctx->nettle_ctx);
 }
 
+int crypt_hash_copy(struct crypt_hash **dst, struct crypt_hash *src)
+{
+	struct crypt_hash *h;
+
+	h = malloc(sizeof(*h));
+	if (!h)
+		return -ENOMEM;
+
+	memcpy(h, src, sizeof(*h));
+	*dst = h;
+	return 0;
+}
+
+int crypt_hash_reset(struct crypt_hash *ctx)
+{
+	crypt_hash_restart(ctx);
+	return 0;
+}
+
+int crypt_hash_restore(struct crypt_hash *ctx, struct crypt_hash *src)
+{
+	if (ctx->hash != src->hash)
+		return -EINVAL;
+
+	memcpy(&ctx->nettle_ctx, &src->nettle_ctx, sizeof(ctx->nettle_ctx));
+	return 0;
+}
+
 int crypt_hash_write(struct crypt_hash *ctx, const char *buffer, size_t length)
 {
 	ctx->hash->update(&ctx->nettle_ctx, length, (const uint8_t*)buffer);
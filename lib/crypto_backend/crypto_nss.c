@@ -21,12 +21,14 @@
 
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include <nss.h>
 #include <pk11pub.h>
 #include "crypto_backend.h"
 
 #define CONST_CAST(x) (x)(uintptr_t)
 
+static pthread_mutex_t crypto_backend_lock = PTHREAD_MUTEX_INITIALIZER;
 static int crypto_backend_initialised = 0;
 static char version[64];
 
@@ -73,11 +75,16 @@ static struct hash_alg *_get_alg(const char *name)
 
 int crypt_backend_init(struct crypt_device *ctx)
 {
-	if (crypto_backend_initialised)
+	pthread_mutex_lock(&crypto_backend_lock);
+	if (crypto_backend_initialised) {
+		pthread_mutex_unlock(&crypto_backend_lock);
 		return 0;
+	}
 
-	if (NSS_NoDB_Init(".") != SECSuccess)
+	if (NSS_NoDB_Init(".") != SECSuccess) {
+		pthread_mutex_unlock(&crypto_backend_lock);
 		return -EINVAL;
+	}
 
 #if HAVE_DECL_NSS_GETVERSION
 	snprintf(version, 64, "NSS %s", NSS_GetVersion());
@@ -85,9 +92,16 @@ int crypt_backend_init(struct crypt_device *ctx)
 	snprintf(version, 64, "NSS");
 #endif
 	crypto_backend_initialised = 1;
+	pthread_mutex_unlock(&crypto_backend_lock);
 	return 0;
 }
 
+/* Backend is initialised on first use if crypt_backend_init() was not called */
+static int crypt_backend_lazy_init(void)
+{
+	return crypto_backend_initialised ? 0 : crypt_backend_init(NULL);
+}
+
 void crypt_backend_destroy(void)
 {
 	crypto_backend_initialised = 0;
@@ -115,6 +129,9 @@ int crypt_hash_init(struct crypt_hash **ctx, const char *name)
 {
 	struct crypt_hash *h;
 
+	if (crypt_backend_lazy_init())
+		return -ENOSYS;
+
 	h = malloc(sizeof(*h));
 	if (!h)
 		return -ENOMEM;
@@ -149,6 +166,43 @@ static int crypt_hash_restart(struct crypt_hash *ctx)
 	return 0;
 }
 
+int crypt_hash_copy(struct crypt_hash **dst, struct crypt_hash *src)
+{
+	struct crypt_hash *h;
+
+	h = malloc(sizeof(*h));
+	if (!h)
+		return -ENOMEM;
+
+	*h = *src;
+	h->md = PK11_CloneContext(src->md);
+	if (!h->md) {
+		free(h);
+		return -EINVAL;
+	}
+
+	*dst = h;
+	return 0;
+}
+
+int crypt_hash_reset(struct crypt_hash *ctx)
+{
+	return crypt_hash_restart(ctx);
+}
+
+int crypt_hash_restore(struct crypt_hash *ctx, struct crypt_hash *src)
+{
+	PK11Context *md;
+
+	md = PK11_CloneContext(src->md);
+	if (!md)
+		return -EINVAL;
+
+	PK11_DestroyContext(ctx->md, PR_TRUE);
+	ctx->md = md;
+	return 0;
+}
+
 int crypt_hash_write(struct crypt_hash *ctx, const char *buffer, size_t length)
 {
 	if (PK11_DigestOp(ctx->md, CONST_CAST(unsigned char *)buffer, length) != SECSuccess)
@@ -200,6 +254,9 @@ int crypt_hmac_init(struct crypt_hmac **ctx, const char *name,
 	SECItem keyItem;
 	SECItem noParams;
 
+	if (crypt_backend_lazy_init())
+		return -ENOSYS;
+
 	keyItem.type = siBuffer;
 	keyItem.data = CONST_CAST(unsigned char *)key;
 	keyItem.len = (int)key_length;
@@ -299,6 +356,9 @@ int crypt_backend_rng(char *buffer, size_t length, int quality, int fips)
 	if (fips)
 		return -EINVAL;
 
+	if (crypt_backend_lazy_init())
+		return -ENOSYS;
+
 	if (PK11_GenerateRandom((unsigned char *)buffer, length) != SECSuccess)
 		return -EINVAL;
 
@@ -317,6 +377,9 @@ int crypt_pbkdf(const char *kdf, const char *hash,
 	if (!kdf)
 		return -EINVAL;
 
+	if (crypt_backend_lazy_init())
+		return -ENOSYS;
+
 	if (!strcmp(kdf, "pbkdf2")) {
 		ha = _get_alg(hash);
 		if (!ha)
@@ -30,11 +30,13 @@
 
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 #include <openssl/evp.h>
 #include <openssl/hmac.h>
 #include <openssl/rand.h>
 #include "crypto_backend.h"
 
+static pthread_mutex_t crypto_backend_lock = PTHREAD_MUTEX_INITIALIZER;
 static int crypto_backend_initialised = 0;
 
 struct crypt_hash {
@@ -107,15 +109,21 @@ static const char *openssl_backend_version(void)
 
 int crypt_backend_init(struct crypt_device *ctx)
 {
-	if (crypto_backend_initialised)
-		return 0;
-
-	openssl_backend_init();
-
-	crypto_backend_initialised = 1;
+	pthread_mutex_lock(&crypto_backend_lock);
+	if (!crypto_backend_initialised) {
+		openssl_backend_init();
+		crypto_backend_initialised = 1;
+	}
+	pthread_mutex_unlock(&crypto_backend_lock);
 	return 0;
 }
 
+/* Backend is initialised on first use if crypt_backend_init() was not called */
+static int crypt_backend_lazy_init(void)
+{
+	return crypto_backend_initialised ? 0 : crypt_backend_init(NULL);
+}
+
 void crypt_backend_destroy(void)
 {
 	crypto_backend_initialised = 0;
@@ -134,8 +142,12 @@ const char *crypt_backend_version(void)
 /* HASH */
 int crypt_hash_size(const char *name)
 {
-	const EVP_MD *hash_id = EVP_get_digestbyname(name);
+	const EVP_MD *hash_id;
+
+	if (crypt_backend_lazy_init())
+		return -ENOSYS;
 
+	hash_id = EVP_get_digestbyname(name);
 	if (!hash_id)
 		return -EINVAL;
 
@@ -146,6 +158,9 @@ int crypt_hash_init(struct crypt_hash **ctx, const char *name)
 {
 	struct crypt_hash *h;
 
+	if (crypt_backend_lazy_init())
+		return -ENOSYS;
+
 	h = malloc(sizeof(*h));
 	if (!h)
 		return -ENOMEM;
@@ -182,6 +197,45 @@ static int crypt_hash_restart(struct crypt_hash *ctx)
 	return 0;
 }
 
+int crypt_hash_copy(struct crypt_hash **dst, struct crypt_hash *src)
+{
+	struct crypt_hash *h;
+
+	h = malloc(sizeof(*h));
+	if (!h)
+		return -ENOMEM;
+
+	*h = *src;
+	h->md = EVP_MD_CTX_new();
+	if (!h->md) {
+		free(h);
+		return -ENOMEM;
+	}
+
+	if (EVP_MD_CTX_copy_ex(h->md, src->md) != 1) {
+		EVP_MD_CTX_free(h->md);
+		free(h);
+		return -EINVAL;
+	}
+
+	*dst = h;
+	return 0;
+}
+
+int crypt_hash_reset(struct crypt_hash *ctx)
+{
+	return crypt_hash_restart(ctx);
+}
+
+/* Replace state with a copy of src state (the same algorithm), no allocation */
+int crypt_hash_restore(struct crypt_hash *ctx, struct crypt_hash *src)
+{
+	if (EVP_MD_CTX_copy_ex(ctx->md, src->md) != 1)
+		return -EINVAL;
+
+	return 0;
+}
+
 int crypt_hash_write(struct crypt_hash *ctx, const char *buffer, size_t length)
 {
 	if (EVP_DigestUpdate(ctx->md, buffer, length) != 1)
@@ -231,6 +285,9 @@ int crypt_hmac_init(struct crypt_hmac **ctx, const char *name,
 {
 	struct crypt_hmac *h;
 
+	if (crypt_backend_lazy_init())
+		return -ENOSYS;
+
 	h = malloc(sizeof(*h));
 	if (!h)
 		return -ENOMEM;
@@ -297,6 +354,9 @@ void crypt_hmac_destroy(struct crypt_hmac *ctx)
 /* RNG */
 int crypt_backend_rng(char *buffer, size_t length, int quality, int fips)
 {
+	if (crypt_backend_lazy_init())
+		return -ENOSYS;
+
 	if (RAND_bytes((unsigned char *)buffer, length) != 1)
 		return -EINVAL;
 
@@ -316,6 +376,9 @@ int crypt_pbkdf(const char *kdf, const char *hash,
 	if (!kdf)
 		return -EINVAL;
 
+	if (crypt_backend_lazy_init())
+		return -ENOSYS;
+
 	if (!strcmp(kdf, "pbkdf2")) {
 		hash_id = EVP_get_digestbyname(hash);
 		if (!hash_id)
@@ -20,6 +20,7 @@
  */
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include <errno.h>
 #include "bitops.h"
 #include "crypto_backend.h"
@@ -27,6 +28,9 @@
 #define SECTOR_SHIFT	9
 #define SECTOR_SIZE	(1 << SECTOR_SHIFT)
 
+/* Number of sector IVs generated at once */
+#define IV_BATCH_SECTORS 64
+
 /*
  * Internal IV helper
  * IV documentation: https://gitlab.com/cryptsetup/cryptsetup/wikis/DMCrypt
@@ -34,7 +38,7 @@
 struct crypt_sector_iv {
 	enum { IV_NONE, IV_NULL, IV_PLAIN, IV_PLAIN64, IV_ESSIV, IV_BENBI, IV_PLAIN64BE } type;
 	int iv_size;
-	char *iv;
+	char *iv; /* IV_BATCH_SECTORS IVs */
 	struct crypt_cipher *essiv_cipher;
 	int benbi_shift;
 };
@@ -42,6 +46,7 @@ struct crypt_sector_iv {
 /* Block encryption storage context */
 struct crypt_storage {
 	uint64_t sector_start;
+	unsigned sector_step;	/* encryption sector size in 512-byte sectors */
 	struct crypt_cipher *cipher;
 	struct crypt_sector_iv cipher_iv;
 };
@@ -131,14 +136,15 @@ static int crypt_sector_iv_init(struct crypt_sector_iv *ctx,
 	} else
 		return -ENOENT;
 
-	ctx->iv = malloc(ctx->iv_size);
+	ctx->iv = malloc(ctx->iv_size * IV_BATCH_SECTORS);
 	if (!ctx->iv)
 		return -ENOMEM;
 
 	return 0;
 }
 
-static int crypt_sector_iv_generate(struct crypt_sector_iv *ctx, uint64_t sector)
+static int crypt_sector_iv_generate(struct crypt_sector_iv *ctx, uint64_t sector,
+				    char *iv)
 {
 	uint64_t val;
 
@@ -146,30 +152,26 @@ static int crypt_sector_iv_generate(struct crypt_sector_iv *ctx, uint64_t sector
 	case IV_NONE:
 		break;
 	case IV_NULL:
-		memset(ctx->iv, 0, ctx->iv_size);
+		memset(iv, 0, ctx->iv_size);
 		break;
 	case IV_PLAIN:
-		memset(ctx->iv, 0, ctx->iv_size);
-		*(uint32_t *)ctx->iv = cpu_to_le32(sector & 0xffffffff);
+		memset(iv, 0, ctx->iv_size);
+		*(uint32_t *)iv = cpu_to_le32(sector & 0xffffffff);
 		break;
 	case IV_PLAIN64:
-		memset(ctx->iv, 0, ctx->iv_size);
-		*(uint64_t *)ctx->iv = cpu_to_le64(sector);
+	case IV_ESSIV:
+		/* ESSIV encryption is done for the whole batch later */
+		memset(iv, 0, ctx->iv_size);
+		*(uint64_t *)iv = cpu_to_le64(sector);
 		break;
 	case IV_PLAIN64BE:
-		memset(ctx->iv, 0, ctx->iv_size);
-		*(uint64_t *)&ctx->iv[ctx->iv_size - sizeof(uint64_t)] = cpu_to_be64(sector);
-		break;
-	case IV_ESSIV:
-		memset(ctx->iv, 0, ctx->iv_size);
-		*(uint64_t *)ctx->iv = cpu_to_le64(sector);
-		return crypt_cipher_encrypt(ctx->essiv_cipher,
-			ctx->iv, ctx->iv, ctx->iv_size, NULL, 0);
+		memset(iv, 0, ctx->iv_size);
+		*(uint64_t *)&iv[ctx->iv_size - sizeof(uint64_t)] = cpu_to_be64(sector);
 		break;
 	case IV_BENBI:
-		memset(ctx->iv, 0, ctx->iv_size);
+		memset(iv, 0, ctx->iv_size);
 		val = cpu_to_be64((sector << ctx->benbi_shift) + 1);
-		memcpy(ctx->iv + ctx->iv_size - sizeof(val), &val, sizeof(val));
+		memcpy(iv + ctx->iv_size - sizeof(val), &val, sizeof(val));
 		break;
 	default:
 		return -EINVAL;
@@ -178,13 +180,40 @@ static int crypt_sector_iv_generate(struct crypt_sector_iv *ctx, uint64_t sector
 	return 0;
 }
 
+/*
+ * Generate IVs for a run of sectors into ctx->iv (count * iv_size bytes),
+ * consecutive IVs are for sectors step (512-byte sectors) apart.
+ * ESSIV IVs are encrypted in one ECB call for the whole run.
+ */
+static int crypt_sector_iv_generate_batch(struct crypt_sector_iv *ctx,
+					  uint64_t sector, size_t count, unsigned step)
+{
+	size_t i;
+	int r;
+
+	if (ctx->type == IV_NONE)
+		return 0;
+
+	for (i = 0; i < count; i++) {
+		r = crypt_sector_iv_generate(ctx, sector + i * step, &ctx->iv[i * ctx->iv_size]);
+		if (r)
+			return r;
+	}
+
+	if (ctx->type == IV_ESSIV)
+		return crypt_cipher_encrypt(ctx->essiv_cipher, ctx->iv, ctx->iv,
+					    count * ctx->iv_size, NULL, 0);
+
+	return 0;
+}
+
 static void crypt_sector_iv_destroy(struct crypt_sector_iv *ctx)
 {
 	if (ctx->type == IV_ESSIV)
 		crypt_cipher_destroy(ctx->essiv_cipher);
 
 	if (ctx->iv) {
-		memset(ctx->iv, 0, ctx->iv_size);
+		memset(ctx->iv, 0, ctx->iv_size * IV_BATCH_SECTORS);
 		free(ctx->iv);
 	}
 
@@ -193,8 +222,13 @@ static void crypt_sector_iv_destroy(struct crypt_sector_iv *ctx)
 
 /* Block encryption storage wrappers */
 
-int crypt_storage_init(struct crypt_storage **ctx,
+/*
+ * Encryption sector can be larger than 512 bytes, its IV is then (as in dm-crypt
+ * without iv_large_sectors) derived from number of its first 512-byte sector.
+ */
+int crypt_storage_init_sector(struct crypt_storage **ctx,
 		       uint64_t sector_start,
+		       size_t sector_size,
 		       const char *cipher,
 		       const char *cipher_mode,
 		       const void *key, size_t key_length)
@@ -204,6 +238,9 @@ int crypt_storage_init(struct crypt_storage **ctx,
 	char *cipher_iv = NULL;
 	int r = -EIO;
 
+	if (sector_size < SECTOR_SIZE || sector_size % SECTOR_SIZE)
+		return -EINVAL;
+
 	s = malloc(sizeof(*s));
 	if (!s)
 		return -ENOMEM;
@@ -231,57 +268,92 @@ int crypt_storage_init(struct crypt_storage **ctx,
 	}
 
 	s->sector_start = sector_start;
+	s->sector_step = sector_size >> SECTOR_SHIFT;
 
 	*ctx = s;
 	return 0;
 }
 
-int crypt_storage_decrypt(struct crypt_storage *ctx,
-		       uint64_t sector, size_t count,
-		       char *buffer)
+int crypt_storage_init(struct crypt_storage **ctx,
+		       uint64_t sector_start,
+		       const char *cipher,
+		       const char *cipher_mode,
+		       const void *key, size_t key_length)
 {
-	unsigned int i;
+	return crypt_storage_init_sector(ctx, sector_start, SECTOR_SIZE,
+					 cipher, cipher_mode, key, key_length);
+}
+
+static int crypt_storage_crypt(struct crypt_storage *ctx,
+			       uint64_t sector, size_t count,
+			       char *buffer, bool encrypt)
+{
+	struct crypt_sector_iv *civ = &ctx->cipher_iv;
+	size_t i, batch, units, unit_size = ctx->sector_step * SECTOR_SIZE;
+	char *iv;
 	int r = 0;
 
-	for (i = 0; i < count; i++) {
-		r = crypt_sector_iv_generate(&ctx->cipher_iv, sector + i);
-		if (r)
-			break;
-		r = crypt_cipher_decrypt(ctx->cipher,
-					 &buffer[i * SECTOR_SIZE],
-					 &buffer[i * SECTOR_SIZE],
-					 SECTOR_SIZE,
-					 ctx->cipher_iv.iv,
-					 ctx->cipher_iv.iv_size);
+	if (count % ctx->sector_step)
+		return -EINVAL;
+
+	/*
+	 * No per-sector state, process IV_BATCH_SECTORS per call, kernel cipher
+	 * socket cannot take more than its send buffer at once.
+	 */
+	if (civ->type == IV_NONE) {
+		while (count && !r) {
+			batch = count > IV_BATCH_SECTORS ? IV_BATCH_SECTORS : count;
+			r = encrypt ?
+				crypt_cipher_encrypt(ctx->cipher, buffer, buffer,
+						     batch * SECTOR_SIZE, NULL, 0) :
+				crypt_cipher_decrypt(ctx->cipher, buffer, buffer,
+						     batch * SECTOR_SIZE, NULL, 0);
+			buffer += batch * SECTOR_SIZE;
+			count -= batch;
+		}
+		return r;
+	}
+
+	units = count / ctx->sector_step;
+	while (units) {
+		batch = units > IV_BATCH_SECTORS ? IV_BATCH_SECTORS : units;
+
+		r = crypt_sector_iv_generate_batch(civ, sector, batch, ctx->sector_step);
 		if (r)
 			break;
-	}
 
+		for (i = 0; i < batch; i++) {
+			iv = &civ->iv[i * civ->iv_size];
+			if (encrypt)
+				r = crypt_cipher_encrypt(ctx->cipher, buffer, buffer,
+							 unit_size, iv, civ->iv_size);
+			else
+				r = crypt_cipher_decrypt(ctx->cipher, buffer, buffer,
+							 unit_size, iv, civ->iv_size);
+			if (r)
+				goto out;
+			buffer += unit_size;
+		}
+
+		sector += batch * ctx->sector_step;
+		units -= batch;
+	}
+out:
 	return r;
 }
 
-int crypt_storage_encrypt(struct crypt_storage *ctx,
+int crypt_storage_decrypt(struct crypt_storage *ctx,
 		       uint64_t sector, size_t count,
 		       char *buffer)
 {
-	unsigned int i;
-	int r = 0;
-
-	for (i = 0; i < count; i++) {
-		r = crypt_sector_iv_generate(&ctx->cipher_iv, sector + i);
-		if (r)
-			break;
-		r = crypt_cipher_encrypt(ctx->cipher,
-					 &buffer[i * SECTOR_SIZE],
-					 &buffer[i * SECTOR_SIZE],
-					 SECTOR_SIZE,
-					 ctx->cipher_iv.iv,
-					 ctx->cipher_iv.iv_size);
-		if (r)
-			break;
-	}
+	return crypt_storage_crypt(ctx, sector, count, buffer, false);
+}
 
-	return r;
+int crypt_storage_encrypt(struct crypt_storage *ctx,
+		       uint64_t sector, size_t count,
+		       char *buffer)
+{
+	return crypt_storage_crypt(ctx, sector, count, buffer, true);
 }
 
 void crypt_storage_destroy(struct crypt_storage *ctx)
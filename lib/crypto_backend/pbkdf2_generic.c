@@ -25,6 +25,9 @@
 
 #include <errno.h>
 #include <alloca.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "crypto_backend.h"
 
 static int hash_buf(const char *src, size_t src_len,
@@ -82,25 +85,164 @@ static int hash_buf(const char *src, size_t src_len,
 
 #define MAX_PRF_BLOCK_LEN 80
 
-int pkcs5_pbkdf2(const char *hash,
-			const char *P, size_t Plen,
-			const char *S, size_t Slen,
-			unsigned int c, unsigned int dkLen,
-			char *DK, unsigned int hash_block_size)
+/*
+ * Output blocks T_1 .. T_l are independent, for large dkLen they are
+ * computed on several threads. Blocks are processed in units of @unit
+ * consecutive blocks, units are distributed round-robin, the calling
+ * thread takes part as well. Result does not depend on thread count.
+ */
+#define PBKDF2_MAX_THREADS 4
+
+struct pbkdf2_blocks {
+	unsigned int l, unit, threads;
+	int (*fn)(void *arg, unsigned int i, unsigned int n);
+	void *arg;
+};
+
+struct pbkdf2_blocks_thread {
+	struct pbkdf2_blocks *b;
+	unsigned int id;
+	int r;
+};
+
+static void *pbkdf2_blocks_thread(void *arg)
 {
+	struct pbkdf2_blocks_thread *t = arg;
+	struct pbkdf2_blocks *b = t->b;
+	unsigned int i, n;
+
+	for (i = 1 + t->id * b->unit; i <= b->l && !t->r; i += b->threads * b->unit) {
+		n = b->l - i + 1 < b->unit ? b->l - i + 1 : b->unit;
+		t->r = b->fn(b->arg, i, n);
+	}
+
+	return NULL;
+}
+
+int pkcs5_pbkdf2_blocks(unsigned int l, unsigned int unit,
+			int (*fn)(void *arg, unsigned int i, unsigned int n),
+			void *arg)
+{
+	struct pbkdf2_blocks b = { .l = l, .unit = unit, .fn = fn, .arg = arg };
+	struct pbkdf2_blocks_thread t[PBKDF2_MAX_THREADS] = {};
+	pthread_t threads[PBKDF2_MAX_THREADS];
+	unsigned int i, units = (l + unit - 1) / unit;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int r = 0;
+
+	b.threads = units < PBKDF2_MAX_THREADS ? units : PBKDF2_MAX_THREADS;
+	if (cpus > 0 && b.threads > (unsigned int)cpus)
+		b.threads = (unsigned int)cpus;
+	if (!b.threads)
+		b.threads = 1;
+
+	for (i = 0; i < b.threads; i++) {
+		t[i].b = &b;
+		t[i].id = i;
+	}
+
+	/* If thread cannot be created, run its share directly */
+	for (i = 1; i < b.threads; i++)
+		if (pthread_create(&threads[i], NULL, pbkdf2_blocks_thread, &t[i]))
+			t[i].id = UINT_MAX;
+
+	pbkdf2_blocks_thread(&t[0]);
+
+	for (i = 1; i < b.threads; i++) {
+		if (t[i].id == UINT_MAX) {
+			t[i].id = i;
+			pbkdf2_blocks_thread(&t[i]);
+		} else
+			pthread_join(threads[i], NULL);
+	}
+
+	for (i = 0; i < b.threads; i++)
+		if (t[i].r && !r)
+			r = t[i].r;
+
+	return r;
+}
+
+struct pbkdf2_generic {
+	const char *hash;
+	const char *K;
+	size_t Klen;
+	const char *S;
+	size_t Slen;
+	unsigned int c, hLen, l, r;
+	char *DK;
+};
+
+/* Compute T_i .. T_(i+n-1) with its own HMAC context */
+static int pbkdf2_generic_blocks(void *arg, unsigned int first, unsigned int n)
+{
+	struct pbkdf2_generic *p = arg;
 	struct crypt_hmac *hmac;
 	char U[MAX_PRF_BLOCK_LEN];
 	char T[MAX_PRF_BLOCK_LEN];
-	char P_hash[MAX_PRF_BLOCK_LEN];
-	int i, k, rc = -EINVAL;
-	unsigned int u, hLen, l, r;
-	size_t tmplen = Slen + 4;
+	unsigned int i, u, k, hLen = p->hLen;
+	size_t tmplen = p->Slen + 4;
 	char *tmp;
+	int rc = -EINVAL;
 
 	tmp = alloca(tmplen);
 	if (tmp == NULL)
 		return -ENOMEM;
 
+	if (crypt_hmac_init(&hmac, p->hash, p->K, p->Klen))
+		return -EINVAL;
+
+	for (i = first; i < first + n; i++) {
+		memset(T, 0, hLen);
+
+		for (u = 1; u <= p->c ; u++) {
+			if (u == 1) {
+				memcpy(tmp, p->S, p->Slen);
+				tmp[p->Slen + 0] = (i & 0xff000000) >> 24;
+				tmp[p->Slen + 1] = (i & 0x00ff0000) >> 16;
+				tmp[p->Slen + 2] = (i & 0x0000ff00) >> 8;
+				tmp[p->Slen + 3] = (i & 0x000000ff) >> 0;
+
+				if (crypt_hmac_write(hmac, tmp, tmplen))
+					goto out;
+			} else {
+				if (crypt_hmac_write(hmac, U, hLen))
+					goto out;
+			}
+
+			if (crypt_hmac_final(hmac, U, hLen))
+				goto out;
+
+			for (k = 0; k < hLen; k++)
+				T[k] ^= U[k];
+		}
+
+		memcpy(p->DK + (i - 1) * hLen, T, i == p->l ? p->r : hLen);
+	}
+	rc = 0;
+out:
+	crypt_hmac_destroy(hmac);
+	crypt_backend_memzero(U, sizeof(U));
+	crypt_backend_memzero(T, sizeof(T));
+	crypt_backend_memzero(tmp, tmplen);
+
+	return rc;
+}
+
+int pkcs5_pbkdf2(const char *hash,
+			const char *P, size_t Plen,
+			const char *S, size_t Slen,
+			unsigned int c, unsigned int dkLen,
+			char *DK, unsigned int hash_block_size)
+{
+	struct pbkdf2_generic p = {
+		.hash = hash, .K = P, .Klen = Plen, .S = S, .Slen = Slen,
+		.c = c, .DK = DK
+	};
+	char P_hash[MAX_PRF_BLOCK_LEN];
+	unsigned int hLen, l, r;
+	int rc;
+
 	hLen = crypt_hmac_size(hash);
 	if (hLen == 0 || hLen > MAX_PRF_BLOCK_LEN)
 		return -EINVAL;
@@ -185,49 +327,17 @@ int pkcs5_pbkdf2(const char *hash,
 	if (hash_block_size > 0 && Plen > hash_block_size) {
 		if (hash_buf(P, Plen, P_hash, hLen, hash))
 			return -EINVAL;
-
-		if (crypt_hmac_init(&hmac, hash, P_hash, hLen))
-			return -EINVAL;
-		crypt_backend_memzero(P_hash, sizeof(P_hash));
-	} else {
-		if (crypt_hmac_init(&hmac, hash, P, Plen))
-			return -EINVAL;
+		p.K = P_hash;
+		p.Klen = hLen;
 	}
 
-	for (i = 1; (unsigned int) i <= l; i++) {
-		memset(T, 0, hLen);
-
-		for (u = 1; u <= c ; u++) {
-			if (u == 1) {
-				memcpy(tmp, S, Slen);
-				tmp[Slen + 0] = (i & 0xff000000) >> 24;
-				tmp[Slen + 1] = (i & 0x00ff0000) >> 16;
-				tmp[Slen + 2] = (i & 0x0000ff00) >> 8;
-				tmp[Slen + 3] = (i & 0x000000ff) >> 0;
-
-				if (crypt_hmac_write(hmac, tmp, tmplen))
-					goto out;
-			} else {
-				if (crypt_hmac_write(hmac, U, hLen))
-					goto out;
-			}
-
-			if (crypt_hmac_final(hmac, U, hLen))
-				goto out;
-
-			for (k = 0; (unsigned int) k < hLen; k++)
-				T[k] ^= U[k];
-		}
+	p.hLen = hLen;
+	p.l = l;
+	p.r = r;
 
-		memcpy(DK + (i - 1) * hLen, T, (unsigned int) i == l ? r : hLen);
-	}
-	rc = 0;
-out:
-	crypt_hmac_destroy(hmac);
-	crypt_backend_memzero(U, sizeof(U));
-	crypt_backend_memzero(T, sizeof(T));
-	crypt_backend_memzero(tmp, tmplen);
+	rc = pkcs5_pbkdf2_blocks(l, 1, pbkdf2_generic_blocks, &p);
 
+	crypt_backend_memzero(P_hash, sizeof(P_hash));
 	return rc;
 }
 
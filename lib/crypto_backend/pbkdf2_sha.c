@@ -0,0 +1,514 @@
+/*
+ * Fast PBKDF2-HMAC-SHA core for internal PBKDF2 implementation
+ *
+ * Copyright (C) 2026, cryptsetup contributors
+ *
+ * This file is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This file is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this file; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * HMAC keyed inner and outer states are computed only once, every PBKDF2
+ * iteration is then exactly two compression function calls on prepared
+ * message words (no re-keying, no byte conversions, no backend calls).
+ * Intended for backends where every HMAC operation is expensive (kernel
+ * userspace crypto API), library backends with optimized hash code are
+ * faster through the generic HMAC path.
+ *
+ * If more output blocks are needed (dkLen > hLen, e.g. LUKS1 with sha1),
+ * independent blocks are computed together in vector lanes (multi-buffer).
+ * The same code is instantiated for scalar and vector word types using
+ * compiler vector extensions.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <alloca.h>
+#include "crypto_backend.h"
+
+#define PBKDF2_MAX_BLOCK	128
+#define PBKDF2_MAX_STATE	8
+
+#if defined(__GNUC__)
+#define PBKDF2_LANES 4
+typedef uint32_t v32 __attribute__((vector_size(4 * PBKDF2_LANES)));
+typedef uint64_t v64 __attribute__((vector_size(8 * PBKDF2_LANES)));
+#else
+#define PBKDF2_LANES 1
+#endif
+
+#define ROTR(x, n, bits) (((x) >> (n)) | ((x) << ((bits) - (n))))
+#define CH(x, y, z)  (((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+
+/* Broadcast scalar to word type (no-op for scalar types) */
+#define BCAST(T, x) ((T){0} + (x))
+
+struct pbkdf2_alg {
+	const char *name;
+	unsigned int word_size;
+	unsigned int block_size;
+	unsigned int state_words;
+	unsigned int digest_words;
+	const void *iv;
+	void (*compress)(void *state, const void *w);
+	void (*compress_v)(void *state, const void *w);
+	int (*derive)(const struct pbkdf2_alg *alg,
+		      const char *P, size_t Plen, const char *S, size_t Slen,
+		      unsigned int c, unsigned int dkLen, char *DK);
+};
+
+/*
+ * SHA-1
+ */
+static const uint32_t sha1_iv[5] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+#define SHA1_COMPRESS(fn, T)						\
+static void fn(void *state, const void *win)				\
+{									\
+	T *s = state, w[80], a, b, c, d, e, t;				\
+	const T *in = win;						\
+	int i;								\
+									\
+	for (i = 0; i < 16; i++)					\
+		w[i] = in[i];						\
+	for (; i < 80; i++) {						\
+		t = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];	\
+		w[i] = ROTR(t, 31, 32);					\
+	}								\
+									\
+	a = s[0]; b = s[1]; c = s[2]; d = s[3]; e = s[4];		\
+									\
+	for (i = 0; i < 20; i++) {					\
+		t = ROTR(a, 27, 32) + CH(b, c, d) + e + w[i] + 0x5a827999U;\
+		e = d; d = c; c = ROTR(b, 2, 32); b = a; a = t;		\
+	}								\
+	for (; i < 40; i++) {						\
+		t = ROTR(a, 27, 32) + (b ^ c ^ d) + e + w[i] + 0x6ed9eba1U;\
+		e = d; d = c; c = ROTR(b, 2, 32); b = a; a = t;		\
+	}								\
+	for (; i < 60; i++) {						\
+		t = ROTR(a, 27, 32) + MAJ(b, c, d) + e + w[i] + 0x8f1bbcdcU;\
+		e = d; d = c; c = ROTR(b, 2, 32); b = a; a = t;		\
+	}								\
+	for (; i < 80; i++) {						\
+		t = ROTR(a, 27, 32) + (b ^ c ^ d) + e + w[i] + 0xca62c1d6U;\
+		e = d; d = c; c = ROTR(b, 2, 32); b = a; a = t;		\
+	}								\
+									\
+	s[0] += a; s[1] += b; s[2] += c; s[3] += d; s[4] += e;		\
+}
+
+/*
+ * SHA-224/SHA-256
+ */
+static const uint32_t sha224_iv[8] = {
+	0xc1059ed8, 0x367cd507, 0x3070dd17, 0xf70e5939,
+	0xffc00b31, 0x68581511, 0x64f98fa7, 0xbefa4fa4
+};
+
+static const uint32_t sha256_iv[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/*
+ * SHA-384/SHA-512
+ */
+static const uint64_t sha384_iv[8] = {
+	0xcbbb9d5dc1059ed8ULL, 0x629a292a367cd507ULL, 0x9159015a3070dd17ULL, 0x152fecd8f70e5939ULL,
+	0x67332667ffc00b31ULL, 0x8eb44a8768581511ULL, 0xdb0c2e0d64f98fa7ULL, 0x47b5481dbefa4fa4ULL
+};
+
+static const uint64_t sha512_iv[8] = {
+	0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+	0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL
+};
+
+static const uint64_t sha512_k[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+	0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+	0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+	0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+	0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+	0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+	0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+	0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+	0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+	0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+	0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+	0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+	0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+	0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL
+};
+
+/* Generic SHA-2 compression, rotation amounts are given by the variant */
+#define SHA2_COMPRESS(fn, T, K, ROUNDS, BITS, A0, A1, A2, E0, E1, E2, W0, W1, W2, X0, X1, X2) \
+static void fn(void *state, const void *win)				\
+{									\
+	T *s = state, w[ROUNDS], a, b, c, d, e, f, g, h, t1, t2;	\
+	const T *in = win;						\
+	int i;								\
+									\
+	for (i = 0; i < 16; i++)					\
+		w[i] = in[i];						\
+	for (; i < ROUNDS; i++)						\
+		w[i] = (ROTR(w[i - 2], X0, BITS) ^ ROTR(w[i - 2], X1, BITS) ^ (w[i - 2] >> X2)) + \
+		       w[i - 7] + w[i - 16] +				\
+		       (ROTR(w[i - 15], W0, BITS) ^ ROTR(w[i - 15], W1, BITS) ^ (w[i - 15] >> W2)); \
+									\
+	a = s[0]; b = s[1]; c = s[2]; d = s[3];				\
+	e = s[4]; f = s[5]; g = s[6]; h = s[7];				\
+									\
+	for (i = 0; i < ROUNDS; i++) {					\
+		t1 = h + (ROTR(e, E0, BITS) ^ ROTR(e, E1, BITS) ^ ROTR(e, E2, BITS)) + \
+		     CH(e, f, g) + K[i] + w[i];				\
+		t2 = (ROTR(a, A0, BITS) ^ ROTR(a, A1, BITS) ^ ROTR(a, A2, BITS)) + \
+		     MAJ(a, b, c);					\
+		h = g; g = f; f = e; e = d + t1;			\
+		d = c; c = b; b = a; a = t1 + t2;			\
+	}								\
+									\
+	s[0] += a; s[1] += b; s[2] += c; s[3] += d;			\
+	s[4] += e; s[5] += f; s[6] += g; s[7] += h;			\
+}
+
+#define SHA256_COMPRESS(fn, T) \
+	SHA2_COMPRESS(fn, T, sha256_k, 64, 32, 2, 13, 22, 6, 11, 25, 7, 18, 3, 17, 19, 10)
+#define SHA512_COMPRESS(fn, T) \
+	SHA2_COMPRESS(fn, T, sha512_k, 80, 64, 28, 34, 39, 14, 18, 41, 1, 8, 7, 19, 61, 6)
+
+SHA1_COMPRESS(sha1_compress, uint32_t)
+SHA256_COMPRESS(sha256_compress, uint32_t)
+SHA512_COMPRESS(sha512_compress, uint64_t)
+#if PBKDF2_LANES > 1
+SHA1_COMPRESS(sha1_compress_v, v32)
+SHA256_COMPRESS(sha256_compress_v, v32)
+SHA512_COMPRESS(sha512_compress_v, v64)
+#endif
+
+/*
+ * PBKDF2 iterations U_2 .. U_c for PBKDF2_LANES output blocks (or one block
+ * for scalar type). Both HMAC hashes of an iteration are single block
+ * messages: previous U (digest_words) and constant padding.
+ */
+#define PBKDF2_ITERATE(fn, Wt, T)					\
+static void fn(const struct pbkdf2_alg *alg, void (*compress)(void *, const void *), \
+	       const Wt *is, const Wt *os, T *u, T *t, unsigned int c)	\
+{									\
+	T s[PBKDF2_MAX_STATE], w[16];					\
+	unsigned int i, k, sw = alg->state_words, dw = alg->digest_words; \
+	const unsigned int bits = 8 * sizeof(Wt);			\
+									\
+	/* Padding of block_size + digest length message */		\
+	for (k = dw; k < 16; k++)					\
+		w[k] = BCAST(T, 0);					\
+	w[dw] = BCAST(T, (Wt)0x80 << (bits - 8));			\
+	w[15] = BCAST(T, (Wt)(alg->block_size + dw * sizeof(Wt)) * 8);	\
+									\
+	for (i = 1; i < c; i++) {					\
+		for (k = 0; k < sw; k++)				\
+			s[k] = BCAST(T, is[k]);				\
+		for (k = 0; k < dw; k++)				\
+			w[k] = u[k];					\
+		compress(s, w);						\
+									\
+		for (k = 0; k < dw; k++)				\
+			w[k] = s[k];					\
+		for (k = 0; k < sw; k++)				\
+			s[k] = BCAST(T, os[k]);				\
+		compress(s, w);						\
+									\
+		for (k = 0; k < dw; k++) {				\
+			u[k] = s[k];					\
+			t[k] ^= s[k];					\
+		}							\
+	}								\
+									\
+	crypt_backend_memzero(s, sizeof(s));				\
+	crypt_backend_memzero(w, sizeof(w));				\
+}
+
+/*
+ * PBKDF2 driver for one word size family.
+ * Message bytes are hashed only for the HMAC key and for U_1.
+ */
+#define PBKDF2_DERIVE(fn, Wt, T)					\
+PBKDF2_ITERATE(fn##_iterate, Wt, Wt)					\
+PBKDF2_LANES_ITERATE(fn##_iterate_v, Wt, T)				\
+									\
+static void fn##_load(Wt *w, const unsigned char *p)			\
+{									\
+	unsigned int i, j;						\
+									\
+	for (i = 0; i < 16; i++)					\
+		for (w[i] = 0, j = 0; j < sizeof(Wt); j++)		\
+			w[i] = (w[i] << 8) | *p++;			\
+}									\
+									\
+static void fn##_store(unsigned char *p, const Wt *w, unsigned int words) \
+{									\
+	unsigned int i, j;						\
+									\
+	for (i = 0; i < words; i++)					\
+		for (j = 0; j < sizeof(Wt); j++)			\
+			*p++ = (unsigned char)(w[i] >> (8 * (sizeof(Wt) - 1 - j))); \
+}									\
+									\
+/* Finish hash of prefix (already in s) and data, prefix is whole blocks */ \
+static void fn##_hash(const struct pbkdf2_alg *alg, Wt *s, size_t prefix, \
+		      const unsigned char *d, size_t len)		\
+{									\
+	unsigned char b[PBKDF2_MAX_BLOCK];				\
+	Wt w[16];							\
+	size_t bs = alg->block_size, total = prefix + len, n;		\
+	unsigned int i;							\
+									\
+	for (; len >= bs; d += bs, len -= bs) {				\
+		fn##_load(w, d);					\
+		alg->compress(s, w);					\
+	}								\
+									\
+	memset(b, 0, sizeof(b));					\
+	memcpy(b, d, len);						\
+	b[len] = 0x80;							\
+	if (len + 1 > bs - 2 * sizeof(Wt)) {				\
+		fn##_load(w, b);					\
+		alg->compress(s, w);					\
+		memset(b, 0, sizeof(b));				\
+	}								\
+	for (n = total * 8, i = 1; i <= 8; i++, n >>= 8)		\
+		b[bs - i] = (unsigned char)n;				\
+	fn##_load(w, b);						\
+	alg->compress(s, w);						\
+									\
+	crypt_backend_memzero(b, sizeof(b));				\
+	crypt_backend_memzero(w, sizeof(w));				\
+}									\
+									\
+struct fn##_ctx {							\
+	const struct pbkdf2_alg *alg;					\
+	Wt is[PBKDF2_MAX_STATE], os[PBKDF2_MAX_STATE];			\
+	const char *S;							\
+	size_t Slen;							\
+	unsigned int c, dkLen, l;					\
+	char *DK;							\
+};									\
+									\
+/* Compute output blocks T_i .. T_(i+n-1), n <= PBKDF2_LANES */	\
+static int fn##_blocks(void *arg, unsigned int i, unsigned int n)	\
+{									\
+	struct fn##_ctx *p = arg;					\
+	const struct pbkdf2_alg *alg = p->alg;				\
+	unsigned char out[PBKDF2_MAX_BLOCK], *tmp;			\
+	Wt u[PBKDF2_LANES][PBKDF2_MAX_STATE], t[PBKDF2_LANES][PBKDF2_MAX_STATE]; \
+	Wt w[16];							\
+	unsigned int j, bs = alg->block_size, l = p->l;			\
+	unsigned int sw = alg->state_words, dw = alg->digest_words;	\
+	unsigned int hLen = dw * sizeof(Wt);				\
+	size_t Slen = p->Slen;						\
+									\
+	tmp = alloca(Slen + 4);						\
+	memcpy(tmp, p->S, Slen);					\
+									\
+	/* U_1 = PRF(P, S || INT(i)) */					\
+	for (j = 0; j < n; j++) {					\
+		tmp[Slen + 0] = ((i + j) >> 24) & 0xff;			\
+		tmp[Slen + 1] = ((i + j) >> 16) & 0xff;			\
+		tmp[Slen + 2] = ((i + j) >>  8) & 0xff;			\
+		tmp[Slen + 3] = ((i + j) >>  0) & 0xff;			\
+		memcpy(u[j], p->is, sw * sizeof(Wt));			\
+		fn##_hash(alg, u[j], bs, tmp, Slen + 4);		\
+									\
+		memset(w, 0, sizeof(w));				\
+		memcpy(w, u[j], dw * sizeof(Wt));			\
+		w[dw] = (Wt)0x80 << (8 * sizeof(Wt) - 8);		\
+		w[15] = (Wt)(bs + hLen) * 8;				\
+		memcpy(u[j], p->os, sw * sizeof(Wt));			\
+		alg->compress(u[j], w);					\
+		memcpy(t[j], u[j], sizeof(t[j]));			\
+	}								\
+									\
+	if (n > 1)							\
+		fn##_iterate_v(alg, p->is, p->os, u, t, n, p->c);	\
+	else								\
+		fn##_iterate(alg, alg->compress, p->is, p->os, u[0], t[0], p->c); \
+									\
+	for (j = 0; j < n; j++) {					\
+		fn##_store(out, t[j], dw);				\
+		memcpy(p->DK + (i + j - 1) * hLen, out,			\
+		       i + j == l ? p->dkLen - (l - 1) * hLen : hLen);	\
+	}								\
+									\
+	crypt_backend_memzero(out, sizeof(out));			\
+	crypt_backend_memzero(tmp, Slen + 4);				\
+	crypt_backend_memzero(w, sizeof(w));				\
+	crypt_backend_memzero(u, sizeof(u));				\
+	crypt_backend_memzero(t, sizeof(t));				\
+	return 0;							\
+}									\
+									\
+static int fn(const struct pbkdf2_alg *alg,				\
+	      const char *P, size_t Plen, const char *S, size_t Slen,	\
+	      unsigned int c, unsigned int dkLen, char *DK)		\
+{									\
+	struct fn##_ctx p = {						\
+		.alg = alg, .S = S, .Slen = Slen, .c = c,		\
+		.dkLen = dkLen, .DK = DK				\
+	};								\
+	unsigned char key[PBKDF2_MAX_BLOCK];				\
+	Wt w[16];							\
+	unsigned int k, hLen, bs = alg->block_size;			\
+	unsigned int sw = alg->state_words, dw = alg->digest_words;	\
+	int r;								\
+									\
+	hLen = dw * sizeof(Wt);						\
+									\
+	/* HMAC key, longer keys are hashed first */			\
+	memset(key, 0, sizeof(key));					\
+	if (Plen > bs) {						\
+		memcpy(p.is, alg->iv, sw * sizeof(Wt));			\
+		fn##_hash(alg, p.is, 0, (const unsigned char *)P, Plen); \
+		fn##_store(key, p.is, dw);				\
+	} else								\
+		memcpy(key, P, Plen);					\
+									\
+	/* Keyed inner and outer states */				\
+	for (k = 0; k < bs; k++)					\
+		key[k] ^= 0x36;						\
+	memcpy(p.is, alg->iv, sw * sizeof(Wt));				\
+	fn##_load(w, key);						\
+	alg->compress(p.is, w);						\
+									\
+	for (k = 0; k < bs; k++)					\
+		key[k] ^= 0x36 ^ 0x5c;					\
+	memcpy(p.os, alg->iv, sw * sizeof(Wt));				\
+	fn##_load(w, key);						\
+	alg->compress(p.os, w);						\
+									\
+	p.l = dkLen / hLen + (dkLen % hLen ? 1 : 0);			\
+	r = pkcs5_pbkdf2_blocks(p.l, PBKDF2_LANES, fn##_blocks, &p);	\
+									\
+	crypt_backend_memzero(key, sizeof(key));			\
+	crypt_backend_memzero(w, sizeof(w));				\
+	crypt_backend_memzero(&p, sizeof(p));				\
+	return r;							\
+}
+
+#if PBKDF2_LANES > 1
+/* Transpose lanes into vector words and run vector iterations */
+#define PBKDF2_LANES_ITERATE(fn, Wt, T)					\
+PBKDF2_ITERATE(fn##_lanes, Wt, T)					\
+									\
+static void fn(const struct pbkdf2_alg *alg, const Wt *is, const Wt *os, \
+	       Wt u[][PBKDF2_MAX_STATE], Wt t[][PBKDF2_MAX_STATE],	\
+	       unsigned int n, unsigned int c)				\
+{									\
+	T vu[PBKDF2_MAX_STATE], vt[PBKDF2_MAX_STATE];			\
+	unsigned int j, k;						\
+									\
+	for (k = 0; k < alg->digest_words; k++)				\
+		for (j = 0; j < PBKDF2_LANES; j++) {			\
+			vu[k][j] = u[j < n ? j : 0][k];			\
+			vt[k][j] = t[j < n ? j : 0][k];			\
+		}							\
+									\
+	fn##_lanes(alg, alg->compress_v, is, os, vu, vt, c);		\
+									\
+	for (k = 0; k < alg->digest_words; k++)				\
+		for (j = 0; j < n; j++)					\
+			t[j][k] = vt[k][j];				\
+									\
+	crypt_backend_memzero(vu, sizeof(vu));				\
+	crypt_backend_memzero(vt, sizeof(vt));				\
+}
+#else
+/* No vector support, compute blocks one after another */
+#define PBKDF2_LANES_ITERATE(fn, Wt, T)					\
+PBKDF2_ITERATE(fn##_lanes, Wt, Wt)					\
+									\
+static void fn(const struct pbkdf2_alg *alg, const Wt *is, const Wt *os, \
+	       Wt u[][PBKDF2_MAX_STATE], Wt t[][PBKDF2_MAX_STATE],	\
+	       unsigned int n, unsigned int c)				\
+{									\
+	unsigned int j;							\
+									\
+	for (j = 0; j < n; j++)						\
+		fn##_lanes(alg, alg->compress, is, os, u[j], t[j], c);	\
+}
+typedef uint32_t v32;
+typedef uint64_t v64;
+#endif
+
+PBKDF2_DERIVE(pbkdf2_derive32, uint32_t, v32)
+PBKDF2_DERIVE(pbkdf2_derive64, uint64_t, v64)
+
+#if PBKDF2_LANES > 1
+#define COMPRESS_V(fn) fn
+#else
+#define COMPRESS_V(fn) NULL
+#endif
+
+static const struct pbkdf2_alg pbkdf2_algs[] = {
+	{ "sha1",   4,  64, 5, 5, sha1_iv,   sha1_compress,   COMPRESS_V(sha1_compress_v),   pbkdf2_derive32 },
+	{ "sha224", 4,  64, 8, 7, sha224_iv, sha256_compress, COMPRESS_V(sha256_compress_v), pbkdf2_derive32 },
+	{ "sha256", 4,  64, 8, 8, sha256_iv, sha256_compress, COMPRESS_V(sha256_compress_v), pbkdf2_derive32 },
+	{ "sha384", 8, 128, 8, 6, sha384_iv, sha512_compress, COMPRESS_V(sha512_compress_v), pbkdf2_derive64 },
+	{ "sha512", 8, 128, 8, 8, sha512_iv, sha512_compress, COMPRESS_V(sha512_compress_v), pbkdf2_derive64 },
+	{ NULL,     0,   0, 0, 0, NULL,      NULL,            NULL,                          NULL }
+};
+
+/*
+ * Returns -ENOTSUP if hash is not handled here,
+ * caller then uses generic HMAC based implementation.
+ */
+int pkcs5_pbkdf2_sha(const char *hash,
+		     const char *P, size_t Plen,
+		     const char *S, size_t Slen,
+		     unsigned int c, unsigned int dkLen, char *DK)
+{
+	const struct pbkdf2_alg *alg;
+
+	for (alg = pbkdf2_algs; alg->name; alg++)
+		if (!strcmp(alg->name, hash))
+			break;
+
+	if (!alg->name)
+		return -ENOTSUP;
+
+	if (!c || !dkLen)
+		return -EINVAL;
+
+	return alg->derive(alg, P, Plen, S, Slen, c, dkLen, DK);
+}
@@ -27,8 +27,10 @@
 #include <sys/resource.h>
 #include "crypto_backend.h"
 
-#define BENCH_MIN_MS 250
 #define BENCH_MIN_MS_FAST 10
+#define BENCH_PROBE_MS 25
+#define BENCH_PROBE_FRACTION 4
+#define BENCH_MAX_STEPS 4
 #define BENCH_PERCENT_ATLEAST 95
 #define BENCH_PERCENT_ATMOST 110
 #define BENCH_SAMPLES_FAST 3
@@ -141,64 +143,64 @@ static int measure_argon2(const char *kdf, const char *password, size_t password
 
 #define CONTINUE 0
 #define FINAL   1
-static int next_argon2_params(uint32_t *t_cost, uint32_t *m_cost,
-			      uint32_t min_t_cost, uint32_t min_m_cost,
-			      uint32_t max_m_cost, long ms, uint32_t target_ms)
+
+/*
+ * Argon2 time is modelled as ms = a * t_cost * m_cost + b (b is the constant
+ * overhead). Two short probes give the model, the target parameters are then
+ * computed directly and verified by one measurement. Hosts limited by memory
+ * bandwidth have higher cost per block with large memory than the probes
+ * show; in that case the model is refitted from the last two measurements.
+ * Memory is never increased over max_m_cost, t_cost is increased instead.
+ */
+struct argon2_model {
+	double a;
+	double b;
+};
+
+static int argon2_model_predict(const struct argon2_model *model, uint32_t target_ms,
+				uint32_t min_t_cost, uint32_t min_m_cost,
+				uint32_t max_m_cost, uint32_t *t_cost, uint32_t *m_cost)
 {
-	uint32_t old_t_cost, old_m_cost, new_t_cost, new_m_cost;
-	uint64_t num, denom;
-
-	old_t_cost = *t_cost;
-	old_m_cost = *m_cost;
-
-	if (ms > target_ms) {
-		/* decreasing, first try to lower t_cost, then m_cost */
-		num = (uint64_t)*t_cost * (uint64_t)target_ms;
-		denom = (uint64_t)ms;
-		new_t_cost = (uint32_t)(num / denom);
-		if (new_t_cost < min_t_cost) {
-			num = (uint64_t)*t_cost * (uint64_t)*m_cost *
-			      (uint64_t)target_ms;
-			denom = (uint64_t)min_t_cost * (uint64_t)ms;
-			*t_cost = min_t_cost;
-			*m_cost = (uint32_t)(num / denom);
-			if (*m_cost < min_m_cost) {
-				*m_cost = min_m_cost;
-				return FINAL;
-			}
-		} else {
-			*t_cost = new_t_cost;
-		}
-	} else {
-		/* increasing, first try to increase m_cost, then t_cost */
-		num = (uint64_t)*m_cost * (uint64_t)target_ms;
-		denom = (uint64_t)ms;
-		new_m_cost = (uint32_t)(num / denom);
-		if (new_m_cost > max_m_cost) {
-			num = (uint64_t)*t_cost * (uint64_t)*m_cost *
-			      (uint64_t)target_ms;
-			denom = (uint64_t)max_m_cost * (uint64_t)ms;
-			*t_cost = (uint32_t)(num / denom);
-			*m_cost = max_m_cost;
-			if (*t_cost <= min_t_cost) {
-				*t_cost = min_t_cost;
-				return FINAL;
-			}
-		} else if (new_m_cost < min_m_cost) {
-			*m_cost = min_m_cost;
-			return FINAL;
-		} else {
-			*m_cost = new_m_cost;
-		}
-	}
+	double work, t, m;
 
-	/* do not continue if it is the same as in the previous run */
-	if (old_t_cost == *t_cost && old_m_cost == *m_cost)
+	work = ((double)target_ms - model->b) / model->a;
+	if (work <= (double)min_t_cost * min_m_cost) {
+		*t_cost = min_t_cost;
+		*m_cost = min_m_cost;
 		return FINAL;
+	}
+
+	/* Prefer memory cost, then increase time cost */
+	t = min_t_cost;
+	m = work / t;
+	if (m > max_m_cost) {
+		t = work / max_m_cost;
+		if (t > UINT32_MAX)
+			t = UINT32_MAX;
+		t = (uint32_t)t;
+		m = work / t;
+		if (m > max_m_cost)
+			m = max_m_cost;
+	}
 
+	*t_cost = (uint32_t)t;
+	*m_cost = m < min_m_cost ? min_m_cost : (uint32_t)m;
 	return CONTINUE;
 }
 
+static void argon2_model_fit(struct argon2_model *model,
+			     double work1, long ms1, double work2, long ms2)
+{
+	model->a = (ms2 - ms1) / (work2 - work1);
+	model->b = ms1 - model->a * work1;
+
+	/* Measurement noise, use only the longer run */
+	if (model->a <= 0.0 || model->b < 0.0) {
+		model->a = ms2 / work2;
+		model->b = 0.0;
+	}
+}
+
 static int crypt_argon2_check(const char *kdf, const char *password,
 			      size_t password_length, const char *salt,
 			      size_t salt_length, size_t key_length,
@@ -208,10 +210,12 @@ static int crypt_argon2_check(const char *kdf, const char *password,
 			      int (*progress)(uint32_t time_ms, void *usrptr),
 			      void *usrptr)
 {
-	int r = 0;
+	int r = 0, step;
 	char *key = NULL;
-	uint32_t t_cost, m_cost, min_m_cost = 8 * parallel;
-	long ms;
+	struct argon2_model model;
+	uint32_t t_cost, m_cost, min_m_cost = 8 * parallel, old_t_cost, old_m_cost;
+	double work1, work2;
+	long ms, ms1;
 	long ms_atleast = (long)target_ms * BENCH_PERCENT_ATLEAST / 100;
 	long ms_atmost = (long)target_ms * BENCH_PERCENT_ATMOST / 100;
 
@@ -228,11 +232,11 @@ static int crypt_argon2_check(const char *kdf, const char *password,
 	t_cost = min_t_cost;
 	m_cost = min_m_cost;
 
-	/* 1. Find some small parameters, s. t. ms >= BENCH_MIN_MS: */
+	/* 1. Find some small parameters, s. t. ms >= BENCH_PROBE_MS: */
 	while (1) {
 		r = measure_argon2(kdf, password, password_length, salt, salt_length,
 		                   key, key_length, t_cost, m_cost, parallel,
-		                   BENCH_SAMPLES_FAST, BENCH_MIN_MS, &ms);
+		                   BENCH_SAMPLES_FAST, BENCH_PROBE_MS, &ms);
 		if (!r) {
 			/* Update parameters to actual measurement */
 			*out_t_cost = t_cost;
@@ -244,14 +248,14 @@ static int crypt_argon2_check(const char *kdf, const char *password,
 		if (r < 0)
 			goto out;
 
-		if (ms >= BENCH_MIN_MS)
+		if (ms >= BENCH_PROBE_MS)
 			break;
 
 		if (m_cost == max_m_cost) {
 			if (ms < BENCH_MIN_MS_FAST)
 				t_cost *= 16;
 			else {
-				uint32_t new = (t_cost * BENCH_MIN_MS) / (uint32_t)ms;
+				uint32_t new = (t_cost * BENCH_PROBE_MS) / (uint32_t)ms + 1;
 				if (new == t_cost)
 					break;
 
@@ -261,7 +265,7 @@ static int crypt_argon2_check(const char *kdf, const char *password,
 			if (ms < BENCH_MIN_MS_FAST)
 				m_cost *= 16;
 			else {
-				uint32_t new = (m_cost * BENCH_MIN_MS) / (uint32_t)ms;
+				uint32_t new = (m_cost * BENCH_PROBE_MS) / (uint32_t)ms + 1;
 				if (new == m_cost)
 					break;
 
@@ -272,14 +276,51 @@ static int crypt_argon2_check(const char *kdf, const char *password,
 			}
 		}
 	}
+
 	/*
-	 * 2. Use the params obtained in (1.) to estimate the target params.
-	 * 3. Then repeatedly measure the candidate params and if they fall out of
-	 * the acceptance range (+-5 %), try to improve the estimate:
+	 * 2. Second probe at about 1/BENCH_PROBE_FRACTION of target time gives
+	 * the model. Large memory cost shows the real per-block cost better.
 	 */
-	do {
-		if (next_argon2_params(&t_cost, &m_cost, min_t_cost, min_m_cost,
-				       max_m_cost, ms, target_ms)) {
+	ms1 = ms;
+	work1 = (double)t_cost * m_cost;
+	work2 = work1 * target_ms / (BENCH_PROBE_FRACTION * ms1);
+	if (work2 < 2 * work1)
+		work2 = 2 * work1;
+	if (work2 / t_cost <= max_m_cost)
+		m_cost = (uint32_t)(work2 / t_cost);
+	else {
+		m_cost = max_m_cost;
+		t_cost = (uint32_t)(work2 / max_m_cost) + 1;
+	}
+
+	r = measure_argon2(kdf, password, password_length, salt, salt_length,
+			   key, key_length, t_cost, m_cost, parallel,
+			   BENCH_SAMPLES_SLOW, 0, &ms);
+	if (!r) {
+		*out_t_cost = t_cost;
+		*out_m_cost = m_cost;
+		if (progress && progress((uint32_t)ms, usrptr))
+			r = -EINTR;
+	}
+	if (r < 0)
+		goto out;
+
+	work2 = (double)t_cost * m_cost;
+	argon2_model_fit(&model, work1, ms1, work2, ms);
+	work1 = work2;
+	ms1 = ms;
+
+	/*
+	 * 3. Jump to the predicted target params and verify them. If they fall
+	 * out of the acceptance range (-5 %, +10 %), correct the slope.
+	 */
+	for (step = 0; step < BENCH_MAX_STEPS; step++) {
+		old_t_cost = t_cost;
+		old_m_cost = m_cost;
+		if (argon2_model_predict(&model, (ms_atleast + ms_atmost) / 2,
+					 min_t_cost, min_m_cost, max_m_cost,
+					 &t_cost, &m_cost) == FINAL ||
+		    (step && old_t_cost == t_cost && old_m_cost == m_cost)) {
 			/* Update parameters to final computation */
 			*out_t_cost = t_cost;
 			*out_m_cost = m_cost;
@@ -298,10 +339,15 @@ static int crypt_argon2_check(const char *kdf, const char *password,
 				r = -EINTR;
 		}
 
-		if (r < 0)
+		if (r < 0 || (ms >= ms_atleast && ms <= ms_atmost))
 			break;
 
-	} while (ms < ms_atleast || ms > ms_atmost);
+		/* Refit from the last two (largest) measurements */
+		work2 = (double)t_cost * m_cost;
+		argon2_model_fit(&model, work1, ms1, work2, ms);
+		work1 = work2;
+		ms1 = ms;
+	}
 out:
 	if (key) {
 		crypt_backend_memzero(key, key_length);
@@ -319,8 +365,9 @@ static int crypt_pbkdf_check(const char *kdf, const char *hash,
 
 {
 	struct rusage rstart, rend;
+	struct timespec tstart, tend;
 	int r = 0, step = 0;
-	long ms = 0;
+	long ms = 0, wall_ms;
 	char *key = NULL;
 	uint32_t iterations;
 	double PBKDF2_temp;
@@ -335,7 +382,8 @@ static int crypt_pbkdf_check(const char *kdf, const char *hash,
 	*iter_secs = 0;
 	iterations = 1 << 15;
 	while (1) {
-		if (getrusage(RUSAGE_SELF, &rstart) < 0) {
+		if (getrusage(RUSAGE_SELF, &rstart) < 0 ||
+		    clock_gettime(CLOCK_MONOTONIC_RAW, &tstart) < 0) {
 			r = -EINVAL;
 			goto out;
 		}
@@ -346,12 +394,21 @@ static int crypt_pbkdf_check(const char *kdf, const char *hash,
 		if (r < 0)
 			goto out;
 
-		if (getrusage(RUSAGE_SELF, &rend) < 0) {
+		if (getrusage(RUSAGE_SELF, &rend) < 0 ||
+		    clock_gettime(CLOCK_MONOTONIC_RAW, &tend) < 0) {
 			r = -EINVAL;
 			goto out;
 		}
 
+		/*
+		 * Output blocks of large keys can be derived on several threads,
+		 * then CPU time is the sum over threads. Use real time if shorter,
+		 * otherwise CPU time (not influenced by other load) as before.
+		 */
 		ms = time_ms(&rstart, &rend);
+		wall_ms = timespec_ms(&tstart, &tend);
+		if (wall_ms >= 0 && wall_ms < ms)
+			ms = wall_ms;
 		if (ms) {
 			PBKDF2_temp = (double)iterations * target_ms / ms;
 			if (PBKDF2_temp > UINT32_MAX)
@@ -415,11 +472,15 @@ int crypt_pbkdf_perf(const char *kdf, const char *hash,
 				      salt, salt_size, volume_key_size,
 				      iterations_out, time_ms, progress, usrptr);
 
-	else if (!strncmp(kdf, "argon2", 6))
+	else if (!strncmp(kdf, "argon2", 6)) {
+		/* benchmark runs repeat with similar memory cost */
+		crypt_argon2_pool_get();
 		r = crypt_argon2_check(kdf, password, password_size,
 				       salt, salt_size, volume_key_size,
 				       pbkdf_limits.min_iterations, max_memory_kb,
 				       parallel_threads, time_ms, iterations_out,
 				       memory_out, progress, usrptr);
+		crypt_argon2_pool_put();
+	}
 	return r;
 }
@@ -53,7 +53,7 @@ static int INTEGRITY_read_superblock(struct crypt_device *cd,
 		r = 0;
 	}
 
-	close(devfd);
+	device_close(device, devfd);
 	return r;
 }
 
@@ -207,6 +207,8 @@ int INTEGRITY_activate(struct crypt_device *cd,
 		dmdi.u.integrity.journal_commit_time = params->journal_commit_time;
 		dmdi.u.integrity.interleave_sectors = params->interleave_sectors;
 		dmdi.u.integrity.buffer_sectors = params->buffer_sectors;
+		crypt_get_integrity_bitmap(cd, &dmdi.u.integrity.sectors_per_bit,
+					   &dmdi.u.integrity.bitmap_flush_time);
 		dmdi.u.integrity.integrity = params->integrity;
 		dmdi.u.integrity.journal_integrity = params->journal_integrity;
 		dmdi.u.integrity.journal_crypt = params->journal_crypt;
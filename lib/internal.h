@@ -76,6 +76,44 @@ int verify_pbkdf_params(struct crypt_device *cd,
 int crypt_benchmark_pbkdf_internal(struct crypt_device *cd,
 				   struct crypt_pbkdf_type *pbkdf,
 				   size_t volume_key_size);
+int crypt_pbkdf_cache_get(const struct crypt_pbkdf_type *pbkdf, size_t volume_key_size,
+			  uint32_t *iterations, uint32_t *memory_kb);
+void crypt_pbkdf_cache_put(const struct crypt_pbkdf_type *pbkdf, size_t volume_key_size,
+			   uint32_t iterations, uint32_t memory_kb);
+
+/* Keyslot trial order by unlock history (if enabled) */
+void crypt_keyslot_history_sort(const char *uuid, int *keyslots, int count);
+void crypt_keyslot_history_hit(const char *uuid, int keyslot);
+
+/* Concurrent key derivation of unlock candidates */
+struct crypt_pbkdf_job {
+	const char *type;
+	const char *hash;
+	const char *salt;
+	size_t salt_length;
+	uint32_t iterations;
+	uint32_t max_memory_kb;
+	uint32_t parallel_threads;
+	const char *password;	/* optional, overrides batch password */
+	size_t password_length;
+	struct volume_key *key;	/* derived key, allocated by caller */
+	int r;
+	int state;
+};
+
+struct crypt_pbkdf_jobs;
+int crypt_pbkdf_jobs_start(struct crypt_pbkdf_jobs **jobs,
+			   struct crypt_pbkdf_job *job, unsigned count,
+			   const char *password, size_t password_length);
+int crypt_pbkdf_jobs_wait(struct crypt_pbkdf_jobs *jobs, unsigned idx);
+void crypt_pbkdf_jobs_stop(struct crypt_pbkdf_jobs *jobs);
+
+struct crypt_pbkdf_shared;
+int crypt_pbkdf_shared_init(struct crypt_pbkdf_shared **shared);
+void crypt_pbkdf_shared_free(struct crypt_pbkdf_shared *shared);
+int crypt_pbkdf_shared_derive(struct crypt_pbkdf_shared *shared,
+			      struct crypt_pbkdf_job *job,
+			      const char *password, size_t password_length);
 
 /* Device backend */
 struct device;
@@ -93,14 +131,25 @@ size_t device_block_size(struct device *device);
 int device_read_ahead(struct device *device, uint32_t *read_ahead);
 int device_size(struct device *device, uint64_t *size);
 int device_open(struct device *device, int flags);
+void device_close(struct device *device, int devfd);
 void device_disable_direct_io(struct device *device);
 int device_is_identical(struct device *device1, struct device *device2);
 int device_is_rotational(struct device *device);
+int device_zeroout(struct device *device, int devfd, uint64_t offset, uint64_t length);
 size_t device_alignment(struct device *device);
+ssize_t device_read_at(struct device *device, int devfd,
+		       void *buf, size_t length, off_t offset);
+ssize_t device_write_at(struct device *device, int devfd,
+			const void *buf, size_t length, off_t offset);
+ssize_t device_writev_at(struct device *device, int devfd,
+			 const struct iovec *iov, int iovcnt, off_t offset);
+void *device_alloc_aligned(struct device *device, size_t size);
+void device_free_aligned(struct device *device, void *buf);
 int device_direct_io(const struct device *device);
 int device_fallocate(struct device *device, uint64_t size);
 
 int device_open_locked(struct device *device, int flags);
+void device_set_optimistic_read(struct device *device, int enable);
 int device_read_lock(struct crypt_device *cd, struct device *device);
 int device_write_lock(struct crypt_device *cd, struct device *device);
 void device_read_unlock(struct device *device);
@@ -123,9 +172,22 @@ struct device *crypt_metadata_device(struct crypt_device *cd);
 struct device *crypt_data_device(struct crypt_device *cd);
 
 int crypt_confirm(struct crypt_device *cd, const char *msg);
+void crypt_trace(struct crypt_device *cd, crypt_trace_phase phase, int end, uint64_t bytes);
+
+/* Progress telemetry of long-running operations */
+struct crypt_progress_wrap {
+	struct crypt_device *cd;
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr);
+	void *usrptr;
+};
+void crypt_progress_start(struct crypt_device *cd, const char *operation);
+void crypt_progress_update(struct crypt_device *cd, uint64_t size, uint64_t offset);
+void crypt_progress_io_error(struct crypt_device *cd, int retried);
+int crypt_progress_wrapped(uint64_t size, uint64_t offset, void *usrptr);
 
 char *crypt_lookup_dev(const char *dev_id);
 int crypt_dev_is_rotational(int major, int minor);
+int crypt_dev_discard_zeroes_data(int major, int minor);
 int crypt_dev_is_partition(const char *dev_path);
 char *crypt_get_partition_device(const char *dev_path, uint64_t offset, uint64_t size);
 char *crypt_get_base_device(const char *dev_path);
@@ -178,15 +240,52 @@ int crypt_wipe_device(struct crypt_device *cd,
 	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
 	void *usrptr);
 
+int crypt_keyslot_area_read_cached(struct crypt_device *cd, char *dst,
+	size_t length, uint64_t offset);
+
+int crypt_backup_file_open(struct crypt_device *cd, const char *backup_file, size_t size);
+int crypt_backup_file_copy(struct crypt_device *cd, struct device *device,
+			   int fd, size_t length);
+
+int crypt_digest_cache_check(struct crypt_device *cd, int digest,
+	const char *tag, size_t tag_len, const struct volume_key *vk);
+void crypt_digest_cache_store(struct crypt_device *cd, int digest,
+	const char *tag, size_t tag_len, const struct volume_key *vk);
+
+struct crypt_wipe_area {
+	uint64_t offset;
+	uint64_t length;
+};
+
+int crypt_wipe_device_areas(struct crypt_device *cd,
+	struct device *device,
+	crypt_wipe_pattern pattern,
+	struct crypt_wipe_area *areas,
+	unsigned count);
+
+int crypt_wipe_device_init(struct crypt_device *cd,
+	struct device *device,
+	uint64_t offset,
+	uint64_t length);
+
 /* Internal integrity helpers */
 const char *crypt_get_integrity(struct crypt_device *cd);
 int crypt_get_integrity_key_size(struct crypt_device *cd);
 int crypt_get_integrity_tag_size(struct crypt_device *cd);
 
+/* Internal verity helpers (userspace hash options) */
+unsigned crypt_get_verity_threads(struct crypt_device *cd);
+uint32_t crypt_get_verity_sample(struct crypt_device *cd);
+int crypt_get_verity_data_fd(struct crypt_device *cd);
+
 int crypt_key_in_keyring(struct crypt_device *cd);
 void crypt_set_key_in_keyring(struct crypt_device *cd, unsigned key_in_keyring);
 int crypt_volume_key_load_in_keyring(struct crypt_device *cd, struct volume_key *vk);
 int crypt_use_keyring_for_vk(const struct crypt_device *cd);
+int crypt_unlock_serial(const struct crypt_device *cd);
+struct crypt_pbkdf_shared *crypt_get_pbkdf_shared(const struct crypt_device *cd);
+const struct crypt_metadata_limits *crypt_get_metadata_limits(struct crypt_device *cd);
+int crypt_header_transaction_defer(struct crypt_device *cd);
 void crypt_drop_keyring_key(struct crypt_device *cd, const char *key_description);
 
 static inline uint64_t version(uint16_t major, uint16_t minor, uint16_t patch, uint16_t release)
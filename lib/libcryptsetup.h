@@ -27,6 +27,17 @@
  *
  * For more verbose examples of LUKS related use cases,
  * please read @ref index "examples".
+ *
+ * Thread safety: one @e crypt_device context must be used by only one thread
+ * at a time, independent contexts (for different devices) can be used from
+ * different threads concurrently. Library internal state (crypto backend,
+ * RNG, device-mapper version probe, kernel keyring detection) is initialised
+ * once and protected internally.
+ * Process-wide settings (@link crypt_set_debug_level @endlink,
+ * @link crypt_set_log_callback @endlink with @e NULL context,
+ * @link crypt_metadata_locking @endlink and
+ * @link crypt_volume_key_keyring @endlink with @e NULL context)
+ * should be configured before other threads start using the library.
  */
 
 #ifndef _LIBCRYPTSETUP_H
@@ -160,6 +171,11 @@ int crypt_set_data_device(struct crypt_device *cd, const char *device);
  * @param usrptr provided identification in callback
  * @param level log level below (debug messages can uses other levels)
  * @param msg log message
+ *
+ * @note Messages of a context (including device-mapper errors) are sent
+ * 	 to the context log function, debug messages and messages without
+ * 	 context use the default log function.
+ * @note Setting the default log function is not thread safe.
  */
 void crypt_set_log_callback(struct crypt_device *cd,
 	void (*log)(int level, const char *msg, void *usrptr),
@@ -175,6 +191,84 @@ void crypt_set_log_callback(struct crypt_device *cd,
  * @param msg log message
  */
 void crypt_log(struct crypt_device *cd, int level, const char *msg);
+
+/**
+ * Phases of device unlock and activation reported to trace callback.
+ *
+ * @note Phases can be nested, for example @e CRYPT_TRACE_HDR_READ
+ *	 includes @e CRYPT_TRACE_HDR_VALIDATE.
+ */
+typedef enum {
+	CRYPT_TRACE_HDR_READ = 0,	/**< on-disk metadata read (bytes read) */
+	CRYPT_TRACE_HDR_VALIDATE,	/**< metadata parsing and validation (metadata size) */
+	CRYPT_TRACE_PBKDF,		/**< passphrase key derivation (memory cost) */
+	CRYPT_TRACE_KEYSLOT_DECRYPT,	/**< keyslot area read and decrypt (area size) */
+	CRYPT_TRACE_AF_MERGE,		/**< anti-forensic merge (area size) */
+	CRYPT_TRACE_DIGEST_VERIFY,	/**< volume key digest verification (key size) */
+	CRYPT_TRACE_KEYRING,		/**< volume key upload to kernel keyring (key size) */
+	CRYPT_TRACE_DM_CREATE,		/**< device-mapper table load, resume and udev wait */
+	CRYPT_TRACE_LOCK_WAIT,		/**< waiting for metadata lock held by other process */
+	CRYPT_TRACE_PHASES		/**< number of phases, not a phase */
+} crypt_trace_phase;
+
+/**
+ * Set trace function.
+ *
+ * The callback is called at start and at end of every traced phase.
+ * If not defined, tracing has no runtime cost besides a pointer check.
+ *
+ * @param cd crypt device handle (can be @e NULL to set default trace function)
+ * @param trace user defined trace function reference
+ * @param usrptr provided identification in callback
+ * @param phase traced phase
+ * @param end @e 0 at phase start, @e 1 at phase end
+ * @param usec monotonic timestamp in microseconds
+ * @param bytes amount of data processed in phase (valid at phase end only)
+ */
+void crypt_set_trace_callback(struct crypt_device *cd,
+	void (*trace)(crypt_trace_phase phase, int end, uint64_t usec,
+		      uint64_t bytes, void *usrptr),
+	void *usrptr);
+
+/**
+ * Get name of traced phase.
+ *
+ * @param phase traced phase
+ *
+ * @return phase name or @e NULL for unknown phase
+ */
+const char *crypt_trace_phase_name(crypt_trace_phase phase);
+
+/**
+ * Telemetry of long-running operation reported to progress callback.
+ */
+struct crypt_progress {
+	const char *operation;	/**< "wipe", "reencrypt", "verity-create" or "verity-verify" */
+	uint64_t size;		/**< size of processed area (in bytes) */
+	uint64_t offset;	/**< offset as reported to operation callback (in bytes) */
+	uint64_t elapsed_usec;	/**< time since the first report */
+	uint64_t rate;		/**< throughput since the previous report (bytes/s) */
+	uint64_t rate_avg;	/**< smoothed throughput (bytes/s) */
+	uint64_t eta_usec;	/**< estimated remaining time or @e 0 if not yet known */
+	uint32_t io_errors;	/**< failed I/O operations */
+	uint32_t io_retries;	/**< I/O requests repeated using a fallback method */
+};
+
+/**
+ * Set progress telemetry function.
+ *
+ * The callback is called on every progress update of @ref crypt_wipe,
+ * @ref crypt_reencrypt and verity hash area creation or verification,
+ * in addition to the operation progress callback (if any).
+ *
+ * @param cd crypt device handle
+ * @param progress user defined telemetry function reference
+ * @param usrptr provided identification in callback
+ * @param p current telemetry of running operation
+ */
+void crypt_set_progress_callback(struct crypt_device *cd,
+	void (*progress)(const struct crypt_progress *p, void *usrptr),
+	void *usrptr);
 /** @} */
 
 /**
@@ -246,6 +340,118 @@ struct crypt_pbkdf_type {
 int crypt_set_pbkdf_type(struct crypt_device *cd,
 	 const struct crypt_pbkdf_type *pbkdf);
 
+/** Run Argon2 on the NUMA node of the calling CPU (default) */
+#define CRYPT_PBKDF_NUMA_AUTO -1
+/** Do not restrict Argon2 placement */
+#define CRYPT_PBKDF_NUMA_NONE -2
+
+/**
+ * Set NUMA node used for Argon2 computation (benchmark and unlock).
+ *
+ * @param cd crypt device handle (can be @e NULL)
+ * @param node node number, @e CRYPT_PBKDF_NUMA_AUTO or @e CRYPT_PBKDF_NUMA_NONE
+ *
+ * @return 0 on success or negative errno value otherwise.
+ *
+ * @note Placement is applied only on systems with more memory nodes
+ *       and if the node has enough allowed CPUs for all Argon2 threads.
+ * @note The switch is global on the library level.
+ */
+int crypt_set_pbkdf_numa_node(struct crypt_device *cd, int node);
+
+/**
+ * Run Argon2 key derivations (benchmark and unlock) in pre-forked helper processes.
+ *
+ * Every helper runs one derivation at a time and keeps its Argon2 memory
+ * mapped between requests, so the calling process never maps Argon2 memory
+ * and the number of concurrent derivations is limited by the helper count.
+ * If a helper crashes, its derivation is repeated in-process and the helper
+ * is not replaced until this function is called again. Helpers exit when
+ * the calling process closes their sockets (or exits).
+ *
+ * @param helpers number of helper processes (up to 64), @e 0 to stop helpers
+ *	  and derive keys in-process again (default)
+ * @param max_memory_kb Argon2 memory reserved in advance in every helper [kilobytes]
+ *
+ * @return 0 on success or negative errno value otherwise.
+ *
+ * @note The switch is global on the library level. Helpers are created by fork(),
+ *	 call it before the process starts other threads.
+ */
+int crypt_set_pbkdf_helpers(unsigned helpers, uint32_t max_memory_kb);
+
+/**
+ * Set memory budget for concurrently running Argon2 key derivations.
+ *
+ * Derivations (from all threads, contexts and PBKDF benchmarks) are admitted
+ * in arrival order while the sum of their memory cost fits into the budget,
+ * the others wait. A derivation is always admitted if no other one runs.
+ *
+ * @param memory_kb budget [kilobytes], @e 0 means half of physical memory (default)
+ * @param shared if set, the budget is shared with other processes using
+ *	  the same option (through a semaphore keyed by a file in the locking directory)
+ *
+ * @return 0 on success or negative errno value otherwise.
+ *
+ * @note The shared budget size is defined by the process that created it first,
+ *	 the system semaphore stays until removed (ipcrm) or reboot.
+ * @note The switch is global on the library level.
+ */
+int crypt_set_pbkdf_memory_budget(uint64_t memory_kb, int shared);
+
+/**
+ * Set file used as persistent PBKDF calibration cache (for all contexts).
+ * Costs are then benchmarked only once for the same CPU model, crypto backend,
+ * PBKDF type and requested parameters and volume key size.
+ *
+ * @param path cache file path or @e NULL to disable cache (default)
+ *
+ * @return 0 on success or negative errno value otherwise.
+ *
+ * @note Cache file not owned by the current user or writable by group or others
+ *       is ignored. Cached values define keyslot cost, the file must be trusted.
+ */
+int crypt_set_pbkdf_cache(const char *path);
+
+/**
+ * Remove all entries from PBKDF calibration cache.
+ *
+ * @return 0 on success or negative errno value otherwise.
+ */
+int crypt_pbkdf_cache_invalidate(void);
+
+/**
+ * Run PBKDF benchmark and store the result in PBKDF calibration cache.
+ * PBKDF parameters are set for the context the same way
+ * as with @link crypt_set_pbkdf_type @endlink.
+ *
+ * @param cd crypt device handle
+ * @param pbkdf PBKDF parameters or @e NULL for context type default
+ * @param volume_key_size size of key derived in keyslot
+ *
+ * @return 0 on success or negative errno value otherwise.
+ */
+int crypt_pbkdf_cache_warm(struct crypt_device *cd,
+	const struct crypt_pbkdf_type *pbkdf,
+	size_t volume_key_size);
+
+/**
+ * Set file used as host-local keyslot unlock history (for all contexts).
+ * If set, every successful keyslot unlock is recorded and LUKS keyslots
+ * of the same priority are tried in descending unlock count order
+ * when no keyslot is specified.
+ *
+ * @param path history file path or @e NULL to disable history (default)
+ *
+ * @return 0 on success or negative errno value otherwise.
+ *
+ * @note Keyslot priority (see @link crypt_keyslot_set_priority @endlink)
+ *       still takes precedence, history only reorders keyslots within the same priority.
+ * @note History file not owned by the current user or writable by group or others
+ *       is ignored. Metadata on disk is never modified.
+ */
+int crypt_set_keyslot_history(const char *path);
+
 /**
  * Get default PBKDF (Password-Based Key Derivation Algorithm) settings for keyslots.
  * Works only with LUKS device handles (both versions).
@@ -291,6 +497,9 @@ void crypt_set_iteration_time(struct crypt_device *cd, uint64_t iteration_time_m
  *
  * @note Only root can do this.
  * @note It locks/unlocks all process memory, not only crypt context.
+ * @note Volume keys and passphrases handled by the library are allocated
+ *	 in locked memory excluded from core dumps, locking all process memory
+ *	 is not required to keep them out of swap.
  */
 int crypt_memory_lock(struct crypt_device *cd, int lock);
 
@@ -305,6 +514,7 @@ int crypt_memory_lock(struct crypt_device *cd, int lock);
  * @note Locking applied only for some metadata formats (LUKS2).
  * @note The switch is global on the library level.
  * 	 In current version locking can be only switched off and cannot be switched on later.
+ * @note Not thread safe, switch it off before contexts are used in other threads.
  */
 int crypt_metadata_locking(struct crypt_device *cd, int enable);
 /** @} */
@@ -415,6 +625,18 @@ struct crypt_params_verity {
 #define CRYPT_VERITY_CHECK_HASH  (1 << 1)
 /** Create hash - format hash device */
 #define CRYPT_VERITY_CREATE_HASH (1 << 2)
+/** Create hash in one pass from data read sequentially from descriptor set by
+ *  @link crypt_verity_set_data_fd @endlink, data are copied to the data device
+ *  (requires known data size) */
+#define CRYPT_VERITY_DATA_STREAM (1 << 3)
+
+/**
+ * Range of changed data blocks for @link crypt_verity_update @endlink.
+ */
+struct crypt_verity_range {
+	uint64_t offset; /**< first data block */
+	uint64_t length; /**< number of data blocks */
+};
 
 /**
  *
@@ -449,6 +671,11 @@ struct crypt_params_tcrypt {
  *  VeraCrypt device is reported as TCRYPT type.
  */
 #define CRYPT_TCRYPT_VERA_MODES      (1 << 4)
+/** Activate cipher chain with inner chain devices processing I/O inline
+ *  (without dm-crypt workqueues) if supported by kernel,
+ *  otherwise the default stacked mapping is used.
+ */
+#define CRYPT_TCRYPT_CHAIN_INLINE    (1 << 5)
 
 /**
  *
@@ -623,6 +850,106 @@ int crypt_load(struct crypt_device *cd,
 	const char *requested_type,
 	void *params);
 
+/**
+ * Result of on-disk signature probe, see @ref crypt_probe_devices.
+ */
+struct crypt_probe_result {
+	int status;		/**< 0 on success, -ENOENT if no known signature, negative errno otherwise */
+	const char *type;	/**< @link crypt-type @endlink or @e NULL */
+	char uuid[40];		/**< UUID string (empty for @e CRYPT_INTEGRITY) */
+	char label[48];		/**< label (only for @e CRYPT_LUKS2) */
+	uint64_t header_size;	/**< size of header in bytes (see note) */
+};
+
+/**
+ * Probe devices for known on-disk signatures.
+ *
+ * Only the first 4 KiB of every device is read (no metadata locking,
+ * no checksum or metadata validation, no crypto backend initialisation).
+ * Devices are processed in parallel.
+ *
+ * @param paths array of device paths
+ * @param count number of devices in @e paths
+ * @param results array of @e count results, @e results[i] belongs to @e paths[i]
+ *
+ * @returns 0 if all devices were processed (per device status in results)
+ *          or negative errno value otherwise.
+ *
+ * @note Header size is primary binary and JSON header size for LUKS2,
+ * 	 binary header with the end of keyslot area for LUKS1,
+ * 	 hash block (superblock area) size for VERITY and superblock
+ * 	 size for INTEGRITY.
+ * @note The result is a hint only, use @ref crypt_load to validate metadata.
+ */
+int crypt_probe_devices(const char **paths, size_t count,
+	struct crypt_probe_result *results);
+
+/**
+ * Enable or disable reuse of already loaded LUKS2 metadata.
+ *
+ * If enabled, repeated @ref crypt_load on the same context reads only both
+ * binary LUKS2 headers and keeps already parsed and validated metadata
+ * if sequence id and checksums on the same device did not change.
+ *
+ * @param cd crypt device handle
+ * @param enable 0 to disable (default), otherwise enable
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ */
+int crypt_set_metadata_cache(struct crypt_device *cd, int enable);
+
+/**
+ * Limits for parsing and validation of (untrusted) LUKS2 JSON metadata.
+ * Zero value in any field means the default (no limit for objects and time).
+ */
+struct crypt_metadata_limits {
+	uint32_t max_depth;   /**< maximal nesting level of JSON objects and arrays */
+	uint32_t max_objects; /**< maximal number of JSON values in one metadata copy */
+	uint32_t max_time_ms; /**< maximal parse and validation time of one metadata copy (ms) */
+};
+
+/**
+ * Set limits for LUKS2 metadata parsing in @ref crypt_load.
+ *
+ * Metadata exceeding any limit are treated as invalid (as a corrupted header copy).
+ *
+ * @param cd crypt device handle
+ * @param limits parser limits, @e NULL restores defaults
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ */
+int crypt_set_metadata_limits(struct crypt_device *cd,
+	const struct crypt_metadata_limits *limits);
+
+/**
+ * Start LUKS2 header transaction.
+ *
+ * Until @ref crypt_header_transaction_commit, all metadata changes
+ * (keyslots, tokens, flags, ...) are kept in memory only and
+ * the header is written to disk once at commit.
+ *
+ * @param cd crypt device handle
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note Only LUKS2 is supported. Keyslot binary areas are still written
+ *       immediately, only JSON metadata is deferred.
+ * @note Uncommitted changes are lost when the context is released.
+ */
+int crypt_header_transaction_begin(struct crypt_device *cd);
+
+/**
+ * Finish LUKS2 header transaction and write header to disk.
+ *
+ * @param cd crypt device handle
+ *
+ * @returns @e 0 on success or negative errno value otherwise.
+ *
+ * @note If any operation inside transaction failed, no change is written
+ *       and in-memory metadata is reloaded from disk (error is returned).
+ */
+int crypt_header_transaction_commit(struct crypt_device *cd);
+
 /**
  * Try to repair crypt device LUKS1 on-disk header if invalid.
  *
@@ -669,12 +996,53 @@ int crypt_resize(struct crypt_device *cd,
  *
  * @return 0 on success or negative errno value otherwise.
  *
- * @note Only LUKS device type is supported
+ * @note Only LUKS device type is supported, device with online
+ *	 reencryption in progress cannot be suspended (@e -ENOTSUP).
  *
  */
 int crypt_suspend(struct crypt_device *cd,
 	const char *name);
 
+/**
+ * Suspend crypt device and retain its volume key in kernel user keyring.
+ *
+ * The volume key is wiped from the device-mapper table as with
+ * @ref crypt_suspend, but a copy is kept in the user keyring so
+ * @ref crypt_resume_by_retained_key does not need to unlock a keyslot.
+ *
+ * @param cd crypt device handle
+ * @param name name of device to suspend
+ * @param timeout expiration of the retained key in seconds (@e 0 means no expiration)
+ *
+ * @return 0 on success or negative errno value otherwise.
+ *
+ * @note Volume key loaded in kernel keyring (LUKS2 default) cannot be
+ *	 read back and retained, such device must be activated with
+ *	 @ref CRYPT_ACTIVATE_KEYRING_KEY disabled.
+ * @note Only LUKS2 device is supported. The key is stored as a @e logon key,
+ *	 dm-crypt can use it but it cannot be read back from userspace.
+ */
+int crypt_suspend_retain_key(struct crypt_device *cd,
+	const char *name,
+	unsigned timeout);
+
+/**
+ * Resume crypt device using volume key retained by @ref crypt_suspend_retain_key.
+ *
+ * @param cd crypt device handle
+ * @param name name of device to resume
+ *
+ * @return 0 on success, @e -ENOENT if no usable retained key exists
+ *	   or negative errno value otherwise.
+ *
+ * @note Retained key is bound to the current volume key digest, after
+ *	 volume key change it is not found and @e -ENOENT is returned.
+ * @note After resume the device table references the key by its
+ *	 keyring description, as with @ref CRYPT_ACTIVATE_KEYRING_KEY.
+ */
+int crypt_resume_by_retained_key(struct crypt_device *cd,
+	const char *name);
+
 /**
  * Resume crypt device using passphrase.
  *
@@ -688,6 +1056,9 @@ int crypt_suspend(struct crypt_device *cd,
  * @return unlocked key slot number or negative errno otherwise.
  *
  * @note Only LUKS device type is supported
+ * @note Device left suspended by failed online reencryption step is
+ *	 reloaded with current segments, the passphrase must then unlock
+ *	 both old and new volume key (@e keyslot is ignored).
  */
 int crypt_resume_by_passphrase(struct crypt_device *cd,
 	const char *name,
@@ -902,6 +1273,40 @@ int crypt_keyslot_add_by_key(struct crypt_device *cd,
 	size_t passphrase_size,
 	uint32_t flags);
 
+/**
+ * New keyslot description for crypt_keyslot_add_batch().
+ */
+struct crypt_keyslot_add_entry {
+	int keyslot; /**< requested keyslot or CRYPT_ANY_SLOT, allocated keyslot on return */
+	const char *passphrase; /**< passphrase for new keyslot */
+	size_t passphrase_size; /**< size of @e passphrase */
+};
+
+/**
+ * Add several key slots using one unlock of existing passphrase.
+ *
+ * Volume key is unlocked once, PBKDF is benchmarked once for all new
+ * keyslots (with current PBKDF type), key derivations run in parallel and
+ * the header is written only once.
+ *
+ * @pre @e cd contains initialized and formatted LUKS2 device context
+ *
+ * @param cd crypt device handle
+ * @param passphrase passphrase used to unlock volume key
+ * @param passphrase_size size of passphrase (binary data)
+ * @param entries array of new keyslots
+ * @param count number of entries
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note If the function fails, no keyslot is added to the header.
+ */
+int crypt_keyslot_add_batch(struct crypt_device *cd,
+	const char *passphrase,
+	size_t passphrase_size,
+	struct crypt_keyslot_add_entry *entries,
+	size_t count);
+
 /**
  * Destroy (and disable) key slot.
  *
@@ -915,6 +1320,23 @@ int crypt_keyslot_add_by_key(struct crypt_device *cd,
  * @note Note that there is no passphrase verification used.
  */
 int crypt_keyslot_destroy(struct crypt_device *cd, int keyslot);
+
+/**
+ * Destroy (and disable) several key slots at once.
+ *
+ * Keyslot areas are wiped in one pass and the header is written only once.
+ *
+ * @pre @e cd contains initialized and formatted LUKS device context
+ *
+ * @param cd crypt device handle
+ * @param keyslots array of key slots to destroy
+ * @param count number of key slots in @e keyslots
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Note that there is no passphrase verification used.
+ */
+int crypt_keyslot_destroy_batch(struct crypt_device *cd, const int *keyslots, size_t count);
 /** @} */
 
 /**
@@ -958,6 +1380,18 @@ int crypt_keyslot_destroy(struct crypt_device *cd, int keyslot);
 #define CRYPT_ACTIVATE_CHECK_AT_MOST_ONCE (1 << 15)
 /** allow activation check including unbound keyslots (kesylots without segments) */
 #define CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY (1 << 16)
+/** dm-crypt: bypass internal workqueue and process read requests synchronously. */
+#define CRYPT_ACTIVATE_NO_READ_WORKQUEUE (1 << 17)
+/** dm-crypt: bypass internal workqueue and process write requests synchronously. */
+#define CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE (1 << 18)
+/** dm-crypt: use high-priority workqueues and writer thread. */
+#define CRYPT_ACTIVATE_HIGH_PRIORITY (1 << 19)
+/** dm-integrity: use bitmap instead of journal, dirty regions are recalculated after crash */
+#define CRYPT_ACTIVATE_NO_JOURNAL_BITMAP (1 << 20)
+/** dm-integrity: recalculate (initialize) integrity tags in background */
+#define CRYPT_ACTIVATE_RECALCULATE (1 << 21)
+/** dm-verity: try to verify in tasklet (softirq) if hash blocks are cached */
+#define CRYPT_ACTIVATE_TASKLETS (1 << 22)
 
 /**
  * Active device runtime attributes
@@ -983,6 +1417,69 @@ int crypt_get_active_device(struct crypt_device *cd,
 	const char *name,
 	struct crypt_active_device *cad);
 
+/**
+ * Active device entry returned by @ref crypt_list_active.
+ */
+struct crypt_active_entry {
+	char *name;      /**< active device name */
+	char *uuid;      /**< device-mapper UUID without CRYPT- prefix */
+	const char *target; /**< "crypt", "verity" or "integrity" */
+	char *device;    /**< underlying data device path (can be @e NULL) */
+	uint64_t offset; /**< offset in sectors (crypt target only) */
+	uint64_t iv_offset; /**< IV initialization sector (crypt target only) */
+	uint64_t size;   /**< active device size */
+	uint32_t flags;  /**< activation flags, CRYPT_ACTIVATE_CORRUPTED for corrupted verity */
+	int holders;     /**< device is used by other device or mounted filesystem */
+	uint64_t integrity_failures; /**< integrity failures (integrity target only) */
+	const char *type; /**< device type from UUID (e.g. @e CRYPT_LUKS2) or @e NULL */
+	char *cipher;    /**< cipher (crypt target only) */
+	char *cipher_mode; /**< cipher mode (crypt target only, @e NULL if not parsed) */
+	char *integrity; /**< integrity in dm-crypt table (crypt target only, can be @e NULL) */
+	uint32_t key_size; /**< volume key size in bytes (crypt target only) */
+	uint32_t sector_size; /**< encryption sector size (crypt target only) */
+};
+
+/**
+ * List all active devices created by libcryptsetup in one pass.
+ *
+ * @param cd crypt device handle, used for logging only (can be @e NULL)
+ * @param list allocated array of active devices
+ * @param count number of entries in @e list
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ *
+ * @note Release the list with @ref crypt_list_active_free.
+ */
+int crypt_list_active(struct crypt_device *cd,
+	struct crypt_active_entry **list,
+	size_t *count);
+
+/**
+ * Get active device entry (as in @ref crypt_list_active) for one device.
+ *
+ * All values are read from the device-mapper table and UUID only, no on-disk
+ * metadata are read and no locks are taken.
+ *
+ * @param cd crypt device handle, used for logging only (can be @e NULL)
+ * @param name active device name
+ * @param entry allocated entry
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ *
+ * @note Release the entry with @ref crypt_list_active_free (with count 1).
+ */
+int crypt_get_active_entry(struct crypt_device *cd,
+	const char *name,
+	struct crypt_active_entry **entry);
+
+/**
+ * Release list returned by @ref crypt_list_active.
+ *
+ * @param list list of active devices
+ * @param count number of entries in @e list
+ */
+void crypt_list_active_free(struct crypt_active_entry *list, size_t count);
+
 /**
  * Get detected number of integrity failures.
  *
@@ -994,6 +1491,66 @@ int crypt_get_active_device(struct crypt_device *cd,
  */
 uint64_t crypt_get_active_integrity_failures(struct crypt_device *cd,
 	const char *name);
+
+/**
+ * Corruption monitor handle.
+ */
+struct crypt_monitor;
+
+/**
+ * Corruption event reported by @ref crypt_monitor_dispatch.
+ */
+struct crypt_monitor_event {
+	const char *name;   /**< active device name */
+	const char *target; /**< "verity" or "integrity" */
+	uint64_t integrity_failures; /**< current integrity failures count */
+	int verity_corrupted; /**< verity device detected corruption */
+};
+
+/**
+ * Create monitor of all active verity and integrity devices.
+ *
+ * Verity corruption is detected from kernel uevents, integrity
+ * mismatch counters are rescanned with @e interval.
+ *
+ * @param mon pointer to monitor handle
+ * @param interval integrity counters rescan interval in seconds (@e 0 for default)
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ */
+int crypt_monitor_init(struct crypt_monitor **mon, uint32_t interval);
+
+/**
+ * Get pollable file descriptor of monitor.
+ *
+ * @param mon monitor handle
+ *
+ * @return file descriptor (readable when @ref crypt_monitor_dispatch
+ *	   should be called) or negative errno value otherwise
+ *
+ * @note The descriptor can be added to epoll or poll set of caller.
+ */
+int crypt_monitor_fd(struct crypt_monitor *mon);
+
+/**
+ * Process pending monitor events without blocking.
+ *
+ * @param mon monitor handle
+ * @param event callback called for every device with new corruption
+ * @param usrptr provided identification in callback
+ *
+ * @return number of reported events or negative errno value otherwise
+ */
+int crypt_monitor_dispatch(struct crypt_monitor *mon,
+	void (*event)(const struct crypt_monitor_event *ev, void *usrptr),
+	void *usrptr);
+
+/**
+ * Release monitor handle.
+ *
+ * @param mon monitor handle
+ */
+void crypt_monitor_free(struct crypt_monitor *mon);
 /** @} */
 
 /**
@@ -1007,6 +1564,8 @@ uint64_t crypt_get_active_integrity_failures(struct crypt_device *cd,
  */
 /** Unfinished offline reencryption */
 #define CRYPT_REQUIREMENT_OFFLINE_REENCRYPT	(1 << 0)
+/** Unfinished online reencryption (see @link crypt_reencrypt @endlink) */
+#define CRYPT_REQUIREMENT_ONLINE_REENCRYPT	(1 << 1)
 /** unknown requirement in header (output only) */
 #define CRYPT_REQUIREMENT_UNKNOWN		(1 << 31)
 
@@ -1169,31 +1728,369 @@ int crypt_activate_by_keyring(struct crypt_device *cd,
 	int keyslot,
 	uint32_t flags);
 
-/** lazy deactivation - remove once last user releases it */
-#define CRYPT_DEACTIVATE_DEFERRED (1 << 0)
-/** force deactivation - if the device is busy, it is replaced by error device */
-#define CRYPT_DEACTIVATE_FORCE    (1 << 1)
+/**
+ * Activation request for @ref crypt_activate_batch.
+ */
+struct crypt_activate_request {
+	struct crypt_device *cd; /**< crypt device handle */
+	const char *name;        /**< name of device to create */
+	int keyslot;             /**< requested keyslot or CRYPT_ANY_SLOT */
+	const char *passphrase;  /**< passphrase, or @e NULL if volume_key is used */
+	size_t passphrase_size;  /**< passphrase size */
+	const char *volume_key;  /**< volume key, used if passphrase is @e NULL */
+	size_t volume_key_size;  /**< volume key size */
+	uint32_t flags;          /**< activation flags */
+	int r;                   /**< output: unlocked keyslot or negative errno */
+};
 
 /**
- * Deactivate crypt device. This function tries to remove active device-mapper
- * mapping from kernel. Also, sensitive data like the volume key are removed from
- * memory
+ * Activate several devices at once.
  *
- * @param cd crypt device handle, can be @e NULL
- * @param name name of device to deactivate
- * @param flags deactivation flags
+ * Keyslots of all requests are unlocked concurrently first (within
+ * CPU and memory limits of the system), then all devices are created
+ * and the library waits for udev only once for the whole batch.
  *
- * @return @e 0 on success or negative errno value otherwise.
+ * @param req array of activation requests, each with its own device handle
+ * @param count number of requests
+ *
+ * @return @e 0 if all devices were activated, negative errno value of
+ *         the first failed request otherwise; per request result is
+ *         stored in @e r member of each request.
  *
+ * @note Requests are independent, failure of one request does not revert
+ *       or skip activation of other requests.
+ * @note Only PLAIN, LUKS1 and LUKS2 devices are supported. Keyfiles can
+ *       be read with @ref crypt_keyfile_read before the call.
  */
-int crypt_deactivate_by_name(struct crypt_device *cd,
-	const char *name,
+int crypt_activate_batch(struct crypt_activate_request *req, size_t count);
+
+/**
+ * Device of activation set for @ref crypt_activate_set.
+ */
+struct crypt_activate_set_device {
+	const char *device;      /**< device with LUKS header */
+	const char *name;        /**< name of device to create */
+	int r;                   /**< output: unlocked keyslot or negative errno */
+};
+
+/**
+ * Activate set of LUKS devices (e.g. disks of one RAID) with one passphrase.
+ *
+ * Headers of all devices are loaded concurrently and devices are activated
+ * as with @ref crypt_activate_batch. LUKS2 keyslots with identical PBKDF
+ * parameters and salt (headers cloned from one template) derive the keyslot
+ * key only once for the whole set, volume key of every device is still
+ * verified by its own digest.
+ *
+ * @param set array of devices to activate
+ * @param count number of devices
+ * @param passphrase passphrase, or @e NULL if key_description is used
+ * @param passphrase_size size of passphrase
+ * @param key_description kernel keyring key description of passphrase
+ *        (used if passphrase is @e NULL)
+ * @param keyslot requested keyslot to check or CRYPT_ANY_SLOT
+ * @param flags activation flags
+ *
+ * @return @e 0 if all devices were activated, negative errno value of
+ *         the first failed device otherwise; per device result is
+ *         stored in @e r member of each entry.
+ */
+int crypt_activate_set(struct crypt_activate_set_device *set, size_t count,
+	const char *passphrase, size_t passphrase_size,
+	const char *key_description, int keyslot, uint32_t flags);
+
+/**
+ * Keyslot check for @ref crypt_keyslot_verify_batch.
+ */
+struct crypt_keyslot_check {
+	struct crypt_device *cd; /**< crypt device handle with loaded LUKS header */
+	int keyslot;             /**< keyslot to verify */
+	const char *passphrase;  /**< passphrase expected to open the keyslot */
+	size_t passphrase_size;  /**< passphrase size */
+	int r;                   /**< output: 0 if verified or negative errno */
+	double kdf_ms;           /**< output: time of key derivation in ms */
+};
+
+/**
+ * Verify that keyslots still open with given passphrases (audit).
+ *
+ * Checks run concurrently on a pool of per-CPU threads (idle threads take
+ * over checks queued for busy ones), a check is started only if its PBKDF
+ * memory cost fits into half of physical memory together with running
+ * checks. Several checks can use the same device handle, LUKS2 key
+ * derivations of one device then run concurrently as well.
+ * Volume key is verified by its digest, no device is activated
+ * and no volume key is loaded to kernel keyring.
+ *
+ * @param req array of keyslot checks
+ * @param count number of checks
+ *
+ * @return @e 0 if all keyslots were verified, negative errno value of
+ *         the first failed check otherwise; per check result is stored
+ *         in @e r member (@e -EPERM for wrong passphrase, @e -ENOENT
+ *         for inactive keyslot).
+ *
+ * @note Device handles must not be used by other threads during the call.
+ */
+int crypt_keyslot_verify_batch(struct crypt_keyslot_check *req, size_t count);
+
+/**
+ * Asynchronous operation handle.
+ */
+struct crypt_async_op;
+
+/**
+ * Completion callback of asynchronous operation.
+ *
+ * @param op operation handle
+ * @param r result of operation (as of the synchronous variant)
+ * @param usrptr provided identification in callback
+ *
+ * @note Callback is called from internal worker thread. It may release
+ *       the operation handle with @ref crypt_async_free.
+ */
+typedef void (*crypt_async_callback)(struct crypt_async_op *op, int r, void *usrptr);
+
+/**
+ * Asynchronous variant of @ref crypt_activate_by_passphrase.
+ *
+ * The call returns immediately, unlock (KDF) and device-mapper work runs
+ * on a bounded internal thread pool shared by all asynchronous operations
+ * in the process. Completion is signalled by @e callback (if set) and
+ * by the descriptor returned by @ref crypt_async_fd.
+ *
+ * @param cd crypt device handle
+ * @param name name of device to create
+ * @param keyslot requested keyslot or CRYPT_ANY_SLOT
+ * @param passphrase passphrase (copied, can be released after the call)
+ * @param passphrase_size passphrase size
+ * @param flags activation flags
+ * @param callback completion callback (can be @e NULL)
+ * @param usrptr provided identification in callback
+ * @param op pointer to operation handle
+ *
+ * @return @e 0 if operation was queued or negative errno value otherwise
+ *         (@e -EBUSY if there is already pending operation on @e cd).
+ *
+ * @note The device handle must not be used until the operation completes.
+ * @note Release the handle with @ref crypt_async_free.
+ */
+int crypt_activate_by_passphrase_async(struct crypt_device *cd,
+	const char *name,
+	int keyslot,
+	const char *passphrase,
+	size_t passphrase_size,
+	uint32_t flags,
+	crypt_async_callback callback,
+	void *usrptr,
+	struct crypt_async_op **op);
+
+/**
+ * Asynchronous variant of @ref crypt_activate_by_token.
+ *
+ * @param cd crypt device handle
+ * @param name name of device to create
+ * @param token requested token or CRYPT_ANY_TOKEN
+ * @param token_usrptr provided identification in token callbacks
+ * @param flags activation flags
+ * @param callback completion callback (can be @e NULL)
+ * @param usrptr provided identification in completion callback
+ * @param op pointer to operation handle
+ *
+ * @return @e 0 if operation was queued or negative errno value otherwise
+ *
+ * @note Token handlers are called from internal worker thread.
+ */
+int crypt_activate_by_token_async(struct crypt_device *cd,
+	const char *name,
+	int token,
+	void *token_usrptr,
+	uint32_t flags,
+	crypt_async_callback callback,
+	void *usrptr,
+	struct crypt_async_op **op);
+
+/**
+ * Asynchronous variant of @ref crypt_resume_by_passphrase.
+ *
+ * @param cd crypt device handle
+ * @param name name of device to resume
+ * @param keyslot requested keyslot or CRYPT_ANY_SLOT
+ * @param passphrase passphrase (copied, can be released after the call)
+ * @param passphrase_size passphrase size
+ * @param callback completion callback (can be @e NULL)
+ * @param usrptr provided identification in callback
+ * @param op pointer to operation handle
+ *
+ * @return @e 0 if operation was queued or negative errno value otherwise
+ */
+int crypt_resume_by_passphrase_async(struct crypt_device *cd,
+	const char *name,
+	int keyslot,
+	const char *passphrase,
+	size_t passphrase_size,
+	crypt_async_callback callback,
+	void *usrptr,
+	struct crypt_async_op **op);
+
+/**
+ * Asynchronous variant of @ref crypt_keyslot_add_by_passphrase.
+ *
+ * @param cd crypt device handle
+ * @param keyslot requested keyslot or CRYPT_ANY_SLOT
+ * @param passphrase passphrase of existing keyslot (copied)
+ * @param passphrase_size passphrase size
+ * @param new_passphrase passphrase for new keyslot (copied)
+ * @param new_passphrase_size new passphrase size
+ * @param callback completion callback (can be @e NULL)
+ * @param usrptr provided identification in callback
+ * @param op pointer to operation handle
+ *
+ * @return @e 0 if operation was queued or negative errno value otherwise
+ */
+int crypt_keyslot_add_by_passphrase_async(struct crypt_device *cd,
+	int keyslot,
+	const char *passphrase,
+	size_t passphrase_size,
+	const char *new_passphrase,
+	size_t new_passphrase_size,
+	crypt_async_callback callback,
+	void *usrptr,
+	struct crypt_async_op **op);
+
+/**
+ * Asynchronous variant of @ref crypt_keyslot_add_by_volume_key.
+ *
+ * @param cd crypt device handle
+ * @param keyslot requested keyslot or CRYPT_ANY_SLOT
+ * @param volume_key provided volume key or @e NULL if used after crypt_format (copied)
+ * @param volume_key_size size of volume_key
+ * @param passphrase passphrase for new keyslot (copied)
+ * @param passphrase_size passphrase size
+ * @param callback completion callback (can be @e NULL)
+ * @param usrptr provided identification in callback
+ * @param op pointer to operation handle
+ *
+ * @return @e 0 if operation was queued or negative errno value otherwise
+ */
+int crypt_keyslot_add_by_volume_key_async(struct crypt_device *cd,
+	int keyslot,
+	const char *volume_key,
+	size_t volume_key_size,
+	const char *passphrase,
+	size_t passphrase_size,
+	crypt_async_callback callback,
+	void *usrptr,
+	struct crypt_async_op **op);
+
+/**
+ * Get pollable descriptor of asynchronous operation.
+ *
+ * @param op operation handle
+ *
+ * @return eventfd descriptor (readable once the operation completed)
+ *         or negative errno value otherwise
+ *
+ * @note Descriptor is owned by the handle and closed in @ref crypt_async_free.
+ */
+int crypt_async_fd(struct crypt_async_op *op);
+
+/**
+ * Get result of asynchronous operation without blocking.
+ *
+ * @param op operation handle
+ *
+ * @return @e -EINPROGRESS if the operation is not finished, @e -ECANCELED
+ *         if it was cancelled, result of operation otherwise
+ */
+int crypt_async_result(struct crypt_async_op *op);
+
+/**
+ * Wait for completion of asynchronous operation.
+ *
+ * @param op operation handle
+ *
+ * @return result of operation
+ */
+int crypt_async_wait(struct crypt_async_op *op);
+
+/**
+ * Cancel asynchronous operation.
+ *
+ * Only operation not yet started can be cancelled, its result is
+ * then @e -ECANCELED, descriptor is signalled but callback is not called.
+ *
+ * @param op operation handle
+ *
+ * @return @e 0 if operation is cancelled or already finished,
+ *         @e -EBUSY if it is already running
+ */
+int crypt_async_cancel(struct crypt_async_op *op);
+
+/**
+ * Release asynchronous operation handle.
+ *
+ * Operation not yet started is cancelled, running operation is waited for
+ * (unless called from its completion callback).
+ *
+ * @param op operation handle
+ */
+void crypt_async_free(struct crypt_async_op *op);
+
+/** lazy deactivation - remove once last user releases it */
+#define CRYPT_DEACTIVATE_DEFERRED (1 << 0)
+/** force deactivation - if the device is busy, it is replaced by error device */
+#define CRYPT_DEACTIVATE_FORCE    (1 << 1)
+
+/**
+ * Deactivate crypt device. This function tries to remove active device-mapper
+ * mapping from kernel. Also, sensitive data like the volume key are removed from
+ * memory
+ *
+ * @param cd crypt device handle, can be @e NULL
+ * @param name name of device to deactivate
+ * @param flags deactivation flags
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ */
+int crypt_deactivate_by_name(struct crypt_device *cd,
+	const char *name,
 	uint32_t flags);
 
 /**
  * Deactivate crypt device. See @ref crypt_deactivate_by_name with empty @e flags.
  */
 int crypt_deactivate(struct crypt_device *cd, const char *name);
+
+/**
+ * Deactivation request for @ref crypt_deactivate_batch.
+ */
+struct crypt_deactivate_request {
+	struct crypt_device *cd; /**< crypt device handle, can be @e NULL */
+	const char *name;        /**< name of device to remove */
+	uint32_t flags;          /**< deactivation flags */
+	int r;                   /**< output: @e 0 or negative errno */
+};
+
+/**
+ * Deactivate several devices at once.
+ *
+ * Devices stacked over other devices in the batch are removed first,
+ * underlying dm-integrity devices are removed after their dm-crypt device.
+ * The library waits for udev only once for the whole batch.
+ *
+ * @param req array of deactivation requests
+ * @param count number of requests
+ *
+ * @return @e 0 if all devices were removed, negative errno value of
+ *         the first failed request otherwise; per request result is
+ *         stored in @e r member of each request.
+ *
+ * @note Use CRYPT_DEACTIVATE_DEFERRED in request flags for deferred removal
+ *       of devices still in use.
+ */
+int crypt_deactivate_batch(struct crypt_deactivate_request *req, size_t count);
 /** @} */
 
 /**
@@ -1237,6 +2134,78 @@ int crypt_volume_key_get(struct crypt_device *cd,
 int crypt_volume_key_verify(struct crypt_device *cd,
 	const char *volume_key,
 	size_t volume_key_size);
+
+/**
+ * Userspace data area cipher context.
+ */
+struct crypt_data_cipher;
+
+/**
+ * Create userspace cipher for data area of crypt device.
+ *
+ * Data processed by the context are compatible with active dm-crypt
+ * mapping of the device, so the data area can be processed directly
+ * on the underlying device.
+ *
+ * @param cd crypt device handle
+ * @param ctx pointer to cipher context
+ * @param volume_key volume key of the device
+ * @param volume_key_size size of @e volume_key
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ *
+ * @note The context is not thread safe, use one context per thread.
+ */
+int crypt_data_cipher_init(struct crypt_device *cd,
+	struct crypt_data_cipher **ctx,
+	const char *volume_key,
+	size_t volume_key_size);
+
+/**
+ * Encrypt data area in place.
+ *
+ * @param ctx cipher context
+ * @param offset offset in bytes relative to the data area start
+ * @param buffer data buffer
+ * @param length length of @e buffer
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ *
+ * @note Both @e offset and @e length must be aligned to encryption sector.
+ */
+int crypt_data_cipher_encrypt(struct crypt_data_cipher *ctx,
+	uint64_t offset, char *buffer, size_t length);
+
+/**
+ * Decrypt data area in place.
+ *
+ * @param ctx cipher context
+ * @param offset offset in bytes relative to the data area start
+ * @param buffer data buffer
+ * @param length length of @e buffer
+ *
+ * @return @e 0 on success or negative errno value otherwise
+ *
+ * @note Both @e offset and @e length must be aligned to encryption sector.
+ */
+int crypt_data_cipher_decrypt(struct crypt_data_cipher *ctx,
+	uint64_t offset, char *buffer, size_t length);
+
+/**
+ * Get encryption sector size of cipher context.
+ *
+ * @param ctx cipher context
+ *
+ * @return sector size in bytes
+ */
+size_t crypt_data_cipher_sector_size(struct crypt_data_cipher *ctx);
+
+/**
+ * Release cipher context.
+ *
+ * @param ctx cipher context
+ */
+void crypt_data_cipher_free(struct crypt_data_cipher *ctx);
 /** @} */
 
 /**
@@ -1367,6 +2336,139 @@ int crypt_get_sector_size(struct crypt_device *cd);
 int crypt_get_verity_info(struct crypt_device *cd,
 	struct crypt_params_verity *vp);
 
+/**
+ * Update existing VERITY hash area (and FEC parity) after data change.
+ *
+ * Only hash blocks covering the changed data block ranges and their parents
+ * up to the root are recalculated, other hash blocks are used as stored.
+ * With FEC device, only parity of RS rounds covering rewritten blocks is updated.
+ *
+ * @param cd crypt device handle (VERITY type with data device set)
+ * @param ranges changed data block ranges
+ * @param count number of ranges
+ * @param root_hash buffer for the new root hash
+ * @param root_hash_size size of root_hash buffer
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Data area size and hash parameters must not change, the resulting
+ *	 root hash is valid only if the rest of the hash area was valid before.
+ */
+int crypt_verity_update(struct crypt_device *cd,
+	const struct crypt_verity_range *ranges,
+	size_t count,
+	char *root_hash,
+	size_t root_hash_size);
+
+/**
+ * Repair corrupted VERITY blocks using FEC device.
+ *
+ * Only RS rounds covering the given blocks are read from input and parity
+ * and decoded, corrected symbols are written back to data or hash device.
+ *
+ * @param cd crypt device handle (VERITY type with data and FEC device set)
+ * @param ranges corrupted block ranges; blocks are numbered over the FEC-covered
+ *	  area, data blocks first followed by blocks of the hash area (from hash offset)
+ * @param count number of ranges
+ * @param errors if set, number of corrected symbols is added here
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_verity_repair(struct crypt_device *cd,
+	const struct crypt_verity_range *ranges,
+	size_t count,
+	unsigned int *errors);
+
+/**
+ * Verify all VERITY data and hash blocks and repair corrupted ones using FEC device.
+ *
+ * Verification does not stop at the first mismatch, every block failing
+ * verification is collected (blocks of each hash level are split among
+ * configured threads). With FEC device set, each such block is repaired
+ * by decoding only RS rounds covering it and verified again before the next
+ * hash level is checked.
+ *
+ * @param cd crypt device handle (VERITY type with data device set)
+ * @param root_hash root hash of the device
+ * @param root_hash_size size of root_hash
+ * @param repaired if set, number of repaired blocks is returned here
+ * @param unrecoverable if set, number of blocks that still fail verification
+ *	  is returned here
+ *
+ * @return @e 0 if the device verifies (after repair), @e -EPERM if corrupted
+ *	   blocks remain or other negative errno value otherwise.
+ */
+int crypt_verity_verify_repair(struct crypt_device *cd,
+	const char *root_hash,
+	size_t root_hash_size,
+	uint64_t *repaired,
+	uint64_t *unrecoverable);
+
+/** Maximal number of userspace VERITY hash threads */
+#define CRYPT_VERITY_THREADS_MAX 256
+
+/**
+ * Set number of threads used for userspace VERITY hash and FEC calculation.
+ *
+ * @param cd crypt device handle
+ * @param threads number of threads (@e 0 means one, up to @ref CRYPT_VERITY_THREADS_MAX)
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Applies to all following operations with the context, including
+ *	 hash creation in @ref crypt_format (so it must be set before).
+ */
+int crypt_verity_set_threads(struct crypt_device *cd, uint32_t threads);
+
+/**
+ * Verify only random sample of data blocks with @e CRYPT_VERITY_CHECK_HASH.
+ *
+ * @param cd crypt device handle
+ * @param sample_percent percent of data blocks to verify (@e 0 or @e 100 means all data)
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_verity_set_sample(struct crypt_device *cd, uint32_t sample_percent);
+
+/**
+ * Set file descriptor for @e CRYPT_VERITY_DATA_STREAM hash creation.
+ *
+ * @param cd crypt device handle
+ * @param fd descriptor data are read from (sequentially) or @e -1 to unset
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Descriptor is not closed by library.
+ */
+int crypt_verity_set_data_fd(struct crypt_device *cd, int fd);
+
+/** Verify preloaded hash blocks against root hash in userspace */
+#define CRYPT_VERITY_PRELOAD_VERIFY (1 << 0)
+
+/**
+ * Preload VERITY hash tree to avoid serialized hash block reads on first access.
+ *
+ * All hash levels above the leaf level and @e leaf_percent of the leaf level
+ * (spread evenly over the level) are read from the hash device in large
+ * sequential requests. If @e name is set, hash blocks are then loaded into
+ * the kernel cache of the active device by reading one data block per
+ * preloaded hash block.
+ *
+ * @param cd crypt device handle (VERITY type)
+ * @param name name of active device or @e NULL to only read the hash device
+ * @param leaf_percent percent of leaf level hash blocks to preload (0 - 100)
+ * @param flags CRYPT_VERITY_PRELOAD_* flags
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note With CRYPT_VERITY_PRELOAD_VERIFY, the root hash must be known
+ *	 (device was activated or its hash updated through this context).
+ */
+int crypt_verity_preload(struct crypt_device *cd,
+	const char *name,
+	uint32_t leaf_percent,
+	uint32_t flags);
+
 /**
  * Get device parameters for INTEGRITY device.
  *
@@ -1378,6 +2480,38 @@ int crypt_get_verity_info(struct crypt_device *cd,
  */
 int crypt_get_integrity_info(struct crypt_device *cd,
 	struct crypt_params_integrity *ip);
+
+/**
+ * Set bitmap mode parameters for INTEGRITY device activation.
+ *
+ * @param cd crypt device handle
+ * @param sectors_per_bit number of 512-byte data sectors per bitmap bit (@e 0 for default)
+ * @param flush_time bitmap flush interval in ms (@e 0 for default)
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Used only with @e CRYPT_ACTIVATE_NO_JOURNAL_BITMAP activation flag,
+ *	 must be set before @ref crypt_load or @ref crypt_format.
+ */
+int crypt_integrity_set_bitmap(struct crypt_device *cd,
+	uint32_t sectors_per_bit,
+	uint32_t flush_time);
+
+/**
+ * Get bitmap mode parameters for INTEGRITY device.
+ *
+ * @param cd crypt device handle
+ * @param sectors_per_bit number of 512-byte data sectors per bitmap bit
+ * @param flush_time bitmap flush interval in ms
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note For context initialized by @ref crypt_init_by_name, values
+ *	 of the active device are returned.
+ */
+int crypt_get_integrity_bitmap(struct crypt_device *cd,
+	uint32_t *sectors_per_bit,
+	uint32_t *flush_time);
 /** @} */
 
 /**
@@ -1413,6 +2547,270 @@ int crypt_benchmark(struct crypt_device *cd,
 	double *encryption_mbs,
 	double *decryption_mbs);
 
+/**
+ * Informational benchmark for ciphers returning every measured run.
+ *
+ * Each run encrypts (and then decrypts) the whole buffer once,
+ * in chunks of @link crypt_benchmark_block_size @endlink bytes.
+ *
+ * @param cd crypt device handle
+ * @param cipher (e.g. "aes")
+ * @param cipher_mode (e.g. "xts"), IV generator is ignored
+ * @param volume_key_size size of volume key in bytes
+ * @param iv_size size of IV in bytes
+ * @param buffer_size size of encryption buffer in bytes used in one run
+ * @param runs number of runs
+ * @param encryption_ms array of @e runs encryption times in milliseconds
+ * @param decryption_ms array of @e runs decryption times in milliseconds
+ *
+ * @return @e 0 on success or negative errno value otherwise,
+ *	   @e -ERANGE if the buffer is too small for reliable measurement.
+ */
+int crypt_benchmark_samples(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	size_t iv_size,
+	size_t buffer_size,
+	unsigned runs,
+	double *encryption_ms,
+	double *decryption_ms);
+
+/**
+ * Informational benchmark for ciphers with IV generator and encryption sector size.
+ *
+ * Unlike @link crypt_benchmark @endlink, every sector is encrypted separately
+ * with its own IV generated by the IV generator (e.g. plain64, essiv, benbi),
+ * as dm-crypt does. Small sectors and extra IV encryption overhead then show up.
+ *
+ * @param cd crypt device handle
+ * @param cipher (e.g. "aes")
+ * @param cipher_mode including IV generator (e.g. "cbc-essiv:sha256")
+ * @param volume_key_size size of volume key in bytes
+ * @param sector_size encryption sector size in bytes (512 - 65536, power of two)
+ * @param buffer_size size of encryption buffer in bytes used in test
+ * @param encryption_mbs measured encryption speed in MiB/s
+ * @param decryption_mbs measured decryption speed in MiB/s
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Sector IV is derived from the 512-byte sector number (dm-crypt default).
+ */
+int crypt_benchmark_sector(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	size_t sector_size,
+	size_t buffer_size,
+	double *encryption_mbs,
+	double *decryption_mbs);
+
+/**
+ * Get size of one encryption request used in memory cipher benchmarks.
+ *
+ * @return chunk size in bytes
+ */
+size_t crypt_benchmark_block_size(void);
+
+/**
+ * Get crypto backend (and its version) used for benchmarks.
+ *
+ * @param cd crypt device handle
+ *
+ * @return backend description or @e NULL if backend cannot be initialized
+ */
+const char *crypt_benchmark_backend(struct crypt_device *cd);
+
+/**
+ * Informational benchmark for ciphers running concurrently in several threads.
+ *
+ * Each thread uses its own cipher context and buffer and is pinned to one
+ * of the CPUs the process is allowed to run on.
+ *
+ * @param cd crypt device handle
+ * @param cipher (e.g. "aes")
+ * @param cipher_mode (e.g. "xts"), IV generator is ignored
+ * @param volume_key_size size of volume key in bytes
+ * @param iv_size size of IV in bytes
+ * @param buffer_size size of encryption buffer in bytes used in test (per thread)
+ * @param threads number of concurrently running threads
+ * @param encryption_mbs measured aggregate encryption speed in MiB/s
+ * @param decryption_mbs measured aggregate decryption speed in MiB/s
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_benchmark_threads(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	size_t iv_size,
+	size_t buffer_size,
+	unsigned threads,
+	double *encryption_mbs,
+	double *decryption_mbs);
+
+/**
+ * Informational benchmark for TCRYPT/VeraCrypt cipher chains (memory only).
+ *
+ * Every chain element is measured separately with its own key size,
+ * chain speed is computed as all elements process the whole buffer in turn.
+ *
+ * @param cd crypt device handle
+ * @param index index of chain in internal table of TCRYPT ciphers (from 0)
+ * @param cipher set to chain name (e.g. "serpent-twofish-aes")
+ * @param cipher_mode set to chain mode (e.g. "xts-plain64")
+ * @param buffer_size size of encryption buffer in bytes used in test
+ * @param encryption_mbs measured chain encryption speed in MiB/s
+ * @param decryption_mbs measured chain decryption speed in MiB/s
+ *
+ * @return @e 0 on success or negative errno value otherwise,
+ *	   @e -EINVAL (and @e cipher set to @e NULL) if @e index is out of table,
+ *	   @e -ENOTSUP for legacy chains which cannot be activated by dm-crypt.
+ */
+int crypt_benchmark_tcrypt(struct crypt_device *cd,
+	unsigned index,
+	const char **cipher,
+	const char **cipher_mode,
+	size_t buffer_size,
+	double *encryption_mbs,
+	double *decryption_mbs);
+
+/**
+ * Informational benchmark for dm-verity hashing (memory only).
+ *
+ * Measures throughput of hashing data blocks and of building the whole
+ * hash tree up to the root over in-memory data.
+ *
+ * @param cd crypt device handle
+ * @param hash_name hash algorithm (e.g. "sha256")
+ * @param hash_type verity hash format type
+ * @param block_size data (and hash) block size in bytes
+ * @param salt_size salt size in bytes
+ * @param threads number of concurrently running threads (0 means one)
+ * @param hash_mbs measured aggregate data block hashing speed in MiB/s
+ * @param tree_mbs measured aggregate tree build speed (of data covered) in MiB/s
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_benchmark_verity(struct crypt_device *cd,
+	const char *hash_name,
+	uint32_t hash_type,
+	uint32_t block_size,
+	uint32_t salt_size,
+	unsigned threads,
+	double *hash_mbs,
+	double *tree_mbs);
+
+/**
+ * Informational benchmark for dm-verity Reed-Solomon error correction (memory only).
+ *
+ * @param cd crypt device handle
+ * @param fec_roots number of parity bytes
+ * @param threads number of concurrently running threads (0 means one)
+ * @param encode_mbs measured aggregate speed of parity encoding in MiB/s
+ * @param decode_mbs measured aggregate speed of decoding with one corrected
+ *	  byte per codeword in MiB/s
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_benchmark_verity_fec(struct crypt_device *cd,
+	uint32_t fec_roots,
+	unsigned threads,
+	double *encode_mbs,
+	double *decode_mbs);
+
+/**
+ * Informational benchmark for sector integrity protection (memory only).
+ *
+ * With @e cipher every sector is encrypted and authenticated as with LUKS2
+ * integrity (dm-crypt HMAC mode), without @e cipher only dm-integrity
+ * internal hash (e.g. "crc32c", "sha256", "hmac(sha256)") is calculated.
+ *
+ * @param cd crypt device handle
+ * @param cipher (e.g. "aes") or @e NULL for dm-integrity internal hash
+ * @param cipher_mode including IV generator (e.g. "xts-random")
+ * @param integrity integrity algorithm (e.g. "hmac(sha256)", "none")
+ * @param volume_key_size size of volume key including integrity key in bytes
+ * @param sector_size sector size in bytes (512 - 65536, power of two)
+ * @param buffer_size size of buffer in bytes used in test
+ * @param tag_size set to on-disk tag size per sector in bytes
+ * @param write_mbs measured speed of encryption with tag calculation in MiB/s
+ * @param read_mbs measured speed of decryption with tag calculation in MiB/s
+ *
+ * @return @e 0 on success or negative errno value otherwise,
+ *	   @e -ENOTSUP for algorithms not available in userspace crypto backend
+ *	   (AEAD modes), these can be measured by @link crypt_benchmark_device @endlink.
+ */
+int crypt_benchmark_integrity(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	const char *integrity,
+	size_t volume_key_size,
+	size_t sector_size,
+	size_t buffer_size,
+	uint32_t *tag_size,
+	double *write_mbs,
+	double *read_mbs);
+
+/** Use random instead of sequential I/O in @link crypt_benchmark_device @endlink. */
+#define CRYPT_BENCHMARK_RANDOM (1 << 0)
+/** Run only read test in @link crypt_benchmark_device @endlink, device can be in use. */
+#define CRYPT_BENCHMARK_READONLY (1 << 1)
+
+/**
+ * Structure used as parameter for storage benchmark.
+ *
+ * @see crypt_benchmark_device
+ */
+struct crypt_params_benchmark {
+	const char *device;	/**< tested device, NULL for RAM-backed device */
+	uint64_t size;		/**< size of tested area in bytes, 0 for default */
+	uint32_t sector_size;	/**< dm-crypt encryption sector size, 0 for default */
+	uint32_t block_size;	/**< size of one I/O request in bytes */
+	uint32_t queue_depth;	/**< number of requests in flight */
+	uint32_t flags;		/**< CRYPT_BENCHMARK_* flags */
+	uint64_t offset;	/**< offset of tested area on device in bytes */
+	uint32_t activation_flags; /**< dm-crypt performance CRYPT_ACTIVATE_* flags */
+	const char *integrity;	/**< dm-crypt integrity mode over dm-integrity, NULL for none */
+};
+
+/**
+ * Informational benchmark for ciphers through dm-crypt kernel mapping.
+ *
+ * Creates temporary dm-crypt device over the tested device (or a RAM-backed
+ * loop device) and measures direct write and read throughput.
+ *
+ * @param cd crypt device handle
+ * @param cipher (e.g. "aes")
+ * @param cipher_mode (e.g. "xts-plain64"), including IV generator
+ * @param volume_key_size size of volume key in bytes
+ * @param params storage benchmark parameters
+ * @param read_mbs measured read speed in MiB/s
+ * @param write_mbs measured write speed in MiB/s
+ * @param read_iops measured read requests per second
+ * @param write_iops measured write requests per second
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note All data in tested area of the device are irrevocably overwritten
+ *	 unless @e CRYPT_BENCHMARK_READONLY is used (write speed is then zero).
+ * @note Performance activation flags not supported by kernel
+ *	 return @e -ENOTSUP.
+ * @note With @e integrity (e.g. "hmac(sha256)", "aead") the volume key
+ *	 includes integrity key, data are stored over temporary dm-integrity
+ *	 device (tested area is wiped first) and @e CRYPT_ACTIVATE_NO_JOURNAL
+ *	 can be used. Read-only test is not possible then.
+ */
+int crypt_benchmark_device(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	const struct crypt_params_benchmark *params,
+	double *read_mbs,
+	double *write_mbs,
+	double *read_iops,
+	double *write_iops);
+
 /**
  * Informational benchmark for PBKDF.
  *
@@ -1437,6 +2835,26 @@ int crypt_benchmark_pbkdf(struct crypt_device *cd,
 	size_t volume_key_size,
 	int (*progress)(uint32_t time_ms, void *usrptr),
 	void *usrptr);
+
+/**
+ * Informational benchmark for PBKDF running concurrently in several threads.
+ *
+ * Every thread runs one key derivation with costs already set in @e pbkdf
+ * (for example by previous @link crypt_benchmark_pbkdf @endlink call).
+ *
+ * @param cd crypt device handle
+ * @param pbkdf PBKDF parameters including iterations and memory cost
+ * @param volume_key_size output volume key size
+ * @param threads number of concurrently running derivations
+ * @param time_ms time until all derivations finished in milliseconds
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_benchmark_pbkdf_threads(struct crypt_device *cd,
+	const struct crypt_pbkdf_type *pbkdf,
+	size_t volume_key_size,
+	unsigned threads,
+	uint32_t *time_ms);
 /** @} */
 
 /**
@@ -1597,6 +3015,7 @@ int crypt_header_restore(struct crypt_device *cd,
  *
  * @param level debug level
  *
+ * @note The level is global for the process, set it before starting threads.
  */
 void crypt_set_debug_level(int level);
 /** @} */
@@ -1627,6 +3046,29 @@ int crypt_keyfile_device_read(struct crypt_device *cd,
 	size_t keyfile_size_max,
 	uint32_t flags);
 
+/**
+ * Read keyfile from already open file descriptor
+ *
+ * Same as @link crypt_keyfile_device_read @endlink, but input is read
+ * from current position of descriptor, the descriptor is not closed.
+ *
+ * @param cd crypt device handle
+ * @param fd open file descriptor to read from
+ * @param key buffer for key
+ * @param key_size_read size of read key
+ * @param keyfile_offset keyfile offset
+ * @param keyfile_size_max maximal size of keyfile to read
+ * @param flags keyfile read flags
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ */
+int crypt_keyfile_fd_read(struct crypt_device *cd,
+	int fd,
+	char **key, size_t *key_size_read,
+	uint64_t keyfile_offset,
+	size_t keyfile_size_max,
+	uint32_t flags);
+
 /**
  * Backward compatible crypt_keyfile_device_read() (with size_t offset).
  */
@@ -1689,6 +3131,8 @@ int crypt_wipe(struct crypt_device *cd,
 
 /** Use direct-io */
 #define CRYPT_WIPE_NO_DIRECT_IO (1 << 0)
+/** Always use parallel writers (also on rotational device), no zero-out offload */
+#define CRYPT_WIPE_PARALLEL (1 << 1)
 /** @} */
 
 /**
@@ -1925,6 +3369,47 @@ typedef struct  {
  */
 int crypt_token_register(const crypt_token_handler *handler);
 
+/** Token handler open can run concurrently with other token opens */
+#define CRYPT_TOKEN_HANDLER_CONCURRENT (1 << 0)
+
+/**
+ * Register token handler with capability flags
+ *
+ * With @e CRYPT_TOKEN_HANDLER_CONCURRENT, @link crypt_activate_by_token @endlink
+ * with @e CRYPT_ANY_TOKEN starts open functions of all such tokens in parallel
+ * threads and uses the first passphrase that unlocks a keyslot.
+ *
+ * @param handler token handler to register
+ * @param flags token handler capabilities
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Concurrent open function may use @e cd only for read-only token
+ *	 queries (like @link crypt_token_json_get @endlink) and must tolerate
+ *	 thread cancellation (pthread_cancel) at cancellation points,
+ *	 used once another token already unlocked the device.
+ */
+int crypt_token_register_flags(const crypt_token_handler *handler, uint32_t flags);
+
+/**
+ * Set timeout of token passphrase cache.
+ *
+ * If enabled, passphrases obtained from external (registered) token handlers
+ * are stored in kernel user keyring under description derived from token JSON
+ * hash and reused by @link crypt_activate_by_token @endlink for the same
+ * token (possibly on other devices) until the timeout expires.
+ * Cache entry that fails to unlock a keyslot is dropped.
+ *
+ * @param cd crypt device handle, can be @e NULL
+ * @param timeout cache timeout in seconds, @e 0 disables the cache (default)
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note The setting is global on the library level.
+ * @note Cached passphrases are readable by all processes of the same user.
+ */
+int crypt_token_cache_timeout(struct crypt_device *cd, unsigned timeout);
+
 /**
  * Activate device or check key using a token.
  *
@@ -1943,6 +3428,112 @@ int crypt_activate_by_token(struct crypt_device *cd,
 	uint32_t flags);
 /** @} */
 
+/**
+ * @defgroup crypt-reencrypt LUKS2 online reencryption
+ * @addtogroup crypt-reencrypt
+ * @{
+ */
+/**
+ * LUKS2 online reencryption parameters.
+ */
+struct crypt_params_reencrypt {
+	uint64_t hotzone_size;	/**< data moved (and journaled) in one step (in bytes), 0 for default */
+	size_t volume_key_size;	/**< new volume key size (in bytes), 0 keeps current key size */
+	uint32_t flags;		/**< CRYPT_REENCRYPT_* flags, used also on resume */
+};
+
+/** Copy hotzone data in kernel (dm-mirror over dm-crypt), falls back to userspace if not available */
+#define CRYPT_REENCRYPT_KERNEL_COPY	(1 << 0)
+
+/**
+ * Initialize (or resume) online reencryption of LUKS2 device.
+ *
+ * New volume key is generated and stored in a new keyslot protected by the same
+ * passphrase, old and new key then protect two data segments until reencryption
+ * finishes. If reencryption is already in progress, the passphrase must unlock both
+ * keys and @e cipher, @e cipher_mode and @e params are ignored.
+ *
+ * @param cd crypt device handle
+ * @param name name of active device to reencrypt online or @e NULL if device is not active
+ * @param passphrase passphrase of existing keyslot
+ * @param passphrase_size size of @e passphrase (binary data)
+ * @param keyslot_old keyslot to unlock old volume key or @e CRYPT_ANY_SLOT
+ * @param keyslot_new keyslot for new volume key or @e CRYPT_ANY_SLOT
+ * @param cipher new cipher or @e NULL to keep current cipher
+ * @param cipher_mode new cipher mode
+ * @param params reencryption parameters or @e NULL for defaults
+ *
+ * @return keyslot of new volume key or negative errno otherwise.
+ *
+ * @note Only 512-byte sector size devices without data integrity are supported,
+ *	 data is reencrypted in userspace with the active device suspended
+ *	 for each hotzone. With @e CRYPT_REENCRYPT_KERNEL_COPY flag the hotzone
+ *	 is copied in kernel (requires dm-mirror target and block devices).
+ */
+int crypt_reencrypt_init_by_passphrase(struct crypt_device *cd,
+	const char *name,
+	const char *passphrase,
+	size_t passphrase_size,
+	int keyslot_old,
+	int keyslot_new,
+	const char *cipher,
+	const char *cipher_mode,
+	const struct crypt_params_reencrypt *params);
+
+/**
+ * Run online reencryption initialized by @link crypt_reencrypt_init_by_passphrase @endlink.
+ *
+ * @param cd crypt device handle
+ * @param progress callback function called after each hotzone or @e NULL
+ * @param usrptr provided identification in callback
+ *
+ * @return @e 0 on finished reencryption or negative errno otherwise.
+ *
+ * @note A @e progress callback can interrupt reencryption by returning non-zero code
+ *	 (-EINTR is returned), the header is always left in a consistent state and
+ *	 reencryption can be resumed later (also after a crash).
+ */
+int crypt_reencrypt(struct crypt_device *cd,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+	void *usrptr);
+
+/**
+ * Offline reencryption checkpoint stored in LUKS2 metadata.
+ */
+struct crypt_params_reencrypt_checkpoint {
+	uint64_t offset;	/**< data area offset processed so far (in bytes) */
+	uint64_t shift;		/**< data shift (in bytes) */
+	uint32_t direction;	/**< 0 forward, 1 backward */
+	uint32_t mode;		/**< 0 reencrypt, 1 encrypt, 2 decrypt */
+};
+
+/**
+ * Store offline reencryption checkpoint in LUKS2 header.
+ *
+ * @param cd crypt device handle
+ * @param cp checkpoint or @e NULL to remove it
+ *
+ * @return @e 0 on success or negative errno value otherwise.
+ *
+ * @note Allowed only with @link CRYPT_REQUIREMENT_OFFLINE_REENCRYPT @endlink set,
+ *	 the header is written (both copies) in one atomic metadata update.
+ */
+int crypt_reencrypt_checkpoint_set(struct crypt_device *cd,
+	const struct crypt_params_reencrypt_checkpoint *cp);
+
+/**
+ * Get offline reencryption checkpoint from LUKS2 header.
+ *
+ * @param cd crypt device handle
+ * @param cp checkpoint
+ *
+ * @return @e 0 on success, @e -ENOENT if no checkpoint is stored
+ *	   or negative errno value otherwise.
+ */
+int crypt_reencrypt_checkpoint_get(struct crypt_device *cd,
+	struct crypt_params_reencrypt_checkpoint *cp);
+/** @} */
+
 #ifdef __cplusplus
 }
 #endif
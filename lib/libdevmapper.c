@@ -23,6 +23,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
@@ -41,21 +42,38 @@
 #define DM_UUID_PREFIX_LEN	6
 #define DM_CRYPT_TARGET		"crypt"
 #define DM_VERITY_TARGET	"verity"
+#define DM_MIRROR_TARGET	"mirror"
 #define DM_INTEGRITY_TARGET	"integrity"
 #define RETRY_COUNT		5
 
-/* Set if DM target versions were probed */
+/* Target versions probed by previous processes since the last boot */
+#define DM_VERSIONS_CACHE	DEFAULT_LUKS2_LOCK_PATH "/dm-versions"
+#define DM_VERSIONS_KEY_LEN	256
+
+/*
+ * Set if DM target versions were probed.
+ * Probe results are written only with _dm_lock held, flags are never cleared.
+ */
+static pthread_mutex_t _dm_lock = PTHREAD_MUTEX_INITIALIZER;
 static bool _dm_ioctl_checked = false;
 static bool _dm_crypt_checked = false;
 static bool _dm_verity_checked = false;
 static bool _dm_integrity_checked = false;
 
-static int _quiet_log = 0;
 static uint32_t _dm_flags = 0;
-
-static struct crypt_device *_context = NULL;
 static int _dm_use_count = 0;
 
+/*
+ * libdevmapper has only one process-wide log callback, the context
+ * used for error messages is tracked per thread.
+ */
+static __thread int _quiet_log = 0;
+static __thread struct crypt_device *_context = NULL;
+
+/* Shared udev cookie of batched device creation, see dm_udev_batch_begin() */
+static __thread int _dm_udev_batch = 0;
+static __thread uint32_t _dm_udev_batch_cookie = 0;
+
 /* Check if we have DM flag to instruct kernel to force wipe buffers */
 #if !HAVE_DECL_DM_TASK_SECURE_DATA
 static int dm_task_secure_data(struct dm_task *dmt) { return 1; }
@@ -83,6 +101,31 @@ static int _dm_use_udev(void)
 #endif
 }
 
+/*
+ * Batched udev synchronization: devices created or removed until
+ * dm_udev_batch_end() share one cookie and the wait for udev is done
+ * only once at the end.
+ * Stacked devices (dm-integrity under dm-crypt) still wait immediately,
+ * the upper device needs the lower node.
+ * The batch is per thread.
+ */
+void dm_udev_batch_begin(void)
+{
+	_dm_udev_batch = 1;
+	_dm_udev_batch_cookie = 0;
+}
+
+void dm_udev_batch_end(void)
+{
+	if (_dm_udev_batch_cookie && _dm_use_udev()) {
+		log_dbg("Waiting for udev to process batched devices.");
+		(void)_dm_udev_wait(_dm_udev_batch_cookie);
+	}
+	_dm_udev_batch = 0;
+	_dm_udev_batch_cookie = 0;
+	dm_task_update_nodes();
+}
+
 __attribute__((format(printf, 4, 5)))
 static void set_dm_error(int level,
 			 const char *file __attribute__((unused)),
@@ -164,6 +207,14 @@ static void _dm_set_crypt_compat(unsigned crypt_maj,
 		_dm_flags |= DM_CAPI_STRING_SUPPORTED;
 	}
 
+	/* no_read_workqueue and no_write_workqueue since 1.22 (kernel 5.9) */
+	if (_dm_satisfies_version(1, 22, 0, crypt_maj, crypt_min, crypt_patch))
+		_dm_flags |= DM_CRYPT_NO_WORKQUEUE_SUPPORTED;
+
+	/* high_priority since 1.26 (kernel 6.10) */
+	if (_dm_satisfies_version(1, 26, 0, crypt_maj, crypt_min, crypt_patch))
+		_dm_flags |= DM_CRYPT_HIGH_PRIORITY_SUPPORTED;
+
 	_dm_crypt_checked = true;
 }
 
@@ -185,12 +236,16 @@ static void _dm_set_verity_compat(unsigned verity_maj,
 	 * (but some dm-verity targets 1.2 don't support it)
 	 * FEC is added in 1.3 as well.
 	 * Check at most once is added in 1.4 (kernel 4.17).
+	 * Verification in tasklet is added in 1.9 (kernel 6.0).
 	 */
 	if (_dm_satisfies_version(1, 3, 0, verity_maj, verity_min, verity_patch)) {
 		_dm_flags |= DM_VERITY_ON_CORRUPTION_SUPPORTED;
 		_dm_flags |= DM_VERITY_FEC_SUPPORTED;
 	}
 
+	if (_dm_satisfies_version(1, 9, 0, verity_maj, verity_min, verity_patch))
+		_dm_flags |= DM_VERITY_TASKLETS_SUPPORTED;
+
 	_dm_verity_checked = true;
 }
 
@@ -206,22 +261,206 @@ static void _dm_set_integrity_compat(unsigned integrity_maj,
 
 	_dm_flags |= DM_INTEGRITY_SUPPORTED;
 
+	if (_dm_satisfies_version(1, 2, 0, integrity_maj, integrity_min, integrity_patch))
+		_dm_flags |= DM_INTEGRITY_RECALC_SUPPORTED;
+
+	if (_dm_satisfies_version(1, 3, 0, integrity_maj, integrity_min, integrity_patch))
+		_dm_flags |= DM_INTEGRITY_BITMAP_SUPPORTED;
+
 	_dm_integrity_checked = true;
 }
 
+static void _dm_set_ioctl_compat(unsigned dm_maj, unsigned dm_min, unsigned dm_patch)
+{
+	if (_dm_ioctl_checked)
+		return;
+
+	log_dbg("Detected dm-ioctl version %u.%u.%u.", dm_maj, dm_min, dm_patch);
+
+	if (_dm_satisfies_version(4, 20, 0, dm_maj, dm_min, dm_patch))
+		_dm_flags |= DM_SECURE_SUPPORTED;
+#if HAVE_DECL_DM_TASK_DEFERRED_REMOVE
+	if (_dm_satisfies_version(4, 27, 0, dm_maj, dm_min, dm_patch))
+		_dm_flags |= DM_DEFERRED_SUPPORTED;
+#endif
+}
+
+/*
+ * Versions cannot change until a target module is (re)loaded, so the cache
+ * is keyed by kernel boot id and load time of all probed target modules.
+ */
+static int _dm_versions_cache_key(char *key, size_t key_len)
+{
+	static const char *modules[] = { "dm_crypt", "dm_verity", "dm_integrity", NULL };
+	char path[64], boot_id[40];
+	struct stat st;
+	ssize_t len;
+	size_t off;
+	int fd, i, r;
+
+	fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -EINVAL;
+	len = read_buffer(fd, boot_id, sizeof(boot_id) - 1);
+	close(fd);
+	if (len <= 0)
+		return -EINVAL;
+	boot_id[len] = '\0';
+	boot_id[strcspn(boot_id, "\n")] = '\0';
+
+	r = snprintf(key, key_len, "%s", boot_id);
+	if (r < 0 || (size_t)r >= key_len)
+		return -EINVAL;
+	off = r;
+
+	for (i = 0; modules[i]; i++) {
+		if (snprintf(path, sizeof(path), "/sys/module/%s", modules[i]) < 0)
+			return -EINVAL;
+		if (stat(path, &st))
+			r = snprintf(key + off, key_len - off, " -");
+		else
+			r = snprintf(key + off, key_len - off, " %lld.%09ld",
+				     (long long)st.st_ctim.tv_sec, st.st_ctim.tv_nsec);
+		if (r < 0 || (size_t)r >= key_len - off)
+			return -EINVAL;
+		off += r;
+	}
+
+	return 0;
+}
+
+/* Called with _dm_lock held, only complete caches (all targets loaded) are used */
+static int _dm_versions_cache_load(const char *key)
+{
+	unsigned v[4][3] = {};
+	char *line = NULL, name[16];
+	unsigned maj, min, patch;
+	struct stat st;
+	size_t len = 0;
+	FILE *f = NULL;
+	int fd, i, r = -ENOENT;
+
+	fd = open(DM_VERSIONS_CACHE, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -ENOENT;
+
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && !st.st_uid &&
+	    !(st.st_mode & (S_IWGRP | S_IWOTH)))
+		f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return -ENOENT;
+	}
+
+	if (getline(&line, &len, f) == -1)
+		goto out;
+	line[strcspn(line, "\n")] = '\0';
+	if (strcmp(line, key))
+		goto out;
+
+	while (getline(&line, &len, f) != -1) {
+		if (sscanf(line, "%15s %u.%u.%u", name, &maj, &min, &patch) != 4 || !maj)
+			continue;
+		if (!strcmp(name, "ioctl"))
+			i = 0;
+		else if (!strcmp(name, DM_CRYPT_TARGET))
+			i = 1;
+		else if (!strcmp(name, DM_VERITY_TARGET))
+			i = 2;
+		else if (!strcmp(name, DM_INTEGRITY_TARGET))
+			i = 3;
+		else
+			continue;
+		v[i][0] = maj;
+		v[i][1] = min;
+		v[i][2] = patch;
+	}
+
+	for (i = 0; i < 4; i++)
+		if (!v[i][0])
+			goto out;
+
+	log_dbg("Using cached device-mapper versions from %s.", DM_VERSIONS_CACHE);
+	_dm_set_ioctl_compat(v[0][0], v[0][1], v[0][2]);
+	_dm_set_crypt_compat(v[1][0], v[1][1], v[1][2]);
+	_dm_set_verity_compat(v[2][0], v[2][1], v[2][2]);
+	_dm_set_integrity_compat(v[3][0], v[3][1], v[3][2]);
+	r = 0;
+out:
+	free(line);
+	fclose(f);
+	return r;
+}
+
+/* Only root can write the cache, replaced atomically so readers never see partial file */
+static void _dm_versions_cache_store(const char *key, const char *dm_version,
+				     struct dm_versions *target)
+{
+	char tmp[] = DM_VERSIONS_CACHE ".XXXXXX";
+	struct dm_versions *last_target;
+	int fd, r, found = 0;
+	FILE *f;
+
+	if (geteuid())
+		return;
+
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return;
+
+	if (fchmod(fd, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) ||
+	    !(f = fdopen(fd, "w"))) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+
+	fprintf(f, "%s\nioctl %s\n", key, dm_version);
+	do {
+		last_target = target;
+		if (!strcmp(DM_CRYPT_TARGET, target->name) ||
+		    !strcmp(DM_VERITY_TARGET, target->name) ||
+		    !strcmp(DM_INTEGRITY_TARGET, target->name)) {
+			fprintf(f, "%s %u.%u.%u\n", target->name,
+				(unsigned)target->version[0],
+				(unsigned)target->version[1],
+				(unsigned)target->version[2]);
+			found++;
+		}
+		target = (struct dm_versions *)((char *) target + target->next);
+	} while (last_target != target);
+
+	/* Incomplete cache would be ignored anyway */
+	r = fclose(f);
+	if (found != 3 || r || rename(tmp, DM_VERSIONS_CACHE))
+		unlink(tmp);
+	else
+		log_dbg("Stored device-mapper versions to %s.", DM_VERSIONS_CACHE);
+}
+
 static int _dm_check_versions(dm_target_type target_type)
 {
-	struct dm_task *dmt;
+	struct dm_task *dmt = NULL;
 	struct dm_versions *target, *last_target;
-	char dm_version[16];
+	char dm_version[16], key[DM_VERSIONS_KEY_LEN];
 	unsigned dm_maj, dm_min, dm_patch;
+	bool have_key;
 	int r = 0;
 
+	pthread_mutex_lock(&_dm_lock);
 	if ((target_type == DM_CRYPT     && _dm_crypt_checked) ||
 	    (target_type == DM_VERITY    && _dm_verity_checked) ||
 	    (target_type == DM_INTEGRITY && _dm_integrity_checked) ||
-	    (_dm_crypt_checked && _dm_verity_checked && _dm_integrity_checked))
+	    (_dm_crypt_checked && _dm_verity_checked && _dm_integrity_checked)) {
+		pthread_mutex_unlock(&_dm_lock);
 		return 1;
+	}
+
+	have_key = !_dm_versions_cache_key(key, sizeof(key));
+	if (have_key && !_dm_ioctl_checked && !_dm_versions_cache_load(key)) {
+		r = 1;
+		goto log;
+	}
 
 	/* Shut up DM while checking */
 	_quiet_log = 1;
@@ -236,20 +475,13 @@ static int _dm_check_versions(dm_target_type target_type)
 	if (!dm_task_get_driver_version(dmt, dm_version, sizeof(dm_version)))
 		goto out;
 
-	if (!_dm_ioctl_checked) {
-		if (sscanf(dm_version, "%u.%u.%u", &dm_maj, &dm_min, &dm_patch) != 3)
-			goto out;
-		log_dbg("Detected dm-ioctl version %u.%u.%u.", dm_maj, dm_min, dm_patch);
-
-		if (_dm_satisfies_version(4, 20, 0, dm_maj, dm_min, dm_patch))
-			_dm_flags |= DM_SECURE_SUPPORTED;
-#if HAVE_DECL_DM_TASK_DEFERRED_REMOVE
-		if (_dm_satisfies_version(4, 27, 0, dm_maj, dm_min, dm_patch))
-			_dm_flags |= DM_DEFERRED_SUPPORTED;
-#endif
-	}
+	if (sscanf(dm_version, "%u.%u.%u", &dm_maj, &dm_min, &dm_patch) != 3)
+		goto out;
+	_dm_set_ioctl_compat(dm_maj, dm_min, dm_patch);
 
 	target = dm_task_get_versions(dmt);
+	if (have_key)
+		_dm_versions_cache_store(key, dm_version, target);
 	do {
 		last_target = target;
 		if (!strcmp(DM_CRYPT_TARGET, target->name)) {
@@ -269,6 +501,7 @@ static int _dm_check_versions(dm_target_type target_type)
 	} while (last_target != target);
 
 	r = 1;
+log:
 	if (!_dm_ioctl_checked)
 		log_dbg("Device-mapper backend running with UDEV support %sabled.",
 			_dm_use_udev() ? "en" : "dis");
@@ -279,49 +512,60 @@ out:
 		dm_task_destroy(dmt);
 
 	_quiet_log = 0;
+	pthread_mutex_unlock(&_dm_lock);
 	return r;
 }
 
 int dm_flags(dm_target_type target, uint32_t *flags)
 {
+	int r = -ENODEV;
+
 	_dm_check_versions(target);
+
+	pthread_mutex_lock(&_dm_lock);
 	*flags = _dm_flags;
 
 	if (target == DM_UNKNOWN &&
 	    _dm_crypt_checked && _dm_verity_checked && _dm_integrity_checked)
-		return 0;
+		r = 0;
 
 	if ((target == DM_CRYPT     && _dm_crypt_checked) ||
 	    (target == DM_VERITY    && _dm_verity_checked) ||
 	    (target == DM_INTEGRITY && _dm_integrity_checked))
-		return 0;
+		r = 0;
+	pthread_mutex_unlock(&_dm_lock);
 
-	return -ENODEV;
+	return r;
 }
 
 /* This doesn't run any kernel checks, just set up userspace libdevmapper */
 void dm_backend_init(void)
 {
+	pthread_mutex_lock(&_dm_lock);
 	if (!_dm_use_count++) {
 		log_dbg("Initialising device-mapper backend library.");
 		dm_log_init(set_dm_error);
 		dm_log_init_verbose(10);
 	}
+	pthread_mutex_unlock(&_dm_lock);
 }
 
 void dm_backend_exit(void)
 {
+	pthread_mutex_lock(&_dm_lock);
 	if (_dm_use_count && (!--_dm_use_count)) {
 		log_dbg("Releasing device-mapper backend.");
 		dm_log_init_verbose(0);
 		dm_log_init(NULL);
 		dm_lib_release();
 	}
+	pthread_mutex_unlock(&_dm_lock);
 }
 
 /*
  * libdevmapper is not context friendly, switch context on every DM call.
- * FIXME: this is not safe if called in parallel but neither is DM lib.
+ * The context is thread local, DM ioctls on independent devices
+ * can run in parallel.
  */
 static int dm_init_context(struct crypt_device *cd, dm_target_type target)
 {
@@ -370,10 +614,14 @@ char *dm_device_path(const char *prefix, int major, int minor)
 
 static void hex_key(char *hexkey, size_t key_size, const char *key)
 {
+	static const char hex[] = "0123456789abcdef";
 	unsigned i;
 
-	for(i = 0; i < key_size; i++)
-		sprintf(&hexkey[i * 2], "%02x", (unsigned char)key[i]);
+	for(i = 0; i < key_size; i++) {
+		hexkey[i * 2]     = hex[(unsigned char)key[i] >> 4];
+		hexkey[i * 2 + 1] = hex[(unsigned char)key[i] & 0xf];
+	}
+	hexkey[key_size * 2] = '\0';
 }
 
 /* get string length for key_size written in decimal system */
@@ -521,8 +769,8 @@ static int cipher_dm2c(char **org_c, char **org_i, const char *c_dm, const char
 /* https://gitlab.com/cryptsetup/cryptsetup/wikis/DMCrypt */
 static char *get_dm_crypt_params(struct crypt_dm_active_device *dmd, uint32_t flags)
 {
-	int r, max_size, null_cipher = 0, num_options = 0, keystr_len = 0;
-	char *params, *hexkey;
+	int r, len, max_size, null_cipher = 0, num_options = 0, keystr_len = 0;
+	char *params;
 	char sector_feature[32], features[512], integrity_dm[256], cipher_dm[256];
 
 	if (!dmd)
@@ -539,6 +787,12 @@ static char *get_dm_crypt_params(struct crypt_dm_active_device *dmd, uint32_t fl
 		num_options++;
 	if (flags & CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS)
 		num_options++;
+	if (flags & CRYPT_ACTIVATE_NO_READ_WORKQUEUE)
+		num_options++;
+	if (flags & CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE)
+		num_options++;
+	if (flags & CRYPT_ACTIVATE_HIGH_PRIORITY)
+		num_options++;
 	if (dmd->u.crypt.integrity)
 		num_options++;
 
@@ -549,10 +803,13 @@ static char *get_dm_crypt_params(struct crypt_dm_active_device *dmd, uint32_t fl
 		*sector_feature = '\0';
 
 	if (num_options) {
-		snprintf(features, sizeof(features)-1, " %d%s%s%s%s%s", num_options,
+		snprintf(features, sizeof(features)-1, " %d%s%s%s%s%s%s%s%s", num_options,
 		(flags & CRYPT_ACTIVATE_ALLOW_DISCARDS) ? " allow_discards" : "",
 		(flags & CRYPT_ACTIVATE_SAME_CPU_CRYPT) ? " same_cpu_crypt" : "",
 		(flags & CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS) ? " submit_from_crypt_cpus" : "",
+		(flags & CRYPT_ACTIVATE_NO_READ_WORKQUEUE) ? " no_read_workqueue" : "",
+		(flags & CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE) ? " no_write_workqueue" : "",
+		(flags & CRYPT_ACTIVATE_HIGH_PRIORITY) ? " high_priority" : "",
 		sector_feature, integrity_dm);
 	} else
 		*features = '\0';
@@ -560,44 +817,49 @@ static char *get_dm_crypt_params(struct crypt_dm_active_device *dmd, uint32_t fl
 	if (!strncmp(cipher_dm, "cipher_null-", 12))
 		null_cipher = 1;
 
-	if (flags & CRYPT_ACTIVATE_KEYRING_KEY) {
-		keystr_len = strlen(dmd->u.crypt.vk->key_description) + get_key_size_strlen(dmd->u.crypt.vk->keylength) + 9;
-		hexkey = crypt_safe_alloc(keystr_len);
-	} else
-		hexkey = crypt_safe_alloc(null_cipher ? 2 : (dmd->u.crypt.vk->keylength * 2 + 1));
-
-	if (!hexkey)
-		return NULL;
-
+	/* Key (or its keyring reference) is written directly to table parameters */
 	if (null_cipher)
-		strncpy(hexkey, "-", 2);
-	else if (flags & CRYPT_ACTIVATE_KEYRING_KEY) {
-		r = snprintf(hexkey, keystr_len, ":%zu:logon:%s", dmd->u.crypt.vk->keylength, dmd->u.crypt.vk->key_description);
-		if (r < 0 || r >= keystr_len) {
-			params = NULL;
-			goto out;
-		}
-	} else
-		hex_key(hexkey, dmd->u.crypt.vk->keylength, dmd->u.crypt.vk->key);
+		keystr_len = 1;
+	else if (flags & CRYPT_ACTIVATE_KEYRING_KEY)
+		keystr_len = strlen(dmd->u.crypt.vk->key_description) +
+			     get_key_size_strlen(dmd->u.crypt.vk->keylength) + 8;
+	else
+		keystr_len = dmd->u.crypt.vk->keylength * 2;
 
-	max_size = strlen(hexkey) + strlen(cipher_dm) +
+	max_size = keystr_len + strlen(cipher_dm) +
 		   strlen(device_block_path(dmd->data_device)) +
 		   strlen(features) + 64;
 	params = crypt_safe_alloc(max_size);
 	if (!params)
-		goto out;
+		return NULL;
 
-	r = snprintf(params, max_size, "%s %s %" PRIu64 " %s %" PRIu64 "%s",
-		     cipher_dm, hexkey, dmd->u.crypt.iv_offset,
-		     device_block_path(dmd->data_device), dmd->u.crypt.offset,
-		     features);
-	if (r < 0 || r >= max_size) {
-		crypt_safe_free(params);
-		params = NULL;
+	len = snprintf(params, max_size, "%s ", cipher_dm);
+	if (len < 0 || len + keystr_len >= max_size)
+		goto err;
+
+	if (null_cipher)
+		r = snprintf(params + len, max_size - len, "-");
+	else if (flags & CRYPT_ACTIVATE_KEYRING_KEY)
+		r = snprintf(params + len, max_size - len, ":%zu:logon:%s",
+			     dmd->u.crypt.vk->keylength, dmd->u.crypt.vk->key_description);
+	else {
+		hex_key(params + len, dmd->u.crypt.vk->keylength, dmd->u.crypt.vk->key);
+		r = keystr_len;
 	}
-out:
-	crypt_safe_free(hexkey);
+	if (r < 0 || r > keystr_len)
+		goto err;
+	len += r;
+
+	r = snprintf(params + len, max_size - len, " %" PRIu64 " %s %" PRIu64 "%s",
+		     dmd->u.crypt.iv_offset, device_block_path(dmd->data_device),
+		     dmd->u.crypt.offset, features);
+	if (r < 0 || r >= max_size - len)
+		goto err;
+
 	return params;
+err:
+	crypt_safe_free(params);
+	return NULL;
 }
 
 /* https://gitlab.com/cryptsetup/cryptsetup/wikis/DMVerity */
@@ -624,6 +886,8 @@ static char *get_dm_verity_params(struct crypt_params_verity *vp,
 		num_options++;
 	if (flags & CRYPT_ACTIVATE_CHECK_AT_MOST_ONCE)
 		num_options++;
+	if (flags & CRYPT_ACTIVATE_TASKLETS)
+		num_options++;
 
 	if (dmd->u.verity.fec_device) {
 		num_options += 8;
@@ -635,11 +899,12 @@ static char *get_dm_verity_params(struct crypt_params_verity *vp,
 		*fec_features = '\0';
 
 	if (num_options)
-		snprintf(features, sizeof(features)-1, " %d%s%s%s%s", num_options,
+		snprintf(features, sizeof(features)-1, " %d%s%s%s%s%s", num_options,
 		(flags & CRYPT_ACTIVATE_IGNORE_CORRUPTION) ? " ignore_corruption" : "",
 		(flags & CRYPT_ACTIVATE_RESTART_ON_CORRUPTION) ? " restart_on_corruption" : "",
 		(flags & CRYPT_ACTIVATE_IGNORE_ZERO_BLOCKS) ? " ignore_zero_blocks" : "",
-		(flags & CRYPT_ACTIVATE_CHECK_AT_MOST_ONCE) ? " check_at_most_once" : "");
+		(flags & CRYPT_ACTIVATE_CHECK_AT_MOST_ONCE) ? " check_at_most_once" : "",
+		(flags & CRYPT_ACTIVATE_TASKLETS) ? " try_verify_in_tasklet" : "");
 	else
 		*features = '\0';
 
@@ -742,6 +1007,22 @@ static char *get_dm_integrity_params(struct crypt_dm_active_device *dmd, uint32_
 			 dmd->u.integrity.buffer_sectors);
 		strncat(features, feature, sizeof(features) - strlen(features) - 1);
 	}
+	if (dmd->u.integrity.sectors_per_bit) {
+		num_options++;
+		snprintf(feature, sizeof(feature), "sectors_per_bit:%u ",
+			 dmd->u.integrity.sectors_per_bit);
+		strncat(features, feature, sizeof(features) - strlen(features) - 1);
+	}
+	if (dmd->u.integrity.bitmap_flush_time) {
+		num_options++;
+		snprintf(feature, sizeof(feature), "bitmap_flush_interval:%u ",
+			 dmd->u.integrity.bitmap_flush_time);
+		strncat(features, feature, sizeof(features) - strlen(features) - 1);
+	}
+	if (flags & CRYPT_ACTIVATE_RECALCULATE) {
+		num_options++;
+		strncat(features, "recalculate ", sizeof(features) - strlen(features) - 1);
+	}
 	if (dmd->u.integrity.integrity) {
 		num_options++;
 
@@ -805,6 +1086,8 @@ static char *get_dm_integrity_params(struct crypt_dm_active_device *dmd, uint32_
 		mode = 'R';
 	else if (flags & CRYPT_ACTIVATE_NO_JOURNAL)
 		mode = 'D';
+	else if (flags & CRYPT_ACTIVATE_NO_JOURNAL_BITMAP)
+		mode = 'B';
 	else
 		mode = 'J';
 
@@ -825,10 +1108,12 @@ static int _dm_remove(const char *name, int udev_wait, int deferred)
 {
 	int r = 0;
 	struct dm_task *dmt;
-	uint32_t cookie = 0;
+	uint32_t cookie = 0, *cookiep = &cookie;
 
 	if (!_dm_use_udev())
 		udev_wait = 0;
+	else if (udev_wait && _dm_udev_batch)
+		cookiep = &_dm_udev_batch_cookie;
 
 	if (!(dmt = dm_task_create(DM_DEVICE_REMOVE)))
 		return 0;
@@ -844,12 +1129,12 @@ static int _dm_remove(const char *name, int udev_wait, int deferred)
 	if (deferred && !dm_task_deferred_remove(dmt))
 		goto out;
 #endif
-	if (udev_wait && !_dm_task_set_cookie(dmt, &cookie, DM_UDEV_DISABLE_LIBRARY_FALLBACK))
+	if (udev_wait && !_dm_task_set_cookie(dmt, cookiep, DM_UDEV_DISABLE_LIBRARY_FALLBACK))
 		goto out;
 
 	r = dm_task_run(dmt);
 
-	if (udev_wait)
+	if (udev_wait && cookiep == &cookie)
 		(void)_dm_udev_wait(cookie);
 out:
 	dm_task_destroy(dmt);
@@ -1030,20 +1315,24 @@ int lookup_dm_dev_by_uuid(const char *uuid, const char *type)
 	return r;
 }
 
-static int _dm_create_device(const char *name, const char *type,
+/* Load table of count consecutive targets of the same type */
+static int _dm_create_device_targets(const char *name, const char *type,
 			     struct device *device, uint32_t flags,
-			     const char *uuid, uint64_t size,
-			     dm_target_type target, char *params, int reload)
+			     const char *uuid, unsigned count, const uint64_t *sizes,
+			     dm_target_type target, char **params, int reload)
 {
 	struct dm_task *dmt = NULL;
 	struct dm_info dmi;
 	char dev_uuid[DM_UUID_LEN] = {0};
 	const char *target_name;
 	int r = -EINVAL;
+	unsigned i;
+	uint64_t start;
 	uint32_t read_ahead = 0;
-	uint32_t cookie = 0;
+	uint32_t cookie = 0, *cookiep = &cookie;
 	uint32_t dmt_flags;
 	uint16_t udev_flags = DM_UDEV_DISABLE_LIBRARY_FALLBACK;
+	int udev = _dm_use_udev();
 
 	/* Only need DM_SECURE_SUPPORTED, no target specific fail matters */
 	dm_flags(target, &dmt_flags);
@@ -1057,11 +1346,17 @@ static int _dm_create_device(const char *name, const char *type,
 	else
 		return -EINVAL;
 
-	if (!params)
+	if (!count || !params)
 		return -EINVAL;
 
+	for (i = 0; i < count; i++)
+		if (!params[i])
+			return -EINVAL;
+
 	if (flags & CRYPT_ACTIVATE_PRIVATE)
 		udev_flags |= CRYPT_TEMP_UDEV_FLAGS;
+	else if (_dm_udev_batch && !reload && target != DM_INTEGRITY)
+		cookiep = &_dm_udev_batch_cookie;
 
 	/* All devices must have DM_UUID, only resize on old device is exception */
 	if (reload) {
@@ -1089,8 +1384,9 @@ static int _dm_create_device(const char *name, const char *type,
 	if ((flags & CRYPT_ACTIVATE_READONLY) && !dm_task_set_ro(dmt))
 		goto out_no_removal;
 
-	if (!dm_task_add_target(dmt, 0, size, target_name, params))
-		goto out_no_removal;
+	for (start = 0, i = 0; i < count; start += sizes[i++])
+		if (!dm_task_add_target(dmt, start, sizes[i], target_name, params[i]))
+			goto out_no_removal;
 
 #ifdef DM_READ_AHEAD_MINIMUM_FLAG
 	if (device_read_ahead(device, &read_ahead) &&
@@ -1098,7 +1394,7 @@ static int _dm_create_device(const char *name, const char *type,
 		goto out_no_removal;
 #endif
 	/* do not set cookie for DM_DEVICE_RELOAD task */
-	if (!reload && _dm_use_udev() && !_dm_task_set_cookie(dmt, &cookie, udev_flags))
+	if (!reload && udev && !_dm_task_set_cookie(dmt, cookiep, udev_flags))
 		goto out_no_removal;
 
 	if (!dm_task_run(dmt))
@@ -1112,7 +1408,7 @@ static int _dm_create_device(const char *name, const char *type,
 			goto out;
 		if (uuid && !dm_task_set_uuid(dmt, dev_uuid))
 			goto out;
-		if (_dm_use_udev() && !_dm_task_set_cookie(dmt, &cookie, udev_flags))
+		if (udev && !_dm_task_set_cookie(dmt, &cookie, udev_flags))
 			goto out;
 		if (!dm_task_run(dmt))
 			goto out;
@@ -1123,16 +1419,19 @@ static int _dm_create_device(const char *name, const char *type,
 
 	r = 0;
 out:
-	if (_dm_use_udev()) {
+	if (udev) {
 		(void)_dm_udev_wait(cookie);
 		cookie = 0;
 	}
 
 	if (r < 0 && !reload)
-		_dm_remove(name, 1, 0);
+		_dm_remove(name, udev, 0);
+	else if (r < 0)
+		/* do not leave loaded table for later resume */
+		_dm_simple(DM_DEVICE_CLEAR, name, 0);
 
 out_no_removal:
-	if (cookie && _dm_use_udev())
+	if (cookie && udev)
 		(void)_dm_udev_wait(cookie);
 
 	if (dmt)
@@ -1146,6 +1445,15 @@ out_no_removal:
 	return r;
 }
 
+static int _dm_create_device(const char *name, const char *type,
+			     struct device *device, uint32_t flags,
+			     const char *uuid, uint64_t size,
+			     dm_target_type target, char *params, int reload)
+{
+	return _dm_create_device_targets(name, type, device, flags, uuid,
+					 1, &size, target, &params, reload);
+}
+
 static int check_retry(uint32_t *dmd_flags, uint32_t dmt_flags)
 {
 	int ret = 0;
@@ -1174,6 +1482,20 @@ static int check_retry(uint32_t *dmd_flags, uint32_t dmt_flags)
 		ret = 1;
 	}
 
+	if ((*dmd_flags & (CRYPT_ACTIVATE_NO_READ_WORKQUEUE | CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE)) &&
+	    !(dmt_flags & DM_CRYPT_NO_WORKQUEUE_SUPPORTED)) {
+		log_dbg("dm-crypt doesn't support bypassing workqueues");
+		*dmd_flags = *dmd_flags & ~(CRYPT_ACTIVATE_NO_READ_WORKQUEUE | CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE);
+		ret = 1;
+	}
+
+	if ((*dmd_flags & CRYPT_ACTIVATE_HIGH_PRIORITY) &&
+	    !(dmt_flags & DM_CRYPT_HIGH_PRIORITY_SUPPORTED)) {
+		log_dbg("dm-crypt doesn't support high priority workqueues");
+		*dmd_flags = *dmd_flags & ~CRYPT_ACTIVATE_HIGH_PRIORITY;
+		ret = 1;
+	}
+
 	return ret;
 }
 
@@ -1192,6 +1514,7 @@ int dm_create_device(struct crypt_device *cd, const char *name,
 	if (dm_init_context(cd, dmd->target))
 		return -ENOTSUP;
 
+	crypt_trace(cd, CRYPT_TRACE_DM_CREATE, 0, 0);
 	dmd_flags = dmd->flags;
 	dmt_flags = 0;
 
@@ -1222,6 +1545,12 @@ int dm_create_device(struct crypt_device *cd, const char *name,
 	    !(dmt_flags & (DM_SAME_CPU_CRYPT_SUPPORTED|DM_SUBMIT_FROM_CRYPT_CPUS_SUPPORTED)))
 		log_err(cd, _("Requested dm-crypt performance options are not supported."));
 
+	if (r == -EINVAL &&
+	    ((dmd_flags & (CRYPT_ACTIVATE_NO_READ_WORKQUEUE|CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE) &&
+	      !(dmt_flags & DM_CRYPT_NO_WORKQUEUE_SUPPORTED)) ||
+	     (dmd_flags & CRYPT_ACTIVATE_HIGH_PRIORITY && !(dmt_flags & DM_CRYPT_HIGH_PRIORITY_SUPPORTED))))
+		log_err(cd, _("Requested dm-crypt performance options are not supported."));
+
 	if (r == -EINVAL && dmd_flags & (CRYPT_ACTIVATE_IGNORE_CORRUPTION|
 					  CRYPT_ACTIVATE_RESTART_ON_CORRUPTION|
 					  CRYPT_ACTIVATE_IGNORE_ZERO_BLOCKS|
@@ -1233,6 +1562,15 @@ int dm_create_device(struct crypt_device *cd, const char *name,
 	    !(dmt_flags & DM_VERITY_FEC_SUPPORTED))
 		log_err(cd, _("Requested dm-verity FEC options are not supported."));
 
+	if (r == -EINVAL && dmd->target == DM_VERITY && dmd_flags & CRYPT_ACTIVATE_TASKLETS &&
+	    !(dmt_flags & DM_VERITY_TASKLETS_SUPPORTED))
+		log_err(cd, _("Requested dm-verity tasklet option is not supported."));
+
+	if (r == -EINVAL && dmd->target == DM_INTEGRITY &&
+	    ((dmd_flags & CRYPT_ACTIVATE_RECALCULATE && !(dmt_flags & DM_INTEGRITY_RECALC_SUPPORTED)) ||
+	     (dmd_flags & CRYPT_ACTIVATE_NO_JOURNAL_BITMAP && !(dmt_flags & DM_INTEGRITY_BITMAP_SUPPORTED))))
+		log_err(cd, _("Requested dm-integrity bitmap or recalculate options are not supported."));
+
 	if (r == -EINVAL && dmd->target == DM_CRYPT) {
 		if (dmd->u.crypt.integrity && !(dmt_flags & DM_INTEGRITY_SUPPORTED))
 			log_err(cd, _("Requested data integrity options are not supported."));
@@ -1241,10 +1579,192 @@ int dm_create_device(struct crypt_device *cd, const char *name,
 	}
 out:
 	crypt_safe_free(table_params);
+	crypt_trace(cd, CRYPT_TRACE_DM_CREATE, 1, 0);
+	dm_exit_context();
+	return r;
+}
+
+/*
+ * Create (or reload and resume) dm-crypt device mapping count segments
+ * in the order given. Activation flags, UUID and data device are taken
+ * from the first segment, zero sized segments are skipped.
+ */
+int dm_create_device_segments(struct crypt_device *cd, const char *name,
+			      const char *type,
+			      struct crypt_dm_active_device *dmd,
+			      unsigned count, int reload)
+{
+	char *table_params[DM_CRYPT_SEGMENTS_MAX];
+	uint64_t sizes[DM_CRYPT_SEGMENTS_MAX];
+	unsigned i, n = 0;
+	int r = -EINVAL;
+
+	if (!type || !count || count > DM_CRYPT_SEGMENTS_MAX)
+		return -EINVAL;
+
+	if (dm_init_context(cd, DM_CRYPT))
+		return -ENOTSUP;
+
+	for (i = 0; i < count; i++) {
+		if (dmd[i].target != DM_CRYPT || dmd[i].u.crypt.tag_size)
+			goto out;
+		if (!dmd[i].size)
+			continue;
+		sizes[n] = dmd[i].size;
+		table_params[n] = get_dm_crypt_params(&dmd[i], dmd[0].flags);
+		if (!table_params[n++])
+			goto out;
+	}
+
+	crypt_trace(cd, CRYPT_TRACE_DM_CREATE, 0, 0);
+	r = _dm_create_device_targets(name, type, dmd[0].data_device, dmd[0].flags,
+				      dmd[0].uuid, n, sizes, DM_CRYPT, table_params, reload);
+	crypt_trace(cd, CRYPT_TRACE_DM_CREATE, 1, 0);
+out:
+	for (i = 0; i < n; i++)
+		crypt_safe_free(table_params[i]);
+	dm_exit_context();
+	return r;
+}
+
+/* dm-mirror recovery region (in sectors) and sync status poll interval */
+#define DM_MIRROR_REGION_SIZE	1024
+#define DM_MIRROR_POLL_US	10000
+
+/* Status is "2 <leg> <leg> <in sync>/<regions> 1 <leg health> ..." */
+static int _dm_mirror_status(const char *name, uint64_t *in_sync, uint64_t *regions)
+{
+	struct dm_task *dmt;
+	uint64_t start, length;
+	char *target_type, *params, *p, health[3];
+	int i, r = -EINVAL;
+
+	if (!(dmt = dm_task_create(DM_DEVICE_STATUS)))
+		return -EINVAL;
+
+	if (!dm_task_set_name(dmt, name) || !dm_task_run(dmt))
+		goto out;
+
+	dm_get_next_target(dmt, NULL, &start, &length, &target_type, &params);
+	if (!target_type || strcmp(target_type, DM_MIRROR_TARGET) || !params)
+		goto out;
+
+	for (p = params, i = 0; p && i < 3; i++)
+		if ((p = strchr(p, ' ')))
+			p++;
+
+	if (!p || strncmp(params, "2 ", 2) ||
+	    sscanf(p, "%" PRIu64 "/%" PRIu64 " %*d %2s", in_sync, regions, health) != 3)
+		goto out;
+
+	/* 'A' is alive, anything else means failed I/O on that leg */
+	r = strcmp(health, "AA") ? -EIO : 0;
+out:
+	dm_task_destroy(dmt);
+	return r;
+}
+
+/*
+ * Copy size sectors from src to dst device in kernel. A temporary dm-mirror
+ * with in-memory log is created over both areas, its initial resync
+ * copies the first leg to the second one through dm-kcopyd and no data
+ * passes through userspace. Both devices must be block devices, returns
+ * -ENOTSUP (nothing was written) if the mirror cannot be created.
+ * Caller must flush dst device.
+ */
+int dm_copy_sectors(struct crypt_device *cd, const char *name,
+		    struct device *src, uint64_t src_offset,
+		    struct device *dst, uint64_t dst_offset,
+		    uint64_t size)
+{
+	struct dm_task *dmt = NULL;
+	char dev_uuid[DM_UUID_LEN] = {0}, *params = NULL;
+	uint64_t in_sync, regions;
+	uint32_t cookie = 0;
+	int r = -ENOTSUP, udev = _dm_use_udev();
+
+	if (!size)
+		return 0;
+
+	if (!device_block_path(src) || !device_block_path(dst))
+		return -ENOTSUP;
+
+	if (dm_init_context(cd, DM_UNKNOWN))
+		return -ENOTSUP;
+
+	if (asprintf(&params, "core 1 %u 2 %s %" PRIu64 " %s %" PRIu64 " 1 handle_errors",
+		     DM_MIRROR_REGION_SIZE, device_block_path(src), src_offset,
+		     device_block_path(dst), dst_offset) < 0) {
+		params = NULL;
+		r = -ENOMEM;
+		goto out;
+	}
+
+	/* temporary device, udev must skip all rules */
+	if (!dm_prepare_uuid(name, "TEMP", NULL, dev_uuid, sizeof(dev_uuid)) ||
+	    !(dmt = dm_task_create(DM_DEVICE_CREATE)) ||
+	    !dm_task_set_name(dmt, name) ||
+	    !dm_task_set_uuid(dmt, dev_uuid) ||
+	    !dm_task_add_target(dmt, 0, size, DM_MIRROR_TARGET, params) ||
+	    (udev && !_dm_task_set_cookie(dmt, &cookie,
+			DM_UDEV_DISABLE_LIBRARY_FALLBACK | CRYPT_TEMP_UDEV_FLAGS)) ||
+	    !dm_task_run(dmt)) {
+		log_dbg("Cannot create temporary dm-mirror device %s.", name);
+		goto out;
+	}
+
+	if (udev) {
+		(void)_dm_udev_wait(cookie);
+		cookie = 0;
+	}
+
+	log_dbg("Copying %" PRIu64 " sectors from %s:%" PRIu64 " to %s:%" PRIu64 " in kernel.",
+		size, device_path(src), src_offset, device_path(dst), dst_offset);
+
+	while (!(r = _dm_mirror_status(name, &in_sync, &regions)) &&
+	       (!regions || in_sync < regions))
+		usleep(DM_MIRROR_POLL_US);
+
+	if (r)
+		log_dbg("Kernel copy through dm-mirror device %s failed.", name);
+
+	if (!_dm_remove(name, 1, 0)) {
+		log_err(cd, _("Cannot remove temporary device %s."), name);
+		if (!r)
+			r = -EINVAL;
+	}
+out:
+	if (cookie && udev)
+		(void)_dm_udev_wait(cookie);
+	if (dmt)
+		dm_task_destroy(dmt);
+	free(params);
+	dm_task_update_nodes();
 	dm_exit_context();
 	return r;
 }
 
+/*
+ * Only dm-crypt tables may consist of several targets (one per LUKS2 segment
+ * during online reencryption), all following targets must be dm-crypt too.
+ */
+static int _dm_targets_tail(struct dm_task *dmt, void *next,
+			    const char *target_type, uint64_t *length)
+{
+	uint64_t start, len;
+	char *type, *params;
+
+	while (next) {
+		next = dm_get_next_target(dmt, next, &start, &len, &type, &params);
+		if (!type || strcmp(target_type, DM_CRYPT_TARGET) ||
+		    strcmp(type, DM_CRYPT_TARGET))
+			return -EINVAL;
+		*length += len;
+	}
+
+	return 0;
+}
+
 static int dm_status_dmi(const char *name, struct dm_info *dmi,
 			  const char *target, char **status_line)
 {
@@ -1274,7 +1794,8 @@ static int dm_status_dmi(const char *name, struct dm_info *dmi,
 	next = dm_get_next_target(dmt, next, &start, &length,
 	                          &target_type, &params);
 
-	if (!target_type || start != 0 || next)
+	if (!target_type || start != 0 ||
+	    _dm_targets_tail(dmt, next, target_type, &length))
 		goto out;
 
 	if (target && strcmp(target_type, target))
@@ -1464,6 +1985,12 @@ static int _dm_query_crypt(uint32_t get_flags,
 				dmd->flags |= CRYPT_ACTIVATE_SAME_CPU_CRYPT;
 			else if (!strcasecmp(arg, "submit_from_crypt_cpus"))
 				dmd->flags |= CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS;
+			else if (!strcasecmp(arg, "no_read_workqueue"))
+				dmd->flags |= CRYPT_ACTIVATE_NO_READ_WORKQUEUE;
+			else if (!strcasecmp(arg, "no_write_workqueue"))
+				dmd->flags |= CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE;
+			else if (!strcasecmp(arg, "high_priority"))
+				dmd->flags |= CRYPT_ACTIVATE_HIGH_PRIORITY;
 			else if (sscanf(arg, "integrity:%u:", &val) == 1) {
 				dmd->u.crypt.tag_size = val;
 				rintegrity = strchr(arg + strlen("integrity:"), ':');
@@ -1718,6 +2245,8 @@ static int _dm_query_verity(uint32_t get_flags,
 				dmd->flags |= CRYPT_ACTIVATE_IGNORE_ZERO_BLOCKS;
 			else if (!strcasecmp(arg, "check_at_most_once"))
 				dmd->flags |= CRYPT_ACTIVATE_CHECK_AT_MOST_ONCE;
+			else if (!strcasecmp(arg, "try_verify_in_tasklet"))
+				dmd->flags |= CRYPT_ACTIVATE_TASKLETS;
 			else if (!strcasecmp(arg, "use_fec_from_device")) {
 				str = strsep(&params, " ");
 				str2 = crypt_lookup_dev(str);
@@ -1839,12 +2368,14 @@ static int _dm_query_integrity(uint32_t get_flags,
 
 	/* journal */
 	c = toupper(*(++params));
-	if (!*params || *(++params) != ' ' || (c != 'D' && c != 'J' && c != 'R'))
+	if (!*params || *(++params) != ' ' || (c != 'D' && c != 'J' && c != 'R' && c != 'B'))
 		goto err;
 	if (c == 'D')
 		dmd->flags |= CRYPT_ACTIVATE_NO_JOURNAL;
 	if (c == 'R')
 		dmd->flags |= CRYPT_ACTIVATE_RECOVERY;
+	if (c == 'B')
+		dmd->flags |= CRYPT_ACTIVATE_NO_JOURNAL_BITMAP;
 
 	dmd->u.integrity.sector_size = SECTOR_SIZE;
 
@@ -1874,6 +2405,12 @@ static int _dm_query_integrity(uint32_t get_flags,
 				dmd->u.integrity.sector_size = val;
 			else if (sscanf(arg, "buffer_sectors:%u", &val) == 1)
 				dmd->u.integrity.buffer_sectors = val;
+			else if (sscanf(arg, "sectors_per_bit:%u", &val) == 1)
+				dmd->u.integrity.sectors_per_bit = val;
+			else if (sscanf(arg, "bitmap_flush_interval:%u", &val) == 1)
+				dmd->u.integrity.bitmap_flush_time = val;
+			else if (!strcmp(arg, "recalculate"))
+				dmd->flags |= CRYPT_ACTIVATE_RECALCULATE;
 			else if (!strncmp(arg, "internal_hash:", 14) && !integrity) {
 				str = &arg[14];
 				arg = strsep(&str, ":");
@@ -1957,8 +2494,8 @@ err:
 	return r;
 }
 
-int dm_query_device(struct crypt_device *cd, const char *name,
-		    uint32_t get_flags, struct crypt_dm_active_device *dmd)
+static int _dm_query_device(const char *name, uint32_t get_flags,
+			    struct crypt_dm_active_device *dmd)
 {
 	struct dm_task *dmt;
 	struct dm_info dmi;
@@ -1969,8 +2506,6 @@ int dm_query_device(struct crypt_device *cd, const char *name,
 	void *next = NULL;
 	int r = -EINVAL;
 
-	if (dm_init_context(cd, DM_UNKNOWN))
-		return -ENOTSUP;
 	if (!(dmt = dm_task_create(DM_DEVICE_TABLE)))
 		goto out;
 	dm_flags(DM_UNKNOWN, &dmt_flags);
@@ -1994,7 +2529,9 @@ int dm_query_device(struct crypt_device *cd, const char *name,
 	next = dm_get_next_target(dmt, next, &start, &length,
 	                          &target_type, &params);
 
-	if (!target_type || start != 0 || next)
+	/* for multi-segment crypt table the first segment is reported */
+	if (!target_type || start != 0 ||
+	    _dm_targets_tail(dmt, next, target_type, &length))
 		goto out;
 
 	if (!strcmp(target_type, DM_CRYPT_TARGET)) {
@@ -2042,10 +2579,132 @@ out:
 	if (dmt)
 		dm_task_destroy(dmt);
 
+	return r;
+}
+
+int dm_query_device(struct crypt_device *cd, const char *name,
+		    uint32_t get_flags, struct crypt_dm_active_device *dmd)
+{
+	int r;
+
+	if (dm_init_context(cd, DM_UNKNOWN))
+		return -ENOTSUP;
+	r = _dm_query_device(name, get_flags, dmd);
 	dm_exit_context();
+
 	return r;
 }
 
+static void dm_entry_free(struct crypt_dm_device_entry *e)
+{
+	device_free(e->dmd.data_device);
+	free(CONST_CAST(void*)e->dmd.uuid);
+	free(e->name);
+	if (e->dmd.target == DM_CRYPT) {
+		free(CONST_CAST(void*)e->dmd.u.crypt.cipher);
+		free(CONST_CAST(void*)e->dmd.u.crypt.integrity);
+		crypt_free_volume_key(e->dmd.u.crypt.vk);
+	}
+}
+
+/*
+ * Query all active devices with cryptsetup UUID using one device list
+ * and one table (and for integrity status) ioctl per device.
+ * Only DM_ACTIVE_DEVICE, DM_ACTIVE_HOLDERS, DM_ACTIVE_CRYPT_CIPHER and
+ * DM_ACTIVE_CRYPT_KEYSIZE flags are supported,
+ * UUID is always returned, devices without cryptsetup UUID are skipped.
+ */
+int dm_query_all_devices(struct crypt_device *cd, uint32_t get_flags,
+			 struct crypt_dm_device_entry **entries, size_t *count)
+{
+	struct dm_task *dmt;
+	struct dm_names *names;
+	struct crypt_dm_device_entry *e = NULL, *tmp, entry;
+	struct dm_info dmi;
+	char *status_line;
+	size_t n = 0, alloc = 0;
+	unsigned next = 0;
+	int r = -EINVAL;
+
+	*entries = NULL;
+	*count = 0;
+
+	get_flags &= (DM_ACTIVE_DEVICE | DM_ACTIVE_HOLDERS |
+		      DM_ACTIVE_CRYPT_CIPHER | DM_ACTIVE_CRYPT_KEYSIZE);
+	get_flags |= DM_ACTIVE_UUID;
+
+	if (dm_init_context(cd, DM_UNKNOWN))
+		return -ENOTSUP;
+
+	if (!(dmt = dm_task_create(DM_DEVICE_LIST)))
+		goto out;
+
+	if (!dm_task_run(dmt) || !(names = dm_task_get_names(dmt)))
+		goto out;
+
+	r = 0;
+	if (!names->dev)
+		goto out;
+
+	do {
+		names = (struct dm_names *)((char *)names + next);
+		next = names->next;
+
+		memset(&entry, 0, sizeof(entry));
+		if (_dm_query_device(names->name, get_flags, &entry.dmd) < 0)
+			continue;
+
+		if (!entry.dmd.uuid || !(entry.name = strdup(names->name))) {
+			r = entry.dmd.uuid ? -ENOMEM : 0;
+			dm_entry_free(&entry);
+			if (r < 0)
+				break;
+			continue;
+		}
+
+		status_line = NULL;
+		if (entry.dmd.target == DM_INTEGRITY &&
+		    !dm_status_dmi(names->name, &dmi, DM_INTEGRITY_TARGET, &status_line) &&
+		    status_line)
+			entry.integrity_failures = strtoull(status_line, NULL, 10);
+		free(status_line);
+
+		if (n == alloc) {
+			alloc = alloc ? 2 * alloc : 16;
+			tmp = realloc(e, alloc * sizeof(*e));
+			if (!tmp) {
+				dm_entry_free(&entry);
+				r = -ENOMEM;
+				break;
+			}
+			e = tmp;
+		}
+		e[n++] = entry;
+	} while (next);
+out:
+	if (dmt)
+		dm_task_destroy(dmt);
+	dm_exit_context();
+
+	if (r < 0) {
+		dm_free_all_devices(e, n);
+		return r;
+	}
+
+	*entries = e;
+	*count = n;
+	return 0;
+}
+
+void dm_free_all_devices(struct crypt_dm_device_entry *entries, size_t count)
+{
+	size_t i;
+
+	for (i = 0; entries && i < count; i++)
+		dm_entry_free(&entries[i]);
+	free(entries);
+}
+
 static int _dm_message(const char *name, const char *msg, uint32_t dmt_flags)
 {
 	int r = 0;
@@ -2072,6 +2731,31 @@ out:
 	return r;
 }
 
+/*
+ * Key messages are delivered only to the target at sector 0, a table with
+ * more targets (online reencryption) would keep the other keys live.
+ */
+static int _dm_single_target(const char *name)
+{
+	struct dm_task *dmt;
+	uint64_t start, length;
+	char *target_type, *params;
+	void *next;
+	int r = 0;
+
+	if (!(dmt = dm_task_create(DM_DEVICE_STATUS)))
+		return 0;
+
+	if (!dm_task_set_name(dmt, name) || !dm_task_run(dmt))
+		goto out;
+
+	next = dm_get_next_target(dmt, NULL, &start, &length, &target_type, &params);
+	r = next ? 0 : 1;
+out:
+	dm_task_destroy(dmt);
+	return r;
+}
+
 int dm_suspend_device(struct crypt_device *cd, const char *name)
 {
 	int r;
@@ -2089,6 +2773,23 @@ int dm_suspend_device(struct crypt_device *cd, const char *name)
 	return r;
 }
 
+int dm_resume_device(struct crypt_device *cd, const char *name)
+{
+	int r;
+
+	if (dm_init_context(cd, DM_UNKNOWN))
+		return -ENOTSUP;
+
+	if (!_dm_simple(DM_DEVICE_RESUME, name, 1))
+		r = -EINVAL;
+	else
+		r = 0;
+
+	dm_exit_context();
+
+	return r;
+}
+
 int dm_suspend_and_wipe_key(struct crypt_device *cd, const char *name)
 {
 	uint32_t dmt_flags;
@@ -2097,7 +2798,7 @@ int dm_suspend_and_wipe_key(struct crypt_device *cd, const char *name)
 	if (dm_init_context(cd, DM_CRYPT) || dm_flags(DM_CRYPT, &dmt_flags))
 		return -ENOTSUP;
 
-	if (!(dmt_flags & DM_KEY_WIPE_SUPPORTED))
+	if (!(dmt_flags & DM_KEY_WIPE_SUPPORTED) || !_dm_single_target(name))
 		goto out;
 
 	if (!_dm_simple(DM_DEVICE_SUSPEND, name, 0)) {
@@ -2127,7 +2828,7 @@ int dm_resume_and_reinstate_key(struct crypt_device *cd, const char *name,
 	if (dm_init_context(cd, DM_CRYPT) || dm_flags(DM_CRYPT, &dmt_flags))
 		return -ENOTSUP;
 
-	if (!(dmt_flags & DM_KEY_WIPE_SUPPORTED))
+	if (!(dmt_flags & DM_KEY_WIPE_SUPPORTED) || !_dm_single_target(name))
 		goto out;
 
 	if (vk->key_description)
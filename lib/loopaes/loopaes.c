@@ -52,24 +52,6 @@ static unsigned char get_tweak(unsigned int keys_count)
 	return 0x00;
 }
 
-static int hash_key(const char *src, size_t src_len,
-		    char *dst, size_t dst_len,
-		    const char *hash_name)
-{
-	struct crypt_hash *hd = NULL;
-	int r;
-
-	if (crypt_hash_init(&hd, hash_name))
-		return -EINVAL;
-
-	r = crypt_hash_write(hd, src, src_len);
-	if (!r)
-		r = crypt_hash_final(hd, dst, dst_len);
-
-	crypt_hash_destroy(hd);
-	return r;
-}
-
 static int hash_keys(struct crypt_device *cd,
 		     struct volume_key **vk,
 		     const char *hash_override,
@@ -78,10 +60,11 @@ static int hash_keys(struct crypt_device *cd,
 		     unsigned int key_len_output,
 		     unsigned int key_len_input)
 {
+	struct crypt_hash *hd = NULL;
 	const char *hash_name;
 	char tweak, *key_ptr;
 	unsigned int i;
-	int r;
+	int r = 0;
 
 	hash_name = hash_override ?: get_hash(key_len_output);
 	tweak = get_tweak(keys_count);
@@ -96,16 +79,28 @@ static int hash_keys(struct crypt_device *cd,
 	if (!*vk)
 		return -ENOMEM;
 
-	for (i = 0; i < keys_count; i++) {
+	/*
+	 * One hash context for all keys, final() restarts it.
+	 * Keys are short (65 hashes of a line each), running it in threads
+	 * would cost more than the hashing itself.
+	 */
+	if (crypt_hash_init(&hd, hash_name))
+		r = -EINVAL;
+
+	for (i = 0; i < keys_count && !r; i++) {
 		key_ptr = &(*vk)->key[i * key_len_output];
-		r = hash_key(input_keys[i], key_len_input, key_ptr,
-			     key_len_output, hash_name);
+		r = crypt_hash_write(hd, input_keys[i], key_len_input);
+		if (!r)
+			r = crypt_hash_final(hd, key_ptr, key_len_output);
 		if (r < 0)
 			break;
 
 		key_ptr[0] ^= tweak;
 	}
 
+	if (hd)
+		crypt_hash_destroy(hd);
+
 	if (r < 0 && *vk) {
 		crypt_free_volume_key(*vk);
 		*vk = NULL;
@@ -113,6 +108,22 @@ static int hash_keys(struct crypt_device *cd,
 	return r;
 }
 
+static int is_key_end(char c)
+{
+	return c == '\n' || c == '\r' || c == '\0';
+}
+
+/* Length of key up to the line end */
+static unsigned int key_length(const char *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len && !is_key_end(buf[i]); i++)
+		;
+
+	return (unsigned int)i;
+}
+
 static int keyfile_is_gpg(char *buffer, size_t buffer_len)
 {
 	int r = 0;
@@ -148,27 +159,24 @@ int LOOPAES_parse_keyfile(struct crypt_device *cd,
 		return -EINVAL;
 	}
 
-	/* Remove EOL in buffer */
-	for (i = 0; i < buffer_len; i++)
-		if (buffer[i] == '\n' || buffer[i] == '\r')
-			buffer[i] = '\0';
-
+	/*
+	 * Keys are parsed in one pass, line ends (or NUL) terminate keys.
+	 * Keys are used with explicit length, buffer is not modified.
+	 */
 	offset = 0;
 	key_index = 0;
 	key_lengths[0] = 0;
 	while (offset < buffer_len && key_index < LOOPAES_KEYS_MAX) {
 		keys[key_index] = &buffer[offset];
-		key_lengths[key_index] = 0;;
-		while (offset < buffer_len && buffer[offset]) {
-			offset++;
-			key_lengths[key_index]++;
-		}
+		key_len = key_length(&buffer[offset], buffer_len - offset);
+		key_lengths[key_index] = key_len;
+		offset += key_len;
 		if (offset == buffer_len) {
 			log_dbg("Unterminated key #%d in keyfile.", key_index);
 			log_err(cd, _("Incompatible loop-AES keyfile detected."));
 			return -EINVAL;
 		}
-		while (offset < buffer_len && !buffer[offset])
+		while (offset < buffer_len && is_key_end(buffer[offset]))
 			offset++;
 		key_index++;
 	}
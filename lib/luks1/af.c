@@ -32,67 +32,94 @@
 
 static void XORblock(const char *src1, const char *src2, char *dst, size_t n)
 {
-	size_t j;
+	uint64_t a, b;
+	size_t j = 0;
+
+	/* Four independent words per round, compilers vectorize this */
+	for (; j + 4 * sizeof(uint64_t) <= n; j += 4 * sizeof(uint64_t)) {
+		uint64_t a4[4], b4[4];
+
+		memcpy(a4, src1 + j, sizeof(a4));
+		memcpy(b4, src2 + j, sizeof(b4));
+		a4[0] ^= b4[0];
+		a4[1] ^= b4[1];
+		a4[2] ^= b4[2];
+		a4[3] ^= b4[3];
+		memcpy(dst + j, a4, sizeof(a4));
+	}
+
+	for (; j + sizeof(uint64_t) <= n; j += sizeof(uint64_t)) {
+		memcpy(&a, src1 + j, sizeof(a));
+		memcpy(&b, src2 + j, sizeof(b));
+		a ^= b;
+		memcpy(dst + j, &a, sizeof(a));
+	}
 
-	for(j = 0; j < n; ++j)
+	for(; j < n; ++j)
 		dst[j] = src1[j] ^ src2[j];
 }
 
-static int hash_buf(const char *src, char *dst, uint32_t iv,
-		    size_t len, const char *hash_name)
+/* Hash context is reused, crypt_hash_final() resets it for the next block */
+static int hash_buf(struct crypt_hash *hd, const char *src, char *dst,
+		    uint32_t iv, size_t len)
 {
-	struct crypt_hash *hd = NULL;
 	char *iv_char = (char *)&iv;
 	int r;
 
 	iv = htonl(iv);
-	if (crypt_hash_init(&hd, hash_name))
-		return -EINVAL;
 
 	if ((r = crypt_hash_write(hd, iv_char, sizeof(uint32_t))))
-		goto out;
+		return r;
 
 	if ((r = crypt_hash_write(hd, src, len)))
-		goto out;
+		return r;
 
-	r = crypt_hash_final(hd, dst, len);
-out:
-	crypt_hash_destroy(hd);
-	return r;
+	return crypt_hash_final(hd, dst, len);
 }
 
 /* diffuse: Information spreading over the whole dataset with
  * the help of hash function.
  */
 
-static int diffuse(char *src, char *dst, size_t size, const char *hash_name)
+static int diffuse(struct crypt_hash *hd, char *src, char *dst, size_t size,
+		   unsigned int digest_size)
 {
-	int hash_size = crypt_hash_size(hash_name);
-	unsigned int digest_size;
 	unsigned int i, blocks, padding;
 
-	if (hash_size <= 0)
-		return 1;
-	digest_size = hash_size;
-
 	blocks = size / digest_size;
 	padding = size % digest_size;
 
 	for (i = 0; i < blocks; i++)
-		if(hash_buf(src + digest_size * i,
+		if(hash_buf(hd, src + digest_size * i,
 			    dst + digest_size * i,
-			    i, (size_t)digest_size, hash_name))
+			    i, (size_t)digest_size))
 			return 1;
 
 	if(padding)
-		if(hash_buf(src + digest_size * i,
+		if(hash_buf(hd, src + digest_size * i,
 			    dst + digest_size * i,
-			    i, (size_t)padding, hash_name))
+			    i, (size_t)padding))
 			return 1;
 
 	return 0;
 }
 
+/* One hash context is used for all stripes */
+static int diffuse_init(struct crypt_hash **hd, unsigned int *digest_size,
+			const char *hash_name)
+{
+	int hash_size = crypt_hash_size(hash_name);
+
+	if (hash_size <= 0)
+		return -EINVAL;
+	*digest_size = hash_size;
+
+	if (crypt_hash_init(hd, hash_name))
+		return -EINVAL;
+
+	return 0;
+}
+
 /*
  * Information splitting. The amount of data is multiplied by
  * blocknumbers. The same blocksize and blocknumbers values
@@ -102,25 +129,38 @@ static int diffuse(char *src, char *dst, size_t size, const char *hash_name)
 int AF_split(const char *src, char *dst, size_t blocksize,
 	     unsigned int blocknumbers, const char *hash)
 {
-	unsigned int i;
+	struct crypt_hash *hd = NULL;
+	unsigned int i, digest_size;
 	char *bufblock;
 	int r = -EINVAL;
 
-	if((bufblock = calloc(blocksize, 1)) == NULL) return -ENOMEM;
+	if (diffuse_init(&hd, &digest_size, hash))
+		return -EINVAL;
+
+	if((bufblock = calloc(blocksize, 1)) == NULL) {
+		crypt_hash_destroy(hd);
+		return -ENOMEM;
+	}
+
+	/* random stripes (all except the last block) in one generator call */
+	r = crypt_random_get(NULL, dst, blocksize * (blocknumbers - 1), CRYPT_RND_NORMAL);
+	if (r < 0)
+		goto out;
 
 	/* process everything except the last block */
 	for(i=0; i<blocknumbers-1; i++) {
-		r = crypt_random_get(NULL, dst+(blocksize*i), blocksize, CRYPT_RND_NORMAL);
-		if(r < 0) goto out;
-
 		XORblock(dst+(blocksize*i),bufblock,bufblock,blocksize);
-		if(diffuse(bufblock, bufblock, blocksize, hash))
+		if(diffuse(hd, bufblock, bufblock, blocksize, digest_size)) {
+			r = -EINVAL;
 			goto out;
+		}
 	}
 	/* the last block is computed */
 	XORblock(src,bufblock,dst+(i*blocksize),blocksize);
 	r = 0;
 out:
+	crypt_hash_destroy(hd);
+	crypt_memzero(bufblock, blocksize);
 	free(bufblock);
 	return r;
 }
@@ -128,22 +168,29 @@ out:
 int AF_merge(const char *src, char *dst, size_t blocksize,
 	     unsigned int blocknumbers, const char *hash)
 {
-	unsigned int i;
+	struct crypt_hash *hd = NULL;
+	unsigned int i, digest_size;
 	char *bufblock;
 	int r = -EINVAL;
 
-	if((bufblock = calloc(blocksize, 1)) == NULL)
+	if (diffuse_init(&hd, &digest_size, hash))
+		return -EINVAL;
+
+	if((bufblock = calloc(blocksize, 1)) == NULL) {
+		crypt_hash_destroy(hd);
 		return -ENOMEM;
+	}
 
-	memset(bufblock,0,blocksize);
 	for(i=0; i<blocknumbers-1; i++) {
 		XORblock(src+(blocksize*i),bufblock,bufblock,blocksize);
-		if(diffuse(bufblock, bufblock, blocksize, hash))
+		if(diffuse(hd, bufblock, bufblock, blocksize, digest_size))
 			goto out;
 	}
 	XORblock(src + blocksize * i, bufblock, dst, blocksize);
 	r = 0;
 out:
+	crypt_hash_destroy(hd);
+	crypt_memzero(bufblock, blocksize);
 	free(bufblock);
 	return r;
 }
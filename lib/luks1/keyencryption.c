@@ -24,6 +24,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include "luks.h"
 #include "af.h"
 #include "internal.h"
@@ -46,6 +47,9 @@ static void _error_hint(struct crypt_device *ctx, const char *device,
 		log_err(ctx, _("Cipher specification should be in [cipher]-[mode]-[iv] format."));
 }
 
+/* Temporary keystore device name is per process, serialize concurrent unlocks */
+static pthread_mutex_t endec_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int LUKS_endec_template(char *src, size_t srcLength,
 			       const char *cipher, const char *cipher_mode,
 			       struct volume_key *vk,
@@ -109,8 +113,10 @@ static int LUKS_endec_template(char *src, size_t srcLength,
 		return -EACCES;
 	}
 
+	pthread_mutex_lock(&endec_lock);
 	r = dm_create_device(ctx, name, "TEMP", &dmd, 0);
 	if (r < 0) {
+		pthread_mutex_unlock(&endec_lock);
 		if (r != -EACCES && r != -ENOTSUP)
 			_error_hint(ctx, device_path(dmd.data_device),
 				    cipher, cipher_mode, vk->keylength * 8);
@@ -134,6 +140,7 @@ static int LUKS_endec_template(char *src, size_t srcLength,
 	if (devfd != -1)
 		close(devfd);
 	dm_remove_device(ctx, name, CRYPT_DEACTIVATE_FORCE);
+	pthread_mutex_unlock(&endec_lock);
 	return r;
 }
 
@@ -194,7 +201,7 @@ int LUKS_encrypt_to_storage(char *src, size_t srcLength,
 	r = 0;
 out:
 	if (devfd >= 0)
-		close(devfd);
+		device_close(device, devfd);
 	if (r)
 		log_err(ctx, _("IO error while encrypting keyslot."));
 
@@ -237,6 +244,13 @@ int LUKS_decrypt_from_storage(char *dst, size_t dstLength,
 
 	r = -EIO;
 
+	/* Keyslot area already prefetched */
+	if (!crypt_keyslot_area_read_cached(ctx, dst, dstLength, (uint64_t)sector * SECTOR_SIZE)) {
+		r = crypt_storage_decrypt(s, 0, dstLength / SECTOR_SIZE, dst);
+		crypt_storage_destroy(s);
+		return r;
+	}
+
 	/* Read buffer from device */
 	devfd = device_open(device, O_RDONLY);
 	if (devfd < 0)
@@ -247,7 +261,7 @@ int LUKS_decrypt_from_storage(char *dst, size_t dstLength,
 				 sector * SECTOR_SIZE) < 0)
 		goto bad;
 
-	close(devfd);
+	device_close(device, devfd);
 
 	/* Decrypt buffer */
 	r = crypt_storage_decrypt(s, 0, dstLength / SECTOR_SIZE, dst);
@@ -256,7 +270,7 @@ int LUKS_decrypt_from_storage(char *dst, size_t dstLength,
 	return r;
 bad:
 	if (devfd >= 0)
-		close(devfd);
+		device_close(device, devfd);
 
 	log_err(ctx, _("IO error while decrypting keyslot."));
 	crypt_storage_destroy(s);
@@ -217,8 +217,8 @@ int LUKS_hdr_backup(const char *backup_file, struct crypt_device *ctx)
 {
 	struct device *device = crypt_metadata_device(ctx);
 	struct luks_phdr hdr;
-	int r = 0, devfd = -1;
-	size_t hdr_size;
+	int r = 0, devfd = -1, fd = -1, copied;
+	size_t hdr_size, wipe_size = LUKS_ALIGN_KEYSLOTS - sizeof(hdr);
 	size_t buffer_size;
 	char *buffer = NULL;
 
@@ -240,34 +240,45 @@ int LUKS_hdr_backup(const char *backup_file, struct crypt_device *ctx)
 
 	log_dbg("Output backup file size: %zu bytes.", buffer_size);
 
-	devfd = device_open(device, O_RDONLY);
-	if (devfd < 0) {
-		log_err(ctx, _("Device %s is not a valid LUKS device."), device_path(device));
-		r = -EINVAL;
+	fd = crypt_backup_file_open(ctx, backup_file, buffer_size);
+	if (fd < 0) {
+		r = fd;
 		goto out;
 	}
 
-	if (read_blockwise(devfd, device_block_size(device), device_alignment(device),
-			   buffer, hdr_size) < (ssize_t)hdr_size) {
-		r = -EIO;
+	/* Detached header file is copied in kernel, no need to read it */
+	r = crypt_backup_file_copy(ctx, device, fd, hdr_size);
+	copied = !r;
+	if (r && r != -ENOTSUP)
 		goto out;
+
+	if (!copied) {
+		devfd = device_open(device, O_RDONLY);
+		if (devfd < 0) {
+			log_err(ctx, _("Device %s is not a valid LUKS device."), device_path(device));
+			r = -EINVAL;
+			goto out;
+		}
+
+		r = read_blockwise(devfd, device_block_size(device), device_alignment(device),
+				   buffer, hdr_size) < (ssize_t)hdr_size ? -EIO : 0;
+		device_close(device, devfd);
+		if (r)
+			goto out;
 	}
-	close(devfd);
 
 	/* Wipe unused area, so backup cannot contain old signatures */
 	if (hdr.keyblock[0].keyMaterialOffset * SECTOR_SIZE == LUKS_ALIGN_KEYSLOTS)
 		memset(buffer + sizeof(hdr), 0, LUKS_ALIGN_KEYSLOTS - sizeof(hdr));
+	else
+		wipe_size = 0;
 
-	devfd = open(backup_file, O_CREAT|O_EXCL|O_WRONLY, S_IRUSR);
-	if (devfd == -1) {
-		if (errno == EEXIST)
-			log_err(ctx, _("Requested header backup file %s already exists."), backup_file);
-		else
-			log_err(ctx, _("Cannot create header backup file %s."), backup_file);
-		r = -EINVAL;
-		goto out;
-	}
-	if (write_buffer(devfd, buffer, buffer_size) < (ssize_t)buffer_size) {
+	/* Copied backup needs only the unused area rewritten */
+	if (copied)
+		r = write_buffer_at(fd, buffer + sizeof(hdr), wipe_size, sizeof(hdr)) < (ssize_t)wipe_size;
+	else
+		r = write_buffer_at(fd, buffer, buffer_size, 0) < (ssize_t)buffer_size;
+	if (r) {
 		log_err(ctx, _("Cannot write header backup file %s."), backup_file);
 		r = -EIO;
 		goto out;
@@ -275,8 +286,11 @@ int LUKS_hdr_backup(const char *backup_file, struct crypt_device *ctx)
 
 	r = 0;
 out:
-	if (devfd >= 0)
-		close(devfd);
+	if (fd >= 0) {
+		if (r < 0)
+			unlink(backup_file);
+		close(fd);
+	}
 	crypt_memzero(&hdr, sizeof(hdr));
 	crypt_safe_free(buffer);
 	return r;
@@ -372,14 +386,14 @@ int LUKS_hdr_restore(
 		r = -EIO;
 		goto out;
 	}
-	close(devfd);
+	device_close(device, devfd);
 	devfd = -1;
 
 	/* Be sure to reload new data */
 	r = LUKS_read_phdr(hdr, 1, 0, ctx);
 out:
 	if (devfd >= 0)
-		close(devfd);
+		device_close(device, devfd);
 	crypt_safe_free(buffer);
 	return r;
 }
@@ -611,12 +625,17 @@ int LUKS_read_phdr(struct luks_phdr *hdr,
 		return -EINVAL;
 	}
 
+	crypt_trace(ctx, CRYPT_TRACE_HDR_READ, 0, 0);
 	if (read_blockwise(devfd, device_block_size(device), device_alignment(device),
 			   hdr, hdr_size) < hdr_size)
 		r = -EIO;
-	else
+	else {
+		crypt_trace(ctx, CRYPT_TRACE_HDR_VALIDATE, 0, 0);
 		r = _check_and_convert_hdr(device_path(device), hdr, require_luks_device,
 					   repair, ctx);
+		crypt_trace(ctx, CRYPT_TRACE_HDR_VALIDATE, 1, hdr_size);
+	}
+	crypt_trace(ctx, CRYPT_TRACE_HDR_READ, 1, r == -EIO ? 0 : hdr_size);
 
 	if (!r)
 		r = LUKS_check_device_size(ctx, hdr, 0);
@@ -631,7 +650,7 @@ int LUKS_read_phdr(struct luks_phdr *hdr,
 		device_disable_direct_io(device);
 	}
 
-	close(devfd);
+	device_close(device, devfd);
 	return r;
 }
 
@@ -681,7 +700,7 @@ int LUKS_write_phdr(struct luks_phdr *hdr,
 			    &convHdr, hdr_size) < hdr_size ? -EIO : 0;
 	if (r)
 		log_err(ctx, _("Error during update of LUKS header on device %s."), device_path(device));
-	close(devfd);
+	device_close(device, devfd);
 
 	/* Re-read header from disk to be sure that in-memory and on-disk data are the same. */
 	if (!r) {
@@ -966,9 +985,11 @@ int LUKS_verify_volume_key(const struct luks_phdr *hdr,
 }
 
 /* Try to open a particular key slot */
+/* Uses precomputed derived key (dk) if provided, otherwise runs PBKDF2 on password */
 static int LUKS_open_key(unsigned int keyIndex,
 		  const char *password,
 		  size_t passwordLen,
+		  const struct volume_key *dk,
 		  struct luks_phdr *hdr,
 		  struct volume_key *vk,
 		  struct crypt_device *ctx)
@@ -997,28 +1018,41 @@ static int LUKS_open_key(unsigned int keyIndex,
 		goto out;
 	}
 
-	r = crypt_pbkdf(CRYPT_KDF_PBKDF2, hdr->hashSpec, password, passwordLen,
-			hdr->keyblock[keyIndex].passwordSalt, LUKS_SALTSIZE,
-			derived_key->key, hdr->keyBytes,
-			hdr->keyblock[keyIndex].passwordIterations, 0, 0);
+	if (dk) {
+		memcpy(derived_key->key, dk->key, hdr->keyBytes);
+		r = 0;
+	} else {
+		crypt_trace(ctx, CRYPT_TRACE_PBKDF, 0, 0);
+		r = crypt_pbkdf(CRYPT_KDF_PBKDF2, hdr->hashSpec, password, passwordLen,
+				hdr->keyblock[keyIndex].passwordSalt, LUKS_SALTSIZE,
+				derived_key->key, hdr->keyBytes,
+				hdr->keyblock[keyIndex].passwordIterations, 0, 0);
+		crypt_trace(ctx, CRYPT_TRACE_PBKDF, 1, 0);
+	}
 	if (r < 0)
 		goto out;
 
 	log_dbg("Reading key slot %d area.", keyIndex);
+	crypt_trace(ctx, CRYPT_TRACE_KEYSLOT_DECRYPT, 0, 0);
 	r = LUKS_decrypt_from_storage(AfKey,
 				      AFEKSize,
 				      hdr->cipherName, hdr->cipherMode,
 				      derived_key,
 				      hdr->keyblock[keyIndex].keyMaterialOffset,
 				      ctx);
+	crypt_trace(ctx, CRYPT_TRACE_KEYSLOT_DECRYPT, 1, AFEKSize);
 	if (r < 0)
 		goto out;
 
+	crypt_trace(ctx, CRYPT_TRACE_AF_MERGE, 0, 0);
 	r = AF_merge(AfKey,vk->key,vk->keylength,hdr->keyblock[keyIndex].stripes,hdr->hashSpec);
+	crypt_trace(ctx, CRYPT_TRACE_AF_MERGE, 1, AFEKSize);
 	if (r < 0)
 		goto out;
 
+	crypt_trace(ctx, CRYPT_TRACE_DIGEST_VERIFY, 0, 0);
 	r = LUKS_verify_volume_key(hdr, vk);
+	crypt_trace(ctx, CRYPT_TRACE_DIGEST_VERIFY, 1, vk->keylength);
 
 	/* Allow only empty passphrase with null cipher */
 	if (!r && !strcmp(hdr->cipherName, "cipher_null") && passwordLen)
@@ -1032,6 +1066,76 @@ out:
 	return r;
 }
 
+/*
+ * Derive keys of all active keyslots concurrently and try them in keyslot order.
+ * Returns -EAGAIN if not applicable (less than two active keyslots or one CPU).
+ */
+static int LUKS_open_key_parallel(const char *password,
+				  size_t passwordLen,
+				  struct luks_phdr *hdr,
+				  struct volume_key *vk,
+				  struct crypt_device *ctx)
+{
+	struct crypt_pbkdf_job job[LUKS_NUMKEYS] = {};
+	struct crypt_pbkdf_jobs *jobs = NULL;
+	int keyslot[LUKS_NUMKEYS];
+	int i, r, count = 0;
+
+	if (crypt_cpusonline() < 2)
+		return -EAGAIN;
+
+	for (i = 0; i < LUKS_NUMKEYS; i++)
+		if (LUKS_keyslot_info(hdr, i) >= CRYPT_SLOT_ACTIVE)
+			keyslot[count++] = i;
+
+	if (count < 2)
+		return -EAGAIN;
+
+	crypt_keyslot_history_sort(hdr->uuid, keyslot, count);
+
+	for (i = 0; i < count; i++) {
+		job[i].type = CRYPT_KDF_PBKDF2;
+		job[i].hash = hdr->hashSpec;
+		job[i].salt = hdr->keyblock[keyslot[i]].passwordSalt;
+		job[i].salt_length = LUKS_SALTSIZE;
+		job[i].iterations = hdr->keyblock[keyslot[i]].passwordIterations;
+		job[i].key = crypt_alloc_volume_key(hdr->keyBytes, NULL);
+		if (!job[i].key) {
+			r = -ENOMEM;
+			goto out;
+		}
+	}
+
+	if (crypt_pbkdf_jobs_start(&jobs, job, count, password, passwordLen)) {
+		r = -EAGAIN;
+		goto out;
+	}
+
+	for (i = 0, r = -EPERM; i < count; i++) {
+		r = crypt_pbkdf_jobs_wait(jobs, i);
+		if (r >= 0)
+			r = LUKS_open_key(keyslot[i], NULL, passwordLen, job[i].key, hdr, vk, ctx);
+		if (r == 0) {
+			r = keyslot[i];
+			break;
+		}
+
+		/* Do not retry for errors that are no -EPERM or -ENOENT,
+		   former meaning password wrong, latter key slot inactive */
+		if ((r != -EPERM) && (r != -ENOENT))
+			break;
+	}
+
+	/* Warning, keep the same return value as LUKS_open_key_with_hdr */
+	if (r == -ENOENT)
+		r = -EPERM;
+out:
+	crypt_pbkdf_jobs_stop(jobs);
+	for (i = 0; i < count; i++)
+		crypt_free_volume_key(job[i].key);
+	return r;
+}
+
 int LUKS_open_key_with_hdr(int keyIndex,
 			   const char *password,
 			   size_t passwordLen,
@@ -1039,20 +1143,34 @@ int LUKS_open_key_with_hdr(int keyIndex,
 			   struct volume_key **vk,
 			   struct crypt_device *ctx)
 {
-	unsigned int i;
-	int r;
+	int i, r, keyslot[LUKS_NUMKEYS];
 
 	*vk = crypt_alloc_volume_key(hdr->keyBytes, NULL);
 
 	if (keyIndex >= 0) {
-		r = LUKS_open_key(keyIndex, password, passwordLen, hdr, *vk, ctx);
-		return (r < 0) ? r : keyIndex;
+		r = LUKS_open_key(keyIndex, password, passwordLen, NULL, hdr, *vk, ctx);
+		if (r < 0)
+			return r;
+		crypt_keyslot_history_hit(hdr->uuid, keyIndex);
+		return keyIndex;
 	}
 
+	r = LUKS_open_key_parallel(password, passwordLen, hdr, *vk, ctx);
+	if (r >= 0)
+		crypt_keyslot_history_hit(hdr->uuid, r);
+	if (r != -EAGAIN)
+		return r;
+
+	for (i = 0; i < LUKS_NUMKEYS; i++)
+		keyslot[i] = i;
+	crypt_keyslot_history_sort(hdr->uuid, keyslot, LUKS_NUMKEYS);
+
 	for(i = 0; i < LUKS_NUMKEYS; i++) {
-		r = LUKS_open_key(i, password, passwordLen, hdr, *vk, ctx);
-		if(r == 0)
-			return i;
+		r = LUKS_open_key(keyslot[i], password, passwordLen, NULL, hdr, *vk, ctx);
+		if(r == 0) {
+			crypt_keyslot_history_hit(hdr->uuid, keyslot[i]);
+			return keyslot[i];
+		}
 
 		/* Do not retry for errors that are no -EPERM or -ENOENT,
 		   former meaning password wrong, latter key slot inactive */
@@ -1109,6 +1227,60 @@ int LUKS_del_key(unsigned int keyIndex,
 	return r;
 }
 
+/* Delete several keys, areas are wiped in one pass and header written once */
+int LUKS_del_keys(const int *keyslots,
+		  unsigned count,
+		  struct luks_phdr *hdr,
+		  struct crypt_device *ctx)
+{
+	struct device *device = crypt_metadata_device(ctx);
+	struct crypt_wipe_area areas[LUKS_NUMKEYS];
+	unsigned i, startOffset, endOffset;
+	int r;
+
+	if (!keyslots || !count || count > LUKS_NUMKEYS)
+		return -EINVAL;
+
+	r = LUKS_read_phdr(hdr, 1, 0, ctx);
+	if (r)
+		return r;
+
+	for (i = 0; i < count; i++) {
+		r = LUKS_keyslot_set(hdr, keyslots[i], 0);
+		if (r) {
+			log_err(ctx, _("Key slot %d is invalid, please select keyslot between 0 and %d."),
+				keyslots[i], LUKS_NUMKEYS - 1);
+			return r;
+		}
+
+		startOffset = hdr->keyblock[keyslots[i]].keyMaterialOffset;
+		endOffset = startOffset + AF_split_sectors(hdr->keyBytes, hdr->keyblock[keyslots[i]].stripes);
+		areas[i].offset = (uint64_t)startOffset * SECTOR_SIZE;
+		areas[i].length = (uint64_t)(endOffset - startOffset) * SECTOR_SIZE;
+	}
+
+	/* secure deletion of key material */
+	r = crypt_wipe_device_areas(ctx, device, CRYPT_WIPE_SPECIAL, areas, count);
+	if (r) {
+		if (r == -EACCES) {
+			log_err(ctx, _("Cannot write to device %s, permission denied."),
+				device_path(device));
+			r = -EINVAL;
+		} else
+			log_err(ctx, _("Cannot wipe device %s."),
+				device_path(device));
+		return r;
+	}
+
+	/* Wipe keyslot info */
+	for (i = 0; i < count; i++) {
+		memset(&hdr->keyblock[keyslots[i]].passwordSalt, 0, LUKS_SALTSIZE);
+		hdr->keyblock[keyslots[i]].passwordIterations = 0;
+	}
+
+	return LUKS_write_phdr(hdr, ctx);
+}
+
 crypt_keyslot_info LUKS_keyslot_info(struct luks_phdr *hdr, int keyslot)
 {
 	int i;
@@ -22,6 +22,7 @@
 #ifndef _CRYPTSETUP_LUKS2_ONDISK_H
 #define _CRYPTSETUP_LUKS2_ONDISK_H
 
+#include <sys/types.h>
 #include "libcryptsetup.h"
 
 #define LUKS2_MAGIC_1ST "LUKS\xba\xbe"
@@ -95,6 +96,16 @@ struct luks2_hdr {
 	uint8_t		salt2[LUKS2_SALT_L];
 	char		uuid[LUKS2_UUID_L];
 	json_object	*jobj;
+
+	/* on-disk identity of last full read, see LUKS2_hdr_read_cached() */
+	struct {
+		dev_t		devno;
+		ino_t		ino;
+		uint64_t	seqid;
+		uint8_t		csum1[LUKS2_CHECKSUM_L];
+		uint8_t		csum2[LUKS2_CHECKSUM_L];
+		int		valid;
+	} disk;
 };
 
 struct luks2_keyslot_params {
@@ -132,6 +143,7 @@ int LUKS2_hdr_version_unlocked(struct crypt_device *cd,
 	const char *backup_file);
 
 int LUKS2_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr);
+int LUKS2_hdr_read_cached(struct crypt_device *cd, struct luks2_hdr *hdr);
 int LUKS2_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr);
 int LUKS2_hdr_dump(struct crypt_device *cd, struct luks2_hdr *hdr);
 
@@ -157,6 +169,10 @@ int LUKS2_hdr_restore(struct crypt_device *cd,
 uint64_t LUKS2_hdr_and_areas_size(json_object *jobj);
 uint64_t LUKS2_keyslots_size(json_object *jobj);
 
+struct device;
+int LUKS2_check_device_size(struct crypt_device *cd, struct device *device,
+			    uint64_t hdr_size, int falloc);
+
 int LUKS2_keyslot_cipher_incompatible(struct crypt_device *cd);
 
 /*
@@ -169,6 +185,27 @@ int LUKS2_keyslot_open(struct crypt_device *cd,
 	size_t password_len,
 	struct volume_key **vk);
 
+struct crypt_pbkdf_job;
+int LUKS2_keyslot_derive_params(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int keyslot,
+	int segment,
+	struct crypt_pbkdf_job *job,
+	char *salt);
+
+int LUKS2_keyslot_open_by_derived(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int keyslot,
+	int segment,
+	const struct volume_key *derived_key,
+	struct volume_key **vk);
+
+int LUKS2_keyslot_pbkdf_memory(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int keyslot,
+	int segment,
+	uint32_t *memory_kb);
+
 int LUKS2_keyslot_store(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int keyslot,
@@ -177,11 +214,29 @@ int LUKS2_keyslot_store(struct crypt_device *cd,
 	const struct volume_key *vk,
 	const struct luks2_keyslot_params *params);
 
+struct luks2_keyslot_store_job {
+	int keyslot;
+	const char *password;
+	size_t password_len;
+};
+
+int LUKS2_keyslot_store_batch(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	const struct luks2_keyslot_store_job *job,
+	unsigned count,
+	const struct volume_key *vk,
+	const struct luks2_keyslot_params *params);
+
 int LUKS2_keyslot_wipe(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int keyslot,
 	int wipe_area_only);
 
+int LUKS2_keyslots_wipe(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	const int *keyslots,
+	unsigned count);
+
 int LUKS2_keyslot_dump(struct crypt_device *cd,
 	int keyslot);
 
@@ -356,6 +411,12 @@ int LUKS2_config_set_flags(struct crypt_device *cd, struct luks2_hdr *hdr, uint3
 int LUKS2_config_get_requirements(struct crypt_device *cd, struct luks2_hdr *hdr, uint32_t *reqs);
 int LUKS2_config_set_requirements(struct crypt_device *cd, struct luks2_hdr *hdr, uint32_t reqs);
 
+struct crypt_params_reencrypt_checkpoint;
+int LUKS2_config_get_checkpoint(struct crypt_device *cd, struct luks2_hdr *hdr,
+	struct crypt_params_reencrypt_checkpoint *cp);
+int LUKS2_config_set_checkpoint(struct crypt_device *cd, struct luks2_hdr *hdr,
+	const struct crypt_params_reencrypt_checkpoint *cp);
+
 int LUKS2_unmet_requirements(struct crypt_device *cd, struct luks2_hdr *hdr, uint32_t reqs_mask, int quiet);
 
 int LUKS2_key_description_by_segment(struct crypt_device *cd,
@@ -363,6 +424,31 @@ int LUKS2_key_description_by_segment(struct crypt_device *cd,
 int LUKS2_volume_key_load_in_keyring_by_keyslot(struct crypt_device *cd,
 		struct luks2_hdr *hdr, struct volume_key *vk, int keyslot);
 
+/*
+ * Online reencryption
+ */
+struct luks2_reenc_context;
+struct crypt_params_reencrypt;
+
+int LUKS2_reencrypt_in_progress(struct crypt_device *cd, struct luks2_hdr *hdr);
+int LUKS2_reencrypt_init(struct crypt_device *cd, struct luks2_hdr *hdr,
+	const char *name, const char *passphrase, size_t passphrase_size,
+	int keyslot_old, int keyslot_new,
+	const char *cipher, const char *cipher_mode,
+	const struct crypt_params_reencrypt *params,
+	uint32_t flags,
+	struct luks2_reenc_context **rh);
+int LUKS2_reencrypt_run(struct crypt_device *cd, struct luks2_hdr *hdr,
+	struct luks2_reenc_context *rh,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+	void *usrptr);
+int LUKS2_reencrypt_activate(struct crypt_device *cd, struct luks2_hdr *hdr,
+	const char *name, const char *passphrase, size_t passphrase_size,
+	uint32_t flags);
+int LUKS2_reencrypt_reload(struct crypt_device *cd, struct luks2_hdr *hdr,
+	const char *name, const char *passphrase, size_t passphrase_size);
+void LUKS2_reencrypt_free(struct luks2_reenc_context *rh);
+
 struct luks_phdr;
 int LUKS2_luks1_to_luks2(struct crypt_device *cd,
 			 struct luks_phdr *hdr1,
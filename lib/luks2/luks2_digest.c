@@ -60,6 +60,44 @@ static const digest_handler *LUKS2_digest_handler(struct crypt_device *cd, int d
 	return LUKS2_digest_handler_type(cd, json_object_get_string(jobj2));
 }
 
+/*
+ * Verify key against digest, every successfully verified key is cached
+ * in context so repeated checks of the same key skip PBKDF2 run.
+ */
+static int LUKS2_digest_verify_one(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int digest,
+	const struct volume_key *vk)
+{
+	const digest_handler *h;
+	json_object *jobj_digest;
+	const char *tag;
+	int r;
+
+	h = LUKS2_digest_handler(cd, digest);
+	if (!h)
+		return -EINVAL;
+
+	jobj_digest = LUKS2_get_digest_jobj(hdr, digest);
+	tag = jobj_digest ? json_object_to_json_string_ext(jobj_digest, JSON_C_TO_STRING_PLAIN) : NULL;
+
+	if (!crypt_digest_cache_check(cd, digest, tag, tag ? strlen(tag) : 0, vk)) {
+		log_dbg("Digest %d (%s) verified from cache.", digest, h->name);
+		return 0;
+	}
+
+	crypt_trace(cd, CRYPT_TRACE_DIGEST_VERIFY, 0, 0);
+	r = h->verify(cd, digest, vk->key, vk->keylength);
+	crypt_trace(cd, CRYPT_TRACE_DIGEST_VERIFY, 1, vk->keylength);
+	if (r < 0) {
+		log_dbg("Digest %d (%s) verify failed with %d.", digest, h->name, r);
+		return r;
+	}
+
+	crypt_digest_cache_store(cd, digest, tag, tag ? strlen(tag) : 0, vk);
+	return 0;
+}
+
 static int LUKS2_digest_find_free(struct crypt_device *cd, struct luks2_hdr *hdr)
 {
 	int digest = 0;
@@ -117,7 +155,6 @@ int LUKS2_digest_verify(struct crypt_device *cd,
 	struct volume_key *vk,
 	int keyslot)
 {
-	const digest_handler *h;
 	int digest, r;
 
 	digest = LUKS2_digest_by_keyslot(cd, hdr, keyslot);
@@ -125,15 +162,10 @@ int LUKS2_digest_verify(struct crypt_device *cd,
 		return digest;
 
 	log_dbg("Verifying key from keyslot %d, digest %d.", keyslot, digest);
-	h = LUKS2_digest_handler(cd, digest);
-	if (!h)
-		return -EINVAL;
 
-	r = h->verify(cd, digest, vk->key, vk->keylength);
-	if (r < 0) {
-		log_dbg("Digest %d (%s) verify failed with %d.", digest, h->name, r);
+	r = LUKS2_digest_verify_one(cd, hdr, digest, vk);
+	if (r < 0)
 		return r;
-	}
 
 	return digest;
 }
@@ -153,7 +185,6 @@ int LUKS2_digest_verify_by_segment(struct crypt_device *cd,
 	int segment,
 	const struct volume_key *vk)
 {
-	const digest_handler *h;
 	int digest, r;
 
 	digest = LUKS2_digest_by_segment(cd, hdr, segment);
@@ -162,15 +193,9 @@ int LUKS2_digest_verify_by_segment(struct crypt_device *cd,
 
 	log_dbg("Verifying key digest %d.", digest);
 
-	h = LUKS2_digest_handler(cd, digest);
-	if (!h)
-		return -EINVAL;
-
-	r = h->verify(cd, digest, vk->key, vk->keylength);
-	if (r < 0) {
-		log_dbg("Digest %d (%s) verify failed with %d.", digest, h->name, r);
+	r = LUKS2_digest_verify_one(cd, hdr, digest, vk);
+	if (r < 0)
 		return r;
-	}
 
 	return digest;
 }
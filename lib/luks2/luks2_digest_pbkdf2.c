@@ -19,12 +19,123 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <pthread.h>
 #include "luks2_internal.h"
 
 #define LUKS_DIGESTSIZE 20 // since SHA1
 #define LUKS_SALTSIZE 32
 #define LUKS_MKD_ITERATIONS_MS 125
 
+/*
+ * Digest iterations depend only on hash, key length and CPU, so they are
+ * benchmarked only once per process (the persistent calibration cache,
+ * if set, is still used by the benchmark itself).
+ */
+#define DIGEST_CACHE_SIZE 8
+
+static struct {
+	pthread_mutex_t lock;
+	struct {
+		char hash[32];
+		size_t key_len;
+		uint32_t iterations;
+	} e[DIGEST_CACHE_SIZE];
+	unsigned count;
+} digest_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint32_t digest_cache_get(const char *hash, size_t key_len)
+{
+	uint32_t iterations = 0;
+	unsigned i;
+
+	pthread_mutex_lock(&digest_cache.lock);
+	for (i = 0; i < digest_cache.count; i++)
+		if (digest_cache.e[i].key_len == key_len &&
+		    !strcmp(digest_cache.e[i].hash, hash)) {
+			iterations = digest_cache.e[i].iterations;
+			break;
+		}
+	pthread_mutex_unlock(&digest_cache.lock);
+
+	return iterations;
+}
+
+static void digest_cache_put(const char *hash, size_t key_len, uint32_t iterations)
+{
+	unsigned i;
+
+	if (strlen(hash) >= sizeof(digest_cache.e[0].hash))
+		return;
+
+	pthread_mutex_lock(&digest_cache.lock);
+	/* simple round robin replacement, there are only few combinations */
+	i = digest_cache.count < DIGEST_CACHE_SIZE ? digest_cache.count++ :
+	    (unsigned)(key_len % DIGEST_CACHE_SIZE);
+	strcpy(digest_cache.e[i].hash, hash);
+	digest_cache.e[i].key_len = key_len;
+	digest_cache.e[i].iterations = iterations;
+	pthread_mutex_unlock(&digest_cache.lock);
+}
+
+/*
+ * Not yet benchmarked memory-hard keyslot PBKDF of the context is calibrated
+ * in parallel with the digest benchmark (if there are enough CPUs for both),
+ * the following keyslot creation then reuses the values.
+ */
+struct keyslot_bench {
+	struct crypt_device *cd;
+	struct crypt_pbkdf_type pbkdf;
+	size_t key_len;
+	pthread_t thread;
+	int r;
+};
+
+static void *keyslot_bench_thread(void *arg)
+{
+	struct keyslot_bench *kb = arg;
+
+	kb->r = crypt_benchmark_pbkdf_internal(kb->cd, &kb->pbkdf, kb->key_len);
+	return NULL;
+}
+
+static int keyslot_bench_start(struct crypt_device *cd, struct keyslot_bench *kb,
+			       size_t key_len)
+{
+	const struct crypt_pbkdf_type *pbkdf = crypt_get_pbkdf_type(cd);
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (!pbkdf || !pbkdf->type || !strcmp(pbkdf->type, CRYPT_KDF_PBKDF2) ||
+	    pbkdf->iterations || (pbkdf->flags & CRYPT_PBKDF_NO_BENCHMARK) ||
+	    cpus <= (long)pbkdf->parallel_threads)
+		return 0;
+
+	kb->cd = cd;
+	kb->pbkdf = *pbkdf;
+	kb->key_len = key_len;
+	if (pthread_create(&kb->thread, NULL, keyslot_bench_thread, kb))
+		return 0;
+
+	log_dbg("Running keyslot PBKDF benchmark in parallel.");
+	return 1;
+}
+
+static void keyslot_bench_finish(struct crypt_device *cd, struct keyslot_bench *kb)
+{
+	struct crypt_pbkdf_type *pbkdf = crypt_get_pbkdf(cd);
+
+	pthread_join(kb->thread, NULL);
+
+	/* keep it if the context PBKDF did not change meanwhile */
+	if (kb->r < 0 || pbkdf->iterations || !pbkdf->type ||
+	    strcmp(pbkdf->type, kb->pbkdf.type))
+		return;
+
+	pbkdf->iterations = kb->pbkdf.iterations;
+	pbkdf->max_memory_kb = kb->pbkdf.max_memory_kb;
+}
+
 static int PBKDF2_digest_verify(struct crypt_device *cd,
 	int digest,
 	const char *volume_key,
@@ -95,8 +206,9 @@ static int PBKDF2_digest_store(struct crypt_device *cd,
 {
 	json_object *jobj_digest, *jobj_digests;
 	char salt[LUKS_SALTSIZE], digest_raw[128], num[16];
-	int r;
+	int r, bench;
 	char *base64_str;
+	struct keyslot_bench kb;
 	struct luks2_hdr *hdr;
 	struct crypt_pbkdf_limits pbkdf_limits;
 	struct crypt_pbkdf_type pbkdf = {
@@ -117,10 +229,16 @@ static int PBKDF2_digest_store(struct crypt_device *cd,
 
 	if (crypt_get_pbkdf(cd)->flags & CRYPT_PBKDF_NO_BENCHMARK)
 		pbkdf.iterations = pbkdf_limits.min_iterations;
+	else if ((pbkdf.iterations = digest_cache_get(pbkdf.hash, volume_key_len)))
+		log_dbg("Reusing digest PBKDF2 iterations benchmarked before.");
 	else {
+		bench = keyslot_bench_start(cd, &kb, volume_key_len);
 		r = crypt_benchmark_pbkdf_internal(cd, &pbkdf, volume_key_len);
+		if (bench)
+			keyslot_bench_finish(cd, &kb);
 		if (r < 0)
 			return r;
+		digest_cache_put(pbkdf.hash, volume_key_len, pbkdf.iterations);
 	}
 
 	r = crypt_pbkdf(CRYPT_KDF_PBKDF2, pbkdf.hash, volume_key, volume_key_len,
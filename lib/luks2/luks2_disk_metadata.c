@@ -20,39 +20,101 @@
  */
 
 #include <assert.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 
 #include "luks2_internal.h"
 
+/* JSON area is parsed in chunks so the time limit can be checked in between */
+#define LUKS2_JSON_PARSE_CHUNK (64 * 1024)
+
 /*
  * Helper functions
  */
-json_object *parse_json_len(const char *json_area, int length, int *end_offset)
+static uint64_t time_us(void)
 {
-	json_object *jobj;
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0;
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int deadline_expired(uint64_t deadline)
+{
+	return deadline && time_us() > deadline;
+}
+
+json_object *parse_json_len(const char *json_area, int length, int *end_offset,
+			    const struct crypt_metadata_limits *limits, uint64_t deadline)
+{
+	json_object *jobj = NULL;
 	struct json_tokener *jtok;
+	int chunk, offset = 0;
 
 	if (!json_area || length <= 0)
 		return NULL;
 
-	jtok = json_tokener_new();
+	jtok = json_tokener_new_ex(limits && limits->max_depth ?
+				   (int)limits->max_depth : JSON_TOKENER_DEFAULT_DEPTH);
 	if (!jtok) {
 		log_dbg("ERROR: Failed to init json tokener");
 		return NULL;
 	}
 
-	jobj = json_tokener_parse_ex(jtok, json_area, length);
+	do {
+		if (deadline_expired(deadline)) {
+			log_dbg("ERROR: JSON parse time limit exceeded at offset %d.", offset);
+			json_tokener_free(jtok);
+			return NULL;
+		}
+
+		chunk = length - offset > LUKS2_JSON_PARSE_CHUNK ? LUKS2_JSON_PARSE_CHUNK : length - offset;
+		jobj = json_tokener_parse_ex(jtok, json_area + offset, chunk);
+		if (jobj)
+			break;
+		offset += chunk;
+	} while (offset < length && json_tokener_get_error(jtok) == json_tokener_continue);
+
 	if (!jobj)
 		log_dbg("ERROR: Failed to parse json data (%d): %s",
 			json_tokener_get_error(jtok),
 			json_tokener_error_desc(json_tokener_get_error(jtok)));
 	else
-		*end_offset = jtok->char_offset;
+		/* char_offset is relative to the last parsed chunk */
+		*end_offset = offset + jtok->char_offset;
 
 	json_tokener_free(jtok);
 
 	return jobj;
 }
 
+/* Returns 0 if there are at most max values in the tree (*count is updated) */
+static int json_count_values(json_object *jobj, uint32_t max, uint32_t *count)
+{
+	int i, len;
+
+	if (++*count > max)
+		return 1;
+
+	if (json_object_is_type(jobj, json_type_object)) {
+		json_object_object_foreach(jobj, key, val) {
+			UNUSED(key);
+			if (json_count_values(val, max, count))
+				return 1;
+		}
+	} else if (json_object_is_type(jobj, json_type_array)) {
+		len = json_object_array_length(jobj);
+		for (i = 0; i < len; i++)
+			if (json_count_values(json_object_array_get_idx(jobj, i), max, count))
+				return 1;
+	}
+
+	return 0;
+}
+
 static void log_dbg_checksum(const uint8_t *csum, const char *csum_alg, const char *info)
 {
 	char csum_txt[2*LUKS2_CHECKSUM_L+1];
@@ -218,7 +280,8 @@ static int hdr_disk_sanity_check_pre(struct luks2_hdr_disk *hdr,
  * Read LUKS2 header from disk at specific offset.
  */
 static int hdr_read_disk(struct device *device, struct luks2_hdr_disk *hdr_disk,
-			 char **json_area, uint64_t offset, int secondary)
+			 char **json_area, uint64_t offset, int secondary,
+			 uint8_t *csum)
 {
 	size_t hdr_json_size = 0;
 	int devfd = -1, r;
@@ -234,16 +297,15 @@ static int hdr_read_disk(struct device *device, struct luks2_hdr_disk *hdr_disk,
 	 * Read binary header and run sanity check before reading
 	 * JSON area and validating checksum.
 	 */
-	if (read_lseek_blockwise(devfd, device_block_size(device),
-				 device_alignment(device), hdr_disk,
-				 LUKS2_HDR_BIN_LEN, offset) != LUKS2_HDR_BIN_LEN) {
-		close(devfd);
+	if (device_read_at(device, devfd, hdr_disk,
+			   LUKS2_HDR_BIN_LEN, offset) != LUKS2_HDR_BIN_LEN) {
+		device_close(device, devfd);
 		return -EIO;
 	}
 
 	r = hdr_disk_sanity_check_pre(hdr_disk, &hdr_json_size, secondary, offset);
 	if (r < 0) {
-		close(devfd);
+		device_close(device, devfd);
 		return r;
 	}
 
@@ -252,20 +314,19 @@ static int hdr_read_disk(struct device *device, struct luks2_hdr_disk *hdr_disk,
 	 */
 	*json_area = malloc(hdr_json_size);
 	if (!*json_area) {
-		close(devfd);
+		device_close(device, devfd);
 		return -ENOMEM;
 	}
 
-	if (read_lseek_blockwise(devfd, device_block_size(device),
-				 device_alignment(device), *json_area, hdr_json_size,
-				 offset + LUKS2_HDR_BIN_LEN) != (ssize_t)hdr_json_size) {
-		close(devfd);
+	if (device_read_at(device, devfd, *json_area, hdr_json_size,
+			   offset + LUKS2_HDR_BIN_LEN) != (ssize_t)hdr_json_size) {
+		device_close(device, devfd);
 		free(*json_area);
 		*json_area = NULL;
 		return -EIO;
 	}
 
-	close(devfd);
+	device_close(device, devfd);
 
 	/*
 	 * Calculate and validate checksum and zero it afterwards.
@@ -275,6 +336,8 @@ static int hdr_read_disk(struct device *device, struct luks2_hdr_disk *hdr_disk,
 		log_dbg("LUKS2 header checksum error (offset %" PRIu64 ").", offset);
 		r = -EINVAL;
 	}
+	if (csum)
+		memcpy(csum, hdr_disk->csum, LUKS2_CHECKSUM_L);
 	memset(hdr_disk->csum, 0, LUKS2_CHECKSUM_L);
 
 	return r;
@@ -283,11 +346,99 @@ static int hdr_read_disk(struct device *device, struct luks2_hdr_disk *hdr_disk,
 /*
  * Write LUKS2 header to disk at specific offset.
  */
+/*
+ * Write only JSON area chunks that differ from the on-disk content.
+ * Binary header (hdr_bin, written always) is gathered with the first
+ * JSON chunk into one write if the chunk changed.
+ * Returns number of chunks written or negative errno.
+ */
+#define LUKS2_JSON_WRITE_CHUNK 4096
+static int hdr_write_json_changed(int devfd, struct device *device, const void *hdr_bin,
+				  const char *json_area, size_t json_len, uint64_t offset)
+{
+	size_t bsize = device_block_size(device), chunk, pos, end, next;
+	struct iovec iov[2] = {
+		{ .iov_base = CONST_CAST(void*)hdr_bin, .iov_len = LUKS2_HDR_BIN_LEN },
+	};
+	char *disk_json;
+	int written = 0;
+
+	chunk = bsize > LUKS2_JSON_WRITE_CHUNK ? bsize : LUKS2_JSON_WRITE_CHUNK;
+	offset += LUKS2_HDR_BIN_LEN;
+
+	/* If current content cannot be read, rewrite the whole area. */
+	disk_json = malloc(json_len);
+	if (!disk_json || device_read_at(device, devfd, disk_json, json_len,
+					 offset) < (ssize_t)json_len) {
+		free(disk_json);
+		iov[1].iov_base = CONST_CAST(char*)json_area;
+		iov[1].iov_len = json_len;
+		if (device_writev_at(device, devfd, iov, 2, offset - LUKS2_HDR_BIN_LEN) <
+		    (ssize_t)(LUKS2_HDR_BIN_LEN + json_len))
+			return -EIO;
+		return 1;
+	}
+
+	for (pos = 0; pos < json_len; pos = end) {
+		end = pos + chunk < json_len ? pos + chunk : json_len;
+		if (!memcmp(json_area + pos, disk_json + pos, end - pos))
+			continue;
+
+		/* merge adjacent changed chunks into one write */
+		while (end < json_len) {
+			next = end + chunk < json_len ? end + chunk : json_len;
+			if (!memcmp(json_area + end, disk_json + end, next - end))
+				break;
+			end = next;
+		}
+
+		iov[1].iov_base = CONST_CAST(char*)json_area + pos;
+		iov[1].iov_len = end - pos;
+		if (!pos) {
+			if (device_writev_at(device, devfd, iov, 2, offset - LUKS2_HDR_BIN_LEN) <
+			    (ssize_t)(LUKS2_HDR_BIN_LEN + end))
+				goto err;
+			hdr_bin = NULL;
+			written++;
+			continue;
+		}
+
+		/* binary header is always written first */
+		if (hdr_bin && device_write_at(device, devfd, hdr_bin, LUKS2_HDR_BIN_LEN,
+					       offset - LUKS2_HDR_BIN_LEN) < LUKS2_HDR_BIN_LEN)
+			goto err;
+		hdr_bin = NULL;
+
+		if (device_write_at(device, devfd, iov[1].iov_base, iov[1].iov_len,
+				    offset + pos) < (ssize_t)(end - pos))
+			goto err;
+		written++;
+	}
+
+	free(disk_json);
+
+	if (hdr_bin && device_write_at(device, devfd, hdr_bin, LUKS2_HDR_BIN_LEN,
+				       offset - LUKS2_HDR_BIN_LEN) < LUKS2_HDR_BIN_LEN)
+		return -EIO;
+
+	log_dbg("Rewritten %d changed JSON area chunks.", written);
+	return written;
+err:
+	free(disk_json);
+	return -EIO;
+}
+
+/*
+ * Write header copy. If hdr_csum is set, it already contains binary header
+ * with checksum calculated (during JSON serialization).
+ */
 static int hdr_write_disk(struct device *device, struct luks2_hdr *hdr,
-		   const char *json_area, int secondary)
+		   const char *json_area, int secondary,
+		   const struct luks2_hdr_disk *hdr_csum)
 {
-	struct luks2_hdr_disk hdr_disk;
+	struct luks2_hdr_disk hdr_disk, hdr_disk_csum;
 	uint64_t offset = secondary ? hdr->hdr_size : 0;
+	void *hdr_bin;
 	size_t hdr_json_len;
 	int devfd = -1, r;
 
@@ -305,48 +456,59 @@ static int hdr_write_disk(struct device *device, struct luks2_hdr *hdr,
 	hdr_to_disk(hdr, &hdr_disk, secondary, offset);
 
 	/*
-	 * Write header without checksum but with proper seqid.
+	 * Calculate checksum of the new header in advance, it does not
+	 * depend on the on-disk content.
 	 */
-	if (write_lseek_blockwise(devfd, device_block_size(device),
-				  device_alignment(device), (char *)&hdr_disk,
-				  LUKS2_HDR_BIN_LEN, offset) < (ssize_t)LUKS2_HDR_BIN_LEN) {
-		close(devfd);
-		return -EIO;
+	if (hdr_csum)
+		hdr_disk_csum = *hdr_csum;
+	else {
+		hdr_disk_csum = hdr_disk;
+		r = hdr_checksum_calculate(hdr_disk_csum.checksum_alg, &hdr_disk_csum,
+					   json_area, hdr_json_len);
+		if (r < 0) {
+			device_close(device, devfd);
+			return r;
+		}
 	}
+	log_dbg_checksum(hdr_disk_csum.csum, hdr_disk_csum.checksum_alg, "in-memory");
 
 	/*
-	 * Write json area.
+	 * Write header without checksum but with proper seqid (this invalidates
+	 * this copy until the final header write) and changed parts of json area.
+	 * Binary header is placed in aligned buffer, so it can be gathered
+	 * with json area into one write.
 	 */
-	if (write_lseek_blockwise(devfd, device_block_size(device),
-				  device_alignment(device),
-				  CONST_CAST(char*)json_area, hdr_json_len,
-				  LUKS2_HDR_BIN_LEN + offset) < (ssize_t)hdr_json_len) {
-		close(devfd);
-		return -EIO;
+	hdr_bin = device_alloc_aligned(device, LUKS2_HDR_BIN_LEN);
+	if (!hdr_bin) {
+		device_close(device, devfd);
+		return -ENOMEM;
 	}
+	memcpy(hdr_bin, &hdr_disk, LUKS2_HDR_BIN_LEN);
 
-	/*
-	 * Calculate checksum and write header with checksum.
-	 */
-	r = hdr_checksum_calculate(hdr_disk.checksum_alg, &hdr_disk,
-				   json_area, hdr_json_len);
+	r = hdr_write_json_changed(devfd, device, hdr_bin, json_area, hdr_json_len, offset);
 	if (r < 0) {
-		close(devfd);
+		device_free_aligned(device, hdr_bin);
+		device_close(device, devfd);
 		return r;
 	}
-	log_dbg_checksum(hdr_disk.csum, hdr_disk.checksum_alg, "in-memory");
 
-	if (write_lseek_blockwise(devfd, device_block_size(device),
-				  device_alignment(device), (char *)&hdr_disk,
-				  LUKS2_HDR_BIN_LEN, offset) < (ssize_t)LUKS2_HDR_BIN_LEN)
+	/*
+	 * Write header with checksum.
+	 */
+	r = 0;
+	memcpy(hdr_bin, &hdr_disk_csum, LUKS2_HDR_BIN_LEN);
+	if (device_write_at(device, devfd, hdr_bin, LUKS2_HDR_BIN_LEN,
+			    offset) < (ssize_t)LUKS2_HDR_BIN_LEN)
 		r = -EIO;
 
-	close(devfd);
+	device_free_aligned(device, hdr_bin);
+
+	device_close(device, devfd);
 	return r;
 }
 
-static int LUKS2_check_device_size(struct crypt_device *cd, struct device *device,
-				   uint64_t hdr_size, int falloc)
+int LUKS2_check_device_size(struct crypt_device *cd, struct device *device,
+			    uint64_t hdr_size, int falloc)
 {
 	uint64_t dev_size;
 
@@ -371,14 +533,197 @@ static int LUKS2_check_device_size(struct crypt_device *cd, struct device *devic
 	return 0;
 }
 
+/*
+ * JSON serializer writing directly to (aligned, reused) json area buffer.
+ * Output is the same as json-c JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOSLASHESCAPE.
+ * Already written text is hashed in chunks for checksums of both header
+ * copies (their binary headers differ), while it is still in cache.
+ */
+#define JSON_HASH_CHUNK 4096
+
+struct json_writer {
+	char *buf;
+	size_t len, size, hashed;
+	struct crypt_hash *hd[2];
+	int r;
+};
+
+static void json_writer_hash(struct json_writer *w, const char *buf, size_t len)
+{
+	int i;
+
+	for (i = 0; i < 2 && !w->r; i++)
+		if (crypt_hash_write(w->hd[i], buf, len))
+			w->r = -EINVAL;
+}
+
+static void json_put(struct json_writer *w, const char *str, size_t len)
+{
+	if (w->r)
+		return;
+
+	/* Keep space for terminating NUL */
+	if (len >= w->size - w->len) {
+		w->r = -EINVAL;
+		return;
+	}
+
+	memcpy(w->buf + w->len, str, len);
+	w->len += len;
+
+	if (w->len - w->hashed >= JSON_HASH_CHUNK) {
+		json_writer_hash(w, w->buf + w->hashed, w->len - w->hashed);
+		w->hashed = w->len;
+	}
+}
+
+static void json_put_string(struct json_writer *w, const char *str, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	char esc[6] = { '\\', 'u', '0', '0' };
+	size_t i, start = 0;
+	unsigned char c;
+
+	json_put(w, "\"", 1);
+	for (i = 0; i < len; i++) {
+		c = (unsigned char)str[i];
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		json_put(w, str + start, i - start);
+		start = i + 1;
+
+		switch (c) {
+		case '\b': json_put(w, "\\b", 2); break;
+		case '\n': json_put(w, "\\n", 2); break;
+		case '\r': json_put(w, "\\r", 2); break;
+		case '\t': json_put(w, "\\t", 2); break;
+		case '\f': json_put(w, "\\f", 2); break;
+		case '"':  json_put(w, "\\\"", 2); break;
+		case '\\': json_put(w, "\\\\", 2); break;
+		default:
+			esc[4] = hex[c >> 4];
+			esc[5] = hex[c & 0xf];
+			json_put(w, esc, 6);
+		}
+	}
+	json_put(w, str + start, len - start);
+	json_put(w, "\"", 1);
+}
+
+static void json_put_object(struct json_writer *w, json_object *jobj)
+{
+	const char *str;
+	char num[32];
+	int i, len, first = 1;
+
+	switch (json_object_get_type(jobj)) {
+	case json_type_null:
+		json_put(w, "null", 4);
+		break;
+	case json_type_boolean:
+		if (json_object_get_boolean(jobj))
+			json_put(w, "true", 4);
+		else
+			json_put(w, "false", 5);
+		break;
+	case json_type_int:
+		len = snprintf(num, sizeof(num), "%" PRId64, json_object_get_int64(jobj));
+		json_put(w, num, len);
+		break;
+	case json_type_string:
+		json_put_string(w, json_object_get_string(jobj), json_object_get_string_len(jobj));
+		break;
+	case json_type_array:
+		json_put(w, "[", 1);
+		for (i = 0; i < json_object_array_length(jobj); i++) {
+			if (i)
+				json_put(w, ",", 1);
+			json_put_object(w, json_object_array_get_idx(jobj, i));
+		}
+		json_put(w, "]", 1);
+		break;
+	case json_type_object:
+		json_put(w, "{", 1);
+		json_object_object_foreach(jobj, key, val) {
+			if (!first)
+				json_put(w, ",", 1);
+			first = 0;
+			json_put_string(w, key, strlen(key));
+			json_put(w, ":", 1);
+			json_put_object(w, val);
+		}
+		json_put(w, "}", 1);
+		break;
+	default:
+		/* Not used in LUKS2 metadata (double), format it by json-c */
+		str = json_object_to_json_string_ext(jobj,
+			JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOSLASHESCAPE);
+		if (str)
+			json_put(w, str, strlen(str));
+		else
+			w->r = -ENOMEM;
+	}
+}
+
+/*
+ * Serialize JSON to json_area (padded with zeroes) and calculate checksums
+ * of both header copies in the same pass.
+ */
+static int hdr_json_serialize(struct luks2_hdr *hdr, char *json_area, size_t json_area_len,
+			      struct luks2_hdr_disk hdr_disk[2])
+{
+	struct json_writer w = {
+		.buf = json_area,
+		.size = json_area_len,
+	};
+	const char *alg = hdr_disk[0].checksum_alg;
+	int i, hash_size;
+
+	hash_size = crypt_hash_size(alg);
+	if (hash_size <= 0)
+		return -EINVAL;
+
+	for (i = 0; i < 2; i++) {
+		if (crypt_hash_init(&w.hd[i], alg)) {
+			w.r = -EINVAL;
+			goto out;
+		}
+		/* Binary header, csum zeroed. */
+		if (crypt_hash_write(w.hd[i], (char*)&hdr_disk[i], LUKS2_HDR_BIN_LEN)) {
+			w.r = -EINVAL;
+			goto out;
+		}
+	}
+
+	json_put_object(&w, hdr->jobj);
+	if (w.r) {
+		log_dbg("JSON is too large or cannot be serialized.");
+		goto out;
+	}
+
+	/* JSON area (including unused space) */
+	memset(w.buf + w.len, 0, w.size - w.len);
+	json_writer_hash(&w, w.buf + w.hashed, w.size - w.hashed);
+
+	for (i = 0; i < 2 && !w.r; i++)
+		if (crypt_hash_final(w.hd[i], (char*)hdr_disk[i].csum, (size_t)hash_size))
+			w.r = -EINVAL;
+out:
+	for (i = 0; i < 2; i++)
+		if (w.hd[i])
+			crypt_hash_destroy(w.hd[i]);
+	return w.r;
+}
+
 /*
  * Convert in-memory LUKS2 header and write it to disk.
  * This will increase sequence id, write both header copies and calculate checksum.
  */
 int LUKS2_disk_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr, struct device *device)
 {
+	struct luks2_hdr_disk hdr_disk[2];
 	char *json_area;
-	const char *json_text;
 	size_t json_area_len;
 	int r;
 
@@ -397,45 +742,41 @@ int LUKS2_disk_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr, struct
 		return r;
 
 	/*
-	 * Allocate and zero JSON area (of proper header size).
+	 * JSON area (of proper header size) is taken from device aligned buffer pool,
+	 * it is reused for both header copies and for following commits.
 	 */
 	json_area_len = hdr->hdr_size - LUKS2_HDR_BIN_LEN;
-	json_area = malloc(json_area_len);
+	json_area = device_alloc_aligned(device, json_area_len);
 	if (!json_area)
 		return -ENOMEM;
-	memset(json_area, 0, json_area_len);
+
+	/* Increase sequence id before writing it to disk. */
+	hdr->seqid++;
 
 	/*
-	 * Generate text space-efficient JSON representation to json area.
+	 * Generate text space-efficient JSON representation directly to json area,
+	 * checksums of both copies are calculated in the same pass.
 	 */
-	json_text = json_object_to_json_string_ext(hdr->jobj,
-			JSON_C_TO_STRING_PLAIN | JSON_C_TO_STRING_NOSLASHESCAPE);
-	if (!json_text || !*json_text) {
-		log_dbg("Cannot parse JSON object to text representation.");
-		free(json_area);
-		return -ENOMEM;
-	}
-	if (strlen(json_text) > (json_area_len - 1)) {
-		log_dbg("JSON is too large (%zu > %zu).", strlen(json_text), json_area_len);
-		free(json_area);
-		return -EINVAL;
+	hdr_to_disk(hdr, &hdr_disk[0], 0, 0);
+	hdr_to_disk(hdr, &hdr_disk[1], 1, hdr->hdr_size);
+	r = hdr_json_serialize(hdr, json_area, json_area_len, hdr_disk);
+	if (r) {
+		hdr->seqid--;
+		device_free_aligned(device, json_area);
+		return r;
 	}
-	strncpy(json_area, json_text, json_area_len);
-
-	/* Increase sequence id before writing it to disk. */
-	hdr->seqid++;
 
 	r = device_write_lock(cd, device);
 	if (r) {
 		log_err(cd, _("Failed to acquire write device lock."));
-		free(json_area);
+		device_free_aligned(device, json_area);
 		return r;
 	}
 
 	/* Write primary and secondary header */
-	r = hdr_write_disk(device, hdr, json_area, 0);
+	r = hdr_write_disk(device, hdr, json_area, 0, &hdr_disk[0]);
 	if (!r)
-		r = hdr_write_disk(device, hdr, json_area, 1);
+		r = hdr_write_disk(device, hdr, json_area, 1, &hdr_disk[1]);
 
 	if (r)
 		log_dbg("LUKS2 header write failed (%d).", r);
@@ -444,7 +785,7 @@ int LUKS2_disk_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr, struct
 
 	/* FIXME: try recovery here? */
 
-	free(json_area);
+	device_free_aligned(device, json_area);
 	return r;
 }
 
@@ -508,43 +849,148 @@ static int validate_luks2_json_object(json_object *jobj_hdr)
 	return r;
 }
 
-static json_object *parse_and_validate_json(const char *json_area, int length)
+json_object *parse_and_validate_json(struct crypt_device *cd,
+				     const char *json_area, int length)
 {
+	const struct crypt_metadata_limits *limits = crypt_get_metadata_limits(cd);
+	uint64_t deadline = 0;
+	uint32_t count = 0;
 	int offset, r;
-	json_object *jobj = parse_json_len(json_area, length, &offset);
+	json_object *jobj;
 
-	if (!jobj)
+	crypt_trace(cd, CRYPT_TRACE_HDR_VALIDATE, 0, 0);
+
+	if (limits->max_time_ms && (deadline = time_us()))
+		deadline += (uint64_t)limits->max_time_ms * 1000;
+
+	jobj = parse_json_len(json_area, length, &offset, limits, deadline);
+	if (!jobj) {
+		crypt_trace(cd, CRYPT_TRACE_HDR_VALIDATE, 1, length);
 		return NULL;
+	}
 
 	/* successful parse_json_len must not return offset <= 0 */
 	assert(offset > 0);
 
 	r = validate_json_area(json_area, offset, length);
+
+	/* Validators iterate (also in nested loops) over objects, bound it first */
+	if (!r && limits->max_objects &&
+	    json_count_values(jobj, limits->max_objects, &count)) {
+		log_dbg("ERROR: JSON metadata contain more than %u values.", limits->max_objects);
+		r = -EINVAL;
+	}
+
+	if (!r && deadline_expired(deadline)) {
+		log_dbg("ERROR: JSON parse time limit exceeded.");
+		r = -EINVAL;
+	}
+
 	if (!r)
 		r = validate_luks2_json_object(jobj);
 
+	if (!r && deadline_expired(deadline)) {
+		log_dbg("ERROR: JSON validation time limit exceeded.");
+		r = -EINVAL;
+	}
+
 	if (r) {
 		json_object_put(jobj);
 		jobj = NULL;
 	}
 
+	crypt_trace(cd, CRYPT_TRACE_HDR_VALIDATE, 1, length);
 	return jobj;
 }
 
+static int hdr_disk_id(int devfd, dev_t *devno, ino_t *ino)
+{
+	struct stat st;
+
+	if (fstat(devfd, &st) < 0)
+		return -EINVAL;
+
+	*devno = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+	*ino = S_ISBLK(st.st_mode) ? 0 : st.st_ino;
+	return 0;
+}
+
+static void hdr_disk_identity(struct device *device, struct luks2_hdr *hdr,
+			      const uint8_t *csum1, const uint8_t *csum2)
+{
+	int devfd;
+
+	devfd = device_open_locked(device, O_RDONLY);
+	if (devfd < 0)
+		return;
+
+	if (!hdr_disk_id(devfd, &hdr->disk.devno, &hdr->disk.ino)) {
+		hdr->disk.seqid = hdr->seqid;
+		memcpy(hdr->disk.csum1, csum1, LUKS2_CHECKSUM_L);
+		memcpy(hdr->disk.csum2, csum2, LUKS2_CHECKSUM_L);
+		hdr->disk.valid = 1;
+	}
+	device_close(device, devfd);
+}
+
+static int hdr_disk_bin_unchanged(int devfd, struct device *device, uint64_t offset,
+				  uint64_t seqid, const uint8_t *csum)
+{
+	struct luks2_hdr_disk hdr_disk;
+
+	if (read_lseek_blockwise(devfd, device_block_size(device),
+				 device_alignment(device), &hdr_disk,
+				 LUKS2_HDR_BIN_LEN, offset) != LUKS2_HDR_BIN_LEN)
+		return 0;
+
+	return be64_to_cpu(hdr_disk.hdr_offset) == offset &&
+	       be64_to_cpu(hdr_disk.seqid) == seqid &&
+	       !memcmp(hdr_disk.csum, csum, LUKS2_CHECKSUM_L);
+}
+
 /*
- * Read and convert on-disk LUKS2 header to in-memory representation..
- * Try to do recovery if on-disk state is not consistent.
+ * Check that both on-disk headers are those already parsed in hdr.
+ * Only binary headers are read; checksum covers JSON area, so the same
+ * seqid and checksums on the same device mean unchanged metadata.
  */
-int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
-			struct device *device, int do_recovery)
+int LUKS2_disk_hdr_unchanged(struct crypt_device *cd, struct luks2_hdr *hdr,
+			     struct device *device)
+{
+	dev_t devno;
+	ino_t ino;
+	int devfd, r = 0;
+
+	if (!hdr->disk.valid || !hdr->jobj)
+		return 0;
+
+	devfd = device_open_locked(device, O_RDONLY);
+	if (devfd < 0)
+		return 0;
+
+	if (!hdr_disk_id(devfd, &devno, &ino) &&
+	    devno == hdr->disk.devno && ino == hdr->disk.ino)
+		r = hdr_disk_bin_unchanged(devfd, device, 0, hdr->disk.seqid, hdr->disk.csum1) &&
+		    hdr_disk_bin_unchanged(devfd, device, hdr->hdr_size, hdr->disk.seqid, hdr->disk.csum2);
+	device_close(device, devfd);
+
+	log_dbg("LUKS2 header seqid %" PRIu64 " %s.", hdr->disk.seqid,
+		r ? "is not changed on disk" : "changed or cannot be checked");
+	return r;
+}
+
+static int disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
+			 struct device *device, int do_recovery)
 {
 	enum { HDR_OK, HDR_OBSOLETE, HDR_FAIL, HDR_FAIL_IO } state_hdr1, state_hdr2;
 	struct luks2_hdr_disk hdr_disk1, hdr_disk2;
 	char *json_area1 = NULL, *json_area2 = NULL;
 	json_object *jobj_hdr1 = NULL, *jobj_hdr2 = NULL;
+	uint8_t csum1[LUKS2_CHECKSUM_L], csum2[LUKS2_CHECKSUM_L];
 	int i, r;
 	uint64_t hdr_size;
 
+	hdr->disk.valid = 0;
+
 	if (do_recovery && !crypt_metadata_locking_enabled()) {
 		do_recovery = 0;
 		log_dbg("Disabling header auto-recovery due to locking being disabled.");
@@ -554,9 +1000,9 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 	 * Read primary LUKS2 header (offset 0).
 	 */
 	state_hdr1 = HDR_FAIL;
-	r = hdr_read_disk(device, &hdr_disk1, &json_area1, 0, 0);
+	r = hdr_read_disk(device, &hdr_disk1, &json_area1, 0, 0, csum1);
 	if (r == 0) {
-		jobj_hdr1 = parse_and_validate_json(json_area1, be64_to_cpu(hdr_disk1.hdr_size) - LUKS2_HDR_BIN_LEN);
+		jobj_hdr1 = parse_and_validate_json(cd, json_area1, be64_to_cpu(hdr_disk1.hdr_size) - LUKS2_HDR_BIN_LEN);
 		state_hdr1 = jobj_hdr1 ? HDR_OK : HDR_OBSOLETE;
 	} else if (r == -EIO)
 		state_hdr1 = HDR_FAIL_IO;
@@ -566,9 +1012,9 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 	 */
 	state_hdr2 = HDR_FAIL;
 	if (state_hdr1 != HDR_FAIL && state_hdr1 != HDR_FAIL_IO) {
-		r = hdr_read_disk(device, &hdr_disk2, &json_area2, be64_to_cpu(hdr_disk1.hdr_size), 1);
+		r = hdr_read_disk(device, &hdr_disk2, &json_area2, be64_to_cpu(hdr_disk1.hdr_size), 1, csum2);
 		if (r == 0) {
-			jobj_hdr2 = parse_and_validate_json(json_area2, be64_to_cpu(hdr_disk2.hdr_size) - LUKS2_HDR_BIN_LEN);
+			jobj_hdr2 = parse_and_validate_json(cd, json_area2, be64_to_cpu(hdr_disk2.hdr_size) - LUKS2_HDR_BIN_LEN);
 			state_hdr2 = jobj_hdr2 ? HDR_OK : HDR_OBSOLETE;
 		} else if (r == -EIO)
 			state_hdr2 = HDR_FAIL_IO;
@@ -577,10 +1023,10 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 		 * No header size, check all known offsets.
 		 */
 		for (r = -EINVAL,i = 2; r < 0 && i <= 1024; i <<= 1)
-			r = hdr_read_disk(device, &hdr_disk2, &json_area2, i * 4096, 1);
+			r = hdr_read_disk(device, &hdr_disk2, &json_area2, i * 4096, 1, csum2);
 
 		if (r == 0) {
-			jobj_hdr2 = parse_and_validate_json(json_area2, be64_to_cpu(hdr_disk2.hdr_size) - LUKS2_HDR_BIN_LEN);
+			jobj_hdr2 = parse_and_validate_json(cd, json_area2, be64_to_cpu(hdr_disk2.hdr_size) - LUKS2_HDR_BIN_LEN);
 			state_hdr2 = jobj_hdr2 ? HDR_OK : HDR_OBSOLETE;
 		} else if (r == -EIO)
 			state_hdr2 = HDR_FAIL_IO;
@@ -623,7 +1069,7 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 				log_dbg("Cannot generate master salt.");
 			else {
 				hdr_from_disk(&hdr_disk1, &hdr_disk2, hdr, 0);
-				r = hdr_write_disk(device, hdr, json_area1, 1);
+				r = hdr_write_disk(device, hdr, json_area1, 1, NULL);
 			}
 			if (r)
 				log_dbg("Secondary LUKS2 header recovery failed.");
@@ -638,7 +1084,7 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 				log_dbg("Cannot generate master salt.");
 			else {
 				hdr_from_disk(&hdr_disk2, &hdr_disk1, hdr, 1);
-				r = hdr_write_disk(device, hdr, json_area2, 0);
+				r = hdr_write_disk(device, hdr, json_area2, 0, NULL);
 			}
 			if (r)
 				log_dbg("Primary LUKS2 header recovery failed.");
@@ -661,6 +1107,9 @@ int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 		hdr_from_disk(&hdr_disk1, &hdr_disk2, hdr, 0);
 		hdr->jobj = jobj_hdr1;
 		json_object_put(jobj_hdr2);
+		/* Both copies in sync, remember them for cheap freshness check */
+		if (state_hdr2 == HDR_OK)
+			hdr_disk_identity(device, hdr, csum1, csum2);
 	} else if (state_hdr2 == HDR_OK) {
 		hdr_from_disk(&hdr_disk2, &hdr_disk1, hdr, 1);
 		hdr->jobj = jobj_hdr2;
@@ -683,6 +1132,23 @@ err:
 	return r;
 }
 
+/*
+ * Read and convert on-disk LUKS2 header to in-memory representation..
+ * Try to do recovery if on-disk state is not consistent.
+ */
+int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
+			struct device *device, int do_recovery)
+{
+	int r;
+
+	crypt_trace(cd, CRYPT_TRACE_HDR_READ, 0, 0);
+	r = disk_hdr_read(cd, hdr, device, do_recovery);
+	/* both binary headers with JSON areas on success */
+	crypt_trace(cd, CRYPT_TRACE_HDR_READ, 1, r ? 0 : 2 * hdr->hdr_size);
+
+	return r;
+}
+
 int LUKS2_hdr_version_unlocked(struct crypt_device *cd, const char *backup_file)
 {
 	struct {
@@ -43,6 +43,8 @@
  */
 int LUKS2_disk_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr,
 			struct device *device, int do_recovery);
+int LUKS2_disk_hdr_unchanged(struct crypt_device *cd, struct luks2_hdr *hdr,
+			     struct device *device);
 int LUKS2_disk_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr,
 			 struct device *device);
 
@@ -58,7 +60,10 @@ json_object *LUKS2_get_tokens_jobj(struct luks2_hdr *hdr);
 void hexprint_base64(struct crypt_device *cd, json_object *jobj,
 		     const char *sep, const char *line_sep);
 
-json_object *parse_json_len(const char *json_area, int length, int *end_offset);
+json_object *parse_json_len(const char *json_area, int length, int *end_offset,
+			    const struct crypt_metadata_limits *limits, uint64_t deadline);
+json_object *parse_and_validate_json(struct crypt_device *cd,
+				     const char *json_area, int length);
 uint64_t json_object_get_uint64(json_object *jobj);
 uint32_t json_object_get_uint32(json_object *jobj);
 json_object *json_object_new_uint64(uint64_t value);
@@ -73,6 +78,14 @@ void JSON_DBG(json_object *jobj, const char *desc);
 json_object *json_contains(json_object *jobj, const char *name, const char *section,
 		      const char *key, json_type type);
 
+/* keyslot area, sortable by offset */
+struct interval {
+	uint64_t offset;
+	uint64_t length;
+};
+
+void LUKS2_intervals_sort(struct interval *ix, int length);
+
 int LUKS2_hdr_validate(json_object *hdr_jobj);
 int LUKS2_keyslot_validate(json_object *hdr_jobj, json_object *hdr_keyslot, const char *key);
 int LUKS2_check_json_size(const struct luks2_hdr *hdr);
@@ -106,9 +119,17 @@ typedef int (*keyslot_update_func)(struct crypt_device *cd, int keyslot,
 typedef int (*keyslot_open_func) (struct crypt_device *cd, int keyslot,
 				  const char *password, size_t password_len,
 				  char *volume_key, size_t volume_key_len);
+typedef int (*keyslot_pbkdf_func) (struct crypt_device *cd, int keyslot,
+				  struct crypt_pbkdf_job *job, char *salt);
+typedef int (*keyslot_open_derived_func) (struct crypt_device *cd, int keyslot,
+				  const struct volume_key *derived_key,
+				  char *volume_key, size_t volume_key_len);
 typedef int (*keyslot_store_func)(struct crypt_device *cd, int keyslot,
 				  const char *password, size_t password_len,
 				  const char *volume_key, size_t volume_key_len);
+typedef int (*keyslot_store_derived_func)(struct crypt_device *cd, int keyslot,
+				  const struct volume_key *derived_key,
+				  const char *volume_key, size_t volume_key_len);
 typedef int (*keyslot_wipe_func) (struct crypt_device *cd, int keyslot);
 typedef int (*keyslot_dump_func) (struct crypt_device *cd, int keyslot);
 typedef int (*keyslot_validate_func) (struct crypt_device *cd, json_object *jobj_keyslot);
@@ -134,6 +155,11 @@ typedef struct  {
 	keyslot_dump_func  dump;
 	keyslot_validate_func validate;
 	keyslot_repair_func repair;
+	/* optional, concurrent unlock of several keyslots */
+	keyslot_pbkdf_func pbkdf;
+	keyslot_open_derived_func open_derived;
+	/* optional, batch store of several keyslots with one header write */
+	keyslot_store_derived_func store_derived;
 } keyslot_handler;
 
 /**
@@ -166,6 +192,8 @@ typedef struct {
 	builtin_token_set_func set;
 	/* public token handler */
 	const crypt_token_handler *h;
+	/* CRYPT_TOKEN_HANDLER_* capabilities */
+	uint32_t flags;
 } token_handler;
 
 int token_keyring_set(json_object **, const void *);
@@ -173,5 +201,7 @@ int token_keyring_get(json_object *, void *);
 
 int LUKS2_find_area_gap(struct crypt_device *cd, struct luks2_hdr *hdr,
 			size_t keylength, uint64_t *area_offset, uint64_t *area_length);
+int LUKS2_find_area(struct crypt_device *cd, struct luks2_hdr *hdr,
+		    uint64_t length, uint64_t *area_offset);
 
 #endif
@@ -22,11 +22,6 @@
 #include "luks2_internal.h"
 #include <uuid/uuid.h>
 
-struct area {
-	uint64_t offset;
-	uint64_t length;
-};
-
 static size_t get_area_size(size_t keylength)
 {
 	//FIXME: calculate this properly, for now it is AF_split_sectors
@@ -43,46 +38,29 @@ static size_t get_max_offset(struct crypt_device *cd)
 	return crypt_get_data_offset(cd) * SECTOR_SIZE;
 }
 
-int LUKS2_find_area_gap(struct crypt_device *cd, struct luks2_hdr *hdr,
-			size_t keylength, uint64_t *area_offset, uint64_t *area_length)
+/* Find first gap of length bytes (4096 bytes aligned) in keyslots area */
+int LUKS2_find_area(struct crypt_device *cd, struct luks2_hdr *hdr,
+		    uint64_t length, uint64_t *area_offset)
 {
-	struct area areas[LUKS2_KEYSLOTS_MAX], sorted_areas[LUKS2_KEYSLOTS_MAX] = {};
-	int i, j, k, area_i;
-	size_t offset, length;
+	struct interval sorted_areas[LUKS2_KEYSLOTS_MAX] = {};
+	int i, k = 0;
+	uint64_t offset, max_offset = get_max_offset(cd) ?: UINT64_MAX;
 
-	/* fill area offset + length table */
+	/* fill area offset + length table, skip areas beyond data offset */
 	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++) {
-		if (!LUKS2_keyslot_area(hdr, i, &areas[i].offset, &areas[i].length))
+		if (LUKS2_keyslot_area(hdr, i, &sorted_areas[k].offset, &sorted_areas[k].length))
+			continue;
+		if (!sorted_areas[k].offset || sorted_areas[k].offset > max_offset)
 			continue;
-		areas[i].length = 0;
-		areas[i].offset = 0;
+		k++;
 	}
+	memset(&sorted_areas[k], 0, (LUKS2_KEYSLOTS_MAX - k) * sizeof(*sorted_areas));
 
-	/* sort table */
-	k = 0; /* index in sorted table */
-	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++) {
-		offset = get_max_offset(cd) ?: UINT64_MAX;
-		area_i = -1;
-		/* search for the smallest offset in table */
-		for (j = 0; j < LUKS2_KEYSLOTS_MAX; j++)
-			if (areas[j].offset && areas[j].offset <= offset) {
-				area_i = j;
-				offset = areas[j].offset;
-			}
-
-		if (area_i >= 0) {
-			sorted_areas[k].length = areas[area_i].length;
-			sorted_areas[k].offset = areas[area_i].offset;
-			areas[area_i].length = 0;
-			areas[area_i].offset = 0;
-			k++;
-		}
-	}
+	LUKS2_intervals_sort(sorted_areas, k);
 
 	/* search for the gap we can use */
 	offset = get_min_offset(hdr);
-	length = get_area_size(keylength);
-	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++) {
+	for (i = 0; i < k; i++) {
 		/* skip empty */
 		if (sorted_areas[i].offset == 0 || sorted_areas[i].length == 0)
 			continue;
@@ -100,7 +78,7 @@ int LUKS2_find_area_gap(struct crypt_device *cd, struct luks2_hdr *hdr,
 		return -EINVAL;
 	}
 
-	log_dbg("Found area %zu -> %zu", offset, length + offset);
+	log_dbg("Found area %" PRIu64 " -> %" PRIu64, offset, length + offset);
 /*
 	log_dbg("Area offset min: %zu, max %zu, slots max %u",
 	       get_min_offset(hdr), get_max_offset(cd), LUKS2_KEYSLOTS_MAX);
@@ -110,10 +88,17 @@ int LUKS2_find_area_gap(struct crypt_device *cd, struct luks2_hdr *hdr,
 			sorted_areas[i].length + sorted_areas[i].offset);
 */
 	*area_offset = offset;
-	*area_length = length;
 	return 0;
 }
 
+int LUKS2_find_area_gap(struct crypt_device *cd, struct luks2_hdr *hdr,
+			size_t keylength, uint64_t *area_offset, uint64_t *area_length)
+{
+	*area_length = get_area_size(keylength);
+
+	return LUKS2_find_area(cd, hdr, *area_length, area_offset);
+}
+
 int LUKS2_generate_hdr(
 	struct crypt_device *cd,
 	struct luks2_hdr *hdr,
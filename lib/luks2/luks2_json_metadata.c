@@ -28,11 +28,6 @@
 
 #define LUKS_STRIPES 4000
 
-struct interval {
-	uint64_t offset;
-	uint64_t length;
-};
-
 void hexprint_base64(struct crypt_device *cd, json_object *jobj,
 		     const char *sep, const char *line_sep)
 {
@@ -363,9 +358,50 @@ static json_bool segment_has_digest(const char *segment_name, json_object *jobj_
 	return FALSE;
 }
 
-static json_bool validate_intervals(int length, const struct interval *ix, uint64_t *data_offset)
+/*
+ * Bitmap of segment ids referenced by any digest, built in a single pass so
+ * that segment validation does not rescan all digests for each segment.
+ * Segments with id above the bitmap width are looked up by segment_has_digest().
+ */
+#define SEGMENTS_BITMAP_MAX 64
+static uint64_t segments_with_digest(json_object *jobj_digests)
+{
+	json_object *jobj_segments;
+	uint64_t bitmap = 0;
+	int i, id;
+
+	json_object_object_foreach(jobj_digests, key, val) {
+		UNUSED(key);
+		if (!json_object_object_get_ex(val, "segments", &jobj_segments))
+			continue;
+		for (i = 0; i < (int) json_object_array_length(jobj_segments); i++) {
+			id = atoi(json_object_get_string(json_object_array_get_idx(jobj_segments, i)));
+			if (id >= 0 && id < SEGMENTS_BITMAP_MAX)
+				bitmap |= (UINT64_C(1) << id);
+		}
+	}
+
+	return bitmap;
+}
+
+static int interval_cmp(const void *a, const void *b)
+{
+	const struct interval *ia = a, *ib = b;
+
+	if (ia->offset == ib->offset)
+		return 0;
+	return ia->offset < ib->offset ? -1 : 1;
+}
+
+void LUKS2_intervals_sort(struct interval *ix, int length)
 {
-	int j, i = 0;
+	if (length > 1)
+		qsort(ix, length, sizeof(*ix), interval_cmp);
+}
+
+static json_bool validate_intervals(int length, struct interval *ix, uint64_t *data_offset)
+{
+	int i = 0;
 
 	while (i < length) {
 		if (ix[i].offset < 2 * LUKS2_HDR_16K_LEN) {
@@ -385,25 +421,27 @@ static json_bool validate_intervals(int length, const struct interval *ix, uint6
 			return FALSE;
 		}
 
-		for (j = 0; j < length; j++) {
-			if (i == j)
-				continue;
-			if ((ix[i].offset >= ix[j].offset) && (ix[i].offset < (ix[j].offset + ix[j].length))) {
-				log_dbg("Overlapping areas [%" PRIu64 ",%" PRIu64 "] and [%" PRIu64 ",%" PRIu64 "].",
-					ix[i].offset, ix[i].offset + ix[i].length,
-					ix[j].offset, ix[j].offset + ix[j].length);
-				return FALSE;
-			}
-		}
-
 		i++;
 	}
 
+	/* sorted by offset, each area can overlap only with its successor */
+	LUKS2_intervals_sort(ix, length);
+
+	for (i = 1; i < length; i++) {
+		if (ix[i].offset < (ix[i - 1].offset + ix[i - 1].length)) {
+			log_dbg("Overlapping areas [%" PRIu64 ",%" PRIu64 "] and [%" PRIu64 ",%" PRIu64 "].",
+				ix[i].offset, ix[i].offset + ix[i].length,
+				ix[i - 1].offset, ix[i - 1].offset + ix[i - 1].length);
+			return FALSE;
+		}
+	}
+
 	return TRUE;
 }
 
 static int hdr_validate_areas(json_object *hdr_jobj);
-int LUKS2_keyslot_validate(json_object *hdr_jobj, json_object *hdr_keyslot, const char *key)
+
+static int keyslot_validate(json_object *hdr_keyslot, const char *key)
 {
 	json_object *jobj_key_size;
 
@@ -419,6 +457,14 @@ int LUKS2_keyslot_validate(json_object *hdr_jobj, json_object *hdr_keyslot, cons
 		return 1;
 	}
 
+	return 0;
+}
+
+int LUKS2_keyslot_validate(json_object *hdr_jobj, json_object *hdr_keyslot, const char *key)
+{
+	if (keyslot_validate(hdr_keyslot, key))
+		return 1;
+
 	if (hdr_validate_areas(hdr_jobj))
 		return 1;
 
@@ -479,7 +525,8 @@ static int hdr_validate_keyslots(json_object *hdr_jobj)
 	json_object_object_foreach(jobj, key, val) {
 		if (!numbered("Keyslot", key))
 			return 1;
-		if (LUKS2_keyslot_validate(hdr_jobj, val, key))
+		/* areas are validated once for the whole header later */
+		if (keyslot_validate(val, key))
 			return 1;
 	}
 
@@ -510,7 +557,8 @@ static int hdr_validate_segments(json_object *hdr_jobj)
 	json_object *jobj, *jobj_digests, *jobj_offset, *jobj_ivoffset,
 		    *jobj_length, *jobj_sector_size, *jobj_type, *jobj_integrity;
 	uint32_t sector_size;
-	uint64_t ivoffset, offset, length;
+	uint64_t ivoffset, offset, length, digest_bitmap;
+	int id;
 
 	if (!json_object_object_get_ex(hdr_jobj, "segments", &jobj)) {
 		log_dbg("Missing segments section.");
@@ -526,6 +574,8 @@ static int hdr_validate_segments(json_object *hdr_jobj)
 	if (!json_object_object_get_ex(hdr_jobj, "digests", &jobj_digests))
 		return 1;
 
+	digest_bitmap = segments_with_digest(jobj_digests);
+
 	json_object_object_foreach(jobj, key, val) {
 		if (!numbered("Segment", key))
 			return 1;
@@ -574,7 +624,8 @@ static int hdr_validate_segments(json_object *hdr_jobj)
 			return 1;
 		}
 
-		if (ivoffset % sector_size) {
+		/* iv_tweak is in 512-byte sectors */
+		if (ivoffset % (sector_size / SECTOR_SIZE)) {
 			log_dbg("IV offset field has to be aligned to sector size: %" PRIu32, sector_size);
 			return 1;
 		}
@@ -592,8 +643,14 @@ static int hdr_validate_segments(json_object *hdr_jobj)
 		}
 
 		json_object_object_get_ex(val, "type", &jobj_type);
-		if (!strcmp(json_object_get_string(jobj_type), "crypt") &&
-		    !segment_has_digest(key, jobj_digests))
+		if (strcmp(json_object_get_string(jobj_type), "crypt"))
+			continue;
+
+		id = atoi(key);
+		if (id < SEGMENTS_BITMAP_MAX) {
+			if (!(digest_bitmap & (UINT64_C(1) << id)))
+				return 1;
+		} else if (!segment_has_digest(key, jobj_digests))
 			return 1;
 	}
 
@@ -805,6 +862,11 @@ static int hdr_validate_config(json_object *hdr_jobj)
 		}
 	}
 
+	/* Reencryption checkpoint is optional */
+	if (json_object_object_get_ex(jobj_config, "reencrypt", &jobj) &&
+	    !json_contains(jobj_config, "section", "Config", "reencrypt", json_type_object))
+		return 1;
+
 	return 0;
 }
 
@@ -842,10 +904,40 @@ int LUKS2_hdr_validate(json_object *hdr_jobj)
 	return 0;
 }
 
+/*
+ * Read header without lock. Result is used only if both copies are
+ * valid and in sync, and the binary headers read again afterwards
+ * still have the same seqid and checksums (no writer interfered).
+ */
+static int hdr_read_optimistic(struct crypt_device *cd, struct luks2_hdr *hdr)
+{
+	struct device *device = crypt_metadata_device(cd);
+	json_object *jobj_old = hdr->jobj;
+	int r;
+
+	device_set_optimistic_read(device, 1);
+	r = LUKS2_disk_hdr_read(cd, hdr, device, 0);
+	if (!r && !LUKS2_disk_hdr_unchanged(cd, hdr, device))
+		r = -EAGAIN;
+	device_set_optimistic_read(device, 0);
+
+	/* drop only what this read parsed */
+	if (r && hdr->jobj != jobj_old) {
+		json_object_put(hdr->jobj);
+		hdr->jobj = jobj_old;
+	}
+
+	log_dbg("Optimistic LUKS2 header read %s.", r ? "failed, locking device" : "succeeded");
+	return r;
+}
+
 int LUKS2_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr)
 {
 	int r;
 
+	if (crypt_metadata_locking_enabled() && !hdr_read_optimistic(cd, hdr))
+		return 0;
+
 	r = device_read_lock(cd, crypt_metadata_device(cd));
 	if (r) {
 		log_err(cd, _("Failed to acquire read lock on device %s."),
@@ -874,8 +966,32 @@ int LUKS2_hdr_read(struct crypt_device *cd, struct luks2_hdr *hdr)
 	return r;
 }
 
+/*
+ * Check that already parsed header is still current on disk
+ * without reading and validating JSON metadata again.
+ */
+int LUKS2_hdr_read_cached(struct crypt_device *cd, struct luks2_hdr *hdr)
+{
+	int r;
+
+	if (!hdr->disk.valid)
+		return 0;
+
+	if (device_read_lock(cd, crypt_metadata_device(cd)))
+		return 0;
+
+	r = LUKS2_disk_hdr_unchanged(cd, hdr, crypt_metadata_device(cd));
+
+	device_read_unlock(crypt_metadata_device(cd));
+
+	return r;
+}
+
 int LUKS2_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr)
 {
+	/* in-memory header no longer matches last read on-disk state */
+	hdr->disk.valid = 0;
+
 	/* NOTE: is called before LUKS2 validation routines */
 	/* erase unused digests (no assigned keyslot or segment) */
 	LUKS2_digests_erase_unused(cd, hdr);
@@ -883,6 +999,10 @@ int LUKS2_hdr_write(struct crypt_device *cd, struct luks2_hdr *hdr)
 	if (LUKS2_hdr_validate(hdr->jobj))
 		return -EINVAL;
 
+	/* inside header transaction, written once on commit */
+	if (crypt_header_transaction_defer(cd))
+		return 0;
+
 	return LUKS2_disk_hdr_write(cd, hdr, crypt_metadata_device(cd));
 }
 
@@ -954,7 +1074,7 @@ int LUKS2_hdr_backup(struct crypt_device *cd, struct luks2_hdr *hdr,
 		     const char *backup_file)
 {
 	struct device *device = crypt_metadata_device(cd);
-	int r = 0, devfd = -1;
+	int r = 0, devfd = -1, fd;
 	ssize_t hdr_size;
 	ssize_t buffer_size;
 	char *buffer = NULL;
@@ -962,10 +1082,6 @@ int LUKS2_hdr_backup(struct crypt_device *cd, struct luks2_hdr *hdr,
 	hdr_size = LUKS2_hdr_and_areas_size(hdr->jobj);
 	buffer_size = size_round_up(hdr_size, crypt_getpagesize());
 
-	buffer = crypt_safe_alloc(buffer_size);
-	if (!buffer)
-		return -ENOMEM;
-
 	log_dbg("Storing backup of header (%zu bytes).", hdr_size);
 	log_dbg("Output backup file size: %zu bytes.", buffer_size);
 
@@ -973,45 +1089,49 @@ int LUKS2_hdr_backup(struct crypt_device *cd, struct luks2_hdr *hdr,
 	if (r) {
 		log_err(cd, _("Failed to acquire read lock on device %s."),
 			device_path(crypt_metadata_device(cd)));
-		crypt_safe_free(buffer);
 		return r;
 	}
 
-	devfd = device_open_locked(device, O_RDONLY);
-	if (devfd < 0) {
+	fd = crypt_backup_file_open(cd, backup_file, buffer_size);
+	if (fd < 0) {
 		device_read_unlock(device);
-		log_err(cd, _("Device %s is not a valid LUKS device."), device_path(device));
-		crypt_safe_free(buffer);
-		return devfd == -1 ? -EINVAL : devfd;
+		return fd;
 	}
 
-	if (read_blockwise(devfd, device_block_size(device),
-			   device_alignment(device), buffer, hdr_size) < hdr_size) {
-		close(devfd);
-		device_read_unlock(device);
-		crypt_safe_free(buffer);
-		return -EIO;
-	}
-	close(devfd);
+	/* Detached header file is copied in kernel, no need to read it */
+	r = crypt_backup_file_copy(cd, device, fd, hdr_size);
+	if (r != -ENOTSUP)
+		goto out;
 
-	device_read_unlock(device);
+	buffer = crypt_safe_alloc(buffer_size);
+	if (!buffer) {
+		r = -ENOMEM;
+		goto out;
+	}
 
-	devfd = open(backup_file, O_CREAT|O_EXCL|O_WRONLY, S_IRUSR);
-	if (devfd == -1) {
-		if (errno == EEXIST)
-			log_err(cd, _("Requested header backup file %s already exists."), backup_file);
-		else
-			log_err(cd, _("Cannot create header backup file %s."), backup_file);
-		crypt_safe_free(buffer);
-		return -EINVAL;
+	devfd = device_open_locked(device, O_RDONLY);
+	if (devfd < 0) {
+		log_err(cd, _("Device %s is not a valid LUKS device."), device_path(device));
+		r = devfd == -1 ? -EINVAL : devfd;
+		goto out;
 	}
-	if (write_buffer(devfd, buffer, buffer_size) < buffer_size) {
+
+	if (read_blockwise(devfd, device_block_size(device),
+			   device_alignment(device), buffer, hdr_size) < hdr_size)
+		r = -EIO;
+	else if (write_buffer_at(fd, buffer, buffer_size, 0) < buffer_size) {
 		log_err(cd, _("Cannot write header backup file %s."), backup_file);
 		r = -EIO;
 	} else
 		r = 0;
 
-	close(devfd);
+	device_close(device, devfd);
+out:
+	device_read_unlock(device);
+
+	if (r < 0)
+		unlink(backup_file);
+	close(fd);
 	crypt_safe_free(buffer);
 	return r;
 }
@@ -1172,7 +1292,7 @@ out:
 	crypt_safe_free(buffer);
 
 	if (devfd >= 0)
-		close(devfd);
+		device_close(device, devfd);
 
 	if (!r) {
 		LUKS2_hdr_free(hdr);
@@ -1192,6 +1312,9 @@ static const struct  {
 	{ CRYPT_ACTIVATE_ALLOW_DISCARDS,         "allow-discards" },
 	{ CRYPT_ACTIVATE_SAME_CPU_CRYPT,         "same-cpu-crypt" },
 	{ CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS, "submit-from-crypt-cpus" },
+	{ CRYPT_ACTIVATE_NO_READ_WORKQUEUE,      "no-read-workqueue" },
+	{ CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE,     "no-write-workqueue" },
+	{ CRYPT_ACTIVATE_HIGH_PRIORITY,          "high-priority" },
 	{ CRYPT_ACTIVATE_NO_JOURNAL,             "no-journal" },
 	{ 0, NULL }
 };
@@ -1269,6 +1392,7 @@ static const struct  {
 	const char *description;
 } requirements_flags[] = {
 	{ CRYPT_REQUIREMENT_OFFLINE_REENCRYPT, "offline-reencrypt" },
+	{ CRYPT_REQUIREMENT_ONLINE_REENCRYPT,  "online-reencrypt" },
 	{ 0, NULL }
 };
 
@@ -1327,6 +1451,7 @@ int LUKS2_config_get_requirements(struct crypt_device *cd, struct luks2_hdr *hdr
 int LUKS2_config_set_requirements(struct crypt_device *cd, struct luks2_hdr *hdr, uint32_t reqs)
 {
 	json_object *jobj_config, *jobj_requirements, *jobj_mandatory, *jobj;
+	uint32_t reqs_orig = reqs;
 	int i, r = -EINVAL;
 
 	if (!hdr)
@@ -1380,12 +1505,102 @@ int LUKS2_config_set_requirements(struct crypt_device *cd, struct luks2_hdr *hdr
 	if (!json_object_object_length(jobj_requirements))
 		json_object_object_del(jobj_config, "requirements");
 
+	/* checkpoint is meaningless without offline reencryption */
+	if (!(reqs_orig & CRYPT_REQUIREMENT_OFFLINE_REENCRYPT))
+		json_object_object_del(jobj_config, "reencrypt");
+
 	return LUKS2_hdr_write(cd, hdr);
 err:
 	json_object_put(jobj_mandatory);
 	return r;
 }
 
+/*
+ * Offline reencryption checkpoint, "reencrypt" object in config section:
+ * { "offset": "<bytes>", "shift": "<bytes>", "direction": "forward|backward",
+ *   "mode": "reencrypt|encrypt|decrypt" }
+ */
+static const char *checkpoint_modes[] = { "reencrypt", "encrypt", "decrypt", NULL };
+static const char *checkpoint_directions[] = { "forward", "backward", NULL };
+
+static int checkpoint_index(const char **names, const char *name)
+{
+	int i;
+
+	for (i = 0; name && names[i]; i++)
+		if (!strcmp(names[i], name))
+			return i;
+	return -1;
+}
+
+int LUKS2_config_get_checkpoint(struct crypt_device *cd, struct luks2_hdr *hdr,
+	struct crypt_params_reencrypt_checkpoint *cp)
+{
+	json_object *jobj_config, *jobj_reenc, *jobj;
+	int direction, mode;
+
+	if (!json_object_object_get_ex(hdr->jobj, "config", &jobj_config) ||
+	    !json_object_object_get_ex(jobj_config, "reencrypt", &jobj_reenc))
+		return -ENOENT;
+
+	if (!json_object_object_get_ex(jobj_reenc, "offset", &jobj) ||
+	    !json_str_to_uint64(jobj, &cp->offset) ||
+	    !json_object_object_get_ex(jobj_reenc, "shift", &jobj) ||
+	    !json_str_to_uint64(jobj, &cp->shift) ||
+	    !json_object_object_get_ex(jobj_reenc, "direction", &jobj) ||
+	    (direction = checkpoint_index(checkpoint_directions, json_object_get_string(jobj))) < 0 ||
+	    !json_object_object_get_ex(jobj_reenc, "mode", &jobj) ||
+	    (mode = checkpoint_index(checkpoint_modes, json_object_get_string(jobj))) < 0) {
+		log_dbg("Invalid reencryption checkpoint.");
+		return -EINVAL;
+	}
+
+	cp->direction = direction;
+	cp->mode = mode;
+
+	return 0;
+}
+
+int LUKS2_config_set_checkpoint(struct crypt_device *cd, struct luks2_hdr *hdr,
+	const struct crypt_params_reencrypt_checkpoint *cp)
+{
+	json_object *jobj_config, *jobj_reenc;
+	uint32_t reqs;
+	int r;
+
+	if (!json_object_object_get_ex(hdr->jobj, "config", &jobj_config))
+		return -EINVAL;
+
+	r = LUKS2_config_get_requirements(cd, hdr, &reqs);
+	if (r)
+		return r;
+
+	if (!(reqs & CRYPT_REQUIREMENT_OFFLINE_REENCRYPT)) {
+		log_dbg("Offline reencryption is not in progress.");
+		return -EINVAL;
+	}
+
+	if (!cp) {
+		json_object_object_del(jobj_config, "reencrypt");
+		return LUKS2_hdr_write(cd, hdr);
+	}
+
+	if (cp->direction > 1 || cp->mode > 2)
+		return -EINVAL;
+
+	jobj_reenc = json_object_new_object();
+	if (!jobj_reenc)
+		return -ENOMEM;
+
+	json_object_object_add(jobj_reenc, "offset", json_object_new_uint64(cp->offset));
+	json_object_object_add(jobj_reenc, "shift", json_object_new_uint64(cp->shift));
+	json_object_object_add(jobj_reenc, "direction", json_object_new_string(checkpoint_directions[cp->direction]));
+	json_object_object_add(jobj_reenc, "mode", json_object_new_string(checkpoint_modes[cp->mode]));
+	json_object_object_add(jobj_config, "reencrypt", jobj_reenc);
+
+	return LUKS2_hdr_write(cd, hdr);
+}
+
 /*
  * Header dump
  */
@@ -1871,6 +2086,12 @@ int LUKS2_activate(struct crypt_device *cd,
 			return -EINVAL;
 		}
 
+		/* dm-integrity bitmap and recalculation require internal hash */
+		if (flags & (CRYPT_ACTIVATE_NO_JOURNAL_BITMAP | CRYPT_ACTIVATE_RECALCULATE)) {
+			log_err(cd, _("Integrity bitmap mode and recalculation are not supported for LUKS2 devices."));
+			return -EINVAL;
+		}
+
 		snprintf(dm_int_name, sizeof(dm_int_name), "%s_dif", name);
 		r = INTEGRITY_activate(cd, dm_int_name, NULL, NULL, NULL, NULL, flags);
 		if (r)
@@ -1937,6 +2158,9 @@ int LUKS2_unmet_requirements(struct crypt_device *cd, struct luks2_hdr *hdr, uin
 	if (reqs_reencrypt(reqs) && !quiet)
 		log_err(cd, _("Offline reencryption in progress. Aborting."));
 
+	if ((reqs & CRYPT_REQUIREMENT_ONLINE_REENCRYPT) && !quiet)
+		log_err(cd, _("Online reencryption in progress. Aborting."));
+
 	/* any remaining unmasked requirement fails the check */
 	return reqs ? -EINVAL : 0;
 }
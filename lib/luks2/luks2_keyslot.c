@@ -21,11 +21,15 @@
 
 #include "luks2_internal.h"
 
+#define LUKS_SALTSIZE 32
+
 /* Internal implementations */
 extern const keyslot_handler luks2_keyslot;
+extern const keyslot_handler reenc_keyslot;
 
 static const keyslot_handler *keyslot_handlers[LUKS2_KEYSLOTS_MAX] = {
 	&luks2_keyslot,
+	&reenc_keyslot,
 	NULL
 };
 
@@ -235,21 +239,18 @@ int LUKS2_keyslot_area(struct luks2_hdr *hdr,
 	return 0;
 }
 
-static int LUKS2_open_and_verify(struct crypt_device *cd,
+static int LUKS2_keyslot_open_check(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int keyslot,
 	int segment,
-	const char *password,
-	size_t password_len,
-	struct volume_key **vk)
+	const keyslot_handler **h)
 {
-	const keyslot_handler *h;
-	int key_size, r;
+	int r;
 
-	if (!(h = LUKS2_keyslot_handler(cd, keyslot)))
+	if (!(*h = LUKS2_keyslot_handler(cd, keyslot)))
 		return -ENOENT;
 
-	r = h->validate(cd, LUKS2_get_keyslot_jobj(hdr, keyslot));
+	r = (*h)->validate(cd, LUKS2_get_keyslot_jobj(hdr, keyslot));
 	if (r) {
 		log_dbg("Keyslot %d validation failed.", keyslot);
 		return r;
@@ -262,6 +263,22 @@ static int LUKS2_open_and_verify(struct crypt_device *cd,
 		return r;
 	}
 
+	return 0;
+}
+
+/* Open checked keyslot, with already derived keyslot key if provided */
+static int LUKS2_keyslot_open_verify(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	const keyslot_handler *h,
+	int keyslot,
+	int segment,
+	const char *password,
+	size_t password_len,
+	const struct volume_key *derived_key,
+	struct volume_key **vk)
+{
+	int key_size, r;
+
 	key_size = LUKS2_get_volume_key_size(hdr, segment);
 	if (key_size < 0)
 		key_size = LUKS2_get_keyslot_key_size(hdr, keyslot);
@@ -272,7 +289,10 @@ static int LUKS2_open_and_verify(struct crypt_device *cd,
 	if (!*vk)
 		return -ENOMEM;
 
-	r = h->open(cd, keyslot, password, password_len, (*vk)->key, (*vk)->keylength);
+	if (derived_key)
+		r = h->open_derived(cd, keyslot, derived_key, (*vk)->key, (*vk)->keylength);
+	else
+		r = h->open(cd, keyslot, password, password_len, (*vk)->key, (*vk)->keylength);
 	if (r < 0)
 		log_dbg("Keyslot %d (%s) open failed with %d.", keyslot, h->name, r);
 	else
@@ -286,6 +306,113 @@ static int LUKS2_open_and_verify(struct crypt_device *cd,
 	return r < 0 ? r : keyslot;
 }
 
+static int LUKS2_open_and_verify(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int keyslot,
+	int segment,
+	const char *password,
+	size_t password_len,
+	struct volume_key **vk)
+{
+	struct crypt_pbkdf_shared *shared = crypt_get_pbkdf_shared(cd);
+	struct crypt_pbkdf_job job = {};
+	const keyslot_handler *h;
+	char salt[LUKS_SALTSIZE];
+	int r;
+
+	r = LUKS2_keyslot_open_check(cd, hdr, keyslot, segment, &h);
+	if (r)
+		return r;
+
+	if (!shared || !h->pbkdf || !h->open_derived)
+		return LUKS2_keyslot_open_verify(cd, hdr, h, keyslot, segment,
+						 password, password_len, NULL, vk);
+
+	/* identical keyslot key could be already derived for another device */
+	r = h->pbkdf(cd, keyslot, &job, salt);
+	if (!r)
+		r = crypt_pbkdf_shared_derive(shared, &job, password, password_len);
+	if (!r)
+		r = LUKS2_keyslot_open_verify(cd, hdr, h, keyslot, segment,
+					      NULL, 0, job.key, vk);
+
+	crypt_free_volume_key(job.key);
+	crypt_memzero(salt, sizeof(salt));
+	return r;
+}
+
+/*
+ * Derive keys of all candidate keyslots concurrently, then open and verify
+ * them in the original order; the first verified keyslot wins and not yet
+ * started derivations are skipped. Returns -EAGAIN if not applicable.
+ */
+static int LUKS2_keyslot_open_parallel(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	const int *keyslots,
+	int count,
+	const char *password,
+	size_t password_len,
+	int segment,
+	struct volume_key **vk)
+{
+	struct crypt_pbkdf_job job[LUKS2_KEYSLOTS_MAX] = {};
+	const keyslot_handler *h[LUKS2_KEYSLOTS_MAX];
+	char salt[LUKS2_KEYSLOTS_MAX][LUKS_SALTSIZE];
+	int check[LUKS2_KEYSLOTS_MAX], job_idx[LUKS2_KEYSLOTS_MAX];
+	struct crypt_pbkdf_jobs *jobs = NULL;
+	int i, jobs_count = 0, r = -ENOENT;
+
+	if (count < 2 || crypt_cpusonline() < 2 || crypt_unlock_serial(cd))
+		return -EAGAIN;
+
+	for (i = 0; i < count; i++) {
+		job_idx[i] = -1;
+		check[i] = LUKS2_keyslot_open_check(cd, hdr, keyslots[i], segment, &h[i]);
+		if (check[i])
+			continue;
+
+		if (!h[i]->pbkdf || !h[i]->open_derived) {
+			r = -EAGAIN;
+			goto out;
+		}
+
+		check[i] = h[i]->pbkdf(cd, keyslots[i], &job[jobs_count], salt[jobs_count]);
+		if (!check[i])
+			job_idx[i] = jobs_count++;
+	}
+
+	if (jobs_count < 2) {
+		r = -EAGAIN;
+		goto out;
+	}
+
+	r = crypt_pbkdf_jobs_start(&jobs, job, jobs_count, password, password_len);
+	if (r) {
+		r = -EAGAIN;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		log_dbg("Trying to open keyslot %d (concurrent derivation).", keyslots[i]);
+		if (check[i])
+			r = check[i];
+		else if ((r = crypt_pbkdf_jobs_wait(jobs, job_idx[i])) >= 0)
+			r = LUKS2_keyslot_open_verify(cd, hdr, h[i], keyslots[i], segment,
+						      NULL, 0, job[job_idx[i]].key, vk);
+
+		/* Do not retry for errors that are no -EPERM or -ENOENT,
+		   former meaning password wrong, latter key slot unusable for segment */
+		if ((r != -EPERM) && (r != -ENOENT))
+			break;
+	}
+out:
+	crypt_pbkdf_jobs_stop(jobs);
+	for (i = 0; i < jobs_count; i++)
+		crypt_free_volume_key(job[i].key);
+	crypt_memzero(salt, sizeof(salt));
+	return r;
+}
+
 static int LUKS2_keyslot_open_priority(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	crypt_keyslot_priority priority,
@@ -296,7 +423,8 @@ static int LUKS2_keyslot_open_priority(struct crypt_device *cd,
 {
 	json_object *jobj_keyslots, *jobj;
 	crypt_keyslot_priority slot_priority;
-	int keyslot, r = -ENOENT;
+	int keyslots[LUKS2_KEYSLOTS_MAX];
+	int keyslot, i, count = 0, r = -ENOENT;
 
 	json_object_object_get_ex(hdr->jobj, "keyslots", &jobj_keyslots);
 
@@ -313,7 +441,19 @@ static int LUKS2_keyslot_open_priority(struct crypt_device *cd,
 			continue;
 		}
 
-		r = LUKS2_open_and_verify(cd, hdr, keyslot, segment, password, password_len, vk);
+		if (count < LUKS2_KEYSLOTS_MAX)
+			keyslots[count++] = keyslot;
+	}
+
+	crypt_keyslot_history_sort(hdr->uuid, keyslots, count);
+
+	r = LUKS2_keyslot_open_parallel(cd, hdr, keyslots, count,
+					password, password_len, segment, vk);
+	if (r != -EAGAIN)
+		return r;
+
+	for (r = -ENOENT, i = 0; i < count; i++) {
+		r = LUKS2_open_and_verify(cd, hdr, keyslots[i], segment, password, password_len, vk);
 
 		/* Do not retry for errors that are no -EPERM or -ENOENT,
 		   former meaning password wrong, latter key slot unusable for segment */
@@ -336,6 +476,9 @@ int LUKS2_keyslot_open(struct crypt_device *cd,
 
 	hdr = crypt_get_hdr(cd, CRYPT_LUKS2);
 
+	/* keyslots tried one by one usually share Argon2 memory cost */
+	crypt_argon2_pool_get();
+
 	if (keyslot == CRYPT_ANY_SLOT) {
 		r_prio = LUKS2_keyslot_open_priority(cd, hdr, CRYPT_SLOT_PRIORITY_PREFER,
 			password, password_len, segment, vk);
@@ -352,16 +495,103 @@ int LUKS2_keyslot_open(struct crypt_device *cd,
 	} else
 		r = LUKS2_open_and_verify(cd, hdr, keyslot, segment, password, password_len, vk);
 
+	crypt_argon2_pool_put();
+
+	if (r >= 0)
+		crypt_keyslot_history_hit(hdr->uuid, r);
+
 	return r;
 }
 
-int LUKS2_keyslot_store(struct crypt_device *cd,
+/*
+ * Keyslot open split into PBKDF parameters and open with derived key,
+ * so the caller can run the derivation without holding the device context.
+ * Returns -ENOTSUP if keyslot handler cannot open with derived key.
+ */
+int LUKS2_keyslot_derive_params(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int keyslot,
+	int segment,
+	struct crypt_pbkdf_job *job,
+	char *salt)
+{
+	const keyslot_handler *h;
+	int r;
+
+	r = LUKS2_keyslot_open_check(cd, hdr, keyslot, segment, &h);
+	if (r)
+		return r;
+
+	if (!h->pbkdf || !h->open_derived)
+		return -ENOTSUP;
+
+	return h->pbkdf(cd, keyslot, job, salt);
+}
+
+int LUKS2_keyslot_open_by_derived(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int keyslot,
+	int segment,
+	const struct volume_key *derived_key,
+	struct volume_key **vk)
+{
+	const keyslot_handler *h;
+	int r;
+
+	r = LUKS2_keyslot_open_check(cd, hdr, keyslot, segment, &h);
+	if (r)
+		return r;
+
+	if (!h->open_derived)
+		return -ENOTSUP;
+
+	return LUKS2_keyslot_open_verify(cd, hdr, h, keyslot, segment,
+					 NULL, 0, derived_key, vk);
+}
+
+/* Largest PBKDF memory cost of keyslots that can be tried to unlock segment */
+int LUKS2_keyslot_pbkdf_memory(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int keyslot,
+	int segment,
+	uint32_t *memory_kb)
+{
+	struct crypt_pbkdf_job job;
+	const keyslot_handler *h;
+	char salt[LUKS_SALTSIZE];
+	int i;
+
+	*memory_kb = 0;
+
+	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++) {
+		if (keyslot != CRYPT_ANY_SLOT && keyslot != i)
+			continue;
+
+		if (!LUKS2_get_keyslot_jobj(hdr, i) ||
+		    LUKS2_keyslot_open_check(cd, hdr, i, segment, &h) ||
+		    !h->pbkdf)
+			continue;
+
+		memset(&job, 0, sizeof(job));
+		if (h->pbkdf(cd, i, &job, salt))
+			continue;
+
+		if (job.max_memory_kb > *memory_kb)
+			*memory_kb = job.max_memory_kb;
+		crypt_free_volume_key(job.key);
+	}
+	crypt_memzero(salt, sizeof(salt));
+
+	return 0;
+}
+
+/* Allocate or update keyslot json for new content and validate it */
+static int keyslot_store_prepare(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int keyslot,
-	const char *password,
-	size_t password_len,
 	const struct volume_key *vk,
-	const struct luks2_keyslot_params *params)
+	const struct luks2_keyslot_params *params,
+	const keyslot_handler **handler)
 {
 	const keyslot_handler *h;
 	int r;
@@ -395,10 +625,115 @@ int LUKS2_keyslot_store(struct crypt_device *cd,
 		return r;
 	}
 
+	*handler = h;
+	return 0;
+}
+
+int LUKS2_keyslot_store(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int keyslot,
+	const char *password,
+	size_t password_len,
+	const struct volume_key *vk,
+	const struct luks2_keyslot_params *params)
+{
+	const keyslot_handler *h;
+	int r;
+
+	r = keyslot_store_prepare(cd, hdr, keyslot, vk, params, &h);
+	if (r)
+		return r;
+
 	return h->store(cd, keyslot, password, password_len,
 			vk->key, vk->keylength);
 }
 
+/*
+ * Store several keyslots with the same volume key and keyslot parameters.
+ *
+ * PBKDF is benchmarked only for the first keyslot, key derivations run
+ * concurrently and the header is written only once after all keyslot
+ * areas are stored. Keyslot numbers must be already resolved.
+ */
+int LUKS2_keyslot_store_batch(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	const struct luks2_keyslot_store_job *job,
+	unsigned count,
+	const struct volume_key *vk,
+	const struct luks2_keyslot_params *params)
+{
+	struct crypt_pbkdf_job pbkdf_job[LUKS2_KEYSLOTS_MAX] = {};
+	const keyslot_handler *h[LUKS2_KEYSLOTS_MAX];
+	char salt[LUKS2_KEYSLOTS_MAX][LUKS_SALTSIZE];
+	struct crypt_pbkdf_jobs *jobs = NULL;
+	struct crypt_pbkdf_type *pbkdf;
+	uint32_t pbkdf_flags;
+	unsigned i, jobs_count = 0;
+	int r = 0;
+
+	if (!job || !count || count > LUKS2_KEYSLOTS_MAX || !vk)
+		return -EINVAL;
+
+	pbkdf = crypt_get_pbkdf(cd);
+	if (!pbkdf)
+		return -EINVAL;
+
+	/* benchmark result stored in context pbkdf is reused for next keyslots */
+	pbkdf_flags = pbkdf->flags;
+	for (i = 0; i < count && !r; i++) {
+		r = keyslot_store_prepare(cd, hdr, job[i].keyslot, vk, params, &h[i]);
+		if (!r && pbkdf->iterations)
+			pbkdf->flags |= CRYPT_PBKDF_NO_BENCHMARK;
+	}
+	pbkdf->flags = pbkdf_flags;
+	if (r)
+		return r;
+
+	for (i = 0; i < count; i++)
+		if (!h[i]->pbkdf || !h[i]->store_derived)
+			break;
+
+	/* handler without derived key support, store keyslots one by one */
+	if (i < count || count < 2) {
+		for (i = 0; i < count && r >= 0; i++)
+			r = h[i]->store(cd, job[i].keyslot, job[i].password,
+					job[i].password_len, vk->key, vk->keylength);
+		return r < 0 ? r : 0;
+	}
+
+	for (i = 0; i < count; i++, jobs_count++) {
+		r = h[i]->pbkdf(cd, job[i].keyslot, &pbkdf_job[i], salt[i]);
+		if (r)
+			goto out;
+		pbkdf_job[i].password = job[i].password;
+		pbkdf_job[i].password_length = job[i].password_len;
+	}
+
+	r = crypt_pbkdf_jobs_start(&jobs, pbkdf_job, jobs_count, NULL, 0);
+	if (r)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		r = crypt_pbkdf_jobs_wait(jobs, i);
+		if (r < 0)
+			break;
+		r = h[i]->store_derived(cd, job[i].keyslot, pbkdf_job[i].key,
+					vk->key, vk->keylength);
+		if (r < 0)
+			break;
+	}
+
+	crypt_pbkdf_jobs_stop(jobs);
+
+	if (r >= 0)
+		r = LUKS2_hdr_write(cd, hdr);
+out:
+	for (i = 0; i < jobs_count; i++)
+		crypt_free_volume_key(pbkdf_job[i].key);
+	crypt_memzero(salt, sizeof(salt));
+	return r < 0 ? r : 0;
+}
+
 int LUKS2_keyslot_wipe(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	int keyslot,
@@ -469,6 +804,76 @@ int LUKS2_keyslot_wipe(struct crypt_device *cd,
 	return LUKS2_hdr_write(cd, hdr);
 }
 
+/* Wipe several keyslots, areas are wiped in one pass and header written once */
+int LUKS2_keyslots_wipe(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	const int *keyslots,
+	unsigned count)
+{
+	struct device *device = crypt_metadata_device(cd);
+	struct crypt_wipe_area areas[LUKS2_KEYSLOTS_MAX];
+	json_object *jobj_keyslots;
+	const keyslot_handler *h;
+	unsigned i, areas_count = 0;
+	char num[16];
+	int r;
+
+	if (!keyslots || !count || count > LUKS2_KEYSLOTS_MAX)
+		return -EINVAL;
+
+	if (!json_object_object_get_ex(hdr->jobj, "keyslots", &jobj_keyslots))
+		return -EINVAL;
+
+	for (i = 0; i < count; i++)
+		if (!LUKS2_get_keyslot_jobj(hdr, keyslots[i]))
+			return -ENOENT;
+
+	/* Just check that nobody uses the metadata now */
+	r = device_write_lock(cd, device);
+	if (r) {
+		log_err(cd, _("Failed to acquire write lock on device %s."),
+			device_path(device));
+		return r;
+	}
+	device_write_unlock(device);
+
+	for (i = 0; i < count; i++) {
+		r = crypt_keyslot_area(cd, keyslots[i], &areas[areas_count].offset,
+				       &areas[areas_count].length);
+		if (!r)
+			areas_count++;
+		else if (r != -ENOENT)
+			return r;
+	}
+
+	/* We can destroy the binary keyslot areas now without lock */
+	r = crypt_wipe_device_areas(cd, device, CRYPT_WIPE_SPECIAL, areas, areas_count);
+	if (r) {
+		if (r == -EACCES) {
+			log_err(cd, _("Cannot write to device %s, permission denied."),
+				device_path(device));
+			r = -EINVAL;
+		} else
+			log_err(cd, _("Cannot wipe device %s."), device_path(device));
+		return r;
+	}
+
+	for (i = 0; i < count; i++) {
+		/* Slot specific wipe */
+		if ((h = LUKS2_keyslot_handler(cd, keyslots[i]))) {
+			r = h->wipe(cd, keyslots[i]);
+			if (r < 0)
+				return r;
+		} else
+			log_dbg("Wiping keyslot %d without specific-slot handler loaded.", keyslots[i]);
+
+		snprintf(num, sizeof(num), "%d", keyslots[i]);
+		json_object_object_del(jobj_keyslots, num);
+	}
+
+	return LUKS2_hdr_write(cd, hdr);
+}
+
 int LUKS2_keyslot_dump(struct crypt_device *cd, int keyslot)
 {
 	const keyslot_handler *h;
@@ -79,7 +79,7 @@ static int luks2_encrypt_to_storage(char *src, size_t srcLength,
 			r = -EIO;
 		else
 			r = 0;
-		close(devfd);
+		device_close(device, devfd);
 	} else
 		r = -EIO;
 
@@ -121,6 +121,13 @@ static int luks2_decrypt_from_storage(char *dst, size_t dstLength,
 		return r;
 	}
 
+	/* Keyslot area already prefetched */
+	if (!crypt_keyslot_area_read_cached(cd, dst, dstLength, (uint64_t)sector * SECTOR_SIZE)) {
+		r = crypt_storage_decrypt(s, 0, dstLength / SECTOR_SIZE, dst);
+		crypt_storage_destroy(s);
+		return r;
+	}
+
 	r = device_read_lock(cd, device);
 	if (r) {
 		log_err(cd, _("Failed to acquire read lock on device %s."),
@@ -137,7 +144,7 @@ static int luks2_decrypt_from_storage(char *dst, size_t dstLength,
 			r = -EIO;
 		else
 			r = 0;
-		close(devfd);
+		device_close(device, devfd);
 	} else
 		r = -EIO;
 
@@ -205,9 +212,11 @@ static int luks2_keyslot_get_pbkdf_params(json_object *jobj_keyslot,
 	return 0;
 }
 
+/* Uses precomputed derived_key if provided, otherwise runs PBKDF on password */
 static int luks2_keyslot_set_key(struct crypt_device *cd,
 	json_object *jobj_keyslot,
 	const char *password, size_t passwordLen,
+	const struct volume_key *derived,
 	const char *volume_key, size_t volume_key_len)
 {
 	struct volume_key *derived_key;
@@ -255,20 +264,24 @@ static int luks2_keyslot_set_key(struct crypt_device *cd,
 	/*
 	 * Allocate derived key storage.
 	 */
-	derived_key = crypt_alloc_volume_key(keyslot_key_len, NULL);
+	if (derived && derived->keylength != keyslot_key_len)
+		return -EINVAL;
+	derived_key = crypt_alloc_volume_key(keyslot_key_len, derived ? derived->key : NULL);
 	if (!derived_key)
 		return -ENOMEM;
 	/*
 	 * Calculate keyslot content, split and store it to keyslot area.
 	 */
-	r = crypt_pbkdf(pbkdf.type, pbkdf.hash, password, passwordLen,
-			salt, LUKS_SALTSIZE,
-			derived_key->key, derived_key->keylength,
-			pbkdf.iterations, pbkdf.max_memory_kb,
-			pbkdf.parallel_threads);
-	if (r < 0) {
-		crypt_free_volume_key(derived_key);
-		return r;
+	if (!derived) {
+		r = crypt_pbkdf(pbkdf.type, pbkdf.hash, password, passwordLen,
+				salt, LUKS_SALTSIZE,
+				derived_key->key, derived_key->keylength,
+				pbkdf.iterations, pbkdf.max_memory_kb,
+				pbkdf.parallel_threads);
+		if (r < 0) {
+			crypt_free_volume_key(derived_key);
+			return r;
+		}
 	}
 
 	// FIXME: verity key_size to AFEKSize
@@ -296,9 +309,11 @@ static int luks2_keyslot_set_key(struct crypt_device *cd,
 	return 0;
 }
 
+/* Uses precomputed derived_key if provided, otherwise runs PBKDF on password */
 static int luks2_keyslot_get_key(struct crypt_device *cd,
 	json_object *jobj_keyslot,
 	const char *password, size_t passwordLen,
+	const struct volume_key *derived,
 	char *volume_key, size_t volume_key_len)
 {
 	struct volume_key *derived_key;
@@ -353,21 +368,37 @@ static int luks2_keyslot_get_key(struct crypt_device *cd,
 	/*
 	 * Calculate derived key, decrypt keyslot content and merge it.
 	 */
-	r = crypt_pbkdf(pbkdf.type, pbkdf.hash, password, passwordLen,
-			salt, LUKS_SALTSIZE,
-			derived_key->key, derived_key->keylength,
-			pbkdf.iterations, pbkdf.max_memory_kb,
-			pbkdf.parallel_threads);
+	if (derived) {
+		if (derived->keylength != derived_key->keylength)
+			r = -EINVAL;
+		else {
+			memcpy(derived_key->key, derived->key, derived->keylength);
+			r = 0;
+		}
+	} else {
+		crypt_trace(cd, CRYPT_TRACE_PBKDF, 0, 0);
+		r = crypt_pbkdf(pbkdf.type, pbkdf.hash, password, passwordLen,
+				salt, LUKS_SALTSIZE,
+				derived_key->key, derived_key->keylength,
+				pbkdf.iterations, pbkdf.max_memory_kb,
+				pbkdf.parallel_threads);
+		crypt_trace(cd, CRYPT_TRACE_PBKDF, 1, (uint64_t)pbkdf.max_memory_kb * 1024);
+	}
 
 	if (r == 0) {
 		log_dbg("Reading keyslot area [0x%04x].", (unsigned)area_offset);
+		crypt_trace(cd, CRYPT_TRACE_KEYSLOT_DECRYPT, 0, 0);
 		/* FIXME: sector_offset should be size_t, fix LUKS_decrypt... accordingly */
 		r = luks2_decrypt_from_storage(AfKey, AFEKSize, cipher, cipher_mode,
 				      derived_key, (unsigned)(area_offset / SECTOR_SIZE), cd);
+		crypt_trace(cd, CRYPT_TRACE_KEYSLOT_DECRYPT, 1, AFEKSize);
 	}
 
-	if (r == 0)
+	if (r == 0) {
+		crypt_trace(cd, CRYPT_TRACE_AF_MERGE, 0, 0);
 		r = AF_merge(AfKey, volume_key, volume_key_len, LUKS_STRIPES, af_hash);
+		crypt_trace(cd, CRYPT_TRACE_AF_MERGE, 1, AFEKSize);
+	}
 
 	crypt_free_volume_key(derived_key);
 	crypt_safe_free(AfKey);
@@ -540,7 +571,68 @@ static int luks2_keyslot_open(struct crypt_device *cd,
 		return -EINVAL;
 
 	return luks2_keyslot_get_key(cd, jobj_keyslot,
-				     password, password_len,
+				     password, password_len, NULL,
+				     volume_key, volume_key_len);
+}
+
+/* PBKDF parameters of keyslot, derivation is run by caller */
+static int luks2_keyslot_pbkdf(struct crypt_device *cd,
+	int keyslot,
+	struct crypt_pbkdf_job *job,
+	char *salt)
+{
+	struct luks2_hdr *hdr;
+	struct crypt_pbkdf_type pbkdf;
+	json_object *jobj_keyslot, *jobj_area, *jobj;
+
+	if (!(hdr = crypt_get_hdr(cd, CRYPT_LUKS2)))
+		return -EINVAL;
+
+	jobj_keyslot = LUKS2_get_keyslot_jobj(hdr, keyslot);
+	if (!jobj_keyslot)
+		return -EINVAL;
+
+	if (!json_object_object_get_ex(jobj_keyslot, "area", &jobj_area) ||
+	    !json_object_object_get_ex(jobj_area, "key_size", &jobj))
+		return -EINVAL;
+
+	if (luks2_keyslot_get_pbkdf_params(jobj_keyslot, &pbkdf, salt))
+		return -EINVAL;
+
+	job->key = crypt_alloc_volume_key(json_object_get_int(jobj), NULL);
+	if (!job->key)
+		return -ENOMEM;
+
+	job->type = pbkdf.type;
+	job->hash = pbkdf.hash;
+	job->salt = salt;
+	job->salt_length = LUKS_SALTSIZE;
+	job->iterations = pbkdf.iterations;
+	job->max_memory_kb = pbkdf.max_memory_kb;
+	job->parallel_threads = pbkdf.parallel_threads;
+
+	return 0;
+}
+
+static int luks2_keyslot_open_derived(struct crypt_device *cd,
+	int keyslot,
+	const struct volume_key *derived_key,
+	char *volume_key,
+	size_t volume_key_len)
+{
+	struct luks2_hdr *hdr;
+	json_object *jobj_keyslot;
+
+	log_dbg("Trying to open LUKS2 keyslot %d with derived key.", keyslot);
+
+	if (!(hdr = crypt_get_hdr(cd, CRYPT_LUKS2)))
+		return -EINVAL;
+
+	jobj_keyslot = LUKS2_get_keyslot_jobj(hdr, keyslot);
+	if (!jobj_keyslot)
+		return -EINVAL;
+
+	return luks2_keyslot_get_key(cd, jobj_keyslot, NULL, 0, derived_key,
 				     volume_key, volume_key_len);
 }
 
@@ -569,7 +661,7 @@ static int luks2_keyslot_store(struct crypt_device *cd,
 		return -EINVAL;
 
 	r = luks2_keyslot_set_key(cd, jobj_keyslot,
-				  password, password_len,
+				  password, password_len, NULL,
 				  volume_key, volume_key_len);
 	if (r < 0)
 		return r;
@@ -581,6 +673,32 @@ static int luks2_keyslot_store(struct crypt_device *cd,
 	return keyslot;
 }
 
+/*
+ * Stores keyslot area with precomputed derived key.
+ * Header is not written, caller commits it (batch store).
+ */
+static int luks2_keyslot_store_derived(struct crypt_device *cd,
+	int keyslot,
+	const struct volume_key *derived_key,
+	const char *volume_key,
+	size_t volume_key_len)
+{
+	struct luks2_hdr *hdr;
+	json_object *jobj_keyslot;
+
+	log_dbg("Storing LUKS2 keyslot %d with derived key.", keyslot);
+
+	if (!(hdr = crypt_get_hdr(cd, CRYPT_LUKS2)))
+		return -EINVAL;
+
+	jobj_keyslot = LUKS2_get_keyslot_jobj(hdr, keyslot);
+	if (!jobj_keyslot)
+		return -EINVAL;
+
+	return luks2_keyslot_set_key(cd, jobj_keyslot, NULL, 0, derived_key,
+				     volume_key, volume_key_len);
+}
+
 static int luks2_keyslot_wipe(struct crypt_device *cd, int keyslot)
 {
 	struct luks2_hdr *hdr;
@@ -780,5 +898,8 @@ const keyslot_handler luks2_keyslot = {
 	.wipe  = luks2_keyslot_wipe,
 	.dump  = luks2_keyslot_dump,
 	.validate = luks2_keyslot_validate,
-	.repair = luks2_keyslot_repair
+	.repair = luks2_keyslot_repair,
+	.pbkdf = luks2_keyslot_pbkdf,
+	.open_derived = luks2_keyslot_open_derived,
+	.store_derived = luks2_keyslot_store_derived
 };
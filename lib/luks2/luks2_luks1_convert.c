@@ -419,18 +419,36 @@ static void move_keyslot_offset(json_object *jobj, int offset_add)
 	}
 }
 
-/* FIXME: return specific error code for partial write error (aka keyslots are gone) */
+/* Keyslot areas are moved in chunks of this size to keep memory use bounded */
+#define KEYSLOTS_MOVE_CHUNK (1024 * 1024)
+
+/*
+ * FIXME: return specific error code for partial write error (aka keyslots are gone)
+ *
+ * Source and destination areas may overlap, chunks are copied from the end
+ * if the area moves to higher offset, from the start otherwise.
+ */
 static int move_keyslot_areas(struct crypt_device *cd, off_t offset_from,
 			      off_t offset_to, size_t buf_size)
 {
 	struct device *device = crypt_metadata_device(cd);
+	size_t chunk, done, len, bsize, alignment;
+	off_t pos;
+	bool backward = offset_to > offset_from;
 	void *buf = NULL;
 	int r = -EIO, devfd = -1;
 
 	log_dbg("Moving keyslot areas of size %zu from %jd to %jd.",
 		buf_size, (intmax_t)offset_from, (intmax_t)offset_to);
 
-	if (posix_memalign(&buf, crypt_getpagesize(), buf_size))
+	if (!buf_size)
+		return 0;
+
+	bsize = device_block_size(device);
+	alignment = device_alignment(device);
+
+	chunk = buf_size < KEYSLOTS_MOVE_CHUNK ? buf_size : KEYSLOTS_MOVE_CHUNK;
+	if (posix_memalign(&buf, crypt_getpagesize(), chunk))
 		return -ENOMEM;
 
 	devfd = device_open(device, O_RDWR);
@@ -443,26 +461,29 @@ static int move_keyslot_areas(struct crypt_device *cd, off_t offset_from,
 	if (posix_fallocate(devfd, offset_to, buf_size))
 		log_dbg("Preallocation (fallocate) of new keyslot area not available.");
 
-	/* Try to read *new* area to check that area is there (trimmed backup). */
-	if (read_lseek_blockwise(devfd, device_block_size(device),
-				 device_alignment(device), buf, buf_size,
-				 offset_to)!= (ssize_t)buf_size)
+	/* Try to read end of *new* area to check that area is there (trimmed backup). */
+	len = buf_size - (buf_size - 1) / chunk * chunk;
+	if (read_lseek_blockwise(devfd, bsize, alignment, buf, len,
+				 offset_to + buf_size - len) != (ssize_t)len)
 		goto out;
 
-	if (read_lseek_blockwise(devfd, device_block_size(device),
-				 device_alignment(device), buf, buf_size,
-				 offset_from)!= (ssize_t)buf_size)
-		goto out;
+	for (done = 0; done < buf_size; done += len) {
+		len = buf_size - done > chunk ? chunk : buf_size - done;
+		pos = backward ? (off_t)(buf_size - done - len) : (off_t)done;
 
-	if (write_lseek_blockwise(devfd, device_block_size(device),
-				  device_alignment(device), buf, buf_size,
-				  offset_to) != (ssize_t)buf_size)
-		goto out;
+		if (read_lseek_blockwise(devfd, bsize, alignment, buf, len,
+					 offset_from + pos) != (ssize_t)len)
+			goto out;
+
+		if (write_lseek_blockwise(devfd, bsize, alignment, buf, len,
+					  offset_to + pos) != (ssize_t)len)
+			goto out;
+	}
 
 	r = 0;
 out:
-	close(devfd);
-	crypt_memzero(buf, buf_size);
+	device_close(device, devfd);
+	crypt_memzero(buf, chunk);
 	free(buf);
 
 	return r;
@@ -504,7 +525,7 @@ static int luksmeta_header_present(struct crypt_device *cd, off_t luks1_size)
 			r = -EBUSY;
 	}
 
-	close(devfd);
+	device_close(device, devfd);
 	free(buf);
 	return r;
 }
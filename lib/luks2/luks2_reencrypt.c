@@ -0,0 +1,1180 @@
+/*
+ * LUKS - Linux Unified Key Setup v2, online reencryption
+ *
+ * Copyright (C) 2026, cryptsetup contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * During online reencryption the header contains two data segments:
+ *   segment 0 - new volume key, already reencrypted area [0, offset)
+ *   segment 1 - old volume key, the rest of the data area
+ * and the active device is mapped by a dm-crypt table with one target
+ * per segment. Data is processed in hotzones with the active device
+ * suspended; the original ciphertext of the hotzone is stored in journal
+ * area (keyslot of type "reencrypt") before it is overwritten, so an
+ * interrupted hotzone can always be restored from the journal.
+ *
+ * With CRYPT_REENCRYPT_KERNEL_COPY both the journal write and the hotzone
+ * rewrite are done in kernel by dm-kcopyd (temporary dm-mirror devices,
+ * the rewrite goes through temporary dm-crypt devices with old and new key),
+ * data never passes through userspace and the device stays suspended only
+ * for the copy itself. Userspace path is used if dm-mirror is not available.
+ */
+
+#include <sys/stat.h>
+
+#include "luks2_internal.h"
+
+#define REENC_HOTZONE_DEFAULT	(1024 * 1024)		/* 1 MiB */
+#define REENC_HOTZONE_MAX	(64 * 1024 * 1024)	/* 64 MiB */
+
+#define REENC_SEGMENT_NEW	0
+#define REENC_SEGMENT_OLD	1
+
+struct luks2_reenc_context {
+	char *name;		/* active device, NULL for offline run */
+	int keyslot;		/* journal keyslot */
+	uint64_t data_offset;	/* start of data area in bytes */
+	uint64_t device_size;	/* size of data area in bytes */
+	uint64_t offset;	/* already reencrypted bytes */
+	uint64_t hotzone_size;	/* journal area size */
+	uint64_t journal_offset;
+	uint32_t flags;		/* activation flags for table reload */
+	int kernel_copy;	/* use dm-kcopyd instead of userspace buffer */
+	struct volume_key *vks[2];
+	void *buf;
+};
+
+/*
+ * Journal keyslot handler, keyslot contains no key material
+ */
+static int reenc_keyslot_open(struct crypt_device *cd, int keyslot,
+	const char *password, size_t password_len,
+	char *volume_key, size_t volume_key_len)
+{
+	return -ENOENT;
+}
+
+static int reenc_keyslot_wipe(struct crypt_device *cd, int keyslot)
+{
+	return 0;
+}
+
+static int reenc_keyslot_dump(struct crypt_device *cd, int keyslot)
+{
+	json_object *jobj_keyslot, *jobj_area, *jobj1, *jobj2;
+
+	jobj_keyslot = LUKS2_get_keyslot_jobj(crypt_get_hdr(cd, CRYPT_LUKS2), keyslot);
+	if (!jobj_keyslot)
+		return -EINVAL;
+
+	if (!json_object_object_get_ex(jobj_keyslot, "direction", &jobj1) ||
+	    !json_object_object_get_ex(jobj_keyslot, "area", &jobj_area))
+		return -EINVAL;
+
+	log_std(cd, "\tDirection:  %s\n", json_object_get_string(jobj1));
+
+	json_object_object_get_ex(jobj_area, "offset", &jobj1);
+	json_object_object_get_ex(jobj_area, "size", &jobj2);
+	log_std(cd, "\tJournal:    %" PRIu64 " [bytes] at offset %" PRIu64 " [bytes]\n",
+		json_object_get_uint64(jobj2), json_object_get_uint64(jobj1));
+
+	if (json_object_object_get_ex(jobj_keyslot, "hotzone", &jobj_area)) {
+		json_object_object_get_ex(jobj_area, "offset", &jobj1);
+		json_object_object_get_ex(jobj_area, "size", &jobj2);
+		log_std(cd, "\tHotzone:    %" PRIu64 " [bytes] at offset %" PRIu64 " [bytes]\n",
+			json_object_get_uint64(jobj2), json_object_get_uint64(jobj1));
+	}
+
+	return 0;
+}
+
+static int reenc_keyslot_validate(struct crypt_device *cd, json_object *jobj_keyslot)
+{
+	json_object *jobj_area, *jobj_hotzone, *jobj1;
+	uint64_t area_size;
+
+	if (!jobj_keyslot)
+		return -EINVAL;
+
+	if (!(jobj_area = json_contains(jobj_keyslot, "", "reencrypt keyslot", "area", json_type_object)) ||
+	    !(jobj1 = json_contains(jobj_keyslot, "", "reencrypt keyslot", "direction", json_type_string)) ||
+	    !json_contains(jobj_area, "", "reencrypt area", "type", json_type_string) ||
+	    !json_contains(jobj_area, "", "reencrypt area", "offset", json_type_string) ||
+	    !json_contains(jobj_area, "", "reencrypt area", "size", json_type_string))
+		return -EINVAL;
+
+	if (strcmp(json_object_get_string(jobj1), "forward")) {
+		log_dbg("Unsupported reencryption direction %s.", json_object_get_string(jobj1));
+		return -EINVAL;
+	}
+
+	json_object_object_get_ex(jobj_area, "type", &jobj1);
+	if (strcmp(json_object_get_string(jobj1), "journal")) {
+		log_dbg("Unsupported reencryption area type %s.", json_object_get_string(jobj1));
+		return -EINVAL;
+	}
+
+	json_object_object_get_ex(jobj_area, "size", &jobj1);
+	area_size = json_object_get_uint64(jobj1);
+
+	if (!json_object_object_get_ex(jobj_keyslot, "hotzone", &jobj_hotzone))
+		return 0;
+
+	if (!json_contains(jobj_hotzone, "", "reencrypt hotzone", "offset", json_type_string) ||
+	    !(jobj1 = json_contains(jobj_hotzone, "", "reencrypt hotzone", "size", json_type_string)))
+		return -EINVAL;
+
+	if (json_object_get_uint64(jobj1) > area_size) {
+		log_dbg("Reencryption hotzone is larger than journal area.");
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+const keyslot_handler reenc_keyslot = {
+	.name  = "reencrypt",
+	.open  = reenc_keyslot_open,
+	.wipe  = reenc_keyslot_wipe,
+	.dump  = reenc_keyslot_dump,
+	.validate = reenc_keyslot_validate,
+};
+
+/*
+ * Header helpers
+ */
+static int reenc_keyslot_find(struct luks2_hdr *hdr)
+{
+	json_object *jobj_keyslots, *jobj_type;
+
+	if (!json_object_object_get_ex(hdr->jobj, "keyslots", &jobj_keyslots))
+		return -EINVAL;
+
+	json_object_object_foreach(jobj_keyslots, slot, val) {
+		if (json_object_object_get_ex(val, "type", &jobj_type) &&
+		    !strcmp(json_object_get_string(jobj_type), "reencrypt"))
+			return atoi(slot);
+	}
+
+	return -ENOENT;
+}
+
+static json_object *reenc_segment_create(uint64_t offset, uint64_t iv_tweak,
+	const uint64_t *size, const char *cipher)
+{
+	json_object *jobj_segment = json_object_new_object();
+
+	if (!jobj_segment)
+		return NULL;
+
+	json_object_object_add(jobj_segment, "type", json_object_new_string("crypt"));
+	json_object_object_add(jobj_segment, "offset", json_object_new_uint64(offset));
+	json_object_object_add(jobj_segment, "iv_tweak", json_object_new_uint64(iv_tweak));
+	json_object_object_add(jobj_segment, "size", size ? json_object_new_uint64(*size) :
+						      json_object_new_string("dynamic"));
+	json_object_object_add(jobj_segment, "encryption", json_object_new_string(cipher));
+	json_object_object_add(jobj_segment, "sector_size", json_object_new_int(SECTOR_SIZE));
+
+	return jobj_segment;
+}
+
+/* Move border between new and old segment to offset */
+static int reenc_segments_update(struct luks2_hdr *hdr, uint64_t data_offset, uint64_t offset)
+{
+	json_object *jobj_new, *jobj_old;
+
+	if (!(jobj_new = LUKS2_get_segment_jobj(hdr, REENC_SEGMENT_NEW)) ||
+	    !(jobj_old = LUKS2_get_segment_jobj(hdr, REENC_SEGMENT_OLD)))
+		return -EINVAL;
+
+	json_object_object_add(jobj_new, "size", json_object_new_uint64(offset));
+	json_object_object_add(jobj_old, "offset", json_object_new_uint64(data_offset + offset));
+	json_object_object_add(jobj_old, "iv_tweak", json_object_new_uint64(offset / SECTOR_SIZE));
+
+	return 0;
+}
+
+static void reenc_hotzone_set(struct luks2_hdr *hdr, int keyslot, uint64_t offset, uint64_t size)
+{
+	json_object *jobj_keyslot, *jobj_hotzone;
+
+	jobj_keyslot = LUKS2_get_keyslot_jobj(hdr, keyslot);
+
+	if (!size) {
+		json_object_object_del(jobj_keyslot, "hotzone");
+		return;
+	}
+
+	jobj_hotzone = json_object_new_object();
+	json_object_object_add(jobj_hotzone, "offset", json_object_new_uint64(offset));
+	json_object_object_add(jobj_hotzone, "size", json_object_new_uint64(size));
+	json_object_object_add(jobj_keyslot, "hotzone", jobj_hotzone);
+}
+
+static int reenc_hotzone_get(struct luks2_hdr *hdr, int keyslot, uint64_t *offset, uint64_t *size)
+{
+	json_object *jobj_keyslot, *jobj_hotzone, *jobj;
+
+	*offset = *size = 0;
+
+	jobj_keyslot = LUKS2_get_keyslot_jobj(hdr, keyslot);
+	if (!jobj_keyslot || !json_object_object_get_ex(jobj_keyslot, "hotzone", &jobj_hotzone))
+		return 0;
+
+	json_object_object_get_ex(jobj_hotzone, "offset", &jobj);
+	*offset = json_object_get_uint64(jobj);
+	json_object_object_get_ex(jobj_hotzone, "size", &jobj);
+	*size = json_object_get_uint64(jobj);
+
+	return 1;
+}
+
+int LUKS2_reencrypt_in_progress(struct crypt_device *cd, struct luks2_hdr *hdr)
+{
+	uint32_t reqs;
+
+	if (LUKS2_config_get_requirements(cd, hdr, &reqs))
+		return 0;
+
+	return (reqs & CRYPT_REQUIREMENT_ONLINE_REENCRYPT) ? 1 : 0;
+}
+
+static int reenc_data_size(struct crypt_device *cd, uint64_t data_offset, uint64_t *size)
+{
+	int r;
+
+	r = device_size(crypt_data_device(cd), size);
+	if (r < 0) {
+		log_err(cd, _("Cannot get device size."));
+		return r;
+	}
+
+	if (*size <= data_offset) {
+		log_err(cd, _("Device %s is too small."), device_path(crypt_data_device(cd)));
+		return -EINVAL;
+	}
+
+	*size -= data_offset;
+	return 0;
+}
+
+/* Read reencryption state from header in progress */
+static int reenc_load(struct crypt_device *cd, struct luks2_hdr *hdr,
+	struct luks2_reenc_context *rh)
+{
+	json_object *jobj_new, *jobj_old, *jobj;
+	uint64_t length;
+
+	rh->keyslot = reenc_keyslot_find(hdr);
+	if (rh->keyslot < 0 ||
+	    LUKS2_keyslot_area(hdr, rh->keyslot, &rh->journal_offset, &rh->hotzone_size) ||
+	    !rh->hotzone_size || rh->hotzone_size % SECTOR_SIZE) {
+		log_err(cd, _("Missing or invalid reencryption journal in LUKS2 header."));
+		return -EINVAL;
+	}
+
+	if (!(jobj_new = LUKS2_get_segment_jobj(hdr, REENC_SEGMENT_NEW)) ||
+	    !(jobj_old = LUKS2_get_segment_jobj(hdr, REENC_SEGMENT_OLD))) {
+		log_err(cd, _("Invalid reencryption segments in LUKS2 header."));
+		return -EINVAL;
+	}
+
+	json_object_object_get_ex(jobj_new, "offset", &jobj);
+	rh->data_offset = json_object_get_uint64(jobj);
+	json_object_object_get_ex(jobj_new, "size", &jobj);
+	rh->offset = json_object_get_uint64(jobj);
+
+	json_object_object_get_ex(jobj_old, "offset", &jobj);
+	if (json_object_get_uint64(jobj) != rh->data_offset + rh->offset) {
+		log_err(cd, _("Invalid reencryption segments in LUKS2 header."));
+		return -EINVAL;
+	}
+
+	if (reenc_data_size(cd, rh->data_offset, &length))
+		return -EINVAL;
+
+	if (rh->offset > length) {
+		log_err(cd, _("Invalid reencryption segments in LUKS2 header."));
+		return -EINVAL;
+	}
+
+	rh->device_size = length;
+	return 0;
+}
+
+/* Unlock volume keys for both segments, returns keyslot unlocking new segment */
+static int reenc_unlock(struct crypt_device *cd, const char *passphrase,
+	size_t passphrase_size, struct volume_key **vks)
+{
+	int r, keyslot;
+
+	r = LUKS2_keyslot_open(cd, CRYPT_ANY_SLOT, REENC_SEGMENT_NEW,
+			       passphrase, passphrase_size, &vks[REENC_SEGMENT_NEW]);
+	if (r < 0)
+		return r;
+	keyslot = r;
+
+	r = LUKS2_keyslot_open(cd, CRYPT_ANY_SLOT, REENC_SEGMENT_OLD,
+			       passphrase, passphrase_size, &vks[REENC_SEGMENT_OLD]);
+	if (r < 0) {
+		crypt_free_volume_key(vks[REENC_SEGMENT_NEW]);
+		vks[REENC_SEGMENT_NEW] = NULL;
+		return r;
+	}
+
+	return keyslot;
+}
+
+static void reenc_dmd(struct crypt_device *cd, struct luks2_hdr *hdr,
+	struct luks2_reenc_context *rh, struct volume_key **vks,
+	uint32_t flags, struct crypt_dm_active_device *dmd)
+{
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		dmd[i] = (struct crypt_dm_active_device) {
+			.target = DM_CRYPT,
+			.uuid   = crypt_get_uuid(cd),
+			.flags  = flags & ~CRYPT_ACTIVATE_KEYRING_KEY,
+			.data_device = crypt_data_device(cd),
+			.u.crypt = {
+				.vk     = vks[i],
+				.cipher = LUKS2_get_cipher(hdr, i),
+				.sector_size = SECTOR_SIZE
+			}
+		};
+	}
+
+	dmd[REENC_SEGMENT_NEW].size = rh->offset / SECTOR_SIZE;
+	dmd[REENC_SEGMENT_NEW].u.crypt.offset = rh->data_offset / SECTOR_SIZE;
+
+	dmd[REENC_SEGMENT_OLD].size = (rh->device_size - rh->offset) / SECTOR_SIZE;
+	dmd[REENC_SEGMENT_OLD].u.crypt.offset = (rh->data_offset + rh->offset) / SECTOR_SIZE;
+	dmd[REENC_SEGMENT_OLD].u.crypt.iv_offset = rh->offset / SECTOR_SIZE;
+}
+
+/* Write back original ciphertext of interrupted hotzone */
+static int reenc_hotzone_restore(struct crypt_device *cd, struct luks2_hdr *hdr,
+	struct luks2_reenc_context *rh, void *buf)
+{
+	struct device *data_device = crypt_data_device(cd),
+		      *md_device = crypt_metadata_device(cd);
+	uint64_t offset, size;
+	int devfd, mdfd, r = -EIO;
+
+	if (!reenc_hotzone_get(hdr, rh->keyslot, &offset, &size))
+		return 0;
+
+	log_dbg("Restoring reencryption hotzone %" PRIu64 " -> %" PRIu64 " from journal.",
+		offset, offset + size);
+
+	if (offset != rh->offset || size > rh->hotzone_size || size % SECTOR_SIZE) {
+		log_err(cd, _("Invalid reencryption hotzone in LUKS2 header."));
+		return -EINVAL;
+	}
+
+	mdfd = device_open(md_device, O_RDONLY);
+	if (mdfd < 0)
+		return -EIO;
+
+	if (read_lseek_blockwise(mdfd, device_block_size(md_device), device_alignment(md_device),
+				 buf, size, rh->journal_offset) != (ssize_t)size) {
+		log_err(cd, _("Cannot read reencryption journal."));
+		device_close(md_device, mdfd);
+		return -EIO;
+	}
+	device_close(md_device, mdfd);
+
+	devfd = device_open(data_device, O_RDWR);
+	if (devfd < 0)
+		return -EIO;
+
+	if (write_lseek_blockwise(devfd, device_block_size(data_device), device_alignment(data_device),
+				  buf, size, rh->data_offset + offset) != (ssize_t)size ||
+	    fsync(devfd)) {
+		log_err(cd, _("Cannot restore reencryption hotzone on device %s."),
+			device_path(data_device));
+		goto out;
+	}
+
+	reenc_hotzone_set(hdr, rh->keyslot, 0, 0);
+	r = LUKS2_hdr_write(cd, hdr);
+out:
+	device_close(data_device, devfd);
+	return r;
+}
+
+static int reenc_hotzone_recover(struct crypt_device *cd, struct luks2_hdr *hdr,
+	struct luks2_reenc_context *rh)
+{
+	void *buf;
+	int r;
+
+	if (posix_memalign(&buf, crypt_getpagesize(), rh->hotzone_size))
+		return -ENOMEM;
+
+	r = reenc_hotzone_restore(cd, hdr, rh, buf);
+
+	crypt_memzero(buf, rh->hotzone_size);
+	free(buf);
+	return r;
+}
+
+static int reenc_storage_init(struct crypt_device *cd, struct luks2_hdr *hdr,
+	struct volume_key **vks, struct crypt_storage **s)
+{
+	char cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN];
+	int i, r;
+
+	for (i = 0; i < 2; i++) {
+		r = crypt_parse_name_and_mode(LUKS2_get_cipher(hdr, i), cipher, NULL, cipher_mode);
+		if (!r)
+			r = crypt_storage_init(&s[i], 0, cipher, cipher_mode,
+					       vks[i]->key, vks[i]->keylength);
+		if (r) {
+			log_err(cd, _("Cipher %s is not available for userspace reencryption."),
+				LUKS2_get_cipher(hdr, i));
+			return r;
+		}
+	}
+
+	return 0;
+}
+
+static void reenc_kernel_copy_disable(struct crypt_device *cd, struct luks2_reenc_context *rh)
+{
+	log_verbose(cd, _("Kernel copy is not available, reencrypting data in userspace."));
+	rh->kernel_copy = 0;
+}
+
+/* Store original ciphertext of hotzone into journal, sets *buffered if data are in rh->buf */
+static int reenc_journal_write(struct crypt_device *cd, struct luks2_reenc_context *rh,
+	int devfd, int mdfd, uint64_t len, int *buffered)
+{
+	struct device *data_device = crypt_data_device(cd),
+		      *md_device = crypt_metadata_device(cd);
+	char name[PATH_MAX];
+	int r;
+
+	*buffered = 0;
+
+	if (rh->kernel_copy) {
+		if (snprintf(name, sizeof(name), "temporary-cryptsetup-reenc-journal-%s",
+			     crypt_get_uuid(cd)) < 0)
+			return -ENOMEM;
+		r = dm_copy_sectors(cd, name, data_device, (rh->data_offset + rh->offset) / SECTOR_SIZE,
+				    md_device, rh->journal_offset / SECTOR_SIZE, len / SECTOR_SIZE);
+		if (r == -ENOTSUP)
+			reenc_kernel_copy_disable(cd, rh);
+		else if (r)
+			goto out;
+	}
+
+	if (!rh->kernel_copy) {
+		if (read_lseek_blockwise(devfd, device_block_size(data_device), device_alignment(data_device),
+					 rh->buf, len, rh->data_offset + rh->offset) != (ssize_t)len)
+			return -EIO;
+		*buffered = 1;
+
+		r = write_lseek_blockwise(mdfd, device_block_size(md_device), device_alignment(md_device),
+					  rh->buf, len, rh->journal_offset) == (ssize_t)len ? 0 : -EIO;
+		if (r)
+			goto out;
+	}
+
+	r = fsync(mdfd) ? -EIO : 0;
+out:
+	if (r)
+		log_err(cd, _("Cannot write reencryption journal."));
+	return r;
+}
+
+/*
+ * Temporary dm-crypt devices map the hotzone with old and new volume key
+ * (the same IV sectors), dm-mirror then copies one to the other.
+ * Returns -ENOTSUP if nothing was written.
+ */
+static int reenc_hotzone_kcopy(struct crypt_device *cd, struct luks2_hdr *hdr,
+	struct luks2_reenc_context *rh, uint64_t len)
+{
+	static const char * const leg_names[2] = { "new", "old" };
+	struct crypt_dm_active_device dmd[2];
+	struct device *legs[2] = {};
+	char names[2][PATH_MAX], name[PATH_MAX], path[PATH_MAX];
+	int i, created = 0, r;
+
+	if (!device_block_path(crypt_data_device(cd)))
+		return -ENOTSUP;
+
+	reenc_dmd(cd, hdr, rh, rh->vks, CRYPT_ACTIVATE_PRIVATE, dmd);
+
+	for (i = 0; i < 2; i++) {
+		dmd[i].size = len / SECTOR_SIZE;
+		dmd[i].u.crypt.offset = (rh->data_offset + rh->offset) / SECTOR_SIZE;
+		dmd[i].u.crypt.iv_offset = rh->offset / SECTOR_SIZE;
+
+		if (snprintf(names[i], sizeof(names[i]), "temporary-cryptsetup-reenc-%s-%s",
+			     leg_names[i], crypt_get_uuid(cd)) < 0 ||
+		    snprintf(path, sizeof(path), "%s/%s", dm_get_dir(), names[i]) < 0) {
+			r = -ENOMEM;
+			goto out;
+		}
+
+		r = dm_create_device(cd, names[i], "TEMP", &dmd[i], 0);
+		if (r < 0) {
+			r = -ENOTSUP;
+			goto out;
+		}
+		created++;
+
+		r = device_alloc(&legs[i], path);
+		if (r < 0)
+			goto out;
+	}
+
+	if (snprintf(name, sizeof(name), "temporary-cryptsetup-reenc-copy-%s", crypt_get_uuid(cd)) < 0) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = dm_copy_sectors(cd, name, legs[REENC_SEGMENT_OLD], 0,
+			    legs[REENC_SEGMENT_NEW], 0, len / SECTOR_SIZE);
+out:
+	for (i = 0; i < 2; i++)
+		device_free(legs[i]);
+	for (i = 0; i < created; i++)
+		dm_remove_device(cd, names[i], 0);
+	return r;
+}
+
+/* Rewrite hotzone with new volume key, either in kernel or through rh->buf */
+static int reenc_data_write(struct crypt_device *cd, struct luks2_hdr *hdr,
+	struct luks2_reenc_context *rh, struct crypt_storage **s,
+	int devfd, uint64_t len, int buffered)
+{
+	struct device *data_device = crypt_data_device(cd);
+	uint64_t sector = rh->offset / SECTOR_SIZE;
+	int r;
+
+	if (rh->kernel_copy) {
+		r = reenc_hotzone_kcopy(cd, hdr, rh, len);
+		if (r == -ENOTSUP)
+			reenc_kernel_copy_disable(cd, rh);
+		else if (r) {
+			log_err(cd, _("Cannot reencrypt data in kernel."));
+			return r;
+		}
+	}
+
+	if (!rh->kernel_copy) {
+		if ((!s[REENC_SEGMENT_NEW] || !s[REENC_SEGMENT_OLD]) &&
+		    (r = reenc_storage_init(cd, hdr, rh->vks, s)))
+			return r;
+
+		if (!buffered &&
+		    read_lseek_blockwise(devfd, device_block_size(data_device), device_alignment(data_device),
+					 rh->buf, len, rh->data_offset + rh->offset) != (ssize_t)len)
+			return -EIO;
+
+		r = crypt_storage_decrypt(s[REENC_SEGMENT_OLD], sector, len / SECTOR_SIZE, rh->buf);
+		if (!r)
+			r = crypt_storage_encrypt(s[REENC_SEGMENT_NEW], sector, len / SECTOR_SIZE, rh->buf);
+		if (r) {
+			log_err(cd, _("Cannot reencrypt data in userspace."));
+			return r;
+		}
+
+		if (write_lseek_blockwise(devfd, device_block_size(data_device), device_alignment(data_device),
+					  rh->buf, len, rh->data_offset + rh->offset) != (ssize_t)len) {
+			log_err(cd, _("Cannot write to device %s."), device_path(data_device));
+			return -EIO;
+		}
+	}
+
+	if (fsync(devfd)) {
+		log_err(cd, _("Cannot write to device %s."), device_path(data_device));
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/*
+ * One hotzone step, the (optional) active device is suspended for the whole step.
+ */
+static int reenc_hotzone(struct crypt_device *cd, struct luks2_hdr *hdr,
+	struct luks2_reenc_context *rh, struct crypt_storage **s)
+{
+	struct device *data_device = crypt_data_device(cd),
+		      *md_device = crypt_metadata_device(cd);
+	struct crypt_dm_active_device dmd[2];
+	uint64_t len;
+	int devfd = -1, mdfd = -1, dirty = 0, buffered, r;
+
+	len = rh->device_size - rh->offset;
+	if (len > rh->hotzone_size)
+		len = rh->hotzone_size;
+
+	log_dbg("Reencrypting hotzone %" PRIu64 " -> %" PRIu64 ".", rh->offset, rh->offset + len);
+
+	if (rh->name && (r = dm_suspend_device(cd, rh->name))) {
+		log_err(cd, _("Cannot suspend device %s."), rh->name);
+		return r;
+	}
+
+	r = -EIO;
+	devfd = device_open(data_device, O_RDWR);
+	mdfd = device_open(md_device, O_RDWR);
+	if (devfd < 0 || mdfd < 0)
+		goto out;
+
+	/* journal must be stable before the hotzone is marked in header */
+	r = reenc_journal_write(cd, rh, devfd, mdfd, len, &buffered);
+	if (r)
+		goto out;
+
+	reenc_hotzone_set(hdr, rh->keyslot, rh->offset, len);
+	r = LUKS2_hdr_write(cd, hdr);
+	if (r) {
+		reenc_hotzone_set(hdr, rh->keyslot, 0, 0);
+		goto out;
+	}
+	dirty = 1;
+
+	r = reenc_data_write(cd, hdr, rh, s, devfd, len, buffered);
+	if (r)
+		goto out;
+
+	/* hotzone belongs to new segment from now on */
+	r = reenc_segments_update(hdr, rh->data_offset, rh->offset + len);
+	if (r)
+		goto out;
+	reenc_hotzone_set(hdr, rh->keyslot, 0, 0);
+	r = LUKS2_hdr_write(cd, hdr);
+	if (r) {
+		reenc_segments_update(hdr, rh->data_offset, rh->offset);
+		reenc_hotzone_set(hdr, rh->keyslot, rh->offset, len);
+		goto out;
+	}
+	dirty = 0;
+	rh->offset += len;
+
+	if (rh->name) {
+		reenc_dmd(cd, hdr, rh, rh->vks, rh->flags, dmd);
+		r = dm_create_device_segments(cd, rh->name, CRYPT_LUKS2, dmd, 2, 1);
+		if (!r) {
+			device_close(data_device, devfd);
+			device_close(md_device, mdfd);
+			return 0;
+		}
+
+		/*
+		 * Old table is still live, move the hotzone back to old segment
+		 * and restore its ciphertext from journal before resume.
+		 */
+		log_dbg("Reload of device %s failed, reverting hotzone.", rh->name);
+		rh->offset -= len;
+		reenc_segments_update(hdr, rh->data_offset, rh->offset);
+		reenc_hotzone_set(hdr, rh->keyslot, rh->offset, len);
+		if (LUKS2_hdr_write(cd, hdr)) {
+			log_err(cd, _("Cannot reload device %s, it remains suspended."), rh->name);
+			device_close(data_device, devfd);
+			device_close(md_device, mdfd);
+			return r;
+		}
+		dirty = 1;
+	}
+out:
+	if (r == -EIO)
+		crypt_progress_io_error(cd, 0);
+	if (devfd >= 0)
+		device_close(data_device, devfd);
+	if (mdfd >= 0)
+		device_close(md_device, mdfd);
+
+	/* never expose partially rewritten hotzone through old mapping */
+	if (dirty && reenc_hotzone_restore(cd, hdr, rh, rh->buf) && rh->name) {
+		log_err(cd, _("Cannot restore reencryption hotzone, device %s remains suspended."), rh->name);
+		return r;
+	}
+
+	if (rh->name && dm_resume_device(cd, rh->name))
+		log_err(cd, _("Cannot resume device %s."), rh->name);
+
+	return r;
+}
+
+/* Drop old segment, its keyslots and the journal */
+static int reenc_finish(struct crypt_device *cd, struct luks2_hdr *hdr,
+	struct luks2_reenc_context *rh)
+{
+	json_object *jobj_segments, *jobj_keyslots, *jobj_new;
+	uint32_t reqs;
+	char num[16];
+	int i, digest, r;
+
+	log_dbg("Finishing online reencryption.");
+
+	digest = LUKS2_digest_by_segment(cd, hdr, REENC_SEGMENT_OLD);
+	if (digest < 0)
+		return -EINVAL;
+
+	if (!json_object_object_get_ex(hdr->jobj, "segments", &jobj_segments) ||
+	    !json_object_object_get_ex(hdr->jobj, "keyslots", &jobj_keyslots) ||
+	    !(jobj_new = LUKS2_get_segment_jobj(hdr, REENC_SEGMENT_NEW)))
+		return -EINVAL;
+
+	r = LUKS2_digest_segment_assign(cd, hdr, REENC_SEGMENT_OLD, digest, 0, 0);
+	if (r < 0)
+		return r;
+
+	snprintf(num, sizeof(num), "%d", REENC_SEGMENT_OLD);
+	json_object_object_del(jobj_segments, num);
+	json_object_object_add(jobj_new, "size", json_object_new_string("dynamic"));
+
+	snprintf(num, sizeof(num), "%d", rh->keyslot);
+	json_object_object_del(jobj_keyslots, num);
+
+	r = LUKS2_config_get_requirements(cd, hdr, &reqs);
+	if (!r)
+		r = LUKS2_config_set_requirements(cd, hdr, reqs & ~CRYPT_REQUIREMENT_ONLINE_REENCRYPT);
+	if (r)
+		return r;
+
+	/* journal contains the last hotzone encrypted by old key */
+	if (crypt_wipe_device(cd, crypt_metadata_device(cd), CRYPT_WIPE_SPECIAL,
+			      rh->journal_offset, rh->hotzone_size, rh->hotzone_size, NULL, NULL))
+		log_err(cd, _("Cannot wipe reencryption journal."));
+
+	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++) {
+		if (LUKS2_digest_by_keyslot(cd, hdr, i) != digest)
+			continue;
+		r = LUKS2_keyslot_wipe(cd, hdr, i, 0);
+		if (r < 0)
+			return r;
+	}
+
+	LUKS2_digests_erase_unused(cd, hdr);
+
+	return LUKS2_hdr_write(cd, hdr);
+}
+
+static int reenc_cipher_check(struct crypt_device *cd, struct luks2_hdr *hdr, int segment)
+{
+	json_object *jobj_segment, *jobj;
+
+	jobj_segment = LUKS2_get_segment_jobj(hdr, segment);
+	if (!jobj_segment)
+		return -EINVAL;
+
+	if (json_object_object_get_ex(jobj_segment, "integrity", &jobj) ||
+	    !json_object_object_get_ex(jobj_segment, "sector_size", &jobj) ||
+	    json_object_get_int(jobj) != SECTOR_SIZE) {
+		log_err(cd, _("Online reencryption supports only 512-byte sectors without integrity."));
+		return -ENOTSUP;
+	}
+
+	return 0;
+}
+
+static void reenc_context_free(struct luks2_reenc_context *rh)
+{
+	if (!rh)
+		return;
+
+	crypt_free_volume_key(rh->vks[REENC_SEGMENT_NEW]);
+	crypt_free_volume_key(rh->vks[REENC_SEGMENT_OLD]);
+	if (rh->buf) {
+		crypt_memzero(rh->buf, rh->hotzone_size);
+		free(rh->buf);
+	}
+	free(rh->name);
+	free(rh);
+}
+
+void LUKS2_reencrypt_free(struct luks2_reenc_context *rh)
+{
+	reenc_context_free(rh);
+}
+
+/* Create new volume key, its keyslot, the journal and the two segments */
+static int reenc_create(struct crypt_device *cd, struct luks2_hdr *hdr,
+	const char *passphrase, size_t passphrase_size,
+	int keyslot_old, int keyslot_new,
+	const char *cipher, const char *cipher_mode,
+	const struct crypt_params_reencrypt *params,
+	struct volume_key **vks)
+{
+	struct luks2_keyslot_params kparams;
+	json_object *jobj_segments, *jobj_keyslots, *jobj_keyslot, *jobj_area, *jobj;
+	uint64_t data_offset, device_size, hotzone_size, journal_offset, new_size = 0;
+	char old_cipher[128], new_cipher[128], num[16];
+	size_t key_size;
+	int digest_old, digest_new, keyslot, r;
+	uint32_t reqs;
+
+	if (!json_object_object_get_ex(hdr->jobj, "segments", &jobj_segments) ||
+	    !json_object_object_get_ex(hdr->jobj, "keyslots", &jobj_keyslots) ||
+	    json_object_object_length(jobj_segments) != 1 ||
+	    !LUKS2_get_segment_jobj(hdr, CRYPT_DEFAULT_SEGMENT)) {
+		log_err(cd, _("Reencryption of device with more data segments is not supported."));
+		return -ENOTSUP;
+	}
+
+	r = reenc_cipher_check(cd, hdr, CRYPT_DEFAULT_SEGMENT);
+	if (r)
+		return r;
+
+	hotzone_size = (params && params->hotzone_size) ? params->hotzone_size : REENC_HOTZONE_DEFAULT;
+	if (hotzone_size > REENC_HOTZONE_MAX || hotzone_size % 4096) {
+		log_err(cd, _("Reencryption hotzone size must be 4096 bytes aligned and not larger than %u bytes."),
+			REENC_HOTZONE_MAX);
+		return -EINVAL;
+	}
+
+	json_object_object_get_ex(LUKS2_get_segment_jobj(hdr, CRYPT_DEFAULT_SEGMENT), "offset", &jobj);
+	data_offset = json_object_get_uint64(jobj);
+	r = reenc_data_size(cd, data_offset, &device_size);
+	if (r)
+		return r;
+
+	/* segment "0" object is replaced below, keep copy of its cipher */
+	r = snprintf(old_cipher, sizeof(old_cipher), "%s", LUKS2_get_cipher(hdr, CRYPT_DEFAULT_SEGMENT));
+	if (r < 0 || (size_t)r >= sizeof(old_cipher))
+		return -EINVAL;
+
+	if (!cipher)
+		r = snprintf(new_cipher, sizeof(new_cipher), "%s", old_cipher);
+	else if (cipher_mode && *cipher_mode)
+		r = snprintf(new_cipher, sizeof(new_cipher), "%s-%s", cipher, cipher_mode);
+	else
+		r = snprintf(new_cipher, sizeof(new_cipher), "%s", cipher);
+	if (r < 0 || (size_t)r >= sizeof(new_cipher))
+		return -EINVAL;
+
+	r = LUKS2_keyslot_open(cd, keyslot_old, CRYPT_DEFAULT_SEGMENT,
+			       passphrase, passphrase_size, &vks[REENC_SEGMENT_OLD]);
+	if (r < 0)
+		return r;
+
+	digest_old = LUKS2_digest_by_segment(cd, hdr, CRYPT_DEFAULT_SEGMENT);
+	if (digest_old < 0)
+		return -EINVAL;
+
+	key_size = (params && params->volume_key_size) ? params->volume_key_size :
+		   vks[REENC_SEGMENT_OLD]->keylength;
+	vks[REENC_SEGMENT_NEW] = crypt_generate_volume_key(cd, key_size);
+	if (!vks[REENC_SEGMENT_NEW])
+		return -ENOMEM;
+
+	/* new keyslot protected by the same passphrase, unbound until segments are switched */
+	keyslot = keyslot_new == CRYPT_ANY_SLOT ? LUKS2_keyslot_find_empty(hdr, "luks2") : keyslot_new;
+	if (keyslot < 0 || keyslot >= LUKS2_KEYSLOTS_MAX || LUKS2_get_keyslot_jobj(hdr, keyslot)) {
+		log_err(cd, _("Key slot %d is invalid or in use."), keyslot);
+		return -EINVAL;
+	}
+
+	digest_new = LUKS2_digest_create(cd, "pbkdf2", hdr, vks[REENC_SEGMENT_NEW]);
+	if (digest_new < 0)
+		return digest_new;
+
+	/* keyslot area uses old segment cipher, keep its key size */
+	r = LUKS2_keyslot_params_default(cd, hdr, vks[REENC_SEGMENT_OLD]->keylength, &kparams);
+	if (r >= 0)
+		r = LUKS2_digest_assign(cd, hdr, keyslot, digest_new, 1, 0);
+	if (r >= 0)
+		r = LUKS2_keyslot_store(cd, hdr, keyslot, passphrase, passphrase_size,
+					vks[REENC_SEGMENT_NEW], &kparams);
+	if (r < 0)
+		return r;
+
+	/* journal keyslot */
+	r = LUKS2_find_area(cd, hdr, hotzone_size, &journal_offset);
+	if (r)
+		return r;
+
+	if (journal_offset + hotzone_size > 2 * hdr->hdr_size + LUKS2_keyslots_size(hdr->jobj)) {
+		log_err(cd, _("Not enough space in keyslots area for reencryption journal."));
+		return -ENOSPC;
+	}
+
+	r = LUKS2_keyslot_find_empty(hdr, "reencrypt");
+	if (r < 0)
+		return -ENOSPC;
+	snprintf(num, sizeof(num), "%d", r);
+
+	jobj_keyslot = json_object_new_object();
+	json_object_object_add(jobj_keyslot, "type", json_object_new_string("reencrypt"));
+	json_object_object_add(jobj_keyslot, "key_size", json_object_new_int(1));
+	json_object_object_add(jobj_keyslot, "priority", json_object_new_int(CRYPT_SLOT_PRIORITY_IGNORE));
+	json_object_object_add(jobj_keyslot, "direction", json_object_new_string("forward"));
+	jobj_area = json_object_new_object();
+	json_object_object_add(jobj_area, "type", json_object_new_string("journal"));
+	json_object_object_add(jobj_area, "offset", json_object_new_uint64(journal_offset));
+	json_object_object_add(jobj_area, "size", json_object_new_uint64(hotzone_size));
+	json_object_object_add(jobj_keyslot, "area", jobj_area);
+	json_object_object_add(jobj_keyslots, num, jobj_keyslot);
+
+	/* segment 0 (new) is empty, segment 1 (old) covers whole data area */
+	json_object_object_add(jobj_segments, "0", reenc_segment_create(data_offset, 0, &new_size, new_cipher));
+	json_object_object_add(jobj_segments, "1", reenc_segment_create(data_offset, 0, NULL, old_cipher));
+
+	r = LUKS2_digest_segment_assign(cd, hdr, REENC_SEGMENT_NEW, digest_old, 0, 0);
+	if (r >= 0)
+		r = LUKS2_digest_segment_assign(cd, hdr, REENC_SEGMENT_OLD, digest_old, 1, 0);
+	if (r >= 0)
+		r = LUKS2_digest_segment_assign(cd, hdr, REENC_SEGMENT_NEW, digest_new, 1, 0);
+	if (r < 0)
+		return r;
+
+	/* single header write switches to reencryption state */
+	r = LUKS2_config_get_requirements(cd, hdr, &reqs);
+	if (!r)
+		r = LUKS2_config_set_requirements(cd, hdr, reqs | CRYPT_REQUIREMENT_ONLINE_REENCRYPT);
+
+	return r < 0 ? r : keyslot;
+}
+
+int LUKS2_reencrypt_init(struct crypt_device *cd, struct luks2_hdr *hdr,
+	const char *name, const char *passphrase, size_t passphrase_size,
+	int keyslot_old, int keyslot_new,
+	const char *cipher, const char *cipher_mode,
+	const struct crypt_params_reencrypt *params,
+	uint32_t flags,
+	struct luks2_reenc_context **rh_out)
+{
+	struct luks2_reenc_context *rh;
+	int r, keyslot;
+
+	rh = calloc(1, sizeof(*rh));
+	if (!rh)
+		return -ENOMEM;
+
+	if (name && !(rh->name = strdup(name))) {
+		r = -ENOMEM;
+		goto err;
+	}
+
+	rh->flags = flags;
+	rh->kernel_copy = (params && (params->flags & CRYPT_REENCRYPT_KERNEL_COPY)) ? 1 : 0;
+
+	if (!LUKS2_reencrypt_in_progress(cd, hdr)) {
+		r = LUKS2_unmet_requirements(cd, hdr, 0, 0);
+		if (r)
+			goto err;
+		r = reenc_create(cd, hdr, passphrase, passphrase_size, keyslot_old, keyslot_new,
+				 cipher, cipher_mode, params, rh->vks);
+		if (r < 0)
+			goto err;
+		keyslot = r;
+		r = reenc_load(cd, hdr, rh);
+	} else {
+		/* resume, cipher and params are stored in header already */
+		r = LUKS2_unmet_requirements(cd, hdr, CRYPT_REQUIREMENT_ONLINE_REENCRYPT, 0);
+		if (!r)
+			r = reenc_load(cd, hdr, rh);
+		if (!r && (r = reenc_unlock(cd, passphrase, passphrase_size, rh->vks)) >= 0) {
+			keyslot = r;
+			r = 0;
+		}
+	}
+	if (r < 0)
+		goto err;
+
+	if (posix_memalign(&rh->buf, crypt_getpagesize(), rh->hotzone_size)) {
+		rh->buf = NULL;
+		r = -ENOMEM;
+		goto err;
+	}
+
+	reenc_context_free(*rh_out);
+	*rh_out = rh;
+	return keyslot;
+err:
+	reenc_context_free(rh);
+	return r;
+}
+
+int LUKS2_reencrypt_run(struct crypt_device *cd, struct luks2_hdr *hdr,
+	struct luks2_reenc_context *rh,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+	void *usrptr)
+{
+	struct crypt_storage *s[2] = {};
+	struct crypt_dm_active_device dmd[2];
+	uint64_t offset, size;
+	int r;
+
+	if (!rh || !LUKS2_reencrypt_in_progress(cd, hdr))
+		return -EINVAL;
+
+	/* interrupted hotzone of active device, device stays suspended until reload */
+	if (reenc_hotzone_get(hdr, rh->keyslot, &offset, &size)) {
+		if (rh->name && (r = dm_suspend_device(cd, rh->name)))
+			return r;
+		r = reenc_hotzone_restore(cd, hdr, rh, rh->buf);
+		if (rh->name && !r)
+			r = dm_resume_device(cd, rh->name);
+		if (r)
+			return r;
+	}
+
+	/* with kernel copy userspace ciphers are set up only for fallback */
+	if (!rh->kernel_copy && (r = reenc_storage_init(cd, hdr, rh->vks, s)))
+		goto out;
+
+	if (progress && progress(rh->device_size, rh->offset, usrptr)) {
+		r = -EINTR;
+		goto out;
+	}
+
+	while (rh->offset < rh->device_size) {
+		r = reenc_hotzone(cd, hdr, rh, s);
+		if (r)
+			goto out;
+
+		if (progress && progress(rh->device_size, rh->offset, usrptr)) {
+			r = -EINTR;
+			goto out;
+		}
+	}
+
+	/*
+	 * Restart after the last hotzone skips the loop, the device can still
+	 * be suspended with the old table, map it by current segments first.
+	 */
+	if (rh->name) {
+		reenc_dmd(cd, hdr, rh, rh->vks, rh->flags, dmd);
+		r = dm_create_device_segments(cd, rh->name, CRYPT_LUKS2, dmd, 2, 1);
+		if (r) {
+			log_err(cd, _("Cannot reload device %s."), rh->name);
+			goto out;
+		}
+	}
+
+	r = reenc_finish(cd, hdr, rh);
+out:
+	crypt_storage_destroy(s[REENC_SEGMENT_NEW]);
+	crypt_storage_destroy(s[REENC_SEGMENT_OLD]);
+	return r;
+}
+
+/* Activate device with both segments, passphrase must unlock old and new volume key */
+int LUKS2_reencrypt_activate(struct crypt_device *cd, struct luks2_hdr *hdr,
+	const char *name, const char *passphrase, size_t passphrase_size,
+	uint32_t flags)
+{
+	struct luks2_reenc_context rh = {};
+	struct crypt_dm_active_device dmd[2];
+	uint32_t pflags = 0;
+	uint64_t size;
+	int r, keyslot;
+
+	r = LUKS2_unmet_requirements(cd, hdr, CRYPT_REQUIREMENT_ONLINE_REENCRYPT, 0);
+	if (r)
+		return r;
+
+	r = reenc_load(cd, hdr, &rh);
+	if (r)
+		return r;
+
+	keyslot = reenc_unlock(cd, passphrase, passphrase_size, rh.vks);
+	if (keyslot < 0 || !name) {
+		r = keyslot;
+		goto out;
+	}
+
+	if (flags & CRYPT_ACTIVATE_KEYRING_KEY)
+		log_dbg("Kernel keyring is not used during online reencryption.");
+
+	if (!(flags & CRYPT_ACTIVATE_IGNORE_PERSISTENT))
+		LUKS2_config_get_flags(cd, hdr, &pflags);
+	flags |= pflags;
+
+	size = 0;
+	r = device_block_adjust(cd, crypt_data_device(cd),
+				(flags & CRYPT_ACTIVATE_SHARED) ? DEV_SHARED : DEV_EXCL,
+				rh.data_offset / SECTOR_SIZE, &size, &flags);
+	if (r)
+		goto out;
+
+	/* device can be shorter than data area, do not map beyond */
+	if (size * SECTOR_SIZE < rh.device_size)
+		rh.device_size = size * SECTOR_SIZE;
+	if (rh.offset > rh.device_size) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	r = reenc_hotzone_recover(cd, hdr, &rh);
+	if (r)
+		goto out;
+
+	reenc_dmd(cd, hdr, &rh, rh.vks, flags, dmd);
+	r = dm_create_device_segments(cd, name, CRYPT_LUKS2, dmd, 2, 0);
+out:
+	crypt_free_volume_key(rh.vks[REENC_SEGMENT_NEW]);
+	crypt_free_volume_key(rh.vks[REENC_SEGMENT_OLD]);
+	return r < 0 ? r : keyslot;
+}
+
+/* Reload suspended device by current segments, passphrase must unlock old and new volume key */
+int LUKS2_reencrypt_reload(struct crypt_device *cd, struct luks2_hdr *hdr,
+	const char *name, const char *passphrase, size_t passphrase_size)
+{
+	struct luks2_reenc_context rh = {};
+	struct crypt_dm_active_device dmd[2], dmd_active = {};
+	int r, keyslot;
+
+	r = LUKS2_unmet_requirements(cd, hdr, CRYPT_REQUIREMENT_ONLINE_REENCRYPT, 0);
+	if (r)
+		return r;
+
+	r = reenc_load(cd, hdr, &rh);
+	if (r)
+		return r;
+
+	keyslot = reenc_unlock(cd, passphrase, passphrase_size, rh.vks);
+	if (keyslot < 0) {
+		r = keyslot;
+		goto out;
+	}
+
+	r = dm_query_device(cd, name, 0, &dmd_active);
+	if (r < 0)
+		goto out;
+
+	/* keep size and flags of active mapping */
+	if (dmd_active.size * SECTOR_SIZE < rh.device_size)
+		rh.device_size = dmd_active.size * SECTOR_SIZE;
+	if (rh.offset > rh.device_size) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	r = reenc_hotzone_recover(cd, hdr, &rh);
+	if (r)
+		goto out;
+
+	reenc_dmd(cd, hdr, &rh, rh.vks, dmd_active.flags, dmd);
+	r = dm_create_device_segments(cd, name, CRYPT_LUKS2, dmd, 2, 1);
+out:
+	crypt_free_volume_key(rh.vks[REENC_SEGMENT_NEW]);
+	crypt_free_volume_key(rh.vks[REENC_SEGMENT_OLD]);
+	return r < 0 ? r : keyslot;
+}
@@ -20,6 +20,7 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
 
 #include "luks2_internal.h"
 
@@ -35,15 +36,42 @@ static token_handler token_handlers[LUKS2_TOKENS_MAX] = {
 	},
 };
 
+/* Timeout (in seconds) of cached token passphrases, 0 means disabled */
+static unsigned token_cache_timeout = 0;
+
+#define TOKEN_CACHE_PREFIX "cryptsetup:token:"
+#define TOKEN_CACHE_HASH "sha256"
+#define TOKEN_CACHE_HASH_LEN 32
+#define TOKEN_CACHE_DESC_LEN (sizeof(TOKEN_CACHE_PREFIX) + 2 * TOKEN_CACHE_HASH_LEN)
+
 static int is_builtin_candidate(const char *type)
 {
 	return !strncmp(type, LUKS2_BUILTIN_TOKEN_PREFIX, LUKS2_BUILTIN_TOKEN_PREFIX_LEN);
 }
 
+int crypt_token_cache_timeout(struct crypt_device *cd, unsigned timeout)
+{
+	if (timeout && !keyring_check()) {
+		log_dbg("Kernel keyring is not supported, token cache disabled.");
+		return -ENOTSUP;
+	}
+
+	token_cache_timeout = timeout;
+	return 0;
+}
+
 int crypt_token_register(const crypt_token_handler *handler)
+{
+	return crypt_token_register_flags(handler, 0);
+}
+
+int crypt_token_register_flags(const crypt_token_handler *handler, uint32_t flags)
 {
 	int i;
 
+	if (flags & ~CRYPT_TOKEN_HANDLER_CONCURRENT)
+		return -EINVAL;
+
 	if (is_builtin_candidate(handler->name)) {
 		log_dbg("'" LUKS2_BUILTIN_TOKEN_PREFIX "' is reserved prefix for builtin tokens.");
 		return -EINVAL;
@@ -62,6 +90,7 @@ int crypt_token_register(const crypt_token_handler *handler)
 	}
 
 	token_handlers[i].h = handler;
+	token_handlers[i].flags = flags;
 	return 0;
 }
 
@@ -381,29 +410,112 @@ static int LUKS2_keyslot_open_by_token(struct crypt_device *cd,
 	return r;
 }
 
-int LUKS2_token_open_and_activate(struct crypt_device *cd,
-		struct luks2_hdr *hdr,
-		int token,
-		const char *name,
-		uint32_t flags,
-		void *usrptr)
+/*
+ * Cached passphrases are stored in user keyring under description
+ * derived from hash of token JSON, so the same token (on another device)
+ * resolves to the same entry.
+ */
+static int LUKS2_token_cache_desc(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int token,
+	char *desc)
 {
-	int keyslot, r;
-	char *buffer;
+	struct crypt_hash *hd = NULL;
+	const crypt_token_handler *h;
+	const char *json;
+	char hash[TOKEN_CACHE_HASH_LEN];
+	int i, r;
+
+	if (!token_cache_timeout)
+		return -ENOENT;
+
+	/* builtin tokens are already cheap to open */
+	h = LUKS2_token_handler(cd, token);
+	if (!h || is_builtin_candidate(h->name))
+		return -ENOENT;
+
+	if (LUKS2_token_json_get(cd, hdr, token, &json))
+		return -EINVAL;
+
+	if (crypt_hash_init(&hd, TOKEN_CACHE_HASH))
+		return -EINVAL;
+
+	r = crypt_hash_write(hd, json, strlen(json));
+	if (!r)
+		r = crypt_hash_final(hd, hash, sizeof(hash));
+	crypt_hash_destroy(hd);
+	if (r)
+		return -EINVAL;
+
+	strcpy(desc, TOKEN_CACHE_PREFIX);
+	for (i = 0; i < TOKEN_CACHE_HASH_LEN; i++)
+		sprintf(desc + strlen(TOKEN_CACHE_PREFIX) + 2 * i, "%02hhx", hash[i]);
+	crypt_memzero(hash, sizeof(hash));
+
+	return 0;
+}
+
+/*
+ * Open token and keyslot referenced in token. Passphrase is taken from
+ * token cache if enabled, stale cache entry is dropped and token handler
+ * is used instead.
+ */
+static int LUKS2_token_open_keyslot(struct crypt_device *cd,
+	struct luks2_hdr *hdr,
+	int token,
+	int segment,
+	void *usrptr,
+	struct volume_key **vk)
+{
+	char desc[TOKEN_CACHE_DESC_LEN], *buffer;
 	size_t buffer_len;
-	struct volume_key *vk = NULL;
+	int cache, r;
+
+	cache = !LUKS2_token_cache_desc(cd, hdr, token, desc);
+
+	if (cache && !keyring_get_user_key(desc, &buffer, &buffer_len)) {
+		log_dbg("Using cached passphrase for token %d.", token);
+		r = LUKS2_keyslot_open_by_token(cd, hdr, token, segment,
+						buffer, buffer_len, vk);
+		crypt_memzero(buffer, buffer_len);
+		free(buffer);
+		if (r >= 0)
+			return r;
+
+		log_dbg("Cached passphrase for token %d failed, dropping it.", token);
+		keyring_unlink_user_key(desc);
+	}
 
 	r = LUKS2_token_open(cd, hdr, token, &buffer, &buffer_len, usrptr);
 	if (r < 0)
 		return r;
 
-	r = LUKS2_keyslot_open_by_token(cd, hdr, token,
-					(flags & CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY) ?
-					CRYPT_ANY_SEGMENT : CRYPT_DEFAULT_SEGMENT,
-					buffer, buffer_len, &vk);
+	r = LUKS2_keyslot_open_by_token(cd, hdr, token, segment,
+					buffer, buffer_len, vk);
+
+	if (r >= 0 && cache &&
+	    keyring_add_user_key_timeout(desc, buffer, buffer_len, token_cache_timeout))
+		log_dbg("Failed to cache passphrase for token %d.", token);
 
 	LUKS2_token_buffer_free(cd, token, buffer, buffer_len);
 
+	return r;
+}
+
+int LUKS2_token_open_and_activate(struct crypt_device *cd,
+		struct luks2_hdr *hdr,
+		int token,
+		const char *name,
+		uint32_t flags,
+		void *usrptr)
+{
+	int keyslot, r;
+	struct volume_key *vk = NULL;
+
+	r = LUKS2_token_open_keyslot(cd, hdr, token,
+				     (flags & CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY) ?
+				     CRYPT_ANY_SEGMENT : CRYPT_DEFAULT_SEGMENT,
+				     usrptr, &vk);
 	if (r < 0)
 		return r;
 
@@ -422,34 +534,180 @@ int LUKS2_token_open_and_activate(struct crypt_device *cd,
 	return r < 0 ? r : keyslot;
 }
 
+struct token_job {
+	int token;
+	int r;
+	int done;
+	int consumed;
+	int started;
+	char *buffer;
+	size_t buffer_len;
+	pthread_t thread;
+	struct token_jobs *jobs;
+};
+
+struct token_jobs {
+	struct crypt_device *cd;
+	struct luks2_hdr *hdr;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct token_job job[LUKS2_TOKENS_MAX];
+	int count;
+};
+
+static void *token_open_thread(void *arg)
+{
+	struct token_job *job = arg;
+	struct token_jobs *jobs = job->jobs;
+	int r;
+
+	r = LUKS2_token_open(jobs->cd, jobs->hdr, job->token,
+			     &job->buffer, &job->buffer_len, NULL);
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	pthread_mutex_lock(&jobs->lock);
+	job->r = r;
+	job->done = 1;
+	pthread_cond_signal(&jobs->cond);
+	pthread_mutex_unlock(&jobs->lock);
+
+	return NULL;
+}
+
+static int token_is_concurrent(struct crypt_device *cd, struct luks2_hdr *hdr, int token)
+{
+	const token_handler *th = LUKS2_token_handler_internal(cd, token);
+	char desc[TOKEN_CACHE_DESC_LEN], *buffer;
+	size_t buffer_len;
+
+	if (!th || !(th->flags & CRYPT_TOKEN_HANDLER_CONCURRENT))
+		return 0;
+
+	/* cached passphrase is used in sequential path, it is fast anyway */
+	if (!LUKS2_token_cache_desc(cd, hdr, token, desc) &&
+	    !keyring_get_user_key(desc, &buffer, &buffer_len)) {
+		crypt_memzero(buffer, buffer_len);
+		free(buffer);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Run open of all tokens in jobs in parallel, try keyslots (in this thread)
+ * in order of token open completion and cancel the rest on first success.
+ */
+static int LUKS2_token_open_keyslot_concurrent(struct token_jobs *jobs,
+	int segment,
+	struct volume_key **vk)
+{
+	struct crypt_device *cd = jobs->cd;
+	struct token_job *job;
+	char desc[TOKEN_CACHE_DESC_LEN];
+	int i, remaining, r = -ENOENT;
+
+	pthread_mutex_init(&jobs->lock, NULL);
+	pthread_cond_init(&jobs->cond, NULL);
+
+	for (i = 0; i < jobs->count; i++) {
+		jobs->job[i].jobs = jobs;
+		jobs->job[i].r = -ENOENT;
+		log_dbg("Starting concurrent open of token %d.", jobs->job[i].token);
+		if (pthread_create(&jobs->job[i].thread, NULL, token_open_thread, &jobs->job[i])) {
+			jobs->job[i].r = -ENOMEM;
+			jobs->job[i].done = 1;
+		} else
+			jobs->job[i].started = 1;
+	}
+
+	pthread_mutex_lock(&jobs->lock);
+	for (remaining = jobs->count; remaining > 0 && r < 0;) {
+		for (job = NULL, i = 0; i < jobs->count && !job; i++)
+			if (jobs->job[i].done && !jobs->job[i].consumed)
+				job = &jobs->job[i];
+
+		if (!job) {
+			pthread_cond_wait(&jobs->cond, &jobs->lock);
+			continue;
+		}
+
+		job->consumed = 1;
+		remaining--;
+		if (job->r < 0)
+			continue;
+
+		pthread_mutex_unlock(&jobs->lock);
+		r = LUKS2_keyslot_open_by_token(cd, jobs->hdr, job->token, segment,
+						job->buffer, job->buffer_len, vk);
+		if (r >= 0 && !LUKS2_token_cache_desc(cd, jobs->hdr, job->token, desc) &&
+		    keyring_add_user_key_timeout(desc, job->buffer, job->buffer_len, token_cache_timeout))
+			log_dbg("Failed to cache passphrase for token %d.", job->token);
+		pthread_mutex_lock(&jobs->lock);
+	}
+
+	/* do not wait for slower tokens */
+	for (i = 0; i < jobs->count; i++)
+		if (jobs->job[i].started && !jobs->job[i].done) {
+			log_dbg("Cancelling open of token %d.", jobs->job[i].token);
+			pthread_cancel(jobs->job[i].thread);
+		}
+	pthread_mutex_unlock(&jobs->lock);
+
+	for (i = 0; i < jobs->count; i++) {
+		job = &jobs->job[i];
+		if (job->started)
+			pthread_join(job->thread, NULL);
+		if (job->done && job->r >= 0)
+			LUKS2_token_buffer_free(cd, job->token, job->buffer, job->buffer_len);
+	}
+
+	pthread_cond_destroy(&jobs->cond);
+	pthread_mutex_destroy(&jobs->lock);
+
+	return r;
+}
+
 int LUKS2_token_open_and_activate_any(struct crypt_device *cd,
 	struct luks2_hdr *hdr,
 	const char *name,
 	uint32_t flags)
 {
-	char *buffer;
 	json_object *tokens_jobj;
-	size_t buffer_len;
-	int keyslot, token, r = -EINVAL;
+	int i, keyslot, token, segment, r = -EINVAL;
 	struct volume_key *vk = NULL;
+	struct token_jobs jobs = { .cd = cd, .hdr = hdr };
+
+	segment = (flags & CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY) ?
+		  CRYPT_ANY_SEGMENT : CRYPT_DEFAULT_SEGMENT;
 
 	json_object_object_get_ex(hdr->jobj, "tokens", &tokens_jobj);
 
+	/* tokens with blocking handlers first, all at once */
 	json_object_object_foreach(tokens_jobj, slot, val) {
 		UNUSED(val);
 		token = atoi(slot);
+		if (jobs.count < LUKS2_TOKENS_MAX && token_is_concurrent(cd, hdr, token))
+			jobs.job[jobs.count++].token = token;
+	}
 
-		r = LUKS2_token_open(cd, hdr, token, &buffer, &buffer_len, NULL);
-		if (r < 0)
-			continue;
+	if (jobs.count > 1)
+		r = LUKS2_token_open_keyslot_concurrent(&jobs, segment, &vk);
+	else
+		jobs.count = 0;
 
-		r = LUKS2_keyslot_open_by_token(cd, hdr, token,
-						(flags & CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY) ?
-						CRYPT_ANY_SEGMENT : CRYPT_DEFAULT_SEGMENT,
-						buffer, buffer_len, &vk);
-		LUKS2_token_buffer_free(cd, token, buffer, buffer_len);
+	json_object_object_foreach(tokens_jobj, slot2, val2) {
+		UNUSED(val2);
 		if (r >= 0)
 			break;
+		token = atoi(slot2);
+
+		/* already tried concurrently */
+		for (i = 0; i < jobs.count && jobs.job[i].token != token; i++);
+		if (i < jobs.count)
+			continue;
+
+		r = LUKS2_token_open_keyslot(cd, hdr, token, segment, NULL, &vk);
 	}
 
 	keyslot = r;
@@ -23,7 +23,12 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
 #include <sys/select.h>
+#ifdef HAVE_SYS_RANDOM_H
+#include <sys/random.h>
+#endif
 
 #include "libcryptsetup.h"
 #include "internal.h"
@@ -32,6 +37,7 @@
 #define O_CLOEXEC 0
 #endif
 
+static pthread_mutex_t random_init_lock = PTHREAD_MUTEX_INITIALIZER;
 static int random_initialised = 0;
 
 #define URANDOM_DEVICE	"/dev/urandom"
@@ -46,6 +52,9 @@ static int random_fd = -1;
 /* Timeout to print warning if no random data (entropy) */
 #define RANDOM_DEVICE_TIMEOUT	5
 
+/* getrandom(2) is used instead of URANDOM_DEVICE if kernel supports it */
+static int use_getrandom = 0;
+
 /* URANDOM_DEVICE access */
 static int _get_urandom(struct crypt_device *ctx __attribute__((unused)),
 			char *buf, size_t len)
@@ -54,10 +63,15 @@ static int _get_urandom(struct crypt_device *ctx __attribute__((unused)),
 	size_t old_len = len;
 	char *old_buf = buf;
 
-	assert(urandom_fd != -1);
+	assert(use_getrandom || urandom_fd != -1);
 
 	while(len) {
-		r = read(urandom_fd, buf, len);
+#ifdef HAVE_GETRANDOM
+		if (use_getrandom)
+			r = getrandom(buf, len, 0);
+		else
+#endif
+			r = read(urandom_fd, buf, len);
 		if (r == -1 && errno != EINTR)
 			return -EINVAL;
 		if (r > 0) {
@@ -72,6 +86,113 @@ static int _get_urandom(struct crypt_device *ctx __attribute__((unused)),
 	return 0;
 }
 
+/*
+ * Userspace ChaCha20 generator for CRYPT_RND_NORMAL requests (wipe patterns,
+ * AF stripes), seeded from the kernel RNG. After every request the key is
+ * replaced by generator output (fast key erasure); it is reseeded from
+ * the kernel after RANDOM_DRBG_RESEED bytes and after fork().
+ */
+#define RANDOM_DRBG_RESEED	(16 * 1024 * 1024)
+
+static struct {
+	uint32_t key[8];
+	uint64_t counter;
+	size_t generated;
+	pid_t pid;
+	int seeded;
+} drbg;
+
+/*
+ * Generator state is shared by all threads (e.g. parallel wipe workers),
+ * every access to it must hold the lock, output must never repeat.
+ */
+static pthread_mutex_t drbg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define CHACHA_QR(a, b, c, d) \
+	a += b; d ^= a; d = ROTL32(d, 16); \
+	c += d; b ^= c; b = ROTL32(b, 12); \
+	a += b; d ^= a; d = ROTL32(d, 8);  \
+	c += d; b ^= c; b = ROTL32(b, 7)
+
+static void chacha20_block(const uint32_t key[8], uint64_t counter, uint32_t out[16])
+{
+	uint32_t x[16];
+	int i;
+
+	out[0] = 0x61707865; out[1] = 0x3320646e;
+	out[2] = 0x79622d32; out[3] = 0x6b206574;
+	memcpy(&out[4], key, 8 * sizeof(uint32_t));
+	out[12] = (uint32_t)counter;
+	out[13] = (uint32_t)(counter >> 32);
+	out[14] = out[15] = 0;
+
+	memcpy(x, out, sizeof(x));
+	for (i = 0; i < 10; i++) {
+		CHACHA_QR(x[0], x[4], x[8],  x[12]);
+		CHACHA_QR(x[1], x[5], x[9],  x[13]);
+		CHACHA_QR(x[2], x[6], x[10], x[14]);
+		CHACHA_QR(x[3], x[7], x[11], x[15]);
+		CHACHA_QR(x[0], x[5], x[10], x[15]);
+		CHACHA_QR(x[1], x[6], x[11], x[12]);
+		CHACHA_QR(x[2], x[7], x[8],  x[13]);
+		CHACHA_QR(x[3], x[4], x[9],  x[14]);
+	}
+	for (i = 0; i < 16; i++)
+		out[i] += x[i];
+
+	crypt_memzero(x, sizeof(x));
+}
+
+static int _drbg_reseed(struct crypt_device *ctx)
+{
+	int r;
+
+	r = _get_urandom(ctx, (char *)drbg.key, sizeof(drbg.key));
+	if (r)
+		return r;
+
+	drbg.counter = 0;
+	drbg.generated = 0;
+	drbg.pid = getpid();
+	drbg.seeded = 1;
+
+	return 0;
+}
+
+static int _get_drbg(struct crypt_device *ctx, char *buf, size_t len)
+{
+	uint32_t block[16];
+	size_t n;
+	int r;
+
+	pthread_mutex_lock(&drbg_lock);
+	if (!drbg.seeded || drbg.pid != getpid() || drbg.generated >= RANDOM_DRBG_RESEED) {
+		r = _drbg_reseed(ctx);
+		if (r) {
+			pthread_mutex_unlock(&drbg_lock);
+			return r;
+		}
+	}
+
+	while (len) {
+		chacha20_block(drbg.key, drbg.counter++, block);
+		n = len < sizeof(block) ? len : sizeof(block);
+		memcpy(buf, block, n);
+		buf += n;
+		len -= n;
+		drbg.generated += n;
+	}
+
+	/* fast key erasure, previous output cannot be reconstructed */
+	chacha20_block(drbg.key, drbg.counter++, block);
+	memcpy(drbg.key, block, sizeof(drbg.key));
+	pthread_mutex_unlock(&drbg_lock);
+	crypt_memzero(block, sizeof(block));
+
+	return 0;
+}
+
 static void _get_random_progress(struct crypt_device *ctx, int warn,
 				 size_t expected_len, size_t read_len)
 {
@@ -94,7 +215,11 @@ static int _get_random(struct crypt_device *ctx, char *buf, size_t len)
 	fd_set fds;
 	struct timeval tv;
 
-	assert(random_fd != -1);
+	/* RANDOM_DEVICE is opened only if really needed */
+	if (random_fd == -1)
+		random_fd = open(RANDOM_DEVICE, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (random_fd == -1)
+		return -EINVAL;
 
 	while (len) {
 		FD_ZERO(&fds);
@@ -148,31 +273,51 @@ static int _get_random(struct crypt_device *ctx, char *buf, size_t len)
 
 	return 0;
 }
-/* Initialisation of both RNG file descriptors is mandatory */
+/*
+ * Initialisation of kernel RNG access is mandatory. With getrandom(2)
+ * no device needs to be opened; RANDOM_DEVICE is opened on first use.
+ * If not called explicitly, it is done on the first crypt_random_get().
+ */
 int crypt_random_init(struct crypt_device *ctx)
 {
-	if (random_initialised)
+	char tmp;
+
+	pthread_mutex_lock(&random_init_lock);
+	if (random_initialised) {
+		pthread_mutex_unlock(&random_init_lock);
 		return 0;
+	}
+
+#ifdef HAVE_GETRANDOM
+	/* Probe only, the call must not block here */
+	if (getrandom(&tmp, 1, GRND_NONBLOCK) == 1 || errno == EAGAIN)
+		use_getrandom = 1;
+#else
+	(void)tmp;
+#endif
 
 	/* Used for CRYPT_RND_NORMAL */
-	if(urandom_fd == -1)
+	if(!use_getrandom && urandom_fd == -1)
 		urandom_fd = open(URANDOM_DEVICE, O_RDONLY | O_CLOEXEC);
-	if(urandom_fd == -1)
+	if(!use_getrandom && urandom_fd == -1)
 		goto fail;
 
 	/* Used for CRYPT_RND_KEY */
-	if(random_fd == -1)
+	if (crypt_random_default_key_rng() == CRYPT_RNG_RANDOM && random_fd == -1) {
 		random_fd = open(RANDOM_DEVICE, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
-	if(random_fd == -1)
-		goto fail;
+		if (random_fd == -1 && !use_getrandom)
+			goto fail;
+	}
 
 	if (crypt_fips_mode())
 		log_verbose(ctx, _("Running in FIPS mode."));
 
 	random_initialised = 1;
+	pthread_mutex_unlock(&random_init_lock);
 	return 0;
 fail:
 	crypt_random_exit();
+	pthread_mutex_unlock(&random_init_lock);
 	log_err(ctx, _("Fatal error during RNG initialisation."));
 	return -ENOSYS;
 }
@@ -181,9 +326,15 @@ int crypt_random_get(struct crypt_device *ctx, char *buf, size_t len, int qualit
 {
 	int status, rng_type;
 
+	if (!random_initialised && (status = crypt_random_init(ctx)))
+		return status;
+
 	switch(quality) {
 	case CRYPT_RND_NORMAL:
-		status = _get_urandom(ctx, buf, len);
+		if (crypt_fips_mode())
+			status = _get_urandom(ctx, buf, len);
+		else
+			status = _get_drbg(ctx, buf, len);
 		break;
 	case CRYPT_RND_SALT:
 		if (crypt_fips_mode())
@@ -223,6 +374,11 @@ int crypt_random_get(struct crypt_device *ctx, char *buf, size_t len, int qualit
 void crypt_random_exit(void)
 {
 	random_initialised = 0;
+	use_getrandom = 0;
+
+	pthread_mutex_lock(&drbg_lock);
+	crypt_memzero(&drbg, sizeof(drbg));
+	pthread_mutex_unlock(&drbg_lock);
 
 	if(random_fd != -1) {
 		(void)close(random_fd);
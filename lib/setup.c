@@ -28,6 +28,8 @@
 #include <sys/utsname.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "libcryptsetup.h"
 #include "luks.h"
@@ -53,6 +55,34 @@ struct crypt_device {
 
 	/* global context scope settings */
 	unsigned key_in_keyring:1;
+	char *keyring_key_desc;		/* volume key uploaded to thread keyring */
+	pthread_t keyring_key_thread;
+	unsigned unlock_serial:1;	/* keyslots are tried one by one (batch unlock) */
+	struct crypt_pbkdf_shared *pbkdf_shared; /* derivations shared in crypt_activate_set */
+	unsigned metadata_cache:1;	/* reuse unchanged LUKS2 metadata in crypt_load */
+	struct crypt_metadata_limits metadata_limits;
+	unsigned hdr_transaction:1;	/* LUKS2 header writes are deferred to commit */
+	unsigned hdr_transaction_dirty:1;
+	unsigned hdr_transaction_failed:1;
+
+	/* keyslot areas prefetched for one unlock attempt */
+	struct {
+		char *buf;
+		uint64_t offset;
+		size_t length;
+	} keyslots_cache;
+
+	/* volume keys already verified against LUKS2 digests */
+	struct crypt_digest_cache *digest_cache;
+
+	/* userspace dm-verity hash options, not stored in header */
+	unsigned verity_threads;
+	uint32_t verity_sample_percent;
+	int verity_data_fd;
+
+	/* dm-integrity bitmap mode options, not stored in superblock */
+	uint32_t integrity_bitmap_sectors_per_bit;
+	uint32_t integrity_bitmap_flush_time;
 
 	// FIXME: private binary headers and access it properly
 	// through sub-library (LUKS1, TCRYPT)
@@ -65,6 +95,7 @@ struct crypt_device {
 		struct luks2_hdr hdr;
 		char *cipher;		/* only for compatibility, segment 0 */
 		char *cipher_mode;	/* only for compatibility, segment 0 */
+		struct luks2_reenc_context *rh; /* pending online reencryption */
 	} luks2;
 	struct { /* used in CRYPT_PLAIN */
 		struct crypt_params_plain hdr;
@@ -109,19 +140,35 @@ struct crypt_device {
 	void *log_usrptr;
 	int (*confirm)(const char *msg, void *usrptr);
 	void *confirm_usrptr;
+	void (*trace)(crypt_trace_phase phase, int end, uint64_t usec, uint64_t bytes, void *usrptr);
+	void *trace_usrptr;
+	void (*progress)(const struct crypt_progress *p, void *usrptr);
+	void *progress_usrptr;
+
+	/* telemetry of running long operation */
+	struct crypt_progress progress_state;
+	uint64_t progress_start, progress_last;	/* usec, 0 before the first report */
+	uint64_t progress_last_offset;
 };
 
 /* Just to suppress redundant messages about crypto backend */
+/* Crypto backend and RNG are initialised once per process */
+static pthread_mutex_t _crypto_init_lock = PTHREAD_MUTEX_INITIALIZER;
 static int _crypto_logged = 0;
 
 /* Log helper */
 static void (*_default_log)(int level, const char *msg, void *usrptr) = NULL;
 static int _debug_level = 0;
 
+/* Trace helper */
+static void (*_default_trace)(crypt_trace_phase phase, int end, uint64_t usec, uint64_t bytes, void *usrptr) = NULL;
+static void *_default_trace_usrptr = NULL;
+
 /* Library can do metadata locking  */
 static int _metadata_locking = 1;
 
 /* Library scope detection for kernel keyring support */
+static pthread_once_t _kernel_keyring_once = PTHREAD_ONCE_INIT;
 static int _kernel_keyring_supported;
 
 /* Library allowed to use kernel keyring for loading VK in kernel crypto layer */
@@ -193,13 +240,19 @@ struct device *crypt_data_device(struct crypt_device *cd)
 	return cd->device;
 }
 
+/*
+ * Explicit initialisation of crypto backend and RNG. Metadata load does not
+ * need it, backend and RNG initialise themselves on the first use.
+ */
 int init_crypto(struct crypt_device *ctx)
 {
 	struct utsname uts;
 	int r;
 
+	pthread_mutex_lock(&_crypto_init_lock);
 	r = crypt_random_init(ctx);
 	if (r < 0) {
+		pthread_mutex_unlock(&_crypto_init_lock);
 		log_err(ctx, _("Cannot initialize crypto RNG backend."));
 		return r;
 	}
@@ -216,6 +269,7 @@ int init_crypto(struct crypt_device *ctx)
 				uts.sysname, uts.release, uts.machine);
 		_crypto_logged = 1;
 	}
+	pthread_mutex_unlock(&_crypto_init_lock);
 
 	return r;
 }
@@ -545,6 +599,146 @@ void crypt_set_confirm_callback(struct crypt_device *cd,
 	}
 }
 
+void crypt_set_trace_callback(struct crypt_device *cd,
+	void (*trace)(crypt_trace_phase phase, int end, uint64_t usec, uint64_t bytes, void *usrptr),
+	void *usrptr)
+{
+	if (!cd) {
+		_default_trace = trace;
+		_default_trace_usrptr = usrptr;
+	} else {
+		cd->trace = trace;
+		cd->trace_usrptr = usrptr;
+	}
+}
+
+void crypt_set_progress_callback(struct crypt_device *cd,
+	void (*progress)(const struct crypt_progress *p, void *usrptr),
+	void *usrptr)
+{
+	if (cd) {
+		cd->progress = progress;
+		cd->progress_usrptr = usrptr;
+	}
+}
+
+const char *crypt_trace_phase_name(crypt_trace_phase phase)
+{
+	static const char *names[CRYPT_TRACE_PHASES] = {
+		[CRYPT_TRACE_HDR_READ]		= "header read",
+		[CRYPT_TRACE_HDR_VALIDATE]	= "header validation",
+		[CRYPT_TRACE_PBKDF]		= "PBKDF",
+		[CRYPT_TRACE_KEYSLOT_DECRYPT]	= "keyslot decrypt",
+		[CRYPT_TRACE_AF_MERGE]		= "AF merge",
+		[CRYPT_TRACE_DIGEST_VERIFY]	= "digest verify",
+		[CRYPT_TRACE_KEYRING]		= "keyring upload",
+		[CRYPT_TRACE_DM_CREATE]		= "device-mapper create",
+		[CRYPT_TRACE_LOCK_WAIT]		= "metadata lock wait",
+	};
+
+	if ((unsigned)phase >= CRYPT_TRACE_PHASES)
+		return NULL;
+
+	return names[phase];
+}
+
+/* internal only */
+void crypt_trace(struct crypt_device *cd, crypt_trace_phase phase, int end, uint64_t bytes)
+{
+	void (*trace)(crypt_trace_phase phase, int end, uint64_t usec, uint64_t bytes, void *usrptr);
+	void *usrptr;
+	struct timespec ts;
+
+	if (cd && cd->trace) {
+		trace = cd->trace;
+		usrptr = cd->trace_usrptr;
+	} else if (_default_trace) {
+		trace = _default_trace;
+		usrptr = _default_trace_usrptr;
+	} else
+		return;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return;
+
+	trace(phase, end, (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000, bytes, usrptr);
+}
+
+/* Smoothing factor of averaged throughput (weight of the last interval) */
+#define PROGRESS_RATE_WEIGHT 0.2
+
+/* internal only */
+void crypt_progress_start(struct crypt_device *cd, const char *operation)
+{
+	if (!cd)
+		return;
+
+	memset(&cd->progress_state, 0, sizeof(cd->progress_state));
+	cd->progress_state.operation = operation;
+	cd->progress_start = cd->progress_last = cd->progress_last_offset = 0;
+}
+
+/* internal only */
+void crypt_progress_update(struct crypt_device *cd, uint64_t size, uint64_t offset)
+{
+	struct crypt_progress *p;
+	struct timespec ts;
+	uint64_t now, bytes, remaining;
+
+	if (!cd || !cd->progress || clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return;
+
+	p = &cd->progress_state;
+	now = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	if (!cd->progress_start) {
+		cd->progress_start = cd->progress_last = now;
+		cd->progress_last_offset = offset;
+	}
+
+	/* offset can also decrease (backward direction) */
+	bytes = offset > cd->progress_last_offset ? offset - cd->progress_last_offset :
+						    cd->progress_last_offset - offset;
+	if (now > cd->progress_last && bytes) {
+		p->rate = bytes * 1000000 / (now - cd->progress_last);
+		p->rate_avg = p->rate_avg ?
+			(uint64_t)(p->rate_avg + PROGRESS_RATE_WEIGHT * ((double)p->rate - p->rate_avg)) :
+			p->rate;
+		cd->progress_last = now;
+		cd->progress_last_offset = offset;
+	}
+
+	p->size = size;
+	p->offset = offset;
+	p->elapsed_usec = now - cd->progress_start;
+
+	remaining = size > offset ? size - offset : 0;
+	p->eta_usec = p->rate_avg ? (uint64_t)((double)remaining / p->rate_avg * 1000000) : 0;
+
+	cd->progress(p, cd->progress_usrptr);
+}
+
+/* internal only */
+void crypt_progress_io_error(struct crypt_device *cd, int retried)
+{
+	if (!cd)
+		return;
+
+	if (retried)
+		cd->progress_state.io_retries++;
+	else
+		cd->progress_state.io_errors++;
+}
+
+/* internal only, progress callback adapter with telemetry update */
+int crypt_progress_wrapped(uint64_t size, uint64_t offset, void *usrptr)
+{
+	struct crypt_progress_wrap *pw = usrptr;
+
+	crypt_progress_update(pw->cd, size, offset);
+
+	return pw->progress ? pw->progress(size, offset, pw->usrptr) : 0;
+}
+
 const char *crypt_get_dir(void)
 {
 	return dm_get_dir();
@@ -572,6 +766,7 @@ int crypt_init(struct crypt_device **cd, const char *device)
 	dm_backend_init();
 
 	h->rng_type = crypt_random_default_key_rng();
+	h->verity_data_fd = -1;
 
 	*cd = h;
 	return 0;
@@ -653,6 +848,10 @@ static int _crypt_load_luks2(struct crypt_device *cd, int reload)
 
 	log_dbg("%soading LUKS2 header.", reload ? "Rel" : "L");
 
+	/* pending changes of header transaction are lost */
+	if (reload && cd->hdr_transaction)
+		cd->hdr_transaction_failed = 1;
+
 	r = LUKS2_hdr_read(cd, &hdr2);
 	if (r)
 		return r;
@@ -686,8 +885,10 @@ static int _crypt_load_luks2(struct crypt_device *cd, int reload)
 		LUKS2_hdr_free(&cd->u.luks2.hdr);
 		free(cd->u.luks2.cipher);
 		free(cd->u.luks2.cipher_mode);
-	} else
+	} else {
 		cd->type = type;
+		cd->u.luks2.rh = NULL;
+	}
 
 	r = 0;
 	memcpy(&cd->u.luks2.hdr, &hdr2, sizeof(hdr2));
@@ -722,10 +923,6 @@ static int _crypt_load_luks(struct crypt_device *cd, const char *requested_type,
 	struct luks_phdr hdr = {};
 	int r, version = 0;
 
-	r = init_crypto(cd);
-	if (r < 0)
-		return r;
-
 	/* This will return 0 if primary LUKS2 header is damaged */
 	if (!requested_type)
 		version = LUKS2_hdr_version_unlocked(cd, NULL);
@@ -768,6 +965,12 @@ static int _crypt_load_luks(struct crypt_device *cd, const char *requested_type,
 			return -EINVAL;
 		}
 
+		if (cd->type && cd->metadata_cache &&
+		    LUKS2_hdr_read_cached(cd, &cd->u.luks2.hdr)) {
+			log_dbg("Reusing already loaded LUKS2 header.");
+			return 0;
+		}
+
 		r =  _crypt_load_luks2(cd, cd->type != NULL);
 	} else
 		r = -EINVAL;
@@ -812,10 +1015,6 @@ static int _crypt_load_verity(struct crypt_device *cd, struct crypt_params_verit
 	int r;
 	size_t sb_offset = 0;
 
-	r = init_crypto(cd);
-	if (r < 0)
-		return r;
-
 	if (params && params->flags & CRYPT_VERITY_NO_HEADER)
 		return -EINVAL;
 
@@ -835,8 +1034,9 @@ static int _crypt_load_verity(struct crypt_device *cd, struct crypt_params_verit
 		return -ENOMEM;
 	}
 
-	if (params)
+	if (params) {
 		cd->u.verity.hdr.flags = params->flags;
+	}
 
 	/* Hash availability checked in sb load */
 	cd->u.verity.root_hash_size = crypt_hash_size(cd->u.verity.hdr.hash_name);
@@ -863,10 +1063,6 @@ static int _crypt_load_integrity(struct crypt_device *cd,
 {
 	int r;
 
-	r = init_crypto(cd);
-	if (r < 0)
-		return r;
-
 	r = INTEGRITY_read_sb(cd, &cd->u.integrity.params);
 	if (r < 0)
 		return r;
@@ -1008,6 +1204,8 @@ static void crypt_free_type(struct crypt_device *cd)
 		LUKS2_hdr_free(&cd->u.luks2.hdr);
 		free(cd->u.luks2.cipher);
 		free(cd->u.luks2.cipher_mode);
+		LUKS2_reencrypt_free(cd->u.luks2.rh);
+		cd->u.luks2.rh = NULL;
 	} else if (isLOOPAES(cd->type)) {
 		free(CONST_CAST(void*)cd->u.loopaes.hdr.hash);
 		free(cd->u.loopaes.cipher);
@@ -1193,6 +1391,8 @@ static int _init_by_name_integrity(struct crypt_device *cd, const char *name)
 		cd->u.integrity.params.journal_commit_time = dmd.u.integrity.journal_commit_time;
 		cd->u.integrity.params.interleave_sectors = dmd.u.integrity.interleave_sectors;
 		cd->u.integrity.params.buffer_sectors = dmd.u.integrity.buffer_sectors;
+		cd->integrity_bitmap_sectors_per_bit = dmd.u.integrity.sectors_per_bit;
+		cd->integrity_bitmap_flush_time = dmd.u.integrity.bitmap_flush_time;
 		cd->u.integrity.params.integrity = dmd.u.integrity.integrity;
 		cd->u.integrity.params.journal_integrity = dmd.u.integrity.journal_integrity;
 		cd->u.integrity.params.journal_crypt = dmd.u.integrity.journal_crypt;
@@ -1535,6 +1735,7 @@ static int _crypt_format_luks2(struct crypt_device *cd,
 
 	if (!(cd->type = strdup(CRYPT_LUKS2)))
 		return -ENOMEM;
+	cd->u.luks2.rh = NULL;
 
 	if (volume_key)
 		cd->volume_key = crypt_alloc_volume_key(volume_key_size,
@@ -1593,6 +1794,19 @@ static int _crypt_format_luks2(struct crypt_device *cd,
 	if (r < 0)
 		goto out;
 
+	/* Old key material must not survive in binary keyslots area */
+	r = LUKS2_check_device_size(cd, crypt_metadata_device(cd),
+				    LUKS2_hdr_and_areas_size(cd->u.luks2.hdr.jobj), 1);
+	if (!r)
+		r = crypt_wipe_device_init(cd, crypt_metadata_device(cd),
+					   2 * cd->u.luks2.hdr.hdr_size,
+					   LUKS2_keyslots_size(cd->u.luks2.hdr.jobj));
+	if (r < 0) {
+		log_err(cd, _("Cannot wipe header on device %s."),
+			mdata_device_path(cd));
+		goto out;
+	}
+
 	if (params && (params->label || params->subsystem)) {
 		r = LUKS2_hdr_labels(cd, &cd->u.luks2.hdr,
 				     params->label, params->subsystem, 0);
@@ -2270,6 +2484,8 @@ void crypt_free(struct crypt_device *cd)
 
 	dm_backend_exit();
 	crypt_free_volume_key(cd->volume_key);
+	crypt_safe_free(cd->digest_cache);
+	free(cd->keyring_key_desc);
 
 	device_free(cd->device);
 	device_free(cd->metadata_device);
@@ -2303,10 +2519,144 @@ static char *crypt_get_device_key_description(const char *name)
 	return tmp;
 }
 
-int crypt_suspend(struct crypt_device *cd,
-		  const char *name)
+/*
+ * Logon key in user keyring holding volume key of suspended device, bound
+ * to LUKS2 UUID and segment digest, so a changed volume key is never used.
+ */
+#define CRYPT_RETAINED_KEY_PREFIX "cryptsetup:suspend:"
+
+static char *_retained_key_description(struct crypt_device *cd, const char *name, int digest)
 {
-	char *key_desc;
+	char *desc;
+
+	if (asprintf(&desc, CRYPT_RETAINED_KEY_PREFIX "%s:%s-d%d", name, crypt_get_uuid(cd), digest) < 0)
+		return NULL;
+
+	return desc;
+}
+
+static char *crypt_get_retained_key_description(struct crypt_device *cd, const char *name)
+{
+	int digest;
+
+	if (!isLUKS2(cd->type))
+		return NULL;
+
+	digest = LUKS2_digest_by_segment(cd, &cd->u.luks2.hdr, CRYPT_DEFAULT_SEGMENT);
+	if (digest < 0)
+		return NULL;
+
+	return _retained_key_description(cd, name, digest);
+}
+
+/* drop keys retained before volume key change */
+static void crypt_drop_stale_retained_keys(struct crypt_device *cd, const char *name)
+{
+	char *desc;
+	int i, digest;
+
+	digest = LUKS2_digest_by_segment(cd, &cd->u.luks2.hdr, CRYPT_DEFAULT_SEGMENT);
+
+	for (i = 0; i < LUKS2_DIGEST_MAX; i++) {
+		if (i == digest || !(desc = _retained_key_description(cd, name, i)))
+			continue;
+		keyring_unlink_logon_key(desc);
+		free(desc);
+	}
+}
+
+/*
+ * Store volume key from active device table in user keyring
+ * so resume does not need to unlock keyslot again.
+ */
+static int crypt_retain_volume_key(struct crypt_device *cd, const char *name,
+				   unsigned timeout)
+{
+	struct crypt_dm_active_device dmd;
+	char *desc = NULL;
+	int r;
+
+	if (!isLUKS2(cd->type)) {
+		log_err(cd, _("Volume key can be retained only for LUKS2 device."));
+		return -ENOTSUP;
+	}
+
+	r = dm_query_device(cd, name, DM_ACTIVE_CRYPT_KEY | DM_ACTIVE_CRYPT_KEYSIZE, &dmd);
+	if (r < 0)
+		return r;
+
+	if (dmd.target != DM_CRYPT) {
+		if (dmd.target == DM_INTEGRITY)
+			crypt_free_volume_key(dmd.u.integrity.vk);
+		return -EINVAL;
+	}
+
+	if (dmd.flags & CRYPT_ACTIVATE_KEYRING_KEY) {
+		log_err(cd, _("Volume key of device %s is stored in kernel keyring and cannot be retained."), name);
+		crypt_free_volume_key(dmd.u.crypt.vk);
+		return -ENOTSUP;
+	}
+
+	/* retained key cannot be checked on resume, it must match header now */
+	r = LUKS2_digest_verify_by_segment(cd, &cd->u.luks2.hdr, CRYPT_DEFAULT_SEGMENT, dmd.u.crypt.vk);
+	if (r < 0) {
+		log_err(cd, _("Volume key of device %s does not match the header."), name);
+		goto out;
+	}
+
+	desc = crypt_get_retained_key_description(cd, name);
+	if (!desc) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = keyring_add_logon_key_timeout(desc, dmd.u.crypt.vk->key,
+					  dmd.u.crypt.vk->keylength, timeout);
+	if (r < 0)
+		log_err(cd, _("Failed to retain volume key in kernel keyring."));
+	else
+		log_dbg("Volume key retained in user keyring as %s.", desc);
+out:
+	crypt_free_volume_key(dmd.u.crypt.vk);
+	free(desc);
+	return r < 0 ? r : 0;
+}
+
+static int _reencrypt_in_progress(struct crypt_device *cd)
+{
+	return isLUKS2(cd->type) && LUKS2_reencrypt_in_progress(cd, &cd->u.luks2.hdr);
+}
+
+/* dm-crypt key messages cannot reach both segments of reencryption mapping */
+static int _reencrypt_suspend_check(struct crypt_device *cd, const char *name)
+{
+	if (_reencrypt_in_progress(cd)) {
+		log_err(cd, _("Suspend and resume is not supported during online reencryption of device %s."), name);
+		return -ENOTSUP;
+	}
+
+	return 0;
+}
+
+/* Device suspended by failed reencryption step is resumed by table reload */
+static int _reencrypt_resume(struct crypt_device *cd, const char *name,
+			     const char *passphrase, size_t passphrase_size)
+{
+	int r;
+
+	log_dbg("Reloading device %s with online reencryption segments.", name);
+
+	r = LUKS2_reencrypt_reload(cd, &cd->u.luks2.hdr, name, passphrase, passphrase_size);
+	if (r < 0)
+		log_err(cd, _("Error during resuming device %s."), name);
+
+	return r;
+}
+
+static int _crypt_suspend(struct crypt_device *cd, const char *name,
+			  int retain_key, unsigned timeout)
+{
+	char *key_desc, *retained_desc;
 	crypt_status_info ci;
 	int r;
 
@@ -2330,6 +2680,9 @@ int crypt_suspend(struct crypt_device *cd,
 	if (r < 0)
 		return r;
 
+	if ((r = _reencrypt_suspend_check(cd, name)))
+		return r;
+
 	ci = crypt_status(NULL, name);
 	if (ci < CRYPT_ACTIVE) {
 		log_err(cd, _("Volume %s is not active."), name);
@@ -2348,6 +2701,16 @@ int crypt_suspend(struct crypt_device *cd,
 		goto out;
 	}
 
+	/* we can't retain wrapped keys */
+	if (retain_key && crypt_cipher_wrapped_key(crypt_get_cipher(cd))) {
+		log_err(cd, _("Cannot retain wrapped key of device %s."), name);
+		r = -ENOTSUP;
+		goto out;
+	}
+
+	if (retain_key && (r = crypt_retain_volume_key(cd, name, timeout)))
+		goto out;
+
 	key_desc = crypt_get_device_key_description(name);
 
 	/* we can't simply wipe wrapped keys */
@@ -2363,11 +2726,123 @@ int crypt_suspend(struct crypt_device *cd,
 	else
 		crypt_drop_keyring_key(cd, key_desc);
 	free(key_desc);
+
+	if (r && retain_key && (retained_desc = crypt_get_retained_key_description(cd, name))) {
+		keyring_unlink_logon_key(retained_desc);
+		free(retained_desc);
+	}
 out:
 	dm_backend_exit();
 	return r;
 }
 
+int crypt_suspend(struct crypt_device *cd,
+		  const char *name)
+{
+	return _crypt_suspend(cd, name, 0, 0);
+}
+
+int crypt_suspend_retain_key(struct crypt_device *cd,
+			     const char *name,
+			     unsigned timeout)
+{
+	return _crypt_suspend(cd, name, 1, timeout);
+}
+
+int crypt_resume_by_retained_key(struct crypt_device *cd,
+				 const char *name)
+{
+	struct crypt_dm_active_device dmd;
+	struct volume_key *vk = NULL;
+	char *desc;
+	int r;
+
+	if (!name)
+		return -EINVAL;
+
+	log_dbg("Resuming volume %s using retained key.", name);
+
+	if ((r = onlyLUKS(cd)))
+		return r;
+
+	/* suspend with retained key is refused for LUKS1 */
+	if (!isLUKS2(cd->type)) {
+		log_dbg("No retained key is used for LUKS1 device.");
+		return -ENOENT;
+	}
+
+	/* suspend with retained key is refused during reencryption */
+	if (_reencrypt_in_progress(cd)) {
+		log_dbg("No retained key is used during online reencryption.");
+		return -ENOENT;
+	}
+
+	r = dm_status_suspended(cd, name);
+	if (r < 0)
+		return r;
+
+	if (!r) {
+		log_err(cd, _("Volume %s is not suspended."), name);
+		return -EINVAL;
+	}
+
+	r = dm_query_device(cd, name, DM_ACTIVE_CRYPT_KEYSIZE, &dmd);
+	if (r < 0)
+		return r;
+
+	if (dmd.target != DM_CRYPT || !dmd.u.crypt.vk) {
+		if (dmd.target == DM_INTEGRITY)
+			crypt_free_volume_key(dmd.u.integrity.vk);
+		else
+			crypt_free_volume_key(dmd.u.crypt.vk);
+		return -EINVAL;
+	}
+
+	/*
+	 * Description contains digest id of the current volume key,
+	 * key retained before volume key change is never found.
+	 */
+	desc = crypt_get_retained_key_description(cd, name);
+	if (!desc) {
+		crypt_free_volume_key(dmd.u.crypt.vk);
+		return -ENOMEM;
+	}
+
+	/* logon key cannot be read back, dm-crypt loads it by description */
+	r = keyring_link_logon_key_in_thread_keyring(desc);
+	if (r < 0) {
+		log_dbg("No retained volume key found for device %s.", name);
+		crypt_drop_stale_retained_keys(cd, name);
+		r = -ENOENT;
+		goto out;
+	}
+
+	vk = crypt_alloc_volume_key(dmd.u.crypt.vk->keylength, NULL);
+	if (!vk) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = crypt_volume_key_set_description(vk, desc);
+	if (r < 0)
+		goto out;
+
+	r = dm_resume_and_reinstate_key(cd, name, vk);
+
+	if (r == -ENOTSUP)
+		log_err(cd, _("Resume is not supported for device %s."), name);
+	else if (r)
+		log_err(cd, _("Error during resuming device %s."), name);
+	else
+		keyring_unlink_logon_key(desc);
+out:
+	crypt_free_volume_key(dmd.u.crypt.vk);
+	crypt_free_volume_key(vk);
+	free(desc);
+
+	return r < 0 ? r : 0;
+}
+
 int crypt_resume_by_passphrase(struct crypt_device *cd,
 			       const char *name,
 			       int keyslot,
@@ -2396,6 +2871,9 @@ int crypt_resume_by_passphrase(struct crypt_device *cd,
 		return -EINVAL;
 	}
 
+	if (_reencrypt_in_progress(cd))
+		return _reencrypt_resume(cd, name, passphrase, passphrase_size);
+
 	if (isLUKS1(cd->type))
 		r = LUKS_open_key_with_hdr(keyslot, passphrase, passphrase_size,
 					   &cd->u.luks1.hdr, &vk, cd);
@@ -2469,8 +2947,13 @@ int crypt_resume_by_keyfile_device_offset(struct crypt_device *cd,
 	if (r < 0)
 		goto out;
 
-	if (isLUKS1(cd->type))
-		r = LUKS_open_key_with_hdr(keyslot, passphrase_read, passphrase_size_read,
+	if (_reencrypt_in_progress(cd)) {
+		r = keyslot = _reencrypt_resume(cd, name, passphrase_read, passphrase_size_read);
+		goto out;
+	}
+
+	if (isLUKS1(cd->type))
+		r = LUKS_open_key_with_hdr(keyslot, passphrase_read, passphrase_size_read,
 					   &cd->u.luks1.hdr, &vk, cd);
 	else
 		r = LUKS2_keyslot_open(cd, keyslot, CRYPT_DEFAULT_SEGMENT, passphrase_read, passphrase_size_read, &vk);
@@ -2609,6 +3092,118 @@ out:
 	return keyslot;
 }
 
+/* Resolve keyslot numbers of batch, explicit requests first */
+static int keyslot_batch_resolve(struct crypt_device *cd,
+	struct crypt_keyslot_add_entry *entries,
+	size_t count)
+{
+	uint64_t taken = 0;
+	size_t i;
+	int pass, keyslot;
+
+	for (pass = 0; pass < 2; pass++)
+		for (i = 0; i < count; i++) {
+			if ((entries[i].keyslot == CRYPT_ANY_SLOT) != pass)
+				continue;
+
+			keyslot = pass ? 0 : entries[i].keyslot;
+			if (pass) {
+				while (keyslot < LUKS2_KEYSLOTS_MAX &&
+				       ((taken & (UINT64_C(1) << keyslot)) ||
+				        LUKS2_keyslot_info(&cd->u.luks2.hdr, keyslot) != CRYPT_SLOT_INACTIVE))
+					keyslot++;
+				if (keyslot == LUKS2_KEYSLOTS_MAX) {
+					log_err(cd, _("All key slots full."));
+					return -EINVAL;
+				}
+			} else if (keyslot >= 0 && keyslot < LUKS2_KEYSLOTS_MAX &&
+				   (taken & (UINT64_C(1) << keyslot))) {
+				log_err(cd, _("Key slot %d is full, please select another one."), keyslot);
+				return -EINVAL;
+			}
+
+			if (keyslot_verify_or_find_empty(cd, &keyslot))
+				return -EINVAL;
+
+			taken |= UINT64_C(1) << keyslot;
+			entries[i].keyslot = keyslot;
+		}
+
+	return 0;
+}
+
+int crypt_keyslot_add_batch(struct crypt_device *cd,
+	const char *passphrase,
+	size_t passphrase_size,
+	struct crypt_keyslot_add_entry *entries,
+	size_t count)
+{
+	struct luks2_keyslot_store_job job[LUKS2_KEYSLOTS_MAX];
+	struct luks2_keyslot_params params;
+	struct volume_key *vk = NULL;
+	int digest, r, active_slots, requested[LUKS2_KEYSLOTS_MAX];
+	size_t i;
+
+	log_dbg("Adding %zu new keyslots in batch.", count);
+
+	if ((r = onlyLUKS2(cd)))
+		return r;
+
+	if (!passphrase || !entries || !count || count > LUKS2_KEYSLOTS_MAX)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		if (!entries[i].passphrase)
+			return -EINVAL;
+		requested[i] = entries[i].keyslot;
+	}
+
+	r = keyslot_batch_resolve(cd, entries, count);
+	if (r)
+		goto out;
+
+	active_slots = LUKS2_keyslot_active_count(&cd->u.luks2.hdr, CRYPT_DEFAULT_SEGMENT);
+	if (active_slots == 0) {
+		/* No slots used, try to use pre-generated key in header */
+		if (cd->volume_key) {
+			vk = crypt_alloc_volume_key(cd->volume_key->keylength, cd->volume_key->key);
+			r = vk ? 0 : -ENOMEM;
+		} else {
+			log_err(cd, _("Cannot add key slot, all slots disabled and no volume key provided."));
+			r = -EINVAL;
+		}
+	} else if (active_slots < 0)
+		r = -EINVAL;
+	else
+		r = LUKS2_keyslot_open(cd, CRYPT_ANY_SLOT, CRYPT_DEFAULT_SEGMENT, passphrase,
+					passphrase_size, &vk);
+	if (r < 0)
+		goto out;
+
+	r = digest = LUKS2_digest_verify_by_segment(cd, &cd->u.luks2.hdr, CRYPT_DEFAULT_SEGMENT, vk);
+	if (r >= 0)
+		r = LUKS2_keyslot_params_default(cd, &cd->u.luks2.hdr, vk->keylength, &params);
+
+	for (i = 0; i < count && r >= 0; i++) {
+		r = LUKS2_digest_assign(cd, &cd->u.luks2.hdr, entries[i].keyslot, digest, 1, 0);
+		job[i].keyslot = entries[i].keyslot;
+		job[i].password = entries[i].passphrase;
+		job[i].password_len = entries[i].passphrase_size;
+	}
+
+	if (r >= 0)
+		r = LUKS2_keyslot_store_batch(cd, &cd->u.luks2.hdr, job, count, vk, &params);
+out:
+	crypt_free_volume_key(vk);
+	if (r < 0) {
+		for (i = 0; i < count; i++)
+			entries[i].keyslot = requested[i];
+		_luks2_reload(cd);
+		return r;
+	}
+	return 0;
+}
+
 int crypt_keyslot_change_by_passphrase(struct crypt_device *cd,
 	int keyslot_old,
 	int keyslot_new,
@@ -2905,71 +3500,330 @@ int crypt_keyslot_destroy(struct crypt_device *cd, int keyslot)
 	return LUKS2_keyslot_wipe(cd, &cd->u.luks2.hdr, keyslot, 0);
 }
 
+int crypt_keyslot_destroy_batch(struct crypt_device *cd, const int *keyslots, size_t count)
+{
+	crypt_keyslot_info ki;
+	size_t i, j;
+	int r;
+
+	log_dbg("Destroying %zu keyslots.", count);
+
+	if ((r = _onlyLUKS(cd, CRYPT_CD_UNRESTRICTED)))
+		return r;
+
+	if (!keyslots || !count || count > (size_t)crypt_keyslot_max(cd->type))
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		ki = crypt_keyslot_status(cd, keyslots[i]);
+		if (ki == CRYPT_SLOT_INVALID) {
+			log_err(cd, _("Key slot %d is invalid."), keyslots[i]);
+			return -EINVAL;
+		}
+		if (isLUKS1(cd->type) && ki == CRYPT_SLOT_INACTIVE) {
+			log_err(cd, _("Key slot %d is not used."), keyslots[i]);
+			return -EINVAL;
+		}
+		for (j = 0; j < i; j++)
+			if (keyslots[j] == keyslots[i])
+				return -EINVAL;
+	}
+
+	if (isLUKS1(cd->type))
+		return LUKS_del_keys(keyslots, count, &cd->u.luks1.hdr, cd);
+
+	r = LUKS2_keyslots_wipe(cd, &cd->u.luks2.hdr, keyslots, count);
+	if (r < 0)
+		_luks2_reload(cd);
+	return r;
+}
+
 /*
  * Activation/deactivation of a device
  */
-static int _activate_by_passphrase(struct crypt_device *cd,
-	const char *name,
+/* Unlock volume key by passphrase, returns keyslot used */
+static int _open_volume_key_by_passphrase(struct crypt_device *cd,
 	int keyslot,
 	const char *passphrase,
 	size_t passphrase_size,
-	uint32_t flags)
+	uint32_t flags,
+	struct volume_key **vk)
 {
 	int r;
-	struct volume_key *vk = NULL;
-
-	if ((flags & CRYPT_ACTIVATE_KEYRING_KEY) && !crypt_use_keyring_for_vk(cd))
-		return -EINVAL;
-
-	if ((flags & CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY) && name)
-		return -EINVAL;
 
 	/* plain, use hashed passphrase */
 	if (isPLAIN(cd->type)) {
-		if (!name)
-			return -EINVAL;
-
 		r = process_key(cd, cd->u.plain.hdr.hash,
 				cd->u.plain.key_size,
-				passphrase, passphrase_size, &vk);
-		if (r < 0)
-			goto out;
-
-		r = PLAIN_activate(cd, name, vk, cd->u.plain.hdr.size, flags);
-		keyslot = 0;
+				passphrase, passphrase_size, vk);
+		r = r < 0 ? r : 0;
 	} else if (isLUKS1(cd->type)) {
 		r = LUKS_open_key_with_hdr(keyslot, passphrase,
-					   passphrase_size, &cd->u.luks1.hdr, &vk, cd);
-		if (r >= 0) {
-			keyslot = r;
-			if (name)
-				r = LUKS1_activate(cd, name, vk, flags);
-		}
+					   passphrase_size, &cd->u.luks1.hdr, vk, cd);
 	} else if (isLUKS2(cd->type)) {
 		r = LUKS2_keyslot_open(cd, keyslot,
 				       (flags & CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY) ?
 				       CRYPT_ANY_SEGMENT : CRYPT_DEFAULT_SEGMENT,
-				       passphrase, passphrase_size, &vk);
-		if (r >= 0) {
-			keyslot = r;
-
-			if ((name || (flags & CRYPT_ACTIVATE_KEYRING_KEY)) &&
-			    crypt_use_keyring_for_vk(cd)) {
-				r = LUKS2_volume_key_load_in_keyring_by_keyslot(cd,
-						&cd->u.luks2.hdr, vk, keyslot);
-				if (r < 0)
-					goto out;
-				flags |= CRYPT_ACTIVATE_KEYRING_KEY;
-			}
-
-			if (name)
-				r = LUKS2_activate(cd, name, vk, flags);
-		}
+				       passphrase, passphrase_size, vk);
 	} else {
 		log_err(cd, _("Device type is not properly initialised."));
 		r = -EINVAL;
 	}
-out:
+
+	return r;
+}
+
+/* Activate with already unlocked volume key of keyslot */
+static int _activate_by_unlocked_key(struct crypt_device *cd,
+	const char *name,
+	int keyslot,
+	struct volume_key *vk,
+	uint32_t flags)
+{
+	int r = 0;
+
+	if (isPLAIN(cd->type))
+		r = PLAIN_activate(cd, name, vk, cd->u.plain.hdr.size, flags);
+	else if (isLUKS1(cd->type)) {
+		if (name)
+			r = LUKS1_activate(cd, name, vk, flags);
+	} else if (isLUKS2(cd->type)) {
+		if ((name || (flags & CRYPT_ACTIVATE_KEYRING_KEY)) &&
+		    crypt_use_keyring_for_vk(cd)) {
+			r = LUKS2_volume_key_load_in_keyring_by_keyslot(cd,
+					&cd->u.luks2.hdr, vk, keyslot);
+			if (r < 0)
+				return r;
+			flags |= CRYPT_ACTIVATE_KEYRING_KEY;
+		}
+
+		if (name)
+			r = LUKS2_activate(cd, name, vk, flags);
+	} else
+		r = -EINVAL;
+
+	return r;
+}
+
+/*
+ * Keyslot areas prefetch
+ *
+ * If several keyslots are candidates for unlock, read the span of all
+ * their areas in one read into locked memory, keyslot decryption is then
+ * served from it instead of separate device read for every keyslot.
+ */
+#define KEYSLOTS_PREFETCH_MAX (16 * 1024 * 1024)
+
+static void keyslots_prefetch_drop(struct crypt_device *cd)
+{
+	crypt_safe_free(cd->keyslots_cache.buf);
+	cd->keyslots_cache.buf = NULL;
+	cd->keyslots_cache.offset = cd->keyslots_cache.length = 0;
+}
+
+static void keyslots_prefetch(struct crypt_device *cd, int keyslot)
+{
+	struct device *device = crypt_metadata_device(cd);
+	uint64_t offset, length, start = UINT64_MAX, end = 0;
+	crypt_keyslot_info ki;
+	int i, count = 0, devfd, r;
+	char *buf;
+
+	if (keyslot != CRYPT_ANY_SLOT || (!isLUKS1(cd->type) && !isLUKS2(cd->type)))
+		return;
+
+	for (i = 0; i < crypt_keyslot_max(cd->type); i++) {
+		ki = crypt_keyslot_status(cd, i);
+		if (ki != CRYPT_SLOT_ACTIVE && ki != CRYPT_SLOT_ACTIVE_LAST)
+			continue;
+		if (crypt_keyslot_area(cd, i, &offset, &length))
+			continue;
+		if (offset < start)
+			start = offset;
+		if (offset + length > end)
+			end = offset + length;
+		count++;
+	}
+
+	if (count < 2 || end - start > KEYSLOTS_PREFETCH_MAX)
+		return;
+
+	buf = crypt_safe_alloc(end - start);
+	if (!buf)
+		return;
+
+	if (isLUKS2(cd->type) && device_read_lock(cd, device)) {
+		crypt_safe_free(buf);
+		return;
+	}
+
+	devfd = isLUKS2(cd->type) ? device_open_locked(device, O_RDONLY) :
+				    device_open(device, O_RDONLY);
+	r = devfd < 0 ? -EIO : 0;
+	if (!r && read_lseek_blockwise(devfd, device_block_size(device),
+			device_alignment(device), buf, end - start, start) < 0)
+		r = -EIO;
+	if (devfd >= 0)
+		device_close(device, devfd);
+
+	if (isLUKS2(cd->type))
+		device_read_unlock(device);
+
+	if (r) {
+		log_dbg("Keyslot areas prefetch failed.");
+		crypt_safe_free(buf);
+		return;
+	}
+
+	log_dbg("Prefetched %d keyslot areas [%" PRIu64 "-%" PRIu64 "].", count, start, end);
+	cd->keyslots_cache.buf = buf;
+	cd->keyslots_cache.offset = start;
+	cd->keyslots_cache.length = end - start;
+}
+
+int crypt_keyslot_area_read_cached(struct crypt_device *cd, char *dst,
+	size_t length, uint64_t offset)
+{
+	if (!cd || !cd->keyslots_cache.buf || offset < cd->keyslots_cache.offset ||
+	    length > cd->keyslots_cache.length ||
+	    offset - cd->keyslots_cache.offset > cd->keyslots_cache.length - length)
+		return -ENOENT;
+
+	memcpy(dst, cd->keyslots_cache.buf + (offset - cd->keyslots_cache.offset), length);
+	return 0;
+}
+
+/*
+ * Verified volume key cache
+ *
+ * Digest verification runs PBKDF2 for every check of the same key
+ * (keyslot unlock, segment digest check, crypt_volume_key_verify).
+ * Remember a keyed hash of every verified key, of the digest id and of
+ * the whole digest object (so any digest change invalidates the entry).
+ * The hash key is random per context, the cache lives in locked memory.
+ */
+#define DIGEST_CACHE_ENTRIES 8
+#define DIGEST_CACHE_HASH "sha256"
+#define DIGEST_CACHE_MAC_LEN 32
+
+struct crypt_digest_cache {
+	char key[DIGEST_CACHE_MAC_LEN];
+	unsigned next;
+	struct {
+		int digest;
+		char mac[DIGEST_CACHE_MAC_LEN];
+	} entry[DIGEST_CACHE_ENTRIES];
+};
+
+static int digest_cache_mac(struct crypt_digest_cache *dc, int digest,
+	const char *tag, size_t tag_len, const struct volume_key *vk,
+	char *mac)
+{
+	struct crypt_hmac *hd;
+	int r;
+
+	if (crypt_hmac_init(&hd, DIGEST_CACHE_HASH, dc->key, sizeof(dc->key)))
+		return -EINVAL;
+
+	r = crypt_hmac_write(hd, (const char *)&digest, sizeof(digest));
+	if (!r)
+		r = crypt_hmac_write(hd, tag, tag_len);
+	if (!r)
+		r = crypt_hmac_write(hd, vk->key, vk->keylength);
+	if (!r)
+		r = crypt_hmac_final(hd, mac, DIGEST_CACHE_MAC_LEN);
+
+	crypt_hmac_destroy(hd);
+	return r ? -EINVAL : 0;
+}
+
+int crypt_digest_cache_check(struct crypt_device *cd, int digest,
+	const char *tag, size_t tag_len, const struct volume_key *vk)
+{
+	struct crypt_digest_cache *dc;
+	char mac[DIGEST_CACHE_MAC_LEN];
+	int i, r = -ENOENT;
+
+	if (!cd || !(dc = cd->digest_cache) || !vk || !tag)
+		return -ENOENT;
+
+	if (digest_cache_mac(dc, digest, tag, tag_len, vk, mac))
+		return -ENOENT;
+
+	for (i = 0; i < DIGEST_CACHE_ENTRIES; i++)
+		if (dc->entry[i].digest == digest &&
+		    !memcmp(dc->entry[i].mac, mac, sizeof(mac))) {
+			r = 0;
+			break;
+		}
+
+	crypt_memzero(mac, sizeof(mac));
+	return r;
+}
+
+void crypt_digest_cache_store(struct crypt_device *cd, int digest,
+	const char *tag, size_t tag_len, const struct volume_key *vk)
+{
+	struct crypt_digest_cache *dc;
+	unsigned i;
+
+	if (!cd || !vk || !tag)
+		return;
+
+	if (!cd->digest_cache) {
+		dc = crypt_safe_alloc(sizeof(*dc));
+		if (!dc)
+			return;
+		if (crypt_random_get(cd, dc->key, sizeof(dc->key), CRYPT_RND_NORMAL) < 0) {
+			crypt_safe_free(dc);
+			return;
+		}
+		for (i = 0; i < DIGEST_CACHE_ENTRIES; i++)
+			dc->entry[i].digest = -1;
+		cd->digest_cache = dc;
+	}
+
+	dc = cd->digest_cache;
+	i = dc->next++ % DIGEST_CACHE_ENTRIES;
+	if (digest_cache_mac(dc, digest, tag, tag_len, vk, dc->entry[i].mac))
+		dc->entry[i].digest = -1;
+	else
+		dc->entry[i].digest = digest;
+}
+
+static int _activate_by_passphrase(struct crypt_device *cd,
+	const char *name,
+	int keyslot,
+	const char *passphrase,
+	size_t passphrase_size,
+	uint32_t flags)
+{
+	int r;
+	struct volume_key *vk = NULL;
+
+	if ((flags & CRYPT_ACTIVATE_KEYRING_KEY) && !crypt_use_keyring_for_vk(cd))
+		return -EINVAL;
+
+	if ((flags & CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY) && name)
+		return -EINVAL;
+
+	if (isPLAIN(cd->type) && !name)
+		return -EINVAL;
+
+	/* interrupted online reencryption needs both segments mapped */
+	if (isLUKS2(cd->type) && LUKS2_reencrypt_in_progress(cd, &cd->u.luks2.hdr))
+		return LUKS2_reencrypt_activate(cd, &cd->u.luks2.hdr, name,
+						passphrase, passphrase_size, flags);
+
+	keyslots_prefetch(cd, keyslot);
+	r = _open_volume_key_by_passphrase(cd, keyslot, passphrase,
+					   passphrase_size, flags, &vk);
+	keyslots_prefetch_drop(cd);
+	if (r >= 0) {
+		keyslot = r;
+		r = _activate_by_unlocked_key(cd, name, keyslot, vk, flags);
+	}
+
 	if (r < 0 && vk)
 		crypt_drop_keyring_key(cd, vk->key_description);
 	crypt_free_volume_key(vk);
@@ -3241,23 +4095,648 @@ int crypt_activate_by_volume_key(struct crypt_device *cd,
 	return r;
 }
 
-int crypt_deactivate_by_name(struct crypt_device *cd, const char *name, uint32_t flags)
+/*
+ * Batch activation
+ *
+ * Volume keys are unlocked first by min(count, cpus) worker threads,
+ * a request is started only if its PBKDF memory cost fits into half of
+ * physical memory together with running unlocks (or nothing else runs).
+ * Keyslots of one request are tried serially then, the batch keeps CPUs busy.
+ * Devices are created afterwards in request order with one shared udev cookie.
+ */
+struct activate_batch {
+	struct crypt_activate_request *req;
+	struct volume_key **vk;
+	uint32_t *memory_kb;
+	size_t *idx, count, next;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t max_memory_kb, busy_memory_kb;
+	unsigned busy;
+};
+
+static uint32_t activate_batch_memory(struct crypt_activate_request *req)
 {
-	char *key_desc;
-	struct crypt_device *fake_cd = NULL;
-	const char *namei = NULL;
-	struct crypt_dm_active_device dmd = {};
-	int r;
-	uint32_t get_flags = DM_ACTIVE_DEVICE | DM_ACTIVE_HOLDERS;
+	uint32_t memory_kb = 0;
 
-	if (!name)
-		return -EINVAL;
+	if (isLUKS2(req->cd->type))
+		(void)LUKS2_keyslot_pbkdf_memory(req->cd, &req->cd->u.luks2.hdr, req->keyslot,
+				(req->flags & CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY) ?
+				CRYPT_ANY_SEGMENT : CRYPT_DEFAULT_SEGMENT, &memory_kb);
 
-	log_dbg("Deactivating volume %s.", name);
+	return memory_kb;
+}
 
-	if (!cd) {
-		r = crypt_init_by_name(&fake_cd, name);
-		if (r < 0)
+static void *activate_batch_thread(void *arg)
+{
+	struct activate_batch *b = arg;
+	struct crypt_activate_request *req;
+	size_t i;
+	int r;
+
+	pthread_mutex_lock(&b->lock);
+	while (1) {
+		while (b->next < b->count && b->busy &&
+		       b->busy_memory_kb + b->memory_kb[b->idx[b->next]] > b->max_memory_kb)
+			pthread_cond_wait(&b->cond, &b->lock);
+
+		if (b->next >= b->count)
+			break;
+
+		i = b->idx[b->next++];
+		b->busy++;
+		b->busy_memory_kb += b->memory_kb[i];
+		pthread_mutex_unlock(&b->lock);
+
+		req = &b->req[i];
+		r = _open_volume_key_by_passphrase(req->cd, req->keyslot, req->passphrase,
+						   req->passphrase_size, req->flags, &b->vk[i]);
+
+		pthread_mutex_lock(&b->lock);
+		req->r = r;
+		b->busy--;
+		b->busy_memory_kb -= b->memory_kb[i];
+		pthread_cond_broadcast(&b->cond);
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	return NULL;
+}
+
+static void activate_batch_unlock(struct activate_batch *b)
+{
+	pthread_t *threads = NULL;
+	unsigned cpus, nthreads = 0, i;
+
+	cpus = crypt_cpusonline() ?: 1;
+	b->max_memory_kb = crypt_getphysmemory_kb() / 2;
+
+	if (b->count > 1 && cpus > 1) {
+		nthreads = b->count < cpus ? b->count : cpus;
+		threads = calloc(nthreads, sizeof(*threads));
+		for (i = 0; threads && i < nthreads; i++)
+			if (pthread_create(&threads[i], NULL, activate_batch_thread, b))
+				break;
+		nthreads = threads ? i : 0;
+	}
+
+	log_dbg("Unlocking %zu devices using %u threads.", b->count, nthreads ?: 1);
+
+	/* Run in the caller thread if no worker could be started */
+	if (!nthreads)
+		activate_batch_thread(b);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
+int crypt_activate_batch(struct crypt_activate_request *req, size_t count)
+{
+	struct activate_batch b = { .req = req };
+	struct crypt_activate_request *rq;
+	size_t i, j;
+	int keyslot, r = 0;
+
+	if (!req || !count)
+		return -EINVAL;
+
+	b.vk = calloc(count, sizeof(*b.vk));
+	b.memory_kb = calloc(count, sizeof(*b.memory_kb));
+	b.idx = calloc(count, sizeof(*b.idx));
+	if (!b.vk || !b.memory_kb || !b.idx) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	if (pthread_mutex_init(&b.lock, NULL)) {
+		r = -ENOMEM;
+		goto out;
+	}
+	if (pthread_cond_init(&b.cond, NULL)) {
+		pthread_mutex_destroy(&b.lock);
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		rq = &req[i];
+		rq->r = 0;
+
+		if (!rq->cd || !rq->name || (!rq->passphrase && !rq->volume_key) ||
+		    (rq->flags & CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY) ||
+		    ((rq->flags & CRYPT_ACTIVATE_KEYRING_KEY) && !crypt_use_keyring_for_vk(rq->cd)) ||
+		    !(isPLAIN(rq->cd->type) || isLUKS1(rq->cd->type) || isLUKS2(rq->cd->type))) {
+			rq->r = -EINVAL;
+			continue;
+		}
+
+		/* Device handle is not thread safe, one request per handle */
+		for (j = 0; j < i; j++)
+			if (req[j].cd == rq->cd)
+				rq->r = -EINVAL;
+		if (rq->r < 0)
+			continue;
+
+		log_dbg("Activating volume %s [keyslot %d] in batch.", rq->name, rq->keyslot);
+
+		rq->r = _activate_check_status(rq->cd, rq->name);
+		if (rq->r < 0 || !rq->passphrase)
+			continue;
+
+		rq->cd->unlock_serial = 1;
+		b.memory_kb[i] = activate_batch_memory(rq);
+		b.idx[b.count++] = i;
+	}
+
+	if (b.count)
+		activate_batch_unlock(&b);
+
+	for (i = 0; i < b.count; i++)
+		req[b.idx[i]].cd->unlock_serial = 0;
+
+	dm_udev_batch_begin();
+	for (i = 0; i < count; i++) {
+		rq = &req[i];
+		if (rq->r < 0)
+			continue;
+
+		if (!rq->passphrase) {
+			rq->r = crypt_activate_by_volume_key(rq->cd, rq->name, rq->volume_key,
+							     rq->volume_key_size, rq->flags);
+			continue;
+		}
+
+		keyslot = rq->r;
+		rq->r = _activate_by_unlocked_key(rq->cd, rq->name, keyslot, b.vk[i], rq->flags);
+		if (rq->r < 0)
+			crypt_drop_keyring_key(rq->cd, b.vk[i]->key_description);
+		else
+			rq->r = keyslot;
+	}
+	dm_udev_batch_end();
+
+	for (i = 0; i < count && !r; i++)
+		if (req[i].r < 0)
+			r = req[i].r;
+
+	pthread_cond_destroy(&b.cond);
+	pthread_mutex_destroy(&b.lock);
+out:
+	if (b.vk)
+		for (i = 0; i < count; i++)
+			crypt_free_volume_key(b.vk[i]);
+	free(b.vk);
+	free(b.memory_kb);
+	free(b.idx);
+	return r;
+}
+
+/*
+ * Activation of device set with one passphrase
+ *
+ * Headers are loaded by several threads (I/O bound), all contexts then
+ * share key derivations, so keyslots cloned from one template header
+ * (the same PBKDF parameters and salt) run the PBKDF only once.
+ * Volume key of every device is still verified by its own digest.
+ */
+#define ACTIVATE_SET_LOAD_THREADS 16
+
+struct activate_set_load {
+	struct crypt_activate_set_device *set;
+	struct crypt_device **cd;
+	size_t count, next;
+	pthread_mutex_t lock;
+};
+
+static void *activate_set_load_thread(void *arg)
+{
+	struct activate_set_load *l = arg;
+	size_t i;
+	int r;
+
+	while (1) {
+		pthread_mutex_lock(&l->lock);
+		i = l->next < l->count ? l->next++ : l->count;
+		pthread_mutex_unlock(&l->lock);
+
+		if (i == l->count)
+			break;
+
+		r = crypt_init(&l->cd[i], l->set[i].device);
+		if (!r)
+			r = crypt_load(l->cd[i], CRYPT_LUKS, NULL);
+		if (r < 0) {
+			crypt_free(l->cd[i]);
+			l->cd[i] = NULL;
+		}
+		l->set[i].r = r;
+	}
+
+	return NULL;
+}
+
+static int activate_set_load(struct activate_set_load *l)
+{
+	pthread_t threads[ACTIVATE_SET_LOAD_THREADS - 1];
+	size_t i, started = 0, nthreads;
+
+	if (pthread_mutex_init(&l->lock, NULL))
+		return -ENOMEM;
+
+	nthreads = l->count < ACTIVATE_SET_LOAD_THREADS ? l->count : ACTIVATE_SET_LOAD_THREADS;
+
+	/* Calling thread is one of the workers */
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[started], NULL, activate_set_load_thread, l))
+			break;
+		started++;
+	}
+
+	activate_set_load_thread(l);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&l->lock);
+	return 0;
+}
+
+int crypt_activate_set(struct crypt_activate_set_device *set, size_t count,
+	const char *passphrase, size_t passphrase_size,
+	const char *key_description, int keyslot, uint32_t flags)
+{
+	struct activate_set_load l = { .set = set, .count = count };
+	struct crypt_activate_request *req = NULL;
+	struct crypt_pbkdf_shared *shared = NULL;
+	char *kr_passphrase = NULL;
+	size_t i, j, *idx = NULL, kr_passphrase_size = 0, n = 0;
+	int r;
+
+	if (!set || !count || (!passphrase && !key_description))
+		return -EINVAL;
+
+	for (i = 0; i < count; i++)
+		if (!set[i].device || !set[i].name)
+			return -EINVAL;
+
+	if (!passphrase) {
+		r = keyring_get_passphrase(key_description, &kr_passphrase, &kr_passphrase_size);
+		if (r < 0) {
+			log_err(NULL, _("Failed to read passphrase from keyring (error %d)."), r);
+			return -EINVAL;
+		}
+		passphrase = kr_passphrase;
+		passphrase_size = kr_passphrase_size;
+	}
+
+	l.cd = calloc(count, sizeof(*l.cd));
+	req = calloc(count, sizeof(*req));
+	idx = calloc(count, sizeof(*idx));
+	if (!l.cd || !req || !idx) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = crypt_pbkdf_shared_init(&shared);
+	if (r < 0)
+		goto out;
+
+	log_dbg("Loading headers of %zu devices in set.", count);
+	r = activate_set_load(&l);
+	if (r < 0)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		if (!l.cd[i])
+			continue;
+		l.cd[i]->pbkdf_shared = shared;
+		req[n].cd = l.cd[i];
+		req[n].name = set[i].name;
+		req[n].keyslot = keyslot;
+		req[n].passphrase = passphrase;
+		req[n].passphrase_size = passphrase_size;
+		req[n].flags = flags;
+		idx[n++] = i;
+	}
+
+	if (n)
+		(void)crypt_activate_batch(req, n);
+
+	for (j = 0; j < n; j++) {
+		set[idx[j]].r = req[j].r;
+		l.cd[idx[j]]->pbkdf_shared = NULL;
+	}
+
+	for (i = 0, r = 0; i < count && !r; i++)
+		if (set[i].r < 0)
+			r = set[i].r;
+out:
+	if (l.cd)
+		for (i = 0; i < count; i++)
+			crypt_free(l.cd[i]);
+	crypt_pbkdf_shared_free(shared);
+	free(l.cd);
+	free(req);
+	free(idx);
+	if (kr_passphrase) {
+		crypt_memzero(kr_passphrase, kr_passphrase_size);
+		free(kr_passphrase);
+	}
+	return r;
+}
+
+/*
+ * Keyslot verification
+ *
+ * Checks are split into contiguous per-worker queues, a worker takes checks
+ * from the head of its own queue and, when it is empty, steals from the tail
+ * of the longest queue. A check is started only if its PBKDF memory cost
+ * fits into half of physical memory together with running checks (or nothing
+ * else runs). Device handle is used only under its lock (metadata, keyslot
+ * area and digest), LUKS2 key derivation runs unlocked, so keyslots of one
+ * device are verified concurrently too.
+ */
+struct verify_batch {
+	struct crypt_keyslot_check *req;
+	uint32_t *memory_kb;
+	size_t *dev;		/* index of device lock of check */
+	pthread_mutex_t *dev_lock;
+	size_t ndevs;
+
+	size_t *idx;		/* checks to run, split into queues */
+	size_t *head, *tail;	/* queue q holds idx[head[q]] .. idx[tail[q] - 1] */
+	unsigned nqueues;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t max_memory_kb, busy_memory_kb;
+	unsigned busy;
+};
+
+struct verify_worker {
+	struct verify_batch *b;
+	unsigned q;
+	pthread_t thread;
+};
+
+static double verify_time_ms(const struct timespec *start)
+{
+	struct timespec end;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &end) < 0)
+		return 0.0;
+
+	return (end.tv_sec - start->tv_sec) * 1000.0 +
+	       (end.tv_nsec - start->tv_nsec) / (1000.0 * 1000);
+}
+
+static int verify_batch_one(struct verify_batch *b, size_t i)
+{
+	struct crypt_keyslot_check *req = &b->req[i];
+	pthread_mutex_t *lock = &b->dev_lock[b->dev[i]];
+	struct crypt_device *cd = req->cd;
+	struct crypt_pbkdf_job job = {};
+	struct volume_key *vk = NULL;
+	struct timespec start;
+	char salt[LUKS_SALTSIZE];
+	int r = -ENOTSUP;
+
+	pthread_mutex_lock(lock);
+	if (isLUKS2(cd->type))
+		r = LUKS2_keyslot_derive_params(cd, &cd->u.luks2.hdr, req->keyslot,
+						CRYPT_ANY_SEGMENT, &job, salt);
+	if (r == -ENOTSUP) {
+		/* LUKS1 (or keyslot without derived key open) runs all locked */
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		r = _open_volume_key_by_passphrase(cd, req->keyslot, req->passphrase,
+				req->passphrase_size, CRYPT_ACTIVATE_ALLOW_UNBOUND_KEY, &vk);
+		req->kdf_ms = verify_time_ms(&start);
+		pthread_mutex_unlock(lock);
+		goto out;
+	}
+	pthread_mutex_unlock(lock);
+	if (r < 0)
+		goto out;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	r = crypt_pbkdf(job.type, job.hash, req->passphrase, req->passphrase_size,
+			job.salt, job.salt_length, job.key->key, job.key->keylength,
+			job.iterations, job.max_memory_kb, job.parallel_threads);
+	req->kdf_ms = verify_time_ms(&start);
+
+	if (!r) {
+		pthread_mutex_lock(lock);
+		r = LUKS2_keyslot_open_by_derived(cd, &cd->u.luks2.hdr, req->keyslot,
+						  CRYPT_ANY_SEGMENT, job.key, &vk);
+		pthread_mutex_unlock(lock);
+	}
+out:
+	crypt_free_volume_key(job.key);
+	crypt_free_volume_key(vk);
+	crypt_memzero(salt, sizeof(salt));
+	return r < 0 ? r : 0;
+}
+
+/* Queue to take the next check from, own queue or the longest one (stolen) */
+static int verify_batch_queue(struct verify_batch *b, unsigned q)
+{
+	unsigned j, victim = q;
+
+	if (b->head[q] < b->tail[q])
+		return q;
+
+	for (j = 0; j < b->nqueues; j++)
+		if (b->tail[j] - b->head[j] > b->tail[victim] - b->head[victim])
+			victim = j;
+
+	return b->head[victim] < b->tail[victim] ? (int)victim : -1;
+}
+
+static void *verify_batch_thread(void *arg)
+{
+	struct verify_worker *w = arg;
+	struct verify_batch *b = w->b;
+	size_t i;
+	int q, r;
+
+	pthread_mutex_lock(&b->lock);
+	while ((q = verify_batch_queue(b, w->q)) >= 0) {
+		/* Own checks are taken from the head, stolen ones from the tail */
+		i = b->idx[q == (int)w->q ? b->head[q] : b->tail[q] - 1];
+
+		if (b->busy && b->busy_memory_kb + b->memory_kb[i] > b->max_memory_kb) {
+			pthread_cond_wait(&b->cond, &b->lock);
+			continue;
+		}
+
+		if (q == (int)w->q)
+			b->head[q]++;
+		else
+			b->tail[q]--;
+		b->busy++;
+		b->busy_memory_kb += b->memory_kb[i];
+		pthread_mutex_unlock(&b->lock);
+
+		r = verify_batch_one(b, i);
+
+		pthread_mutex_lock(&b->lock);
+		b->req[i].r = r;
+		b->busy--;
+		b->busy_memory_kb -= b->memory_kb[i];
+		pthread_cond_broadcast(&b->cond);
+	}
+	pthread_mutex_unlock(&b->lock);
+
+	return NULL;
+}
+
+static int verify_batch_run(struct verify_batch *b, size_t n)
+{
+	struct verify_worker *w;
+	unsigned cpus, q, nthreads = 0;
+	int r = 0;
+
+	cpus = crypt_cpusonline() ?: 1;
+	b->max_memory_kb = crypt_getphysmemory_kb() / 2;
+	b->nqueues = n < cpus ? n : cpus;
+
+	w = calloc(b->nqueues, sizeof(*w));
+	b->head = calloc(b->nqueues, sizeof(*b->head));
+	b->tail = calloc(b->nqueues, sizeof(*b->tail));
+	if (!w || !b->head || !b->tail) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (q = 0; q < b->nqueues; q++) {
+		b->head[q] = q * n / b->nqueues;
+		b->tail[q] = (q + 1) * n / b->nqueues;
+		w[q].b = b;
+		w[q].q = q;
+	}
+
+	/* Calling thread is the first worker, queues without thread are stolen */
+	for (q = 1; q < b->nqueues; q++) {
+		if (pthread_create(&w[q].thread, NULL, verify_batch_thread, &w[q]))
+			break;
+		nthreads++;
+	}
+
+	log_dbg("Verifying %zu keyslots using %u threads.", n, nthreads + 1);
+
+	verify_batch_thread(&w[0]);
+
+	for (q = 1; q <= nthreads; q++)
+		pthread_join(w[q].thread, NULL);
+out:
+	free(b->head);
+	free(b->tail);
+	free(w);
+	return r;
+}
+
+int crypt_keyslot_verify_batch(struct crypt_keyslot_check *req, size_t count)
+{
+	struct verify_batch b = { .req = req };
+	struct crypt_keyslot_check *rq;
+	size_t i, j, n = 0;
+	int r = 0;
+
+	if (!req || !count)
+		return -EINVAL;
+
+	b.memory_kb = calloc(count, sizeof(*b.memory_kb));
+	b.dev = calloc(count, sizeof(*b.dev));
+	b.dev_lock = calloc(count, sizeof(*b.dev_lock));
+	b.idx = calloc(count, sizeof(*b.idx));
+	if (!b.memory_kb || !b.dev || !b.dev_lock || !b.idx) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	if (pthread_mutex_init(&b.lock, NULL)) {
+		r = -ENOMEM;
+		goto out;
+	}
+	if (pthread_cond_init(&b.cond, NULL)) {
+		pthread_mutex_destroy(&b.lock);
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		rq = &req[i];
+		rq->r = -EINVAL;
+		rq->kdf_ms = 0.0;
+
+		if (!rq->cd || !rq->passphrase || rq->keyslot < 0 ||
+		    !(isLUKS1(rq->cd->type) || isLUKS2(rq->cd->type)))
+			continue;
+
+		if (crypt_keyslot_status(rq->cd, rq->keyslot) < CRYPT_SLOT_ACTIVE) {
+			rq->r = -ENOENT;
+			continue;
+		}
+
+		/* One lock per device handle, checks can share a handle */
+		for (j = 0; j < i; j++)
+			if (req[j].cd == rq->cd && !req[j].r)
+				break;
+		if (j < i)
+			b.dev[i] = b.dev[j];
+		else if (pthread_mutex_init(&b.dev_lock[b.ndevs], NULL)) {
+			rq->r = -ENOMEM;
+			continue;
+		} else
+			b.dev[i] = b.ndevs++;
+
+		if (isLUKS2(rq->cd->type))
+			(void)LUKS2_keyslot_pbkdf_memory(rq->cd, &rq->cd->u.luks2.hdr,
+					rq->keyslot, CRYPT_ANY_SEGMENT, &b.memory_kb[i]);
+		rq->r = 0;
+		b.idx[n++] = i;
+	}
+
+	if (n)
+		r = verify_batch_run(&b, n);
+	for (i = 0; r < 0 && i < n; i++)
+		req[b.idx[i]].r = r;
+
+	for (i = 0; i < count && !r; i++)
+		if (req[i].r < 0)
+			r = req[i].r;
+
+	for (i = 0; i < b.ndevs; i++)
+		pthread_mutex_destroy(&b.dev_lock[i]);
+	pthread_cond_destroy(&b.cond);
+	pthread_mutex_destroy(&b.lock);
+out:
+	free(b.memory_kb);
+	free(b.dev);
+	free(b.dev_lock);
+	free(b.idx);
+	return r;
+}
+
+int crypt_deactivate_by_name(struct crypt_device *cd, const char *name, uint32_t flags)
+{
+	char *key_desc;
+	struct crypt_device *fake_cd = NULL;
+	const char *namei = NULL;
+	struct crypt_dm_active_device dmd = {};
+	int r;
+	uint32_t get_flags = DM_ACTIVE_DEVICE | DM_ACTIVE_HOLDERS;
+
+	if (!name)
+		return -EINVAL;
+
+	log_dbg("Deactivating volume %s.", name);
+
+	if (!cd) {
+		r = crypt_init_by_name(&fake_cd, name);
+		if (r < 0)
 			return r;
 		cd = fake_cd;
 	}
@@ -3312,6 +4791,54 @@ int crypt_deactivate_by_name(struct crypt_device *cd, const char *name, uint32_t
 	return r;
 }
 
+/* Holders (possibly other devices in the batch) must be removed first */
+static int _deactivate_has_holders(struct crypt_device *cd, const char *name)
+{
+	struct crypt_dm_active_device dmd = {};
+
+	return dm_query_device(cd, name, DM_ACTIVE_HOLDERS, &dmd) >= 0 && dmd.holders;
+}
+
+int crypt_deactivate_batch(struct crypt_deactivate_request *req, size_t count)
+{
+	size_t i, pending = count, removed;
+	int r = 0;
+
+	if (!req || !count)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++)
+		req[i].r = -EAGAIN;
+
+	dm_udev_batch_begin();
+
+	/* Remove devices in dependency order, top of the stack first */
+	do {
+		removed = 0;
+		for (i = 0; i < count; i++) {
+			if (req[i].r != -EAGAIN ||
+			    (req[i].name && _deactivate_has_holders(req[i].cd, req[i].name)))
+				continue;
+			req[i].r = crypt_deactivate_by_name(req[i].cd, req[i].name, req[i].flags);
+			removed++;
+		}
+		pending -= removed;
+	} while (removed && pending);
+
+	/* Held by devices outside of the batch, follow the flags of request */
+	for (i = 0; i < count && pending; i++)
+		if (req[i].r == -EAGAIN)
+			req[i].r = crypt_deactivate_by_name(req[i].cd, req[i].name, req[i].flags);
+
+	dm_udev_batch_end();
+
+	for (i = 0; i < count && !r; i++)
+		if (req[i].r < 0)
+			r = req[i].r;
+
+	return r;
+}
+
 int crypt_deactivate(struct crypt_device *cd, const char *name)
 {
 	return crypt_deactivate_by_name(cd, name, 0);
@@ -3348,6 +4875,167 @@ int crypt_get_active_device(struct crypt_device *cd, const char *name,
 	return 0;
 }
 
+static const char *active_entry_type(const char *uuid)
+{
+	static const char *types[] = { CRYPT_PLAIN, CRYPT_LOOPAES, CRYPT_LUKS1, CRYPT_LUKS2,
+				       CRYPT_VERITY, CRYPT_TCRYPT, CRYPT_INTEGRITY, NULL };
+	int i;
+
+	for (i = 0; uuid && types[i]; i++)
+		if (!strncmp(types[i], uuid, strlen(types[i])) && uuid[strlen(types[i])] == '-')
+			return types[i];
+
+	return NULL;
+}
+
+/* Move values from dm query to API entry, name and uuid are taken over */
+static int active_entry_fill(struct crypt_active_entry *l, struct crypt_dm_device_entry *e)
+{
+	static const char *targets[] = { "crypt", "verity", "integrity" };
+	char cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN];
+
+	l->name = e->name;
+	l->uuid = CONST_CAST(char*)e->dmd.uuid;
+	e->name = NULL;
+	e->dmd.uuid = NULL;
+	l->type = active_entry_type(l->uuid);
+	if (e->dmd.target < DM_UNKNOWN)
+		l->target = targets[e->dmd.target];
+	if (e->dmd.data_device && !(l->device = strdup(device_path(e->dmd.data_device))))
+		return -ENOMEM;
+	if (e->dmd.target == DM_CRYPT) {
+		l->offset = e->dmd.u.crypt.offset;
+		l->iv_offset = e->dmd.u.crypt.iv_offset;
+		l->sector_size = e->dmd.u.crypt.sector_size;
+		if (e->dmd.u.crypt.vk)
+			l->key_size = e->dmd.u.crypt.vk->keylength;
+		if (e->dmd.u.crypt.cipher &&
+		    !crypt_parse_name_and_mode(e->dmd.u.crypt.cipher, cipher, NULL, cipher_mode)) {
+			l->cipher = strdup(cipher);
+			l->cipher_mode = strdup(cipher_mode);
+			if (!l->cipher || !l->cipher_mode)
+				return -ENOMEM;
+		} else if (e->dmd.u.crypt.cipher && !(l->cipher = strdup(e->dmd.u.crypt.cipher)))
+			return -ENOMEM;
+		if (e->dmd.u.crypt.integrity && !(l->integrity = strdup(e->dmd.u.crypt.integrity)))
+			return -ENOMEM;
+	}
+	l->size = e->dmd.size;
+	l->flags = e->dmd.flags;
+	l->holders = e->dmd.holders;
+	l->integrity_failures = e->integrity_failures;
+	return 0;
+}
+
+int crypt_list_active(struct crypt_device *cd,
+	struct crypt_active_entry **list,
+	size_t *count)
+{
+	struct crypt_dm_device_entry *e;
+	struct crypt_active_entry *l;
+	size_t i, n;
+	int r;
+
+	if (!list || !count)
+		return -EINVAL;
+
+	*list = NULL;
+	*count = 0;
+
+	if (!cd)
+		dm_backend_init();
+
+	r = dm_query_all_devices(cd, DM_ACTIVE_DEVICE | DM_ACTIVE_HOLDERS |
+				 DM_ACTIVE_CRYPT_CIPHER | DM_ACTIVE_CRYPT_KEYSIZE, &e, &n);
+
+	if (!cd)
+		dm_backend_exit();
+
+	if (r < 0 || !n)
+		return r;
+
+	l = calloc(n, sizeof(*l));
+	if (!l) {
+		dm_free_all_devices(e, n);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < n; i++)
+		if (active_entry_fill(&l[i], &e[i])) {
+			dm_free_all_devices(e, n);
+			crypt_list_active_free(l, n);
+			return -ENOMEM;
+		}
+
+	dm_free_all_devices(e, n);
+	*list = l;
+	*count = n;
+	return 0;
+}
+
+int crypt_get_active_entry(struct crypt_device *cd,
+	const char *name,
+	struct crypt_active_entry **entry)
+{
+	struct crypt_dm_device_entry e = {};
+	struct crypt_active_entry *l;
+	int r;
+
+	if (!name || !entry)
+		return -EINVAL;
+
+	*entry = NULL;
+
+	if (!cd)
+		dm_backend_init();
+
+	r = dm_query_device(cd, name, DM_ACTIVE_DEVICE | DM_ACTIVE_UUID | DM_ACTIVE_HOLDERS |
+			    DM_ACTIVE_CRYPT_CIPHER | DM_ACTIVE_CRYPT_KEYSIZE, &e.dmd);
+	if (r >= 0 && e.dmd.target == DM_INTEGRITY)
+		e.integrity_failures = crypt_get_active_integrity_failures(cd, name);
+
+	if (!cd)
+		dm_backend_exit();
+
+	if (r < 0)
+		goto out;
+
+	l = calloc(1, sizeof(*l));
+	if (!l || !(e.name = strdup(name)) || active_entry_fill(l, &e)) {
+		crypt_list_active_free(l, l ? 1 : 0);
+		r = -ENOMEM;
+		goto out;
+	}
+
+	*entry = l;
+	r = 0;
+out:
+	free(e.name);
+	free(CONST_CAST(void*)e.dmd.uuid);
+	device_free(e.dmd.data_device);
+	if (e.dmd.target == DM_CRYPT) {
+		free(CONST_CAST(void*)e.dmd.u.crypt.cipher);
+		free(CONST_CAST(void*)e.dmd.u.crypt.integrity);
+		crypt_free_volume_key(e.dmd.u.crypt.vk);
+	}
+	return r;
+}
+
+void crypt_list_active_free(struct crypt_active_entry *list, size_t count)
+{
+	size_t i;
+
+	for (i = 0; list && i < count; i++) {
+		free(list[i].name);
+		free(list[i].uuid);
+		free(list[i].device);
+		free(list[i].cipher);
+		free(list[i].cipher_mode);
+		free(list[i].integrity);
+	}
+	free(list);
+}
+
 uint64_t crypt_get_active_integrity_failures(struct crypt_device *cd, const char *name)
 {
 	struct crypt_dm_active_device dmd;
@@ -3438,24 +5126,119 @@ int crypt_volume_key_verify(struct crypt_device *cd,
 	struct volume_key *vk;
 	int r;
 
-	if ((r = _onlyLUKS(cd, CRYPT_CD_UNRESTRICTED)))
-		return r;
+	if ((r = _onlyLUKS(cd, CRYPT_CD_UNRESTRICTED)))
+		return r;
+
+	vk = crypt_alloc_volume_key(volume_key_size, volume_key);
+	if (!vk)
+		return -ENOMEM;
+
+	if (isLUKS1(cd->type))
+		r = LUKS_verify_volume_key(&cd->u.luks1.hdr, vk);
+	else if (isLUKS2(cd->type))
+		r = LUKS2_digest_verify_by_segment(cd, &cd->u.luks2.hdr, CRYPT_DEFAULT_SEGMENT, vk);
+
+	if (r == -EPERM)
+		log_err(cd, _("Volume key does not match the volume."));
+
+	crypt_free_volume_key(vk);
+
+	return r >= 0 ? 0 : r;
+}
+
+/*
+ * Userspace data area encryption (compatible with dm-crypt mapping of the device)
+ */
+struct crypt_data_cipher {
+	struct crypt_storage *s;	/* NULL for cipher_null */
+	uint64_t iv_offset;
+	size_t sector_size;
+};
+
+int crypt_data_cipher_init(struct crypt_device *cd,
+	struct crypt_data_cipher **ctx,
+	const char *volume_key,
+	size_t volume_key_size)
+{
+	struct crypt_data_cipher *c;
+	const char *cipher, *cipher_mode;
+	int r;
+
+	if (!ctx || !volume_key)
+		return -EINVAL;
+
+	if ((r = crypt_volume_key_verify(cd, volume_key, volume_key_size)))
+		return r;
+
+	cipher = crypt_get_cipher(cd);
+	cipher_mode = crypt_get_cipher_mode(cd);
+	if (!cipher || !cipher_mode)
+		return -EINVAL;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return -ENOMEM;
+
+	c->iv_offset = crypt_get_iv_offset(cd);
+	c->sector_size = crypt_get_sector_size(cd);
+
+	if (strcmp(cipher, "cipher_null")) {
+		r = crypt_storage_init_sector(&c->s, 0, c->sector_size, cipher,
+					      cipher_mode, volume_key, volume_key_size);
+		if (r) {
+			log_dbg("Userspace cipher %s-%s is not available (%d).",
+				cipher, cipher_mode, r);
+			free(c);
+			return r;
+		}
+	}
+
+	*ctx = c;
+	return 0;
+}
+
+static int crypt_data_cipher_run(struct crypt_data_cipher *ctx,
+	uint64_t offset, char *buffer, size_t length, bool encrypt)
+{
+	uint64_t sector;
+
+	if (!ctx || !buffer || offset % ctx->sector_size || length % ctx->sector_size)
+		return -EINVAL;
+
+	if (!ctx->s || !length)
+		return 0;
 
-	vk = crypt_alloc_volume_key(volume_key_size, volume_key);
-	if (!vk)
-		return -ENOMEM;
+	sector = ctx->iv_offset + (offset >> SECTOR_SHIFT);
 
-	if (isLUKS1(cd->type))
-		r = LUKS_verify_volume_key(&cd->u.luks1.hdr, vk);
-	else if (isLUKS2(cd->type))
-		r = LUKS2_digest_verify_by_segment(cd, &cd->u.luks2.hdr, CRYPT_DEFAULT_SEGMENT, vk);
+	return encrypt ?
+		crypt_storage_encrypt(ctx->s, sector, length >> SECTOR_SHIFT, buffer) :
+		crypt_storage_decrypt(ctx->s, sector, length >> SECTOR_SHIFT, buffer);
+}
 
-	if (r == -EPERM)
-		log_err(cd, _("Volume key does not match the volume."));
+int crypt_data_cipher_encrypt(struct crypt_data_cipher *ctx,
+	uint64_t offset, char *buffer, size_t length)
+{
+	return crypt_data_cipher_run(ctx, offset, buffer, length, true);
+}
 
-	crypt_free_volume_key(vk);
+int crypt_data_cipher_decrypt(struct crypt_data_cipher *ctx,
+	uint64_t offset, char *buffer, size_t length)
+{
+	return crypt_data_cipher_run(ctx, offset, buffer, length, false);
+}
 
-	return r >= 0 ? 0 : r;
+size_t crypt_data_cipher_sector_size(struct crypt_data_cipher *ctx)
+{
+	return ctx ? ctx->sector_size : SECTOR_SIZE;
+}
+
+void crypt_data_cipher_free(struct crypt_data_cipher *ctx)
+{
+	if (!ctx)
+		return;
+
+	crypt_storage_destroy(ctx->s);
+	free(ctx);
 }
 
 /*
@@ -3938,6 +5721,123 @@ int crypt_get_verity_info(struct crypt_device *cd,
 	return 0;
 }
 
+int crypt_verity_update(struct crypt_device *cd,
+	const struct crypt_verity_range *ranges,
+	size_t count,
+	char *root_hash,
+	size_t root_hash_size)
+{
+	struct crypt_verity_range *fec_blocks = NULL;
+	size_t fec_count = 0;
+	int r;
+
+	if (!cd || !isVERITY(cd->type) || !ranges || !count || !root_hash)
+		return -EINVAL;
+
+	if (root_hash_size != cd->u.verity.root_hash_size) {
+		log_err(cd, _("Incorrect root hash specified for verity device."));
+		return -EINVAL;
+	}
+
+	r = VERITY_update(cd, &cd->u.verity.hdr, ranges, count,
+			  root_hash, root_hash_size,
+			  cd->u.verity.fec_device ? &fec_blocks : NULL, &fec_count);
+	if (!r && cd->u.verity.fec_device)
+		r = VERITY_FEC_update(cd, &cd->u.verity.hdr, cd->u.verity.fec_device,
+				      fec_blocks, fec_count);
+	free(fec_blocks);
+	if (r)
+		return r;
+
+	if (!cd->u.verity.root_hash)
+		cd->u.verity.root_hash = malloc(root_hash_size);
+	if (cd->u.verity.root_hash)
+		memcpy(cd->u.verity.root_hash, root_hash, root_hash_size);
+
+	return 0;
+}
+
+int crypt_verity_repair(struct crypt_device *cd,
+	const struct crypt_verity_range *ranges,
+	size_t count,
+	unsigned int *errors)
+{
+	if (!cd || !isVERITY(cd->type) || !ranges || !count)
+		return -EINVAL;
+
+	if (!cd->u.verity.fec_device) {
+		log_err(cd, _("No FEC device set for verity device."));
+		return -EINVAL;
+	}
+
+	return VERITY_FEC_repair(cd, &cd->u.verity.hdr, cd->u.verity.fec_device,
+				 ranges, count, errors);
+}
+
+int crypt_verity_verify_repair(struct crypt_device *cd,
+	const char *root_hash,
+	size_t root_hash_size,
+	uint64_t *repaired,
+	uint64_t *unrecoverable)
+{
+	if (!cd || !isVERITY(cd->type) || !root_hash)
+		return -EINVAL;
+
+	if (root_hash_size != cd->u.verity.root_hash_size) {
+		log_err(cd, _("Incorrect root hash specified for verity device."));
+		return -EINVAL;
+	}
+
+	return VERITY_verify_repair(cd, &cd->u.verity.hdr, cd->u.verity.fec_device,
+				    root_hash, root_hash_size, repaired, unrecoverable);
+}
+
+int crypt_verity_set_threads(struct crypt_device *cd, uint32_t threads)
+{
+	if (!cd || threads > CRYPT_VERITY_THREADS_MAX)
+		return -EINVAL;
+
+	log_dbg("Setting verity hash threads to %u.", threads);
+	cd->verity_threads = threads;
+	return 0;
+}
+
+int crypt_verity_set_sample(struct crypt_device *cd, uint32_t sample_percent)
+{
+	if (!cd || sample_percent > 100)
+		return -EINVAL;
+
+	cd->verity_sample_percent = sample_percent;
+	return 0;
+}
+
+int crypt_verity_set_data_fd(struct crypt_device *cd, int fd)
+{
+	if (!cd || fd < -1)
+		return -EINVAL;
+
+	cd->verity_data_fd = fd;
+	return 0;
+}
+
+int crypt_verity_preload(struct crypt_device *cd,
+	const char *name,
+	uint32_t leaf_percent,
+	uint32_t flags)
+{
+	if (!cd || !isVERITY(cd->type) || leaf_percent > 100)
+		return -EINVAL;
+
+	if ((flags & CRYPT_VERITY_PRELOAD_VERIFY) && !cd->u.verity.root_hash) {
+		log_err(cd, _("Root hash of verity device is not known."));
+		return -EINVAL;
+	}
+
+	return VERITY_preload(cd, &cd->u.verity.hdr, name,
+			      cd->u.verity.root_hash, cd->u.verity.root_hash_size,
+			      leaf_percent, flags & CRYPT_VERITY_PRELOAD_VERIFY);
+}
+
 int crypt_get_integrity_info(struct crypt_device *cd,
 	struct crypt_params_integrity *ip)
 {
@@ -3989,6 +5889,32 @@ int crypt_get_integrity_info(struct crypt_device *cd,
 	return -ENOTSUP;
 }
 
+int crypt_integrity_set_bitmap(struct crypt_device *cd,
+	uint32_t sectors_per_bit,
+	uint32_t flush_time)
+{
+	if (!cd)
+		return -EINVAL;
+
+	log_dbg("Setting integrity bitmap to %u sectors per bit, flush time %u ms.",
+		sectors_per_bit, flush_time);
+	cd->integrity_bitmap_sectors_per_bit = sectors_per_bit;
+	cd->integrity_bitmap_flush_time = flush_time;
+	return 0;
+}
+
+int crypt_get_integrity_bitmap(struct crypt_device *cd,
+	uint32_t *sectors_per_bit,
+	uint32_t *flush_time)
+{
+	if (!cd || !sectors_per_bit || !flush_time)
+		return -EINVAL;
+
+	*sectors_per_bit = cd->integrity_bitmap_sectors_per_bit;
+	*flush_time = cd->integrity_bitmap_flush_time;
+	return 0;
+}
+
 int crypt_convert(struct crypt_device *cd,
 		  const char *type,
 		  void *params)
@@ -4396,14 +6322,14 @@ out:
  * Keyring handling
  */
 
-static int kernel_keyring_support(void)
+static void kernel_keyring_check(void)
 {
-	static unsigned _checked = 0;
+	_kernel_keyring_supported = keyring_check();
+}
 
-	if (!_checked) {
-		_kernel_keyring_supported = keyring_check();
-		_checked = 1;
-	}
+static int kernel_keyring_support(void)
+{
+	pthread_once(&_kernel_keyring_once, kernel_keyring_check);
 
 	return _kernel_keyring_supported;
 }
@@ -4417,6 +6343,31 @@ static int dmcrypt_keyring_bug(void)
 	return kversion < version(4,15,0,0);
 }
 
+int crypt_unlock_serial(const struct crypt_device *cd)
+{
+	return cd ? cd->unlock_serial : 0;
+}
+
+unsigned crypt_get_verity_threads(struct crypt_device *cd)
+{
+	return cd ? cd->verity_threads : 0;
+}
+
+uint32_t crypt_get_verity_sample(struct crypt_device *cd)
+{
+	return cd ? cd->verity_sample_percent : 0;
+}
+
+int crypt_get_verity_data_fd(struct crypt_device *cd)
+{
+	return cd ? cd->verity_data_fd : -1;
+}
+
+struct crypt_pbkdf_shared *crypt_get_pbkdf_shared(const struct crypt_device *cd)
+{
+	return cd ? cd->pbkdf_shared : NULL;
+}
+
 int crypt_use_keyring_for_vk(const struct crypt_device *cd)
 {
 	uint32_t dmc_flags;
@@ -4434,6 +6385,88 @@ int crypt_use_keyring_for_vk(const struct crypt_device *cd)
 	return (dmc_flags & DM_KERNEL_KEYRING_SUPPORTED);
 }
 
+int crypt_set_metadata_cache(struct crypt_device *cd, int enable)
+{
+	if (!cd)
+		return -EINVAL;
+
+	cd->metadata_cache = enable ? 1 : 0;
+	return 0;
+}
+
+int crypt_set_metadata_limits(struct crypt_device *cd,
+	const struct crypt_metadata_limits *limits)
+{
+	if (!cd)
+		return -EINVAL;
+
+	if (limits)
+		cd->metadata_limits = *limits;
+	else
+		memset(&cd->metadata_limits, 0, sizeof(cd->metadata_limits));
+
+	log_dbg("LUKS2 metadata limits: depth %u, objects %u, time %u ms.",
+		cd->metadata_limits.max_depth, cd->metadata_limits.max_objects,
+		cd->metadata_limits.max_time_ms);
+	return 0;
+}
+
+/* internal only */
+const struct crypt_metadata_limits *crypt_get_metadata_limits(struct crypt_device *cd)
+{
+	static const struct crypt_metadata_limits defaults = {};
+
+	return cd ? &cd->metadata_limits : &defaults;
+}
+
+int crypt_header_transaction_begin(struct crypt_device *cd)
+{
+	if (!cd || !isLUKS2(cd->type) || cd->hdr_transaction)
+		return -EINVAL;
+
+	log_dbg("Starting LUKS2 header transaction.");
+
+	cd->hdr_transaction = 1;
+	cd->hdr_transaction_dirty = 0;
+	cd->hdr_transaction_failed = 0;
+	return 0;
+}
+
+int crypt_header_transaction_commit(struct crypt_device *cd)
+{
+	int r = 0;
+
+	if (!cd || !isLUKS2(cd->type) || !cd->hdr_transaction)
+		return -EINVAL;
+
+	cd->hdr_transaction = 0;
+
+	if (cd->hdr_transaction_failed) {
+		log_dbg("LUKS2 header transaction failed, no changes written.");
+		_luks2_reload(cd);
+		r = -EINVAL;
+	} else if (cd->hdr_transaction_dirty) {
+		log_dbg("Committing LUKS2 header transaction.");
+		r = LUKS2_hdr_write(cd, &cd->u.luks2.hdr);
+		if (r < 0)
+			_luks2_reload(cd);
+	}
+
+	cd->hdr_transaction_dirty = 0;
+	cd->hdr_transaction_failed = 0;
+	return r;
+}
+
+/* internal only */
+int crypt_header_transaction_defer(struct crypt_device *cd)
+{
+	if (!cd || !cd->hdr_transaction)
+		return 0;
+
+	cd->hdr_transaction_dirty = 1;
+	return 1;
+}
+
 int crypt_volume_key_keyring(struct crypt_device *cd, int enable)
 {
 	_vk_via_keyring = enable ? 1 : 0;
@@ -4453,16 +6486,35 @@ int crypt_volume_key_load_in_keyring(struct crypt_device *cd, struct volume_key
 		return -EINVAL;
 	}
 
+	/*
+	 * Description is bound to verified digest, the same description means
+	 * the same key. It is uploaded only once per handle and thread
+	 * (thread keyring), refresh, resume and stacked devices reuse it.
+	 */
+	if (cd->key_in_keyring && cd->keyring_key_desc &&
+	    pthread_equal(cd->keyring_key_thread, pthread_self()) &&
+	    !strcmp(cd->keyring_key_desc, vk->key_description)) {
+		log_dbg("Key %s is already loaded in thread keyring.", vk->key_description);
+		return 0;
+	}
+
 	log_dbg("Loading key (%zu bytes) in thread keyring.", vk->keylength);
 
+	crypt_trace(cd, CRYPT_TRACE_KEYRING, 0, 0);
 	r = keyring_add_key_in_thread_keyring(vk->key_description, vk->key, vk->keylength);
+	crypt_trace(cd, CRYPT_TRACE_KEYRING, 1, vk->keylength);
 	if (r) {
 		log_dbg("keyring_add_key_in_thread_keyring failed (error %d)", r);
 		log_err(cd, _("Failed to load key in kernel keyring."));
-	} else
-		crypt_set_key_in_keyring(cd, 1);
+		return r;
+	}
 
-	return r;
+	crypt_set_key_in_keyring(cd, 1);
+	free(cd->keyring_key_desc);
+	cd->keyring_key_desc = strdup(vk->key_description);
+	cd->keyring_key_thread = pthread_self();
+
+	return 0;
 }
 
 /* internal only */
@@ -4478,6 +6530,10 @@ void crypt_set_key_in_keyring(struct crypt_device *cd, unsigned key_in_keyring)
 		return;
 
 	cd->key_in_keyring = key_in_keyring;
+	if (!key_in_keyring) {
+		free(cd->keyring_key_desc);
+		cd->keyring_key_desc = NULL;
+	}
 }
 
 /* internal only */
@@ -4535,6 +6591,121 @@ int crypt_activate_by_keyring(struct crypt_device *cd,
 	return r;
 }
 
+int crypt_reencrypt_init_by_passphrase(struct crypt_device *cd,
+	const char *name,
+	const char *passphrase,
+	size_t passphrase_size,
+	int keyslot_old,
+	int keyslot_new,
+	const char *cipher,
+	const char *cipher_mode,
+	const struct crypt_params_reencrypt *params)
+{
+	struct crypt_dm_active_device dmd = {};
+	uint32_t flags = 0;
+	int r;
+
+	if (!passphrase)
+		return -EINVAL;
+
+	if ((r = _onlyLUKS2(cd, CRYPT_CD_UNRESTRICTED)))
+		return r;
+
+	log_dbg("Initializing online reencryption of device %s%s%s.",
+		mdata_device_path(cd) ?: "", name ? " active as " : "", name ?: "");
+
+	if (name) {
+		r = dm_query_device(cd, name, DM_ACTIVE_UUID, &dmd);
+		if (r < 0) {
+			log_err(cd, _("Device %s is not active."), name);
+			return -EINVAL;
+		}
+
+		r = crypt_uuid_cmp(dmd.uuid, cd->u.luks2.hdr.uuid);
+		flags = dmd.flags;
+		free(CONST_CAST(void*)dmd.uuid);
+		if (r) {
+			log_err(cd, _("Device %s does not match LUKS2 header."), name);
+			return -EINVAL;
+		}
+	}
+
+	r = LUKS2_reencrypt_init(cd, &cd->u.luks2.hdr, name, passphrase, passphrase_size,
+				 keyslot_old, keyslot_new, cipher, cipher_mode, params,
+				 flags, &cd->u.luks2.rh);
+	if (r < 0)
+		_luks2_reload(cd);
+
+	return r;
+}
+
+int crypt_reencrypt(struct crypt_device *cd,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+	void *usrptr)
+{
+	int r;
+
+	if ((r = _onlyLUKS2(cd, CRYPT_CD_UNRESTRICTED)))
+		return r;
+
+	if (!cd->u.luks2.rh) {
+		log_err(cd, _("Online reencryption is not initialized."));
+		return -EINVAL;
+	}
+
+	if (cd->progress) {
+		struct crypt_progress_wrap pw = { cd, progress, usrptr };
+
+		crypt_progress_start(cd, "reencrypt");
+		r = LUKS2_reencrypt_run(cd, &cd->u.luks2.hdr, cd->u.luks2.rh,
+					crypt_progress_wrapped, &pw);
+	} else
+		r = LUKS2_reencrypt_run(cd, &cd->u.luks2.hdr, cd->u.luks2.rh, progress, usrptr);
+	if (r < 0) {
+		_luks2_reload(cd);
+		return r;
+	}
+
+	LUKS2_reencrypt_free(cd->u.luks2.rh);
+	cd->u.luks2.rh = NULL;
+
+	return 0;
+}
+
+int crypt_reencrypt_checkpoint_set(struct crypt_device *cd,
+	const struct crypt_params_reencrypt_checkpoint *cp)
+{
+	int r;
+
+	if ((r = _onlyLUKS2(cd, CRYPT_CD_UNRESTRICTED)))
+		return r;
+
+	if (cp)
+		log_dbg("Storing reencryption checkpoint at offset %" PRIu64 ".", cp->offset);
+	else
+		log_dbg("Removing reencryption checkpoint.");
+
+	r = LUKS2_config_set_checkpoint(cd, &cd->u.luks2.hdr, cp);
+	if (r < 0)
+		_luks2_reload(cd);
+
+	return r;
+}
+
+int crypt_reencrypt_checkpoint_get(struct crypt_device *cd,
+	struct crypt_params_reencrypt_checkpoint *cp)
+{
+	int r;
+
+	if (!cp)
+		return -EINVAL;
+
+	if ((r = _onlyLUKS2(cd, CRYPT_CD_QUIET | CRYPT_CD_UNRESTRICTED)))
+		return r;
+
+	return LUKS2_config_get_checkpoint(cd, &cd->u.luks2.hdr, cp);
+}
+
 static void __attribute__((destructor)) libcryptsetup_exit(void)
 {
 	crypt_backend_destroy();
@@ -25,6 +25,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "libcryptsetup.h"
 #include "tcrypt.h"
@@ -54,6 +55,8 @@ static const struct {
 	{ 0, 0,     NULL,        NULL,      0,     0,    0 }
 };
 
+#define TCRYPT_KDF_COUNT (sizeof(tcrypt_kdf) / sizeof(tcrypt_kdf[0]))
+
 struct tcrypt_alg {
 		const char *name;
 		unsigned int key_size;
@@ -240,6 +243,76 @@ static int TCRYPT_hdr_from_disk(struct tcrypt_phdr *hdr,
 /*
  * Kernel implements just big-endian version of blowfish, hack it here
  */
+/*
+ * Cipher contexts reused by one trial thread for all header decryption attempts,
+ * a context is only re-keyed (no new AF_ALG socket and algorithm lookup).
+ * Unavailable algorithms are remembered as well.
+ */
+#define TCRYPT_CIPHER_POOL_SIZE 16
+
+struct tcrypt_cipher_pool {
+	struct {
+		const char *name;
+		char mode[MAX_CIPHER_LEN + 1];
+		struct crypt_cipher *cipher;
+		int r;
+	} entry[TCRYPT_CIPHER_POOL_SIZE];
+	unsigned int count;
+};
+
+static void TCRYPT_cipher_pool_destroy(struct tcrypt_cipher_pool *pool)
+{
+	unsigned int i;
+
+	for (i = 0; i < pool->count; i++)
+		if (pool->entry[i].cipher)
+			crypt_cipher_destroy(pool->entry[i].cipher);
+	memset(pool, 0, sizeof(*pool));
+}
+
+static int TCRYPT_cipher_get(struct tcrypt_cipher_pool *pool, struct crypt_cipher **cipher,
+			     const char *name, const char *mode,
+			     const char *key, size_t key_size)
+{
+	unsigned int i;
+	int r;
+
+	for (i = 0; pool && i < pool->count; i++) {
+		if (strcmp(pool->entry[i].name, name) || strcmp(pool->entry[i].mode, mode))
+			continue;
+		if (pool->entry[i].r < 0)
+			return pool->entry[i].r;
+		*cipher = pool->entry[i].cipher;
+		return crypt_cipher_setkey(*cipher, key, key_size);
+	}
+
+	r = crypt_cipher_init(cipher, name, mode, key, key_size);
+
+	/* Wrong key cannot happen for table ciphers, cache only success or missing algorithm */
+	if (pool && pool->count < TCRYPT_CIPHER_POOL_SIZE &&
+	    (!r || r == -ENOENT || r == -ENOTSUP)) {
+		pool->entry[pool->count].name = name;
+		strncpy(pool->entry[pool->count].mode, mode, MAX_CIPHER_LEN);
+		pool->entry[pool->count].cipher = r ? NULL : *cipher;
+		pool->entry[pool->count].r = r;
+		pool->count++;
+	}
+
+	return r;
+}
+
+/* Contexts not stored in pool are destroyed */
+static void TCRYPT_cipher_put(struct tcrypt_cipher_pool *pool, struct crypt_cipher *cipher)
+{
+	unsigned int i;
+
+	for (i = 0; pool && i < pool->count; i++)
+		if (pool->entry[i].cipher == cipher)
+			return;
+
+	crypt_cipher_destroy(cipher);
+}
+
 static void TCRYPT_swab_le(char *buf)
 {
 	uint32_t *l = (uint32_t*)&buf[0];
@@ -248,7 +321,7 @@ static void TCRYPT_swab_le(char *buf)
 	*r = swab32(*r);
 }
 
-static int decrypt_blowfish_le_cbc(struct tcrypt_alg *alg,
+static int decrypt_blowfish_le_cbc(struct tcrypt_cipher_pool *pool, struct tcrypt_alg *alg,
 				   const char *key, char *buf)
 {
 	int bs = alg->iv_size;
@@ -258,7 +331,7 @@ static int decrypt_blowfish_le_cbc(struct tcrypt_alg *alg,
 
 	assert(bs == 2*sizeof(uint32_t));
 
-	r = crypt_cipher_init(&cipher, "blowfish", "ecb",
+	r = TCRYPT_cipher_get(pool, &cipher, "blowfish", "ecb",
 			      &key[alg->key_offset], alg->key_size);
 	if (r < 0)
 		return r;
@@ -277,7 +350,7 @@ static int decrypt_blowfish_le_cbc(struct tcrypt_alg *alg,
 		memcpy(iv, iv_old, bs);
 	}
 
-	crypt_cipher_destroy(cipher);
+	TCRYPT_cipher_put(pool, cipher);
 	crypt_memzero(iv, bs);
 	crypt_memzero(iv_old, bs);
 	return r;
@@ -311,13 +384,14 @@ static void TCRYPT_copy_key(struct tcrypt_alg *alg, const char *mode,
 	}
 }
 
-static int TCRYPT_decrypt_hdr_one(struct tcrypt_alg *alg, const char *mode,
+static int TCRYPT_decrypt_hdr_one(struct tcrypt_cipher_pool *pool,
+				   struct tcrypt_alg *alg, const char *mode,
 				   const char *key,struct tcrypt_phdr *hdr)
 {
 	char backend_key[TCRYPT_HDR_KEY_LEN];
 	char iv[TCRYPT_HDR_IV_LEN] = {};
 	char mode_name[MAX_CIPHER_LEN + 1];
-	struct crypt_cipher *cipher;
+	struct crypt_cipher *cipher = NULL;
 	char *c, *buf = (char*)&hdr->e;
 	int r;
 
@@ -333,18 +407,18 @@ static int TCRYPT_decrypt_hdr_one(struct tcrypt_alg *alg, const char *mode,
 	else if (!strncmp(mode, "cbc", 3)) {
 		TCRYPT_remove_whitening(buf, &key[8]);
 		if (!strcmp(alg->name, "blowfish_le"))
-			return decrypt_blowfish_le_cbc(alg, key, buf);
+			return decrypt_blowfish_le_cbc(pool, alg, key, buf);
 		memcpy(iv, &key[alg->iv_offset], alg->iv_size);
 	}
 
 	TCRYPT_copy_key(alg, mode, backend_key, key);
-	r = crypt_cipher_init(&cipher, alg->name, mode_name,
+	r = TCRYPT_cipher_get(pool, &cipher, alg->name, mode_name,
 			      backend_key, alg->key_size);
-	if (!r) {
+	if (!r)
 		r = crypt_cipher_decrypt(cipher, buf, buf, TCRYPT_HDR_LEN,
 					 iv, alg->iv_size);
-		crypt_cipher_destroy(cipher);
-	}
+	if (cipher)
+		TCRYPT_cipher_put(pool, cipher);
 
 	crypt_memzero(backend_key, sizeof(backend_key));
 	crypt_memzero(iv, TCRYPT_HDR_IV_LEN);
@@ -355,7 +429,7 @@ static int TCRYPT_decrypt_hdr_one(struct tcrypt_alg *alg, const char *mode,
  * For chained ciphers and CBC mode we need "outer" decryption.
  * Backend doesn't provide this, so implement it here directly using ECB.
  */
-static int TCRYPT_decrypt_cbci(struct tcrypt_algs *ciphers,
+static int TCRYPT_decrypt_cbci(struct tcrypt_cipher_pool *pool, struct tcrypt_algs *ciphers,
 				const char *key, struct tcrypt_phdr *hdr)
 {
 	struct crypt_cipher *cipher[ciphers->chain_count];
@@ -372,7 +446,7 @@ static int TCRYPT_decrypt_cbci(struct tcrypt_algs *ciphers,
 	for (j = 0; j < ciphers->chain_count; j++)
 		cipher[j] = NULL;
 	for (j = 0; j < ciphers->chain_count; j++) {
-		r = crypt_cipher_init(&cipher[j], ciphers->cipher[j].name, "ecb",
+		r = TCRYPT_cipher_get(pool, &cipher[j], ciphers->cipher[j].name, "ecb",
 				      &key[ciphers->cipher[j].key_offset],
 				      ciphers->cipher[j].key_size);
 		if (r < 0)
@@ -395,38 +469,155 @@ static int TCRYPT_decrypt_cbci(struct tcrypt_algs *ciphers,
 out:
 	for (j = 0; j < ciphers->chain_count; j++)
 		if (cipher[j])
-			crypt_cipher_destroy(cipher[j]);
+			TCRYPT_cipher_put(pool, cipher[j]);
 
 	crypt_memzero(iv, bs);
 	crypt_memzero(iv_old, bs);
 	return r;
 }
 
-static int TCRYPT_decrypt_hdr(struct crypt_device *cd, struct tcrypt_phdr *hdr,
-			       const char *key, uint32_t flags)
+/* Returns 1 if signature matches, 0 if it does not, negative errno on failure */
+static int TCRYPT_decrypt_hdr_chain(struct tcrypt_cipher_pool *pool,
+				   unsigned int i, const char *key,
+				   const struct tcrypt_phdr *hdr,
+				   struct tcrypt_phdr *hdr2, uint32_t flags)
+{
+	int j, r = -EINVAL;
+
+	log_dbg("TCRYPT:  trying cipher %s-%s",
+		tcrypt_cipher[i].long_name, tcrypt_cipher[i].mode);
+
+	memcpy(&hdr2->e, &hdr->e, TCRYPT_HDR_LEN);
+
+	if (!strncmp(tcrypt_cipher[i].mode, "cbci", 4))
+		r = TCRYPT_decrypt_cbci(pool, &tcrypt_cipher[i], key, hdr2);
+	else for (j = tcrypt_cipher[i].chain_count - 1; j >= 0 ; j--) {
+		if (!tcrypt_cipher[i].cipher[j].name)
+			continue;
+		r = TCRYPT_decrypt_hdr_one(pool, &tcrypt_cipher[i].cipher[j],
+				    tcrypt_cipher[i].mode, key, hdr2);
+		if (r < 0)
+			break;
+	}
+
+	if (r < 0)
+		return r;
+
+	if (!strncmp(hdr2->d.magic, TCRYPT_HDR_MAGIC, TCRYPT_HDR_MAGIC_LEN)) {
+		log_dbg("TCRYPT: Signature magic detected.");
+		return 1;
+	}
+	if ((flags & CRYPT_TCRYPT_VERA_MODES) &&
+	     !strncmp(hdr2->d.magic, VCRYPT_HDR_MAGIC, TCRYPT_HDR_MAGIC_LEN)) {
+		log_dbg("TCRYPT: Signature magic detected (Veracrypt).");
+		return 1;
+	}
+
+	return 0;
+}
+
+#define TCRYPT_CIPHER_COUNT (sizeof(tcrypt_cipher) / sizeof(tcrypt_cipher[0]))
+
+/*
+ * Cipher chain trials for one derived key, shared by all trial threads.
+ * Chains are taken in table order, nothing after the first matching
+ * (or unsupported) chain is started.
+ */
+struct tcrypt_trials {
+	const struct tcrypt_phdr *hdr;
+	const char *key;
+	uint32_t flags;
+
+	unsigned int chain[TCRYPT_CIPHER_COUNT];
+	int r[TCRYPT_CIPHER_COUNT];
+	unsigned int count, next, found;
+	struct tcrypt_phdr hdr_found;
+
+	pthread_mutex_t lock;
+};
+
+struct tcrypt_trials_worker {
+	struct tcrypt_trials *t;
+	struct tcrypt_cipher_pool *pool;
+	pthread_t thread;
+};
+
+static void *TCRYPT_trials_thread(void *arg)
 {
+	struct tcrypt_trials_worker *w = arg;
+	struct tcrypt_trials *t = w->t;
 	struct tcrypt_phdr hdr2;
-	int i, j, r = -EINVAL;
+	unsigned int n;
+	int r;
+
+	pthread_mutex_lock(&t->lock);
+	while (t->next < t->count && t->next < t->found) {
+		n = t->next++;
+		pthread_mutex_unlock(&t->lock);
+
+		r = TCRYPT_decrypt_hdr_chain(w->pool, t->chain[n], t->key, t->hdr, &hdr2, t->flags);
+
+		pthread_mutex_lock(&t->lock);
+		t->r[n] = r;
+		if ((r == 1 || r == -ENOTSUP) && n < t->found) {
+			t->found = n;
+			if (r == 1)
+				memcpy(&t->hdr_found.e, &hdr2.e, TCRYPT_HDR_LEN);
+		}
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	crypt_memzero(&hdr2, sizeof(hdr2));
+	return NULL;
+}
+
+/*
+ * Each trial thread uses its own cipher pool (pools[0] is used by the calling
+ * thread), so contexts can be reused by caller for another header key.
+ */
+static int TCRYPT_decrypt_hdr(struct crypt_device *cd, struct tcrypt_phdr *hdr,
+			       const char *key, uint32_t flags,
+			       struct tcrypt_cipher_pool *pools, unsigned int pool_count)
+{
+	struct tcrypt_trials t = { .hdr = hdr, .key = key, .flags = flags };
+	struct tcrypt_trials_worker w[TCRYPT_CIPHER_COUNT];
+	unsigned int i, n, nthreads;
+	int r = -EINVAL;
 
 	for (i = 0; tcrypt_cipher[i].chain_count; i++) {
 		if (!(flags & CRYPT_TCRYPT_LEGACY_MODES) && tcrypt_cipher[i].legacy)
 			continue;
-		log_dbg("TCRYPT:  trying cipher %s-%s",
-			tcrypt_cipher[i].long_name, tcrypt_cipher[i].mode);
+		t.chain[t.count++] = i;
+	}
+	t.found = t.count;
 
-		memcpy(&hdr2.e, &hdr->e, TCRYPT_HDR_LEN);
+	if (pthread_mutex_init(&t.lock, NULL))
+		return -ENOMEM;
 
-		if (!strncmp(tcrypt_cipher[i].mode, "cbci", 4))
-			r = TCRYPT_decrypt_cbci(&tcrypt_cipher[i], key, &hdr2);
-		else for (j = tcrypt_cipher[i].chain_count - 1; j >= 0 ; j--) {
-			if (!tcrypt_cipher[i].cipher[j].name)
-				continue;
-			r = TCRYPT_decrypt_hdr_one(&tcrypt_cipher[i].cipher[j],
-					    tcrypt_cipher[i].mode, key, &hdr2);
-			if (r < 0)
-				break;
-		}
+	/* The calling thread runs trials as well */
+	nthreads = crypt_cpusonline();
+	if (nthreads > t.count)
+		nthreads = t.count;
+	if (pools && nthreads > pool_count)
+		nthreads = pool_count;
+	for (n = 0; n < TCRYPT_CIPHER_COUNT; n++) {
+		w[n].t = &t;
+		w[n].pool = pools && n < pool_count ? &pools[n] : NULL;
+	}
+	for (n = 1; n < nthreads; n++)
+		if (pthread_create(&w[n].thread, NULL, TCRYPT_trials_thread, &w[n]))
+			break;
+	nthreads = n;
+
+	TCRYPT_trials_thread(&w[0]);
+
+	for (n = 1; n < nthreads; n++)
+		pthread_join(w[n].thread, NULL);
+	pthread_mutex_destroy(&t.lock);
 
+	/* Evaluate results in table order, as if the chains were tried sequentially */
+	for (n = 0; n < t.count; n++) {
+		r = t.r[n];
 		if (r < 0) {
 			log_dbg("TCRYPT:   returned error %d, skipped.", r);
 			if (r == -ENOTSUP)
@@ -435,40 +626,39 @@ static int TCRYPT_decrypt_hdr(struct crypt_device *cd, struct tcrypt_phdr *hdr,
 			continue;
 		}
 
-		if (!strncmp(hdr2.d.magic, TCRYPT_HDR_MAGIC, TCRYPT_HDR_MAGIC_LEN)) {
-			log_dbg("TCRYPT: Signature magic detected.");
-			memcpy(&hdr->e, &hdr2.e, TCRYPT_HDR_LEN);
-			r = i;
-			break;
-		}
-		if ((flags & CRYPT_TCRYPT_VERA_MODES) &&
-		     !strncmp(hdr2.d.magic, VCRYPT_HDR_MAGIC, TCRYPT_HDR_MAGIC_LEN)) {
-			log_dbg("TCRYPT: Signature magic detected (Veracrypt).");
-			memcpy(&hdr->e, &hdr2.e, TCRYPT_HDR_LEN);
-			r = i;
+		if (r == 1) {
+			memcpy(&hdr->e, &t.hdr_found.e, TCRYPT_HDR_LEN);
+			r = t.chain[n];
 			break;
 		}
 		r = -EPERM;
 	}
 
-	crypt_memzero(&hdr2, sizeof(hdr2));
+	crypt_memzero(&t.hdr_found, sizeof(t.hdr_found));
 	return r;
 }
 
+/*
+ * Keyfile is pooled in chunks, chunk size must be multiple of
+ * TCRYPT_KEY_POOL_LEN / 4 to keep pool position aligned between chunks.
+ */
+#define TCRYPT_KEYFILE_CHUNK 65536
+
 static int TCRYPT_pool_keyfile(struct crypt_device *cd,
 				unsigned char pool[TCRYPT_KEY_POOL_LEN],
 				const char *keyfile)
 {
 	unsigned char *data;
-	int i, j, fd, data_size, r = -EIO;
-	uint32_t crc;
+	int fd, r = -EIO;
+	ssize_t data_size;
+	size_t total = 0;
+	uint32_t crc = ~0U;
 
 	log_dbg("TCRYPT: using keyfile %s.", keyfile);
 
-	data = malloc(TCRYPT_KEYFILE_LEN);
+	data = crypt_safe_alloc(TCRYPT_KEYFILE_CHUNK);
 	if (!data)
 		return -ENOMEM;
-	memset(data, 0, TCRYPT_KEYFILE_LEN);
 
 	fd = open(keyfile, O_RDONLY);
 	if (fd < 0) {
@@ -476,43 +666,73 @@ static int TCRYPT_pool_keyfile(struct crypt_device *cd,
 		goto out;
 	}
 
-	data_size = read_buffer(fd, data, TCRYPT_KEYFILE_LEN);
+	do {
+		data_size = read_buffer(fd, data, TCRYPT_KEYFILE_CHUNK);
+		if (data_size < 0)
+			break;
+		crc = crypt_crc32_pool(crc, data, data_size, pool, TCRYPT_KEY_POOL_LEN);
+		total += data_size;
+	} while (data_size == TCRYPT_KEYFILE_CHUNK && total < TCRYPT_KEYFILE_LEN);
 	close(fd);
+
 	if (data_size < 0) {
 		log_err(cd, _("Error reading keyfile %s."), keyfile);
 		goto out;
 	}
 
-	for (i = 0, j = 0, crc = ~0U; i < data_size; i++) {
-		crc = crypt_crc32(crc, &data[i], 1);
-		pool[j++] += (unsigned char)(crc >> 24);
-		pool[j++] += (unsigned char)(crc >> 16);
-		pool[j++] += (unsigned char)(crc >>  8);
-		pool[j++] += (unsigned char)(crc);
-		j %= TCRYPT_KEY_POOL_LEN;
-	}
 	r = 0;
 out:
 	crypt_memzero(&crc, sizeof(crc));
-	crypt_memzero(data, TCRYPT_KEYFILE_LEN);
-	free(data);
+	crypt_safe_free(data);
 
 	return r;
 }
 
+/* Maximal number of header locations tried for one TCRYPT_read_phdr() call */
+#define TCRYPT_HDR_CANDIDATES 2
+
+/*
+ * Try all header candidates (read from different offsets) in given order.
+ * Header keys are derived once per distinct salt, all derivations
+ * (for all candidates) run concurrently. Matching candidate is copied to hdr[0].
+ */
 static int TCRYPT_init_hdr(struct crypt_device *cd,
 			   struct tcrypt_phdr *hdr,
+			   unsigned int hdr_count,
 			   struct crypt_params_tcrypt *params)
 {
 	unsigned char pwd[TCRYPT_KEY_POOL_LEN] = {};
+	struct crypt_pbkdf_job job[TCRYPT_HDR_CANDIDATES * TCRYPT_KDF_COUNT] = {};
+	struct crypt_pbkdf_jobs *jobs = NULL;
+	unsigned int kdf[TCRYPT_KDF_COUNT], kdf_iterations[TCRYPT_KDF_COUNT];
+	unsigned int salt_idx[TCRYPT_HDR_CANDIDATES];
+	int kdf_r[TCRYPT_HDR_CANDIDATES * TCRYPT_KDF_COUNT];
+	bool derived[TCRYPT_HDR_CANDIDATES * TCRYPT_KDF_COUNT] = {};
+	struct tcrypt_cipher_pool *pools;
+	unsigned int pool_count;
 	size_t passphrase_size;
 	char *key;
-	unsigned int i, skipped = 0, iterations;
+	unsigned int c, i, n, u, count = 0, salts = 0, skipped = 0, iterations;
 	int r = -EPERM;
 
-	if (posix_memalign((void*)&key, crypt_getpagesize(), TCRYPT_HDR_KEY_LEN))
+	if (!hdr_count || hdr_count > TCRYPT_HDR_CANDIDATES)
+		return -EINVAL;
+
+	/* Cipher contexts are reused for all KDF variants and candidates */
+	pool_count = crypt_cpusonline();
+	if (pool_count > TCRYPT_CIPHER_COUNT)
+		pool_count = TCRYPT_CIPHER_COUNT;
+	if (!pool_count)
+		pool_count = 1;
+	pools = calloc(pool_count, sizeof(*pools));
+	if (!pools)
 		return -ENOMEM;
 
+	if (posix_memalign((void*)&key, crypt_getpagesize(), TCRYPT_HDR_KEY_LEN)) {
+		free(pools);
+		return -ENOMEM;
+	}
+
 	if (params->keyfiles_count)
 		passphrase_size = TCRYPT_KEY_POOL_LEN;
 	else
@@ -535,6 +755,14 @@ static int TCRYPT_init_hdr(struct crypt_device *cd,
 	for (i = 0; i < params->passphrase_size; i++)
 		pwd[i] += params->passphrase[i];
 
+	/* Candidates with the same salt share derived keys */
+	for (c = 0; c < hdr_count; c++) {
+		for (u = 0; u < c; u++)
+			if (!memcmp(hdr[u].salt, hdr[c].salt, TCRYPT_HDR_SALT_LEN))
+				break;
+		salt_idx[c] = u < c ? salt_idx[u] : salts++;
+	}
+
 	for (i = 0; tcrypt_kdf[i].name; i++) {
 		if (!(params->flags & CRYPT_TCRYPT_LEGACY_MODES) && tcrypt_kdf[i].legacy)
 			continue;
@@ -550,33 +778,91 @@ static int TCRYPT_init_hdr(struct crypt_device *cd,
 		} else
 			iterations = tcrypt_kdf[i].iterations;
 
-		/* Derive header key */
-		log_dbg("TCRYPT: trying KDF: %s-%s-%d%s.",
-			tcrypt_kdf[i].name, tcrypt_kdf[i].hash, tcrypt_kdf[i].iterations,
-			params->veracrypt_pim && tcrypt_kdf[i].veracrypt ? "-PIM" : "");
-		r = crypt_pbkdf(tcrypt_kdf[i].name, tcrypt_kdf[i].hash,
-				(char*)pwd, passphrase_size,
-				hdr->salt, TCRYPT_HDR_SALT_LEN,
-				key, TCRYPT_HDR_KEY_LEN,
-				iterations, 0, 0);
-		if (r < 0 && crypt_hash_size(tcrypt_kdf[i].hash) < 0) {
-			log_verbose(cd, _("PBKDF2 hash algorithm %s not available, skipping."),
-				      tcrypt_kdf[i].hash);
-			continue;
+		kdf[count] = i;
+		kdf_iterations[count] = iterations;
+		count++;
+	}
+
+	for (c = 0; c < hdr_count; c++)
+		for (n = 0; n < count; n++) {
+			u = salt_idx[c] * count + n;
+			job[u].type = tcrypt_kdf[kdf[n]].name;
+			job[u].hash = tcrypt_kdf[kdf[n]].hash;
+			job[u].salt = hdr[c].salt;
+			job[u].salt_length = TCRYPT_HDR_SALT_LEN;
+			job[u].iterations = kdf_iterations[n];
 		}
-		if (r < 0)
-			break;
 
-		/* Decrypt header */
-		r = TCRYPT_decrypt_hdr(cd, hdr, key, params->flags);
-		if (r == -ENOENT) {
-			skipped++;
-			r = -EPERM;
+	for (n = 0; n < salts * count; n++) {
+		job[n].key = crypt_alloc_volume_key(TCRYPT_HDR_KEY_LEN, NULL);
+		if (!job[n].key) {
+			r = -ENOMEM;
+			goto out;
+		}
+	}
+
+	/* Derive all header key candidates concurrently if it makes sense */
+	if (salts * count > 1 && crypt_cpusonline() > 1 &&
+	    crypt_pbkdf_jobs_start(&jobs, job, salts * count, (char*)pwd, passphrase_size))
+		jobs = NULL;
+
+	for (c = 0, i = 0; c < hdr_count; c++) {
+		if (hdr_count > 1)
+			log_dbg("TCRYPT: trying header candidate %u.", c);
+
+		for (n = 0; n < count; n++) {
+			i = kdf[n];
+			u = salt_idx[c] * count + n;
+
+			/* Derive header key */
+			log_dbg("TCRYPT: trying KDF: %s-%s-%d%s.",
+				tcrypt_kdf[i].name, tcrypt_kdf[i].hash, tcrypt_kdf[i].iterations,
+				params->veracrypt_pim && tcrypt_kdf[i].veracrypt ? "-PIM" : "");
+			if (jobs)
+				r = crypt_pbkdf_jobs_wait(jobs, u);
+			else if (!derived[u])
+				r = crypt_pbkdf(tcrypt_kdf[i].name, tcrypt_kdf[i].hash,
+						(char*)pwd, passphrase_size,
+						hdr[c].salt, TCRYPT_HDR_SALT_LEN,
+						job[u].key->key, TCRYPT_HDR_KEY_LEN,
+						job[u].iterations, 0, 0);
+			else
+				r = kdf_r[u];
+			derived[u] = true;
+			kdf_r[u] = r;
+			if (!r)
+				memcpy(key, job[u].key->key, TCRYPT_HDR_KEY_LEN);
+			if (r < 0 && crypt_hash_size(tcrypt_kdf[i].hash) < 0) {
+				log_verbose(cd, _("PBKDF2 hash algorithm %s not available, skipping."),
+					      tcrypt_kdf[i].hash);
+				continue;
+			}
+			if (r < 0)
+				break;
+
+			/* Decrypt header */
+			r = TCRYPT_decrypt_hdr(cd, &hdr[c], key, params->flags,
+					       pools, pool_count);
+			if (r == -ENOENT) {
+				skipped++;
+				r = -EPERM;
+			}
+			if (r != -EPERM)
+				break;
 		}
+
 		if (r != -EPERM)
 			break;
 	}
 
+	/* Remaining candidates are not needed anymore */
+	crypt_pbkdf_jobs_stop(jobs);
+	jobs = NULL;
+
+	/* All candidates tried, index the table terminator as before */
+	if (n == count)
+		i = TCRYPT_KDF_COUNT - 1;
+
 	if ((r < 0 && r != -EPERM && skipped && skipped == i) || r == -ENOTSUP) {
 		log_err(cd, _("Required kernel crypto interface not available."));
 #ifdef ENABLE_AF_ALG
@@ -586,6 +872,9 @@ static int TCRYPT_init_hdr(struct crypt_device *cd,
 	if (r < 0)
 		goto out;
 
+	if (c)
+		memcpy(&hdr[0], &hdr[c], sizeof(*hdr));
+
 	r = TCRYPT_hdr_from_disk(hdr, params, i, r);
 	if (!r) {
 		log_dbg("TCRYPT: Magic: %s, Header version: %d, req. %d, sector %d"
@@ -598,6 +887,12 @@ static int TCRYPT_init_hdr(struct crypt_device *cd,
 			params->cipher, params->mode, params->key_size);
 	}
 out:
+	crypt_pbkdf_jobs_stop(jobs);
+	for (n = 0; n < TCRYPT_HDR_CANDIDATES * TCRYPT_KDF_COUNT; n++)
+		crypt_free_volume_key(job[n].key);
+	for (n = 0; n < pool_count; n++)
+		TCRYPT_cipher_pool_destroy(&pools[n]);
+	free(pools);
 	crypt_memzero(pwd, TCRYPT_KEY_POOL_LEN);
 	if (key)
 		crypt_memzero(key, TCRYPT_HDR_KEY_LEN);
@@ -605,13 +900,38 @@ out:
 	return r;
 }
 
+/* Header locations to try for requested header type, in order of preference */
+static unsigned int TCRYPT_hdr_offsets(uint32_t flags, off_t offsets[TCRYPT_HDR_CANDIDATES])
+{
+	if (flags & CRYPT_TCRYPT_SYSTEM_HEADER) {
+		offsets[0] = TCRYPT_HDR_SYSTEM_OFFSET;
+		return 1;
+	}
+
+	if (flags & CRYPT_TCRYPT_HIDDEN_HEADER) {
+		if (flags & CRYPT_TCRYPT_BACKUP_HEADER) {
+			offsets[0] = TCRYPT_HDR_HIDDEN_OFFSET_BCK;
+			return 1;
+		}
+		offsets[0] = TCRYPT_HDR_HIDDEN_OFFSET;
+		offsets[1] = TCRYPT_HDR_HIDDEN_OFFSET_OLD;
+		return 2;
+	}
+
+	offsets[0] = (flags & CRYPT_TCRYPT_BACKUP_HEADER) ? TCRYPT_HDR_OFFSET_BCK : 0;
+	return 1;
+}
+
 int TCRYPT_read_phdr(struct crypt_device *cd,
 		     struct tcrypt_phdr *hdr,
 		     struct crypt_params_tcrypt *params)
 {
-	struct device *base_device, *device = crypt_metadata_device(cd);
+	struct device *base_device = NULL, *device = crypt_metadata_device(cd);
+	struct tcrypt_phdr hdrs[TCRYPT_HDR_CANDIDATES];
+	off_t offsets[TCRYPT_HDR_CANDIDATES];
 	ssize_t hdr_size = sizeof(struct tcrypt_phdr);
 	char *base_device_path;
+	unsigned int i, count, read_count = 0;
 	int devfd = 0, r;
 
 	assert(sizeof(struct tcrypt_phdr) == 512);
@@ -632,50 +952,32 @@ int TCRYPT_read_phdr(struct crypt_device *cd,
 		if (r < 0)
 			return r;
 		devfd = device_open(base_device, O_RDONLY);
-		device_free(base_device);
 	} else
 		devfd = device_open(device, O_RDONLY);
 
 	if (devfd < 0) {
+		device_free(base_device);
 		log_err(cd, _("Cannot open device %s."), device_path(device));
 		return -EINVAL;
 	}
 
-	r = -EIO;
-	if (params->flags & CRYPT_TCRYPT_SYSTEM_HEADER) {
-		if (read_lseek_blockwise(devfd, device_block_size(device),
-			device_alignment(device), hdr, hdr_size,
-			TCRYPT_HDR_SYSTEM_OFFSET) == hdr_size) {
-			r = TCRYPT_init_hdr(cd, hdr, params);
-		}
-	} else if (params->flags & CRYPT_TCRYPT_HIDDEN_HEADER) {
-		if (params->flags & CRYPT_TCRYPT_BACKUP_HEADER) {
-			if (read_lseek_blockwise(devfd, device_block_size(device),
-				device_alignment(device), hdr, hdr_size,
-				TCRYPT_HDR_HIDDEN_OFFSET_BCK) == hdr_size)
-				r = TCRYPT_init_hdr(cd, hdr, params);
-		} else {
-			if (read_lseek_blockwise(devfd, device_block_size(device),
-				device_alignment(device), hdr, hdr_size,
-				TCRYPT_HDR_HIDDEN_OFFSET) == hdr_size)
-				r = TCRYPT_init_hdr(cd, hdr, params);
-			if (r && read_lseek_blockwise(devfd, device_block_size(device),
-				device_alignment(device), hdr, hdr_size,
-				TCRYPT_HDR_HIDDEN_OFFSET_OLD) == hdr_size)
-				r = TCRYPT_init_hdr(cd, hdr, params);
-		}
-	} else if (params->flags & CRYPT_TCRYPT_BACKUP_HEADER) {
+	/* Read all header candidates before any (expensive) key derivation */
+	count = TCRYPT_hdr_offsets(params->flags, offsets);
+	for (i = 0; i < count; i++)
 		if (read_lseek_blockwise(devfd, device_block_size(device),
-			device_alignment(device), hdr, hdr_size,
-			TCRYPT_HDR_OFFSET_BCK) == hdr_size)
-			r = TCRYPT_init_hdr(cd, hdr, params);
-	} else if (read_blockwise(devfd, device_block_size(device),
-			device_alignment(device), hdr, hdr_size) == hdr_size)
-		r = TCRYPT_init_hdr(cd, hdr, params);
-
-	close(devfd);
+			device_alignment(device), &hdrs[read_count], hdr_size,
+			offsets[i]) == hdr_size)
+			read_count++;
+
+	device_close(base_device ?: device, devfd);
+	device_free(base_device);
+
+	r = read_count ? TCRYPT_init_hdr(cd, hdrs, read_count, params) : -EIO;
 	if (r < 0)
 		memset(hdr, 0, sizeof (*hdr));
+	else
+		memcpy(hdr, &hdrs[0], sizeof(*hdr));
+	crypt_memzero(hdrs, sizeof(hdrs));
 	return r;
 }
 
@@ -705,7 +1007,7 @@ int TCRYPT_activate(struct crypt_device *cd,
 	struct device *device = NULL, *part_device = NULL;
 	unsigned int i;
 	int r;
-	uint32_t req_flags, dmc_flags;
+	uint32_t req_flags, dmc_flags, inner_flags = 0;
 	struct tcrypt_algs *algs;
 	enum devcheck device_check;
 	struct crypt_dm_active_device dmd = {
@@ -748,6 +1050,17 @@ int TCRYPT_activate(struct crypt_device *cd,
 	if (hdr->d.sector_size == 0)
 		return -EINVAL;
 
+	/*
+	 * Kernel cannot map cipher chain in one dm-crypt target, but inner
+	 * chain devices can at least process I/O inline (without own workqueues).
+	 */
+	if ((params->flags & CRYPT_TCRYPT_CHAIN_INLINE) && algs->chain_count > 1) {
+		if (!dm_flags(DM_CRYPT, &dmc_flags) && (dmc_flags & DM_CRYPT_NO_WORKQUEUE_SUPPORTED))
+			inner_flags = CRYPT_ACTIVATE_NO_READ_WORKQUEUE | CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE;
+		else
+			log_dbg("TCRYPT: inline chain processing not supported, using stacked workqueues.");
+	}
+
 	if (params->flags & CRYPT_TCRYPT_SYSTEM_HEADER)
 		dmd.size = 0;
 	else if (params->flags & CRYPT_TCRYPT_HIDDEN_HEADER)
@@ -802,7 +1115,7 @@ int TCRYPT_activate(struct crypt_device *cd,
 			dmd.flags = flags;
 		} else {
 			snprintf(dm_name, sizeof(dm_name), "%s_%d", name, i-1);
-			dmd.flags = flags | CRYPT_ACTIVATE_PRIVATE;
+			dmd.flags = flags | inner_flags | CRYPT_ACTIVATE_PRIVATE;
 		}
 
 		snprintf(cipher, sizeof(cipher), "%s-%s",
@@ -843,6 +1156,56 @@ int TCRYPT_activate(struct crypt_device *cd,
 	return r;
 }
 
+/*
+ * Chain throughput in memory, every chain element processes the whole buffer,
+ * so the chain time is the sum of times of all elements.
+ */
+int TCRYPT_benchmark(struct crypt_device *cd, unsigned int index,
+		     const char **cipher, const char **cipher_mode,
+		     size_t buffer_size, double *encryption_mbs, double *decryption_mbs)
+{
+	struct tcrypt_algs *algs;
+	char mode[MAX_CIPHER_LEN], *c;
+	double enc_mbs, dec_mbs, enc = 0., dec = 0.;
+	unsigned int i;
+	int r;
+
+	for (i = 0; tcrypt_cipher[i].chain_count && i < index; i++);
+	if (!tcrypt_cipher[i].chain_count) {
+		*cipher = *cipher_mode = NULL;
+		return -EINVAL;
+	}
+
+	algs = &tcrypt_cipher[i];
+	*cipher = algs->long_name;
+	*cipher_mode = algs->mode;
+
+	/* Only modes which can be activated through dm-crypt */
+	if (strstr(algs->mode, "-tcrypt"))
+		return -ENOTSUP;
+
+	strncpy(mode, algs->mode, sizeof(mode) - 1);
+	mode[sizeof(mode) - 1] = '\0';
+	if ((c = strchr(mode, '-')))
+		*c = '\0';
+
+	for (i = 0; i < algs->chain_count; i++) {
+		r = crypt_benchmark(cd, algs->cipher[i].name, mode,
+				    algs->cipher[i].key_size, algs->cipher[i].iv_size,
+				    buffer_size, &enc_mbs, &dec_mbs);
+		if (r < 0)
+			return r;
+		if (enc_mbs <= 0. || dec_mbs <= 0.)
+			return -ERANGE;
+		enc += 1. / enc_mbs;
+		dec += 1. / dec_mbs;
+	}
+
+	*encryption_mbs = 1. / enc;
+	*decryption_mbs = 1. / dec;
+	return 0;
+}
+
 static int TCRYPT_remove_one(struct crypt_device *cd, const char *name,
 		      const char *base_uuid, int index, uint32_t flags)
 {
@@ -94,6 +94,10 @@ int TCRYPT_activate(struct crypt_device *cd,
 		     struct crypt_params_tcrypt *params,
 		     uint32_t flags);
 
+int TCRYPT_benchmark(struct crypt_device *cd, unsigned int index,
+		     const char **cipher, const char **cipher_mode,
+		     size_t buffer_size, double *encryption_mbs, double *decryption_mbs);
+
 int TCRYPT_deactivate(struct crypt_device *cd,
 		      const char *name,
 		      uint32_t flags);
@@ -24,10 +24,13 @@
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
+#include <linux/fs.h>
 
 #include "internal.h"
 
@@ -146,29 +149,75 @@ static int keyfile_seek(int fd, uint64_t bytes)
 	return bytes == 0 ? 0 : -1;
 }
 
-int crypt_keyfile_device_read(struct crypt_device *cd,  const char *keyfile,
-			      char **key, size_t *key_size_read,
-			      uint64_t keyfile_offset, size_t keyfile_size_max,
-			      uint32_t flags)
+/*
+ * Read input up to newline (not included) or up to length bytes, input after
+ * newline is never consumed. Seekable input is read in one chunk and the file
+ * position is then returned after the newline, socket input is peeked first.
+ * Only pipes must be read one character at a time.
+ */
+static ssize_t keyfile_read_eol(int fd, char *buf, size_t length, int *newline)
 {
-	int fd, regular_file, char_to_read = 0, char_read = 0, unlimited_read = 0;
-	int r = -EINVAL, newline;
-	char *pass = NULL;
-	size_t buflen, i;
-	uint64_t file_read_size;
 	struct stat st;
+	ssize_t r, peeked = 0;
+	size_t i = 0;
+	char *nl;
+	int seekable, sock;
+
+	*newline = 0;
+	seekable = lseek(fd, 0, SEEK_CUR) >= 0;
+	sock = !seekable && !fstat(fd, &st) && S_ISSOCK(st.st_mode);
+
+	while (i < length) {
+		if (seekable)
+			r = read_buffer(fd, &buf[i], length - i);
+		else if (sock) {
+			do {
+				peeked = recv(fd, &buf[i], length - i, MSG_PEEK);
+			} while (peeked < 0 && errno == EINTR);
+			if (peeked <= 0)
+				return peeked < 0 ? -1 : (ssize_t)i;
+			nl = memchr(&buf[i], '\n', peeked);
+			r = read_buffer(fd, &buf[i], nl ? (size_t)(nl - &buf[i]) + 1 : (size_t)peeked);
+		} else
+			r = read_buffer(fd, &buf[i], 1);
+
+		if (r <= 0)
+			return r < 0 ? -1 : (ssize_t)i;
+
+		nl = memchr(&buf[i], '\n', r);
+		if (nl) {
+			*newline = 1;
+			/* return input after newline */
+			if (seekable && nl - &buf[i] + 1 < r &&
+			    lseek(fd, (off_t)(nl - &buf[i] + 1) - r, SEEK_CUR) < 0)
+				return -1;
+			crypt_memzero(nl, r - (nl - &buf[i]));
+			return nl - buf;
+		}
 
-	if (!key || !key_size_read)
-		return -EINVAL;
+		/* short read of seekable input means EOF */
+		if (seekable && (size_t)r < length - i) {
+			i += r;
+			break;
+		}
+		i += r;
+	}
 
-	*key = NULL;
-	*key_size_read = 0;
+	return i;
+}
 
-	fd = keyfile ? open(keyfile, O_RDONLY) : STDIN_FILENO;
-	if (fd < 0) {
-		log_err(cd, _("Failed to open key file."));
-		return -EINVAL;
-	}
+static int keyfile_read(struct crypt_device *cd, int fd, int probe,
+			char **key, size_t *key_size_read,
+			uint64_t keyfile_offset, size_t keyfile_size_max,
+			uint32_t flags)
+{
+	int regular_file, seekable, avail, char_to_read = 0, char_read = 0, unlimited_read = 0;
+	int r = -EINVAL, newline;
+	char *pass = NULL;
+	size_t buflen, i;
+	uint64_t file_read_size = 0;
+	ssize_t bytes_read;
+	struct stat st;
 
 	if (isatty(fd)) {
 		log_err(cd, _("Cannot read keyfile from a terminal."));
@@ -182,19 +231,25 @@ int crypt_keyfile_device_read(struct crypt_device *cd,  const char *keyfile,
 		unlimited_read = 1;
 		/* use 4k for buffer (page divisor but avoid huge pages) */
 		buflen = 4096 - sizeof(struct safe_allocation);
+		/* data already waiting in pipe or socket, read it in one chunk */
+		if (!ioctl(fd, FIONREAD, &avail) && avail > 0 && (size_t)avail > buflen)
+			buflen = (size_t)avail < keyfile_size_max ? (size_t)avail + 1 : keyfile_size_max;
 	} else
 		buflen = keyfile_size_max;
 
-	regular_file = 0;
-	if (keyfile) {
-		if (stat(keyfile, &st) < 0) {
+	regular_file = seekable = 0;
+	if (probe) {
+		if (fstat(fd, &st) < 0) {
 			log_err(cd, _("Failed to stat key file."));
 			goto out_err;
 		}
 		if (S_ISREG(st.st_mode)) {
-			regular_file = 1;
+			regular_file = seekable = 1;
 			file_read_size = (uint64_t)st.st_size;
+		} else if (S_ISBLK(st.st_mode) && !ioctl(fd, BLKGETSIZE64, &file_read_size))
+			seekable = 1;
 
+		if (seekable) {
 			if (keyfile_offset > file_read_size) {
 				log_err(cd, _("Cannot seek to requested keyfile offset."));
 				goto out_err;
@@ -215,6 +270,22 @@ int crypt_keyfile_device_read(struct crypt_device *cd,  const char *keyfile,
 		goto out_err;
 	}
 
+	/*
+	 * Seekable input of known size is read at offset directly
+	 * into exactly sized buffer.
+	 */
+	if (seekable && file_read_size && !(flags & CRYPT_KEYFILE_STOP_EOL)) {
+		bytes_read = read_buffer_at(fd, pass, buflen, (off_t)keyfile_offset);
+		if (bytes_read < 0) {
+			log_err(cd, _("Error reading passphrase."));
+			r = -EPIPE;
+			goto out_err;
+		}
+		i = (size_t)bytes_read;
+		newline = 0;
+		goto out_check;
+	}
+
 	/* Discard keyfile_offset bytes on input */
 	if (keyfile_offset && keyfile_seek(fd, keyfile_offset) < 0) {
 		log_err(cd, _("Cannot seek to requested keyfile offset."));
@@ -223,7 +294,8 @@ int crypt_keyfile_device_read(struct crypt_device *cd,  const char *keyfile,
 
 	for (i = 0, newline = 0; i < keyfile_size_max; i += char_read) {
 		if (i == buflen) {
-			buflen += 4096;
+			/* grow geometrically, do not copy big input on every page */
+			buflen = 2 * buflen > keyfile_size_max ? keyfile_size_max : 2 * buflen;
 			pass = crypt_safe_realloc(pass, buflen);
 			if (!pass) {
 				log_err(cd, _("Out of memory while reading passphrase."));
@@ -232,35 +304,36 @@ int crypt_keyfile_device_read(struct crypt_device *cd,  const char *keyfile,
 			}
 		}
 
-		if (flags & CRYPT_KEYFILE_STOP_EOL) {
-			/* If we should stop on newline, we must read the input
-			 * one character at the time. Otherwise we might end up
-			 * having read some bytes after the newline, which we
-			 * promised not to do.
-			 */
-			char_to_read = 1;
-		} else {
-			/* char_to_read = min(keyfile_size_max - i, buflen - i) */
-			char_to_read = keyfile_size_max < buflen ?
-				keyfile_size_max - i : buflen - i;
-		}
-		char_read = read_buffer(fd, &pass[i], char_to_read);
+		/* char_to_read = min(keyfile_size_max - i, buflen - i) */
+		char_to_read = keyfile_size_max < buflen ?
+			keyfile_size_max - i : buflen - i;
+
+		/*
+		 * If we should stop on newline, we must not consume
+		 * any bytes after the newline, which we promised not to do.
+		 */
+		if (flags & CRYPT_KEYFILE_STOP_EOL)
+			char_read = keyfile_read_eol(fd, &pass[i], char_to_read, &newline);
+		else
+			char_read = read_buffer(fd, &pass[i], char_to_read);
 		if (char_read < 0) {
 			log_err(cd, _("Error reading passphrase."));
 			r = -EPIPE;
 			goto out_err;
 		}
 
-		if (char_read == 0)
-			break;
 		/* Stop on newline only if not requested read from keyfile */
-		if ((flags & CRYPT_KEYFILE_STOP_EOL) && pass[i] == '\n') {
-			newline = 1;
+		if (newline) {
+			i += char_read;
 			pass[i] = '\0';
 			break;
 		}
+
+		if (char_read == 0)
+			break;
 	}
 
+out_check:
 	/* Fail if piped input dies reading nothing */
 	if (!i && !regular_file && !newline) {
 		log_dbg("Nothing read on input.");
@@ -283,14 +356,53 @@ int crypt_keyfile_device_read(struct crypt_device *cd,  const char *keyfile,
 	*key_size_read = i;
 	r = 0;
 out_err:
-	if (fd != STDIN_FILENO)
-		close(fd);
-
 	if (r)
 		crypt_safe_free(pass);
 	return r;
 }
 
+int crypt_keyfile_device_read(struct crypt_device *cd,  const char *keyfile,
+			      char **key, size_t *key_size_read,
+			      uint64_t keyfile_offset, size_t keyfile_size_max,
+			      uint32_t flags)
+{
+	int fd, r;
+
+	if (!key || !key_size_read)
+		return -EINVAL;
+
+	*key = NULL;
+	*key_size_read = 0;
+
+	fd = keyfile ? open(keyfile, O_RDONLY) : STDIN_FILENO;
+	if (fd < 0) {
+		log_err(cd, _("Failed to open key file."));
+		return -EINVAL;
+	}
+
+	r = keyfile_read(cd, fd, keyfile != NULL, key, key_size_read,
+			 keyfile_offset, keyfile_size_max, flags);
+
+	if (fd != STDIN_FILENO)
+		close(fd);
+	return r;
+}
+
+int crypt_keyfile_fd_read(struct crypt_device *cd, int fd,
+			  char **key, size_t *key_size_read,
+			  uint64_t keyfile_offset, size_t keyfile_size_max,
+			  uint32_t flags)
+{
+	if (!key || !key_size_read || fd < 0)
+		return -EINVAL;
+
+	*key = NULL;
+	*key_size_read = 0;
+
+	return keyfile_read(cd, fd, 1, key, key_size_read,
+			    keyfile_offset, keyfile_size_max, flags);
+}
+
 int crypt_keyfile_read(struct crypt_device *cd,  const char *keyfile,
 		       char **key, size_t *key_size_read,
 		       size_t keyfile_offset, size_t keyfile_size_max,
@@ -300,6 +412,66 @@ int crypt_keyfile_read(struct crypt_device *cd,  const char *keyfile,
 					 keyfile_offset, keyfile_size_max, flags);
 }
 
+/*
+ * Create new header backup file of the final size, preallocated
+ * if filesystem supports it (so the copy is not fragmented).
+ */
+int crypt_backup_file_open(struct crypt_device *cd, const char *backup_file, size_t size)
+{
+	int fd;
+
+	fd = open(backup_file, O_CREAT|O_EXCL|O_WRONLY, S_IRUSR);
+	if (fd == -1) {
+		if (errno == EEXIST)
+			log_err(cd, _("Requested header backup file %s already exists."), backup_file);
+		else
+			log_err(cd, _("Cannot create header backup file %s."), backup_file);
+		return -EINVAL;
+	}
+
+	if (fallocate(fd, 0, 0, (off_t)size) && ftruncate(fd, (off_t)size)) {
+		log_err(cd, _("Cannot write header backup file %s."), backup_file);
+		close(fd);
+		unlink(backup_file);
+		return -EIO;
+	}
+
+	return fd;
+}
+
+/*
+ * Copy header from detached header file without userspace buffer.
+ * Returns -ENOTSUP if device is not a regular file or in-kernel copy
+ * is not possible, caller then writes the header read to buffer.
+ */
+int crypt_backup_file_copy(struct crypt_device *cd, struct device *device,
+			   int fd, size_t length)
+{
+	struct stat st;
+	ssize_t r;
+	int in_fd;
+
+	if (stat(device_path(device), &st) < 0 || !S_ISREG(st.st_mode))
+		return -ENOTSUP;
+
+	in_fd = open(device_path(device), O_RDONLY);
+	if (in_fd < 0)
+		return -ENOTSUP;
+
+	r = copy_file_kernel(in_fd, fd, length);
+	close(in_fd);
+
+	if (r == -ENOTSUP)
+		return r;
+	if (r != (ssize_t)length) {
+		log_dbg("In-kernel copy of header from %s failed.", device_path(device));
+		return -EIO;
+	}
+
+	log_dbg("Header copied in kernel from %s.", device_path(device));
+	return 0;
+}
+
 int kernel_version(uint64_t *kversion)
 {
 	struct utsname uts;
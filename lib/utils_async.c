@@ -0,0 +1,528 @@
+/*
+ * utils_async - asynchronous activation and keyslot operations
+ *
+ * Copyright (C) 2026, cryptsetup contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+
+#include "internal.h"
+
+/* Upper bound of worker threads (shared by all operations in process) */
+#define ASYNC_MAX_THREADS 16
+
+/* Idle worker exits after this time (seconds) */
+#define ASYNC_IDLE_TIMEOUT 10
+
+enum async_type {
+	ASYNC_ACTIVATE_PASSPHRASE,
+	ASYNC_ACTIVATE_TOKEN,
+	ASYNC_RESUME_PASSPHRASE,
+	ASYNC_KEYSLOT_ADD_PASSPHRASE,
+	ASYNC_KEYSLOT_ADD_VOLUME_KEY,
+};
+
+enum async_state { ASYNC_QUEUED, ASYNC_RUNNING, ASYNC_DONE };
+
+struct crypt_async_op {
+	struct crypt_async_op *next;
+	enum async_type type;
+	enum async_state state;
+	unsigned refcnt;
+
+	struct crypt_device *cd;
+	char *name;
+	int keyslot; /* or token */
+	void *token_usrptr;
+	char *key;
+	size_t key_size;
+	char *new_key;
+	size_t new_key_size;
+	uint32_t flags;
+
+	crypt_async_callback callback;
+	void *usrptr;
+
+	int r;
+	int event_fd;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t queued;  /* new operation queued */
+	pthread_cond_t done;    /* an operation finished */
+	struct crypt_async_op *ops; /* queued and running operations */
+	unsigned threads, idle;
+} async = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.queued = PTHREAD_COND_INITIALIZER,
+	.done = PTHREAD_COND_INITIALIZER,
+};
+
+static void async_op_release(struct crypt_async_op *op)
+{
+	if (--op->refcnt)
+		return;
+
+	if (op->event_fd >= 0)
+		close(op->event_fd);
+	crypt_safe_free(op->key);
+	crypt_safe_free(op->new_key);
+	free(op->name);
+	free(op);
+}
+
+static void async_list_remove(struct crypt_async_op *op)
+{
+	struct crypt_async_op **p;
+
+	for (p = &async.ops; *p; p = &(*p)->next)
+		if (*p == op) {
+			*p = op->next;
+			op->next = NULL;
+			return;
+		}
+}
+
+/* Must be called with lock held */
+static void async_complete(struct crypt_async_op *op, int r)
+{
+	uint64_t one = 1;
+
+	op->r = r;
+	op->state = ASYNC_DONE;
+	async_list_remove(op);
+	if (op->event_fd >= 0 && write(op->event_fd, &one, sizeof(one)) < 0)
+		log_dbg("Cannot signal async operation completion.");
+	pthread_cond_broadcast(&async.done);
+}
+
+static int async_run(struct crypt_async_op *op)
+{
+	switch (op->type) {
+	case ASYNC_ACTIVATE_PASSPHRASE:
+		return crypt_activate_by_passphrase(op->cd, op->name, op->keyslot,
+						    op->key, op->key_size, op->flags);
+	case ASYNC_ACTIVATE_TOKEN:
+		return crypt_activate_by_token(op->cd, op->name, op->keyslot,
+					       op->token_usrptr, op->flags);
+	case ASYNC_RESUME_PASSPHRASE:
+		return crypt_resume_by_passphrase(op->cd, op->name, op->keyslot,
+						  op->key, op->key_size);
+	case ASYNC_KEYSLOT_ADD_PASSPHRASE:
+		return crypt_keyslot_add_by_passphrase(op->cd, op->keyslot,
+						       op->key, op->key_size,
+						       op->new_key, op->new_key_size);
+	case ASYNC_KEYSLOT_ADD_VOLUME_KEY:
+		return crypt_keyslot_add_by_volume_key(op->cd, op->keyslot,
+						       op->key, op->key_size,
+						       op->new_key, op->new_key_size);
+	}
+
+	return -EINVAL;
+}
+
+static struct crypt_async_op *async_next_queued(void)
+{
+	struct crypt_async_op *op;
+
+	for (op = async.ops; op; op = op->next)
+		if (op->state == ASYNC_QUEUED)
+			return op;
+
+	return NULL;
+}
+
+static void *async_worker(void *arg __attribute__((unused)))
+{
+	struct crypt_async_op *op;
+	struct timespec ts;
+	int r;
+
+	pthread_mutex_lock(&async.lock);
+	while (1) {
+		op = async_next_queued();
+		if (!op) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += ASYNC_IDLE_TIMEOUT;
+			async.idle++;
+			r = pthread_cond_timedwait(&async.queued, &async.lock, &ts);
+			async.idle--;
+			if (r == ETIMEDOUT && !async_next_queued())
+				break;
+			continue;
+		}
+
+		op->state = ASYNC_RUNNING;
+		pthread_mutex_unlock(&async.lock);
+
+		log_dbg("Running async operation %d.", op->type);
+		r = async_run(op);
+
+		/* Secrets are not needed anymore */
+		crypt_safe_free(op->key);
+		crypt_safe_free(op->new_key);
+		op->key = op->new_key = NULL;
+
+		pthread_mutex_lock(&async.lock);
+		async_complete(op, r);
+		pthread_mutex_unlock(&async.lock);
+
+		/* Callback can release operation, keep own reference until it returns */
+		if (op->callback)
+			op->callback(op, r, op->usrptr);
+
+		pthread_mutex_lock(&async.lock);
+		async_op_release(op);
+	}
+	async.threads--;
+	pthread_mutex_unlock(&async.lock);
+
+	return NULL;
+}
+
+static int async_submit(struct crypt_async_op *op, struct crypt_async_op **rop)
+{
+	struct crypt_async_op *o;
+	pthread_attr_t attr;
+	pthread_t thread;
+	unsigned max_threads;
+	int r = 0;
+
+	max_threads = crypt_cpusonline();
+	if (max_threads > ASYNC_MAX_THREADS)
+		max_threads = ASYNC_MAX_THREADS;
+	if (!max_threads)
+		max_threads = 1;
+
+	pthread_mutex_lock(&async.lock);
+
+	/* Device handle is not thread safe, one pending operation per handle */
+	for (o = async.ops; o; o = o->next)
+		if (o->cd == op->cd) {
+			r = -EBUSY;
+			goto out;
+		}
+
+	if (!async.idle && async.threads < max_threads) {
+		if (pthread_attr_init(&attr)) {
+			r = -ENOMEM;
+			goto out;
+		}
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attr, async_worker, NULL))
+			r = async.threads ? 0 : -ENOMEM;
+		else
+			async.threads++;
+		pthread_attr_destroy(&attr);
+		if (r < 0)
+			goto out;
+	}
+
+	/* one reference for caller, one for worker */
+	op->refcnt = 2;
+	op->state = ASYNC_QUEUED;
+	op->next = async.ops;
+	async.ops = op;
+	pthread_cond_signal(&async.queued);
+	*rop = op;
+out:
+	pthread_mutex_unlock(&async.lock);
+	return r;
+}
+
+static int async_op_alloc(struct crypt_async_op **op, enum async_type type,
+			  struct crypt_device *cd, const char *name,
+			  const char *key, size_t key_size,
+			  const char *new_key, size_t new_key_size)
+{
+	struct crypt_async_op *o;
+
+	if (!cd)
+		return -EINVAL;
+
+	o = calloc(1, sizeof(*o));
+	if (!o)
+		return -ENOMEM;
+
+	o->type = type;
+	o->cd = cd;
+	o->event_fd = -1;
+
+	/* Caller buffers can be released after the call returns */
+	if ((name && !(o->name = strdup(name))) ||
+	    (key && !(o->key = crypt_safe_alloc(key_size ?: 1))) ||
+	    (new_key && !(o->new_key = crypt_safe_alloc(new_key_size ?: 1)))) {
+		o->refcnt = 1;
+		async_op_release(o);
+		return -ENOMEM;
+	}
+
+	if (key) {
+		memcpy(o->key, key, key_size);
+		o->key_size = key_size;
+	}
+	if (new_key) {
+		memcpy(o->new_key, new_key, new_key_size);
+		o->new_key_size = new_key_size;
+	}
+
+	*op = o;
+	return 0;
+}
+
+static int async_start(struct crypt_async_op *o, crypt_async_callback callback,
+		       void *usrptr, struct crypt_async_op **op)
+{
+	int r;
+
+	o->callback = callback;
+	o->usrptr = usrptr;
+
+	r = async_submit(o, op);
+	if (r < 0) {
+		o->refcnt = 1;
+		async_op_release(o);
+	}
+
+	return r;
+}
+
+int crypt_activate_by_passphrase_async(struct crypt_device *cd,
+	const char *name,
+	int keyslot,
+	const char *passphrase,
+	size_t passphrase_size,
+	uint32_t flags,
+	crypt_async_callback callback,
+	void *usrptr,
+	struct crypt_async_op **op)
+{
+	struct crypt_async_op *o;
+	int r;
+
+	if (!op || !passphrase)
+		return -EINVAL;
+
+	r = async_op_alloc(&o, ASYNC_ACTIVATE_PASSPHRASE, cd, name,
+			   passphrase, passphrase_size, NULL, 0);
+	if (r < 0)
+		return r;
+
+	o->keyslot = keyslot;
+	o->flags = flags;
+
+	return async_start(o, callback, usrptr, op);
+}
+
+int crypt_activate_by_token_async(struct crypt_device *cd,
+	const char *name,
+	int token,
+	void *token_usrptr,
+	uint32_t flags,
+	crypt_async_callback callback,
+	void *usrptr,
+	struct crypt_async_op **op)
+{
+	struct crypt_async_op *o;
+	int r;
+
+	if (!op)
+		return -EINVAL;
+
+	r = async_op_alloc(&o, ASYNC_ACTIVATE_TOKEN, cd, name, NULL, 0, NULL, 0);
+	if (r < 0)
+		return r;
+
+	o->keyslot = token;
+	o->token_usrptr = token_usrptr;
+	o->flags = flags;
+
+	return async_start(o, callback, usrptr, op);
+}
+
+int crypt_resume_by_passphrase_async(struct crypt_device *cd,
+	const char *name,
+	int keyslot,
+	const char *passphrase,
+	size_t passphrase_size,
+	crypt_async_callback callback,
+	void *usrptr,
+	struct crypt_async_op **op)
+{
+	struct crypt_async_op *o;
+	int r;
+
+	if (!op || !name || !passphrase)
+		return -EINVAL;
+
+	r = async_op_alloc(&o, ASYNC_RESUME_PASSPHRASE, cd, name,
+			   passphrase, passphrase_size, NULL, 0);
+	if (r < 0)
+		return r;
+
+	o->keyslot = keyslot;
+
+	return async_start(o, callback, usrptr, op);
+}
+
+int crypt_keyslot_add_by_passphrase_async(struct crypt_device *cd,
+	int keyslot,
+	const char *passphrase,
+	size_t passphrase_size,
+	const char *new_passphrase,
+	size_t new_passphrase_size,
+	crypt_async_callback callback,
+	void *usrptr,
+	struct crypt_async_op **op)
+{
+	struct crypt_async_op *o;
+	int r;
+
+	if (!op || !passphrase || !new_passphrase)
+		return -EINVAL;
+
+	r = async_op_alloc(&o, ASYNC_KEYSLOT_ADD_PASSPHRASE, cd, NULL,
+			   passphrase, passphrase_size,
+			   new_passphrase, new_passphrase_size);
+	if (r < 0)
+		return r;
+
+	o->keyslot = keyslot;
+
+	return async_start(o, callback, usrptr, op);
+}
+
+int crypt_keyslot_add_by_volume_key_async(struct crypt_device *cd,
+	int keyslot,
+	const char *volume_key,
+	size_t volume_key_size,
+	const char *passphrase,
+	size_t passphrase_size,
+	crypt_async_callback callback,
+	void *usrptr,
+	struct crypt_async_op **op)
+{
+	struct crypt_async_op *o;
+	int r;
+
+	if (!op || !passphrase)
+		return -EINVAL;
+
+	r = async_op_alloc(&o, ASYNC_KEYSLOT_ADD_VOLUME_KEY, cd, NULL,
+			   volume_key, volume_key_size,
+			   passphrase, passphrase_size);
+	if (r < 0)
+		return r;
+
+	o->keyslot = keyslot;
+
+	return async_start(o, callback, usrptr, op);
+}
+
+int crypt_async_fd(struct crypt_async_op *op)
+{
+	uint64_t one = 1;
+	int r;
+
+	if (!op)
+		return -EINVAL;
+
+	pthread_mutex_lock(&async.lock);
+	if (op->event_fd < 0) {
+		op->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (op->event_fd >= 0 && op->state == ASYNC_DONE &&
+		    write(op->event_fd, &one, sizeof(one)) < 0)
+			log_dbg("Cannot signal async operation completion.");
+	}
+	r = op->event_fd >= 0 ? op->event_fd : -errno;
+	pthread_mutex_unlock(&async.lock);
+
+	return r;
+}
+
+int crypt_async_result(struct crypt_async_op *op)
+{
+	int r;
+
+	if (!op)
+		return -EINVAL;
+
+	pthread_mutex_lock(&async.lock);
+	r = op->state == ASYNC_DONE ? op->r : -EINPROGRESS;
+	pthread_mutex_unlock(&async.lock);
+
+	return r;
+}
+
+int crypt_async_wait(struct crypt_async_op *op)
+{
+	int r;
+
+	if (!op)
+		return -EINVAL;
+
+	pthread_mutex_lock(&async.lock);
+	while (op->state != ASYNC_DONE)
+		pthread_cond_wait(&async.done, &async.lock);
+	r = op->r;
+	pthread_mutex_unlock(&async.lock);
+
+	return r;
+}
+
+int crypt_async_cancel(struct crypt_async_op *op)
+{
+	int r = 0;
+
+	if (!op)
+		return -EINVAL;
+
+	pthread_mutex_lock(&async.lock);
+	if (op->state == ASYNC_QUEUED) {
+		/* worker will never see it, drop its reference here (no callback) */
+		async_complete(op, -ECANCELED);
+		async_op_release(op);
+	} else if (op->state == ASYNC_RUNNING)
+		r = -EBUSY;
+	pthread_mutex_unlock(&async.lock);
+
+	return r;
+}
+
+void crypt_async_free(struct crypt_async_op *op)
+{
+	if (!op)
+		return;
+
+	pthread_mutex_lock(&async.lock);
+	if (op->state == ASYNC_QUEUED) {
+		async_complete(op, -ECANCELED);
+		async_op_release(op);
+	}
+	while (op->state != ASYNC_DONE)
+		pthread_cond_wait(&async.done, &async.lock);
+	async_op_release(op);
+	pthread_mutex_unlock(&async.lock);
+}
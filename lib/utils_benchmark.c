@@ -19,11 +19,18 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "internal.h"
+#include "verity.h"
+#include "tcrypt.h"
+#include "integrity.h"
 
 /*
  * This is not simulating storage, so using disk block causes extreme overhead.
@@ -50,8 +57,49 @@ struct cipher_perf {
 	char *iv;
 	size_t iv_length;
 	size_t buffer_size;
+	size_t sector_size;	/* storage mode with IV generator in mode */
 };
 
+/* Every encryption sector with its own IV generated as in dm-crypt */
+static int storage_perf_one(struct cipher_perf *cp, char *buf,
+			    size_t buf_size, int enc)
+{
+	struct crypt_storage *s = NULL;
+	size_t done = 0, block = CIPHER_BLOCK_BYTES;
+	int r;
+
+	if (buf_size < block)
+		block = buf_size;
+	block -= block % cp->sector_size;
+	if (!block)
+		return -EINVAL;
+
+	r = crypt_storage_init_sector(&s, 0, cp->sector_size, cp->name, cp->mode,
+				      cp->key, cp->key_length);
+	if (r < 0) {
+		log_dbg("Cannot initialise cipher %s, mode %s.", cp->name, cp->mode);
+		return r;
+	}
+
+	while (done + cp->sector_size <= buf_size) {
+		if ((done + block) > buf_size)
+			block = (buf_size - done) - (buf_size - done) % cp->sector_size;
+
+		if (enc)
+			r = crypt_storage_encrypt(s, done / SECTOR_SIZE, block / SECTOR_SIZE, &buf[done]);
+		else
+			r = crypt_storage_decrypt(s, done / SECTOR_SIZE, block / SECTOR_SIZE, &buf[done]);
+		if (r < 0)
+			break;
+
+		done += block;
+	}
+
+	crypt_storage_destroy(s);
+
+	return r;
+}
+
 static int time_ms(struct timespec *start, struct timespec *end, double *ms)
 {
 	double start_ms, end_ms;
@@ -70,6 +118,9 @@ static int cipher_perf_one(struct cipher_perf *cp, char *buf,
 	size_t done = 0, block = CIPHER_BLOCK_BYTES;
 	int r;
 
+	if (cp->sector_size)
+		return storage_perf_one(cp, buf, buf_size, enc);
+
 	if (buf_size < block)
 		block = buf_size;
 
@@ -231,119 +282,1267 @@ out:
 	return r;
 }
 
-int crypt_benchmark_pbkdf(struct crypt_device *cd,
-	struct crypt_pbkdf_type *pbkdf,
-	const char *password,
-	size_t password_size,
-	const char *salt,
-	size_t salt_size,
+/* Every run processes the whole buffer once */
+static int cipher_perf_samples(struct cipher_perf *cp, unsigned runs,
+			       double *encryption_ms, double *decryption_ms)
+{
+	void *buf = NULL;
+	unsigned i;
+	int r = 0;
+
+	if (posix_memalign(&buf, crypt_getpagesize(), cp->buffer_size))
+		return -ENOMEM;
+
+	for (i = 0; i < runs && !r; i++)
+		r = cipher_measure(cp, buf, cp->buffer_size, 1, &encryption_ms[i]);
+
+	for (i = 0; i < runs && !r; i++)
+		r = cipher_measure(cp, buf, cp->buffer_size, 0, &decryption_ms[i]);
+
+	free(buf);
+	return r;
+}
+
+int crypt_benchmark_samples(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
 	size_t volume_key_size,
-	int (*progress)(uint32_t time_ms, void *usrptr),
-	void *usrptr)
+	size_t iv_size,
+	size_t buffer_size,
+	unsigned runs,
+	double *encryption_ms,
+	double *decryption_ms)
 {
+	struct cipher_perf cp = {
+		.key_length = volume_key_size,
+		.iv_length = iv_size,
+		.buffer_size = buffer_size,
+	};
+	char *c;
 	int r;
-	const char *kdf_opt;
 
-	if (!pbkdf || (!password && password_size))
+	if (!cipher || !cipher_mode || !volume_key_size || !buffer_size || !runs ||
+	    !encryption_ms || !decryption_ms)
 		return -EINVAL;
 
 	r = init_crypto(cd);
 	if (r < 0)
 		return r;
 
-	kdf_opt = !strcmp(pbkdf->type, CRYPT_KDF_PBKDF2) ? pbkdf->hash : "";
+	r = -ENOMEM;
+	if (iv_size) {
+		cp.iv = malloc(iv_size);
+		if (!cp.iv)
+			goto out;
+		crypt_random_get(cd, cp.iv, iv_size, CRYPT_RND_NORMAL);
+	}
 
-	log_dbg("Running %s(%s) benchmark.", pbkdf->type, kdf_opt);
+	cp.key = malloc(volume_key_size);
+	if (!cp.key)
+		goto out;
 
-	r = crypt_pbkdf_perf(pbkdf->type, pbkdf->hash, password, password_size,
-			     salt, salt_size, volume_key_size, pbkdf->time_ms,
-			     pbkdf->max_memory_kb, pbkdf->parallel_threads,
-			     &pbkdf->iterations, &pbkdf->max_memory_kb, progress, usrptr);
+	crypt_random_get(cd, cp.key, volume_key_size, CRYPT_RND_NORMAL);
+	strncpy(cp.name, cipher, sizeof(cp.name)-1);
+	strncpy(cp.mode, cipher_mode, sizeof(cp.mode)-1);
 
-	if (!r)
-		log_dbg("Benchmark returns %s(%s) %u iterations, %u memory, %u threads (for %zu-bits key).",
-			pbkdf->type, kdf_opt, pbkdf->iterations, pbkdf->max_memory_kb,
-			pbkdf->parallel_threads, volume_key_size * 8);
+	/* Ignore IV generator */
+	if ((c  = strchr(cp.mode, '-')))
+		*c = '\0';
+
+	r = cipher_perf_samples(&cp, runs, encryption_ms, decryption_ms);
+out:
+	free(cp.key);
+	free(cp.iv);
 	return r;
 }
 
-static int benchmark_callback(uint32_t time_ms, void *usrptr)
+int crypt_benchmark_sector(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	size_t sector_size,
+	size_t buffer_size,
+	double *encryption_mbs,
+	double *decryption_mbs)
 {
-	struct crypt_pbkdf_type *pbkdf = usrptr;
+	struct cipher_perf cp = {
+		.key_length = volume_key_size,
+		.buffer_size = buffer_size,
+		.sector_size = sector_size,
+	};
+	int r;
 
-	log_dbg("PBKDF benchmark: memory cost = %u, iterations = %u, "
-		"threads = %u (took %u ms)", pbkdf->max_memory_kb,
-		pbkdf->iterations, pbkdf->parallel_threads, time_ms);
+	if (!cipher || !cipher_mode || !volume_key_size || !encryption_mbs || !decryption_mbs ||
+	    sector_size < SECTOR_SIZE || sector_size > CIPHER_BLOCK_BYTES ||
+	    (sector_size & (sector_size - 1)) || buffer_size < sector_size)
+		return -EINVAL;
 
-	return 0;
+	r = init_crypto(cd);
+	if (r < 0)
+		return r;
+
+	cp.key = malloc(volume_key_size);
+	if (!cp.key)
+		return -ENOMEM;
+
+	crypt_random_get(cd, cp.key, volume_key_size, CRYPT_RND_NORMAL);
+	strncpy(cp.name, cipher, sizeof(cp.name)-1);
+	strncpy(cp.mode, cipher_mode, sizeof(cp.mode)-1);
+
+	r = cipher_perf(&cp, encryption_mbs, decryption_mbs);
+
+	free(cp.key);
+	return r;
+}
+
+size_t crypt_benchmark_block_size(void)
+{
+	return CIPHER_BLOCK_BYTES;
+}
+
+const char *crypt_benchmark_backend(struct crypt_device *cd)
+{
+	if (init_crypto(cd) < 0)
+		return NULL;
+
+	return crypt_backend_version();
 }
 
 /*
- * Used in internal places to benchmark crypt_device context PBKDF.
- * Once requested parameters are benchmarked, iterations attribute is set,
- * and the benchmarked values can be reused.
- * Note that memory cost can be changed after benchmark (if used).
- * NOTE: You need to check that you are benchmarking for the same key size.
+ * Concurrent benchmarks run the same test in several threads at once,
+ * threads are pinned round-robin to CPUs the process is allowed to run on.
+ * All threads are released together after all of them are created.
  */
-int crypt_benchmark_pbkdf_internal(struct crypt_device *cd,
-				   struct crypt_pbkdf_type *pbkdf,
-				   size_t volume_key_size)
+#define BENCH_MAX_THREADS 1024
+
+struct bench_threads {
+	unsigned threads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int go;
+
+	/* cipher benchmark */
+	struct cipher_perf *cp;
+
+	/* PBKDF benchmark */
+	const struct crypt_pbkdf_type *pbkdf;
+	size_t volume_key_size;
+};
+
+struct bench_thread {
+	struct bench_threads *bt;
+	pthread_t thread;
+	double encryption_mbs;
+	double decryption_mbs;
+	double ms;
+	int r;
+};
+
+/* Returns 0 if the thread should run the test */
+static int bench_thread_wait(struct bench_threads *bt)
 {
-	struct crypt_pbkdf_limits pbkdf_limits;
-	double PBKDF2_tmp;
-	uint32_t ms_tmp;
-	int r = -EINVAL;
+	int go;
 
-	r = crypt_pbkdf_get_limits(pbkdf->type, &pbkdf_limits);
-	if (r)
-		return r;
+	pthread_mutex_lock(&bt->lock);
+	while (!bt->go)
+		pthread_cond_wait(&bt->cond, &bt->lock);
+	go = bt->go;
+	pthread_mutex_unlock(&bt->lock);
 
-	if (pbkdf->flags & CRYPT_PBKDF_NO_BENCHMARK) {
-		if (pbkdf->iterations) {
-			log_dbg("Reusing PBKDF values (no benchmark flag is set).");
-			return 0;
-		}
-		log_err(cd, _("PBKDF benchmark disabled but iterations not set."));
-		return -EINVAL;
-	}
+	return go > 0 ? 0 : -EINTR;
+}
 
-	/* For PBKDF2 run benchmark always. Also note it depends on volume_key_size! */
-	if (!strcmp(pbkdf->type, CRYPT_KDF_PBKDF2)) {
-		/*
-		 * For PBKDF2 it is enough to run benchmark for only 1 second
-		 * and interpolate final iterations value from it.
-		 */
-		ms_tmp = pbkdf->time_ms;
-		pbkdf->time_ms = 1000;
-		pbkdf->parallel_threads = 0; /* N/A in PBKDF2 */
-		pbkdf->max_memory_kb = 0; /* N/A in PBKDF2 */
+static void *bench_cipher_thread(void *arg)
+{
+	struct bench_thread *t = arg;
 
-		r = crypt_benchmark_pbkdf(cd, pbkdf, "foo", 3, "bar", 3,
-					volume_key_size, &benchmark_callback, pbkdf);
-		pbkdf->time_ms = ms_tmp;
-		if (r < 0) {
-			log_err(cd, _("Not compatible PBKDF2 options (using hash algorithm %s)."),
-				pbkdf->hash);
-			return r;
-		}
+	t->r = bench_thread_wait(t->bt);
+	if (!t->r)
+		t->r = cipher_perf(t->bt->cp, &t->encryption_mbs, &t->decryption_mbs);
 
-		PBKDF2_tmp = ((double)pbkdf->iterations * pbkdf->time_ms / 1000.);
-		if (PBKDF2_tmp > (double)UINT32_MAX)
-			return -EINVAL;
-		pbkdf->iterations = at_least((uint32_t)PBKDF2_tmp, pbkdf_limits.min_iterations);
-	} else {
-		/* Already benchmarked */
-		if (pbkdf->iterations) {
-			log_dbg("Reusing PBKDF values.");
-			return 0;
+	return NULL;
+}
+
+static void *bench_pbkdf_thread(void *arg)
+{
+	struct bench_thread *t = arg;
+	const struct crypt_pbkdf_type *pbkdf = t->bt->pbkdf;
+	struct timespec start, end;
+	char *key;
+
+	key = crypt_safe_alloc(t->bt->volume_key_size);
+	t->r = key ? bench_thread_wait(t->bt) : -ENOMEM;
+
+	if (!t->r && clock_gettime(CLOCK_MONOTONIC, &start) < 0)
+		t->r = -EINVAL;
+	if (!t->r)
+		t->r = crypt_pbkdf(pbkdf->type, pbkdf->hash, "foo", 3,
+				   "0123456789abcdef0123456789abcdef", 32,
+				   key, t->bt->volume_key_size, pbkdf->iterations,
+				   pbkdf->max_memory_kb, pbkdf->parallel_threads);
+	if (!t->r && clock_gettime(CLOCK_MONOTONIC, &end) < 0)
+		t->r = -EINVAL;
+	if (!t->r)
+		t->r = time_ms(&start, &end, &t->ms);
+
+	crypt_safe_free(key);
+	return NULL;
+}
+
+static int bench_threads_run(struct bench_threads *bt, struct bench_thread *t,
+			     void *(*fn)(void *))
+{
+	pthread_attr_t attr;
+	cpu_set_t allowed, cpu;
+	unsigned i, nthreads, ncpus = 0, cpus[CPU_SETSIZE];
+	int r = 0;
+
+	if (!sched_getaffinity(0, sizeof(allowed), &allowed))
+		for (i = 0; i < CPU_SETSIZE; i++)
+			if (CPU_ISSET(i, &allowed))
+				cpus[ncpus++] = i;
+
+	if (pthread_mutex_init(&bt->lock, NULL))
+		return -ENOMEM;
+	if (pthread_cond_init(&bt->cond, NULL)) {
+		pthread_mutex_destroy(&bt->lock);
+		return -ENOMEM;
+	}
+
+	for (nthreads = 0; nthreads < bt->threads; nthreads++) {
+		t[nthreads].bt = bt;
+		if (pthread_attr_init(&attr)) {
+			r = -ENOMEM;
+			break;
+		}
+		if (ncpus) {
+			CPU_ZERO(&cpu);
+			CPU_SET(cpus[nthreads % ncpus], &cpu);
+			(void)pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
 		}
+		if (pthread_create(&t[nthreads].thread, &attr, fn, &t[nthreads]))
+			r = -ENOMEM;
+		pthread_attr_destroy(&attr);
+		if (r)
+			break;
+	}
 
-		r = crypt_benchmark_pbkdf(cd, pbkdf, "foo", 3,
-			"0123456789abcdef0123456789abcdef", 32,
-			volume_key_size, &benchmark_callback, pbkdf);
-		if (r < 0)
-			log_err(cd, _("Not compatible PBKDF options."));
+	if (r)
+		log_dbg("Cannot start benchmark thread %u.", nthreads);
+
+	pthread_mutex_lock(&bt->lock);
+	bt->go = r ? -1 : 1;
+	pthread_cond_broadcast(&bt->cond);
+	pthread_mutex_unlock(&bt->lock);
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(t[i].thread, NULL);
+		if (!r && t[i].r)
+			r = t[i].r;
 	}
 
+	pthread_cond_destroy(&bt->cond);
+	pthread_mutex_destroy(&bt->lock);
 	return r;
 }
+
+int crypt_benchmark_threads(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	size_t iv_size,
+	size_t buffer_size,
+	unsigned threads,
+	double *encryption_mbs,
+	double *decryption_mbs)
+{
+	struct cipher_perf cp = {
+		.key_length = volume_key_size,
+		.iv_length = iv_size,
+		.buffer_size = buffer_size,
+	};
+	struct bench_threads bt = {
+		.threads = threads,
+		.cp = &cp,
+	};
+	struct bench_thread *t = NULL;
+	unsigned i;
+	char *c;
+	int r;
+
+	if (!cipher || !cipher_mode || !volume_key_size || !encryption_mbs || !decryption_mbs ||
+	    !threads || threads > BENCH_MAX_THREADS)
+		return -EINVAL;
+
+	r = init_crypto(cd);
+	if (r < 0)
+		return r;
+
+	r = -ENOMEM;
+	t = calloc(threads, sizeof(*t));
+	if (!t)
+		goto out;
+
+	if (iv_size) {
+		cp.iv = malloc(iv_size);
+		if (!cp.iv)
+			goto out;
+		crypt_random_get(cd, cp.iv, iv_size, CRYPT_RND_NORMAL);
+	}
+
+	cp.key = malloc(volume_key_size);
+	if (!cp.key)
+		goto out;
+
+	crypt_random_get(cd, cp.key, volume_key_size, CRYPT_RND_NORMAL);
+	strncpy(cp.name, cipher, sizeof(cp.name)-1);
+	strncpy(cp.mode, cipher_mode, sizeof(cp.mode)-1);
+
+	/* Ignore IV generator */
+	if ((c  = strchr(cp.mode, '-')))
+		*c = '\0';
+
+	log_dbg("Running %s-%s benchmark in %u threads.", cp.name, cp.mode, threads);
+
+	r = bench_threads_run(&bt, t, bench_cipher_thread);
+	if (r < 0)
+		goto out;
+
+	*encryption_mbs = *decryption_mbs = 0.0;
+	for (i = 0; i < threads; i++) {
+		*encryption_mbs += t[i].encryption_mbs;
+		*decryption_mbs += t[i].decryption_mbs;
+	}
+out:
+	free(t);
+	free(cp.key);
+	free(cp.iv);
+	return r;
+}
+
+int crypt_benchmark_tcrypt(struct crypt_device *cd,
+	unsigned index,
+	const char **cipher,
+	const char **cipher_mode,
+	size_t buffer_size,
+	double *encryption_mbs,
+	double *decryption_mbs)
+{
+	if (!cipher || !cipher_mode || !encryption_mbs || !decryption_mbs)
+		return -EINVAL;
+
+	return TCRYPT_benchmark(cd, index, cipher, cipher_mode, buffer_size,
+				encryption_mbs, decryption_mbs);
+}
+
+int crypt_benchmark_verity(struct crypt_device *cd,
+	const char *hash_name,
+	uint32_t hash_type,
+	uint32_t block_size,
+	uint32_t salt_size,
+	unsigned threads,
+	double *hash_mbs,
+	double *tree_mbs)
+{
+	int r;
+
+	if (!hash_name || !hash_mbs || !tree_mbs || hash_type > VERITY_MAX_HASH_TYPE ||
+	    VERITY_BLOCK_SIZE_OK(block_size) || threads > BENCH_MAX_THREADS)
+		return -EINVAL;
+
+	r = init_crypto(cd);
+	if (r < 0)
+		return r;
+
+	log_dbg("Running verity %s benchmark, block %u, %u threads.",
+		hash_name, block_size, threads ?: 1);
+
+	r = VERITY_benchmark(cd, hash_name, hash_type, block_size, salt_size,
+			     threads, 0, hash_mbs);
+	if (!r)
+		r = VERITY_benchmark(cd, hash_name, hash_type, block_size, salt_size,
+				     threads, 1, tree_mbs);
+	return r;
+}
+
+int crypt_benchmark_verity_fec(struct crypt_device *cd,
+	uint32_t fec_roots,
+	unsigned threads,
+	double *encode_mbs,
+	double *decode_mbs)
+{
+	if (!encode_mbs || !decode_mbs || threads > BENCH_MAX_THREADS)
+		return -EINVAL;
+
+	log_dbg("Running FEC benchmark, %u roots, %u threads.", fec_roots, threads ?: 1);
+
+	return VERITY_FEC_benchmark(fec_roots, threads, encode_mbs, decode_mbs);
+}
+
+/*
+ * Integrity benchmark computes one tag per sector over sector number and data,
+ * as dm-crypt HMAC modes (with cipher) or dm-integrity internal hash (without).
+ * AEAD modes exist only in kernel crypto API, these run in storage benchmark.
+ */
+static int integrity_perf_one(const char *hash, const char *key, size_t key_length,
+			      char *buf, size_t buf_size, size_t sector_size,
+			      size_t tag_size)
+{
+	struct crypt_hash *h = NULL;
+	struct crypt_hmac *hmac = NULL;
+	char tag[64];
+	uint64_t sector;
+	size_t done;
+	int r;
+
+	if (key_length)
+		r = crypt_hmac_init(&hmac, hash, key, key_length);
+	else
+		r = crypt_hash_init(&h, hash);
+	if (r < 0) {
+		log_dbg("Cannot initialise integrity hash %s.", hash);
+		return r;
+	}
+
+	for (done = 0; !r && done + sector_size <= buf_size; done += sector_size) {
+		sector = cpu_to_le64(done / SECTOR_SIZE);
+		if (hmac) {
+			r = crypt_hmac_write(hmac, (const char *)&sector, sizeof(sector));
+			if (!r)
+				r = crypt_hmac_write(hmac, &buf[done], sector_size);
+			if (!r)
+				r = crypt_hmac_final(hmac, tag, tag_size);
+		} else {
+			r = crypt_hash_write(h, (const char *)&sector, sizeof(sector));
+			if (!r)
+				r = crypt_hash_write(h, &buf[done], sector_size);
+			if (!r)
+				r = crypt_hash_final(h, tag, tag_size);
+		}
+	}
+
+	if (hmac)
+		crypt_hmac_destroy(hmac);
+	else
+		crypt_hash_destroy(h);
+	crypt_memzero(tag, sizeof(tag));
+
+	return r;
+}
+
+static int integrity_perf(const char *hash, const char *key, size_t key_length,
+			  size_t sector_size, size_t buffer_size, double *mbs)
+{
+	struct timespec start, end;
+	double ms, total_ms = 0.0;
+	unsigned repeat = 0;
+	void *buf = NULL;
+	int tag_size, r = 0;
+
+	tag_size = crypt_hash_size(hash);
+	if (tag_size <= 0 || tag_size > 64)
+		return -ENOTSUP;
+
+	if (posix_memalign(&buf, crypt_getpagesize(), buffer_size))
+		return -ENOMEM;
+	memset(buf, 0x5a, buffer_size);
+
+	while (!r && total_ms < 1000.0) {
+		if (clock_gettime(CLOCK_MONOTONIC, &start) < 0)
+			r = -EINVAL;
+		if (!r)
+			r = integrity_perf_one(hash, key, key_length, buf, buffer_size,
+					       sector_size, tag_size);
+		if (!r && clock_gettime(CLOCK_MONOTONIC, &end) < 0)
+			r = -EINVAL;
+		if (!r)
+			r = time_ms(&start, &end, &ms);
+		if (!r && ms < CIPHER_TIME_MIN_MS) {
+			log_dbg("Measured integrity runtime (%1.6f) is too low.", ms);
+			r = -ERANGE;
+		}
+		total_ms += ms;
+		repeat++;
+	}
+
+	free(buf);
+
+	if (!r)
+		*mbs = speed_mbs(buffer_size * repeat, total_ms);
+	return r;
+}
+
+/* Speed of cipher and integrity processing the whole buffer in turn */
+static double integrity_combined_mbs(double cipher_mbs, double integrity_mbs)
+{
+	return 1.0 / (1.0 / cipher_mbs + 1.0 / integrity_mbs);
+}
+
+int crypt_benchmark_integrity(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	const char *integrity,
+	size_t volume_key_size,
+	size_t sector_size,
+	size_t buffer_size,
+	uint32_t *tag_size,
+	double *write_mbs,
+	double *read_mbs)
+{
+	struct cipher_perf cp = {
+		.buffer_size = buffer_size,
+		.sector_size = sector_size,
+	};
+	char hash[MAX_CIPHER_LEN], *key = NULL, *c;
+	double int_mbs, enc_mbs, dec_mbs;
+	size_t key_length = 0;
+	int r;
+
+	if (!integrity || !tag_size || !write_mbs || !read_mbs ||
+	    (cipher && !cipher_mode) || sector_size < SECTOR_SIZE ||
+	    sector_size > CIPHER_BLOCK_BYTES || (sector_size & (sector_size - 1)) ||
+	    buffer_size < sector_size)
+		return -EINVAL;
+
+	if (cipher) {
+		/* dm-crypt authenticated mode, volume key includes integrity key */
+		r = INTEGRITY_key_size(cd, integrity);
+		if (r < 0 || (size_t)r >= volume_key_size)
+			return -EINVAL;
+		key_length = r;
+
+		r = INTEGRITY_tag_size(cd, integrity, cipher, cipher_mode);
+		if (r <= 0)
+			return -EINVAL;
+		*tag_size = r;
+
+		if (!strcmp(integrity, "aead") || !strcmp(integrity, "poly1305"))
+			return -ENOTSUP;
+	} else if (!strncmp(integrity, "hmac(", 5)) {
+		/* dm-integrity internal hash, the whole key is HMAC key */
+		if (!volume_key_size)
+			return -EINVAL;
+		key_length = volume_key_size;
+	} else if (volume_key_size)
+		return -EINVAL;
+
+	if (!strncmp(integrity, "hmac(", 5)) {
+		if (snprintf(hash, sizeof(hash), "%s", integrity + 5) < 0 ||
+		    !(c = strchr(hash, ')')) || c[1])
+			return -EINVAL;
+		*c = '\0';
+	} else if (cipher && strcmp(integrity, "none"))
+		return -ENOTSUP;
+	else if (snprintf(hash, sizeof(hash), "%s", integrity) < 0)
+		return -EINVAL;
+
+	r = init_crypto(cd);
+	if (r < 0)
+		return r;
+
+	if (!cipher) {
+		r = crypt_hash_size(hash);
+		if (r <= 0)
+			return -ENOTSUP;
+		*tag_size = r;
+	}
+
+	log_dbg("Running integrity %s benchmark%s%s%s%s, sector %zu, tag %u bytes.",
+		integrity, cipher ? " with " : "", cipher ?: "", cipher ? "-" : "",
+		cipher_mode ?: "", sector_size, *tag_size);
+
+	key = malloc(volume_key_size ?: 1);
+	if (!key)
+		return -ENOMEM;
+	crypt_random_get(cd, key, volume_key_size, CRYPT_RND_NORMAL);
+
+	/* Only IV for random modes is stored in tag, "none" hashes nothing */
+	if (!cipher || strcmp(integrity, "none"))
+		r = integrity_perf(hash, key + volume_key_size - key_length, key_length,
+				   sector_size, buffer_size, &int_mbs);
+	else
+		int_mbs = 0.0;
+
+	if (!r && cipher) {
+		cp.key = key;
+		cp.key_length = volume_key_size - key_length;
+		strncpy(cp.name, cipher, sizeof(cp.name)-1);
+
+		/* Random IV is read from tag, sector IV costs about the same */
+		if (!strcmp(cipher_mode, "random"))
+			r = -ENOTSUP;
+		else if (snprintf(cp.mode, sizeof(cp.mode), "%s", cipher_mode) < 0)
+			r = -EINVAL;
+		else if ((c = strchr(cp.mode, '-')) && !strcmp(c, "-random"))
+			strcpy(c, "-plain64");
+
+		if (!r)
+			r = cipher_perf(&cp, &enc_mbs, &dec_mbs);
+		if (!r && int_mbs != 0.0) {
+			*write_mbs = integrity_combined_mbs(enc_mbs, int_mbs);
+			*read_mbs = integrity_combined_mbs(dec_mbs, int_mbs);
+		} else if (!r) {
+			*write_mbs = enc_mbs;
+			*read_mbs = dec_mbs;
+		}
+	} else if (!r)
+		*write_mbs = *read_mbs = int_mbs;
+
+	crypt_memzero(key, volume_key_size);
+	free(key);
+	return r;
+}
+
+/*
+ * Storage benchmark runs I/O through a temporary dm-crypt mapping,
+ * so the result includes kernel crypto, dm-crypt queueing and the device.
+ * Without user device a file on tmpfs (over loop device) is used.
+ */
+#define DEVICE_BENCH_TIME_MS	1000
+#define DEVICE_BENCH_RAM_DIR	"/dev/shm"
+#define DEVICE_BENCH_RAM_SIZE	(64 * 1024 * 1024)
+#define DEVICE_BENCH_MAX_DEPTH	256
+#define DEVICE_BENCH_PERF_FLAGS	(CRYPT_ACTIVATE_SAME_CPU_CRYPT | \
+				 CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS | \
+				 CRYPT_ACTIVATE_NO_READ_WORKQUEUE | \
+				 CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE | \
+				 CRYPT_ACTIVATE_HIGH_PRIORITY)
+
+struct device_perf {
+	const char *path;
+	uint64_t blocks;	/* number of I/O blocks in tested area */
+	size_t block_size;
+	int random;
+	int write;
+
+	uint64_t next;		/* next sequential block */
+	uint64_t ops;		/* finished requests of all workers */
+	double ms;		/* the longest worker runtime */
+	int r;
+	pthread_mutex_t lock;
+};
+
+struct device_perf_worker {
+	struct device_perf *dp;
+	uint64_t seed;
+	pthread_t thread;
+};
+
+static void *device_perf_thread(void *arg)
+{
+	struct device_perf_worker *w = arg;
+	struct device_perf *dp = w->dp;
+	struct timespec start, now;
+	uint64_t block, ops = 0, x = w->seed | 1;
+	double ms = 0.0;
+	void *buf = NULL;
+	ssize_t len;
+	int fd, r = 0;
+
+	fd = open(dp->path, (dp->write ? O_WRONLY : O_RDONLY) | O_DIRECT);
+	if (fd < 0)
+		r = -EIO;
+	else if (posix_memalign(&buf, crypt_getpagesize(), dp->block_size))
+		r = -ENOMEM;
+	else if (clock_gettime(CLOCK_MONOTONIC, &start) < 0)
+		r = -EINVAL;
+	else
+		memset(buf, 0x5a, dp->block_size);
+
+	while (!r && ms < DEVICE_BENCH_TIME_MS) {
+		if (dp->random) {
+			/* xorshift64, quality is not important here */
+			x ^= x << 13;
+			x ^= x >> 7;
+			x ^= x << 17;
+			block = x % dp->blocks;
+		} else {
+			pthread_mutex_lock(&dp->lock);
+			block = dp->next++ % dp->blocks;
+			pthread_mutex_unlock(&dp->lock);
+		}
+
+		if (dp->write)
+			len = pwrite(fd, buf, dp->block_size, block * dp->block_size);
+		else
+			len = pread(fd, buf, dp->block_size, block * dp->block_size);
+		if (len < 0 || (size_t)len != dp->block_size) {
+			r = -EIO;
+			break;
+		}
+		ops++;
+
+		if (clock_gettime(CLOCK_MONOTONIC, &now) < 0)
+			r = -EINVAL;
+		else
+			time_ms(&start, &now, &ms);
+	}
+
+	if (!r && dp->write && fsync(fd))
+		r = -EIO;
+
+	pthread_mutex_lock(&dp->lock);
+	dp->ops += ops;
+	if (ms > dp->ms)
+		dp->ms = ms;
+	if (r && !dp->r)
+		dp->r = r;
+	pthread_mutex_unlock(&dp->lock);
+
+	free(buf);
+	if (fd >= 0)
+		close(fd);
+	return NULL;
+}
+
+static int device_perf(struct device_perf *dp, unsigned queue_depth,
+		       double *mbs, double *iops)
+{
+	struct device_perf_worker *w;
+	unsigned i, nthreads;
+	int r;
+
+	w = calloc(queue_depth, sizeof(*w));
+	if (!w)
+		return -ENOMEM;
+
+	if (pthread_mutex_init(&dp->lock, NULL)) {
+		free(w);
+		return -ENOMEM;
+	}
+
+	dp->next = dp->ops = 0;
+	dp->ms = 0.0;
+	dp->r = 0;
+
+	crypt_random_get(NULL, (char *)&w[0].seed, sizeof(w[0].seed), CRYPT_RND_NORMAL);
+	for (nthreads = 0; nthreads < queue_depth; nthreads++) {
+		w[nthreads].dp = dp;
+		w[nthreads].seed = w[0].seed + nthreads * UINT64_C(0x9e3779b97f4a7c15);
+		if (pthread_create(&w[nthreads].thread, NULL, device_perf_thread, &w[nthreads]))
+			break;
+	}
+
+	if (nthreads < queue_depth)
+		log_dbg("Benchmark uses only %u of %u requested parallel requests.",
+			nthreads, queue_depth);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(w[i].thread, NULL);
+
+	r = nthreads ? dp->r : -ENOMEM;
+	if (!r && dp->ms < CIPHER_TIME_MIN_MS)
+		r = -ERANGE;
+	if (!r) {
+		*mbs = speed_mbs(dp->ops * dp->block_size, dp->ms);
+		*iops = dp->ops / (dp->ms / 1000.);
+	}
+
+	pthread_mutex_destroy(&dp->lock);
+	free(w);
+	return r;
+}
+
+/*
+ * dm-integrity under dm-crypt as LUKS2 with integrity uses it. Zeroed superblock
+ * is formatted by kernel on the first activation. Tested area is then wiped
+ * through dm-crypt, otherwise reads of not yet written sectors fail tag check.
+ */
+static int device_perf_integrity(struct crypt_device *cd, const char *int_name,
+				 struct crypt_dm_active_device *dmd,
+				 struct device **int_device)
+{
+	char int_path[PATH_MAX];
+	struct crypt_dm_active_device dmdi = {
+		.target = DM_INTEGRITY,
+		.data_device = dmd->data_device,
+		.size = 8,
+		.flags = CRYPT_ACTIVATE_PRIVATE,
+		.u.integrity = {
+			.offset = dmd->u.crypt.offset,
+			.tag_size = dmd->u.crypt.tag_size,
+			.sector_size = dmd->u.crypt.sector_size,
+		}
+	};
+	uint64_t sectors;
+	uint32_t dmi_flags;
+	int r;
+
+	if (dm_flags(DM_INTEGRITY, &dmi_flags) || !(dmi_flags & DM_INTEGRITY_SUPPORTED))
+		return -ENOTSUP;
+
+	if (snprintf(int_path, sizeof(int_path), "%s/%s", dm_get_dir(), int_name) < 0)
+		return -ENOMEM;
+
+	r = crypt_wipe_device(cd, dmd->data_device, CRYPT_WIPE_ZERO,
+			      dmd->u.crypt.offset * SECTOR_SIZE, 4096, 4096, NULL, NULL);
+	if (r < 0)
+		return r;
+
+	r = dm_create_device(cd, int_name, "TEMP", &dmdi, 0);
+	if (r < 0)
+		return r;
+	dm_remove_device(cd, int_name, CRYPT_DEACTIVATE_FORCE);
+
+	r = INTEGRITY_data_sectors(cd, dmd->data_device,
+				   dmd->u.crypt.offset * SECTOR_SIZE, &sectors);
+	if (r < 0)
+		return r;
+
+	dmdi.size = sectors;
+	dmdi.flags |= dmd->flags & CRYPT_ACTIVATE_NO_JOURNAL;
+	r = dm_create_device(cd, int_name, "TEMP", &dmdi, 0);
+	if (r < 0)
+		return r;
+
+	r = device_alloc(int_device, int_path);
+	if (r < 0) {
+		dm_remove_device(cd, int_name, CRYPT_DEACTIVATE_FORCE);
+		return r;
+	}
+
+	dmd->data_device = *int_device;
+	dmd->u.crypt.offset = 0;
+	if (dmd->size > sectors)
+		dmd->size = sectors;
+	dmd->flags &= ~CRYPT_ACTIVATE_NO_JOURNAL;
+
+	return 0;
+}
+
+static int device_perf_ram_file(struct crypt_device *cd, char *file, size_t file_size,
+				uint64_t size)
+{
+	int fd;
+
+	if (snprintf(file, file_size, "%s/cryptsetup-benchmark-XXXXXX",
+		     DEVICE_BENCH_RAM_DIR) < 0)
+		return -ENOMEM;
+
+	fd = mkstemp(file);
+	if (fd < 0) {
+		log_err(cd, _("Cannot create temporary file in %s."), DEVICE_BENCH_RAM_DIR);
+		return -EINVAL;
+	}
+
+	if (posix_fallocate(fd, 0, size)) {
+		log_err(cd, _("Cannot allocate memory for temporary benchmark device."));
+		close(fd);
+		unlink(file);
+		return -ENOMEM;
+	}
+
+	close(fd);
+	return 0;
+}
+
+int crypt_benchmark_device(struct crypt_device *cd,
+	const char *cipher,
+	const char *cipher_mode,
+	size_t volume_key_size,
+	const struct crypt_params_benchmark *params,
+	double *read_mbs,
+	double *write_mbs,
+	double *read_iops,
+	double *write_iops)
+{
+	char name[64], int_name[68], path[PATH_MAX], ram_file[PATH_MAX] = "";
+	char cipher_spec[MAX_CIPHER_LEN * 3];
+	struct crypt_dm_active_device dmd = {
+		.target = DM_CRYPT,
+		.flags  = CRYPT_ACTIVATE_PRIVATE,
+		.u.crypt = {
+			.cipher = cipher_spec,
+		}
+	};
+	struct device_perf dp = {
+		.path = path,
+	};
+	struct device *data_device = NULL, *int_device = NULL, *top_device = NULL;
+	struct volume_key *vk = NULL;
+	uint64_t size;
+	uint32_t dmt_flags;
+	int r, readonly;
+
+	if (!cipher || !cipher_mode || !volume_key_size || !params ||
+	    !read_mbs || !write_mbs || !read_iops || !write_iops)
+		return -EINVAL;
+
+	readonly = params->flags & CRYPT_BENCHMARK_READONLY ? 1 : 0;
+
+	if (params->activation_flags & ~(DEVICE_BENCH_PERF_FLAGS |
+	    (params->integrity ? CRYPT_ACTIVATE_NO_JOURNAL : 0)) ||
+	    params->offset % SECTOR_SIZE || (params->integrity && readonly))
+		return -EINVAL;
+
+	if (params->integrity) {
+		r = INTEGRITY_tag_size(cd, params->integrity, cipher, cipher_mode);
+		if (r <= 0)
+			return -EINVAL;
+		dmd.u.crypt.tag_size = r;
+		dmd.u.crypt.integrity = params->integrity;
+	}
+	dmd.flags |= params->activation_flags;
+	dmd.u.crypt.offset = params->offset / SECTOR_SIZE;
+
+	dmd.u.crypt.sector_size = params->sector_size ?: SECTOR_SIZE;
+	dp.block_size = params->block_size;
+	dp.random = params->flags & CRYPT_BENCHMARK_RANDOM ? 1 : 0;
+
+	if (!dp.block_size || dp.block_size % dmd.u.crypt.sector_size ||
+	    !params->queue_depth || params->queue_depth > DEVICE_BENCH_MAX_DEPTH)
+		return -EINVAL;
+
+	if (snprintf(cipher_spec, sizeof(cipher_spec), "%s-%s", cipher, cipher_mode) < 0 ||
+	    snprintf(name, sizeof(name), "temporary-cryptsetup-benchmark-%d", getpid()) < 0 ||
+	    snprintf(int_name, sizeof(int_name), "%s_dif", name) < 0 ||
+	    snprintf(path, sizeof(path), "%s/%s", dm_get_dir(), name) < 0)
+		return -ENOMEM;
+
+	r = init_crypto(cd);
+	if (r < 0)
+		return r;
+
+	/* Never let dm silently drop tested options */
+	if (params->activation_flags) {
+		if (dm_flags(DM_CRYPT, &dmt_flags))
+			return -ENOTSUP;
+		if ((params->activation_flags & (CRYPT_ACTIVATE_SAME_CPU_CRYPT | CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS) &&
+		     !(dmt_flags & DM_SAME_CPU_CRYPT_SUPPORTED)) ||
+		    (params->activation_flags & (CRYPT_ACTIVATE_NO_READ_WORKQUEUE | CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE) &&
+		     !(dmt_flags & DM_CRYPT_NO_WORKQUEUE_SUPPORTED)) ||
+		    (params->activation_flags & CRYPT_ACTIVATE_HIGH_PRIORITY &&
+		     !(dmt_flags & DM_CRYPT_HIGH_PRIORITY_SUPPORTED)))
+			return -ENOTSUP;
+	}
+
+	if (!params->device) {
+		r = device_perf_ram_file(cd, ram_file, sizeof(ram_file),
+					 params->size ?: DEVICE_BENCH_RAM_SIZE);
+		if (r < 0)
+			return r;
+	}
+
+	r = device_alloc(&dmd.data_device, params->device ?: ram_file);
+	if (r < 0)
+		goto out;
+
+	size = params->size / SECTOR_SIZE;
+	r = device_block_adjust(cd, dmd.data_device, readonly ? DEV_SHARED : DEV_EXCL,
+				dmd.u.crypt.offset, &size, &dmd.flags);
+	if (r < 0)
+		goto out;
+
+	if (readonly)
+		dmd.flags |= CRYPT_ACTIVATE_READONLY | CRYPT_ACTIVATE_SHARED;
+	else if (dmd.flags & CRYPT_ACTIVATE_READONLY) {
+		log_err(cd, _("Cannot write to device %s, permission denied."),
+			device_path(dmd.data_device));
+		r = -EACCES;
+		goto out;
+	}
+
+	dp.blocks = size * SECTOR_SIZE / dp.block_size;
+	if (!dp.blocks) {
+		log_err(cd, _("Device %s is too small."), device_path(dmd.data_device));
+		r = -EINVAL;
+		goto out;
+	}
+	dmd.size = dp.blocks * dp.block_size / SECTOR_SIZE;
+
+	vk = crypt_generate_volume_key(cd, volume_key_size);
+	if (!vk) {
+		r = -ENOMEM;
+		goto out;
+	}
+	dmd.u.crypt.vk = vk;
+
+	log_dbg("Running %s%s%s storage benchmark on %s, %s%s I/O of %zu bytes, "
+		"queue depth %u, sector size %u, flags 0x%x.", cipher_spec,
+		params->integrity ? " " : "", params->integrity ?: "",
+		device_path(dmd.data_device), readonly ? "read-only " : "",
+		dp.random ? "random" : "sequential", dp.block_size,
+		params->queue_depth, dmd.u.crypt.sector_size, params->activation_flags);
+
+	if (params->integrity) {
+		data_device = dmd.data_device;
+		r = device_perf_integrity(cd, int_name, &dmd, &int_device);
+		if (r < 0)
+			goto out;
+		dp.blocks = dmd.size * SECTOR_SIZE / dp.block_size;
+		dmd.size = dp.blocks * dp.block_size / SECTOR_SIZE;
+		if (!dp.blocks) {
+			r = -EINVAL;
+			goto out;
+		}
+	}
+
+	r = dm_create_device(cd, name, "TEMP", &dmd, 0);
+	if (r < 0)
+		goto out;
+
+	if (params->integrity) {
+		r = device_alloc(&top_device, path);
+		if (!r)
+			r = crypt_wipe_device(cd, top_device, CRYPT_WIPE_ZERO, 0,
+					      dmd.size * SECTOR_SIZE, 1024 * 1024, NULL, NULL);
+	}
+
+	if (!r && readonly) {
+		*write_mbs = *write_iops = 0.0;
+	} else if (!r) {
+		dp.write = 1;
+		r = device_perf(&dp, params->queue_depth, write_mbs, write_iops);
+	}
+	if (!r) {
+		dp.write = 0;
+		r = device_perf(&dp, params->queue_depth, read_mbs, read_iops);
+	}
+
+	device_free(top_device);
+	dm_remove_device(cd, name, CRYPT_DEACTIVATE_FORCE);
+out:
+	if (int_device) {
+		device_free(int_device);
+		dm_remove_device(cd, int_name, CRYPT_DEACTIVATE_FORCE);
+		dmd.data_device = data_device;
+	}
+	crypt_free_volume_key(vk);
+	device_free(dmd.data_device);
+	if (*ram_file)
+		unlink(ram_file);
+	return r;
+}
+
+int crypt_benchmark_pbkdf(struct crypt_device *cd,
+	struct crypt_pbkdf_type *pbkdf,
+	const char *password,
+	size_t password_size,
+	const char *salt,
+	size_t salt_size,
+	size_t volume_key_size,
+	int (*progress)(uint32_t time_ms, void *usrptr),
+	void *usrptr)
+{
+	int r;
+	const char *kdf_opt;
+
+	if (!pbkdf || (!password && password_size))
+		return -EINVAL;
+
+	r = init_crypto(cd);
+	if (r < 0)
+		return r;
+
+	kdf_opt = !strcmp(pbkdf->type, CRYPT_KDF_PBKDF2) ? pbkdf->hash : "";
+
+	log_dbg("Running %s(%s) benchmark.", pbkdf->type, kdf_opt);
+
+	r = crypt_pbkdf_perf(pbkdf->type, pbkdf->hash, password, password_size,
+			     salt, salt_size, volume_key_size, pbkdf->time_ms,
+			     pbkdf->max_memory_kb, pbkdf->parallel_threads,
+			     &pbkdf->iterations, &pbkdf->max_memory_kb, progress, usrptr);
+
+	if (!r)
+		log_dbg("Benchmark returns %s(%s) %u iterations, %u memory, %u threads (for %zu-bits key).",
+			pbkdf->type, kdf_opt, pbkdf->iterations, pbkdf->max_memory_kb,
+			pbkdf->parallel_threads, volume_key_size * 8);
+	return r;
+}
+
+int crypt_benchmark_pbkdf_threads(struct crypt_device *cd,
+	const struct crypt_pbkdf_type *pbkdf,
+	size_t volume_key_size,
+	unsigned threads,
+	uint32_t *time_ms)
+{
+	struct bench_threads bt = {
+		.threads = threads,
+		.pbkdf = pbkdf,
+		.volume_key_size = volume_key_size,
+	};
+	struct bench_thread *t;
+	uint64_t memory_kb;
+	double ms = 0.0;
+	unsigned i;
+	int r;
+
+	if (!pbkdf || !pbkdf->type || !pbkdf->iterations || !volume_key_size ||
+	    !time_ms || !threads || threads > BENCH_MAX_THREADS)
+		return -EINVAL;
+
+	/* Do not let concurrent memory-hard KDFs to swap or to trigger OOM */
+	memory_kb = crypt_getphysmemory_kb();
+	if (memory_kb && (uint64_t)pbkdf->max_memory_kb * threads > memory_kb / 2) {
+		log_dbg("Not enough memory for %u concurrent %s derivations.",
+			threads, pbkdf->type);
+		return -ENOMEM;
+	}
+
+	r = init_crypto(cd);
+	if (r < 0)
+		return r;
+
+	t = calloc(threads, sizeof(*t));
+	if (!t)
+		return -ENOMEM;
+
+	log_dbg("Running %s benchmark in %u threads.", pbkdf->type, threads);
+
+	r = bench_threads_run(&bt, t, bench_pbkdf_thread);
+	if (!r) {
+		for (i = 0; i < threads; i++)
+			if (t[i].ms > ms)
+				ms = t[i].ms;
+		*time_ms = (uint32_t)ms;
+	}
+
+	free(t);
+	return r;
+}
+
+static int benchmark_callback(uint32_t time_ms, void *usrptr)
+{
+	struct crypt_pbkdf_type *pbkdf = usrptr;
+
+	log_dbg("PBKDF benchmark: memory cost = %u, iterations = %u, "
+		"threads = %u (took %u ms)", pbkdf->max_memory_kb,
+		pbkdf->iterations, pbkdf->parallel_threads, time_ms);
+
+	return 0;
+}
+
+/* Use cached values only if they satisfy PBKDF limits */
+static int benchmark_pbkdf_cached(struct crypt_pbkdf_type *pbkdf, size_t volume_key_size,
+				  const struct crypt_pbkdf_limits *limits)
+{
+	uint32_t iterations, memory_kb;
+
+	if (crypt_pbkdf_cache_get(pbkdf, volume_key_size, &iterations, &memory_kb))
+		return 0;
+
+	if (iterations < limits->min_iterations ||
+	    (memory_kb && memory_kb < limits->min_memory) ||
+	    memory_kb > pbkdf->max_memory_kb)
+		return 0;
+
+	log_dbg("Reusing cached PBKDF values.");
+	pbkdf->iterations = iterations;
+	pbkdf->max_memory_kb = memory_kb;
+	return 1;
+}
+
+static int benchmark_pbkdf(struct crypt_device *cd,
+			   struct crypt_pbkdf_type *pbkdf,
+			   size_t volume_key_size,
+			   bool use_cache)
+{
+	struct crypt_pbkdf_limits pbkdf_limits;
+	struct crypt_pbkdf_type requested;
+	double PBKDF2_tmp;
+	uint32_t ms_tmp;
+	int r = -EINVAL;
+
+	r = crypt_pbkdf_get_limits(pbkdf->type, &pbkdf_limits);
+	if (r)
+		return r;
+
+	if (pbkdf->flags & CRYPT_PBKDF_NO_BENCHMARK) {
+		if (pbkdf->iterations) {
+			log_dbg("Reusing PBKDF values (no benchmark flag is set).");
+			return 0;
+		}
+		log_err(cd, _("PBKDF benchmark disabled but iterations not set."));
+		return -EINVAL;
+	}
+
+	/* Cache is keyed by requested values, benchmark changes them */
+	requested = *pbkdf;
+
+	/* For PBKDF2 run benchmark always. Also note it depends on volume_key_size! */
+	if (!strcmp(pbkdf->type, CRYPT_KDF_PBKDF2)) {
+		if (use_cache && !init_crypto(cd) &&
+		    benchmark_pbkdf_cached(pbkdf, volume_key_size, &pbkdf_limits))
+			return 0;
+		/*
+		 * For PBKDF2 it is enough to run benchmark for only 1 second
+		 * and interpolate final iterations value from it.
+		 */
+		ms_tmp = pbkdf->time_ms;
+		pbkdf->time_ms = 1000;
+		pbkdf->parallel_threads = 0; /* N/A in PBKDF2 */
+		pbkdf->max_memory_kb = 0; /* N/A in PBKDF2 */
+
+		r = crypt_benchmark_pbkdf(cd, pbkdf, "foo", 3, "bar", 3,
+					volume_key_size, &benchmark_callback, pbkdf);
+		pbkdf->time_ms = ms_tmp;
+		if (r < 0) {
+			log_err(cd, _("Not compatible PBKDF2 options (using hash algorithm %s)."),
+				pbkdf->hash);
+			return r;
+		}
+
+		PBKDF2_tmp = ((double)pbkdf->iterations * pbkdf->time_ms / 1000.);
+		if (PBKDF2_tmp > (double)UINT32_MAX)
+			return -EINVAL;
+		pbkdf->iterations = at_least((uint32_t)PBKDF2_tmp, pbkdf_limits.min_iterations);
+	} else {
+		/* Already benchmarked */
+		if (pbkdf->iterations) {
+			log_dbg("Reusing PBKDF values.");
+			return 0;
+		}
+
+		if (use_cache && !init_crypto(cd) &&
+		    benchmark_pbkdf_cached(pbkdf, volume_key_size, &pbkdf_limits))
+			return 0;
+
+		r = crypt_benchmark_pbkdf(cd, pbkdf, "foo", 3,
+			"0123456789abcdef0123456789abcdef", 32,
+			volume_key_size, &benchmark_callback, pbkdf);
+		if (r < 0) {
+			log_err(cd, _("Not compatible PBKDF options."));
+			return r;
+		}
+	}
+
+	crypt_pbkdf_cache_put(&requested, volume_key_size,
+			      pbkdf->iterations, pbkdf->max_memory_kb);
+	return r;
+}
+
+/*
+ * Used in internal places to benchmark crypt_device context PBKDF.
+ * Once requested parameters are benchmarked, iterations attribute is set,
+ * and the benchmarked values can be reused.
+ * Note that memory cost can be changed after benchmark (if used).
+ * NOTE: You need to check that you are benchmarking for the same key size.
+ */
+int crypt_benchmark_pbkdf_internal(struct crypt_device *cd,
+				   struct crypt_pbkdf_type *pbkdf,
+				   size_t volume_key_size)
+{
+	return benchmark_pbkdf(cd, pbkdf, volume_key_size, true);
+}
+
+int crypt_pbkdf_cache_warm(struct crypt_device *cd,
+	const struct crypt_pbkdf_type *pbkdf,
+	size_t volume_key_size)
+{
+	struct crypt_pbkdf_type tmp;
+	int r;
+
+	if (!cd || !volume_key_size)
+		return -EINVAL;
+
+	r = crypt_set_pbkdf_type(cd, pbkdf);
+	if (r < 0)
+		return r;
+
+	tmp = *crypt_get_pbkdf(cd);
+	if (tmp.flags & CRYPT_PBKDF_NO_BENCHMARK)
+		return -EINVAL;
+	tmp.iterations = 0;
+
+	return benchmark_pbkdf(cd, &tmp, volume_key_size, false);
+}
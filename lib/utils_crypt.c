@@ -24,6 +24,9 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 #include "libcryptsetup.h"
 #include "utils_crypt.h"
@@ -161,19 +164,119 @@ void crypt_memzero(void *s, size_t n)
 		*p++ = 0;
 }
 
+/*
+ * Safe allocations arena. Memory comes from anonymous mappings locked
+ * in RAM (as far as RLIMIT_MEMLOCK allows) and excluded from core dumps,
+ * so keys do not need the whole process locked by mlockall().
+ * Small allocations use per size class free lists carved from arena
+ * chunks (chunks are reused, never unmapped), larger ones get their
+ * own mapping. All memory is wiped on free.
+ */
+#define SAFE_ARENA_CHUNK	(64 * 1024)
+#define SAFE_ARENA_MIN_SHIFT	5	/* 32 bytes */
+#define SAFE_ARENA_CLASSES	8	/* up to 4096 bytes */
+#define SAFE_ARENA_LARGE	SAFE_ARENA_CLASSES
+
+struct safe_free_slot {
+	struct safe_free_slot *next;
+};
+
+static struct safe_free_slot *safe_free_list[SAFE_ARENA_CLASSES];
+static pthread_mutex_t safe_arena_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *safe_map(size_t len)
+{
+	void *p;
+
+	p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+
+	/* best effort, unprivileged users are limited by RLIMIT_MEMLOCK */
+	(void)mlock(p, len);
+#ifdef MADV_DONTDUMP
+	(void)madvise(p, len, MADV_DONTDUMP);
+#endif
+	return p;
+}
+
+static size_t safe_large_len(size_t len)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+	return (len + page - 1) / page * page;
+}
+
+static size_t safe_size_class(size_t len)
+{
+	size_t c = 0;
+
+	while (c < SAFE_ARENA_CLASSES && ((size_t)1 << (SAFE_ARENA_MIN_SHIFT + c)) < len)
+		c++;
+
+	return c;
+}
+
+static struct safe_allocation *safe_arena_get(size_t c)
+{
+	size_t slot = (size_t)1 << (SAFE_ARENA_MIN_SHIFT + c), i;
+	struct safe_free_slot *s;
+	char *chunk;
+
+	pthread_mutex_lock(&safe_arena_mutex);
+
+	if (!safe_free_list[c]) {
+		chunk = safe_map(SAFE_ARENA_CHUNK);
+		if (!chunk) {
+			pthread_mutex_unlock(&safe_arena_mutex);
+			return NULL;
+		}
+		for (i = SAFE_ARENA_CHUNK; i >= slot; i -= slot) {
+			s = (struct safe_free_slot *)(chunk + i - slot);
+			s->next = safe_free_list[c];
+			safe_free_list[c] = s;
+		}
+	}
+
+	s = safe_free_list[c];
+	safe_free_list[c] = s->next;
+
+	pthread_mutex_unlock(&safe_arena_mutex);
+
+	return (struct safe_allocation *)s;
+}
+
+static void safe_arena_put(struct safe_allocation *alloc, size_t c)
+{
+	struct safe_free_slot *s = (struct safe_free_slot *)alloc;
+
+	pthread_mutex_lock(&safe_arena_mutex);
+	s->next = safe_free_list[c];
+	safe_free_list[c] = s;
+	pthread_mutex_unlock(&safe_arena_mutex);
+}
+
 /* safe allocations */
 void *crypt_safe_alloc(size_t size)
 {
 	struct safe_allocation *alloc;
+	size_t len, c;
 
-	if (!size || size > (SIZE_MAX - offsetof(struct safe_allocation, data)))
+	if (!size || size > (SIZE_MAX - offsetof(struct safe_allocation, data) - (size_t)sysconf(_SC_PAGESIZE)))
 		return NULL;
 
-	alloc = malloc(size + offsetof(struct safe_allocation, data));
+	len = size + offsetof(struct safe_allocation, data);
+	c = safe_size_class(len);
+
+	if (c == SAFE_ARENA_LARGE)
+		alloc = safe_map(safe_large_len(len));
+	else
+		alloc = safe_arena_get(c);
 	if (!alloc)
 		return NULL;
 
 	alloc->size = size;
+	alloc->size_class = c;
 	crypt_memzero(&alloc->data, size);
 
 	/* coverity[leaked_storage] */
@@ -183,6 +286,7 @@ void *crypt_safe_alloc(size_t size)
 void crypt_safe_free(void *data)
 {
 	struct safe_allocation *alloc;
+	size_t c, len;
 
 	if (!data)
 		return;
@@ -192,8 +296,15 @@ void crypt_safe_free(void *data)
 
 	crypt_memzero(data, alloc->size);
 
+	len = alloc->size + offsetof(struct safe_allocation, data);
+	c = alloc->size_class;
 	alloc->size = 0x55aa55aa;
-	free(alloc);
+
+	if (c == SAFE_ARENA_LARGE) {
+		/* munlock is implied by munmap */
+		munmap(alloc, safe_large_len(len));
+	} else
+		safe_arena_put(alloc, c);
 }
 
 void *crypt_safe_realloc(void *data, size_t size)
@@ -34,6 +34,7 @@ struct crypt_device;
 /* Not to be used directly */
 struct safe_allocation {
 	size_t	size;
+	size_t	size_class;
 	char	data[0];
 };
 
@@ -31,6 +31,7 @@
 #include <sys/ioctl.h>
 #include <linux/fs.h>
 #include <unistd.h>
+#include <pthread.h>
 #ifdef HAVE_SYS_SYSMACROS_H
 # include <sys/sysmacros.h>     /* for major, minor */
 #endif
@@ -40,6 +41,33 @@
 #include "internal.h"
 #include "utils_device_locking.h"
 
+/*
+ * Opened fds are kept in device for reuse until device_free(), one per
+ * open mode (read, write, with or without direct-io). A cached fd is
+ * handed to one user at a time, concurrent users get their own fd.
+ */
+#define DEVICE_FDS 4
+
+struct device_fd {
+	int fd;
+	int flags;
+	unsigned refcnt;
+};
+
+/*
+ * Aligned bounce buffers for blockwise I/O are kept in device for reuse
+ * as well, one buffer per concurrent user.
+ */
+#define DEVICE_BOUNCE_BUFFERS 4
+
+struct device_bounce {
+	void *buf;
+	size_t size;
+	unsigned used:1;
+};
+
+static pthread_mutex_t device_fds_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct device {
 	char *path;
 
@@ -50,12 +78,167 @@ struct device {
 
 	unsigned int o_direct:1;
 	unsigned int init_done:1;
+	unsigned int optimistic_read:1;
 
 	/* cached values */
 	size_t alignment;
 	size_t block_size;
+
+	struct device_fd fds[DEVICE_FDS];
+	struct device_bounce bounce[DEVICE_BOUNCE_BUFFERS];
 };
 
+/* Close all cached fds not in use */
+static void device_fds_drop(struct device *device)
+{
+	int i;
+
+	pthread_mutex_lock(&device_fds_lock);
+	for (i = 0; i < DEVICE_FDS; i++) {
+		if (device->fds[i].fd < 0 || device->fds[i].refcnt)
+			continue;
+		close(device->fds[i].fd);
+		device->fds[i].fd = -1;
+	}
+	pthread_mutex_unlock(&device_fds_lock);
+}
+
+static void device_bounce_drop(struct device *device)
+{
+	int i;
+
+	for (i = 0; i < DEVICE_BOUNCE_BUFFERS; i++) {
+		assert(!device->bounce[i].used);
+		free(device->bounce[i].buf);
+		device->bounce[i].buf = NULL;
+	}
+}
+
+/* Returns aligned buffer of at least size bytes, device_bounce_put() releases it */
+static void *device_bounce_get(struct device *device, size_t size)
+{
+	struct device_bounce *b = NULL;
+	void *buf = NULL;
+	int i;
+
+	pthread_mutex_lock(&device_fds_lock);
+	for (i = 0; i < DEVICE_BOUNCE_BUFFERS; i++) {
+		if (device->bounce[i].used)
+			continue;
+		b = &device->bounce[i];
+		if (b->buf && b->size >= size)
+			break;
+	}
+	if (b)
+		b->used = 1;
+	pthread_mutex_unlock(&device_fds_lock);
+
+	/* All buffers in use, caller gets temporary one */
+	if (!b) {
+		if (posix_memalign(&buf, device_alignment(device), size))
+			return NULL;
+		return buf;
+	}
+
+	if (!b->buf || b->size < size) {
+		free(b->buf);
+		b->buf = NULL;
+		b->size = 0;
+		if (posix_memalign(&b->buf, device_alignment(device), size)) {
+			pthread_mutex_lock(&device_fds_lock);
+			b->buf = NULL;
+			b->used = 0;
+			pthread_mutex_unlock(&device_fds_lock);
+			return NULL;
+		}
+		b->size = size;
+	}
+
+	return b->buf;
+}
+
+static void device_bounce_put(struct device *device, void *buf)
+{
+	int i;
+
+	if (!buf)
+		return;
+
+	pthread_mutex_lock(&device_fds_lock);
+	for (i = 0; i < DEVICE_BOUNCE_BUFFERS; i++)
+		if (device->bounce[i].used && device->bounce[i].buf == buf) {
+			device->bounce[i].used = 0;
+			break;
+		}
+	pthread_mutex_unlock(&device_fds_lock);
+
+	if (i == DEVICE_BOUNCE_BUFFERS)
+		free(buf);
+}
+
+/*
+ * Positional blockwise I/O on device fd (no shared file position),
+ * bounce buffer is taken from the device pool.
+ */
+ssize_t device_read_at(struct device *device, int devfd,
+		       void *buf, size_t length, off_t offset)
+{
+	size_t bsize = device_block_size(device);
+	void *bounce;
+	ssize_t r;
+
+	if (!bsize || !(bounce = device_bounce_get(device, io_bounce_size(bsize))))
+		return -1;
+
+	r = read_blockwise_at(devfd, bsize, device_alignment(device),
+			      buf, length, offset, bounce);
+	device_bounce_put(device, bounce);
+	return r;
+}
+
+ssize_t device_write_at(struct device *device, int devfd,
+			const void *buf, size_t length, off_t offset)
+{
+	size_t bsize = device_block_size(device);
+	void *bounce;
+	ssize_t r;
+
+	if (!bsize || !(bounce = device_bounce_get(device, io_bounce_size(bsize))))
+		return -1;
+
+	r = write_blockwise_at(devfd, bsize, device_alignment(device),
+			       CONST_CAST(void*)buf, length, offset, bounce);
+	device_bounce_put(device, bounce);
+	return r;
+}
+
+ssize_t device_writev_at(struct device *device, int devfd,
+			 const struct iovec *iov, int iovcnt, off_t offset)
+{
+	size_t bsize = device_block_size(device);
+	void *bounce;
+	ssize_t r;
+
+	if (!bsize || !(bounce = device_bounce_get(device, io_bounce_size(bsize))))
+		return -1;
+
+	r = writev_blockwise_at(devfd, bsize, device_alignment(device),
+				iov, iovcnt, offset, bounce);
+	device_bounce_put(device, bounce);
+	return r;
+}
+
+/* Aligned buffer from device bounce pool (for direct or gathered I/O) */
+void *device_alloc_aligned(struct device *device, size_t size)
+{
+	return device_bounce_get(device, size);
+}
+
+void device_free_aligned(struct device *device, void *buf)
+{
+	device_bounce_put(device, buf);
+}
+
 static size_t device_fs_block_size_fd(int fd)
 {
 	size_t page_size = crypt_getpagesize();
@@ -145,6 +328,122 @@ static int device_read_test(int devfd)
 	return r;
 }
 
+/*
+ * Process-wide cache of block device capabilities, so devices used
+ * by many contexts are not read-tested and queried again on each use.
+ * An entry is trusted only while the device size is unchanged.
+ */
+#define DEVICE_CACHE_SIZE 64
+
+struct device_cache_entry {
+	dev_t devno;
+	uint64_t size;
+	size_t alignment;
+	size_t block_size;
+	int rotational;		/* -1 if not known yet */
+	unsigned int used:1;
+	unsigned int direct_tested:1;
+	unsigned int o_direct:1;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	struct device_cache_entry e[DEVICE_CACHE_SIZE];
+	unsigned next;
+} device_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct device_cache_entry *device_cache_find(dev_t devno)
+{
+	int i;
+
+	for (i = 0; i < DEVICE_CACHE_SIZE; i++)
+		if (device_cache.e[i].used && device_cache.e[i].devno == devno)
+			return &device_cache.e[i];
+
+	return NULL;
+}
+
+static int device_cache_get(dev_t devno, uint64_t size, struct device_cache_entry *entry)
+{
+	struct device_cache_entry *e;
+	int r = 0;
+
+	pthread_mutex_lock(&device_cache.lock);
+	e = device_cache_find(devno);
+	if (e && e->size != size) {
+		log_dbg("Device %u:%u size changed, dropping cached parameters.",
+			major(devno), minor(devno));
+		e->used = 0;
+	} else if (e) {
+		*entry = *e;
+		r = 1;
+	}
+	pthread_mutex_unlock(&device_cache.lock);
+
+	return r;
+}
+
+static void device_cache_put(const struct device_cache_entry *entry)
+{
+	struct device_cache_entry *e;
+
+	pthread_mutex_lock(&device_cache.lock);
+	e = device_cache_find(entry->devno);
+	if (!e) {
+		e = &device_cache.e[device_cache.next];
+		device_cache.next = (device_cache.next + 1) % DEVICE_CACHE_SIZE;
+	}
+	*e = *entry;
+	e->used = 1;
+	pthread_mutex_unlock(&device_cache.lock);
+}
+
+/* Use cached parameters for block device with unchanged size */
+static int device_ready_cached(struct device *device)
+{
+	struct device_cache_entry e;
+	struct stat st;
+	uint64_t size;
+	int devfd, r = 0;
+
+	if (stat(device_path(device), &st) < 0 || !S_ISBLK(st.st_mode))
+		return 0;
+
+	devfd = open(device_path(device), O_RDONLY);
+	if (devfd < 0)
+		return 0;
+
+	if (!ioctl(devfd, BLKGETSIZE64, &size) && device_cache_get(st.st_rdev, size, &e) &&
+	    (e.direct_tested || !device->o_direct)) {
+		log_dbg("Using cached parameters of device %s.", device_path(device));
+		device->o_direct = device->o_direct && e.o_direct;
+		if (e.alignment > device->alignment)
+			device->alignment = e.alignment;
+		if (e.block_size > device->block_size)
+			device->block_size = e.block_size;
+		r = 1;
+	}
+
+	close(devfd);
+	return r;
+}
+
+static void device_ready_store(struct device *device, int devfd, const struct stat *st,
+			       int direct_tested)
+{
+	struct device_cache_entry e = { .rotational = -1 };
+
+	if (!S_ISBLK(st->st_mode) || ioctl(devfd, BLKGETSIZE64, &e.size) < 0)
+		return;
+
+	e.devno = st->st_rdev;
+	e.alignment = device->alignment;
+	e.block_size = device->block_size;
+	e.direct_tested = direct_tested;
+	e.o_direct = device->o_direct;
+	device_cache_put(&e);
+}
+
 /*
  * The direct-io is always preferred. The header is usually mapped to the same
  * device and can be accessed when the rest of device is mapped to data device.
@@ -155,10 +454,13 @@ static int device_read_test(int devfd)
  */
 static int device_ready(struct device *device)
 {
-	int devfd = -1, r = 0;
+	int devfd = -1, r = 0, direct_tested = device->o_direct;
 	struct stat st;
 	size_t tmp_size;
 
+	if (device_ready_cached(device))
+		return 0;
+
 	if (device->o_direct) {
 		log_dbg("Trying to open and read device %s with direct-io.",
 			device_path(device));
@@ -200,6 +502,9 @@ static int device_ready(struct device *device)
 	if (tmp_size > device->block_size)
 		device->block_size = tmp_size;
 
+	if (!r)
+		device_ready_store(device, devfd, &st, direct_tested);
+
 	close(devfd);
 	return r;
 }
@@ -238,14 +543,70 @@ static int _open_locked(struct device *device, int flags)
  * 	-EINVAL : invalid lock fd state
  * 	-1	: all other errors
  */
+/* Take idle cached fd opened with the same flags */
+static int device_fd_get(struct device *device, int flags)
+{
+	struct device_fd *dfd;
+	int i, devfd = -1;
+
+	/* write access under read lock is refused in _open_locked() */
+	if ((flags & O_ACCMODE) != O_RDONLY && device_locked(device->lh) &&
+	    device_locked_readonly(device->lh))
+		return -1;
+
+	pthread_mutex_lock(&device_fds_lock);
+	for (i = 0; i < DEVICE_FDS && devfd < 0; i++) {
+		dfd = &device->fds[i];
+		if (dfd->fd < 0 || dfd->refcnt || dfd->flags != flags)
+			continue;
+
+		/* lock could be taken after the fd was opened */
+		if (device_locked(device->lh) && device_locked_verify(dfd->fd, device->lh)) {
+			close(dfd->fd);
+			dfd->fd = -1;
+			continue;
+		}
+
+		/* users may expect fresh fd, e.g. read_blockwise() from offset 0 */
+		if (lseek(dfd->fd, 0, SEEK_SET) < 0)
+			continue;
+
+		dfd->refcnt++;
+		devfd = dfd->fd;
+	}
+	pthread_mutex_unlock(&device_fds_lock);
+
+	return devfd;
+}
+
+static void device_fd_put(struct device *device, int devfd, int flags)
+{
+	int i;
+
+	pthread_mutex_lock(&device_fds_lock);
+	for (i = 0; i < DEVICE_FDS; i++)
+		if (device->fds[i].fd < 0) {
+			device->fds[i].fd = devfd;
+			device->fds[i].flags = flags;
+			device->fds[i].refcnt = 1;
+			break;
+		}
+	pthread_mutex_unlock(&device_fds_lock);
+}
+
 static int device_open_internal(struct device *device, int flags)
 {
 	int devfd;
 
-	flags |= O_SYNC;
+	/* cached fds must not leak to forked helpers (e.g. Argon2) */
+	flags |= O_SYNC | O_CLOEXEC;
 	if (device->o_direct)
 		flags |= O_DIRECT;
 
+	devfd = device_fd_get(device, flags);
+	if (devfd >= 0)
+		return devfd;
+
 	if (device_locked(device->lh))
 		devfd = _open_locked(device, flags);
 	else
@@ -255,10 +616,34 @@ static int device_open_internal(struct device *device, int flags)
 		log_dbg("Cannot open device %s%s.",
 			device_path(device),
 			(flags & O_ACCMODE) != O_RDONLY ? " for write" : "");
+	else
+		device_fd_put(device, devfd, flags);
 
 	return devfd;
 }
 
+/* Release fd returned by device_open() or device_open_locked() */
+void device_close(struct device *device, int devfd)
+{
+	int i;
+
+	if (devfd < 0)
+		return;
+
+	if (device) {
+		pthread_mutex_lock(&device_fds_lock);
+		for (i = 0; i < DEVICE_FDS; i++)
+			if (device->fds[i].fd == devfd && device->fds[i].refcnt) {
+				device->fds[i].refcnt--;
+				pthread_mutex_unlock(&device_fds_lock);
+				return;
+			}
+		pthread_mutex_unlock(&device_fds_lock);
+	}
+
+	close(devfd);
+}
+
 int device_open(struct device *device, int flags)
 {
 	assert(!device_locked(device->lh));
@@ -267,14 +652,26 @@ int device_open(struct device *device, int flags)
 
 int device_open_locked(struct device *device, int flags)
 {
-	assert(!crypt_metadata_locking_enabled() || device_locked(device->lh));
+	assert(!crypt_metadata_locking_enabled() || device_locked(device->lh) ||
+	       (device->optimistic_read && (flags & O_ACCMODE) == O_RDONLY));
 	return device_open_internal(device, flags);
 }
 
+/*
+ * Allow read-only access to metadata without lock. Caller must check
+ * that content did not change during the read (LUKS2 seqid and checksums).
+ */
+void device_set_optimistic_read(struct device *device, int enable)
+{
+	if (device)
+		device->optimistic_read = enable ? 1 : 0;
+}
+
 /* Avoid any read from device, expects direct-io to work. */
 int device_alloc_no_check(struct device **device, const char *path)
 {
 	struct device *dev;
+	int r;
 
 	if (!path) {
 		*device = NULL;
@@ -293,6 +690,8 @@ int device_alloc_no_check(struct device **device, const char *path)
 	}
 	dev->loop_fd = -1;
 	dev->o_direct = 1;
+	for (r = 0; r < DEVICE_FDS; r++)
+		dev->fds[r].fd = -1;
 
 	*device = dev;
 	return 0;
@@ -329,6 +728,9 @@ void device_free(struct device *device)
 	if (!device)
 		return;
 
+	device_fds_drop(device);
+	device_bounce_drop(device);
+
 	if (device->loop_fd != -1) {
 		log_dbg("Closed loop %s (%s).", device->path, device->file_path);
 		close(device->loop_fd);
@@ -641,6 +1043,7 @@ static int device_internal_prepare(struct crypt_device *cd, struct device *devic
 		return -EINVAL;
 	}
 
+	device_fds_drop(device);
 	file_path = device->path;
 	device->path = loop_device;
 
@@ -722,6 +1125,7 @@ size_t size_round_up(size_t size, size_t block)
 void device_disable_direct_io(struct device *device)
 {
 	device->o_direct = 0;
+	device_fds_drop(device);
 }
 
 int device_direct_io(const struct device *device)
@@ -746,7 +1150,9 @@ int device_is_identical(struct device *device1, struct device *device2)
 
 int device_is_rotational(struct device *device)
 {
+	struct device_cache_entry *e;
 	struct stat st;
+	int r;
 
 	if (stat(device_path(device), &st) < 0)
 		return -EINVAL;
@@ -754,7 +1160,48 @@ int device_is_rotational(struct device *device)
 	if (!S_ISBLK(st.st_mode))
 		return 0;
 
-	return crypt_dev_is_rotational(major(st.st_rdev), minor(st.st_rdev));
+	pthread_mutex_lock(&device_cache.lock);
+	e = device_cache_find(st.st_rdev);
+	r = e ? e->rotational : -1;
+	pthread_mutex_unlock(&device_cache.lock);
+	if (r >= 0)
+		return r;
+
+	r = crypt_dev_is_rotational(major(st.st_rdev), minor(st.st_rdev));
+
+	pthread_mutex_lock(&device_cache.lock);
+	if ((e = device_cache_find(st.st_rdev)))
+		e->rotational = r;
+	pthread_mutex_unlock(&device_cache.lock);
+
+	return r;
+}
+
+/*
+ * Let the block device zero the range itself, either by discard
+ * (only if it guarantees zeroes) or by the write-zeroes offload.
+ * Returns 1 if discarded, 0 if zeroed by offload and -ENOTSUP
+ * if not available and the caller should write zeroes.
+ */
+int device_zeroout(struct device *device, int devfd, uint64_t offset, uint64_t length)
+{
+	uint64_t range[2] = { offset, length };
+	struct stat st;
+
+	if (fstat(devfd, &st) < 0 || !S_ISBLK(st.st_mode))
+		return -ENOTSUP;
+
+	if (crypt_dev_discard_zeroes_data(major(st.st_rdev), minor(st.st_rdev)) &&
+	    !ioctl(devfd, BLKDISCARD, &range))
+		return 1;
+
+	if (!ioctl(devfd, BLKZEROOUT, &range))
+		return 0;
+
+	log_dbg("Zero out offload of device %s failed: %s.",
+		device_path(device), strerror(errno));
+
+	return (errno == ENOTTY || errno == EOPNOTSUPP || errno == EINVAL) ? -ENOTSUP : -EIO;
 }
 
 size_t device_alignment(struct device *device)
@@ -21,6 +21,7 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <linux/limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -55,8 +56,40 @@ struct crypt_lock_handle {
 	int flock_fd;
 	enum lock_type type;
 	__typeof__( ((struct stat*)0)->st_mode) mode;
+	unsigned refcnt;
+	struct crypt_lock_handle *next;
 };
 
+/*
+ * Read lock handles of block devices held by this process. Shared flock
+ * can be reused by all contexts of the same device, so another read lock
+ * costs only resource file verification.
+ */
+static struct crypt_lock_handle *read_lock_cache = NULL;
+static pthread_mutex_t read_lock_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct crypt_lock_handle *read_lock_cache_get(dev_t devno)
+{
+	struct crypt_lock_handle *h;
+
+	for (h = read_lock_cache; h; h = h->next)
+		if (h->devno == devno)
+			return h;
+
+	return NULL;
+}
+
+static void read_lock_cache_del(struct crypt_lock_handle *h)
+{
+	struct crypt_lock_handle **p;
+
+	for (p = &read_lock_cache; *p; p = &(*p)->next)
+		if (*p == h) {
+			*p = h->next;
+			break;
+		}
+}
+
 static int resource_by_devno(char *res, size_t res_size, dev_t devno, unsigned fullpath)
 {
 	int r;
@@ -199,6 +232,36 @@ int device_locked_readonly(struct crypt_lock_handle *h)
 	return (h && h->type == DEV_LOCK_READ);
 }
 
+/*
+ * Take flock, report time spent waiting for other lock holders
+ * in debug log and as CRYPT_TRACE_LOCK_WAIT phase.
+ */
+static int flock_wait(struct crypt_device *cd, struct crypt_lock_handle *h, int operation)
+{
+	struct timespec start, end;
+	int r;
+
+	if (!flock(h->flock_fd, operation | LOCK_NB))
+		return 0;
+
+	if (errno != EWOULDBLOCK)
+		return -1;
+
+	log_dbg("Lock is contended, waiting.");
+	crypt_trace(cd, CRYPT_TRACE_LOCK_WAIT, 0, 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	r = flock(h->flock_fd, operation);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	crypt_trace(cd, CRYPT_TRACE_LOCK_WAIT, 1, 0);
+	log_dbg("Waited %" PRIu64 " ms for lock.",
+		(uint64_t)(end.tv_sec - start.tv_sec) * 1000 +
+		(end.tv_nsec - start.tv_nsec) / 1000000);
+
+	return r;
+}
+
 static int verify_lock_handle(const char *device_path, struct crypt_lock_handle *h)
 {
 	char res[PATH_MAX];
@@ -220,10 +283,29 @@ static int verify_lock_handle(const char *device_path, struct crypt_lock_handle
 struct crypt_lock_handle *device_read_lock_handle(struct crypt_device *cd, const char *device_path)
 {
 	int r;
-	struct crypt_lock_handle *h = malloc(sizeof(*h));
+	struct crypt_lock_handle *h;
+	struct stat st;
 
-	if (!h)
+	pthread_mutex_lock(&read_lock_cache_mutex);
+
+	if (!stat(device_path, &st) && S_ISBLK(st.st_mode) &&
+	    (h = read_lock_cache_get(st.st_rdev))) {
+		if (!verify_lock_handle(device_path, h)) {
+			h->refcnt++;
+			pthread_mutex_unlock(&read_lock_cache_mutex);
+			log_dbg("Reusing read lock handle for device %s.", device_path);
+			return h;
+		}
+		/* stale, keep it to its owners, it is released on unlock */
+		read_lock_cache_del(h);
+		h->next = NULL;
+	}
+
+	h = malloc(sizeof(*h));
+	if (!h) {
+		pthread_mutex_unlock(&read_lock_cache_mutex);
 		return NULL;
+	}
 
 	do {
 		r = acquire_lock_handle(cd, device_path, h);
@@ -232,7 +314,7 @@ struct crypt_lock_handle *device_read_lock_handle(struct crypt_device *cd, const
 
 		log_dbg("Acquiring read lock for device %s.", device_path);
 
-		if (flock(h->flock_fd, LOCK_SH)) {
+		if (flock_wait(cd, h, LOCK_SH)) {
 			log_dbg("Shared flock failed with errno %d.", errno);
 			r = -EINVAL;
 			release_lock_handle(h);
@@ -254,11 +336,21 @@ struct crypt_lock_handle *device_read_lock_handle(struct crypt_device *cd, const
 	} while (r == -EAGAIN);
 
 	if (r) {
+		pthread_mutex_unlock(&read_lock_cache_mutex);
 		free(h);
 		return NULL;
 	}
 
 	h->type = DEV_LOCK_READ;
+	h->refcnt = 1;
+	h->next = NULL;
+
+	if (S_ISBLK(h->mode)) {
+		h->next = read_lock_cache;
+		read_lock_cache = h;
+	}
+
+	pthread_mutex_unlock(&read_lock_cache_mutex);
 
 	return h;
 }
@@ -278,7 +370,7 @@ struct crypt_lock_handle *device_write_lock_handle(struct crypt_device *cd, cons
 
 		log_dbg("Acquiring write lock for device %s.", device_path);
 
-		if (flock(h->flock_fd, LOCK_EX)) {
+		if (flock_wait(cd, h, LOCK_EX)) {
 			log_dbg("Exclusive flock failed with errno %d.", errno);
 			r = -EINVAL;
 			release_lock_handle(h);
@@ -305,12 +397,24 @@ struct crypt_lock_handle *device_write_lock_handle(struct crypt_device *cd, cons
 	}
 
 	h->type = DEV_LOCK_WRITE;
+	h->refcnt = 1;
+	h->next = NULL;
 
 	return h;
 }
 
 void device_unlock_handle(struct crypt_lock_handle *h)
 {
+	if (h->type == DEV_LOCK_READ) {
+		pthread_mutex_lock(&read_lock_cache_mutex);
+		if (--h->refcnt) {
+			pthread_mutex_unlock(&read_lock_cache_mutex);
+			return;
+		}
+		read_lock_cache_del(h);
+		pthread_mutex_unlock(&read_lock_cache_mutex);
+	}
+
 	if (flock(h->flock_fd, LOCK_UN))
 		log_dbg("flock on fd %d failed.", h->flock_fd);
 
@@ -29,6 +29,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #ifdef HAVE_SYS_SYSMACROS_H
@@ -121,6 +122,120 @@ static char *lookup_dev_old(int major, int minor)
 	return  __lookup_dev(buf, dev, 0, 4);
 }
 
+static int devpath_valid(const char *devpath, dev_t dev)
+{
+	struct stat st;
+
+	return !stat(devpath, &st) && S_ISBLK(st.st_mode) && st.st_rdev == dev;
+}
+
+/*
+ * Process-level cache of resolved device nodes. Every hit is validated
+ * with stat(), renamed or removed nodes are then resolved again.
+ */
+#define DEVPATH_CACHE_SIZE 64
+
+static struct {
+	pthread_mutex_t lock;
+	unsigned next;
+	struct {
+		dev_t dev;
+		char *path;
+	} entry[DEVPATH_CACHE_SIZE];
+} devpath_cache = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static char *devpath_cache_get(dev_t dev)
+{
+	char *devpath = NULL;
+	unsigned i;
+
+	pthread_mutex_lock(&devpath_cache.lock);
+	for (i = 0; i < DEVPATH_CACHE_SIZE && !devpath; i++)
+		if (devpath_cache.entry[i].path && devpath_cache.entry[i].dev == dev)
+			devpath = strdup(devpath_cache.entry[i].path);
+	pthread_mutex_unlock(&devpath_cache.lock);
+
+	if (devpath && !devpath_valid(devpath, dev)) {
+		free(devpath);
+		devpath = NULL;
+	}
+
+	return devpath;
+}
+
+static void devpath_cache_put(dev_t dev, const char *devpath)
+{
+	char *path = strdup(devpath);
+	unsigned i;
+
+	if (!path)
+		return;
+
+	pthread_mutex_lock(&devpath_cache.lock);
+	for (i = 0; i < DEVPATH_CACHE_SIZE; i++)
+		if (devpath_cache.entry[i].path && devpath_cache.entry[i].dev == dev)
+			break;
+	if (i == DEVPATH_CACHE_SIZE)
+		i = devpath_cache.next++ % DEVPATH_CACHE_SIZE;
+	free(devpath_cache.entry[i].path);
+	devpath_cache.entry[i].dev = dev;
+	devpath_cache.entry[i].path = path;
+	pthread_mutex_unlock(&devpath_cache.lock);
+}
+
+/* Read (small) sysfs attribute as string */
+static int _read_string(const char *sysfs_path, char *buf, size_t buf_size)
+{
+	ssize_t r;
+	int fd;
+
+	if ((fd = open(sysfs_path, O_RDONLY | O_CLOEXEC)) < 0)
+		return 0;
+	r = read(fd, buf, buf_size - 1);
+	close(fd);
+
+	if (r <= 0)
+		return 0;
+
+	buf[r] = '\0';
+	return 1;
+}
+
+/*
+ * Resolve node directly from sysfs: device-mapper name (dm/name) for dm devices,
+ * otherwise kernel node name (DEVNAME in uevent, can contain subdirectory).
+ */
+static char *lookup_dev_sysfs(int major, int minor)
+{
+	char path[PATH_MAX], buf[PATH_MAX], *devname;
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/dm/name", major, minor) < 0)
+		return NULL;
+
+	if (_read_string(path, buf, sizeof(buf))) {
+		buf[strcspn(buf, "\n")] = '\0';
+		if (!*buf || snprintf(path, sizeof(path), "%s/%s", dm_get_dir(), buf) < 0)
+			return NULL;
+		return strdup(path);
+	}
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%d:%d/uevent", major, minor) < 0)
+		return NULL;
+
+	/* Leading newline, so every variable starts with one */
+	buf[0] = '\n';
+	if (!_read_string(path, buf + 1, sizeof(buf) - 1) ||
+	    !(devname = strstr(buf, "\nDEVNAME=")))
+		return NULL;
+
+	devname += strlen("\nDEVNAME=");
+	devname[strcspn(devname, "\n")] = '\0';
+	if (!*devname || snprintf(path, sizeof(path), "/dev/%s", devname) < 0)
+		return NULL;
+
+	return strdup(path);
+}
+
 /*
  * Returns string pointing to device in /dev according to "major:minor" dev_id
  */
@@ -134,6 +249,17 @@ char *crypt_lookup_dev(const char *dev_id)
 	if (sscanf(dev_id, "%d:%d", &major, &minor) != 2)
 		return NULL;
 
+	if ((devpath = devpath_cache_get(makedev(major, minor))))
+		return devpath;
+
+	devpath = lookup_dev_sysfs(major, minor);
+	if (devpath && devpath_valid(devpath, makedev(major, minor))) {
+		devpath_cache_put(makedev(major, minor), devpath);
+		return devpath;
+	}
+	free(devpath);
+	devpath = NULL;
+
 	if (snprintf(path, sizeof(path), "/sys/dev/block/%s", dev_id) < 0)
 		return NULL;
 
@@ -159,14 +285,15 @@ char *crypt_lookup_dev(const char *dev_id)
 	/*
 	 * Check that path is correct.
 	 */
-	if (devpath && ((stat(devpath, &st) < 0) ||
-	    !S_ISBLK(st.st_mode) ||
-	    (st.st_rdev != makedev(major, minor)))) {
+	if (devpath && !devpath_valid(devpath, makedev(major, minor))) {
 		free(devpath);
 		/* Should never happen unless user mangles with dev nodes. */
-		return lookup_dev_old(major, minor);
+		devpath = lookup_dev_old(major, minor);
 	}
 
+	if (devpath)
+		devpath_cache_put(makedev(major, minor), devpath);
+
 	return devpath;
 }
 
@@ -221,6 +348,16 @@ int crypt_dev_is_rotational(int major, int minor)
 	return val ? 1 : 0;
 }
 
+int crypt_dev_discard_zeroes_data(int major, int minor)
+{
+	uint64_t val;
+
+	if (!_sysfs_get_uint64(major, minor, &val, "queue/discard_zeroes_data"))
+		return 0; /* if failed, do not expect zeroes */
+
+	return val ? 1 : 0;
+}
+
 int crypt_dev_is_partition(const char *dev_path)
 {
 	uint64_t val;
@@ -384,8 +521,8 @@ int lookup_by_disk_id(const char *dm_uuid)
 		return errno == ENOTDIR ? -ENOENT : -errno;
 
 	while ((entry = readdir(dir))) {
-		if (entry->d_name[0] == '.' ||
-		    !strncmp(entry->d_name, "..", 2))
+		/* Compare name first, stat only candidates */
+		if (strncmp(entry->d_name, dm_uuid, strlen(dm_uuid)))
 			continue;
 
 		if (fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
@@ -393,10 +530,7 @@ int lookup_by_disk_id(const char *dm_uuid)
 			break;
 		}
 
-		if (!S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode))
-			continue;
-
-		if (!strncmp(entry->d_name, dm_uuid, strlen(dm_uuid))) {
+		if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode)) {
 			r = 1;
 			break;
 		}
@@ -421,8 +555,8 @@ int lookup_by_sysfs_uuid_field(const char *dm_uuid, size_t max_len)
 		return errno == ENOTDIR ? -ENOENT : -errno;
 
 	while (r != 1 && (entry = readdir(dir))) {
-		if (entry->d_name[0] == '.' ||
-		    !strncmp(entry->d_name, "..", 2))
+		/* Only dm-X devices have dm/uuid, do not open attributes of others */
+		if (!dm_is_dm_kernel_name(entry->d_name))
 			continue;
 
 		len = snprintf(subpath, PATH_MAX, "%s/%s", entry->d_name, "dm/uuid");
@@ -49,6 +49,11 @@ struct device;
 #define DM_SECTOR_SIZE_SUPPORTED (1 << 13) /* support for sector size setting in dm-crypt/dm-integrity */
 #define DM_CAPI_STRING_SUPPORTED (1 << 14) /* support for cryptoapi format cipher definition */
 #define DM_DEFERRED_SUPPORTED (1 << 15) /* deferred removal of device */
+#define DM_CRYPT_NO_WORKQUEUE_SUPPORTED (1 << 16) /* dm-crypt support for bypassing workqueues */
+#define DM_CRYPT_HIGH_PRIORITY_SUPPORTED (1 << 17) /* dm-crypt high priority workqueues */
+#define DM_INTEGRITY_RECALC_SUPPORTED (1 << 18) /* dm-integrity automatic recalculation supported */
+#define DM_INTEGRITY_BITMAP_SUPPORTED (1 << 19) /* dm-integrity bitmap mode supported */
+#define DM_VERITY_TASKLETS_SUPPORTED (1 << 20) /* dm-verity try_verify_in_tasklet supported */
 
 typedef enum { DM_CRYPT = 0, DM_VERITY, DM_INTEGRITY, DM_UNKNOWN } dm_target_type;
 
@@ -68,6 +73,9 @@ int dm_flags(dm_target_type target, uint32_t *flags);
 
 #define DM_ACTIVE_INTEGRITY_PARAMS	(1 << 9)
 
+/* max count of dm-crypt segments (targets) in one table */
+#define DM_CRYPT_SEGMENTS_MAX	2
+
 struct crypt_dm_active_device {
 	dm_target_type target;
 	uint64_t size;		/* active device size */
@@ -112,6 +120,8 @@ struct crypt_dm_active_device {
 		uint64_t offset;	/* offset in sectors */
 		uint32_t sector_size;	/* integrity sector size */
 		uint32_t buffer_sectors;
+		uint32_t sectors_per_bit;	/* bitmap mode granularity */
+		uint32_t bitmap_flush_time;	/* bitmap flush interval in ms */
 
 		const char *integrity;
 		/* Active key for device */
@@ -129,6 +139,9 @@ struct crypt_dm_active_device {
 void dm_backend_init(void);
 void dm_backend_exit(void);
 
+void dm_udev_batch_begin(void);
+void dm_udev_batch_end(void);
+
 int dm_remove_device(struct crypt_device *cd, const char *name, uint32_t flags);
 int dm_status_device(struct crypt_device *cd, const char *name);
 int dm_status_suspended(struct crypt_device *cd, const char *name);
@@ -136,10 +149,29 @@ int dm_status_verity_ok(struct crypt_device *cd, const char *name);
 int dm_status_integrity_failures(struct crypt_device *cd, const char *name, uint64_t *count);
 int dm_query_device(struct crypt_device *cd, const char *name,
 		    uint32_t get_flags, struct crypt_dm_active_device *dmd);
+
+struct crypt_dm_device_entry {
+	char *name;
+	struct crypt_dm_active_device dmd;
+	uint64_t integrity_failures;
+};
+
+int dm_query_all_devices(struct crypt_device *cd, uint32_t get_flags,
+			 struct crypt_dm_device_entry **entries, size_t *count);
+void dm_free_all_devices(struct crypt_dm_device_entry *entries, size_t count);
+
 int dm_create_device(struct crypt_device *cd, const char *name,
 		     const char *type, struct crypt_dm_active_device *dmd,
 		     int reload);
+int dm_create_device_segments(struct crypt_device *cd, const char *name,
+			      const char *type, struct crypt_dm_active_device *dmd,
+			      unsigned count, int reload);
+int dm_copy_sectors(struct crypt_device *cd, const char *name,
+		    struct device *src, uint64_t src_offset,
+		    struct device *dst, uint64_t dst_offset,
+		    uint64_t size);
 int dm_suspend_device(struct crypt_device *cd, const char *name);
+int dm_resume_device(struct crypt_device *cd, const char *name);
 int dm_suspend_and_wipe_key(struct crypt_device *cd, const char *name);
 int dm_resume_and_reinstate_key(struct crypt_device *cd, const char *name,
 				const struct volume_key *vk);
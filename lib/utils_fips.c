@@ -21,6 +21,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
 #include "utils_fips.h"
 
 #if !ENABLE_FIPS
@@ -39,8 +40,18 @@ static int kernel_fips_mode(void)
 	return (buf[0] == '1') ? 1 : 0;
 }
 
+/* FIPS mode cannot change during process lifetime, check it only once */
+static pthread_once_t fips_once = PTHREAD_ONCE_INIT;
+static int fips_mode;
+
+static void fips_mode_check(void)
+{
+	fips_mode = kernel_fips_mode() && !access("/etc/system-fips", F_OK);
+}
+
 int crypt_fips_mode(void)
 {
-	return kernel_fips_mode() && !access("/etc/system-fips", F_OK);
+	pthread_once(&fips_once, fips_mode_check);
+	return fips_mode;
 }
 #endif /* ENABLE_FIPS */
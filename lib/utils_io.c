@@ -25,8 +25,12 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
 
 #include "utils_io.h"
 
@@ -53,6 +57,71 @@ ssize_t read_buffer(int fd, void *buf, size_t length)
 	return (ssize_t)length;
 }
 
+/*
+ * Copy length bytes from the start of in_fd to the start of out_fd in kernel,
+ * sharing extents (reflink) if filesystem supports it, or by copy_file_range().
+ * Returns -ENOTSUP if in-kernel copy is not possible for these descriptors.
+ */
+ssize_t copy_file_kernel(int in_fd, int out_fd, size_t length)
+{
+#ifdef FICLONERANGE
+	struct file_clone_range fcr = {
+		.src_fd = in_fd,
+		.src_length = length,
+	};
+
+	if (!ioctl(out_fd, FICLONERANGE, &fcr))
+		return (ssize_t)length;
+#endif
+#if HAVE_COPY_FILE_RANGE
+	loff_t in_off = 0, out_off = 0;
+	size_t copied = 0;
+	ssize_t r;
+
+	while (copied < length) {
+		r = copy_file_range(in_fd, &in_off, out_fd, &out_off, length - copied, 0);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && !copied && (errno == EXDEV || errno == EINVAL ||
+		    errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF))
+			return -ENOTSUP;
+		if (r < 0)
+			return -EIO;
+		if (r == 0)
+			break;
+		copied += (size_t)r;
+	}
+
+	return (ssize_t)copied;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+/* As read_buffer() but with pread(), file position is not changed */
+ssize_t read_buffer_at(int fd, void *buf, size_t length, off_t offset)
+{
+	size_t read_size = 0;
+	ssize_t r;
+
+	if (fd < 0 || !buf)
+		return -EINVAL;
+
+	do {
+		r = pread(fd, buf, length - read_size, offset + read_size);
+		if (r == -1 && errno != EINTR)
+			return r;
+		if (r == 0)
+			return (ssize_t)read_size;
+		if (r > 0) {
+			read_size += (size_t)r;
+			buf = (uint8_t*)buf + r;
+		}
+	} while (read_size != length);
+
+	return (ssize_t)length;
+}
+
 ssize_t write_buffer(int fd, const void *buf, size_t length)
 {
 	size_t write_size = 0;
@@ -76,169 +145,249 @@ ssize_t write_buffer(int fd, const void *buf, size_t length)
 	return (ssize_t)write_size;
 }
 
-ssize_t write_blockwise(int fd, size_t bsize, size_t alignment,
-			void *orig_buf, size_t length)
+/* As write_buffer() but with pwrite(), file position is not changed */
+ssize_t write_buffer_at(int fd, const void *buf, size_t length, off_t offset)
 {
-	void *hangover_buf = NULL, *buf = NULL;
-	size_t hangover, solid;
-	ssize_t r, ret = -1;
+	size_t write_size = 0;
+	ssize_t w;
 
-	if (fd == -1 || !orig_buf || !bsize || !alignment)
-		return -1;
+	if (fd < 0 || !buf || !length)
+		return -EINVAL;
+
+	do {
+		w = pwrite(fd, buf, length - write_size, offset + write_size);
+		if (w < 0 && errno != EINTR)
+			return w;
+		if (w == 0)
+			return (ssize_t)write_size;
+		if (w > 0) {
+			write_size += (size_t) w;
+			buf = (const uint8_t*)buf + w;
+		}
+	} while (write_size != length);
 
-	hangover = length % bsize;
-	solid = length - hangover;
+	return (ssize_t)write_size;
+}
 
-	if ((size_t)orig_buf & (alignment - 1)) {
-		if (posix_memalign(&buf, alignment, length))
-			return -1;
-		memcpy(buf, orig_buf, length);
-	} else
-		buf = orig_buf;
-
-	if (solid) {
-		r = write_buffer(fd, buf, solid);
-		if (r < 0 || r != (ssize_t)solid)
-			goto out;
-	}
+/*
+ * Positional blockwise I/O. Only partial blocks at both ends and misaligned
+ * parts of the buffer go through (at most IO_BOUNCE_SIZE) bounce buffer,
+ * block-aligned parts are transferred directly. No file position is used,
+ * so more threads can share one fd.
+ *
+ * The bounce buffer can be provided by caller (aligned, at least
+ * io_bounce_size(bsize) bytes), otherwise it is allocated here.
+ */
+size_t io_bounce_size(size_t bsize)
+{
+	if (bsize >= IO_BOUNCE_SIZE)
+		return bsize;
 
-	if (hangover) {
-		if (posix_memalign(&hangover_buf, alignment, bsize))
-			goto out;
+	return IO_BOUNCE_SIZE - IO_BOUNCE_SIZE % bsize;
+}
 
-		r = read_buffer(fd, hangover_buf, bsize);
-		if (r < 0 || r < (ssize_t)hangover)
-			goto out;
+static ssize_t rw_blockwise_at(int fd, size_t bsize, size_t alignment,
+			       char *buf, size_t length, off_t offset,
+			       void *bounce, int write)
+{
+	size_t head, n, done = 0, chunk;
+	void *bounce_alloc = NULL;
+	ssize_t r, ret = -1;
+	off_t block;
 
-		if (r < (ssize_t)bsize)
-			bsize = r;
+	if (fd < 0 || !buf || !bsize || !alignment || offset < 0)
+		return -1;
 
-		if (lseek(fd, -(off_t)bsize, SEEK_CUR) < 0)
-			goto out;
+	chunk = io_bounce_size(bsize);
+
+	while (done < length) {
+		head = (offset + done) % bsize;
+		n = length - done;
+
+		/* Whole aligned blocks to aligned buffer */
+		if (!head && n >= bsize && !((uintptr_t)(buf + done) & (alignment - 1))) {
+			n -= n % bsize;
+			r = write ? write_buffer_at(fd, buf + done, n, offset + done) :
+				    read_buffer_at(fd, buf + done, n, offset + done);
+			if (r != (ssize_t)n)
+				goto out;
+			done += n;
+			continue;
+		}
 
-		memcpy(hangover_buf, (char*)buf + solid, hangover);
+		if (!bounce) {
+			if (posix_memalign(&bounce_alloc, alignment, chunk))
+				goto out;
+			bounce = bounce_alloc;
+		}
 
-		r = write_buffer(fd, hangover_buf, bsize);
-		if (r < 0 || r < (ssize_t)hangover)
-			goto out;
+		block = offset + done - head;
+		if (head || n < bsize) {
+			/* Partial block, read-modify-write for write */
+			if (n > bsize - head)
+				n = bsize - head;
+			r = read_buffer_at(fd, bounce, bsize, block);
+			if (r < 0 || r < (ssize_t)(head + n))
+				goto out;
+			if (write) {
+				memcpy((char *)bounce + head, buf + done, n);
+				if (write_buffer_at(fd, bounce, r, block) != r)
+					goto out;
+			} else
+				memcpy(buf + done, (char *)bounce + head, n);
+		} else {
+			/* Whole blocks, misaligned buffer */
+			n -= n % bsize;
+			if (n > chunk)
+				n = chunk;
+			if (write) {
+				memcpy(bounce, buf + done, n);
+				r = write_buffer_at(fd, bounce, n, block);
+			} else {
+				r = read_buffer_at(fd, bounce, n, block);
+				if (r == (ssize_t)n)
+					memcpy(buf + done, bounce, n);
+			}
+			if (r != (ssize_t)n)
+				goto out;
+		}
+		done += n;
 	}
 	ret = length;
 out:
-	free(hangover_buf);
-	if (buf != orig_buf)
-		free(buf);
+	free(bounce_alloc);
 	return ret;
 }
 
-ssize_t read_blockwise(int fd, size_t bsize, size_t alignment,
-		       void *orig_buf, size_t length)
+ssize_t read_blockwise_at(int fd, size_t bsize, size_t alignment,
+			  void *buf, size_t length, off_t offset, void *bounce)
 {
-	void *hangover_buf = NULL, *buf = NULL;
-	size_t hangover, solid;
-	ssize_t r, ret = -1;
+	return rw_blockwise_at(fd, bsize, alignment, buf, length, offset, bounce, 0);
+}
 
-	if (fd == -1 || !orig_buf || !bsize || !alignment)
+ssize_t write_blockwise_at(int fd, size_t bsize, size_t alignment,
+			   void *buf, size_t length, off_t offset, void *bounce)
+{
+	return rw_blockwise_at(fd, bsize, alignment, buf, length, offset, bounce, 1);
+}
+
+/*
+ * Gathered write of all iov segments to contiguous area at offset.
+ * If all segments are block and memory aligned, single pwritev() is used.
+ */
+ssize_t writev_blockwise_at(int fd, size_t bsize, size_t alignment,
+			    const struct iovec *iov, int iovcnt, off_t offset,
+			    void *bounce)
+{
+	size_t length = 0, done;
+	ssize_t w, ret;
+	int i, aligned = !(offset % bsize);
+
+	if (fd < 0 || !iov || iovcnt <= 0 || iovcnt > IOV_MAX || !bsize || !alignment)
 		return -1;
 
-	hangover = length % bsize;
-	solid = length - hangover;
+	for (i = 0; i < iovcnt; i++) {
+		length += iov[i].iov_len;
+		if (iov[i].iov_len % bsize || ((uintptr_t)iov[i].iov_base & (alignment - 1)))
+			aligned = 0;
+	}
 
-	if ((size_t)orig_buf & (alignment - 1)) {
-		if (posix_memalign(&buf, alignment, length))
-			return -1;
-	} else
-		buf = orig_buf;
+	if (!aligned) {
+		for (i = 0, ret = 0; i < iovcnt; i++) {
+			w = write_blockwise_at(fd, bsize, alignment, iov[i].iov_base,
+					       iov[i].iov_len, offset + ret, bounce);
+			if (w != (ssize_t)iov[i].iov_len)
+				return -1;
+			ret += w;
+		}
+		return ret;
+	}
 
-	r = read_buffer(fd, buf, solid);
-	if (r < 0 || r != (ssize_t)solid)
-		goto out;
+	do {
+		w = pwritev(fd, iov, iovcnt, offset);
+	} while (w < 0 && errno == EINTR);
 
-	if (hangover) {
-		if (posix_memalign(&hangover_buf, alignment, bsize))
-			goto out;
-		r = read_buffer(fd, hangover_buf, bsize);
-		if (r <  0 || r < (ssize_t)hangover)
-			goto out;
+	if (w < 0)
+		return -1;
 
-		memcpy((char *)buf + solid, hangover_buf, hangover);
-	}
-	ret = length;
-out:
-	free(hangover_buf);
-	if (buf != orig_buf) {
-		memcpy(orig_buf, buf, length);
-		free(buf);
+	/* Finish short write segment by segment */
+	for (i = 0, done = 0; i < iovcnt && (size_t)w < length; done += iov[i++].iov_len) {
+		if (done + iov[i].iov_len <= (size_t)w)
+			continue;
+		ret = write_buffer_at(fd, (char *)iov[i].iov_base + (w - done),
+				      iov[i].iov_len - (w - done), offset + w);
+		if (ret != (ssize_t)(iov[i].iov_len - (w - done)))
+			return -1;
+		w += ret;
 	}
-	return ret;
+
+	return (ssize_t)length;
 }
 
-/*
- * Combines llseek with blockwise write. write_blockwise can already deal with short writes
- * but we also need a function to deal with short writes at the start. But this information
- * is implicitly included in the read/write offset, which can not be set to non-aligned
- * boundaries. Hence, we combine llseek with write.
- */
-ssize_t write_lseek_blockwise(int fd, size_t bsize, size_t alignment,
-			      void *buf, size_t length, off_t offset)
+/* Sequential variants, file position is advanced past processed data */
+ssize_t write_blockwise(int fd, size_t bsize, size_t alignment,
+			void *orig_buf, size_t length)
 {
-	void *frontPadBuf = NULL;
-	size_t frontHang, innerCount = 0;
-	ssize_t r, ret = -1;
+	off_t pos;
+	ssize_t r;
 
-	if (fd == -1 || !buf || !bsize || !alignment)
+	if (fd == -1 || !orig_buf || !bsize || !alignment)
 		return -1;
 
-	if (offset < 0)
-		offset = lseek(fd, offset, SEEK_END);
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos < 0)
+		return -1;
 
-	if (offset < 0)
+	r = write_blockwise_at(fd, bsize, alignment, orig_buf, length, pos, NULL);
+	if (r > 0 && lseek(fd, pos + r, SEEK_SET) < 0)
 		return -1;
 
-	frontHang = offset % bsize;
+	return r;
+}
 
-	if (lseek(fd, offset - frontHang, SEEK_SET) < 0)
-		return -1;
+ssize_t read_blockwise(int fd, size_t bsize, size_t alignment,
+		       void *orig_buf, size_t length)
+{
+	off_t pos;
+	ssize_t r;
 
-	if (frontHang) {
-		if (posix_memalign(&frontPadBuf, alignment, bsize))
-			return -1;
+	if (fd == -1 || !orig_buf || !bsize || !alignment)
+		return -1;
 
-		innerCount = bsize - frontHang;
-		if (innerCount > length)
-			innerCount = length;
+	pos = lseek(fd, 0, SEEK_CUR);
+	if (pos < 0)
+		return -1;
 
-		r = read_buffer(fd, frontPadBuf, bsize);
-		if (r < 0 || r < (ssize_t)(frontHang + innerCount))
-			goto out;
+	r = read_blockwise_at(fd, bsize, alignment, orig_buf, length, pos, NULL);
+	if (r > 0 && lseek(fd, pos + r, SEEK_SET) < 0)
+		return -1;
 
-		memcpy((char*)frontPadBuf + frontHang, buf, innerCount);
+	return r;
+}
 
-		if (lseek(fd, offset - frontHang, SEEK_SET) < 0)
-			goto out;
+/*
+ * Blockwise I/O at given offset (negative offset is relative to the device end).
+ * Both are positional now, file position is not changed (except for negative
+ * offset which needs to seek to the end of device).
+ */
+ssize_t write_lseek_blockwise(int fd, size_t bsize, size_t alignment,
+			      void *buf, size_t length, off_t offset)
+{
+	if (fd == -1 || !buf || !bsize || !alignment)
+		return -1;
 
-		r = write_buffer(fd, frontPadBuf, frontHang + innerCount);
-		if (r < 0 || r != (ssize_t)(frontHang + innerCount))
-			goto out;
+	if (offset < 0)
+		offset = lseek(fd, offset, SEEK_END);
 
-		buf = (char*)buf + innerCount;
-		length -= innerCount;
-	}
+	if (offset < 0)
+		return -1;
 
-	ret = length ? write_blockwise(fd, bsize, alignment, buf, length) : 0;
-	if (ret >= 0)
-		ret += innerCount;
-out:
-	free(frontPadBuf);
-	return ret;
+	return write_blockwise_at(fd, bsize, alignment, buf, length, offset, NULL);
 }
 
 ssize_t read_lseek_blockwise(int fd, size_t bsize, size_t alignment,
 			     void *buf, size_t length, off_t offset)
 {
-	void *frontPadBuf = NULL;
-	size_t frontHang, innerCount = 0;
-	ssize_t r, ret = -1;
-
 	if (fd == -1 || !buf || bsize <= 0)
 		return -1;
 
@@ -248,33 +397,5 @@ ssize_t read_lseek_blockwise(int fd, size_t bsize, size_t alignment,
 	if (offset < 0)
 		return -1;
 
-	frontHang = offset % bsize;
-
-	if (lseek(fd, offset - frontHang, SEEK_SET) < 0)
-		return -1;
-
-	if (frontHang) {
-		if (posix_memalign(&frontPadBuf, alignment, bsize))
-			return -1;
-
-		innerCount = bsize - frontHang;
-		if (innerCount > length)
-			innerCount = length;
-
-		r = read_buffer(fd, frontPadBuf, bsize);
-		if (r < 0 || r < (ssize_t)(frontHang + innerCount))
-			goto out;
-
-		memcpy(buf, (char*)frontPadBuf + frontHang, innerCount);
-
-		buf = (char*)buf + innerCount;
-		length -= innerCount;
-	}
-
-	ret = read_blockwise(fd, bsize, alignment, buf, length);
-	if (ret >= 0)
-		ret += innerCount;
-out:
-	free(frontPadBuf);
-	return ret;
+	return read_blockwise_at(fd, bsize, alignment, buf, length, offset, NULL);
 }
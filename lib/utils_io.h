@@ -24,8 +24,26 @@
 #ifndef _CRYPTSETUP_UTILS_IO_H
 #define _CRYPTSETUP_UTILS_IO_H
 
+#include <sys/types.h>
+
+struct iovec;
+
+/* Maximal size of temporary aligned buffer used in blockwise I/O */
+#define IO_BOUNCE_SIZE (64 * 1024)
+
 ssize_t read_buffer(int fd, void *buf, size_t length);
+ssize_t read_buffer_at(int fd, void *buf, size_t length, off_t offset);
 ssize_t write_buffer(int fd, const void *buf, size_t length);
+ssize_t write_buffer_at(int fd, const void *buf, size_t length, off_t offset);
+ssize_t copy_file_kernel(int in_fd, int out_fd, size_t length);
+size_t io_bounce_size(size_t bsize);
+ssize_t read_blockwise_at(int fd, size_t bsize, size_t alignment,
+			  void *buf, size_t length, off_t offset, void *bounce);
+ssize_t write_blockwise_at(int fd, size_t bsize, size_t alignment,
+			   void *buf, size_t length, off_t offset, void *bounce);
+ssize_t writev_blockwise_at(int fd, size_t bsize, size_t alignment,
+			    const struct iovec *iov, int iovcnt, off_t offset,
+			    void *bounce);
 ssize_t write_blockwise(int fd, size_t bsize, size_t alignment,
 			void *orig_buf, size_t length);
 ssize_t read_blockwise(int fd, size_t bsize, size_t alignment,
@@ -74,6 +74,69 @@ static long keyctl_unlink(key_serial_t key, key_serial_t keyring)
 {
 	return syscall(__NR_keyctl, KEYCTL_UNLINK, key, keyring);
 }
+
+/* keyctl_search */
+static key_serial_t keyctl_search(key_serial_t keyring, const char *type,
+	const char *description)
+{
+	return syscall(__NR_keyctl, KEYCTL_SEARCH, keyring, type, description, 0);
+}
+
+/* keyctl_set_timeout */
+static long keyctl_set_timeout(key_serial_t key, unsigned timeout)
+{
+	return syscall(__NR_keyctl, KEYCTL_SET_TIMEOUT, key, timeout);
+}
+
+/* keyctl_setperm */
+static long keyctl_setperm(key_serial_t key, uint32_t perm)
+{
+	return syscall(__NR_keyctl, KEYCTL_SETPERM, key, perm);
+}
+
+/* keyctl_link */
+static long keyctl_link(key_serial_t key, key_serial_t keyring)
+{
+	return syscall(__NR_keyctl, KEYCTL_LINK, key, keyring);
+}
+
+/* key permissions (keyutils.h) */
+#define KEY_POS_ALL	0x3f000000
+#define KEY_USR_VIEW	0x00010000
+#define KEY_USR_SEARCH	0x00080000
+#define KEY_USR_LINK	0x00100000
+
+static int keyring_read_key(key_serial_t kid, char **key, size_t *key_size)
+{
+	int err;
+	long ret;
+	char *buf = NULL;
+	size_t len = 0;
+
+	/* just get payload size */
+	ret = keyctl_read(kid, NULL, 0);
+	if (ret > 0) {
+		len = ret;
+		buf = malloc(len);
+		if (!buf)
+			return -ENOMEM;
+
+		/* retrieve actual payload data */
+		ret = keyctl_read(kid, buf, len);
+	}
+
+	if (ret < 0) {
+		err = errno;
+		crypt_memzero(buf, len);
+		free(buf);
+		return -err;
+	}
+
+	*key = buf;
+	*key_size = len;
+
+	return 0;
+}
 #endif
 
 int keyring_check(void)
@@ -106,11 +169,7 @@ int keyring_get_passphrase(const char *key_desc,
 		      size_t *passphrase_len)
 {
 #ifdef KERNEL_KEYRING
-	int err;
 	key_serial_t kid;
-	long ret;
-	char *buf = NULL;
-	size_t len = 0;
 
 	do
 		kid = request_key("user", key_desc, NULL, 0);
@@ -119,27 +178,136 @@ int keyring_get_passphrase(const char *key_desc,
 	if (kid < 0)
 		return -errno;
 
-	/* just get payload size */
-	ret = keyctl_read(kid, NULL, 0);
-	if (ret > 0) {
-		len = ret;
-		buf = malloc(len);
-		if (!buf)
-			return -ENOMEM;
+	return keyring_read_key(kid, passphrase, passphrase_len);
+#else
+	return -ENOTSUP;
+#endif
+}
 
-		/* retrieve actual payload data */
-		ret = keyctl_read(kid, buf, len);
+int keyring_add_user_key_timeout(const char *key_desc, const void *key,
+	size_t key_size, unsigned timeout)
+{
+#ifdef KERNEL_KEYRING
+	key_serial_t kid;
+	int r;
+
+	kid = add_key("user", key_desc, key, key_size, KEY_SPEC_USER_KEYRING);
+	if (kid < 0)
+		return -errno;
+
+	if (timeout && keyctl_set_timeout(kid, timeout)) {
+		/* revoke and unlink may overwrite errno */
+		r = -errno;
+		keyctl_revoke(kid);
+		keyctl_unlink(kid, KEY_SPEC_USER_KEYRING);
+		return r;
 	}
 
-	if (ret < 0) {
-		err = errno;
-		crypt_memzero(buf, len);
-		free(buf);
-		return -err;
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+int keyring_get_user_key(const char *key_desc, char **key, size_t *key_size)
+{
+#ifdef KERNEL_KEYRING
+	key_serial_t kid;
+
+	kid = keyctl_search(KEY_SPEC_USER_KEYRING, "user", key_desc);
+	if (kid < 0)
+		return -errno;
+
+	return keyring_read_key(kid, key, key_size);
+#else
+	return -ENOTSUP;
+#endif
+}
+
+int keyring_unlink_user_key(const char *key_desc)
+{
+#ifdef KERNEL_KEYRING
+	key_serial_t kid;
+
+	kid = keyctl_search(KEY_SPEC_USER_KEYRING, "user", key_desc);
+	if (kid < 0)
+		return 0;
+
+	if (keyctl_revoke(kid))
+		return -errno;
+
+	keyctl_unlink(kid, KEY_SPEC_USER_KEYRING);
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+/*
+ * Logon key in user keyring, payload can be used by dm-crypt only
+ * and is never readable from userspace.
+ */
+int keyring_add_logon_key_timeout(const char *key_desc, const void *key,
+	size_t key_size, unsigned timeout)
+{
+#ifdef KERNEL_KEYRING
+	key_serial_t kid;
+	int r;
+
+	kid = add_key("logon", key_desc, key, key_size, KEY_SPEC_USER_KEYRING);
+	if (kid < 0)
+		return -errno;
+
+	/* other processes of the user may only find and link the key */
+	if (keyctl_setperm(kid, KEY_POS_ALL | KEY_USR_VIEW | KEY_USR_SEARCH | KEY_USR_LINK) ||
+	    (timeout && keyctl_set_timeout(kid, timeout))) {
+		/* revoke and unlink may overwrite errno */
+		r = -errno;
+		keyctl_revoke(kid);
+		keyctl_unlink(kid, KEY_SPEC_USER_KEYRING);
+		return r;
 	}
 
-	*passphrase = buf;
-	*passphrase_len = len;
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+/* Link logon key from user keyring, so dm-crypt finds it from this thread */
+int keyring_link_logon_key_in_thread_keyring(const char *key_desc)
+{
+#ifdef KERNEL_KEYRING
+	key_serial_t kid;
+
+	kid = keyctl_search(KEY_SPEC_USER_KEYRING, "logon", key_desc);
+	if (kid < 0)
+		return -errno;
+
+	if (keyctl_link(kid, KEY_SPEC_THREAD_KEYRING))
+		return -errno;
+
+	return 0;
+#else
+	return -ENOTSUP;
+#endif
+}
+
+int keyring_unlink_logon_key(const char *key_desc)
+{
+#ifdef KERNEL_KEYRING
+	key_serial_t kid;
+
+	kid = keyctl_search(KEY_SPEC_USER_KEYRING, "logon", key_desc);
+	if (kid < 0)
+		return 0;
+
+	if (keyctl_revoke(kid))
+		return -errno;
+
+	keyctl_unlink(kid, KEY_SPEC_THREAD_KEYRING);
+	keyctl_unlink(kid, KEY_SPEC_USER_KEYRING);
 
 	return 0;
 #else
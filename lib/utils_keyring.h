@@ -35,4 +35,18 @@ int keyring_add_key_in_thread_keyring(
 
 int keyring_revoke_and_unlink_key(const char *key_desc);
 
+int keyring_add_user_key_timeout(const char *key_desc, const void *key,
+	size_t key_size, unsigned timeout);
+
+int keyring_get_user_key(const char *key_desc, char **key, size_t *key_size);
+
+int keyring_unlink_user_key(const char *key_desc);
+
+int keyring_add_logon_key_timeout(const char *key_desc, const void *key,
+	size_t key_size, unsigned timeout);
+
+int keyring_link_logon_key_in_thread_keyring(const char *key_desc);
+
+int keyring_unlink_logon_key(const char *key_desc);
+
 #endif
@@ -0,0 +1,250 @@
+/*
+ * utils_keyslot_history - host-local keyslot unlock statistics
+ *
+ * Copyright (C) 2026, cryptsetup contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+
+/* Entries (devices x keyslots) kept in history file, oldest are dropped */
+#define KEYSLOT_HISTORY_MAX 1024
+
+/*
+ * Optional keyslot unlock history
+ *
+ * The file has one "<uuid> <keyslot> <unlock count>" entry per line.
+ * Keyslots of the same priority are then tried in descending unlock count
+ * order, so the usual passphrase costs one key derivation. It contains
+ * no secrets, it only decides trial order, but it is still ignored
+ * if not owned by the current user or writable by others.
+ * Metadata on disk is never touched.
+ */
+struct keyslot_history_entry {
+	char uuid[40];
+	int keyslot;
+	unsigned long hits;
+};
+
+static struct {
+	pthread_mutex_t lock;
+	char *path;
+} keyslot_history = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Called with history lock held */
+static int keyslot_history_load(struct keyslot_history_entry **entries)
+{
+	struct keyslot_history_entry *e = NULL, *tmp;
+	struct stat st;
+	char *line = NULL, uuid[40];
+	unsigned long hits;
+	size_t len = 0;
+	FILE *f = NULL;
+	int fd, keyslot, count = 0;
+
+	*entries = NULL;
+
+	fd = open(keyslot_history.path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_uid == geteuid() &&
+	    !(st.st_mode & (S_IWGRP | S_IWOTH)))
+		f = fdopen(fd, "r");
+	if (!f) {
+		log_dbg("Keyslot history file %s is not trusted, ignoring it.",
+			keyslot_history.path);
+		close(fd);
+		return 0;
+	}
+
+	while (count < KEYSLOT_HISTORY_MAX && getline(&line, &len, f) != -1) {
+		if (sscanf(line, "%39s %d %lu", uuid, &keyslot, &hits) != 3 ||
+		    keyslot < 0 || !hits)
+			continue;
+
+		if (!(count % 16)) {
+			tmp = realloc(e, (count + 16) * sizeof(*e));
+			if (!tmp)
+				break;
+			e = tmp;
+		}
+		strcpy(e[count].uuid, uuid);
+		e[count].keyslot = keyslot;
+		e[count].hits = hits;
+		count++;
+	}
+
+	free(line);
+	fclose(f);
+	*entries = e;
+	return count;
+}
+
+/* Called with history lock held, replaced atomically so readers never see partial file */
+static void keyslot_history_store(const struct keyslot_history_entry *e, int count)
+{
+	char *tmp;
+	FILE *f;
+	int fd, i;
+
+	if (asprintf(&tmp, "%s.XXXXXX", keyslot_history.path) < 0)
+		return;
+
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		goto out;
+
+	if (!(f = fdopen(fd, "w"))) {
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+
+	/* Entries are kept most recently unlocked first */
+	for (i = 0; i < count; i++)
+		fprintf(f, "%s %d %lu\n", e[i].uuid, e[i].keyslot, e[i].hits);
+
+	if (fclose(f) || rename(tmp, keyslot_history.path)) {
+		log_dbg("Cannot store keyslot history to %s.", keyslot_history.path);
+		unlink(tmp);
+	}
+out:
+	free(tmp);
+}
+
+static unsigned long keyslot_history_hits(const struct keyslot_history_entry *e, int count,
+					  const char *uuid, int keyslot)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (e[i].keyslot == keyslot && !strcmp(e[i].uuid, uuid))
+			return e[i].hits;
+
+	return 0;
+}
+
+void crypt_keyslot_history_sort(const char *uuid, int *keyslots, int count)
+{
+	struct keyslot_history_entry *e;
+	unsigned long hits[count > 0 ? count : 1], h;
+	int i, j, k, entries;
+
+	if (!uuid || !*uuid || count < 2)
+		return;
+
+	pthread_mutex_lock(&keyslot_history.lock);
+	if (!keyslot_history.path) {
+		pthread_mutex_unlock(&keyslot_history.lock);
+		return;
+	}
+
+	entries = keyslot_history_load(&e);
+	pthread_mutex_unlock(&keyslot_history.lock);
+
+	if (!entries) {
+		free(e);
+		return;
+	}
+
+	for (i = 0; i < count; i++)
+		hits[i] = keyslot_history_hits(e, entries, uuid, keyslots[i]);
+	free(e);
+
+	/* Stable insertion sort, keyslots never unlocked keep numeric order */
+	for (i = 1; i < count; i++) {
+		k = keyslots[i];
+		h = hits[i];
+		for (j = i; j > 0 && hits[j - 1] < h; j--) {
+			keyslots[j] = keyslots[j - 1];
+			hits[j] = hits[j - 1];
+		}
+		keyslots[j] = k;
+		hits[j] = h;
+	}
+
+	log_dbg("Keyslot trial order adjusted by unlock history, keyslot %d first.",
+		keyslots[0]);
+}
+
+void crypt_keyslot_history_hit(const char *uuid, int keyslot)
+{
+	struct keyslot_history_entry *e, *tmp;
+	struct keyslot_history_entry hit = { .keyslot = keyslot, .hits = 1 };
+	int i, count;
+
+	if (!uuid || !*uuid || keyslot < 0 || strlen(uuid) >= sizeof(hit.uuid))
+		return;
+
+	pthread_mutex_lock(&keyslot_history.lock);
+	if (!keyslot_history.path)
+		goto out;
+
+	strcpy(hit.uuid, uuid);
+	count = keyslot_history_load(&e);
+
+	for (i = 0; i < count; i++)
+		if (e[i].keyslot == keyslot && !strcmp(e[i].uuid, uuid)) {
+			hit.hits = e[i].hits + 1;
+			memmove(&e[i], &e[i + 1], (count - i - 1) * sizeof(*e));
+			count--;
+			break;
+		}
+
+	/* Move the entry to front, the last one is dropped when full */
+	if (count == KEYSLOT_HISTORY_MAX)
+		count--;
+	tmp = realloc(e, (count + 1) * sizeof(*e));
+	if (tmp) {
+		memmove(&tmp[1], &tmp[0], count * sizeof(*tmp));
+		tmp[0] = hit;
+		keyslot_history_store(tmp, count + 1);
+		e = tmp;
+	}
+	free(e);
+out:
+	pthread_mutex_unlock(&keyslot_history.lock);
+}
+
+/* Libcryptsetup API */
+
+int crypt_set_keyslot_history(const char *path)
+{
+	char *new_path = NULL;
+
+	if (path && !(new_path = strdup(path)))
+		return -ENOMEM;
+
+	pthread_mutex_lock(&keyslot_history.lock);
+	free(keyslot_history.path);
+	keyslot_history.path = new_path;
+	pthread_mutex_unlock(&keyslot_history.lock);
+
+	log_dbg("Keyslot unlock history %s.", path ?: "disabled");
+	return 0;
+}
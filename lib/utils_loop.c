@@ -29,6 +29,7 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <stdint.h>
 #ifdef HAVE_SYS_SYSMACROS_H
 # include <sys/sysmacros.h>     /* for major, minor */
 #endif
@@ -50,6 +51,26 @@
 #define LOOP_SET_CAPACITY 0x4C07
 #endif
 
+#ifndef LOOP_SET_DIRECT_IO
+#define LOOP_SET_DIRECT_IO 0x4C08
+#endif
+
+#ifndef LO_FLAGS_DIRECT_IO
+#define LO_FLAGS_DIRECT_IO 16
+#endif
+
+#ifndef LOOP_CONFIGURE
+#define LOOP_CONFIGURE 0x4C0A
+struct loop_config {
+	uint32_t fd;
+	uint32_t block_size;
+	struct loop_info64 info;
+	uint64_t __reserved[8];
+};
+#endif
+
+#define LOOP_BLOCK_SIZE 512
+
 static char *crypt_loop_get_device_old(void)
 {
 	char dev[20];
@@ -100,12 +121,84 @@ static char *crypt_loop_get_device(void)
 	return strdup(dev);
 }
 
+/*
+ * Direct I/O on loop works only if the loop block size is not smaller
+ * than logical block size of the device backing the file. If it cannot
+ * be detected (virtual filesystems), kernel decides on its own.
+ */
+static int crypt_loop_direct_io_possible(int file_fd)
+{
+	char path[PATH_MAX], buf[32];
+	struct stat st;
+	ssize_t len;
+	int fd;
+
+	if (fstat(file_fd, &st) < 0)
+		return 0;
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/queue/logical_block_size",
+		     major(st.st_dev), minor(st.st_dev)) < 0)
+		return 1;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		/* partition has queue attributes in parent device */
+		if (snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../queue/logical_block_size",
+			     major(st.st_dev), minor(st.st_dev)) < 0)
+			return 1;
+		fd = open(path, O_RDONLY);
+	}
+	if (fd < 0)
+		return 1;
+
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return 1;
+	buf[len] = '\0';
+
+	return atoi(buf) <= LOOP_BLOCK_SIZE;
+}
+
+/*
+ * Attach file and set status in one ioctl (kernel 5.8).
+ * Returns -ENOTTY if LOOP_CONFIGURE is not supported.
+ */
+static int crypt_loop_configure(int loop_fd, int file_fd,
+				const struct loop_info64 *lo64, int direct_io)
+{
+	struct loop_config config = {
+		.fd = file_fd,
+		.block_size = LOOP_BLOCK_SIZE,
+		.info = *lo64,
+	};
+
+	if (direct_io)
+		config.info.lo_flags |= LO_FLAGS_DIRECT_IO;
+
+	if (!ioctl(loop_fd, LOOP_CONFIGURE, &config))
+		return 0;
+
+	/* backing file can refuse direct I/O, retry without it */
+	if (errno == EINVAL && direct_io) {
+		config.info.lo_flags &= ~LO_FLAGS_DIRECT_IO;
+		if (!ioctl(loop_fd, LOOP_CONFIGURE, &config))
+			return 0;
+	}
+
+	/* old kernels reject unknown ioctl with EINVAL or ENOTTY */
+	if (errno == EINVAL || errno == ENOTTY)
+		return -ENOTTY;
+
+	return -errno;
+}
+
 int crypt_loop_attach(char **loop, const char *file, int offset,
 		      int autoclear, int *readonly)
 {
 	struct loop_info64 lo64 = {0};
 	char *lo_file_name;
-	int loop_fd = -1, file_fd = -1, r = 1;
+	int loop_fd = -1, file_fd = -1, r = 1, configure = 1, direct_io;
 
 	*loop = NULL;
 
@@ -117,6 +210,16 @@ int crypt_loop_attach(char **loop, const char *file, int offset,
 	if (file_fd < 0)
 		goto out;
 
+	lo_file_name = (char*)lo64.lo_file_name;
+	lo_file_name[LO_NAME_SIZE-1] = '\0';
+	strncpy(lo_file_name, file, LO_NAME_SIZE-1);
+	lo64.lo_offset = offset;
+	if (autoclear)
+		lo64.lo_flags |= LO_FLAGS_AUTOCLEAR;
+
+	/* Avoid caching both encrypted file and plaintext device pages */
+	direct_io = crypt_loop_direct_io_possible(file_fd);
+
 	while (loop_fd < 0)  {
 		*loop = crypt_loop_get_device();
 		if (!*loop)
@@ -126,27 +229,35 @@ int crypt_loop_attach(char **loop, const char *file, int offset,
 		if (loop_fd < 0)
 			goto out;
 
-		if (ioctl(loop_fd, LOOP_SET_FD, file_fd) < 0) {
-			if (errno != EBUSY)
-				goto out;
+		if (configure) {
+			r = crypt_loop_configure(loop_fd, file_fd, &lo64, direct_io);
+			if (r == -ENOTTY)
+				configure = 0;
+		}
+
+		if (!configure)
+			r = ioctl(loop_fd, LOOP_SET_FD, file_fd) < 0 ? -errno : 0;
+
+		if (r == -EBUSY) {
 			free(*loop);
 			*loop = NULL;
 
 			close(loop_fd);
 			loop_fd = -1;
-		}
+		} else if (r)
+			goto out;
 	}
+	r = 1;
 
-	lo_file_name = (char*)lo64.lo_file_name;
-	lo_file_name[LO_NAME_SIZE-1] = '\0';
-	strncpy(lo_file_name, file, LO_NAME_SIZE-1);
-	lo64.lo_offset = offset;
-	if (autoclear)
-		lo64.lo_flags |= LO_FLAGS_AUTOCLEAR;
+	if (!configure) {
+		if (ioctl(loop_fd, LOOP_SET_STATUS64, &lo64) < 0) {
+			(void)ioctl(loop_fd, LOOP_CLR_FD, 0);
+			goto out;
+		}
 
-	if (ioctl(loop_fd, LOOP_SET_STATUS64, &lo64) < 0) {
-		(void)ioctl(loop_fd, LOOP_CLR_FD, 0);
-		goto out;
+		/* best effort, available since kernel 4.10 */
+		if (direct_io)
+			(void)ioctl(loop_fd, LOOP_SET_DIRECT_IO, 1);
 	}
 
 	/* Verify that autoclear is really set */
@@ -0,0 +1,284 @@
+/*
+ * utils_monitor - integrity and verity corruption monitoring
+ *
+ * Copyright (C) 2026, cryptsetup contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <linux/netlink.h>
+
+#include "internal.h"
+
+/* Default rescan interval of integrity mismatch counters (seconds) */
+#define MONITOR_DEFAULT_INTERVAL 10
+
+/* uevent key set by dm-verity on a detected corruption */
+#define MONITOR_VERITY_UEVENT "DM_VERITY_ERR_"
+
+struct monitor_state {
+	char *name;
+	uint64_t integrity_failures;
+	int corrupted;
+};
+
+struct crypt_monitor {
+	int epoll_fd;
+	int uevent_fd;
+	int timer_fd;
+	struct monitor_state *state;
+	size_t count;
+};
+
+static void monitor_state_free(struct monitor_state *state, size_t count)
+{
+	size_t i;
+
+	for (i = 0; state && i < count; i++)
+		free(state[i].name);
+	free(state);
+}
+
+static const struct monitor_state *monitor_state_find(struct crypt_monitor *mon, const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < mon->count; i++)
+		if (!strcmp(mon->state[i].name, name))
+			return &mon->state[i];
+
+	return NULL;
+}
+
+/*
+ * Scan all active verity and integrity devices, report changes against
+ * the previous scan (if event is set) and store the new state.
+ */
+static int monitor_scan(struct crypt_monitor *mon,
+	void (*event)(const struct crypt_monitor_event *ev, void *usrptr),
+	void *usrptr)
+{
+	struct crypt_active_entry *list;
+	struct crypt_monitor_event ev;
+	const struct monitor_state *old;
+	struct monitor_state *state;
+	size_t i, n, count = 0;
+	int r, events = 0;
+
+	r = crypt_list_active(NULL, &list, &n);
+	if (r < 0)
+		return r;
+
+	state = calloc(n ?: 1, sizeof(*state));
+	if (!state) {
+		crypt_list_active_free(list, n);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (!list[i].target || (strcmp(list[i].target, "verity") &&
+					strcmp(list[i].target, "integrity")))
+			continue;
+
+		state[count].name = list[i].name;
+		list[i].name = NULL;
+		state[count].integrity_failures = list[i].integrity_failures;
+		state[count].corrupted = (list[i].flags & CRYPT_ACTIVATE_CORRUPTED) ? 1 : 0;
+
+		old = monitor_state_find(mon, state[count].name);
+		if (event && (state[count].integrity_failures > (old ? old->integrity_failures : 0) ||
+			      (state[count].corrupted && !(old && old->corrupted)))) {
+			memset(&ev, 0, sizeof(ev));
+			ev.name = state[count].name;
+			ev.target = list[i].target;
+			ev.integrity_failures = state[count].integrity_failures;
+			ev.verity_corrupted = state[count].corrupted;
+			event(&ev, usrptr);
+			events++;
+		}
+		count++;
+	}
+
+	crypt_list_active_free(list, n);
+	monitor_state_free(mon->state, mon->count);
+	mon->state = state;
+	mon->count = count;
+
+	return events;
+}
+
+static int monitor_add_fd(struct crypt_monitor *mon, int fd)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+
+	return epoll_ctl(mon->epoll_fd, EPOLL_CTL_ADD, fd, &ev) ? -errno : 0;
+}
+
+static int monitor_uevent_open(void)
+{
+	struct sockaddr_nl nl = {
+		.nl_family = AF_NETLINK,
+		.nl_groups = 1, /* kernel uevents */
+	};
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    NETLINK_KOBJECT_UEVENT);
+	if (fd < 0)
+		return -errno;
+
+	if (bind(fd, (struct sockaddr *)&nl, sizeof(nl)) < 0) {
+		close(fd);
+		return -errno;
+	}
+
+	return fd;
+}
+
+/* Drain pending uevents, return 1 if any of them reports verity error. */
+static int monitor_uevent_read(int fd)
+{
+	char buf[4096], *p;
+	ssize_t len;
+	int found = 0;
+
+	while ((len = recv(fd, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[len] = '\0';
+		/* uevent message is a sequence of NUL separated KEY=value strings */
+		for (p = buf; p < buf + len; p += strlen(p) + 1)
+			if (!strncmp(p, MONITOR_VERITY_UEVENT, strlen(MONITOR_VERITY_UEVENT)))
+				found = 1;
+	}
+
+	return found;
+}
+
+int crypt_monitor_init(struct crypt_monitor **mon, uint32_t interval)
+{
+	struct crypt_monitor *m;
+	struct itimerspec its = {};
+	int r;
+
+	if (!mon)
+		return -EINVAL;
+
+	if (!interval)
+		interval = MONITOR_DEFAULT_INTERVAL;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		return -ENOMEM;
+
+	m->uevent_fd = m->timer_fd = -1;
+
+	m->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (m->epoll_fd < 0) {
+		free(m);
+		return -errno;
+	}
+
+	/*
+	 * dm-verity sends uevent on corruption, dm-integrity provides
+	 * only mismatch counter in status, so it is rescanned periodically.
+	 */
+	m->uevent_fd = monitor_uevent_open();
+	if (m->uevent_fd < 0)
+		log_dbg("Cannot listen for kernel uevents (%d), using only status rescan.", m->uevent_fd);
+	else if ((r = monitor_add_fd(m, m->uevent_fd)))
+		goto fail;
+
+	m->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (m->timer_fd < 0) {
+		r = -errno;
+		goto fail;
+	}
+
+	its.it_value.tv_sec = its.it_interval.tv_sec = interval;
+	if (timerfd_settime(m->timer_fd, 0, &its, NULL) < 0) {
+		r = -errno;
+		goto fail;
+	}
+
+	if ((r = monitor_add_fd(m, m->timer_fd)))
+		goto fail;
+
+	/* initial state, nothing is reported */
+	r = monitor_scan(m, NULL, NULL);
+	if (r < 0)
+		goto fail;
+
+	*mon = m;
+	return 0;
+fail:
+	crypt_monitor_free(m);
+	return r;
+}
+
+int crypt_monitor_fd(struct crypt_monitor *mon)
+{
+	return mon ? mon->epoll_fd : -EINVAL;
+}
+
+int crypt_monitor_dispatch(struct crypt_monitor *mon,
+	void (*event)(const struct crypt_monitor_event *ev, void *usrptr),
+	void *usrptr)
+{
+	struct epoll_event evs[2];
+	uint64_t expirations;
+	int i, n, rescan = 0;
+
+	if (!mon || !event)
+		return -EINVAL;
+
+	n = epoll_wait(mon->epoll_fd, evs, 2, 0);
+	if (n < 0)
+		return errno == EINTR ? 0 : -errno;
+
+	for (i = 0; i < n; i++) {
+		if (evs[i].data.fd == mon->uevent_fd)
+			rescan |= monitor_uevent_read(mon->uevent_fd);
+		else if (evs[i].data.fd == mon->timer_fd &&
+			 read(mon->timer_fd, &expirations, sizeof(expirations)) > 0)
+			rescan = 1;
+	}
+
+	if (!rescan)
+		return 0;
+
+	return monitor_scan(mon, event, usrptr);
+}
+
+void crypt_monitor_free(struct crypt_monitor *mon)
+{
+	if (!mon)
+		return;
+
+	if (mon->uevent_fd >= 0)
+		close(mon->uevent_fd);
+	if (mon->timer_fd >= 0)
+		close(mon->timer_fd);
+	if (mon->epoll_fd >= 0)
+		close(mon->epoll_fd);
+
+	monitor_state_free(mon->state, mon->count);
+	free(mon);
+}
@@ -19,8 +19,13 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
 
 #include "internal.h"
 
@@ -243,6 +248,48 @@ int crypt_set_pbkdf_type(struct crypt_device *cd, const struct crypt_pbkdf_type
 	return init_pbkdf_type(cd, pbkdf, crypt_get_type(cd));
 }
 
+int crypt_set_pbkdf_numa_node(struct crypt_device *cd, int node)
+{
+	if (node < CRYPT_PBKDF_NUMA_NONE)
+		return -EINVAL;
+
+	log_dbg("Setting Argon2 NUMA node to %d.", node);
+	crypt_argon2_set_numa_node(node == CRYPT_PBKDF_NUMA_AUTO ? CRYPT_ARGON2_NUMA_AUTO :
+				   node == CRYPT_PBKDF_NUMA_NONE ? CRYPT_ARGON2_NUMA_NONE : node);
+	return 0;
+}
+
+int crypt_set_pbkdf_helpers(unsigned helpers, uint32_t max_memory_kb)
+{
+	log_dbg("Setting Argon2 helper processes to %u (%u kB reserved).",
+		helpers, max_memory_kb);
+
+	if (!helpers) {
+		crypt_argon2_helpers_stop();
+		return 0;
+	}
+
+	return crypt_argon2_helpers_start(helpers, max_memory_kb);
+}
+
+int crypt_set_pbkdf_memory_budget(uint64_t memory_kb, int shared)
+{
+	const char *path = DEFAULT_LUKS2_LOCK_PATH "/pbkdf-budget";
+	int r;
+
+	log_dbg("Setting Argon2 memory budget to %" PRIu64 " kB%s.",
+		memory_kb, shared ? " (shared)" : "");
+
+	if (shared && mkdir(DEFAULT_LUKS2_LOCK_PATH, DEFAULT_LUKS2_LOCK_DIR_PERMS) && errno != EEXIST)
+		return -errno;
+
+	r = crypt_argon2_set_budget(memory_kb, shared ? path : NULL);
+	if (r < 0)
+		log_dbg("Cannot set Argon2 memory budget: %s.", strerror(-r));
+
+	return r;
+}
+
 const struct crypt_pbkdf_type *crypt_get_pbkdf_type(struct crypt_device *cd)
 {
 	if (!cd)
@@ -290,3 +337,599 @@ void crypt_set_iteration_time(struct crypt_device *cd, uint64_t iteration_time_m
 
 	log_dbg("Iteration time set to %" PRIu64 " milliseconds.", iteration_time_ms);
 }
+
+/*
+ * Optional persistent PBKDF calibration cache
+ *
+ * Benchmarked costs are keyed by CPU model, crypto backend and all requested
+ * PBKDF parameters, so provisioning of many devices on identical hardware
+ * runs the benchmark only once. The file has one entry per line, later
+ * entries override earlier ones. There are no secrets, but the file must be
+ * trusted (it decides keyslot cost), so it is ignored if writable by others.
+ */
+struct pbkdf_cache_entry {
+	struct pbkdf_cache_entry *next;
+	uint32_t iterations;
+	uint32_t memory_kb;
+	char id[];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	char *path;
+	char *cpu;
+	bool loaded;
+	struct pbkdf_cache_entry *entries;
+} pbkdf_cache = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static char *pbkdf_cache_cpu_model(void)
+{
+	struct utsname uts;
+	char *line = NULL, *model = NULL, *c;
+	size_t len = 0;
+	FILE *f;
+
+	f = fopen("/proc/cpuinfo", "r");
+	while (f && !model && getline(&line, &len, f) != -1) {
+		if (strncmp(line, "model name", 10) && strncmp(line, "cpu model", 9) &&
+		    strncmp(line, "Processor", 9) && strncmp(line, "cpu\t", 4))
+			continue;
+		if (!(c = strchr(line, ':')))
+			continue;
+		for (c++; *c == ' '; c++);
+		c[strcspn(c, "\n")] = '\0';
+		model = strdup(c);
+	}
+	free(line);
+	if (f)
+		fclose(f);
+
+	if (!model && !uname(&uts))
+		model = strdup(uts.machine);
+
+	/* Tab and newline are cache file separators */
+	for (c = model; c && *c; c++)
+		if (*c == '\t')
+			*c = ' ';
+
+	return model;
+}
+
+static void pbkdf_cache_free_entries(void)
+{
+	struct pbkdf_cache_entry *e;
+
+	while ((e = pbkdf_cache.entries)) {
+		pbkdf_cache.entries = e->next;
+		free(e);
+	}
+	pbkdf_cache.loaded = false;
+}
+
+static int pbkdf_cache_add_entry(const char *id, uint32_t iterations, uint32_t memory_kb)
+{
+	struct pbkdf_cache_entry *e;
+	size_t len = strlen(id) + 1;
+
+	e = malloc(sizeof(*e) + len);
+	if (!e)
+		return -ENOMEM;
+
+	memcpy(e->id, id, len);
+	e->iterations = iterations;
+	e->memory_kb = memory_kb;
+	e->next = pbkdf_cache.entries;
+	pbkdf_cache.entries = e;
+
+	return 0;
+}
+
+static int pbkdf_cache_file_trusted(int fd)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode))
+		return 0;
+
+	if (st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+		log_dbg("PBKDF cache file %s is not trusted, ignoring it.", pbkdf_cache.path);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* Called with cache lock held */
+static void pbkdf_cache_load(void)
+{
+	char *line = NULL, *it, *mem;
+	unsigned long iterations, memory_kb;
+	size_t len = 0;
+	FILE *f = NULL;
+	int fd;
+
+	if (pbkdf_cache.loaded || !pbkdf_cache.path)
+		return;
+	pbkdf_cache.loaded = true;
+
+	fd = open(pbkdf_cache.path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (pbkdf_cache_file_trusted(fd))
+		f = fdopen(fd, "r");
+	if (!f) {
+		close(fd);
+		return;
+	}
+
+	/* id \t iterations \t memory_kb */
+	while (getline(&line, &len, f) != -1) {
+		line[strcspn(line, "\n")] = '\0';
+		if (!(mem = strrchr(line, '\t')))
+			continue;
+		*mem++ = '\0';
+		if (!(it = strrchr(line, '\t')))
+			continue;
+		*it++ = '\0';
+
+		iterations = strtoul(it, NULL, 10);
+		memory_kb = strtoul(mem, NULL, 10);
+		if (!iterations || iterations > UINT32_MAX || memory_kb > UINT32_MAX)
+			continue;
+
+		if (pbkdf_cache_add_entry(line, iterations, memory_kb))
+			break;
+	}
+
+	free(line);
+	fclose(f);
+}
+
+static char *pbkdf_cache_id(const struct crypt_pbkdf_type *pbkdf, size_t volume_key_size)
+{
+	char *id;
+
+	if (!pbkdf_cache.cpu)
+		pbkdf_cache.cpu = pbkdf_cache_cpu_model();
+
+	if (asprintf(&id, "%s\t%s\t%s\t%s\t%u\t%u\t%u\t%zu",
+		     pbkdf_cache.cpu ?: "unknown", crypt_backend_version(),
+		     pbkdf->type, pbkdf->hash ?: "", pbkdf->time_ms,
+		     pbkdf->max_memory_kb, pbkdf->parallel_threads,
+		     volume_key_size) < 0)
+		return NULL;
+
+	return id;
+}
+
+int crypt_pbkdf_cache_get(const struct crypt_pbkdf_type *pbkdf, size_t volume_key_size,
+			  uint32_t *iterations, uint32_t *memory_kb)
+{
+	struct pbkdf_cache_entry *e;
+	char *id;
+	int r = -ENOENT;
+
+	pthread_mutex_lock(&pbkdf_cache.lock);
+	if (!pbkdf_cache.path)
+		goto out;
+
+	pbkdf_cache_load();
+
+	id = pbkdf_cache_id(pbkdf, volume_key_size);
+	if (!id) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (e = pbkdf_cache.entries; e; e = e->next)
+		if (!strcmp(e->id, id)) {
+			*iterations = e->iterations;
+			*memory_kb = e->memory_kb;
+			r = 0;
+			break;
+		}
+	free(id);
+out:
+	pthread_mutex_unlock(&pbkdf_cache.lock);
+	return r;
+}
+
+void crypt_pbkdf_cache_put(const struct crypt_pbkdf_type *pbkdf, size_t volume_key_size,
+			   uint32_t iterations, uint32_t memory_kb)
+{
+	char *id = NULL;
+	int fd = -1;
+
+	pthread_mutex_lock(&pbkdf_cache.lock);
+	if (!pbkdf_cache.path)
+		goto out;
+
+	pbkdf_cache_load();
+
+	id = pbkdf_cache_id(pbkdf, volume_key_size);
+	if (!id || pbkdf_cache_add_entry(id, iterations, memory_kb))
+		goto out;
+
+	fd = open(pbkdf_cache.path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd < 0 || !pbkdf_cache_file_trusted(fd) ||
+	    dprintf(fd, "%s\t%u\t%u\n", id, iterations, memory_kb) < 0)
+		log_dbg("Cannot store PBKDF values to cache %s.", pbkdf_cache.path);
+out:
+	if (fd >= 0)
+		close(fd);
+	free(id);
+	pthread_mutex_unlock(&pbkdf_cache.lock);
+}
+
+/* Libcryptsetup API */
+
+int crypt_set_pbkdf_cache(const char *path)
+{
+	char *new_path = NULL;
+
+	if (path && !(new_path = strdup(path)))
+		return -ENOMEM;
+
+	pthread_mutex_lock(&pbkdf_cache.lock);
+	pbkdf_cache_free_entries();
+	free(pbkdf_cache.path);
+	pbkdf_cache.path = new_path;
+	pthread_mutex_unlock(&pbkdf_cache.lock);
+
+	log_dbg("PBKDF calibration cache %s.", path ?: "disabled");
+	return 0;
+}
+
+int crypt_pbkdf_cache_invalidate(void)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&pbkdf_cache.lock);
+	pbkdf_cache_free_entries();
+	if (pbkdf_cache.path && truncate(pbkdf_cache.path, 0) && errno != ENOENT)
+		r = -errno;
+	pthread_mutex_unlock(&pbkdf_cache.lock);
+
+	return r;
+}
+
+/*
+ * Concurrent key derivation of unlock candidates
+ *
+ * Jobs are started strictly in index order by min(count, cpus) worker threads.
+ * A job is started only if it fits into the free CPU and memory budget
+ * (or nothing else runs), so memory-hard KDFs never together exceed
+ * half of physical memory. The caller consumes results in index order
+ * (crypt_pbkdf_jobs_wait) and stops the batch once a candidate verified,
+ * jobs not yet started are then skipped.
+ */
+enum { PBKDF_JOB_QUEUED = 0, PBKDF_JOB_RUNNING, PBKDF_JOB_DONE };
+
+struct crypt_pbkdf_jobs {
+	struct crypt_pbkdf_job *job;
+	unsigned count, next;
+	const char *password;
+	size_t password_length;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t *threads;
+	unsigned nthreads;
+
+	unsigned cpus, busy_cpus;
+	uint64_t memory_kb, busy_memory_kb;
+	int stop;
+};
+
+static unsigned pbkdf_job_cpus(const struct crypt_pbkdf_job *job)
+{
+	return job->parallel_threads ?: 1;
+}
+
+static int pbkdf_job_admit(struct crypt_pbkdf_jobs *jobs)
+{
+	const struct crypt_pbkdf_job *job = &jobs->job[jobs->next];
+
+	if (!jobs->busy_cpus)
+		return 1;
+
+	return (jobs->busy_cpus + pbkdf_job_cpus(job) <= jobs->cpus &&
+		jobs->busy_memory_kb + job->max_memory_kb <= jobs->memory_kb);
+}
+
+static void *pbkdf_jobs_thread(void *arg)
+{
+	struct crypt_pbkdf_jobs *jobs = arg;
+	struct crypt_pbkdf_job *job;
+	int r;
+
+	pthread_mutex_lock(&jobs->lock);
+	while (1) {
+		while (!jobs->stop && jobs->next < jobs->count && !pbkdf_job_admit(jobs))
+			pthread_cond_wait(&jobs->cond, &jobs->lock);
+
+		if (jobs->stop || jobs->next >= jobs->count)
+			break;
+
+		job = &jobs->job[jobs->next++];
+		job->state = PBKDF_JOB_RUNNING;
+		jobs->busy_cpus += pbkdf_job_cpus(job);
+		jobs->busy_memory_kb += job->max_memory_kb;
+		pthread_mutex_unlock(&jobs->lock);
+
+		r = crypt_pbkdf(job->type, job->hash,
+				job->password ?: jobs->password,
+				job->password ? job->password_length : jobs->password_length,
+				job->salt, job->salt_length, job->key->key, job->key->keylength,
+				job->iterations, job->max_memory_kb, job->parallel_threads);
+
+		pthread_mutex_lock(&jobs->lock);
+		job->r = r;
+		job->state = PBKDF_JOB_DONE;
+		jobs->busy_cpus -= pbkdf_job_cpus(job);
+		jobs->busy_memory_kb -= job->max_memory_kb;
+		pthread_cond_broadcast(&jobs->cond);
+	}
+	pthread_mutex_unlock(&jobs->lock);
+
+	return NULL;
+}
+
+int crypt_pbkdf_jobs_start(struct crypt_pbkdf_jobs **jobs,
+			   struct crypt_pbkdf_job *job, unsigned count,
+			   const char *password, size_t password_length)
+{
+	struct crypt_pbkdf_jobs *j;
+	unsigned i;
+
+	if (!count)
+		return -EINVAL;
+
+	j = calloc(1, sizeof(*j));
+	if (!j)
+		return -ENOMEM;
+
+	j->job = job;
+	j->count = count;
+	j->password = password;
+	j->password_length = password_length;
+	j->cpus = crypt_cpusonline() ?: 1;
+	j->memory_kb = adjusted_phys_memory();
+	j->nthreads = count < j->cpus ? count : j->cpus;
+
+	for (i = 0; i < count; i++)
+		job[i].state = PBKDF_JOB_QUEUED;
+
+	j->threads = calloc(j->nthreads, sizeof(*j->threads));
+	if (!j->threads) {
+		free(j);
+		return -ENOMEM;
+	}
+
+	if (pthread_mutex_init(&j->lock, NULL)) {
+		free(j->threads);
+		free(j);
+		return -ENOMEM;
+	}
+
+	if (pthread_cond_init(&j->cond, NULL)) {
+		pthread_mutex_destroy(&j->lock);
+		free(j->threads);
+		free(j);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < j->nthreads; i++)
+		if (pthread_create(&j->threads[i], NULL, pbkdf_jobs_thread, j))
+			break;
+
+	if (!i) {
+		pthread_cond_destroy(&j->cond);
+		pthread_mutex_destroy(&j->lock);
+		free(j->threads);
+		free(j);
+		return -ENOMEM;
+	}
+	j->nthreads = i;
+
+	/* later jobs reuse Argon2 memory of finished ones */
+	crypt_argon2_pool_get();
+
+	log_dbg("Running %u PBKDF jobs using %u threads.", count, j->nthreads);
+	*jobs = j;
+	return 0;
+}
+
+/* Wait for job to finish, returns crypt_pbkdf() result or -EINTR if stopped */
+int crypt_pbkdf_jobs_wait(struct crypt_pbkdf_jobs *jobs, unsigned idx)
+{
+	int r;
+
+	if (idx >= jobs->count)
+		return -EINVAL;
+
+	pthread_mutex_lock(&jobs->lock);
+	while (jobs->job[idx].state != PBKDF_JOB_DONE && !(jobs->stop &&
+	       jobs->job[idx].state == PBKDF_JOB_QUEUED))
+		pthread_cond_wait(&jobs->cond, &jobs->lock);
+	r = jobs->job[idx].state == PBKDF_JOB_DONE ? jobs->job[idx].r : -EINTR;
+	pthread_mutex_unlock(&jobs->lock);
+
+	return r;
+}
+
+/* Skip not yet started jobs, wait for running ones and release the batch */
+void crypt_pbkdf_jobs_stop(struct crypt_pbkdf_jobs *jobs)
+{
+	unsigned i;
+
+	if (!jobs)
+		return;
+
+	pthread_mutex_lock(&jobs->lock);
+	jobs->stop = 1;
+	pthread_cond_broadcast(&jobs->cond);
+	pthread_mutex_unlock(&jobs->lock);
+
+	for (i = 0; i < jobs->nthreads; i++)
+		pthread_join(jobs->threads[i], NULL);
+
+	crypt_argon2_pool_put();
+
+	pthread_cond_destroy(&jobs->cond);
+	pthread_mutex_destroy(&jobs->lock);
+	free(jobs->threads);
+	free(jobs);
+}
+
+/*
+ * Key derivations shared by several device contexts (crypt_activate_set)
+ *
+ * All contexts use the same passphrase, so keyslots with identical PBKDF
+ * (type, hash, costs, salt and key size) derive the same key. It is derived
+ * only once, concurrent requests for the same derivation wait for the first.
+ */
+struct pbkdf_shared_entry {
+	struct pbkdf_shared_entry *next;
+	char *type, *hash, *salt;
+	size_t salt_length;
+	uint32_t iterations, max_memory_kb, parallel_threads;
+	struct volume_key *key;
+	int r, done;
+};
+
+struct crypt_pbkdf_shared {
+	struct pbkdf_shared_entry *entries;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static int pbkdf_shared_match(const struct pbkdf_shared_entry *e,
+			      const struct crypt_pbkdf_job *job)
+{
+	return !strcmp(e->type, job->type) &&
+	       !strcmp(e->hash ?: "", job->hash ?: "") &&
+	       e->iterations == job->iterations &&
+	       e->max_memory_kb == job->max_memory_kb &&
+	       e->parallel_threads == job->parallel_threads &&
+	       e->key->keylength == job->key->keylength &&
+	       e->salt_length == job->salt_length &&
+	       !memcmp(e->salt, job->salt, job->salt_length);
+}
+
+static void pbkdf_shared_entry_free(struct pbkdf_shared_entry *e)
+{
+	free(e->type);
+	free(e->hash);
+	crypt_safe_free(e->salt);
+	crypt_free_volume_key(e->key);
+	free(e);
+}
+
+int crypt_pbkdf_shared_init(struct crypt_pbkdf_shared **shared)
+{
+	struct crypt_pbkdf_shared *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return -ENOMEM;
+
+	if (pthread_mutex_init(&s->lock, NULL)) {
+		free(s);
+		return -ENOMEM;
+	}
+
+	if (pthread_cond_init(&s->cond, NULL)) {
+		pthread_mutex_destroy(&s->lock);
+		free(s);
+		return -ENOMEM;
+	}
+
+	*shared = s;
+	return 0;
+}
+
+void crypt_pbkdf_shared_free(struct crypt_pbkdf_shared *shared)
+{
+	struct pbkdf_shared_entry *e;
+
+	if (!shared)
+		return;
+
+	while ((e = shared->entries)) {
+		shared->entries = e->next;
+		pbkdf_shared_entry_free(e);
+	}
+
+	pthread_cond_destroy(&shared->cond);
+	pthread_mutex_destroy(&shared->lock);
+	free(shared);
+}
+
+/* Derive job key (allocated by caller) or copy already derived identical key */
+int crypt_pbkdf_shared_derive(struct crypt_pbkdf_shared *shared,
+			      struct crypt_pbkdf_job *job,
+			      const char *password, size_t password_length)
+{
+	struct pbkdf_shared_entry *e;
+	int r;
+
+	pthread_mutex_lock(&shared->lock);
+	for (e = shared->entries; e; e = e->next)
+		if (pbkdf_shared_match(e, job))
+			break;
+
+	if (e) {
+		while (!e->done)
+			pthread_cond_wait(&shared->cond, &shared->lock);
+		r = e->r;
+		if (!r)
+			memcpy(job->key->key, e->key->key, job->key->keylength);
+		pthread_mutex_unlock(&shared->lock);
+		log_dbg("Reused shared %s key derivation.", job->type);
+		return r;
+	}
+
+	e = calloc(1, sizeof(*e));
+	if (e) {
+		e->type = strdup(job->type);
+		e->hash = job->hash ? strdup(job->hash) : NULL;
+		e->salt = crypt_safe_alloc(job->salt_length ?: 1);
+		e->key = crypt_alloc_volume_key(job->key->keylength, NULL);
+		if (!e->type || (job->hash && !e->hash) || !e->salt || !e->key) {
+			pbkdf_shared_entry_free(e);
+			e = NULL;
+		}
+	}
+
+	if (e) {
+		memcpy(e->salt, job->salt, job->salt_length);
+		e->salt_length = job->salt_length;
+		e->iterations = job->iterations;
+		e->max_memory_kb = job->max_memory_kb;
+		e->parallel_threads = job->parallel_threads;
+		e->next = shared->entries;
+		shared->entries = e;
+	}
+	pthread_mutex_unlock(&shared->lock);
+
+	r = crypt_pbkdf(job->type, job->hash, password, password_length,
+			job->salt, job->salt_length, job->key->key, job->key->keylength,
+			job->iterations, job->max_memory_kb, job->parallel_threads);
+
+	if (!e)
+		return r;
+
+	pthread_mutex_lock(&shared->lock);
+	e->r = r;
+	if (!r)
+		memcpy(e->key->key, job->key->key, job->key->keylength);
+	e->done = 1;
+	pthread_cond_broadcast(&shared->cond);
+	pthread_mutex_unlock(&shared->lock);
+
+	return r;
+}
@@ -0,0 +1,207 @@
+/*
+ * utils_probe - fast on-disk signature probe for many devices
+ *
+ * Copyright (C) 2026, cryptsetup contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <uuid/uuid.h>
+
+#include "internal.h"
+#include "luks1/luks.h"
+#include "luks1/af.h"
+#include "luks2/luks2.h"
+#include "verity/verity.h"
+#include "integrity/integrity.h"
+
+/* All probed signatures are within the first 4 KiB of device */
+#define PROBE_READ_SIZE 4096
+
+/* Probe is I/O bound, the number of threads is not limited by CPUs */
+#define PROBE_MAX_THREADS 16
+
+struct probe_ctx {
+	const char **paths;
+	struct crypt_probe_result *results;
+	size_t count;
+	size_t next;
+	pthread_mutex_t lock;
+};
+
+static void probe_copy_str(char *dst, size_t dst_len, const char *src, size_t src_len)
+{
+	size_t len = strnlen(src, src_len < dst_len ? src_len : dst_len - 1);
+
+	memcpy(dst, src, len);
+	dst[len] = '\0';
+}
+
+static int probe_luks1(const struct luks_phdr *hdr, struct crypt_probe_result *res)
+{
+	uint64_t end, size = LUKS_ALIGN_KEYSLOTS;
+	int i;
+
+	for (i = 0; i < LUKS_NUMKEYS; i++) {
+		end = (uint64_t)ntohl(hdr->keyblock[i].keyMaterialOffset) * SECTOR_SIZE +
+		      (uint64_t)AF_split_sectors(ntohl(hdr->keyBytes),
+						 ntohl(hdr->keyblock[i].stripes)) * SECTOR_SIZE;
+		if (end > size)
+			size = end;
+	}
+
+	res->type = CRYPT_LUKS1;
+	probe_copy_str(res->uuid, sizeof(res->uuid), hdr->uuid, UUID_STRING_L);
+	res->header_size = size;
+	return 0;
+}
+
+static int probe_luks2(const struct luks2_hdr_disk *hdr, struct crypt_probe_result *res)
+{
+	res->type = CRYPT_LUKS2;
+	probe_copy_str(res->uuid, sizeof(res->uuid), hdr->uuid, LUKS2_UUID_L);
+	probe_copy_str(res->label, sizeof(res->label), hdr->label, LUKS2_LABEL_L);
+	res->header_size = be64_to_cpu(hdr->hdr_size);
+	return 0;
+}
+
+static int probe_verity(const struct verity_sb *sb, struct crypt_probe_result *res)
+{
+	if (le32_to_cpu(sb->version) != 1)
+		return -ENOENT;
+
+	res->type = CRYPT_VERITY;
+	uuid_unparse(sb->uuid, res->uuid);
+	res->header_size = le32_to_cpu(sb->hash_block_size);
+	return 0;
+}
+
+static int probe_integrity(const struct superblock *sb, struct crypt_probe_result *res)
+{
+	if (!sb->version)
+		return -ENOENT;
+
+	res->type = CRYPT_INTEGRITY;
+	res->header_size = SECTOR_SIZE;
+	return 0;
+}
+
+/* One positional read, no locking, no checksum and no crypto backend */
+static int probe_one(const char *path, struct crypt_probe_result *res)
+{
+	static const char luks_magic[] = LUKS_MAGIC;
+	char *buf;
+	ssize_t len;
+	int fd, r = -ENOENT;
+
+	memset(res, 0, sizeof(*res));
+
+	if (!path)
+		return -EINVAL;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (posix_memalign((void *)&buf, PROBE_READ_SIZE, PROBE_READ_SIZE)) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	len = read_buffer_at(fd, buf, PROBE_READ_SIZE, 0);
+	close(fd);
+	if (len < 0) {
+		free(buf);
+		return -EIO;
+	}
+
+	if (len >= (ssize_t)sizeof(struct luks_phdr) &&
+	    !memcmp(buf, luks_magic, LUKS_MAGIC_L)) {
+		if (be16_to_cpu(((struct luks_phdr *)buf)->version) == 1)
+			r = probe_luks1((struct luks_phdr *)buf, res);
+		else if (len >= (ssize_t)LUKS2_HDR_BIN_LEN &&
+			 be16_to_cpu(((struct luks2_hdr_disk *)buf)->version) == 2)
+			r = probe_luks2((struct luks2_hdr_disk *)buf, res);
+	} else if (len >= (ssize_t)sizeof(struct verity_sb) &&
+		   !memcmp(buf, VERITY_SIGNATURE, sizeof(((struct verity_sb *)0)->signature)))
+		r = probe_verity((struct verity_sb *)buf, res);
+	else if (len >= (ssize_t)sizeof(struct superblock) &&
+		 !memcmp(buf, SB_MAGIC, sizeof(((struct superblock *)0)->magic)))
+		r = probe_integrity((struct superblock *)buf, res);
+
+	free(buf);
+	return r;
+}
+
+static void *probe_worker(void *arg)
+{
+	struct probe_ctx *ctx = arg;
+	size_t i;
+
+	while (1) {
+		pthread_mutex_lock(&ctx->lock);
+		i = ctx->next < ctx->count ? ctx->next++ : ctx->count;
+		pthread_mutex_unlock(&ctx->lock);
+
+		if (i == ctx->count)
+			break;
+
+		ctx->results[i].status = probe_one(ctx->paths[i], &ctx->results[i]);
+	}
+
+	return NULL;
+}
+
+int crypt_probe_devices(const char **paths, size_t count,
+			struct crypt_probe_result *results)
+{
+	struct probe_ctx ctx = {
+		.paths = paths,
+		.results = results,
+		.count = count,
+	};
+	pthread_t threads[PROBE_MAX_THREADS - 1];
+	size_t i, started = 0, nthreads;
+
+	if (!paths || !results)
+		return -EINVAL;
+
+	if (pthread_mutex_init(&ctx.lock, NULL))
+		return -ENOMEM;
+
+	nthreads = count < PROBE_MAX_THREADS ? count : PROBE_MAX_THREADS;
+
+	/* Calling thread is one of the workers */
+	for (i = 1; i < nthreads; i++) {
+		if (pthread_create(&threads[started], NULL, probe_worker, &ctx))
+			break;
+		started++;
+	}
+
+	probe_worker(&ctx);
+
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	pthread_mutex_destroy(&ctx.lock);
+	return 0;
+}
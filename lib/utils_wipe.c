@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include "internal.h"
 
 /*
@@ -91,9 +92,67 @@ static int crypt_wipe_special(int fd, size_t bsize, size_t alignment, char *buff
 	return 0;
 }
 
+/*
+ * Wipe pattern generator for random and encrypted zero patterns.
+ * Instead of reading the whole wipe block from RNG every time, seed a throwaway
+ * AES-CTR key once; the CTR keystream - zeroes encrypted with that key -
+ * is then produced at cipher speed, counter is derived from device offset.
+ */
+#define WIPE_RNG_KEY_SIZE 32
+#define WIPE_RNG_IV_SIZE  16
+#define WIPE_RNG_CHUNK	  (64 * 1024)
+
+static int wipe_rng_init(struct crypt_cipher **rng)
+{
+	char key[WIPE_RNG_KEY_SIZE];
+	int r;
+
+	r = crypt_random_get(NULL, key, sizeof(key), CRYPT_RND_NORMAL);
+	if (r < 0)
+		return -EIO;
+
+	r = crypt_cipher_init(rng, "aes", "ctr", key, sizeof(key));
+	crypt_memzero(key, sizeof(key));
+	if (r < 0)
+		*rng = NULL;
+
+	return r;
+}
+
+static int wipe_rng_fill(struct crypt_cipher *rng, char *buffer, size_t size,
+			 uint64_t offset)
+{
+	char iv[WIPE_RNG_IV_SIZE] = {};
+	uint64_t counter;
+	size_t len;
+	int i, r;
+
+	memset(buffer, 0, size);
+
+	while (size) {
+		len = size > WIPE_RNG_CHUNK ? WIPE_RNG_CHUNK : size;
+
+		/* Big-endian block counter in the low half of IV */
+		counter = offset / WIPE_RNG_IV_SIZE;
+		for (i = 0; i < 8; i++)
+			iv[WIPE_RNG_IV_SIZE - 1 - i] = (char)(counter >> (8 * i));
+
+		r = crypt_cipher_encrypt(rng, buffer, buffer, len, iv, sizeof(iv));
+		if (r < 0)
+			return r;
+
+		buffer += len;
+		offset += len;
+		size -= len;
+	}
+
+	return 0;
+}
+
 static int wipe_block(int devfd, crypt_wipe_pattern pattern, char *sf,
 		      size_t device_block_size, size_t alignment,
-		      size_t wipe_block_size, uint64_t offset, bool *need_block_init)
+		      size_t wipe_block_size, uint64_t offset, bool *need_block_init,
+		      struct crypt_cipher *rng)
 {
 	int r;
 
@@ -106,14 +165,13 @@ static int wipe_block(int devfd, crypt_wipe_pattern pattern, char *sf,
 			memset(sf, 0, wipe_block_size);
 			*need_block_init = false;
 			r = 0;
-		} else if (pattern == CRYPT_WIPE_RANDOM) {
-			r = crypt_random_get(NULL, sf, wipe_block_size,
-					     CRYPT_RND_NORMAL) ? -EIO : 0;
-			*need_block_init = true;
-		} else if (pattern == CRYPT_WIPE_ENCRYPTED_ZERO) {
-			// FIXME
-			r = crypt_random_get(NULL, sf, wipe_block_size,
-					     CRYPT_RND_NORMAL) ? -EIO : 0;
+		} else if (pattern == CRYPT_WIPE_RANDOM ||
+			   pattern == CRYPT_WIPE_ENCRYPTED_ZERO) {
+			if (rng)
+				r = wipe_rng_fill(rng, sf, wipe_block_size, offset) ? -EIO : 0;
+			else
+				r = crypt_random_get(NULL, sf, wipe_block_size,
+						     CRYPT_RND_NORMAL) ? -EIO : 0;
 			*need_block_init = true;
 		} else
 			r = -EINVAL;
@@ -122,24 +180,251 @@ static int wipe_block(int devfd, crypt_wipe_pattern pattern, char *sf,
 			return r;
 	}
 
-	if (write_blockwise(devfd, device_block_size, alignment, sf,
-			    wipe_block_size) == (ssize_t)wipe_block_size)
+	if (write_lseek_blockwise(devfd, device_block_size, alignment, sf,
+			    wipe_block_size, offset) == (ssize_t)wipe_block_size)
 		return 0;
 
 	return -EIO;
 }
 
-int crypt_wipe_device(struct crypt_device *cd,
+/*
+ * Zero pattern offload, done in chunks so progress is still reported.
+ * On return offset points to the first byte not yet wiped.
+ */
+#define WIPE_ZEROOUT_CHUNK (128 * 1024 * 1024)
+
+static int wipe_zeroout(struct device *device, int devfd,
+	uint64_t *offset, uint64_t dev_size,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+	void *usrptr)
+{
+	uint64_t len;
+	int r;
+
+	while (*offset < dev_size) {
+		len = dev_size - *offset;
+		if (len > WIPE_ZEROOUT_CHUNK)
+			len = WIPE_ZEROOUT_CHUNK;
+
+		r = device_zeroout(device, devfd, *offset, len);
+		if (r < 0)
+			return r;
+
+		*offset += len;
+
+		if (progress && progress(dev_size, *offset, usrptr))
+			return -EINTR;
+	}
+
+	return 0;
+}
+
+/*
+ * Parallel wipe engine: several workers, each with its own fd and buffer,
+ * take wipe blocks in device order, keeping up to WIPE_IO_DEPTH writes
+ * in flight. The calling thread only reports progress of the completed
+ * prefix, so callbacks still see monotonic offsets.
+ */
+#define WIPE_IO_DEPTH 8
+
+struct wipe_engine {
+	struct device *device;
+	crypt_wipe_pattern pattern;
+	size_t bsize, alignment, wipe_block_size;
+
+	uint64_t next, end;
+	uint64_t busy[WIPE_IO_DEPTH];	/* offset being written or UINT64_MAX */
+	uint64_t error_offset;
+	unsigned running;
+	int r, stop;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+struct wipe_worker {
+	struct wipe_engine *e;
+	unsigned id;
+};
+
+static void *wipe_worker_thread(void *arg)
+{
+	struct wipe_worker *w = arg;
+	struct wipe_engine *e = w->e;
+	struct crypt_cipher *rng = NULL;
+	bool need_block_init = true;
+	char *sf = NULL;
+	uint64_t offset;
+	size_t len;
+	int devfd, r = 0;
+
+	devfd = device_open(e->device, O_RDWR);
+	if (devfd < 0)
+		r = -EIO;
+	else if (posix_memalign((void **)&sf, e->alignment, e->wipe_block_size))
+		r = -ENOMEM;
+	else if ((e->pattern == CRYPT_WIPE_RANDOM || e->pattern == CRYPT_WIPE_ENCRYPTED_ZERO))
+		(void)wipe_rng_init(&rng);
+
+	pthread_mutex_lock(&e->lock);
+	offset = e->next;
+	while (!r && !e->stop && e->next < e->end) {
+		offset = e->next;
+		len = e->end - offset;
+		if (len > e->wipe_block_size)
+			len = e->wipe_block_size;
+		e->next += len;
+		e->busy[w->id] = offset;
+		pthread_mutex_unlock(&e->lock);
+
+		r = wipe_block(devfd, e->pattern, sf, e->bsize, e->alignment,
+			       len, offset, &need_block_init, rng);
+
+		pthread_mutex_lock(&e->lock);
+		e->busy[w->id] = UINT64_MAX;
+		pthread_cond_broadcast(&e->cond);
+	}
+
+	if (r && (!e->r || offset < e->error_offset)) {
+		e->r = r;
+		e->error_offset = offset;
+	}
+	if (r)
+		e->stop = 1;
+	e->running--;
+	pthread_cond_broadcast(&e->cond);
+	pthread_mutex_unlock(&e->lock);
+
+	if (rng)
+		crypt_cipher_destroy(rng);
+	free(sf);
+	if (devfd >= 0)
+		device_close(e->device, devfd);
+	return NULL;
+}
+
+/* Everything below returned offset is wiped */
+static uint64_t wipe_engine_completed(const struct wipe_engine *e)
+{
+	uint64_t completed = e->next;
+	unsigned i;
+
+	for (i = 0; i < WIPE_IO_DEPTH; i++)
+		if (e->busy[i] < completed)
+			completed = e->busy[i];
+
+	if (e->r && e->error_offset < completed)
+		completed = e->error_offset;
+
+	return completed;
+}
+
+/* Returns -EAGAIN if no worker could be started */
+static int wipe_device_parallel(struct crypt_device *cd,
+	struct device *device,
+	crypt_wipe_pattern pattern,
+	size_t bsize, size_t alignment,
+	size_t wipe_block_size,
+	uint64_t *offset, uint64_t dev_size,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+	void *usrptr)
+{
+	struct wipe_engine e = {
+		.device = device, .pattern = pattern, .bsize = bsize,
+		.alignment = alignment, .wipe_block_size = wipe_block_size,
+		.next = *offset, .end = dev_size,
+	};
+	struct wipe_worker w[WIPE_IO_DEPTH];
+	pthread_t threads[WIPE_IO_DEPTH];
+	uint64_t completed, reported = *offset;
+	unsigned i, nthreads;
+	int r = 0;
+
+	for (i = 0; i < WIPE_IO_DEPTH; i++)
+		e.busy[i] = UINT64_MAX;
+
+	if (pthread_mutex_init(&e.lock, NULL))
+		return -EAGAIN;
+	if (pthread_cond_init(&e.cond, NULL)) {
+		pthread_mutex_destroy(&e.lock);
+		return -EAGAIN;
+	}
+
+	pthread_mutex_lock(&e.lock);
+	for (nthreads = 0; nthreads < WIPE_IO_DEPTH; nthreads++) {
+		w[nthreads].e = &e;
+		w[nthreads].id = nthreads;
+		e.running++;
+		if (pthread_create(&threads[nthreads], NULL, wipe_worker_thread, &w[nthreads])) {
+			e.running--;
+			break;
+		}
+	}
+
+	if (!nthreads) {
+		pthread_mutex_unlock(&e.lock);
+		r = -EAGAIN;
+		goto out;
+	}
+
+	log_dbg("Wiping device using %u parallel writers.", nthreads);
+
+	while (1) {
+		completed = wipe_engine_completed(&e);
+		while (e.running && completed == reported) {
+			pthread_cond_wait(&e.cond, &e.lock);
+			completed = wipe_engine_completed(&e);
+		}
+
+		if (completed == reported)
+			break;
+
+		reported = completed;
+		if (progress) {
+			pthread_mutex_unlock(&e.lock);
+			if (progress(dev_size, completed, usrptr) && !r)
+				r = -EINTR;
+			pthread_mutex_lock(&e.lock);
+			if (r)
+				e.stop = 1;
+		}
+	}
+	pthread_mutex_unlock(&e.lock);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	if (e.r) {
+		log_err(cd, "Device wipe error, offset %" PRIu64 ".", e.error_offset);
+		crypt_progress_io_error(cd, 0);
+		r = e.r;
+	}
+	*offset = reported;
+out:
+	pthread_cond_destroy(&e.cond);
+	pthread_mutex_destroy(&e.lock);
+	return r;
+}
+
+/*
+ * With CRYPT_WIPE_PARALLEL (initialization of dm-integrity tags through
+ * a temporary mapping) the kernel computes tags for every written block,
+ * so keep several writes in flight even on rotational device and do not
+ * use zero-out offload that is processed in one chunk at a time.
+ */
+static int wipe_device(struct crypt_device *cd,
 	struct device *device,
 	crypt_wipe_pattern pattern,
 	uint64_t offset,
 	uint64_t length,
 	size_t wipe_block_size,
+	uint32_t flags,
 	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
 	void *usrptr)
 {
 	int r, devfd = -1;
 	size_t bsize, alignment;
+	struct crypt_cipher *rng = NULL;
 	char *sf = NULL;
 	uint64_t dev_size;
 	bool need_block_init = true;
@@ -192,6 +477,36 @@ int crypt_wipe_device(struct crypt_device *cd,
 		pattern = CRYPT_WIPE_RANDOM;
 	}
 
+	if (pattern == CRYPT_WIPE_ZERO && !(flags & CRYPT_WIPE_PARALLEL)) {
+		r = wipe_zeroout(device, devfd, &offset, dev_size, progress, usrptr);
+		if (r == -EIO) {
+			log_err(cd, "Device wipe error, offset %" PRIu64 ".", offset);
+			crypt_progress_io_error(cd, 0);
+		}
+		if (r && r != -ENOTSUP)
+			goto sync;
+		if (r) {
+			log_dbg("Zero out offload not available, writing zeroes.");
+			crypt_progress_io_error(cd, 1);
+		}
+		r = 0;
+	}
+
+	if (pattern != CRYPT_WIPE_SPECIAL &&
+	    ((flags & CRYPT_WIPE_PARALLEL) || !device_is_rotational(device)) &&
+	    (dev_size - offset) > wipe_block_size) {
+		r = wipe_device_parallel(cd, device, pattern, bsize, alignment,
+					 wipe_block_size, &offset, dev_size,
+					 progress, usrptr);
+		if (r != -EAGAIN)
+			goto sync;
+		r = 0;
+	}
+
+	if ((pattern == CRYPT_WIPE_RANDOM || pattern == CRYPT_WIPE_ENCRYPTED_ZERO) &&
+	    wipe_rng_init(&rng) < 0)
+		log_dbg("Cannot initialize AES-CTR wipe generator, using RNG directly.");
+
 	while (offset < dev_size) {
 		if ((offset + wipe_block_size) > dev_size)
 			wipe_block_size = dev_size - offset;
@@ -199,9 +514,10 @@ int crypt_wipe_device(struct crypt_device *cd,
 		//log_dbg("Wipe %012" PRIu64 "-%012" PRIu64 " bytes", offset, offset + wipe_block_size);
 
 		r = wipe_block(devfd, pattern, sf, bsize, alignment,
-			       wipe_block_size, offset, &need_block_init);
+			       wipe_block_size, offset, &need_block_init, rng);
 		if (r) {
 			log_err(cd, "Device wipe error, offset %" PRIu64 ".", offset);
+			crypt_progress_io_error(cd, 0);
 			break;
 		}
 
@@ -212,14 +528,193 @@ int crypt_wipe_device(struct crypt_device *cd,
 			break;
 		}
 	}
-
+sync:
 	fsync(devfd);
 out:
-	close(devfd);
+	if (rng)
+		crypt_cipher_destroy(rng);
+	device_close(device, devfd);
+	free(sf);
+	return r;
+}
+
+int crypt_wipe_device(struct crypt_device *cd,
+	struct device *device,
+	crypt_wipe_pattern pattern,
+	uint64_t offset,
+	uint64_t length,
+	size_t wipe_block_size,
+	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
+	void *usrptr)
+{
+	return wipe_device(cd, device, pattern, offset, length,
+			   wipe_block_size, 0, progress, usrptr);
+}
+
+#define WIPE_AREAS_BLOCK (1024 * 1024)
+
+static int wipe_area_cmp(const void *a, const void *b)
+{
+	const struct crypt_wipe_area *a1 = a, *a2 = b;
+
+	if (a1->offset != a2->offset)
+		return a1->offset < a2->offset ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Wipe several device areas (keyslots) through one fd in offset order.
+ * Adjacent or overlapping areas are merged into one write run and
+ * the device is flushed only once at the end. Areas array is sorted.
+ */
+int crypt_wipe_device_areas(struct crypt_device *cd,
+	struct device *device,
+	crypt_wipe_pattern pattern,
+	struct crypt_wipe_area *areas,
+	unsigned count)
+{
+	struct crypt_cipher *rng = NULL;
+	bool need_block_init = true;
+	uint64_t offset, end, dev_size;
+	size_t bsize, alignment, len;
+	unsigned i, runs = 0;
+	char *sf = NULL;
+	int r, devfd;
+
+	if (!areas || !count)
+		return 0;
+
+	bsize = device_block_size(device);
+	alignment = device_alignment(device);
+	if (!bsize || !alignment)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++)
+		if ((areas[i].offset % SECTOR_SIZE) || (areas[i].length % SECTOR_SIZE) ||
+		    areas[i].offset + areas[i].length < areas[i].offset)
+			return -EINVAL;
+
+	qsort(areas, count, sizeof(*areas), wipe_area_cmp);
+
+	devfd = device_open(device, O_RDWR);
+	if (devfd < 0)
+		return errno ? -errno : -EINVAL;
+
+	r = device_size(device, &dev_size);
+	if (r)
+		goto out;
+
+	for (i = 0, end = 0; i < count; i++)
+		if (areas[i].offset + areas[i].length > end)
+			end = areas[i].offset + areas[i].length;
+	if (end > dev_size) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	if (posix_memalign((void **)&sf, alignment, WIPE_AREAS_BLOCK)) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	if (pattern == CRYPT_WIPE_SPECIAL && !device_is_rotational(device)) {
+		log_dbg("Non-rotational device, using random data wipe mode.");
+		pattern = CRYPT_WIPE_RANDOM;
+	}
+
+	if ((pattern == CRYPT_WIPE_RANDOM || pattern == CRYPT_WIPE_ENCRYPTED_ZERO) &&
+	    wipe_rng_init(&rng) < 0)
+		log_dbg("Cannot initialize AES-CTR wipe generator, using RNG directly.");
+
+	for (i = 0; i < count && !r; runs++) {
+		offset = areas[i].offset;
+		end = offset + areas[i].length;
+		for (i++; i < count && areas[i].offset <= end; i++)
+			if (areas[i].offset + areas[i].length > end)
+				end = areas[i].offset + areas[i].length;
+
+		log_dbg("Wipe area %012" PRIu64 "-%012" PRIu64 ".", offset, end);
+
+		while (offset < end && !r) {
+			len = end - offset > WIPE_AREAS_BLOCK ? WIPE_AREAS_BLOCK : (size_t)(end - offset);
+			r = wipe_block(devfd, pattern, sf, bsize, alignment, len,
+				       offset, &need_block_init, rng);
+			if (r)
+				log_err(cd, "Device wipe error, offset %" PRIu64 ".", offset);
+			offset += len;
+		}
+	}
+
+	log_dbg("Wiped %u areas in %u runs.", count, runs);
+
+	if (fsync(devfd) && !r)
+		r = -EIO;
+out:
+	if (rng)
+		crypt_cipher_destroy(rng);
+	device_close(device, devfd);
 	free(sf);
 	return r;
 }
 
+/*
+ * Initialize (zero) metadata area on format with the cheapest method
+ * the device offers: discard with zeroing semantics, write-zeroes offload,
+ * parallel zero writes on non-rotational device, or one sequential
+ * write run with a single flush. Used method is reported as verbose message.
+ */
+int crypt_wipe_device_init(struct crypt_device *cd,
+	struct device *device,
+	uint64_t offset,
+	uint64_t length)
+{
+	struct crypt_wipe_area area = { offset, length };
+	uint64_t pos, len, discarded = 0;
+	const char *method;
+	int r, devfd;
+
+	if (!length)
+		return 0;
+
+	if ((offset % SECTOR_SIZE) || (length % SECTOR_SIZE))
+		return -EINVAL;
+
+	devfd = device_open(device, O_RDWR);
+	if (devfd < 0)
+		return errno ? -errno : -EINVAL;
+
+	for (pos = offset, r = 0; pos < offset + length; pos += len) {
+		len = offset + length - pos;
+		if (len > WIPE_ZEROOUT_CHUNK)
+			len = WIPE_ZEROOUT_CHUNK;
+
+		r = device_zeroout(device, devfd, pos, len);
+		if (r < 0)
+			break;
+		if (r)
+			discarded += len;
+	}
+	device_close(device, devfd);
+
+	if (r >= 0)
+		method = discarded == length ? "discard" : "write zeroes offload";
+	else if (r != -ENOTSUP)
+		return r;
+	else if (!device_is_rotational(device)) {
+		method = "parallel zero writes";
+		r = wipe_device(cd, device, CRYPT_WIPE_ZERO, offset, length,
+				WIPE_AREAS_BLOCK, CRYPT_WIPE_PARALLEL, NULL, NULL);
+	} else {
+		method = "sequential zero writes";
+		r = crypt_wipe_device_areas(cd, device, CRYPT_WIPE_ZERO, &area, 1);
+	}
+
+	if (!r)
+		log_verbose(cd, _("Initialized %" PRIu64 " bytes of metadata area on device %s (%s)."),
+			    length, device_path(device), method);
+	return r;
+}
+
 int crypt_wipe(struct crypt_device *cd,
 	const char *dev_path,
 	crypt_wipe_pattern pattern,
@@ -230,6 +725,7 @@ int crypt_wipe(struct crypt_device *cd,
 	int (*progress)(uint64_t size, uint64_t offset, void *usrptr),
 	void *usrptr)
 {
+	struct crypt_progress_wrap pw = { cd, progress, usrptr };
 	struct device *device;
 	int r;
 
@@ -253,8 +749,9 @@ int crypt_wipe(struct crypt_device *cd,
 	log_dbg("Wipe [%u] device %s, offset %" PRIu64 ", length %" PRIu64 ", block %zu.",
 		(unsigned)pattern, device_path(device), offset, length, wipe_block_size);
 
-	r = crypt_wipe_device(cd, device, pattern, offset, length,
-			      wipe_block_size, progress, usrptr);
+	crypt_progress_start(cd, "wipe");
+	r = wipe_device(cd, device, pattern, offset, length, wipe_block_size, flags,
+			crypt_progress_wrapped, &pw);
 
 	if (dev_path)
 		device_free(device);
@@ -23,6 +23,8 @@
 #ifndef _LIBFEC_RS_H
 #define _LIBFEC_RS_H
 
+#include <stddef.h>
+
 /* Special reserved value encoding zero in index form. */
 #define A0 (rs->nn)
 
@@ -42,6 +44,7 @@ struct rs {
 	int prim;        /* Primitive element, index form */
 	int iprim;       /* prim-th root of 1, index form */
 	int pad;         /* Padding bytes in shortened block */
+	data_t *mul_tables;/* Genpoly nibble multiplication tables (vector encoder) */
 };
 
 static inline int modnn(struct rs *rs, int x)
@@ -58,6 +61,8 @@ void free_rs_char(struct rs *rs);
 
 /* General purpose RS codec, 8-bit symbols */
 void encode_rs_char(struct rs *rs, data_t *data, data_t *parity);
+void encode_rs_char_multi(struct rs *rs, const data_t *data, size_t stride,
+			  data_t *parity, size_t count);
 int decode_rs_char(struct rs *rs, data_t *data);
 
 #endif
@@ -25,6 +25,23 @@
 
 #include "rs.h"
 
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    ((defined(__GNUC__) && __GNUC__ >= 5) || defined(__clang__))
+#define RS_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+/* Vector encoder is used only for codes with up to this number of roots */
+#define RS_VEC_MAX_ROOTS 32
+
+/* Multiply two field elements in polynomial form */
+static data_t gf_mul(struct rs *rs, data_t a, data_t b)
+{
+	if (!a || !b)
+		return 0;
+	return rs->alpha_to[modnn(rs, rs->index_of[a] + rs->index_of[b])];
+}
+
 /* Initialize a Reed-Solomon codec
  * symsize = symbol size, bits
  * gfpoly = Field generator polynomial coefficients
@@ -124,6 +141,23 @@ struct rs *init_rs_char(int symsize, int gfpoly, int fcr, int prim, int nroots,
 		/* rs->genpoly[0] can never be zero */
 		rs->genpoly[0] = rs->alpha_to[modnn(rs, rs->index_of[rs->genpoly[0]] + root)];
 	}
+	/*
+	 * Multiplication tables for every genpoly coefficient c, split by nibble:
+	 * c * x = lo[x & 0x0f] ^ hi[x >> 4] (used by the vector encoder)
+	 */
+	if (symsize == 8 && nroots <= RS_VEC_MAX_ROOTS) {
+		rs->mul_tables = malloc(32 * (nroots + 1));
+		if (rs->mul_tables == NULL) {
+			free_rs_char(rs);
+			return NULL;
+		}
+		for (i = 0; i <= nroots; i++)
+			for (j = 0; j < 16; j++) {
+				rs->mul_tables[32 * i + j] = gf_mul(rs, rs->genpoly[i], j);
+				rs->mul_tables[32 * i + 16 + j] = gf_mul(rs, rs->genpoly[i], j << 4);
+			}
+	}
+
 	/* convert rs->genpoly[] to index form for quicker encoding */
 	for (i = 0; i <= nroots; i++)
 		rs->genpoly[i] = rs->index_of[rs->genpoly[i]];
@@ -139,6 +173,7 @@ void free_rs_char(struct rs *rs)
 	free(rs->alpha_to);
 	free(rs->index_of);
 	free(rs->genpoly);
+	free(rs->mul_tables);
 	free(rs);
 }
 
@@ -171,3 +206,101 @@ void encode_rs_char(struct rs *rs, data_t *data, data_t *parity)
 			parity[rs->nroots - 1] = 0;
 	}
 }
+
+#if RS_SIMD_X86
+/*
+ * Encode 16 (SSSE3) or 32 (AVX2) codewords at once, one codeword per byte lane.
+ * This is the LFSR of encode_rs_char() with genpoly in polynomial form:
+ * p[j - 1] = p[j] ^ fb * g[nroots - j], p[nroots - 1] = fb * g[0],
+ * GF multiplication by a constant is done by two nibble table lookups.
+ */
+__attribute__((target("ssse3")))
+static void encode_rs_char_ssse3(struct rs *rs, const data_t *data, size_t stride,
+				 data_t *parity)
+{
+	__m128i p[RS_VEC_MAX_ROOTS], fb, lo, hi, mask = _mm_set1_epi8(0x0f);
+	data_t out[16] __attribute__((aligned(16)));
+	const data_t *t;
+	int i, j, k;
+
+	for (j = 0; j < rs->nroots; j++)
+		p[j] = _mm_setzero_si128();
+
+	for (i = 0; i < rs->nn - rs->nroots - rs->pad; i++) {
+		fb = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&data[i * stride]), p[0]);
+		lo = _mm_and_si128(fb, mask);
+		hi = _mm_and_si128(_mm_srli_epi64(fb, 4), mask);
+		for (j = 1; j <= rs->nroots; j++) {
+			t = &rs->mul_tables[32 * (rs->nroots - j)];
+			fb = _mm_xor_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)t), lo),
+					   _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(t + 16)), hi));
+			p[j - 1] = j < rs->nroots ? _mm_xor_si128(p[j], fb) : fb;
+		}
+	}
+
+	for (j = 0; j < rs->nroots; j++) {
+		_mm_store_si128((__m128i *)out, p[j]);
+		for (k = 0; k < 16; k++)
+			parity[k * rs->nroots + j] = out[k];
+	}
+}
+
+__attribute__((target("avx2")))
+static void encode_rs_char_avx2(struct rs *rs, const data_t *data, size_t stride,
+				data_t *parity)
+{
+	__m256i p[RS_VEC_MAX_ROOTS], fb, lo, hi, mask = _mm256_set1_epi8(0x0f);
+	data_t out[32] __attribute__((aligned(32)));
+	const data_t *t;
+	int i, j, k;
+
+	for (j = 0; j < rs->nroots; j++)
+		p[j] = _mm256_setzero_si256();
+
+	for (i = 0; i < rs->nn - rs->nroots - rs->pad; i++) {
+		fb = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&data[i * stride]), p[0]);
+		lo = _mm256_and_si256(fb, mask);
+		hi = _mm256_and_si256(_mm256_srli_epi64(fb, 4), mask);
+		for (j = 1; j <= rs->nroots; j++) {
+			t = &rs->mul_tables[32 * (rs->nroots - j)];
+			fb = _mm256_xor_si256(
+				_mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)t)), lo),
+				_mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(t + 16))), hi));
+			p[j - 1] = j < rs->nroots ? _mm256_xor_si256(p[j], fb) : fb;
+		}
+	}
+
+	for (j = 0; j < rs->nroots; j++) {
+		_mm256_store_si256((__m256i *)out, p[j]);
+		for (k = 0; k < 32; k++)
+			parity[k * rs->nroots + j] = out[k];
+	}
+}
+#endif
+
+/*
+ * Encode count codewords stored interleaved: symbol i of codeword k is stored
+ * at data[i * stride + k]. Parity of codeword k is written to parity[k * nroots].
+ */
+void encode_rs_char_multi(struct rs *rs, const data_t *data, size_t stride,
+			  data_t *parity, size_t count)
+{
+	data_t block[256];
+	size_t k = 0;
+	int i;
+
+#if RS_SIMD_X86
+	if (rs->mul_tables && __builtin_cpu_supports("avx2"))
+		for (; count - k >= 32; k += 32)
+			encode_rs_char_avx2(rs, &data[k], stride, &parity[k * rs->nroots]);
+
+	if (rs->mul_tables && __builtin_cpu_supports("ssse3"))
+		for (; count - k >= 16; k += 16)
+			encode_rs_char_ssse3(rs, &data[k], stride, &parity[k * rs->nroots]);
+#endif
+	for (; k < count; k++) {
+		for (i = 0; i < rs->nn - rs->nroots - rs->pad; i++)
+			block[i] = data[i * stride + k];
+		encode_rs_char(rs, block, &parity[k * rs->nroots]);
+	}
+}
@@ -33,24 +33,6 @@
 #include "verity.h"
 #include "internal.h"
 
-#define VERITY_SIGNATURE "verity\0\0"
-
-/* https://gitlab.com/cryptsetup/cryptsetup/wikis/DMVerity#verity-superblock-format */
-struct verity_sb {
-	uint8_t  signature[8];	/* "verity\0\0" */
-	uint32_t version;	/* superblock version */
-	uint32_t hash_type;	/* 0 - Chrome OS, 1 - normal */
-	uint8_t  uuid[16];	/* UUID of hash device */
-	uint8_t  algorithm[32];/* hash algorithm name */
-	uint32_t data_block_size; /* data block in bytes */
-	uint32_t hash_block_size; /* hash block in bytes */
-	uint64_t data_blocks;	/* number of data blocks */
-	uint16_t salt_size;	/* salt size */
-	uint8_t  _pad1[6];
-	uint8_t  salt[256];	/* salt */
-	uint8_t  _pad2[168];
-} __attribute__((packed));
-
 /* Read verity superblock from disk */
 int VERITY_read_sb(struct crypt_device *cd,
 		   uint64_t sb_offset,
@@ -85,10 +67,10 @@ int VERITY_read_sb(struct crypt_device *cd,
 	if (read_lseek_blockwise(devfd, device_block_size(device),
 				 device_alignment(device), &sb, hdr_size,
 				 sb_offset) < hdr_size) {
-		close(devfd);
+		device_close(device, devfd);
 		return -EIO;
 	}
-	close(devfd);
+	device_close(device, devfd);
 
 	if (memcmp(sb.signature, VERITY_SIGNATURE, sizeof(sb.signature))) {
 		log_err(cd, _("Device %s is not a valid VERITY device."),
@@ -201,7 +183,7 @@ int VERITY_write_sb(struct crypt_device *cd,
 	if (r)
 		log_err(cd, _("Error during update of verity header on device %s."),
 			device_path(device));
-	close(devfd);
+	device_close(device, devfd);
 
 	return r;
 }
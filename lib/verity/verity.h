@@ -27,8 +27,27 @@
 #define VERITY_BLOCK_SIZE_OK(x)	((x) % 512 || (x) < 512 || \
 				(x) > (512 * 1024) || (x) & ((x)-1))
 
+#define VERITY_SIGNATURE "verity\0\0"
+
+/* https://gitlab.com/cryptsetup/cryptsetup/wikis/DMVerity#verity-superblock-format */
+struct verity_sb {
+	uint8_t  signature[8];	/* "verity\0\0" */
+	uint32_t version;	/* superblock version */
+	uint32_t hash_type;	/* 0 - Chrome OS, 1 - normal */
+	uint8_t  uuid[16];	/* UUID of hash device */
+	uint8_t  algorithm[32];/* hash algorithm name */
+	uint32_t data_block_size; /* data block in bytes */
+	uint32_t hash_block_size; /* hash block in bytes */
+	uint64_t data_blocks;	/* number of data blocks */
+	uint16_t salt_size;	/* salt size */
+	uint8_t  _pad1[6];
+	uint8_t  salt[256];	/* salt */
+	uint8_t  _pad2[168];
+} __attribute__((packed));
+
 struct crypt_device;
 struct crypt_params_verity;
+struct crypt_verity_range;
 struct device;
 
 int VERITY_read_sb(struct crypt_device *cd,
@@ -54,17 +73,69 @@ int VERITY_verify(struct crypt_device *cd,
 		const char *root_hash,
 		size_t root_hash_size);
 
+int VERITY_verify_repair(struct crypt_device *cd,
+			 struct crypt_params_verity *verity_hdr,
+			 struct device *fec_device,
+			 const char *root_hash,
+			 size_t root_hash_size,
+			 uint64_t *repaired,
+			 uint64_t *unrecoverable);
+
 int VERITY_create(struct crypt_device *cd,
 		  struct crypt_params_verity *verity_hdr,
 		  char *root_hash,
 		  size_t root_hash_size);
 
+int VERITY_update(struct crypt_device *cd,
+		  struct crypt_params_verity *verity_hdr,
+		  const struct crypt_verity_range *ranges,
+		  size_t count,
+		  char *root_hash,
+		  size_t root_hash_size,
+		  struct crypt_verity_range **fec_blocks,
+		  size_t *fec_count);
+
+int VERITY_preload(struct crypt_device *cd,
+		   struct crypt_params_verity *verity_hdr,
+		   const char *name,
+		   const char *root_hash,
+		   size_t root_hash_size,
+		   unsigned leaf_percent,
+		   int verify);
+
+size_t VERITY_ranges_merge(struct crypt_verity_range *ranges, size_t count);
+
 int VERITY_FEC_process(struct crypt_device *cd,
 		      struct crypt_params_verity *params,
 		      struct device *fec_device,
 		      int check_fec,
 		      unsigned int *errors);
 
+int VERITY_FEC_update(struct crypt_device *cd,
+		      struct crypt_params_verity *params,
+		      struct device *fec_device,
+		      const struct crypt_verity_range *blocks,
+		      size_t count);
+
+int VERITY_FEC_repair(struct crypt_device *cd,
+		      struct crypt_params_verity *params,
+		      struct device *fec_device,
+		      const struct crypt_verity_range *blocks,
+		      size_t count,
+		      unsigned int *errors);
+
+int VERITY_benchmark(struct crypt_device *cd,
+		     const char *hash_name,
+		     int version,
+		     size_t block_size,
+		     size_t salt_size,
+		     unsigned threads,
+		     int tree,
+		     double *mbs);
+
+int VERITY_FEC_benchmark(uint32_t roots, unsigned threads,
+			 double *encode_mbs, double *decode_mbs);
+
 uint64_t VERITY_hash_offset_block(struct crypt_params_verity *params);
 
 uint64_t VERITY_hash_blocks(struct crypt_device *cd, struct crypt_params_verity *params);
@@ -22,6 +22,8 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "verity.h"
 #include "internal.h"
@@ -34,6 +36,9 @@
 
 #define FEC_INPUT_DEVICES 2
 
+/* input read per worker and chunk of rounds */
+#define FEC_IO_BUFFER (4 * 1024 * 1024)
+
 /* parameters to init_rs_char */
 #define FEC_PARAMS(roots) \
     8,          /* symbol size in bits */ \
@@ -45,7 +50,6 @@
 
 struct fec_input_device {
 	struct device *device;
-	int fd;
 	uint64_t start;
 	uint64_t count;
 };
@@ -56,6 +60,7 @@ struct fec_context {
 	uint64_t size;
 	uint64_t blocks;
 	uint64_t rounds;
+	uint64_t chunk_rounds;
 	uint32_t block_size;
 	struct fec_input_device *inputs;
 	size_t ninputs;
@@ -74,50 +79,287 @@ static inline uint64_t FEC_interleave(struct fec_context *ctx, uint64_t offset)
 			(offset % ctx->rsn) * ctx->rounds * ctx->block_size;
 }
 
-/* returns data for a byte at the specified RS offset */
-static int FEC_read_interleaved(struct fec_context *ctx, uint64_t i,
-				void *output, size_t count)
+/* reads data at the specified physical offset (spanning input devices) */
+static int FEC_read_range(struct fec_context *ctx, const int *fds, uint64_t offset,
+			  uint8_t *output, size_t count)
 {
-	size_t n;
-	uint64_t offset = FEC_interleave(ctx, i);
+	size_t n, len;
+	uint64_t dev_offset;
+
+	while (count) {
+		/* offsets outside input area are assumed to contain zeros */
+		if (offset >= ctx->size) {
+			memset(output, 0, count);
+			return 0;
+		}
 
-	/* offsets outside input area are assumed to contain zeros */
-	if (offset >= ctx->size) {
-		memset(output, 0, count);
-		return 0;
+		/* find the correct input device and read from it */
+		dev_offset = offset;
+		for (n = 0; n < ctx->ninputs; ++n) {
+			if (dev_offset < ctx->inputs[n].count)
+				break;
+			dev_offset -= ctx->inputs[n].count;
+		}
+
+		/* should never be reached */
+		if (n == ctx->ninputs)
+			return -1;
+
+		len = count;
+		if (len > ctx->inputs[n].count - dev_offset)
+			len = ctx->inputs[n].count - dev_offset;
+
+		if (read_buffer_at(fds[n], output, len,
+				   ctx->inputs[n].start + dev_offset) != (ssize_t)len)
+			return -1;
+
+		output += len;
+		offset += len;
+		count -= len;
 	}
 
-	/* find the correct input device and read from it */
-	for (n = 0; n < ctx->ninputs; ++n) {
-		if (offset >= ctx->inputs[n].count) {
-			offset -= ctx->inputs[n].count;
-			continue;
+	return 0;
+}
+
+/* writes repaired data at the specified physical offset (spanning input devices) */
+static int FEC_write_range(struct fec_context *ctx, const int *fds, uint64_t offset,
+			   const uint8_t *input, size_t count)
+{
+	size_t n, len;
+	uint64_t dev_offset;
+
+	while (count) {
+		/* zeros outside input area are not stored anywhere */
+		if (offset >= ctx->size)
+			return 0;
+
+		dev_offset = offset;
+		for (n = 0; n < ctx->ninputs; ++n) {
+			if (dev_offset < ctx->inputs[n].count)
+				break;
+			dev_offset -= ctx->inputs[n].count;
 		}
 
-		/* FIXME: read_lseek_blockwise candidate */
-		if (lseek(ctx->inputs[n].fd, ctx->inputs[n].start + offset, SEEK_SET) < 0)
+		if (n == ctx->ninputs)
+			return -1;
+
+		len = count;
+		if (len > ctx->inputs[n].count - dev_offset)
+			len = ctx->inputs[n].count - dev_offset;
+
+		if (write_buffer_at(fds[n], input, len,
+				    ctx->inputs[n].start + dev_offset) != (ssize_t)len)
 			return -1;
-		return (read_buffer(ctx->inputs[n].fd, output, count) == (ssize_t)count) ? 0 : -1;
+
+		input += len;
+		offset += len;
+		count -= len;
+	}
+
+	return 0;
+}
+
+enum fec_fail { FEC_FAIL_NONE = 0, FEC_FAIL_READ, FEC_FAIL_READ_PARITY,
+		FEC_FAIL_REPAIR, FEC_FAIL_WRITE, FEC_FAIL_WRITE_DATA };
+
+/*
+ * Worker processing rounds <round_start, round_end) in chunks of ctx->chunk_rounds;
+ * worker k owns chunks k, k + nworkers, ... so the input is read roughly sequentially.
+ * Byte i of RS block of round n is stored at FEC_interleave(n * rsn * block_size + i),
+ * so for consecutive rounds each of the rsn input columns is a single contiguous read.
+ */
+struct fec_worker {
+	struct fec_context *ctx;
+	void *rs;
+	int decode;
+	int repair;
+	int fds[FEC_INPUT_DEVICES];
+	int fd;
+	uint64_t fec_offset;
+	uint64_t first_chunk;
+	unsigned int nworkers;
+	uint64_t round_start, round_end;
+	pthread_t thread;
+
+	int r;
+	unsigned int errors;
+	enum fec_fail fail;
+	uint64_t fail_round;
+	unsigned int fail_byte;
+};
+
+static int FEC_process_chunks(struct fec_worker *w)
+{
+	struct fec_context *ctx = w->ctx;
+	uint64_t chunk, n, rounds, offset;
+	size_t col_size, parity_size, b;
+	uint8_t rs_block[FEC_RSM], dirty[FEC_RSM];
+	uint8_t *buf, *parity;
+	unsigned int i;
+	int r = 0;
+
+	col_size = (size_t)ctx->block_size * ctx->chunk_rounds;
+	buf = malloc(col_size * ctx->rsn);
+	parity = malloc(col_size * ctx->roots);
+	if (!buf || !parity) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (chunk = w->first_chunk; w->round_start + chunk * ctx->chunk_rounds < w->round_end;
+	     chunk += w->nworkers) {
+		n = w->round_start + chunk * ctx->chunk_rounds;
+		rounds = w->round_end - n;
+		if (rounds > ctx->chunk_rounds)
+			rounds = ctx->chunk_rounds;
+		col_size = (size_t)rounds * ctx->block_size;
+		parity_size = col_size * ctx->roots;
+
+		for (i = 0; i < ctx->rsn; ++i) {
+			if (FEC_read_range(ctx, w->fds, FEC_interleave(ctx, n * ctx->rsn * ctx->block_size + i),
+					   &buf[i * col_size], col_size)) {
+				w->fail = FEC_FAIL_READ;
+				w->fail_round = n;
+				w->fail_byte = i;
+				r = -EIO;
+				goto out;
+			}
+		}
+
+		offset = w->fec_offset + n * ctx->block_size * ctx->roots;
+		if (lseek(w->fd, offset, SEEK_SET) < 0) {
+			log_dbg("Cannot seek to requested position in FEC device.");
+			w->fail = w->decode ? FEC_FAIL_READ_PARITY : FEC_FAIL_WRITE;
+			w->fail_round = n;
+			r = -EIO;
+			goto out;
+		}
+
+		if (w->decode && read_buffer(w->fd, parity, parity_size) != (ssize_t)parity_size) {
+			w->fail = FEC_FAIL_READ_PARITY;
+			w->fail_round = n;
+			r = -EIO;
+			goto out;
+		}
+
+		if (!w->decode) {
+			/* encoding parity data for fec device, columns are interleaved codewords */
+			encode_rs_char_multi(w->rs, buf, col_size, parity, col_size);
+		}
+
+		/* decoding from parity device */
+		memset(dirty, 0, sizeof(dirty));
+		for (b = 0; w->decode && b < col_size; ++b) {
+			for (i = 0; i < ctx->rsn; ++i)
+				rs_block[i] = buf[i * col_size + b];
+			memcpy(&rs_block[ctx->rsn], &parity[b * ctx->roots], ctx->roots);
+
+			/* coverity[tainted_data] */
+			r = decode_rs_char(w->rs, rs_block);
+			if (r < 0) {
+				w->fail = FEC_FAIL_REPAIR;
+				w->fail_round = n + b / ctx->block_size;
+				goto out;
+			}
+			/* return number of detected errors */
+			w->errors += r;
+
+			/* keep corrected symbols for write back */
+			for (i = 0; r && w->repair && i < ctx->rsn; ++i)
+				if (buf[i * col_size + b] != rs_block[i]) {
+					buf[i * col_size + b] = rs_block[i];
+					dirty[i] = 1;
+				}
+			r = 0;
+		}
+
+		for (i = 0; w->repair && i < ctx->rsn; ++i) {
+			if (!dirty[i])
+				continue;
+			if (FEC_write_range(ctx, w->fds, FEC_interleave(ctx, n * ctx->rsn * ctx->block_size + i),
+					    &buf[i * col_size], col_size)) {
+				w->fail = FEC_FAIL_WRITE_DATA;
+				w->fail_round = n;
+				w->fail_byte = i;
+				r = -EIO;
+				goto out;
+			}
+		}
+
+		if (!w->decode && write_buffer(w->fd, parity, parity_size) != (ssize_t)parity_size) {
+			w->fail = FEC_FAIL_WRITE;
+			w->fail_round = n;
+			r = -EIO;
+			goto out;
+		}
+	}
+out:
+	free(buf);
+	free(parity);
+	return r;
+}
+
+static void *FEC_process_thread(void *arg)
+{
+	struct fec_worker *w = arg;
+
+	w->r = FEC_process_chunks(w);
+	return NULL;
+}
+
+/*
+ * Input block p is stored in column p / rounds of round p % rounds,
+ * so a range of changed blocks maps to (at most two) ranges of rounds.
+ */
+static size_t FEC_blocks_to_rounds(struct fec_context *ctx,
+				   const struct crypt_verity_range *blocks, size_t count,
+				   struct crypt_verity_range *rounds)
+{
+	uint64_t first, last;
+	size_t i, n = 0;
+
+	for (i = 0; i < count; i++) {
+		if (blocks[i].length >= ctx->rounds) {
+			rounds[0].offset = 0;
+			rounds[0].length = ctx->rounds;
+			return 1;
+		}
+		first = blocks[i].offset % ctx->rounds;
+		last = (blocks[i].offset + blocks[i].length - 1) % ctx->rounds;
+		if (first <= last) {
+			rounds[n].offset = first;
+			rounds[n++].length = last - first + 1;
+		} else {
+			rounds[n].offset = 0;
+			rounds[n++].length = last + 1;
+			rounds[n].offset = first;
+			rounds[n++].length = ctx->rounds - first;
+		}
 	}
 
-	/* should never be reached */
-	return -1;
+	return VERITY_ranges_merge(rounds, n);
 }
 
-/* encodes/decode inputs to/from fd */
+/*
+ * encodes/decode inputs to/from fec device,
+ * if blocks are set, only RS rounds covering these input blocks are encoded,
+ * or decoded and corrected input symbols are written back (repair)
+ */
 static int FEC_process_inputs(struct crypt_device *cd,
 			      struct crypt_params_verity *params,
 			      struct fec_input_device *inputs,
-			      size_t ninputs, int fd,
-			      int decode, unsigned int *errors)
+			      size_t ninputs, struct device *fec_device,
+			      int decode, unsigned int *errors,
+			      const struct crypt_verity_range *blocks,
+			      size_t nblocks)
 {
 	int r = 0;
-	unsigned int i;
+	unsigned int i, t, nworkers, started;
 	struct fec_context ctx;
-	uint32_t b;
-	uint64_t n;
-	uint8_t rs_block[FEC_RSM];
-	uint8_t *buf = NULL;
+	struct fec_worker *workers = NULL;
+	struct crypt_verity_range *rounds = NULL;
+	uint64_t n, chunks;
+	size_t nrounds = 0;
 	void *rs;
 
 	/* initialize parameters */
@@ -142,79 +384,164 @@ static int FEC_process_inputs(struct crypt_device *cd,
 	ctx.blocks = FEC_div_round_up(ctx.size, ctx.block_size);
 	ctx.rounds = FEC_div_round_up(ctx.blocks, ctx.rsn);
 
-	buf = malloc((size_t)ctx.block_size * ctx.rsn);
-	if (!buf) {
+	ctx.chunk_rounds = FEC_IO_BUFFER / ((uint64_t)ctx.block_size * ctx.rsn);
+	if (!ctx.chunk_rounds)
+		ctx.chunk_rounds = 1;
+	chunks = FEC_div_round_up(ctx.rounds, ctx.chunk_rounds);
+
+	nworkers = crypt_get_verity_threads(cd) ?: 1;
+	if (nworkers > chunks)
+		nworkers = chunks ?: 1;
+
+	for (n = 0; n < nblocks; n++)
+		if (blocks[n].offset >= ctx.blocks ||
+		    blocks[n].length > ctx.blocks - blocks[n].offset) {
+			log_err(cd, _("Block range %" PRIu64 "-%" PRIu64 " is outside of FEC area."),
+				blocks[n].offset, blocks[n].offset + blocks[n].length);
+			r = -EINVAL;
+			goto out;
+		}
+
+	if (blocks && ctx.rounds) {
+		rounds = malloc(2 * nblocks * sizeof(*rounds));
+		if (!rounds) {
+			log_err(cd, _("Failed to allocate buffer."));
+			r = -ENOMEM;
+			goto out;
+		}
+		nrounds = FEC_blocks_to_rounds(&ctx, blocks, nblocks, rounds);
+		nworkers = 1;
+		log_dbg("Updating parity of %zu RS round ranges.", nrounds);
+	}
+
+	workers = calloc(nworkers, sizeof(*workers));
+	if (!workers) {
 		log_err(cd, _("Failed to allocate buffer."));
 		r = -ENOMEM;
 		goto out;
 	}
 
-	/* encode/decode input */
-	for (n = 0; n < ctx.rounds; ++n) {
-		for (i = 0; i < ctx.rsn; ++i) {
-			if (FEC_read_interleaved(&ctx, n * ctx.rsn * ctx.block_size + i,
-						 &buf[i * ctx.block_size], ctx.block_size)) {
-				log_err(cd, _("Failed to read RS block %" PRIu64 " byte %d."), n, i);
+	for (t = 0; t < nworkers; t++) {
+		workers[t].ctx = &ctx;
+		workers[t].rs = rs;
+		workers[t].decode = decode;
+		workers[t].repair = decode && blocks;
+		workers[t].fec_offset = params->fec_area_offset;
+		workers[t].first_chunk = t;
+		workers[t].nworkers = nworkers;
+		workers[t].round_start = 0;
+		workers[t].round_end = ctx.rounds;
+		workers[t].fd = -1;
+		for (i = 0; i < FEC_INPUT_DEVICES; i++)
+			workers[t].fds[i] = -1;
+
+		workers[t].fd = open(device_path(fec_device), decode ? O_RDONLY : O_RDWR);
+		if (workers[t].fd == -1) {
+			log_err(cd, _("Cannot open device %s."), device_path(fec_device));
+			r = -EIO;
+			goto out;
+		}
+
+		for (i = 0; i < ninputs; i++) {
+			workers[t].fds[i] = open(device_path(inputs[i].device),
+						 workers[t].repair ? O_RDWR : O_RDONLY);
+			if (workers[t].fds[i] == -1) {
+				log_err(cd, _("Cannot open device %s."), device_path(inputs[i].device));
 				r = -EIO;
 				goto out;
 			}
 		}
+	}
 
-		for (b = 0; b < ctx.block_size; ++b) {
-			for (i = 0; i < ctx.rsn; ++i)
-				rs_block[i] = buf[i * ctx.block_size + b];
-
-			/* decoding from parity device */
-			if (decode) {
-				if (read_buffer(fd, &rs_block[ctx.rsn], ctx.roots) != ctx.roots) {
-					log_err(cd, _("Failed to read parity for RS block %" PRIu64 "."), n);
-					r = -EIO;
-					goto out;
-				}
-
-				/* coverity[tainted_data] */
-				r = decode_rs_char(rs, rs_block);
-				if (r < 0) {
-					log_err(cd, _("Failed to repair parity for block %" PRIu64 "."), n);
-					goto out;
-				}
-				/* return number of detected errors */
-				if (errors)
-					*errors += r;
-				r = 0;
-			} else {
-				/* encoding and writing parity data to fec device */
-				encode_rs_char(rs, rs_block, &rs_block[ctx.rsn]);
-				if (write_buffer(fd, &rs_block[ctx.rsn], ctx.roots) != ctx.roots) {
-					log_err(cd, _("Failed to write parity for RS block %" PRIu64 "."), n);
-					r = -EIO;
-					goto out;
-				}
+	if (blocks) {
+		for (n = 0; n < nrounds && !workers[0].r; n++) {
+			workers[0].round_start = rounds[n].offset;
+			workers[0].round_end = rounds[n].offset + rounds[n].length;
+			workers[0].r = FEC_process_chunks(&workers[0]);
+		}
+	} else if (nworkers == 1)
+		workers[0].r = FEC_process_chunks(&workers[0]);
+	else {
+		log_dbg("Processing %" PRIu64 " RS rounds using %u threads.", ctx.rounds, nworkers);
+		for (started = 0; started < nworkers; started++)
+			if (pthread_create(&workers[started].thread, NULL,
+					   FEC_process_thread, &workers[started])) {
+				r = -ENOMEM;
+				break;
 			}
+		for (t = 0; t < started; t++)
+			pthread_join(workers[t].thread, NULL);
+		if (r)
+			goto out;
+	}
+
+	for (t = 0; t < nworkers; t++) {
+		if (errors)
+			*errors += workers[t].errors;
+		if (!r)
+			r = workers[t].r;
+
+		switch (workers[t].fail) {
+		case FEC_FAIL_READ:
+			log_err(cd, _("Failed to read RS block %" PRIu64 " byte %d."),
+				workers[t].fail_round, workers[t].fail_byte);
+			break;
+		case FEC_FAIL_READ_PARITY:
+			log_err(cd, _("Failed to read parity for RS block %" PRIu64 "."),
+				workers[t].fail_round);
+			break;
+		case FEC_FAIL_REPAIR:
+			log_err(cd, _("Failed to repair parity for block %" PRIu64 "."),
+				workers[t].fail_round);
+			break;
+		case FEC_FAIL_WRITE:
+			log_err(cd, _("Failed to write parity for RS block %" PRIu64 "."),
+				workers[t].fail_round);
+			break;
+		case FEC_FAIL_WRITE_DATA:
+			log_err(cd, _("Failed to write repaired RS block %" PRIu64 " byte %d."),
+				workers[t].fail_round, workers[t].fail_byte);
+			break;
+		case FEC_FAIL_NONE:
+			if (workers[t].r == -ENOMEM)
+				log_err(cd, _("Failed to allocate buffer."));
+			break;
 		}
 	}
 out:
+	if (workers) {
+		for (t = 0; t < nworkers; t++) {
+			for (i = 0; i < FEC_INPUT_DEVICES; i++)
+				if (workers[t].fds[i] != -1) {
+					if (workers[t].repair)
+						fsync(workers[t].fds[i]);
+					close(workers[t].fds[i]);
+				}
+			if (workers[t].fd != -1)
+				close(workers[t].fd);
+		}
+	}
+	free(workers);
+	free(rounds);
 	free_rs_char(rs);
-	free(buf);
 	return r;
 }
 
-int VERITY_FEC_process(struct crypt_device *cd,
-		      struct crypt_params_verity *params,
-		      struct device *fec_device, int check_fec,
-		      unsigned int *errors)
+static int FEC_process(struct crypt_device *cd,
+		       struct crypt_params_verity *params,
+		       struct device *fec_device, int check_fec,
+		       unsigned int *errors,
+		       const struct crypt_verity_range *blocks,
+		       size_t nblocks)
 {
 	int r;
-	int fd = -1;
 	struct fec_input_device inputs[FEC_INPUT_DEVICES] = {
 		{
 			.device = crypt_data_device(cd),
-			.fd = -1,
 			.start = 0,
 			.count =  params->data_size * params->data_block_size
 		},{
 			.device = crypt_metadata_device(cd),
-			.fd = -1,
 			.start = VERITY_hash_offset_block(params) * params->data_block_size
 		}
 	};
@@ -231,52 +558,180 @@ int VERITY_FEC_process(struct crypt_device *cd,
 		return -EINVAL;
 	}
 
-	r = -EIO;
-
-	if (check_fec)
-		fd = open(device_path(fec_device), O_RDONLY);
-	else
-		fd = open(device_path(fec_device), O_RDWR);
-
-	if (fd == -1) {
-		log_err(cd, _("Cannot open device %s."), device_path(fec_device));
-		goto out;
-	}
-
-	if (lseek(fd, params->fec_area_offset, SEEK_SET) < 0) {
-		log_dbg("Cannot seek to requested position in FEC device.");
-		goto out;
-	}
-
-	/* input devices */
-	inputs[0].fd = open(device_path(inputs[0].device), O_RDONLY);
-	if (inputs[0].fd == -1) {
-		log_err(cd, _("Cannot open device %s."), device_path(inputs[0].device));
-		goto out;
-	}
-	inputs[1].fd = open(device_path(inputs[1].device), O_RDONLY);
-	if (inputs[1].fd == -1) {
-		log_err(cd, _("Cannot open device %s."), device_path(inputs[1].device));
-		goto out;
-	}
-
 	/* cover the entire hash device starting from hash_offset */
 	r = device_size(inputs[1].device, &inputs[1].count);
 	if (r) {
 		log_err(cd, _("Failed to determine size for device %s."),
 				device_path(inputs[1].device));
-		goto out;
+		return r;
 	}
 	inputs[1].count -= inputs[1].start;
 
-	r = FEC_process_inputs(cd, params, inputs, FEC_INPUT_DEVICES, fd, check_fec, errors);
+	return FEC_process_inputs(cd, params, inputs, FEC_INPUT_DEVICES, fec_device,
+				  check_fec, errors, blocks, nblocks);
+}
+
+int VERITY_FEC_process(struct crypt_device *cd,
+		      struct crypt_params_verity *params,
+		      struct device *fec_device, int check_fec,
+		      unsigned int *errors)
+{
+	return FEC_process(cd, params, fec_device, check_fec, errors, NULL, 0);
+}
+
+/* Re-encode parity only for RS rounds covering changed blocks (in FEC input space) */
+int VERITY_FEC_update(struct crypt_device *cd,
+		      struct crypt_params_verity *params,
+		      struct device *fec_device,
+		      const struct crypt_verity_range *blocks,
+		      size_t count)
+{
+	if (!blocks || !count)
+		return 0;
+
+	return FEC_process(cd, params, fec_device, 0, NULL, blocks, count);
+}
+
+/* Decode only RS rounds covering corrupted blocks and write corrected symbols back */
+int VERITY_FEC_repair(struct crypt_device *cd,
+		      struct crypt_params_verity *params,
+		      struct device *fec_device,
+		      const struct crypt_verity_range *blocks,
+		      size_t count,
+		      unsigned int *errors)
+{
+	if (!blocks || !count)
+		return -EINVAL;
+
+	return FEC_process(cd, params, fec_device, 1, errors, blocks, count);
+}
+
+/*
+ * In-memory RS benchmark: chunks of rsn columns are encoded as in FEC_process_chunks,
+ * decoding corrects one corrupted symbol in every codeword.
+ */
+#define FEC_BENCH_COLUMN	(64 * 1024)
+#define FEC_BENCH_TIME_MS	500
+
+struct fec_bench {
+	uint32_t roots;
+	pthread_t thread;
+	double encode_mbs, decode_mbs;
+	int r;
+};
+
+static double FEC_bench_time_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0.0;
+
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / (1000.0 * 1000);
+}
+
+static int FEC_bench_run(struct fec_bench *b)
+{
+	uint32_t rsn = FEC_RSM - b->roots;
+	size_t data_size = (size_t)rsn * FEC_BENCH_COLUMN, i, k;
+	uint8_t rs_block[FEC_RSM], *buf, *parity;
+	double start, ms;
+	uint64_t bytes;
+	void *rs;
+	int r = 0;
+
+	rs = init_rs_char(FEC_PARAMS(b->roots));
+	buf = malloc(data_size);
+	parity = malloc((size_t)FEC_BENCH_COLUMN * b->roots);
+	if (!rs || !buf || !parity) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < data_size; i++)
+		buf[i] = (uint8_t)(i * 2654435761U >> 13);
+
+	bytes = 0;
+	start = FEC_bench_time_ms();
+	do {
+		encode_rs_char_multi(rs, buf, FEC_BENCH_COLUMN, parity, FEC_BENCH_COLUMN);
+		bytes += data_size;
+		ms = FEC_bench_time_ms() - start;
+	} while (ms < FEC_BENCH_TIME_MS);
+	b->encode_mbs = (double)bytes / (1024 * 1024) / (ms / 1000.0);
+
+	bytes = 0;
+	start = FEC_bench_time_ms();
+	do {
+		for (k = 0; k < FEC_BENCH_COLUMN; k++) {
+			for (i = 0; i < rsn; i++)
+				rs_block[i] = buf[i * FEC_BENCH_COLUMN + k];
+			memcpy(&rs_block[rsn], &parity[k * b->roots], b->roots);
+			rs_block[k % rsn] ^= 0x5a;
+			if (decode_rs_char(rs, rs_block) != 1) {
+				r = -EINVAL;
+				goto out;
+			}
+		}
+		bytes += data_size;
+		ms = FEC_bench_time_ms() - start;
+	} while (ms < FEC_BENCH_TIME_MS);
+	b->decode_mbs = (double)bytes / (1024 * 1024) / (ms / 1000.0);
 out:
-	if (inputs[0].fd != -1)
-		close(inputs[0].fd);
-	if (inputs[1].fd != -1)
-		close(inputs[1].fd);
-	if (fd != -1)
-		close(fd);
+	free(buf);
+	free(parity);
+	if (rs)
+		free_rs_char(rs);
+	return r;
+}
+
+static void *FEC_bench_thread(void *arg)
+{
+	struct fec_bench *b = arg;
+
+	b->r = FEC_bench_run(b);
+	return NULL;
+}
+
+int VERITY_FEC_benchmark(uint32_t roots, unsigned threads,
+			 double *encode_mbs, double *decode_mbs)
+{
+	struct fec_bench *b;
+	unsigned i, started;
+	int r = 0;
+
+	if (roots > FEC_RSM - FEC_MIN_RSN || roots < FEC_RSM - FEC_MAX_RSN)
+		return -EINVAL;
+
+	if (!threads)
+		threads = 1;
+
+	b = calloc(threads, sizeof(*b));
+	if (!b)
+		return -ENOMEM;
+
+	for (i = 0; i < threads; i++)
+		b[i].roots = roots;
+
+	if (threads == 1)
+		b[0].r = FEC_bench_run(&b[0]);
+	else {
+		for (started = 0; started < threads; started++)
+			if (pthread_create(&b[started].thread, NULL, FEC_bench_thread, &b[started])) {
+				r = -ENOMEM;
+				break;
+			}
+		for (i = 0; i < started; i++)
+			pthread_join(b[i].thread, NULL);
+	}
+
+	*encode_mbs = *decode_mbs = 0.0;
+	for (i = 0; i < threads && !r; i++) {
+		r = b[i].r;
+		*encode_mbs += b[i].encode_mbs;
+		*decode_mbs += b[i].decode_mbs;
+	}
 
+	free(b);
 	return r;
 }
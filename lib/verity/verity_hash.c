@@ -23,11 +23,16 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "verity.h"
 #include "internal.h"
 
 #define VERITY_MAX_LEVELS	63
+#define VERITY_IO_BUFFER	(4 * 1024 * 1024)
 
 static unsigned get_bits_up(size_t u)
 {
@@ -45,36 +50,46 @@ static unsigned get_bits_down(size_t u)
 	return i;
 }
 
-static int verify_zero(struct crypt_device *cd, FILE *wr, size_t bytes)
+/*
+ * Salt prefix (format version 1) long enough to fill a whole hash input block
+ * is hashed only once, every block then starts from a copy of that state.
+ */
+#define VERITY_SALT_MIDSTATE_MIN 64
+
+static struct crypt_hash *salt_midstate_init(const char *hash_name, int version,
+					     const char *salt, size_t salt_size)
 {
-	char block[bytes];
-	size_t i;
+	struct crypt_hash *ctx = NULL;
 
-	if (fread(block, bytes, 1, wr) != 1) {
-		log_dbg("EIO while reading spare area.");
-		return -EIO;
+	if (version != 1 || salt_size < VERITY_SALT_MIDSTATE_MIN)
+		return NULL;
+
+	if (crypt_hash_init(&ctx, hash_name))
+		return NULL;
+
+	if (crypt_hash_write(ctx, salt, salt_size)) {
+		crypt_hash_destroy(ctx);
+		return NULL;
 	}
-	for (i = 0; i < bytes; i++)
-		if (block[i]) {
-			log_err(cd, _("Spare area is not zeroed at position %" PRIu64 "."),
-				ftello(wr) - bytes);
-			return -EPERM;
-		}
-	return 0;
+
+	return ctx;
 }
 
-static int verify_hash_block(const char *hash_name, int version,
+/*
+ * Hash context is reused, final (or reset on error) prepares it for the next block.
+ * With salted midstate the context state is replaced with already hashed salt.
+ */
+static int verify_hash_block(struct crypt_hash *ctx, struct crypt_hash *salted, int version,
 			      char *hash, size_t hash_size,
 			      const char *data, size_t data_size,
 			      const char *salt, size_t salt_size)
 {
-	struct crypt_hash *ctx = NULL;
 	int r;
 
-	if (crypt_hash_init(&ctx, hash_name))
-		return -EINVAL;
-
-	if (version == 1 && (r = crypt_hash_write(ctx, salt, salt_size)))
+	if (salted) {
+		if ((r = crypt_hash_restore(ctx, salted)))
+			goto out;
+	} else if (version == 1 && (r = crypt_hash_write(ctx, salt, salt_size)))
 		goto out;
 
 	if ((r = crypt_hash_write(ctx, data, data_size)))
@@ -83,9 +98,9 @@ static int verify_hash_block(const char *hash_name, int version,
 	if (version == 0 && (r = crypt_hash_write(ctx, salt, salt_size)))
 		goto out;
 
-	r = crypt_hash_final(ctx, hash, hash_size);
+	return crypt_hash_final(ctx, hash, hash_size);
 out:
-	crypt_hash_destroy(ctx);
+	crypt_hash_reset(ctx);
 	return r;
 }
 
@@ -136,106 +151,643 @@ static int hash_levels(size_t hash_block_size, size_t digest_size,
 	return 0;
 }
 
-static int create_or_verify(struct crypt_device *cd, FILE *rd, FILE *wr,
-				   off_t data_block, size_t data_block_size,
-				   off_t hash_block, size_t hash_block_size,
-				   off_t blocks, int version,
-				   const char *hash_name, int verify,
-				   char *calculated_digest, size_t digest_size,
-				   const char *salt, size_t salt_size)
-{
-	char left_block[hash_block_size];
-	char data_buffer[data_block_size];
-	char read_digest[digest_size];
-	size_t hash_per_block = 1 << get_bits_down(hash_block_size / digest_size);
-	size_t digest_size_full = 1 << get_bits_up(digest_size);
-	off_t blocks_to_write = (blocks + hash_per_block - 1) / hash_per_block;
-	off_t seek_rd, seek_wr;
-	size_t left_bytes;
-	unsigned i;
+/* One hash level (or its part) processed by a worker */
+struct verity_level {
+	const char *hash_name;
+	const char *salt;
+	size_t salt_size;
+	size_t digest_size;
+	int version;
+	int verify;
+
+	off_t data_offset;	/* input blocks start (bytes) */
+	size_t data_block_size;
+	off_t blocks;		/* input blocks */
+
+	off_t hash_offset;	/* output hash blocks start (bytes) */
+	size_t hash_block_size;
+
+	/* FEC block numbers of the first input and output block (scrub only) */
+	uint64_t fec_input_block;
+	uint64_t fec_hash_block;
+};
+
+/* Blocks failed verification, collected instead of stopping at the first one */
+struct verity_failed {
+	struct crypt_verity_range *repair;	/* FEC repair candidates (FEC block numbers) */
+	size_t repair_count, repair_alloc;
+	struct crypt_verity_range *recheck;	/* hash blocks of the level to verify again */
+	size_t recheck_count, recheck_alloc;
+	uint64_t blocks;			/* number of blocks failed verification */
+};
+
+/* Verify with FEC repair state */
+struct verity_scrub {
+	struct crypt_params_verity *params;
+	struct device *fec_device;
+	struct verity_failed failed;
+	uint64_t repaired;
+	uint64_t unrecoverable;
+};
+
+/* Input bytes processed by all workers, reported as progress telemetry */
+struct verity_progress {
+	struct crypt_device *cd;
+	pthread_mutex_t lock;
+	uint64_t size;
+	uint64_t done;
+};
+
+struct verity_worker {
+	const struct verity_level *level;
+	struct verity_progress *progress;
+	off_t first_hash_block, hash_blocks;
+	int rd, wr;
+	size_t rd_bsize, rd_alignment;
+	size_t wr_bsize, wr_alignment;
+	pthread_t thread;
+
 	int r;
+	off_t fail_offset;
+	bool fail_spare;
 
-	if (mult_overflow(&seek_rd, data_block, data_block_size) ||
-	    mult_overflow(&seek_wr, hash_block, hash_block_size)) {
-		log_err(cd, _("Device offset overflow."));
-		return -EINVAL;
+	bool collect;
+	struct verity_failed failed;
+};
+
+static int ranges_add(struct crypt_verity_range **ranges, size_t *count, size_t *alloc,
+		      uint64_t offset, uint64_t length)
+{
+	struct crypt_verity_range *tmp, *last = *count ? &(*ranges)[*count - 1] : NULL;
+
+	if (last && last->offset + last->length == offset) {
+		last->length += length;
+		return 0;
 	}
 
-	if (fseeko(rd, seek_rd, SEEK_SET)) {
-		log_dbg("Cannot seek to requested position in data device.");
-		return -EIO;
+	if (*count == *alloc) {
+		tmp = realloc(*ranges, (*alloc ? 2 * *alloc : 64) * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		*ranges = tmp;
+		*alloc = *alloc ? 2 * *alloc : 64;
 	}
 
-	if (wr && fseeko(wr, seek_wr, SEEK_SET)) {
-		log_dbg("Cannot seek to requested position in hash device.");
-		return -EIO;
+	(*ranges)[*count].offset = offset;
+	(*ranges)[(*count)++].length = length;
+	return 0;
+}
+
+static void failed_free(struct verity_failed *f)
+{
+	free(f->repair);
+	free(f->recheck);
+	memset(f, 0, sizeof(*f));
+}
+
+static int failed_join(struct verity_failed *dst, const struct verity_failed *src)
+{
+	size_t i;
+	int r = 0;
+
+	for (i = 0; i < src->repair_count && !r; i++)
+		r = ranges_add(&dst->repair, &dst->repair_count, &dst->repair_alloc,
+			       src->repair[i].offset, src->repair[i].length);
+	for (i = 0; i < src->recheck_count && !r; i++)
+		r = ranges_add(&dst->recheck, &dst->recheck_count, &dst->recheck_alloc,
+			       src->recheck[i].offset, src->recheck[i].length);
+	dst->blocks += src->blocks;
+	return r;
+}
+
+/*
+ * Record all failed blocks of an extent. A digest mismatch means either the input
+ * block or the hash block is corrupted, both are FEC repair candidates (decoding
+ * of an intact block corrects nothing). A mismatch only in spare area
+ * is corruption of the hash block itself.
+ */
+static int verify_collect(struct verity_worker *w, const char *hash, const char *cmp,
+			  off_t hash_block, off_t hash_count, off_t block, off_t blocks)
+{
+	const struct verity_level *l = w->level;
+	struct verity_failed *f = &w->failed;
+	size_t hash_per_block = 1 << get_bits_down(l->hash_block_size / l->digest_size);
+	size_t digest_size_full = 1 << get_bits_up(l->digest_size);
+	size_t digest_step = l->version ? digest_size_full : l->digest_size;
+	const char *a, *b;
+	size_t pos, j;
+	uint64_t failed;
+	bool spare;
+	off_t h, n;
+	int r;
+
+	for (h = 0; h < hash_count; h++) {
+		a = &hash[h * l->hash_block_size];
+		b = &cmp[h * l->hash_block_size];
+		if (!memcmp(a, b, l->hash_block_size))
+			continue;
+
+		failed = 0;
+		spare = false;
+		for (pos = 0; pos < l->hash_block_size; pos++) {
+			if (a[pos] == b[pos])
+				continue;
+			j = pos / digest_step;
+			n = h * hash_per_block + j;
+			if (j < hash_per_block && n < blocks && (pos % digest_step) < l->digest_size) {
+				r = ranges_add(&f->repair, &f->repair_count, &f->repair_alloc,
+					       l->fec_input_block + block + n, 1);
+				if (r)
+					return r;
+				failed++;
+				/* skip the rest of this digest */
+				pos = (j + 1) * digest_step - 1;
+			} else
+				spare = true;
+		}
+
+		if (spare && !failed)
+			failed = 1;
+		f->blocks += failed;
+
+		r = ranges_add(&f->repair, &f->repair_count, &f->repair_alloc,
+			       l->fec_hash_block + hash_block + h, 1);
+		if (!r)
+			r = ranges_add(&f->recheck, &f->recheck_count, &f->recheck_alloc,
+				       hash_block + h, 1);
+		if (r)
+			return r;
 	}
 
-	memset(left_block, 0, hash_block_size);
-	while (blocks_to_write--) {
-		left_bytes = hash_block_size;
-		for (i = 0; i < hash_per_block; i++) {
-			if (!blocks)
-				break;
-			blocks--;
-			if (fread(data_buffer, data_block_size, 1, rd) != 1) {
-				log_dbg("Cannot read data device block.");
-				return -EIO;
-			}
+	return 0;
+}
+
+/*
+ * Calculate (or verify) a continuous range of hash blocks of a level.
+ * Each output hash block covers hash_per_block input blocks; input is read
+ * in extents of up to VERITY_IO_BUFFER bytes covering whole hash blocks and
+ * the hash blocks are written (or read for compare) in one request per extent.
+ */
+static int create_or_verify_range(struct verity_worker *w)
+{
+	const struct verity_level *l = w->level;
+	size_t hash_per_block = 1 << get_bits_down(l->hash_block_size / l->digest_size);
+	size_t digest_size_full = 1 << get_bits_up(l->digest_size);
+	size_t digest_step = l->version ? digest_size_full : l->digest_size;
+	size_t extent_hash_blocks, data_len, hash_len, i, n, pos;
+	void *data_buffer = NULL, *hash_buffer = NULL, *cmp_buffer = NULL;
+	struct crypt_hash *ctx = NULL, *salted = NULL;
+	char *data, *hash, *cmp;
+	off_t block, blocks, hash_block, hash_count, hash_offset;
+	int r = 0;
 
-			if (verify_hash_block(hash_name, version,
-					calculated_digest, digest_size,
-					data_buffer, data_block_size,
-					salt, salt_size))
-				return -EINVAL;
+	extent_hash_blocks = VERITY_IO_BUFFER / (hash_per_block * l->data_block_size);
+	if (!extent_hash_blocks)
+		extent_hash_blocks = 1;
 
-			if (!wr)
-				break;
-			if (verify) {
-				if (fread(read_digest, digest_size, 1, wr) != 1) {
-					log_dbg("Cannot read digest form hash device.");
-					return -EIO;
-				}
-				if (memcmp(read_digest, calculated_digest, digest_size)) {
-					log_err(cd, _("Verification failed at position %" PRIu64 "."),
-						ftello(rd) - data_block_size);
-					return -EPERM;
-				}
-			} else {
-				if (fwrite(calculated_digest, digest_size, 1, wr) != 1) {
-					log_dbg("Cannot write digest to hash device.");
-					return -EIO;
-				}
+	if (posix_memalign(&data_buffer, w->rd_alignment,
+			   extent_hash_blocks * hash_per_block * l->data_block_size) ||
+	    posix_memalign(&hash_buffer, w->wr_alignment,
+			   extent_hash_blocks * l->hash_block_size) ||
+	    (l->verify && posix_memalign(&cmp_buffer, w->wr_alignment,
+			   extent_hash_blocks * l->hash_block_size))) {
+		r = -ENOMEM;
+		goto out;
+	}
+	data = data_buffer;
+	hash = hash_buffer;
+	cmp = cmp_buffer;
+
+	salted = salt_midstate_init(l->hash_name, l->version, l->salt, l->salt_size);
+
+	if (crypt_hash_init(&ctx, l->hash_name)) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	for (hash_block = w->first_hash_block;
+	     hash_block < w->first_hash_block + w->hash_blocks; hash_block += hash_count) {
+		hash_count = w->first_hash_block + w->hash_blocks - hash_block;
+		if (hash_count > (off_t)extent_hash_blocks)
+			hash_count = extent_hash_blocks;
+
+		block = hash_block * hash_per_block;
+		blocks = hash_count * hash_per_block;
+		if (block + blocks > l->blocks)
+			blocks = l->blocks - block;
+
+		data_len = blocks * l->data_block_size;
+		if (read_lseek_blockwise(w->rd, w->rd_bsize, w->rd_alignment, data,
+					 data_len, l->data_offset + block * l->data_block_size) !=
+		    (ssize_t)data_len) {
+			log_dbg("Cannot read data device block.");
+			r = -EIO;
+			goto out;
+		}
+
+		hash_len = hash_count * l->hash_block_size;
+		memset(hash, 0, hash_len);
+
+		for (n = 0; n < (size_t)blocks; n++) {
+			if (verify_hash_block(ctx, salted, l->version,
+					&hash[(n / hash_per_block) * l->hash_block_size +
+					      (n % hash_per_block) * digest_step], l->digest_size,
+					&data[n * l->data_block_size], l->data_block_size,
+					l->salt, l->salt_size)) {
+				r = -EINVAL;
+				goto out;
 			}
-			if (version == 0) {
-				left_bytes -= digest_size;
-			} else {
-				if (digest_size_full - digest_size) {
-					if (verify) {
-						r = verify_zero(cd, wr, digest_size_full - digest_size);
-						if (r)
-							return r;
-					} else if (fwrite(left_block, digest_size_full - digest_size, 1, wr) != 1) {
-						log_dbg("Cannot write spare area to hash device.");
-						return -EIO;
-					}
-				}
-				left_bytes -= digest_size_full;
+		}
+
+		if (w->progress) {
+			pthread_mutex_lock(&w->progress->lock);
+			w->progress->done += data_len;
+			crypt_progress_update(w->progress->cd, w->progress->size, w->progress->done);
+			pthread_mutex_unlock(&w->progress->lock);
+		}
+
+		hash_offset = l->hash_offset + hash_block * l->hash_block_size;
+
+		if (!l->verify) {
+			if (write_lseek_blockwise(w->wr, w->wr_bsize, w->wr_alignment, hash,
+						  hash_len, hash_offset) != (ssize_t)hash_len) {
+				log_dbg("Cannot write hash block to hash device.");
+				r = -EIO;
+				goto out;
 			}
+			continue;
 		}
-		if (wr && left_bytes) {
-			if (verify) {
-				r = verify_zero(cd , wr, left_bytes);
-				if (r)
-					return r;
-			} else if (fwrite(left_block, left_bytes, 1, wr) != 1) {
-				log_dbg("Cannot write remaining spare area to hash device.");
-				return -EIO;
+
+		if (read_lseek_blockwise(w->wr, w->wr_bsize, w->wr_alignment, cmp,
+					 hash_len, hash_offset) != (ssize_t)hash_len) {
+			log_dbg("Cannot read digest form hash device.");
+			r = -EIO;
+			goto out;
+		}
+
+		if (!memcmp(cmp, hash, hash_len))
+			continue;
+
+		if (w->collect) {
+			r = verify_collect(w, hash, cmp, hash_block, hash_count, block, blocks);
+			if (r)
+				goto out;
+			continue;
+		}
+
+		/* Find the first mismatch, it is either a digest or spare area */
+		for (pos = 0; cmp[pos] == hash[pos]; pos++)
+			;
+		i = (pos / l->hash_block_size) * hash_per_block +
+		    (pos % l->hash_block_size) / digest_step;
+		if ((pos % l->hash_block_size) / digest_step < hash_per_block &&
+		    i < (size_t)blocks && (pos % digest_step) < l->digest_size) {
+			w->fail_offset = l->data_offset + (block + i) * l->data_block_size;
+			w->fail_spare = false;
+		} else {
+			w->fail_offset = hash_offset + pos;
+			w->fail_spare = true;
+		}
+		r = -EPERM;
+		goto out;
+	}
+out:
+	if (ctx)
+		crypt_hash_destroy(ctx);
+	if (salted)
+		crypt_hash_destroy(salted);
+	free(data_buffer);
+	free(hash_buffer);
+	free(cmp_buffer);
+	return r;
+}
+
+static void *create_or_verify_thread(void *arg)
+{
+	struct verity_worker *w = arg;
+
+	w->r = create_or_verify_range(w);
+	return NULL;
+}
+
+static int create_or_verify(struct crypt_device *cd,
+			    struct device *data_device, struct device *hash_device,
+			    const struct verity_level *l, unsigned threads,
+			    struct verity_progress *progress,
+			    struct verity_failed *failed)
+{
+	struct verity_worker *workers;
+	size_t hash_per_block = 1 << get_bits_down(l->hash_block_size / l->digest_size);
+	off_t blocks_to_write = (l->blocks + hash_per_block - 1) / hash_per_block;
+	off_t first = 0;
+	unsigned i, started = 0;
+	int r = 0;
+
+	if (!threads)
+		threads = 1;
+	if ((off_t)threads > blocks_to_write)
+		threads = blocks_to_write ?: 1;
+
+	workers = calloc(threads, sizeof(*workers));
+	if (!workers)
+		return -ENOMEM;
+
+	for (i = 0; i < threads; i++) {
+		workers[i].rd = workers[i].wr = -1;
+		workers[i].level = l;
+		workers[i].progress = progress;
+		workers[i].collect = failed ? true : false;
+		workers[i].first_hash_block = first;
+		workers[i].hash_blocks = blocks_to_write / threads +
+					 ((off_t)i < blocks_to_write % threads ? 1 : 0);
+		first += workers[i].hash_blocks;
+
+		workers[i].rd_bsize = device_block_size(data_device);
+		workers[i].rd_alignment = device_alignment(data_device);
+		workers[i].wr_bsize = device_block_size(hash_device);
+		workers[i].wr_alignment = device_alignment(hash_device);
+
+		workers[i].rd = device_open(data_device, O_RDONLY);
+		if (workers[i].rd < 0) {
+			log_err(cd, _("Cannot open device %s."), device_path(data_device));
+			r = -EIO;
+			goto out;
+		}
+		workers[i].wr = device_open(hash_device, l->verify ? O_RDONLY : O_RDWR);
+		if (workers[i].wr < 0) {
+			log_err(cd, _("Cannot open device %s."), device_path(hash_device));
+			r = -EIO;
+			goto out;
+		}
+	}
+
+	if (threads == 1)
+		workers[0].r = create_or_verify_range(&workers[0]);
+	else {
+		log_dbg("Processing %" PRIu64 " hash blocks using %u threads.",
+			blocks_to_write, threads);
+		for (started = 0; started < threads; started++)
+			if (pthread_create(&workers[started].thread, NULL,
+					   create_or_verify_thread, &workers[started])) {
+				r = -ENOMEM;
+				break;
 			}
+		for (i = 0; i < started; i++)
+			pthread_join(workers[i].thread, NULL);
+		if (r)
+			goto out;
+	}
+
+	/* Report the first failure in device order */
+	for (i = 0; i < threads && !r; i++) {
+		r = workers[i].r;
+		if (!r && failed)
+			r = failed_join(failed, &workers[i].failed);
+		if (r == -EPERM && workers[i].fail_spare)
+			log_err(cd, _("Spare area is not zeroed at position %" PRIu64 "."),
+				workers[i].fail_offset);
+		else if (r == -EPERM)
+			log_err(cd, _("Verification failed at position %" PRIu64 "."),
+				workers[i].fail_offset);
+	}
+out:
+	for (i = 0; i < threads; i++) {
+		if (workers[i].rd >= 0)
+			device_close(data_device, workers[i].rd);
+		if (workers[i].wr >= 0)
+			device_close(hash_device, workers[i].wr);
+		failed_free(&workers[i].failed);
+	}
+	free(workers);
+	return r;
+}
+
+static int range_cmp(const void *a, const void *b)
+{
+	const struct crypt_verity_range *ra = a, *rb = b;
+
+	if (ra->offset < rb->offset)
+		return -1;
+	return ra->offset > rb->offset ? 1 : 0;
+}
+
+/* Sort block ranges and join overlapping or adjacent ones, returns new count */
+size_t VERITY_ranges_merge(struct crypt_verity_range *ranges, size_t count)
+{
+	size_t i, n = 0;
+
+	if (!count)
+		return 0;
+
+	qsort(ranges, count, sizeof(*ranges), range_cmp);
+
+	for (i = 1; i < count; i++) {
+		if (ranges[i].offset <= ranges[n].offset + ranges[n].length) {
+			if (ranges[i].offset + ranges[i].length > ranges[n].offset + ranges[n].length)
+				ranges[n].length = ranges[i].offset + ranges[i].length - ranges[n].offset;
+		} else
+			ranges[++n] = ranges[i];
+	}
+
+	return n + 1;
+}
+
+/*
+ * Verify only a random sample of level 0 hash blocks (each covering hash_per_block
+ * data blocks). Upper levels and the root are still verified completely,
+ * so every sampled data block is checked along its full path to the root.
+ */
+static int verify_sample(struct crypt_device *cd,
+			 struct device *data_device, struct device *hash_device,
+			 const struct verity_level *l, uint32_t percent)
+{
+	struct verity_worker w = { .level = l, .rd = -1, .wr = -1 };
+	struct crypt_verity_range *ranges = NULL;
+	size_t hash_per_block = 1 << get_bits_down(l->hash_block_size / l->digest_size);
+	off_t hash_blocks = (l->blocks + hash_per_block - 1) / hash_per_block;
+	uint64_t *rnd = NULL;
+	size_t count, i;
+	int r = 0;
+
+	count = (uint64_t)hash_blocks * percent / 100 ?: 1;
+
+	ranges = malloc(count * sizeof(*ranges));
+	rnd = malloc(count * sizeof(*rnd));
+	if (!ranges || !rnd) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = crypt_random_get(cd, (char *)rnd, count * sizeof(*rnd), CRYPT_RND_NORMAL);
+	if (r < 0)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		ranges[i].offset = rnd[i] % hash_blocks;
+		ranges[i].length = 1;
+	}
+	count = VERITY_ranges_merge(ranges, count);
+
+	log_dbg("Verifying %u%% sample (%zu ranges) of %" PRIu64 " hash blocks.",
+		percent, count, hash_blocks);
+
+	w.rd_bsize = device_block_size(data_device);
+	w.rd_alignment = device_alignment(data_device);
+	w.wr_bsize = device_block_size(hash_device);
+	w.wr_alignment = device_alignment(hash_device);
+
+	w.rd = device_open(data_device, O_RDONLY);
+	if (w.rd < 0) {
+		log_err(cd, _("Cannot open device %s."), device_path(data_device));
+		r = -EIO;
+		goto out;
+	}
+	w.wr = device_open(hash_device, O_RDONLY);
+	if (w.wr < 0) {
+		log_err(cd, _("Cannot open device %s."), device_path(hash_device));
+		r = -EIO;
+		goto out;
+	}
+
+	for (i = 0; i < count && !r; i++) {
+		w.first_hash_block = ranges[i].offset;
+		w.hash_blocks = ranges[i].length;
+		r = create_or_verify_range(&w);
+	}
+
+	if (r == -EPERM && w.fail_spare)
+		log_err(cd, _("Spare area is not zeroed at position %" PRIu64 "."),
+			w.fail_offset);
+	else if (r == -EPERM)
+		log_err(cd, _("Verification failed at position %" PRIu64 "."),
+			w.fail_offset);
+out:
+	if (w.rd >= 0)
+		device_close(data_device, w.rd);
+	if (w.wr >= 0)
+		device_close(hash_device, w.wr);
+	free(ranges);
+	free(rnd);
+	return r;
+}
+
+/* Root hash is the digest of the top level hash block (or the only data block) */
+static int calculate_root(struct device *device, off_t offset, size_t block_size,
+			  const struct verity_level *l, char *root_hash)
+{
+	struct crypt_hash *ctx = NULL;
+	void *buffer;
+	int fd, r = 0;
+
+	if (posix_memalign(&buffer, device_alignment(device), block_size))
+		return -ENOMEM;
+
+	fd = device_open(device, O_RDONLY);
+	if (fd < 0) {
+		free(buffer);
+		return -EIO;
+	}
+
+	if (read_lseek_blockwise(fd, device_block_size(device), device_alignment(device),
+				 buffer, block_size, offset) != (ssize_t)block_size) {
+		log_dbg("Cannot read hash device block.");
+		r = -EIO;
+	} else if (crypt_hash_init(&ctx, l->hash_name) ||
+		   verify_hash_block(ctx, NULL, l->version, root_hash, l->digest_size,
+				     buffer, block_size, l->salt, l->salt_size))
+		r = -EINVAL;
+
+	if (ctx)
+		crypt_hash_destroy(ctx);
+	device_close(device, fd);
+	free(buffer);
+	return r;
+}
+
+/* Decode one block at a time, a single unrecoverable block does not stop the others */
+static void scrub_repair(struct crypt_device *cd, struct verity_scrub *s,
+			 const struct crypt_verity_range *ranges, size_t count)
+{
+	struct crypt_verity_range block = { .length = 1 };
+	unsigned int errors;
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		for (block.offset = ranges[i].offset;
+		     block.offset < ranges[i].offset + ranges[i].length; block.offset++) {
+			errors = 0;
+			if (VERITY_FEC_repair(cd, s->params, s->fec_device, &block, 1, &errors))
+				log_dbg("Cannot repair FEC block %" PRIu64 ".", block.offset);
+			else if (errors)
+				log_dbg("Corrected %u bytes in RS rounds of FEC block %" PRIu64 ".",
+					errors, block.offset);
 		}
+}
+
+/*
+ * Repair blocks failed on this level from FEC and verify their hash blocks again,
+ * the next level then reads already repaired hash blocks.
+ */
+static int scrub_level(struct crypt_device *cd,
+		       struct device *data_device, struct device *hash_device,
+		       const struct verity_level *l, struct verity_scrub *s)
+{
+	struct verity_worker w = { .level = l, .rd = -1, .wr = -1, .collect = true };
+	struct verity_failed *f = &s->failed;
+	size_t i;
+	int r = 0;
+
+	if (!f->blocks)
+		goto out;
+
+	log_dbg("%" PRIu64 " blocks failed verification in %" PRIu64 " - %" PRIu64 " area.",
+		f->blocks, l->data_offset, l->data_offset + l->blocks * l->data_block_size);
+
+	if (!s->fec_device) {
+		s->unrecoverable += f->blocks;
+		goto out;
 	}
 
-	return 0;
+	f->repair_count = VERITY_ranges_merge(f->repair, f->repair_count);
+	scrub_repair(cd, s, f->repair, f->repair_count);
+
+	w.rd_bsize = device_block_size(data_device);
+	w.rd_alignment = device_alignment(data_device);
+	w.wr_bsize = device_block_size(hash_device);
+	w.wr_alignment = device_alignment(hash_device);
+
+	w.rd = device_open(data_device, O_RDONLY);
+	if (w.rd < 0) {
+		log_err(cd, _("Cannot open device %s."), device_path(data_device));
+		r = -EIO;
+		goto out;
+	}
+	w.wr = device_open(hash_device, O_RDONLY);
+	if (w.wr < 0) {
+		log_err(cd, _("Cannot open device %s."), device_path(hash_device));
+		r = -EIO;
+		goto out;
+	}
+
+	f->recheck_count = VERITY_ranges_merge(f->recheck, f->recheck_count);
+	for (i = 0; i < f->recheck_count && !r; i++) {
+		w.first_hash_block = f->recheck[i].offset;
+		w.hash_blocks = f->recheck[i].length;
+		r = create_or_verify_range(&w);
+	}
+	if (r)
+		goto out;
+
+	s->repaired += w.failed.blocks < f->blocks ? f->blocks - w.failed.blocks : 0;
+	s->unrecoverable += w.failed.blocks;
+out:
+	if (w.rd >= 0)
+		device_close(data_device, w.rd);
+	if (w.wr >= 0)
+		device_close(hash_device, w.wr);
+	failed_free(&w.failed);
+	failed_free(f);
+	return r;
 }
 
 static int VERITY_create_or_verify_hash(struct crypt_device *cd,
@@ -251,17 +803,36 @@ static int VERITY_create_or_verify_hash(struct crypt_device *cd,
 	char *root_hash,
 	size_t digest_size,
 	const char *salt,
-	size_t salt_size)
+	size_t salt_size,
+	unsigned threads,
+	uint32_t sample_percent,
+	struct verity_scrub *scrub)
 {
 	char calculated_digest[digest_size];
-	FILE *data_file = NULL;
-	FILE *hash_file = NULL, *hash_file_2;
+	struct crypt_verity_range root_block = { .length = 1 };
+	struct device *root_device;
+	off_t root_offset, hash_start = hash_position;
+	size_t root_block_size;
+	unsigned int errors;
+	struct verity_level l = {
+		.hash_name = hash_name,
+		.salt = salt,
+		.salt_size = salt_size,
+		.digest_size = digest_size,
+		.version = version,
+		.verify = verify,
+		.hash_block_size = hash_block_size,
+	};
+	struct verity_progress progress = {
+		.cd = cd,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
 	off_t hash_level_block[VERITY_MAX_LEVELS];
 	off_t hash_level_size[VERITY_MAX_LEVELS];
 	off_t data_file_blocks;
 	off_t data_device_size = 0, hash_device_size = 0;
 	uint64_t dev_size;
-	int levels, i, r;
+	int levels, i, fd, r;
 
 	log_dbg("Hash %s %s, data device %s, data blocks %" PRIu64
 		", hash_device %s, offset %" PRIu64 ".",
@@ -303,67 +874,80 @@ static int VERITY_create_or_verify_hash(struct crypt_device *cd,
 
 	log_dbg("Data device size required: %" PRIu64 " bytes.",
 		data_device_size);
-	data_file = fopen(device_path(data_device), "r");
-	if (!data_file) {
-		log_err(cd, _("Cannot open device %s."),
-			device_path(data_device)
-		);
-		r = -EIO;
-		goto out;
-	}
-
 	log_dbg("Hash device size required: %" PRIu64 " bytes.",
 		hash_device_size);
-	hash_file = fopen(device_path(hash_device), verify ? "r" : "r+");
-	if (!hash_file) {
-		log_err(cd, _("Cannot open device %s."),
-			device_path(hash_device));
-		r = -EIO;
-		goto out;
-	}
 
 	memset(calculated_digest, 0, digest_size);
 
+	/* every level reads the hash blocks written by the previous one */
+	progress.size = (uint64_t)data_file_blocks * data_block_size;
+	for (i = 0; i < levels - 1; i++)
+		progress.size += (uint64_t)hash_level_size[i] * hash_block_size;
+	crypt_progress_start(cd, verify ? "verity-verify" : "verity-create");
+
 	for (i = 0; i < levels; i++) {
 		if (!i) {
-			r = create_or_verify(cd, data_file, hash_file,
-						    0, data_block_size,
-						    hash_level_block[i], hash_block_size,
-						    data_file_blocks, version, hash_name, verify,
-						    calculated_digest, digest_size, salt, salt_size);
-			if (r)
-				goto out;
+			l.data_offset = 0;
+			l.data_block_size = data_block_size;
+			l.blocks = data_file_blocks;
 		} else {
-			hash_file_2 = fopen(device_path(hash_device), "r");
-			if (!hash_file_2) {
-				log_err(cd, _("Cannot open device %s."),
-					device_path(hash_device));
-				r = -EIO;
+			l.data_block_size = hash_block_size;
+			l.blocks = hash_level_size[i - 1];
+			if (mult_overflow(&l.data_offset, hash_level_block[i - 1], hash_block_size)) {
+				log_err(cd, _("Device offset overflow."));
+				r = -EINVAL;
 				goto out;
 			}
-			r = create_or_verify(cd, hash_file_2, hash_file,
-						    hash_level_block[i - 1], hash_block_size,
-						    hash_level_block[i], hash_block_size,
-						    hash_level_size[i - 1], version, hash_name, verify,
-						    calculated_digest, digest_size, salt, salt_size);
-			fclose(hash_file_2);
-			if (r)
-				goto out;
 		}
+
+		if (mult_overflow(&l.hash_offset, hash_level_block[i], hash_block_size)) {
+			log_err(cd, _("Device offset overflow."));
+			r = -EINVAL;
+			goto out;
+		}
+
+		if (!i && verify && sample_percent && sample_percent < 100) {
+			r = verify_sample(cd, data_device, hash_device, &l, sample_percent);
+			progress.done += (uint64_t)l.blocks * l.data_block_size;
+			crypt_progress_update(cd, progress.size, progress.done);
+		} else {
+			if (scrub) {
+				l.fec_input_block = i ? data_file_blocks + hash_level_block[i - 1] - hash_start : 0;
+				l.fec_hash_block = data_file_blocks + hash_level_block[i] - hash_start;
+			}
+			r = create_or_verify(cd, i ? hash_device : data_device, hash_device,
+					     &l, threads, &progress, scrub ? &scrub->failed : NULL);
+			if (!r && scrub)
+				r = scrub_level(cd, i ? hash_device : data_device, hash_device, &l, scrub);
+		}
+		if (r)
+			goto out;
 	}
 
-	if (levels)
-		r = create_or_verify(cd, hash_file, NULL,
-					    hash_level_block[levels - 1], hash_block_size,
-					    0, hash_block_size,
-					    1, version, hash_name, verify,
-					    calculated_digest, digest_size, salt, salt_size);
-	else
-		r = create_or_verify(cd, data_file, NULL,
-					    0, data_block_size,
-					    0, hash_block_size,
-					    data_file_blocks, version, hash_name, verify,
-					    calculated_digest, digest_size, salt, salt_size);
+	if (levels) {
+		root_device = hash_device;
+		root_offset = (off_t)hash_level_block[levels - 1] * hash_block_size;
+		root_block_size = hash_block_size;
+		root_block.offset = data_file_blocks + hash_level_block[levels - 1] - hash_start;
+	} else {
+		root_device = data_device;
+		root_offset = 0;
+		root_block_size = data_block_size;
+	}
+
+	r = calculate_root(root_device, root_offset, root_block_size, &l, calculated_digest);
+
+	/* top level block is covered only by the root hash */
+	if (!r && scrub && memcmp(root_hash, calculated_digest, digest_size)) {
+		errors = 0;
+		if (scrub->fec_device &&
+		    !VERITY_FEC_repair(cd, scrub->params, scrub->fec_device, &root_block, 1, &errors) &&
+		    !calculate_root(root_device, root_offset, root_block_size, &l, calculated_digest) &&
+		    !memcmp(root_hash, calculated_digest, digest_size))
+			scrub->repaired++;
+		else
+			scrub->unrecoverable++;
+	}
 out:
 	if (verify) {
 		if (r)
@@ -376,32 +960,304 @@ out:
 			else
 				log_dbg("Verification of root hash succeeded.");
 		}
+		if (!r && scrub && scrub->unrecoverable) {
+			log_err(cd, _("Verification of data area failed."));
+			r = -EPERM;
+		}
 	} else {
 		if (r == -EIO)
 			log_err(cd, _("Input/output error while creating hash area."));
 		else if (r)
 			log_err(cd, _("Creation of hash area failed."));
 		else {
-			fsync(fileno(hash_file));
+			fd = open(device_path(hash_device), O_RDONLY);
+			if (fd >= 0) {
+				fsync(fd);
+				close(fd);
+			}
 			memcpy(root_hash, calculated_digest, digest_size);
 		}
 	}
 
-	if (data_file)
-		fclose(data_file);
-	if (hash_file)
-		fclose(hash_file);
 	return r;
 }
 
-/* Verify verity device using userspace crypto backend */
-int VERITY_verify(struct crypt_device *cd,
-		  struct crypt_params_verity *verity_hdr,
-		  const char *root_hash,
-		  size_t root_hash_size)
+/*
+ * Streaming hash creation: data is read once, sequentially, from a file
+ * descriptor (pipe) and copied to the data device. Only one (partial) hash
+ * block per level is kept in memory, each completed hash block is written
+ * to its final position on the hash device and its digest is added to
+ * the block of the next level. The top level block provides the root hash.
+ */
+struct verity_stream {
+	const struct verity_level *l;
+	struct crypt_hash *ctx, *salted;
+	size_t hash_per_block, digest_step;
+	int levels, hash_fd;
+	size_t hash_bsize, hash_alignment;
+	off_t *hash_level_block;
+
+	char *block[VERITY_MAX_LEVELS];
+	size_t fill[VERITY_MAX_LEVELS];
+	off_t written[VERITY_MAX_LEVELS];
+	char *root_hash;
+};
+
+static int stream_flush_level(struct verity_stream *st, int i)
 {
-	return VERITY_create_or_verify_hash(cd, 1,
-		verity_hdr->hash_type,
+	const struct verity_level *l = st->l;
+	off_t offset = (st->hash_level_block[i] + st->written[i]) * l->hash_block_size;
+	char *digest;
+
+	if (write_lseek_blockwise(st->hash_fd, st->hash_bsize, st->hash_alignment,
+				  st->block[i], l->hash_block_size, offset) != (ssize_t)l->hash_block_size) {
+		log_dbg("Cannot write hash block to hash device.");
+		return -EIO;
+	}
+	st->written[i]++;
+
+	if (i + 1 < st->levels)
+		digest = &st->block[i + 1][st->fill[i + 1] * st->digest_step];
+	else
+		digest = st->root_hash;
+
+	if (verify_hash_block(st->ctx, st->salted, l->version, digest, l->digest_size,
+			      st->block[i], l->hash_block_size, l->salt, l->salt_size))
+		return -EINVAL;
+
+	memset(st->block[i], 0, l->hash_block_size);
+	st->fill[i] = 0;
+
+	if (i + 1 < st->levels && ++st->fill[i + 1] == st->hash_per_block)
+		return stream_flush_level(st, i + 1);
+
+	return 0;
+}
+
+static int stream_data_block(struct verity_stream *st, const char *data, size_t data_block_size)
+{
+	const struct verity_level *l = st->l;
+
+	/* Only one data block, its digest is the root hash */
+	if (!st->levels)
+		return verify_hash_block(st->ctx, st->salted, l->version, st->root_hash,
+					 l->digest_size, data, data_block_size,
+					 l->salt, l->salt_size) ? -EINVAL : 0;
+
+	if (verify_hash_block(st->ctx, st->salted, l->version,
+			      &st->block[0][st->fill[0] * st->digest_step], l->digest_size,
+			      data, data_block_size, l->salt, l->salt_size))
+		return -EINVAL;
+
+	if (++st->fill[0] == st->hash_per_block)
+		return stream_flush_level(st, 0);
+
+	return 0;
+}
+
+static int VERITY_create_stream(struct crypt_device *cd,
+				struct crypt_params_verity *verity_hdr,
+				char *root_hash,
+				size_t root_hash_size)
+{
+	struct device *data_device = crypt_data_device(cd);
+	struct device *hash_device = crypt_metadata_device(cd);
+	struct verity_level l = {
+		.hash_name = verity_hdr->hash_name,
+		.salt = verity_hdr->salt,
+		.salt_size = verity_hdr->salt_size,
+		.digest_size = root_hash_size,
+		.version = verity_hdr->hash_type,
+		.hash_block_size = verity_hdr->hash_block_size,
+		.data_block_size = verity_hdr->data_block_size,
+		.blocks = verity_hdr->data_size,
+	};
+	struct verity_stream st = { .l = &l, .hash_fd = -1 };
+	char calculated_digest[root_hash_size];
+	off_t hash_level_block[VERITY_MAX_LEVELS];
+	off_t hash_level_size[VERITY_MAX_LEVELS];
+	off_t hash_position, block = 0;
+	size_t chunk_blocks, n, len;
+	void *buffer = NULL;
+	ssize_t rlen;
+	int i, data_fd = -1, stream_fd = crypt_get_verity_data_fd(cd), r = 0;
+
+	if (stream_fd < 0 || !verity_hdr->data_size) {
+		log_err(cd, _("Data size must be known for streaming hash creation."));
+		return -EINVAL;
+	}
+
+	hash_position = VERITY_hash_offset_block(verity_hdr);
+	if (hash_levels(l.hash_block_size, l.digest_size, l.blocks, &hash_position,
+			&st.levels, &hash_level_block[0], &hash_level_size[0])) {
+		log_err(cd, _("Hash area overflow."));
+		return -EINVAL;
+	}
+
+	log_dbg("Streaming hash creation from fd %d, %" PRIu64 " data blocks, %d hash levels.",
+		stream_fd, l.blocks, st.levels);
+
+	st.hash_per_block = 1 << get_bits_down(l.hash_block_size / l.digest_size);
+	st.digest_step = l.version ? 1 << get_bits_up(l.digest_size) : l.digest_size;
+	st.hash_level_block = hash_level_block;
+	st.hash_bsize = device_block_size(hash_device);
+	st.hash_alignment = device_alignment(hash_device);
+	st.root_hash = calculated_digest;
+
+	chunk_blocks = VERITY_IO_BUFFER / l.data_block_size ?: 1;
+	if (posix_memalign(&buffer, device_alignment(data_device), chunk_blocks * l.data_block_size)) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < st.levels; i++)
+		if (!(st.block[i] = calloc(1, l.hash_block_size))) {
+			r = -ENOMEM;
+			goto out;
+		}
+
+	st.salted = salt_midstate_init(l.hash_name, l.version, l.salt, l.salt_size);
+	if (crypt_hash_init(&st.ctx, l.hash_name)) {
+		r = -EINVAL;
+		goto out;
+	}
+
+	data_fd = device_open(data_device, O_RDWR);
+	if (data_fd < 0) {
+		log_err(cd, _("Cannot open device %s."), device_path(data_device));
+		r = -EIO;
+		goto out;
+	}
+	st.hash_fd = device_open(hash_device, O_RDWR);
+	if (st.hash_fd < 0) {
+		log_err(cd, _("Cannot open device %s."), device_path(hash_device));
+		r = -EIO;
+		goto out;
+	}
+
+	crypt_progress_start(cd, "verity-create");
+
+	while (block < l.blocks) {
+		n = l.blocks - block;
+		if (n > chunk_blocks)
+			n = chunk_blocks;
+		len = n * l.data_block_size;
+
+		rlen = read_buffer(stream_fd, buffer, len);
+		if (rlen != (ssize_t)len) {
+			log_err(cd, _("Data stream ended prematurely at block %" PRIu64 "."),
+				block + (rlen > 0 ? (uint64_t)rlen / l.data_block_size : 0));
+			r = -EIO;
+			goto out;
+		}
+
+		if (write_lseek_blockwise(data_fd, device_block_size(data_device),
+					  device_alignment(data_device), buffer, len,
+					  block * l.data_block_size) != (ssize_t)len) {
+			log_dbg("Cannot write data device block.");
+			r = -EIO;
+			goto out;
+		}
+
+		for (i = 0; i < (int)n && !r; i++)
+			r = stream_data_block(&st, (char *)buffer + i * l.data_block_size,
+					      l.data_block_size);
+		if (r)
+			goto out;
+
+		block += n;
+		crypt_progress_update(cd, (uint64_t)l.blocks * l.data_block_size,
+				      (uint64_t)block * l.data_block_size);
+	}
+
+	/* Flush partially filled blocks, upper levels receive their last digests */
+	for (i = 0; i < st.levels && !r; i++)
+		if (st.fill[i])
+			r = stream_flush_level(&st, i);
+	if (r)
+		goto out;
+
+	for (i = 0; i < st.levels; i++)
+		if (st.written[i] != hash_level_size[i]) {
+			log_dbg("Hash level %d: %" PRIu64 " blocks written, %" PRIu64 " expected.",
+				i, st.written[i], hash_level_size[i]);
+			r = -EINVAL;
+			goto out;
+		}
+
+	fsync(data_fd);
+	fsync(st.hash_fd);
+	memcpy(root_hash, calculated_digest, root_hash_size);
+out:
+	if (r == -EIO)
+		log_err(cd, _("Input/output error while creating hash area."));
+	else if (r && r != -ENOMEM)
+		log_err(cd, _("Creation of hash area failed."));
+
+	if (data_fd >= 0)
+		device_close(data_device, data_fd);
+	if (st.hash_fd >= 0)
+		device_close(hash_device, st.hash_fd);
+	if (st.ctx)
+		crypt_hash_destroy(st.ctx);
+	if (st.salted)
+		crypt_hash_destroy(st.salted);
+	for (i = 0; i < st.levels; i++)
+		free(st.block[i]);
+	free(buffer);
+	return r;
+}
+
+/* Verify verity device using userspace crypto backend */
+int VERITY_verify(struct crypt_device *cd,
+		  struct crypt_params_verity *verity_hdr,
+		  const char *root_hash,
+		  size_t root_hash_size)
+{
+	return VERITY_create_or_verify_hash(cd, 1,
+		verity_hdr->hash_type,
+		verity_hdr->hash_name,
+		crypt_metadata_device(cd),
+		crypt_data_device(cd),
+		verity_hdr->hash_block_size,
+		verity_hdr->data_block_size,
+		verity_hdr->data_size,
+		VERITY_hash_offset_block(verity_hdr),
+		CONST_CAST(char*)root_hash,
+		root_hash_size,
+		verity_hdr->salt,
+		verity_hdr->salt_size,
+		crypt_get_verity_threads(cd),
+		crypt_get_verity_sample(cd),
+		NULL);
+}
+
+/*
+ * Verify all blocks (sampling is not used), collect every block failing
+ * verification and repair it from FEC device (if set) before the next hash
+ * level is verified.
+ */
+int VERITY_verify_repair(struct crypt_device *cd,
+			 struct crypt_params_verity *verity_hdr,
+			 struct device *fec_device,
+			 const char *root_hash,
+			 size_t root_hash_size,
+			 uint64_t *repaired,
+			 uint64_t *unrecoverable)
+{
+	struct verity_scrub scrub = {
+		.params = verity_hdr,
+		.fec_device = fec_device,
+	};
+	int r;
+
+	if (fec_device && verity_hdr->data_block_size != verity_hdr->hash_block_size) {
+		log_err(cd, _("Block sizes must match for FEC."));
+		return -EINVAL;
+	}
+
+	r = VERITY_create_or_verify_hash(cd, 1,
+		verity_hdr->hash_type,
 		verity_hdr->hash_name,
 		crypt_metadata_device(cd),
 		crypt_data_device(cd),
@@ -412,7 +1268,22 @@ int VERITY_verify(struct crypt_device *cd,
 		CONST_CAST(char*)root_hash,
 		root_hash_size,
 		verity_hdr->salt,
-		verity_hdr->salt_size);
+		verity_hdr->salt_size,
+		crypt_get_verity_threads(cd),
+		0,
+		&scrub);
+
+	failed_free(&scrub.failed);
+
+	log_dbg("Verity scrub repaired %" PRIu64 " blocks, %" PRIu64 " blocks unrecoverable.",
+		scrub.repaired, scrub.unrecoverable);
+
+	if (repaired)
+		*repaired = scrub.repaired;
+	if (unrecoverable)
+		*unrecoverable = scrub.unrecoverable;
+
+	return r;
 }
 
 /* Create verity hash */
@@ -430,6 +1301,9 @@ int VERITY_create(struct crypt_device *cd,
 		log_err(cd, _("WARNING: Kernel cannot activate device if data "
 			      "block size exceeds page size (%u)."), pgsize);
 
+	if (verity_hdr->flags & CRYPT_VERITY_DATA_STREAM)
+		return VERITY_create_stream(cd, verity_hdr, root_hash, root_hash_size);
+
 	return VERITY_create_or_verify_hash(cd, 0,
 		verity_hdr->hash_type,
 		verity_hdr->hash_name,
@@ -442,7 +1316,607 @@ int VERITY_create(struct crypt_device *cd,
 		root_hash,
 		root_hash_size,
 		verity_hdr->salt,
-		verity_hdr->salt_size);
+		verity_hdr->salt_size,
+		crypt_get_verity_threads(cd),
+		0,
+		NULL);
+}
+
+/*
+ * Recalculate only hash blocks covering changed data block ranges.
+ * Changed blocks of one level are mapped to the hash blocks of the next level
+ * (through hash_levels() offsets) up to the top level block and root hash.
+ * Unchanged hash blocks are trusted as they are on the hash device.
+ * If fec_blocks is set, it returns all rewritten blocks in FEC input space
+ * (data blocks followed by blocks of the hash area).
+ */
+int VERITY_update(struct crypt_device *cd,
+		  struct crypt_params_verity *verity_hdr,
+		  const struct crypt_verity_range *ranges,
+		  size_t count,
+		  char *root_hash,
+		  size_t root_hash_size,
+		  struct crypt_verity_range **fec_blocks,
+		  size_t *fec_count)
+{
+	struct device *data_device = crypt_data_device(cd);
+	struct device *hash_device = crypt_metadata_device(cd);
+	char calculated_digest[root_hash_size];
+	struct verity_level l = {
+		.hash_name = verity_hdr->hash_name,
+		.salt = verity_hdr->salt,
+		.salt_size = verity_hdr->salt_size,
+		.digest_size = root_hash_size,
+		.version = verity_hdr->hash_type,
+		.verify = 0,
+		.hash_block_size = verity_hdr->hash_block_size,
+	};
+	struct verity_worker w = { .level = &l, .rd = -1, .wr = -1 };
+	struct crypt_verity_range *cur = NULL, *touched = NULL;
+	off_t hash_level_block[VERITY_MAX_LEVELS];
+	off_t hash_level_size[VERITY_MAX_LEVELS];
+	off_t hash_start, hash_position;
+	size_t hash_per_block, i, n, ntouched = 0;
+	int levels, fd_data = -1, fd_hash = -1, r;
+
+	if (!count)
+		return -EINVAL;
+
+	hash_start = hash_position = VERITY_hash_offset_block(verity_hdr);
+	if (hash_levels(verity_hdr->hash_block_size, root_hash_size, verity_hdr->data_size,
+			&hash_position, &levels, &hash_level_block[0], &hash_level_size[0])) {
+		log_err(cd, _("Hash area overflow."));
+		return -EINVAL;
+	}
+	hash_per_block = 1 << get_bits_down(verity_hdr->hash_block_size / root_hash_size);
+
+	cur = malloc(count * sizeof(*cur));
+	if (fec_blocks)
+		touched = malloc(count * (levels + 1) * sizeof(*touched));
+	if (!cur || (fec_blocks && !touched)) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!ranges[i].length || ranges[i].offset >= verity_hdr->data_size ||
+		    ranges[i].length > verity_hdr->data_size - ranges[i].offset) {
+			log_err(cd, _("Data block range %" PRIu64 "-%" PRIu64 " is outside of data area."),
+				ranges[i].offset, ranges[i].offset + ranges[i].length);
+			free(cur);
+			free(touched);
+			return -EINVAL;
+		}
+		cur[i] = ranges[i];
+	}
+	count = VERITY_ranges_merge(cur, count);
+
+	log_dbg("Updating hash of %zu data block ranges, %d hash levels.", count, levels);
+
+	if (touched) {
+		memcpy(touched, cur, count * sizeof(*cur));
+		ntouched = count;
+	}
+
+	fd_data = device_open(data_device, O_RDONLY);
+	if (fd_data < 0) {
+		log_err(cd, _("Cannot open device %s."), device_path(data_device));
+		r = -EIO;
+		goto out;
+	}
+	fd_hash = device_open(hash_device, O_RDWR);
+	if (fd_hash < 0) {
+		log_err(cd, _("Cannot open device %s."), device_path(hash_device));
+		r = -EIO;
+		goto out;
+	}
+
+	w.wr = fd_hash;
+	w.wr_bsize = device_block_size(hash_device);
+	w.wr_alignment = device_alignment(hash_device);
+
+	for (i = 0; i < (size_t)levels; i++) {
+		if (!i) {
+			l.data_offset = 0;
+			l.data_block_size = verity_hdr->data_block_size;
+			l.blocks = verity_hdr->data_size;
+			w.rd = fd_data;
+			w.rd_bsize = device_block_size(data_device);
+			w.rd_alignment = device_alignment(data_device);
+		} else {
+			l.data_block_size = verity_hdr->hash_block_size;
+			l.blocks = hash_level_size[i - 1];
+			w.rd = fd_hash;
+			w.rd_bsize = w.wr_bsize;
+			w.rd_alignment = w.wr_alignment;
+			if (mult_overflow(&l.data_offset, hash_level_block[i - 1], verity_hdr->hash_block_size)) {
+				log_err(cd, _("Device offset overflow."));
+				r = -EINVAL;
+				goto out;
+			}
+		}
+
+		if (mult_overflow(&l.hash_offset, hash_level_block[i], verity_hdr->hash_block_size)) {
+			log_err(cd, _("Device offset overflow."));
+			r = -EINVAL;
+			goto out;
+		}
+
+		/* input blocks of this level -> hash blocks of this level (next level input) */
+		for (n = 0; n < count; n++) {
+			cur[n].length = (cur[n].offset + cur[n].length - 1) / hash_per_block -
+					cur[n].offset / hash_per_block + 1;
+			cur[n].offset /= hash_per_block;
+		}
+		count = VERITY_ranges_merge(cur, count);
+
+		for (n = 0; n < count; n++) {
+			w.first_hash_block = cur[n].offset;
+			w.hash_blocks = cur[n].length;
+			r = create_or_verify_range(&w);
+			if (r)
+				goto out;
+
+			if (touched) {
+				touched[ntouched].offset = verity_hdr->data_size +
+					hash_level_block[i] - hash_start + cur[n].offset;
+				touched[ntouched++].length = cur[n].length;
+			}
+		}
+	}
+
+	if (levels)
+		r = calculate_root(hash_device,
+				   (off_t)hash_level_block[levels - 1] * verity_hdr->hash_block_size,
+				   verity_hdr->hash_block_size, &l, calculated_digest);
+	else
+		r = calculate_root(data_device, 0, verity_hdr->data_block_size, &l, calculated_digest);
+
+	if (!r) {
+		fsync(fd_hash);
+		memcpy(root_hash, calculated_digest, root_hash_size);
+	}
+out:
+	if (r == -EIO)
+		log_err(cd, _("Input/output error while creating hash area."));
+	else if (r && r != -ENOMEM)
+		log_err(cd, _("Update of hash area failed."));
+
+	if (fd_data >= 0)
+		device_close(data_device, fd_data);
+	if (fd_hash >= 0)
+		device_close(hash_device, fd_hash);
+	free(cur);
+	if (!r && touched) {
+		*fec_blocks = touched;
+		*fec_count = VERITY_ranges_merge(touched, ntouched);
+	} else
+		free(touched);
+	return r;
+}
+
+/*
+ * Read [offset, offset + len) of the hash device in requests of up to
+ * VERITY_IO_BUFFER bytes, either into dst or (dst == NULL) into scratch buffer.
+ */
+static int preload_read(int fd, char *dst, char *scratch, off_t offset, size_t len)
+{
+	size_t chunk;
+
+	for (; len; len -= chunk, offset += chunk) {
+		chunk = len > VERITY_IO_BUFFER ? VERITY_IO_BUFFER : len;
+		if (read_buffer_at(fd, dst ?: scratch, chunk, offset) != (ssize_t)chunk)
+			return -EIO;
+		if (dst)
+			dst += chunk;
+	}
+
+	return 0;
+}
+
+/* Check count hash blocks against digests stored in parent level (or root hash) */
+static int preload_verify(const struct verity_level *l, struct crypt_hash *ctx,
+			  struct crypt_hash *salted, const char *blocks,
+			  off_t first, off_t count,
+			  const char *parent, const char *root_hash)
+{
+	size_t hash_per_block = 1 << get_bits_down(l->hash_block_size / l->digest_size);
+	size_t digest_step = l->version ? (size_t)1 << get_bits_up(l->digest_size) : l->digest_size;
+	char digest[l->digest_size];
+	const char *expected;
+	off_t b;
+
+	for (b = first; b < first + count; b++) {
+		if (verify_hash_block(ctx, salted, l->version, digest, l->digest_size,
+				      &blocks[(b - first) * l->hash_block_size], l->hash_block_size,
+				      l->salt, l->salt_size))
+			return -EINVAL;
+
+		expected = parent ? &parent[(b / hash_per_block) * l->hash_block_size +
+					    (b % hash_per_block) * digest_step] : root_hash;
+		if (memcmp(digest, expected, l->digest_size))
+			return -EPERM;
+	}
+
+	return 0;
+}
+
+/* Leaf level is preloaded in VERITY_IO_BUFFER chunks spread evenly over the level */
+static bool preload_leaf_chunk(off_t chunk, unsigned leaf_percent)
+{
+	return ((chunk + 1) * leaf_percent) / 100 != (chunk * leaf_percent) / 100;
+}
+
+/*
+ * dm-verity keeps hash blocks in its own (dm-bufio) cache that bypasses
+ * the page cache of the hash device. The only way to fill it from userspace
+ * is reading through the active device: one data block read loads its leaf
+ * hash block and all parents, so one read per level 1 block loads all upper
+ * levels and one read per selected leaf block loads the leaf fraction.
+ */
+static int preload_active(struct crypt_device *cd, const char *name,
+			  struct crypt_params_verity *verity_hdr,
+			  off_t leaf_blocks, size_t hash_per_block,
+			  off_t chunk_blocks, unsigned leaf_percent)
+{
+	char path[PATH_MAX];
+	void *buf = NULL;
+	off_t leaf;
+	int fd, r = 0;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dm_get_dir(), name) < 0)
+		return -EINVAL;
+
+	fd = open(path, O_RDONLY | O_DIRECT | O_CLOEXEC);
+	if (fd < 0) {
+		log_err(cd, _("Cannot open device %s."), path);
+		return -EIO;
+	}
+
+	if (posix_memalign(&buf, crypt_getpagesize(), verity_hdr->data_block_size)) {
+		close(fd);
+		return -ENOMEM;
+	}
+
+	for (leaf = 0; leaf < leaf_blocks && !r; leaf++) {
+		if (leaf % hash_per_block && !preload_leaf_chunk(leaf / chunk_blocks, leaf_percent))
+			continue;
+		if (read_buffer_at(fd, buf, verity_hdr->data_block_size,
+				   (off_t)(leaf * hash_per_block) * verity_hdr->data_block_size) !=
+		    (ssize_t)verity_hdr->data_block_size)
+			r = -EIO;
+	}
+
+	if (r)
+		log_err(cd, _("Cannot read device %s."), path);
+	free(buf);
+	close(fd);
+	return r;
+}
+
+/*
+ * Preload hash tree: all levels above leaves and leaf_percent of the leaf level
+ * are read from the hash device with large sequential requests (upper levels
+ * are stored together before the leaf level). With verify, every preloaded
+ * block is checked against its parent digest and the top block against root hash;
+ * the whole level is kept in memory while the level below is verified.
+ * If name is set, hash blocks are then pulled into the active device cache.
+ */
+int VERITY_preload(struct crypt_device *cd,
+		   struct crypt_params_verity *verity_hdr,
+		   const char *name,
+		   const char *root_hash,
+		   size_t root_hash_size,
+		   unsigned leaf_percent,
+		   int verify)
+{
+	struct device *hash_device = crypt_metadata_device(cd);
+	struct verity_level l = {
+		.hash_name = verity_hdr->hash_name,
+		.salt = verity_hdr->salt,
+		.salt_size = verity_hdr->salt_size,
+		.digest_size = root_hash_size,
+		.version = verity_hdr->hash_type,
+		.verify = verify,
+		.hash_block_size = verity_hdr->hash_block_size,
+	};
+	off_t hash_level_block[VERITY_MAX_LEVELS];
+	off_t hash_level_size[VERITY_MAX_LEVELS];
+	off_t hash_position, offset, chunk, chunks, chunk_blocks, count;
+	char *scratch = NULL, *level = NULL, *parent = NULL;
+	struct crypt_hash *ctx = NULL, *salted = NULL;
+	size_t hash_per_block;
+	int i, levels, fd = -1, r = 0;
+
+	if (leaf_percent > 100 || (verify && !root_hash))
+		return -EINVAL;
+
+	hash_position = VERITY_hash_offset_block(verity_hdr);
+	if (hash_levels(verity_hdr->hash_block_size, root_hash_size, verity_hdr->data_size,
+			&hash_position, &levels, &hash_level_block[0], &hash_level_size[0])) {
+		log_err(cd, _("Hash area overflow."));
+		return -EINVAL;
+	}
+
+	/* Single data block, root hash is the whole tree */
+	if (!levels)
+		return 0;
+
+	hash_per_block = 1 << get_bits_down(verity_hdr->hash_block_size / root_hash_size);
+	chunk_blocks = VERITY_IO_BUFFER / verity_hdr->hash_block_size;
+	chunks = (hash_level_size[0] + chunk_blocks - 1) / chunk_blocks;
+
+	log_dbg("Preloading %d hash levels above leaves and %u%% of leaf level.",
+		levels - 1, leaf_percent);
+
+	/* Page cache is what we want to fill here, do not use (possibly direct-io) device fd */
+	fd = open(device_path(hash_device), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		log_err(cd, _("Cannot open device %s."), device_path(hash_device));
+		return -EIO;
+	}
+
+	scratch = malloc(VERITY_IO_BUFFER);
+	if (!scratch) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	if (verify) {
+		salted = salt_midstate_init(l.hash_name, l.version, l.salt, l.salt_size);
+		if (crypt_hash_init(&ctx, l.hash_name)) {
+			r = -EINVAL;
+			goto out;
+		}
+	}
+
+	for (i = levels - 1; i > 0; i--) {
+		if (mult_overflow(&offset, hash_level_block[i], verity_hdr->hash_block_size)) {
+			log_err(cd, _("Device offset overflow."));
+			r = -EINVAL;
+			goto out;
+		}
+
+		if (verify && !(level = malloc(hash_level_size[i] * verity_hdr->hash_block_size))) {
+			r = -ENOMEM;
+			goto out;
+		}
+
+		r = preload_read(fd, level, scratch, offset,
+				 hash_level_size[i] * verity_hdr->hash_block_size);
+		if (!r && verify)
+			r = preload_verify(&l, ctx, salted, level, 0, hash_level_size[i],
+					   parent, root_hash);
+		if (r)
+			goto out;
+
+		free(parent);
+		parent = level;
+		level = NULL;
+	}
+
+	if (mult_overflow(&offset, hash_level_block[0], verity_hdr->hash_block_size)) {
+		log_err(cd, _("Device offset overflow."));
+		r = -EINVAL;
+		goto out;
+	}
+
+	for (chunk = 0; chunk < chunks && leaf_percent; chunk++) {
+		if (!preload_leaf_chunk(chunk, leaf_percent))
+			continue;
+
+		count = hash_level_size[0] - chunk * chunk_blocks;
+		if (count > chunk_blocks)
+			count = chunk_blocks;
+
+		r = preload_read(fd, NULL, scratch,
+				 offset + chunk * chunk_blocks * verity_hdr->hash_block_size,
+				 count * verity_hdr->hash_block_size);
+		if (!r && verify)
+			r = preload_verify(&l, ctx, salted, scratch, chunk * chunk_blocks,
+					   count, parent, root_hash);
+		if (r)
+			goto out;
+	}
+
+	close(fd);
+	fd = -1;
+
+	if (name)
+		r = preload_active(cd, name, verity_hdr, hash_level_size[0],
+				   hash_per_block, chunk_blocks, leaf_percent);
+out:
+	if (r == -EIO)
+		log_err(cd, _("Input/output error while preloading hash area."));
+	else if (r == -EPERM)
+		log_err(cd, _("Verification of hash area failed."));
+
+	if (fd >= 0)
+		close(fd);
+	if (ctx)
+		crypt_hash_destroy(ctx);
+	if (salted)
+		crypt_hash_destroy(salted);
+	free(scratch);
+	free(level);
+	free(parent);
+	return r;
+}
+
+/*
+ * In-memory benchmark (no device I/O): every thread hashes the same data buffer
+ * with its own context, either data blocks only or the whole tree up to the root.
+ */
+#define VERITY_BENCH_SIZE	(16 * 1024 * 1024)
+#define VERITY_BENCH_TIME_MS	500
+#define VERITY_BENCH_MAX_SALT	256
+
+struct verity_bench {
+	const char *hash_name;
+	int version;
+	size_t block_size;
+	size_t digest_size;
+	char salt[VERITY_BENCH_MAX_SALT];
+	size_t salt_size;
+	const char *data;
+	size_t data_size;
+	int tree;
+
+	pthread_t thread;
+	double mbs;
+	int r;
+};
+
+static double bench_time_ms(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		return 0.0;
+
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / (1000.0 * 1000);
+}
+
+static int verity_bench_once(struct verity_bench *b, struct crypt_hash *ctx,
+			     struct crypt_hash *salted)
+{
+	size_t hash_per_block = 1 << get_bits_down(b->block_size / b->digest_size);
+	size_t digest_step = b->version ? 1 << get_bits_up(b->digest_size) : b->digest_size;
+	size_t i, n = b->data_size / b->block_size, out_blocks;
+	char digest[b->digest_size], *level = NULL, *next = NULL;
+	const char *in = b->data;
+	int r = 0;
+
+	do {
+		out_blocks = (n + hash_per_block - 1) / hash_per_block;
+		if (b->tree && !(next = calloc(out_blocks, b->block_size))) {
+			r = -ENOMEM;
+			break;
+		}
+
+		for (i = 0; i < n && !r; i++)
+			r = verify_hash_block(ctx, salted, b->version,
+				next ? &next[(i / hash_per_block) * b->block_size +
+					     (i % hash_per_block) * digest_step] : digest,
+				b->digest_size, &in[i * b->block_size], b->block_size,
+				b->salt, b->salt_size);
+
+		free(level);
+		in = level = next;
+		next = NULL;
+		n = out_blocks;
+	} while (!r && b->tree && n > 1);
+
+	/* root hash */
+	if (!r && b->tree)
+		r = verify_hash_block(ctx, salted, b->version, digest, b->digest_size,
+				      in, b->block_size, b->salt, b->salt_size);
+	free(level);
+	return r ? -EINVAL : 0;
+}
+
+static int verity_bench_run(struct verity_bench *b)
+{
+	struct crypt_hash *ctx = NULL, *salted;
+	double start, ms = 0.0;
+	uint64_t bytes = 0;
+	int r = 0;
+
+	if (crypt_hash_init(&ctx, b->hash_name))
+		return -ENOENT;
+	salted = salt_midstate_init(b->hash_name, b->version, b->salt, b->salt_size);
+
+	start = bench_time_ms();
+	while (!r && ms < VERITY_BENCH_TIME_MS) {
+		r = verity_bench_once(b, ctx, salted);
+		bytes += b->data_size;
+		ms = bench_time_ms() - start;
+	}
+
+	if (!r)
+		b->mbs = (double)bytes / (1024 * 1024) / (ms / 1000.0);
+
+	if (salted)
+		crypt_hash_destroy(salted);
+	crypt_hash_destroy(ctx);
+	return r;
+}
+
+static void *verity_bench_thread(void *arg)
+{
+	struct verity_bench *b = arg;
+
+	b->r = verity_bench_run(b);
+	return NULL;
+}
+
+int VERITY_benchmark(struct crypt_device *cd,
+		     const char *hash_name,
+		     int version,
+		     size_t block_size,
+		     size_t salt_size,
+		     unsigned threads,
+		     int tree,
+		     double *mbs)
+{
+	struct verity_bench *b;
+	char *data = NULL;
+	int digest_size, r = 0;
+	unsigned i, started;
+
+	digest_size = crypt_hash_size(hash_name);
+	if (digest_size <= 0)
+		return -ENOENT;
+
+	if (!threads)
+		threads = 1;
+	if (salt_size > VERITY_BENCH_MAX_SALT || (size_t)digest_size > block_size)
+		return -EINVAL;
+
+	b = calloc(threads, sizeof(*b));
+	if (!b || posix_memalign((void **)&data, crypt_getpagesize(), VERITY_BENCH_SIZE)) {
+		free(b);
+		return -ENOMEM;
+	}
+
+	r = crypt_random_get(cd, data, VERITY_BENCH_SIZE, CRYPT_RND_NORMAL);
+	for (i = 0; !r && i < threads; i++) {
+		b[i].hash_name = hash_name;
+		b[i].version = version;
+		b[i].block_size = block_size;
+		b[i].digest_size = digest_size;
+		b[i].salt_size = salt_size;
+		b[i].data = data;
+		b[i].data_size = VERITY_BENCH_SIZE;
+		b[i].tree = tree;
+		r = crypt_random_get(cd, b[i].salt, salt_size, CRYPT_RND_NORMAL);
+	}
+	if (r < 0)
+		goto out;
+
+	if (threads == 1)
+		b[0].r = verity_bench_run(&b[0]);
+	else {
+		for (started = 0; started < threads; started++)
+			if (pthread_create(&b[started].thread, NULL, verity_bench_thread, &b[started])) {
+				r = -ENOMEM;
+				break;
+			}
+		for (i = 0; i < started; i++)
+			pthread_join(b[i].thread, NULL);
+		if (r)
+			goto out;
+	}
+
+	*mbs = 0.0;
+	for (i = 0; i < threads && !r; i++) {
+		r = b[i].r;
+		*mbs += b[i].mbs;
+	}
+out:
+	free(data);
+	free(b);
+	return r;
 }
 
 uint64_t VERITY_hash_blocks(struct crypt_device *cd, struct crypt_params_verity *params)
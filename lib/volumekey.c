@@ -33,7 +33,7 @@ struct volume_key *crypt_alloc_volume_key(size_t keylength, const char *key)
 	if (keylength > (SIZE_MAX - sizeof(*vk)))
 		return NULL;
 
-	vk = malloc(sizeof(*vk) + keylength);
+	vk = crypt_safe_alloc(sizeof(*vk) + keylength);
 	if (!vk)
 		return NULL;
 
@@ -70,7 +70,7 @@ void crypt_free_volume_key(struct volume_key *vk)
 		crypt_memzero(vk->key, vk->keylength);
 		vk->keylength = 0;
 		free(CONST_CAST(void*)vk->key_description);
-		free(vk);
+		crypt_safe_free(vk);
 	}
 }
 
@@ -124,4 +124,15 @@ print("deact.  :", r)
 del c
 del c2
 
+c = pycryptsetup.CryptSetup(
+        device = IMG,
+        name = DEVICE,
+        yesDialog = askyes,
+        logFunc = log)
+
+print("actBatch:", pycryptsetup.activateBatch([(c, DEVICE, PASSWORD)]))
+print_status(c)
+print("deBatch :", pycryptsetup.deactivateBatch([c]))
+del c
+
 os.remove(IMG)
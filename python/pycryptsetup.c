@@ -36,6 +36,7 @@
           ob = Py_InitModule3(name, methods, doc);
 #else
   #define PyInt_AsLong PyLong_AsLong
+  #define PyInt_FromLong PyLong_FromLong
   #define PyInt_Check PyLong_Check
   #define MOD_ERROR_VAL NULL
   #define MOD_SUCCESS_VAL(val) val
@@ -55,52 +56,84 @@ typedef struct {
 	struct crypt_device *device;
 	char *activated_as;
 
+	/* Serializes library calls on device, taken with the GIL released */
+	PyThread_type_lock lock;
+
 	/* Callbacks */
 	PyObject *yesDialogCB;
 	PyObject *cmdLineLogCB;
 } CryptSetupObject;
 
+/*
+ * Library calls run without the GIL so that PBKDF work in one thread does
+ * not block the interpreter; callbacks reacquire it. The device lock is
+ * only ever waited for with the GIL released, so a callback running in
+ * the lock holder can always get the GIL.
+ */
+static void device_lock(CryptSetupObject *self)
+{
+	if (PyThread_acquire_lock(self->lock, NOWAIT_LOCK))
+		return;
+
+	Py_BEGIN_ALLOW_THREADS
+	PyThread_acquire_lock(self->lock, WAIT_LOCK);
+	Py_END_ALLOW_THREADS
+}
+
+static void device_unlock(CryptSetupObject *self)
+{
+	PyThread_release_lock(self->lock);
+}
+
 static int yesDialog(const char *msg, void *this)
 {
 	CryptSetupObject *self = this;
 	PyObject *result, *arglist;
-	int r;
+	PyGILState_STATE gil;
+	int r = 1;
 
+	gil = PyGILState_Ensure();
 	if (self->yesDialogCB){
 		arglist = Py_BuildValue("(s)", msg);
-		if (!arglist)
-			return -ENOMEM;
+		if (!arglist) {
+			r = -ENOMEM;
+			goto out;
+		}
 
 		result = PyEval_CallObject(self->yesDialogCB, arglist);
 		Py_DECREF(arglist);
 
-		if (!result)
-			return -EINVAL;
+		if (!result) {
+			r = -EINVAL;
+			goto out;
+		}
 
 		if (!PyArg_Parse(result, "i", &r))
 			r = -EINVAL;
 
 		Py_DECREF(result);
-		return r;
 	}
-
-	return 1;
+out:
+	PyGILState_Release(gil);
+	return r;
 }
 
 static void cmdLineLog(int cls, const char *msg, void *this)
 {
 	CryptSetupObject *self = this;
 	PyObject *result, *arglist;
+	PyGILState_STATE gil;
 
+	gil = PyGILState_Ensure();
 	if(self->cmdLineLogCB) {
 		arglist = Py_BuildValue("(is)", cls, msg);
-		if(!arglist)
-			return;
-
-		result = PyEval_CallObject(self->cmdLineLogCB, arglist);
-		Py_DECREF(arglist);
-		Py_XDECREF(result);
+		if(arglist) {
+			result = PyEval_CallObject(self->cmdLineLogCB, arglist);
+			Py_DECREF(arglist);
+			Py_XDECREF(result);
+		}
 	}
+	PyGILState_Release(gil);
 }
 
 static void CryptSetup_dealloc(CryptSetupObject* self)
@@ -113,6 +146,9 @@ static void CryptSetup_dealloc(CryptSetupObject* self)
 
 	crypt_free(self->device);
 
+	if (self->lock)
+		PyThread_free_lock(self->lock);
+
 	/* free self */
 	Py_TYPE(self)->tp_free((PyObject*)self);
 }
@@ -125,6 +161,11 @@ static PyObject *CryptSetup_new(PyTypeObject *type, PyObject *args, PyObject *kw
 		self->yesDialogCB = NULL;
 		self->cmdLineLogCB = NULL;
 		self->activated_as = NULL;
+		self->lock = PyThread_allocate_lock();
+		if (!self->lock) {
+			Py_DECREF(self);
+			return PyErr_NoMemory();
+		}
 	}
 
 	return (PyObject *)self;
@@ -164,18 +205,26 @@ static int CryptSetup_init(CryptSetupObject* self, PyObject *args, PyObject *kwd
 		return -1;
 
 	if (device) {
-		if (crypt_init(&(self->device), device)) {
+		Py_BEGIN_ALLOW_THREADS
+		r = crypt_init(&(self->device), device);
+		Py_END_ALLOW_THREADS
+		if (r) {
 			PyErr_SetString(PyExc_IOError, "Device cannot be opened");
 			return -1;
 		}
 		/* Try to load header form device */
+		Py_BEGIN_ALLOW_THREADS
 		r = crypt_load(self->device, NULL, NULL);
+		Py_END_ALLOW_THREADS
 		if (r && r != -EINVAL) {
 			PyErr_SetString(PyExc_RuntimeError, "Cannot initialize device context");
 			return -1;
 		}
 	} else if (deviceName) {
-		if (crypt_init_by_name(&(self->device), deviceName)) {
+		Py_BEGIN_ALLOW_THREADS
+		r = crypt_init_by_name(&(self->device), deviceName);
+		Py_END_ALLOW_THREADS
+		if (r) {
 			PyErr_SetString(PyExc_IOError, "Device cannot be opened");
 			return -1;
 		}
@@ -222,13 +271,17 @@ static PyObject *CryptSetup_activate(CryptSetupObject* self, PyObject *args, PyO
 		return NULL;
 
 	// FIXME: allow keyfile and \0 in passphrase
+	device_lock(self);
+	Py_BEGIN_ALLOW_THREADS
 	is = crypt_activate_by_passphrase(self->device, name, CRYPT_ANY_SLOT,
 					  passphrase, passphrase ? strlen(passphrase) : 0, 0);
+	Py_END_ALLOW_THREADS
 
 	if (is >= 0) {
 		free(self->activated_as);
 		self->activated_as = strdup(name);
 	}
+	device_unlock(self);
 
 	return PyObjectResult(is);
 }
@@ -240,12 +293,18 @@ CryptSetup_deactivate_HELP[] =
 
 static PyObject *CryptSetup_deactivate(CryptSetupObject* self, PyObject *args, PyObject *kwds)
 {
-	int is = crypt_deactivate(self->device, self->activated_as);
+	int is;
+
+	device_lock(self);
+	Py_BEGIN_ALLOW_THREADS
+	is = crypt_deactivate(self->device, self->activated_as);
+	Py_END_ALLOW_THREADS
 
 	if (!is) {
 		free(self->activated_as);
 		self->activated_as = NULL;
 	}
+	device_unlock(self);
 
 	return PyObjectResult(is);
 }
@@ -317,7 +376,9 @@ static PyObject *CryptSetup_luksUUID(CryptSetupObject* self, PyObject *args, PyO
 {
 	PyObject *result;
 
+	device_lock(self);
 	result = Py_BuildValue("s", crypt_get_uuid(self->device));
+	device_unlock(self);
 	if (!result)
 		PyErr_SetString(PyExc_RuntimeError, "Error during constructing values for return value");
 
@@ -331,7 +392,15 @@ CryptSetup_isLuks_HELP[] =
 
 static PyObject *CryptSetup_isLuks(CryptSetupObject* self, PyObject *args, PyObject *kwds)
 {
-	return PyObjectResult(crypt_load(self->device, CRYPT_LUKS1, NULL));
+	int is;
+
+	device_lock(self);
+	Py_BEGIN_ALLOW_THREADS
+	is = crypt_load(self->device, CRYPT_LUKS1, NULL);
+	Py_END_ALLOW_THREADS
+	device_unlock(self);
+
+	return PyObjectResult(is);
 }
 
 static char
@@ -344,6 +413,7 @@ static PyObject *CryptSetup_Info(CryptSetupObject* self, PyObject *args, PyObjec
 {
 	PyObject *result;
 
+	device_lock(self);
 	result = Py_BuildValue("{s:s,s:s,s:z,s:s,s:s,s:s,s:i,s:K}",
 				"dir",		crypt_get_dir(),
 				"device",	crypt_get_device_name(self->device),
@@ -356,6 +426,7 @@ static PyObject *CryptSetup_Info(CryptSetupObject* self, PyObject *args, PyObjec
 				//"mode",	(co.flags & CRYPT_FLAG_READONLY) ? "readonly" : "read/write",
 				"offset",	crypt_get_data_offset(self->device)
 				);
+	device_unlock(self);
 
 	if (!result)
 		PyErr_SetString(PyExc_RuntimeError, "Error during constructing values for return value");
@@ -376,7 +447,7 @@ static PyObject *CryptSetup_luksFormat(CryptSetupObject* self, PyObject *args, P
 {
 	static const char *kwlist[] = {"cipher", "cipherMode", "keysize", "hashMode", NULL};
 	char *cipher_mode = NULL, *cipher = NULL, *hashMode = NULL;
-	int keysize = DEFAULT_LUKS1_KEYBITS;
+	int is, keysize = DEFAULT_LUKS1_KEYBITS;
 	PyObject *keysize_object = NULL;
 	struct crypt_params_luks1 params = {};
 
@@ -400,10 +471,16 @@ static PyObject *CryptSetup_luksFormat(CryptSetupObject* self, PyObject *args, P
 	} else
 		keysize = PyInt_AsLong(keysize_object);
 
-	return PyObjectResult(crypt_format(self->device, CRYPT_LUKS1,
-				cipher ?: DEFAULT_LUKS1_CIPHER,
-				cipher_mode ?: DEFAULT_LUKS1_MODE,
-				NULL, NULL, keysize / 8, &params));
+	device_lock(self);
+	Py_BEGIN_ALLOW_THREADS
+	is = crypt_format(self->device, CRYPT_LUKS1,
+			  cipher ?: DEFAULT_LUKS1_CIPHER,
+			  cipher_mode ?: DEFAULT_LUKS1_MODE,
+			  NULL, NULL, keysize / 8, &params);
+	Py_END_ALLOW_THREADS
+	device_unlock(self);
+
+	return PyObjectResult(is);
 }
 
 static char
@@ -419,7 +496,7 @@ static PyObject *CryptSetup_addKeyByPassphrase(CryptSetupObject* self, PyObject
 	static const char *kwlist[] = {"passphrase", "newPassphrase", "slot", NULL};
 	char *passphrase = NULL, *newpassphrase = NULL;
 	size_t passphrase_len = 0, newpassphrase_len = 0;
-	int slot = CRYPT_ANY_SLOT;
+	int is, slot = CRYPT_ANY_SLOT;
 
 	if (!PyArg_ParseTupleAndKeywords(args, kwds, "ss|i", CONST_CAST(char**)kwlist, &passphrase, &newpassphrase, &slot))
 		return NULL;
@@ -430,9 +507,15 @@ static PyObject *CryptSetup_addKeyByPassphrase(CryptSetupObject* self, PyObject
 	if(newpassphrase)
 		newpassphrase_len = strlen(newpassphrase);
 
-	return PyObjectResult(crypt_keyslot_add_by_passphrase(self->device, slot,
-					passphrase, passphrase_len,
-					newpassphrase, newpassphrase_len));
+	device_lock(self);
+	Py_BEGIN_ALLOW_THREADS
+	is = crypt_keyslot_add_by_passphrase(self->device, slot,
+					     passphrase, passphrase_len,
+					     newpassphrase, newpassphrase_len);
+	Py_END_ALLOW_THREADS
+	device_unlock(self);
+
+	return PyObjectResult(is);
 }
 
 static char
@@ -447,7 +530,7 @@ static PyObject *CryptSetup_addKeyByVolumeKey(CryptSetupObject* self, PyObject *
 	static const char *kwlist[] = {"newPassphrase", "slot", NULL};
 	char *newpassphrase = NULL;
 	size_t newpassphrase_len = 0;
-	int slot = CRYPT_ANY_SLOT;
+	int is, slot = CRYPT_ANY_SLOT;
 
 	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|i", CONST_CAST(char**)kwlist, &newpassphrase, &slot))
 		return NULL;
@@ -455,8 +538,14 @@ static PyObject *CryptSetup_addKeyByVolumeKey(CryptSetupObject* self, PyObject *
 	if (newpassphrase)
 		newpassphrase_len = strlen(newpassphrase);
 
-	return PyObjectResult(crypt_keyslot_add_by_volume_key(self->device, slot,
-					NULL, 0, newpassphrase, newpassphrase_len));
+	device_lock(self);
+	Py_BEGIN_ALLOW_THREADS
+	is = crypt_keyslot_add_by_volume_key(self->device, slot,
+					     NULL, 0, newpassphrase, newpassphrase_len);
+	Py_END_ALLOW_THREADS
+	device_unlock(self);
+
+	return PyObjectResult(is);
 }
 
 static char
@@ -478,12 +567,16 @@ static PyObject *CryptSetup_removePassphrase(CryptSetupObject* self, PyObject *a
 	if (passphrase)
 		passphrase_len = strlen(passphrase);
 
+	device_lock(self);
+	Py_BEGIN_ALLOW_THREADS
 	is = crypt_activate_by_passphrase(self->device, NULL, CRYPT_ANY_SLOT,
 					  passphrase, passphrase_len, 0);
-	if (is < 0)
-		return PyObjectResult(is);
+	if (is >= 0)
+		is = crypt_keyslot_destroy(self->device, is);
+	Py_END_ALLOW_THREADS
+	device_unlock(self);
 
-	return PyObjectResult(crypt_keyslot_destroy(self->device, is));
+	return PyObjectResult(is);
 }
 
 static char
@@ -495,14 +588,24 @@ CryptSetup_killSlot_HELP[] =
 static PyObject *CryptSetup_killSlot(CryptSetupObject* self, PyObject *args, PyObject *kwds)
 {
 	static const char *kwlist[] = {"slot", NULL};
-	int slot = CRYPT_ANY_SLOT;
+	int is = -EINVAL, slot = CRYPT_ANY_SLOT;
+	crypt_keyslot_info ki;
 
 	if (!PyArg_ParseTupleAndKeywords(args, kwds, "i", CONST_CAST(char**)kwlist, &slot))
 		return NULL;
 
-	switch (crypt_keyslot_status(self->device, slot)) {
+	device_lock(self);
+	ki = crypt_keyslot_status(self->device, slot);
+	if (ki == CRYPT_SLOT_ACTIVE) {
+		Py_BEGIN_ALLOW_THREADS
+		is = crypt_keyslot_destroy(self->device, slot);
+		Py_END_ALLOW_THREADS
+	}
+	device_unlock(self);
+
+	switch (ki) {
 	case CRYPT_SLOT_ACTIVE:
-		return PyObjectResult(crypt_keyslot_destroy(self->device, slot));
+		return PyObjectResult(is);
 	case CRYPT_SLOT_ACTIVE_LAST:
 		PyErr_SetString(PyExc_ValueError, "Last slot, removing it would render the device unusable");
 		break;
@@ -531,7 +634,15 @@ static PyObject *CryptSetup_Status(CryptSetupObject* self, PyObject *args, PyObj
 		return NULL;
 	}
 
-	return PyObjectResult(crypt_status(self->device, self->activated_as));
+	crypt_status_info ci;
+
+	device_lock(self);
+	Py_BEGIN_ALLOW_THREADS
+	ci = crypt_status(self->device, self->activated_as);
+	Py_END_ALLOW_THREADS
+	device_unlock(self);
+
+	return PyObjectResult(ci);
 }
 
 static char
@@ -545,6 +656,7 @@ static PyObject *CryptSetup_Resume(CryptSetupObject* self, PyObject *args, PyObj
 	static const char *kwlist[] = {"passphrase", NULL};
 	char* passphrase = NULL;
 	size_t passphrase_len = 0;
+	int is;
 
 	if (!self->activated_as){
 		PyErr_SetString(PyExc_IOError, "Device has not been activated yet.");
@@ -557,8 +669,14 @@ static PyObject *CryptSetup_Resume(CryptSetupObject* self, PyObject *args, PyObj
 	if (passphrase)
 		passphrase_len = strlen(passphrase);
 
-	return PyObjectResult(crypt_resume_by_passphrase(self->device, self->activated_as,
-					CRYPT_ANY_SLOT, passphrase, passphrase_len));
+	device_lock(self);
+	Py_BEGIN_ALLOW_THREADS
+	is = crypt_resume_by_passphrase(self->device, self->activated_as,
+					CRYPT_ANY_SLOT, passphrase, passphrase_len);
+	Py_END_ALLOW_THREADS
+	device_unlock(self);
+
+	return PyObjectResult(is);
 }
 
 static char
@@ -568,12 +686,20 @@ CryptSetup_Suspend_HELP[] =
 
 static PyObject *CryptSetup_Suspend(CryptSetupObject* self, PyObject *args, PyObject *kwds)
 {
+	int is;
+
 	if (!self->activated_as){
 		PyErr_SetString(PyExc_IOError, "Device has not been activated yet.");
 		return NULL;
 	}
 
-	return PyObjectResult(crypt_suspend(self->device, self->activated_as));
+	device_lock(self);
+	Py_BEGIN_ALLOW_THREADS
+	is = crypt_suspend(self->device, self->activated_as);
+	Py_END_ALLOW_THREADS
+	device_unlock(self);
+
+	return PyObjectResult(is);
 }
 
 static char
@@ -609,7 +735,9 @@ static PyObject *CryptSetup_iterationTime(CryptSetupObject* self, PyObject *args
 	if (!PyArg_ParseTupleAndKeywords(args, kwds, "K", CONST_CAST(char**)kwlist, &time_ms))
 		return NULL;
 
+	device_lock(self);
 	crypt_set_iteration_time(self->device, time_ms);
+	device_unlock(self);
 
 	Py_RETURN_NONE;
 }
@@ -694,7 +822,232 @@ static PyTypeObject CryptSetupType = {
 	CryptSetup_new, /* tp_new */
 };
 
+static int device_cmp(const void *a, const void *b)
+{
+	const CryptSetupObject *x = *(CryptSetupObject * const *)a;
+	const CryptSetupObject *y = *(CryptSetupObject * const *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Lock all devices of a batch, in address order so that concurrent batches
+ * cannot deadlock. A device listed twice is rejected.
+ */
+static int batch_lock(CryptSetupObject **dev, size_t count)
+{
+	CryptSetupObject **sorted;
+	size_t i;
+
+	sorted = PyMem_Malloc(count * sizeof(*sorted));
+	if (!sorted) {
+		PyErr_NoMemory();
+		return -1;
+	}
+	memcpy(sorted, dev, count * sizeof(*sorted));
+	qsort(sorted, count, sizeof(*sorted), device_cmp);
+
+	for (i = 1; i < count; i++)
+		if (sorted[i] == sorted[i - 1]) {
+			PyMem_Free(sorted);
+			PyErr_SetString(PyExc_ValueError, "Device is listed more than once");
+			return -1;
+		}
+
+	for (i = 0; i < count; i++)
+		device_lock(sorted[i]);
+
+	PyMem_Free(sorted);
+	return 0;
+}
+
+static void batch_unlock(CryptSetupObject **dev, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		device_unlock(dev[i]);
+}
+
+/* Batch item is a CryptSetup object or a tuple starting with one */
+static PyObject *batch_items(PyObject *requests, CryptSetupObject ***dev, size_t *count)
+{
+	PyObject *items, *item;
+	Py_ssize_t i, n;
+
+	items = PySequence_Tuple(requests);
+	if (!items)
+		return NULL;
+
+	n = PyTuple_GET_SIZE(items);
+	*dev = PyMem_Malloc((n ?: 1) * sizeof(**dev));
+	if (!*dev) {
+		Py_DECREF(items);
+		return PyErr_NoMemory();
+	}
+
+	for (i = 0; i < n; i++) {
+		item = PyTuple_GET_ITEM(items, i);
+		if (PyTuple_Check(item) && PyTuple_GET_SIZE(item))
+			item = PyTuple_GET_ITEM(item, 0);
+		if (!PyObject_TypeCheck(item, &CryptSetupType) ||
+		    !((CryptSetupObject *)item)->device) {
+			PyErr_SetString(PyExc_TypeError, "Batch item must start with initialized CryptSetup object");
+			PyMem_Free(*dev);
+			Py_DECREF(items);
+			return NULL;
+		}
+		(*dev)[i] = (CryptSetupObject *)item;
+	}
+
+	*count = n;
+	return items;
+}
+
+static char
+pycryptsetup_activateBatch_HELP[] =
+"Activate several LUKS devices, unlocking keyslots concurrently\n\n\
+  activateBatch([(device, name, passphrase), ...]) -> [result, ...]\n\n\
+  device - initialized CryptSetup object (each one at most once)\n\
+  result - unlocked keyslot or negative errno, per request\n\n\
+  The GIL is released during the operation, asyncio code can run it\n\
+  with loop.run_in_executor(None, pycryptsetup.activateBatch, requests).";
+
+static PyObject *pycryptsetup_activateBatch(PyObject *module, PyObject *args, PyObject *kwds)
+{
+	static const char *kwlist[] = {"requests", NULL};
+	struct crypt_activate_request *req = NULL;
+	CryptSetupObject **dev = NULL;
+	PyObject *requests, *items, *obj, *result = NULL;
+	char *name, *passphrase;
+	size_t i, count;
+	int r;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", CONST_CAST(char**)kwlist, &requests))
+		return NULL;
+
+	items = batch_items(requests, &dev, &count);
+	if (!items)
+		return NULL;
+
+	req = PyMem_Malloc((count ?: 1) * sizeof(*req));
+	if (!req) {
+		PyErr_NoMemory();
+		goto out;
+	}
+	memset(req, 0, (count ?: 1) * sizeof(*req));
+
+	for (i = 0; i < count; i++) {
+		passphrase = NULL;
+		if (!PyArg_ParseTuple(PyTuple_GET_ITEM(items, i), "Os|z", &obj, &name, &passphrase))
+			goto out;
+		req[i].cd = dev[i]->device;
+		req[i].name = name;
+		req[i].keyslot = CRYPT_ANY_SLOT;
+		req[i].passphrase = passphrase ?: "";
+		req[i].passphrase_size = passphrase ? strlen(passphrase) : 0;
+		req[i].r = -EAGAIN;
+	}
+
+	if (batch_lock(dev, count))
+		goto out;
+
+	Py_BEGIN_ALLOW_THREADS
+	r = count ? crypt_activate_batch(req, count) : 0;
+	Py_END_ALLOW_THREADS
+
+	for (i = 0; i < count; i++) {
+		/* Batch failed before reaching the request */
+		if (r < 0 && req[i].r == -EAGAIN)
+			req[i].r = r;
+		if (req[i].r < 0)
+			continue;
+		free(dev[i]->activated_as);
+		dev[i]->activated_as = strdup(req[i].name);
+	}
+	batch_unlock(dev, count);
+
+	result = PyList_New(count);
+	for (i = 0; result && i < count; i++)
+		PyList_SET_ITEM(result, i, PyInt_FromLong(req[i].r));
+out:
+	PyMem_Free(req);
+	PyMem_Free(dev);
+	Py_DECREF(items);
+	return result;
+}
+
+static char
+pycryptsetup_deactivateBatch_HELP[] =
+"Deactivate several devices sharing one udev synchronization\n\n\
+  deactivateBatch([device, ...]) -> [result, ...]\n\n\
+  device - CryptSetup object with activated device (each one at most once)\n\
+  result - 0 or negative errno, per device";
+
+static PyObject *pycryptsetup_deactivateBatch(PyObject *module, PyObject *args, PyObject *kwds)
+{
+	static const char *kwlist[] = {"devices", NULL};
+	struct crypt_deactivate_request *req = NULL;
+	CryptSetupObject **dev = NULL;
+	PyObject *devices, *items, *result = NULL;
+	size_t i, count;
+	int r;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", CONST_CAST(char**)kwlist, &devices))
+		return NULL;
+
+	items = batch_items(devices, &dev, &count);
+	if (!items)
+		return NULL;
+
+	req = PyMem_Malloc((count ?: 1) * sizeof(*req));
+	if (!req) {
+		PyErr_NoMemory();
+		goto out;
+	}
+	memset(req, 0, (count ?: 1) * sizeof(*req));
+
+	if (batch_lock(dev, count))
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		req[i].cd = dev[i]->device;
+		req[i].name = dev[i]->activated_as;
+		if (!req[i].name) {
+			batch_unlock(dev, count);
+			PyErr_SetString(PyExc_IOError, "Device has not been activated yet.");
+			goto out;
+		}
+		req[i].r = -EAGAIN;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	r = count ? crypt_deactivate_batch(req, count) : 0;
+	Py_END_ALLOW_THREADS
+
+	for (i = 0; i < count; i++) {
+		if (r < 0 && req[i].r == -EAGAIN)
+			req[i].r = r;
+		if (req[i].r)
+			continue;
+		free(dev[i]->activated_as);
+		dev[i]->activated_as = NULL;
+	}
+	batch_unlock(dev, count);
+
+	result = PyList_New(count);
+	for (i = 0; result && i < count; i++)
+		PyList_SET_ITEM(result, i, PyInt_FromLong(req[i].r));
+out:
+	PyMem_Free(req);
+	PyMem_Free(dev);
+	Py_DECREF(items);
+	return result;
+}
+
 static PyMethodDef pycryptsetup_methods[] = {
+	{"activateBatch", (PyCFunction)pycryptsetup_activateBatch, METH_VARARGS|METH_KEYWORDS, pycryptsetup_activateBatch_HELP},
+	{"deactivateBatch", (PyCFunction)pycryptsetup_deactivateBatch, METH_VARARGS|METH_KEYWORDS, pycryptsetup_deactivateBatch_HELP},
 	{NULL} /* Sentinel */
 };
 
@@ -702,6 +1055,9 @@ MOD_INIT(pycryptsetup)
 {
 	PyObject *m;
 
+#if PY_VERSION_HEX < 0x03070000
+	PyEval_InitThreads();
+#endif
 	if (PyType_Ready(&CryptSetupType) < 0)
 		return MOD_ERROR_VAL;
 
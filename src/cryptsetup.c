@@ -23,6 +23,7 @@
 
 #include "cryptsetup.h"
 #include <uuid/uuid.h>
+#include <math.h>
 
 static const char *opt_cipher = NULL;
 static const char *opt_hash = NULL;
@@ -30,6 +31,7 @@ static int opt_verify_passphrase = 0;
 
 static const char *opt_key_file = NULL;
 static const char *opt_keyfile_stdin = NULL;
+static char opt_key_fd_path[32];
 static int opt_keyfiles_count = 0;
 static const char *opt_keyfiles[MAX_KEYFILES];
 
@@ -62,10 +64,14 @@ static int opt_shared = 0;
 static int opt_allow_discards = 0;
 static int opt_perf_same_cpu_crypt = 0;
 static int opt_perf_submit_from_crypt_cpus = 0;
+static int opt_perf_no_read_workqueue = 0;
+static int opt_perf_no_write_workqueue = 0;
+static int opt_perf_high_priority = 0;
 static int opt_test_passphrase = 0;
 static int opt_tcrypt_hidden = 0;
 static int opt_tcrypt_system = 0;
 static int opt_tcrypt_backup = 0;
+static int opt_tcrypt_chain_inline = 0;
 static int opt_veracrypt = 0;
 static int opt_veracrypt_pim = -1;
 static int opt_veracrypt_query_pim = 0;
@@ -85,9 +91,15 @@ static int opt_integrity_no_wipe = 0;
 static const char *opt_key_description = NULL;
 static int opt_sector_size = SECTOR_SIZE;
 static int opt_persistent = 0;
+static int opt_retain_key = 0;
 static const char *opt_label = NULL;
 static const char *opt_subsystem = NULL;
 static int opt_unbound = 0;
+static int opt_benchmark_storage = 0;
+static int opt_benchmark_threads = 0;
+static int opt_json = 0;
+static const char *opt_pbkdf_cache = NULL;
+static const char *opt_keyslot_history = NULL;
 
 static const char **action_argv;
 static int action_argc;
@@ -150,6 +162,15 @@ static void _set_activation_flags(uint32_t *flags)
 	if (opt_perf_submit_from_crypt_cpus)
 		*flags |= CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS;
 
+	if (opt_perf_no_read_workqueue)
+		*flags |= CRYPT_ACTIVATE_NO_READ_WORKQUEUE;
+
+	if (opt_perf_no_write_workqueue)
+		*flags |= CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE;
+
+	if (opt_perf_high_priority)
+		*flags |= CRYPT_ACTIVATE_HIGH_PRIORITY;
+
 	if (opt_integrity_nojournal)
 		*flags |= CRYPT_ACTIVATE_NO_JOURNAL;
 
@@ -369,7 +390,8 @@ static int action_open_tcrypt(void)
 		.keyfiles = opt_keyfiles,
 		.keyfiles_count = opt_keyfiles_count,
 		.flags = CRYPT_TCRYPT_LEGACY_MODES |
-			 (opt_veracrypt ? CRYPT_TCRYPT_VERA_MODES : 0),
+			 (opt_veracrypt ? CRYPT_TCRYPT_VERA_MODES : 0) |
+			 (opt_tcrypt_chain_inline ? CRYPT_TCRYPT_CHAIN_INLINE : 0),
 		.veracrypt_pim = (opt_veracrypt_pim > 0) ? opt_veracrypt_pim : 0,
 	};
 	const char *activated_name;
@@ -543,6 +565,71 @@ out:
 	return r;
 }
 
+static void status_flags(uint32_t flags)
+{
+	if (flags & (CRYPT_ACTIVATE_ALLOW_DISCARDS|
+		     CRYPT_ACTIVATE_SAME_CPU_CRYPT|
+		     CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS|
+		     CRYPT_ACTIVATE_NO_READ_WORKQUEUE|
+		     CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE|
+		     CRYPT_ACTIVATE_HIGH_PRIORITY))
+		log_std("  flags:   %s%s%s%s%s%s\n",
+			(flags & CRYPT_ACTIVATE_ALLOW_DISCARDS) ? "discards " : "",
+			(flags & CRYPT_ACTIVATE_SAME_CPU_CRYPT) ? "same_cpu_crypt " : "",
+			(flags & CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS) ? "submit_from_crypt_cpus " : "",
+			(flags & CRYPT_ACTIVATE_NO_READ_WORKQUEUE) ? "no_read_workqueue " : "",
+			(flags & CRYPT_ACTIVATE_NO_WRITE_WORKQUEUE) ? "no_write_workqueue " : "",
+			(flags & CRYPT_ACTIVATE_HIGH_PRIORITY) ? "high_priority" : "");
+}
+
+/*
+ * Status from device-mapper table only (no header load and no locking).
+ * Returns -ENOTSUP if some printed value needs on-disk metadata.
+ */
+static int status_from_table(const char *name)
+{
+	struct crypt_active_entry *e;
+	char *backing_file;
+	int r;
+
+	if (opt_header_device)
+		return -ENOTSUP;
+
+	r = crypt_get_active_entry(NULL, name, &e);
+	if (r < 0)
+		return -ENOTSUP;
+
+	/* LUKS values are the same in table, TCRYPT, loop-AES and integrity need metadata */
+	if (!e->type || strcmp(e->target, "crypt") || e->integrity || !e->cipher_mode ||
+	    (strcmp(e->type, CRYPT_LUKS1) && strcmp(e->type, CRYPT_LUKS2) &&
+	     strcmp(e->type, CRYPT_PLAIN)) || !e->device) {
+		crypt_list_active_free(e, 1);
+		return -ENOTSUP;
+	}
+
+	log_std("  type:    %s\n", e->type);
+	log_std("  cipher:  %s-%s\n", e->cipher, e->cipher_mode);
+	log_std("  keysize: %d bits\n", e->key_size * 8);
+	log_std("  key location: %s\n", (e->flags & CRYPT_ACTIVATE_KEYRING_KEY) ? "keyring" : "dm-crypt");
+	log_std("  device:  %s\n", e->device);
+	if (crypt_loop_device(e->device)) {
+		backing_file = crypt_loop_backing_file(e->device);
+		log_std("  loop:    %s\n", backing_file);
+		free(backing_file);
+	}
+	log_std("  sector size:  %d\n", e->sector_size);
+	log_std("  offset:  %" PRIu64 " sectors\n", e->offset);
+	log_std("  size:    %" PRIu64 " sectors\n", e->size);
+	if (e->iv_offset)
+		log_std("  skipped: %" PRIu64 " sectors\n", e->iv_offset);
+	log_std("  mode:    %s\n", e->flags & CRYPT_ACTIVATE_READONLY ?
+				   "readonly" : "read/write");
+	status_flags(e->flags);
+
+	crypt_list_active_free(e, 1);
+	return 0;
+}
+
 static int action_status(void)
 {
 	crypt_status_info ci;
@@ -578,6 +665,9 @@ static int action_status(void)
 			log_std("%s/%s is active%s.\n", crypt_get_dir(), action_argv[0],
 				ci == CRYPT_BUSY ? " and is in use" : "");
 
+		if (!status_from_table(action_argv[0]))
+			break;
+
 		r = crypt_init_by_name_and_header(&cd, action_argv[0], opt_header_device);
 		if (r < 0)
 			goto out;
@@ -613,13 +703,7 @@ static int action_status(void)
 			log_std("  skipped: %" PRIu64 " sectors\n", cad.iv_offset);
 		log_std("  mode:    %s\n", cad.flags & CRYPT_ACTIVATE_READONLY ?
 					   "readonly" : "read/write");
-		if (cad.flags & (CRYPT_ACTIVATE_ALLOW_DISCARDS|
-				 CRYPT_ACTIVATE_SAME_CPU_CRYPT|
-				 CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS))
-			log_std("  flags:   %s%s%s\n",
-				(cad.flags & CRYPT_ACTIVATE_ALLOW_DISCARDS) ? "discards " : "",
-				(cad.flags & CRYPT_ACTIVATE_SAME_CPU_CRYPT) ? "same_cpu_crypt " : "",
-				(cad.flags & CRYPT_ACTIVATE_SUBMIT_FROM_CRYPT_CPUS) ? "submit_from_crypt_cpus" : "");
+		status_flags(cad.flags);
 	}
 out:
 	crypt_free(cd);
@@ -707,6 +791,600 @@ static int benchmark_cipher_loop(const char *cipher, const char *cipher_mode,
 	return r;
 }
 
+/* Sector by sector encryption with IV generator, as in dm-crypt */
+static int benchmark_sector_loop(const char *cipher, const char *cipher_mode,
+				 size_t volume_key_size, size_t sector_size,
+				 double *encryption_mbs, double *decryption_mbs)
+{
+	int r, buffer_size = 1024 * 1024;
+
+	do {
+		r = crypt_benchmark_sector(NULL, cipher, cipher_mode,
+					   volume_key_size, sector_size, buffer_size,
+					   encryption_mbs, decryption_mbs);
+		if (r == -ERANGE) {
+			if (buffer_size < 1024 * 1024 * 65)
+				buffer_size *= 2;
+			else {
+				log_err(_("Result of benchmark is not reliable."));
+				r = -ENOENT;
+			}
+		}
+	} while (r == -ERANGE);
+
+	return r;
+}
+
+static int action_benchmark_sectors(const char *cipher, const char *cipher_mode,
+				    size_t key_size)
+{
+	static const size_t bsectors[] = { SECTOR_SIZE, 4096, 0 };
+	size_t opt_sectors[] = { opt_sector_size, 0 };
+	const size_t *sector = bsectors;
+	double enc_mbr = 0, dec_mbr = 0;
+	int r = 0;
+
+	if (opt_sector_size != SECTOR_SIZE)
+		sector = opt_sectors;
+
+	/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+	log_std(_("#               Algorithm |       Key |  Sector |      Encryption |      Decryption\n"));
+	for (; *sector; sector++) {
+		r = benchmark_sector_loop(cipher, cipher_mode, key_size, *sector,
+					  &enc_mbr, &dec_mbr);
+		check_signal(&r);
+		if (r == -EINTR)
+			break;
+		if (r < 0)
+			log_std("%20s-%s  %9zub  %7zu %17s %17s\n", cipher, cipher_mode,
+				key_size * 8, *sector, _("N/A"), _("N/A"));
+		else
+			log_std("%20s-%s  %9zub  %7zu %10.1f MiB/s  %10.1f MiB/s\n", cipher,
+				cipher_mode, key_size * 8, *sector, enc_mbr, dec_mbr);
+	}
+
+	if (r == -ENOENT)
+		log_err(_("Cipher %s is not available."), opt_cipher);
+	return r;
+}
+
+static int action_benchmark_storage(void)
+{
+	static struct {
+		const char *name;
+		uint32_t block_size;
+		uint32_t flags;
+	} bpatterns[] = {
+		{ "sequential", 1024 * 1024, 0 },
+		{ "random",     4096,        CRYPT_BENCHMARK_RANDOM },
+		{ NULL, 0, 0 }
+	};
+	static const uint32_t bdepths[] = { 1, 8, 32, 0 };
+	static const uint32_t bsectors[] = { SECTOR_SIZE, 4096, 0 };
+	struct crypt_params_benchmark params = {
+		.device = action_argc ? action_argv[0] : NULL,
+		.size = opt_size * SECTOR_SIZE,
+	};
+	char cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN], integrity[MAX_CIPHER_LEN];
+	double read_mbs, write_mbs, read_iops, write_iops;
+	int key_size = (opt_key_size ?: DEFAULT_LUKS1_KEYBITS) / 8, integrity_key_size;
+	const uint32_t *sector = bsectors;
+	uint32_t opt_sectors[] = { opt_sector_size, 0 };
+	int i, j, r, tests = 0, skipped = 0;
+	char *msg;
+
+	if (!strcmp(opt_type, "loopaes")) {
+		/* Multi-key v3 mapping as created by loopaesOpen (64 keys + IV seed) */
+		if (opt_integrity) {
+			log_err(_("Option --integrity is not supported for loop-AES benchmark."));
+			return -EINVAL;
+		}
+		key_size = (opt_key_size ?: DEFAULT_LOOPAES_KEYBITS) / 8 * 65;
+		r = snprintf(cipher, sizeof(cipher), "%s:64",
+			     opt_cipher ?: DEFAULT_LOOPAES_CIPHER);
+		if (r < 0 || (size_t)r >= sizeof(cipher))
+			return -EINVAL;
+		strcpy(cipher_mode, "cbc-lmk");
+		log_std(_("# loop-AES multi-key %s-%s mapping, %d keys.\n"),
+			cipher, cipher_mode, 65);
+	} else if ((r = crypt_parse_name_and_mode(opt_cipher ?: DEFAULT_CIPHER(LUKS1),
+				      cipher, NULL, cipher_mode)) < 0) {
+		log_err(_("No known cipher specification pattern detected."));
+		return r;
+	}
+
+	if (opt_integrity) {
+		r = crypt_parse_integrity_mode(opt_integrity, integrity, &integrity_key_size);
+		if (r < 0) {
+			log_err(_("No known integrity specification pattern detected."));
+			return r;
+		}
+		params.integrity = integrity;
+		key_size += integrity_key_size;
+		if (opt_integrity_nojournal)
+			params.activation_flags |= CRYPT_ACTIVATE_NO_JOURNAL;
+	}
+
+	if (params.device) {
+		if (asprintf(&msg, _("This will overwrite data on %s irrevocably."),
+			     params.device) == -1)
+			return -ENOMEM;
+		r = yesDialog(msg, _("Operation aborted.\n")) ? 0 : -EPERM;
+		free(msg);
+		if (r < 0)
+			return r;
+	} else
+		log_std(_("# Tests are using RAM-backed device (no storage IO).\n"));
+
+	/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+	log_std(_("#    Pattern | Sector | Depth |               Read |              Write\n"));
+	if (opt_sector_size != SECTOR_SIZE)
+		sector = opt_sectors;
+
+	for (; *sector; sector++) {
+		params.sector_size = *sector;
+		for (i = 0; bpatterns[i].name; i++) {
+			if (bpatterns[i].block_size < *sector)
+				continue;
+			params.block_size = bpatterns[i].block_size;
+			params.flags = bpatterns[i].flags;
+			for (j = 0; bdepths[j]; j++) {
+				params.queue_depth = bdepths[j];
+				r = crypt_benchmark_device(NULL, cipher, cipher_mode, key_size,
+							   &params, &read_mbs, &write_mbs,
+							   &read_iops, &write_iops);
+				check_signal(&r);
+				if (r == -EINTR)
+					return r;
+				tests++;
+				if (r < 0) {
+					skipped++;
+					log_std("%12s %8u %7u %20s %20s\n", bpatterns[i].name,
+						*sector, bdepths[j], _("N/A"), _("N/A"));
+					continue;
+				}
+				if (params.flags & CRYPT_BENCHMARK_RANDOM)
+					log_std("%12s %8u %7u %15.0f IOPS %15.0f IOPS\n",
+						bpatterns[i].name, *sector, bdepths[j],
+						read_iops, write_iops);
+				else
+					log_std("%12s %8u %7u %14.1f MiB/s %14.1f MiB/s\n",
+						bpatterns[i].name, *sector, bdepths[j],
+						read_mbs, write_mbs);
+			}
+		}
+	}
+
+	return skipped == tests ? r : 0;
+}
+
+/* Thread counts 1, 2, 4, ... up to requested maximum */
+static unsigned benchmark_threads_next(unsigned threads)
+{
+	if (threads >= (unsigned)opt_benchmark_threads)
+		return 0;
+	threads *= 2;
+	return threads < (unsigned)opt_benchmark_threads ? threads : (unsigned)opt_benchmark_threads;
+}
+
+static int benchmark_cipher_threads(const char *cipher, const char *cipher_mode,
+				    size_t key_size, size_t iv_size)
+{
+	double enc_mbr, dec_mbr, enc_one = 0.0;
+	int r, buffer_size = 1024 * 1024;
+	unsigned threads;
+
+	log_std(_("# %s-%s, %zu-bit key\n"), cipher, cipher_mode, key_size * 8);
+	/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+	log_std(_("# Threads |       Encryption | Per thread |       Decryption | Per thread | Scaling\n"));
+
+	for (threads = 1; threads; threads = benchmark_threads_next(threads)) {
+		do {
+			r = crypt_benchmark_threads(NULL, cipher, cipher_mode, key_size,
+						    iv_size, buffer_size, threads,
+						    &enc_mbr, &dec_mbr);
+			if (r == -ERANGE && buffer_size < 1024 * 1024 * 65)
+				buffer_size *= 2;
+		} while (r == -ERANGE && buffer_size < 1024 * 1024 * 65);
+		check_signal(&r);
+		if (r == -EINTR || r == -ENOTSUP)
+			return r;
+		if (r < 0) {
+			log_std("%9u %18s %12s %18s %12s %9s\n", threads,
+				_("N/A"), _("N/A"), _("N/A"), _("N/A"), _("N/A"));
+			continue;
+		}
+		if (threads == 1)
+			enc_one = enc_mbr;
+		log_std("%9u %12.1f MiB/s %6.1f MiB/s %12.1f MiB/s %6.1f MiB/s %8.0f%%\n",
+			threads, enc_mbr, enc_mbr / threads, dec_mbr, dec_mbr / threads,
+			enc_one > 0.0 ? enc_mbr / threads / enc_one * 100. : 0.0);
+	}
+
+	return 0;
+}
+
+static int benchmark_kdf_threads(const char *kdf, const char *hash, size_t key_size)
+{
+	struct crypt_pbkdf_type pbkdf = {
+		.type = kdf,
+		.hash = hash,
+		.time_ms = opt_iteration_time ?: 1000,
+		.max_memory_kb = opt_pbkdf_memory,
+		.parallel_threads = opt_pbkdf_parallel,
+	};
+	double per_thread, one = 0.0, traffic;
+	uint32_t time_ms;
+	unsigned threads;
+	int r;
+
+	if (!strcmp(kdf, CRYPT_KDF_PBKDF2)) {
+		pbkdf.time_ms = 1000;
+		r = crypt_benchmark_pbkdf(NULL, &pbkdf, "foo", 3, "bar", 3, key_size,
+					  &benchmark_callback, &pbkdf);
+	} else
+		r = crypt_benchmark_pbkdf(NULL, &pbkdf, "foo", 3,
+			"0123456789abcdef0123456789abcdef", 32,
+			key_size, &benchmark_callback, &pbkdf);
+	if (r < 0) {
+		log_std(_("%-10s N/A\n"), kdf);
+		return r;
+	}
+
+	if (!strcmp(kdf, CRYPT_KDF_PBKDF2))
+		log_std(_("# PBKDF2-%s, %u iterations for %zu-bit key\n"),
+			hash, pbkdf.iterations, key_size * 8);
+	else
+		log_std(_("# %s, %u iterations, %u memory, %u parallel threads (CPUs) "
+			  "for %zu-bit key\n"), kdf, pbkdf.iterations,
+			pbkdf.max_memory_kb, pbkdf.parallel_threads, key_size * 8);
+	/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+	log_std(_("# Threads | Derivations/s | Per thread | Scaling |  Memory traffic\n"));
+
+	for (threads = 1; threads; threads = benchmark_threads_next(threads)) {
+		r = crypt_benchmark_pbkdf_threads(NULL, &pbkdf, key_size, threads, &time_ms);
+		check_signal(&r);
+		if (r == -EINTR)
+			return r;
+		if (r < 0 || !time_ms) {
+			log_std("%9u %15s %12s %9s %17s\n", threads,
+				_("N/A"), _("N/A"), _("N/A"), _("N/A"));
+			continue;
+		}
+
+		per_thread = 1000. / time_ms;
+		if (threads == 1)
+			one = per_thread;
+
+		/* Argon2 reads two and writes one block for every block in every pass */
+		traffic = 3. * pbkdf.iterations * pbkdf.max_memory_kb * threads / 1024. / (time_ms / 1000.);
+		if (pbkdf.max_memory_kb)
+			log_std("%9u %15.2f %12.2f %8.0f%% %11.0f MiB/s\n", threads,
+				per_thread * threads, per_thread, per_thread / one * 100., traffic);
+		else
+			log_std("%9u %15.2f %12.2f %8.0f%% %17s\n", threads,
+				per_thread * threads, per_thread, per_thread / one * 100., "-");
+	}
+
+	return 0;
+}
+
+static int action_benchmark_threads(void)
+{
+	char cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN];
+	int key_size = (opt_key_size ?: DEFAULT_LUKS1_KEYBITS) / 8;
+	int iv_size = 16, r;
+	char *c;
+
+	log_std(_("# Tests are approximate using memory only (no storage IO).\n"));
+	if (opt_pbkdf || opt_hash)
+		return benchmark_kdf_threads(opt_pbkdf ?: CRYPT_KDF_PBKDF2,
+					     opt_hash ?: DEFAULT_LUKS1_HASH, key_size);
+
+	r = crypt_parse_name_and_mode(opt_cipher ?: DEFAULT_CIPHER(LUKS1),
+				      cipher, NULL, cipher_mode);
+	if (r < 0) {
+		log_err(_("No known cipher specification pattern detected."));
+		return r;
+	}
+	if ((c  = strchr(cipher_mode, '-')))
+		*c = '\0';
+	if (!strcmp(cipher_mode, "ecb"))
+		iv_size = 0;
+
+	r = benchmark_cipher_threads(cipher, cipher_mode, key_size, iv_size);
+	if (r == -ENOTSUP) {
+		log_err(_("Required kernel crypto interface not available."));
+		return r;
+	}
+	if (r < 0 || opt_cipher)
+		return r;
+
+	return benchmark_kdf_threads(CRYPT_KDF_ARGON2ID, NULL, key_size);
+}
+
+/*
+ * JSON benchmark output (--json), every cipher test is repeated BENCHMARK_RUNS
+ * times and statistics of run times are printed together with all samples.
+ */
+#define BENCHMARK_RUNS 32
+
+static void json_string(const char *str)
+{
+	log_std("\"");
+	for (; str && *str; str++) {
+		if (*str == '"' || *str == '\\')
+			log_std("\\%c", *str);
+		else if ((unsigned char)*str >= 0x20)
+			log_std("%c", *str);
+	}
+	log_std("\"");
+}
+
+static int double_cmp(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+static void benchmark_json_stats(const char *name, size_t buffer_size,
+				 const double *ms, unsigned runs, int last)
+{
+	double sorted[BENCHMARK_RUNS], mean = 0.0, var = 0.0;
+	unsigned i;
+
+	for (i = 0; i < runs; i++) {
+		sorted[i] = ms[i];
+		mean += ms[i];
+	}
+	mean /= runs;
+	for (i = 0; i < runs; i++)
+		var += (ms[i] - mean) * (ms[i] - mean);
+	var = runs > 1 ? var / (runs - 1) : 0.0;
+	qsort(sorted, runs, sizeof(*sorted), double_cmp);
+
+	log_std("      \"%s\": { \"mbs\": %.1f, \"min_ms\": %.4f, \"median_ms\": %.4f, "
+		"\"p99_ms\": %.4f, \"mean_ms\": %.4f, \"stddev_ms\": %.4f,\n"
+		"        \"samples_ms\": [", name,
+		(double)buffer_size / (1024 * 1024) / (mean / 1000.0), sorted[0],
+		runs % 2 ? sorted[runs / 2] : (sorted[runs / 2 - 1] + sorted[runs / 2]) / 2,
+		sorted[(unsigned)ceil(0.99 * runs) - 1], mean, sqrt(var));
+	for (i = 0; i < runs; i++)
+		log_std("%s%.4f", i ? ", " : "", ms[i]);
+	log_std("] }%s\n", last ? "" : ",");
+}
+
+/* CPU model and crypto related CPU features (x86 flags or ARM Features) */
+static void benchmark_json_cpu(void)
+{
+	static const char *features[] = {
+		"aes", "vaes", "pclmulqdq", "vpclmulqdq", "sse2", "ssse3", "sse4_1",
+		"avx", "avx2", "avx512f", "avx512vl", "sha_ni", "pmull", "sha1", "sha2",
+		"sha3", "sha512", "neon", "asimd", NULL
+	};
+	char *line = NULL, *model = NULL, *flags = NULL, *c, *tok;
+	size_t len = 0;
+	int i, first = 1;
+	FILE *f;
+
+	f = fopen("/proc/cpuinfo", "r");
+	while (f && getline(&line, &len, f) != -1) {
+		if (!(c = strchr(line, ':')))
+			continue;
+		for (c++; *c == ' '; c++);
+		c[strcspn(c, "\n")] = '\0';
+		if (!model && (!strncmp(line, "model name", 10) || !strncmp(line, "cpu model", 9)))
+			model = strdup(c);
+		else if (!flags && (!strncmp(line, "flags", 5) || !strncmp(line, "Features", 8)))
+			flags = strdup(c);
+		if (model && flags)
+			break;
+	}
+	free(line);
+	if (f)
+		fclose(f);
+
+	log_std("  \"cpu\": { \"model\": ");
+	json_string(model ?: "unknown");
+	log_std(", \"features\": [");
+	for (tok = flags ? strtok(flags, " \t") : NULL; tok; tok = strtok(NULL, " \t"))
+		for (i = 0; features[i]; i++)
+			if (!strcmp(tok, features[i])) {
+				log_std("%s\"%s\"", first ? "" : ", ", tok);
+				first = 0;
+			}
+	log_std("] },\n");
+
+	free(model);
+	free(flags);
+}
+
+static int benchmark_json_kdf(const char *kdf, const char *hash, size_t key_size, int last)
+{
+	struct crypt_pbkdf_type pbkdf = {
+		.type = kdf,
+		.hash = hash,
+	};
+	int r;
+
+	if (!strcmp(kdf, CRYPT_KDF_PBKDF2)) {
+		pbkdf.time_ms = 1000;
+		r = crypt_benchmark_pbkdf(NULL, &pbkdf, "foo", 3, "bar", 3, key_size,
+					  &benchmark_callback, &pbkdf);
+	} else {
+		pbkdf.time_ms = opt_iteration_time ?: DEFAULT_LUKS2_ITER_TIME;
+		pbkdf.max_memory_kb = opt_pbkdf_memory;
+		pbkdf.parallel_threads = opt_pbkdf_parallel;
+		r = crypt_benchmark_pbkdf(NULL, &pbkdf, "foo", 3,
+			"0123456789abcdef0123456789abcdef", 32,
+			key_size, &benchmark_callback, &pbkdf);
+	}
+
+	log_std("    { \"type\": ");
+	json_string(kdf);
+	log_std(", ");
+	if (hash) {
+		log_std("\"hash\": ");
+		json_string(hash);
+		log_std(", ");
+	}
+	if (r < 0)
+		log_std("\"key_size\": %zu, \"error\": %d }%s\n", key_size * 8, r, last ? "" : ",");
+	else
+		log_std("\"key_size\": %zu, \"time_ms\": %u, \"iterations\": %u, "
+			"\"memory_kb\": %u, \"threads\": %u }%s\n", key_size * 8,
+			pbkdf.time_ms, pbkdf.iterations, pbkdf.max_memory_kb,
+			pbkdf.parallel_threads, last ? "" : ",");
+	return r;
+}
+
+static int benchmark_json_cipher(const char *cipher, const char *cipher_mode,
+				 size_t key_size, size_t iv_size, int last)
+{
+	double enc_ms[BENCHMARK_RUNS], dec_ms[BENCHMARK_RUNS];
+	size_t buffer_size = 1024 * 1024;
+	int r;
+
+	do {
+		r = crypt_benchmark_samples(NULL, cipher, cipher_mode, key_size, iv_size,
+					    buffer_size, BENCHMARK_RUNS, enc_ms, dec_ms);
+		if (r == -ERANGE && buffer_size < 1024 * 1024 * 65)
+			buffer_size *= 2;
+	} while (r == -ERANGE && buffer_size < 1024 * 1024 * 65);
+
+	log_std("    { \"cipher\": ");
+	json_string(cipher);
+	log_std(", \"mode\": ");
+	json_string(cipher_mode);
+	log_std(", \"key_size\": %zu, \"iv_size\": %zu, ", key_size * 8, iv_size);
+	if (r < 0) {
+		log_std("\"error\": %d }%s\n", r, last ? "" : ",");
+		return r;
+	}
+
+	log_std("\"buffer_size\": %zu, \"block_size\": %zu, \"runs\": %u,\n",
+		buffer_size, crypt_benchmark_block_size(), BENCHMARK_RUNS);
+	benchmark_json_stats("encryption", buffer_size, enc_ms, BENCHMARK_RUNS, 0);
+	benchmark_json_stats("decryption", buffer_size, dec_ms, BENCHMARK_RUNS, 1);
+	log_std("    }%s\n", last ? "" : ",");
+	return 0;
+}
+
+static int action_benchmark_tcrypt(void)
+{
+	const char *cipher, *cipher_mode;
+	double enc_mbr, dec_mbr;
+	unsigned i;
+	int r;
+
+	log_std(_("# Tests are approximate using memory only (no storage IO).\n"));
+	/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+	log_std(_("#                 Cipher chain |      Encryption |      Decryption\n"));
+	for (i = 0; ; i++) {
+		r = crypt_benchmark_tcrypt(NULL, i, &cipher, &cipher_mode,
+					   1024 * 1024, &enc_mbr, &dec_mbr);
+		if (!cipher)
+			break;
+		check_signal(&r);
+		if (r == -EINTR)
+			return r;
+		if (r == -ENOTSUP && strstr(cipher_mode, "-tcrypt"))
+			continue;
+		if (!r)
+			log_std("%18s-%-11s  %10.1f MiB/s  %10.1f MiB/s\n",
+				cipher, cipher_mode, enc_mbr, dec_mbr);
+		else
+			log_std("%18s-%-11s %17s %17s\n", cipher, cipher_mode,
+				_("N/A"), _("N/A"));
+	}
+
+	return 0;
+}
+
+static int action_benchmark_integrity(void)
+{
+	static const struct bench_integrity {
+		const char *cipher;
+		const char *mode;
+		const char *integrity;
+		size_t key_size;
+	} bintegrity[] = {
+		{ "aes",      "xts-random", "hmac(sha256)", 96 },
+		{ "aes",      "xts-random", "hmac(sha512)", 128 },
+		{ "aes",      "gcm-random", "aead",         32 },
+		{ "chacha20", "random",     "poly1305",     32 },
+		{ NULL,       NULL,         "crc32c",       0 },
+		{ NULL,       NULL,         "sha1",         0 },
+		{ NULL,       NULL,         "sha256",       0 },
+		{ NULL,       NULL,         "hmac(sha256)", 32 },
+		{ NULL,       NULL,         NULL,           0 }
+	};
+	static const size_t bsectors[] = { SECTOR_SIZE, 4096, 0 };
+	size_t opt_sectors[] = { opt_sector_size, 0 };
+	struct bench_integrity requested[2] = {};
+	const struct bench_integrity *b = bintegrity;
+	const size_t *sector;
+	char cipher[MAX_CIPHER_LEN], cipher_mode[MAX_CIPHER_LEN], integrity[MAX_CIPHER_LEN];
+	char name[2 * MAX_CIPHER_LEN];
+	double write_mbs, read_mbs;
+	uint32_t tag_size;
+	int r, integrity_key_size;
+
+	/* Only requested combination, otherwise the whole table */
+	if (opt_integrity) {
+		r = crypt_parse_integrity_mode(opt_integrity, integrity, &integrity_key_size);
+		if (r < 0) {
+			/* dm-integrity internal hash is used directly */
+			strncpy(integrity, opt_integrity, MAX_CIPHER_LEN - 1);
+			integrity[MAX_CIPHER_LEN - 1] = '\0';
+			integrity_key_size = 0;
+		}
+		requested[0].integrity = integrity;
+		requested[0].key_size = opt_key_size / 8;
+		if (opt_cipher) {
+			r = crypt_parse_name_and_mode(opt_cipher, cipher, NULL, cipher_mode);
+			if (r < 0) {
+				log_err(_("No known cipher specification pattern detected."));
+				return r;
+			}
+			requested[0].cipher = cipher;
+			requested[0].mode = cipher_mode;
+			requested[0].key_size = (opt_key_size ?: DEFAULT_LUKS1_KEYBITS) / 8 +
+						integrity_key_size;
+		}
+		b = requested;
+	}
+
+	log_std(_("# Tests are approximate using memory only (no storage IO).\n"));
+	/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+	log_std(_("#      Algorithm |    Integrity |  Tag | Sector |           Write |            Read\n"));
+	for (; b->integrity; b++) {
+		if (b->cipher)
+			snprintf(name, sizeof(name), "%s-%s", b->cipher, b->mode);
+		else
+			strcpy(name, "-");
+		sector = opt_sector_size != SECTOR_SIZE ? opt_sectors : bsectors;
+		for (; *sector; sector++) {
+			r = crypt_benchmark_integrity(NULL, b->cipher, b->mode, b->integrity,
+						      b->key_size, *sector, 1024 * 1024,
+						      &tag_size, &write_mbs, &read_mbs);
+			check_signal(&r);
+			if (r == -EINTR)
+				return r;
+			if (r < 0)
+				log_std("%16s %14s %6s %8zu %17s %17s\n", name, b->integrity,
+					"-", *sector, _("N/A"), _("N/A"));
+			else
+				log_std("%16s %14s %6u %8zu %10.1f MiB/s  %10.1f MiB/s\n",
+					name, b->integrity, tag_size, *sector,
+					write_mbs, read_mbs);
+		}
+	}
+
+	return 0;
+}
+
 static int action_benchmark(void)
 {
 	static struct {
@@ -749,17 +1427,32 @@ static int action_benchmark(void)
 	char *c;
 	int i, r;
 
-	log_std(_("# Tests are approximate using memory only (no storage IO).\n"));
-	if (opt_pbkdf || opt_hash) {
-		if (!opt_pbkdf && opt_hash)
-			opt_pbkdf = CRYPT_KDF_PBKDF2;
-		r = action_benchmark_kdf(opt_pbkdf, opt_hash, key_size);
-	} else if (opt_cipher) {
+	if (opt_benchmark_storage)
+		return action_benchmark_storage();
+
+	if (opt_benchmark_threads)
+		return action_benchmark_threads();
+
+	if (!strcmp(opt_type, "tcrypt"))
+		return action_benchmark_tcrypt();
+
+	if (!strcmp(opt_type, "integrity") || opt_integrity)
+		return action_benchmark_integrity();
+
+	if (!opt_pbkdf && opt_hash)
+		opt_pbkdf = CRYPT_KDF_PBKDF2;
+
+	if (!opt_pbkdf && opt_cipher) {
 		r = crypt_parse_name_and_mode(opt_cipher, cipher, NULL, cipher_mode);
 		if (r < 0) {
 			log_err(_("No known cipher specification pattern detected."));
 			return r;
 		}
+
+		/* With IV generator every sector is encrypted separately */
+		if (!opt_json && strchr(cipher_mode, '-'))
+			return action_benchmark_sectors(cipher, cipher_mode, key_size);
+
 		if ((c  = strchr(cipher_mode, '-')))
 			*c = '\0';
 
@@ -771,7 +1464,43 @@ static int action_benchmark(void)
 
 		if (!strcmp(cipher_mode, "ecb"))
 			iv_size = 0;
+	}
 
+	if (opt_json) {
+		log_std("{\n  \"backend\": ");
+		json_string(crypt_benchmark_backend(NULL) ?: "unknown");
+		log_std(",\n");
+		benchmark_json_cpu();
+
+		r = 0;
+		log_std("  \"kdf\": [\n");
+		if (opt_pbkdf)
+			r = benchmark_json_kdf(opt_pbkdf, opt_hash, key_size, 1);
+		for (i = 0; !opt_pbkdf && !opt_cipher && bkdfs[i].type && r != -EINTR; i++) {
+			r = benchmark_json_kdf(bkdfs[i].type, bkdfs[i].hash, key_size,
+					       !bkdfs[i + 1].type);
+			check_signal(&r);
+		}
+
+		log_std("  ],\n  \"cipher\": [\n");
+		if (!opt_pbkdf && opt_cipher)
+			r = benchmark_json_cipher(cipher, cipher_mode, key_size, iv_size, 1);
+		for (i = 0; !opt_pbkdf && !opt_cipher && bciphers[i].cipher && r != -EINTR; i++) {
+			r = benchmark_json_cipher(bciphers[i].cipher, bciphers[i].mode,
+						  bciphers[i].key_size, bciphers[i].iv_size,
+						  !bciphers[i + 1].cipher);
+			check_signal(&r);
+		}
+		log_std("  ]\n}\n");
+
+		/* Failed tests are reported in output */
+		return r == -EINTR ? r : 0;
+	}
+
+	log_std(_("# Tests are approximate using memory only (no storage IO).\n"));
+	if (opt_pbkdf) {
+		r = action_benchmark_kdf(opt_pbkdf, opt_hash, key_size);
+	} else if (opt_cipher) {
 		r = benchmark_cipher_loop(cipher, cipher_mode,
 					  key_size, iv_size,
 					  &enc_mbr, &dec_mbr);
@@ -905,8 +1634,9 @@ static int _wipe_data_device(struct crypt_device *cd)
 
 	/* Wipe the device */
 	set_int_handler(0);
+	tools_progress_init(cd, "wipe");
 	r = crypt_wipe(cd, tmp_path, CRYPT_WIPE_ZERO, 0, 0, DEFAULT_WIPE_BLOCK,
-		       0, &tools_wipe_progress, NULL);
+		       CRYPT_WIPE_PARALLEL, &tools_wipe_progress, NULL);
 	if (crypt_deactivate(cd, tmp_name))
 		log_err(_("Cannot deactivate temporary device %s."), tmp_path);
 	set_int_block(0);
@@ -1528,6 +2258,89 @@ out:
 	return r;
 }
 
+static int action_luksVerifySlots(void)
+{
+	struct crypt_device **cds;
+	struct crypt_keyslot_check *checks = NULL;
+	crypt_keyslot_info ki;
+	char *password = NULL;
+	size_t passwordLen, count = 0;
+	int i, ks, ks_max, r, failed = 0;
+
+	cds = calloc(action_argc, sizeof(*cds));
+	if (!cds)
+		return -ENOMEM;
+
+	for (i = 0; i < action_argc; i++) {
+		if ((r = crypt_init(&cds[i], action_argv[i])) ||
+		    (r = crypt_load(cds[i], luksType(opt_type), NULL))) {
+			log_err(_("Device %s is not a valid LUKS device."), action_argv[i]);
+			goto out;
+		}
+	}
+
+	r = tools_get_key(NULL, &password, &passwordLen,
+			  opt_keyfile_offset, opt_keyfile_size, opt_key_file,
+			  opt_timeout, _verify_passphrase(0), 0, cds[0]);
+	if (r < 0)
+		goto out;
+
+	r = -ENOMEM;
+	checks = calloc(action_argc * crypt_keyslot_max(CRYPT_LUKS2), sizeof(*checks));
+	if (!checks)
+		goto out;
+
+	/* Requested keyslot or all active keyslots of every device */
+	for (i = 0; i < action_argc; i++) {
+		ks_max = crypt_keyslot_max(crypt_get_type(cds[i]));
+		for (ks = 0; ks < ks_max; ks++) {
+			if (opt_key_slot != CRYPT_ANY_SLOT && opt_key_slot != ks)
+				continue;
+			ki = crypt_keyslot_status(cds[i], ks);
+			if (opt_key_slot == CRYPT_ANY_SLOT &&
+			    ki != CRYPT_SLOT_ACTIVE && ki != CRYPT_SLOT_ACTIVE_LAST &&
+			    ki != CRYPT_SLOT_UNBOUND)
+				continue;
+			checks[count].cd = cds[i];
+			checks[count].keyslot = ks;
+			checks[count].passphrase = password;
+			checks[count].passphrase_size = passwordLen;
+			count++;
+		}
+	}
+
+	if (!count) {
+		log_err(_("No usable keyslot is available."));
+		r = -ENOENT;
+		goto out;
+	}
+
+	(void)crypt_keyslot_verify_batch(checks, count);
+
+	for (i = 0; (size_t)i < count; i++) {
+		if (checks[i].r < 0)
+			failed++;
+		if (checks[i].r == -EPERM)
+			log_std(_("%s: keyslot %d FAILED, no key available with this passphrase (%.0f ms).\n"),
+				crypt_get_device_name(checks[i].cd), checks[i].keyslot, checks[i].kdf_ms);
+		else if (checks[i].r < 0)
+			log_std(_("%s: keyslot %d FAILED (error %d).\n"),
+				crypt_get_device_name(checks[i].cd), checks[i].keyslot, checks[i].r);
+		else
+			log_std(_("%s: keyslot %d OK (%.0f ms).\n"),
+				crypt_get_device_name(checks[i].cd), checks[i].keyslot, checks[i].kdf_ms);
+	}
+
+	r = failed ? -EPERM : 0;
+out:
+	crypt_safe_free(password);
+	free(checks);
+	for (i = 0; i < action_argc; i++)
+		crypt_free(cds[i]);
+	free(cds);
+	return r;
+}
+
 static int action_isLuks(void)
 {
 	struct crypt_device *cd = NULL;
@@ -1666,7 +2479,9 @@ static int action_luksSuspend(void)
 	int r;
 
 	r = crypt_init_by_name_and_header(&cd, action_argv[0], uuid_or_device(opt_header_device));
-	if (!r)
+	if (!r && opt_retain_key)
+		r = crypt_suspend_retain_key(cd, action_argv[0], opt_retain_key);
+	else if (!r)
 		r = crypt_suspend(cd, action_argv[0]);
 
 	crypt_free(cd);
@@ -1686,6 +2501,11 @@ static int action_luksResume(void)
 	if ((r = crypt_load(cd, luksType(opt_type), NULL)))
 		goto out;
 
+	/* volume key retained by luksSuspend --retain-key */
+	r = crypt_resume_by_retained_key(cd, action_argv[0]);
+	if (r != -ENOENT && r != -EPERM)
+		goto out;
+
 	tries = (tools_is_stdin(opt_key_file) && isatty(STDIN_FILENO)) ? opt_tries : 1;
 	do {
 		r = tools_get_key(NULL, &password, &passwordLen,
@@ -1786,7 +2606,7 @@ static int action_luksErase(void)
 	struct crypt_device *cd = NULL;
 	crypt_keyslot_info ki;
 	char *msg = NULL;
-	int i, max, r;
+	int i, max, r, *keyslots = NULL, count = 0;
 
 	if ((r = crypt_init(&cd, uuid_or_device_header(NULL))))
 		goto out;
@@ -1813,15 +2633,23 @@ static int action_luksErase(void)
 	if (max <= 0)
 		return -EINVAL;
 
+	keyslots = malloc(max * sizeof(*keyslots));
+	if (!keyslots) {
+		r = -ENOMEM;
+		goto out;
+	}
+
 	for (i = 0; i < max; i++) {
 		ki = crypt_keyslot_status(cd, i);
-		if (ki == CRYPT_SLOT_ACTIVE || ki == CRYPT_SLOT_ACTIVE_LAST) {
-			r = crypt_keyslot_destroy(cd, i);
-			if (r < 0)
-				goto out;
-		}
+		if (ki == CRYPT_SLOT_ACTIVE || ki == CRYPT_SLOT_ACTIVE_LAST)
+			keyslots[count++] = i;
 	}
+
+	/* all keyslot areas are wiped in one pass, header is updated once */
+	if (count)
+		r = crypt_keyslot_destroy_batch(cd, keyslots, count);
 out:
+	free(keyslots);
 	free(msg);
 	crypt_free(cd);
 	return r;
@@ -1900,13 +2728,28 @@ static int _config_labels(struct crypt_device *cd)
 	return crypt_set_label(cd, opt_label, opt_subsystem);
 }
 
+static int _config_flags(struct crypt_device *cd)
+{
+	uint32_t flags = 0;
+	int r;
+
+	_set_activation_flags(&flags);
+	flags &= ~CRYPT_ACTIVATE_IGNORE_PERSISTENT;
+
+	r = crypt_persistent_flags_set(cd, CRYPT_FLAGS_ACTIVATION, flags);
+	if (r)
+		log_err(_("Cannot make activation flags persistent."));
+
+	return r;
+}
+
 static int action_luksConfig(void)
 {
 	struct crypt_device *cd = NULL;
 	int r;
 
-	if (!opt_priority && !opt_label && !opt_subsystem) {
-		log_err(_("Option --priority, --label or --subsystem is missing."));
+	if (!opt_priority && !opt_label && !opt_subsystem && !opt_persistent) {
+		log_err(_("Option --priority, --label, --subsystem or --persistent is missing."));
 		return -EINVAL;
 	}
 
@@ -1921,6 +2764,136 @@ static int action_luksConfig(void)
 
 	if ((opt_label || opt_subsystem) && (r = _config_labels(cd)))
 		goto out;
+
+	if (opt_persistent && (r = _config_flags(cd)))
+		goto out;
+out:
+	crypt_free(cd);
+	return r;
+}
+
+/* Flags affecting read path only can be measured on device with data */
+#define TUNE_FLAGS (CRYPT_ACTIVATE_SAME_CPU_CRYPT | \
+		    CRYPT_ACTIVATE_NO_READ_WORKQUEUE | \
+		    CRYPT_ACTIVATE_HIGH_PRIORITY)
+/* Required improvement over default in percent to use the option */
+#define TUNE_MIN_GAIN 5
+
+static const char *tune_flags_str(uint32_t flags, char *buf, size_t buf_len)
+{
+	snprintf(buf, buf_len, "%s%s%s",
+		 (flags & CRYPT_ACTIVATE_SAME_CPU_CRYPT) ? "same_cpu_crypt " : "",
+		 (flags & CRYPT_ACTIVATE_NO_READ_WORKQUEUE) ? "no_read_workqueue " : "",
+		 (flags & CRYPT_ACTIVATE_HIGH_PRIORITY) ? "high_priority " : "");
+	if (!*buf)
+		snprintf(buf, buf_len, "default");
+	else
+		buf[strlen(buf) - 1] = '\0';
+	return buf;
+}
+
+static int action_tune(void)
+{
+	static const uint32_t tcandidates[] = {
+		0,
+		CRYPT_ACTIVATE_SAME_CPU_CRYPT,
+		CRYPT_ACTIVATE_NO_READ_WORKQUEUE,
+		CRYPT_ACTIVATE_NO_READ_WORKQUEUE | CRYPT_ACTIVATE_SAME_CPU_CRYPT,
+		CRYPT_ACTIVATE_HIGH_PRIORITY,
+		CRYPT_ACTIVATE_HIGH_PRIORITY | CRYPT_ACTIVATE_SAME_CPU_CRYPT,
+	};
+	struct crypt_device *cd = NULL;
+	struct crypt_params_integrity ip = {};
+	struct crypt_params_benchmark params = {
+		.size = opt_size * SECTOR_SIZE,
+		.flags = CRYPT_BENCHMARK_READONLY,
+	};
+	double seq_mbs, rnd_iops, base_seq = 0., base_rnd = 0., score, best_score = 0.;
+	double write_mbs, write_iops, dummy;
+	uint32_t flags, best = 0;
+	char buf[64];
+	unsigned i;
+	int r;
+
+	if ((r = crypt_init(&cd, uuid_or_device_header(NULL))))
+		return r;
+
+	if ((r = crypt_load(cd, CRYPT_LUKS2, NULL)))
+		goto out;
+
+	if (!crypt_get_integrity_info(cd, &ip) && ip.tag_size) {
+		log_err(_("Tuning of devices with data integrity protection is not supported."));
+		r = -ENOTSUP;
+		goto out;
+	}
+
+	params.device = crypt_get_device_name(cd);
+	params.offset = crypt_get_data_offset(cd) * SECTOR_SIZE;
+	params.sector_size = crypt_get_sector_size(cd);
+
+	log_std(_("# Tests are read-only using temporary mapping of %s.\n"), params.device);
+	/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+	log_std(_("#                                         Options |    Sequential read |        Random read\n"));
+	for (i = 0; i < sizeof(tcandidates) / sizeof(*tcandidates); i++) {
+		params.activation_flags = tcandidates[i];
+
+		params.block_size = 1024 * 1024;
+		params.queue_depth = 4;
+		params.flags &= ~CRYPT_BENCHMARK_RANDOM;
+		r = crypt_benchmark_device(NULL, crypt_get_cipher(cd), crypt_get_cipher_mode(cd),
+					   crypt_get_volume_key_size(cd), &params,
+					   &seq_mbs, &write_mbs, &dummy, &write_iops);
+		if (!r) {
+			params.block_size = params.sector_size > 4096 ? params.sector_size : 4096;
+			params.queue_depth = 32;
+			params.flags |= CRYPT_BENCHMARK_RANDOM;
+			r = crypt_benchmark_device(NULL, crypt_get_cipher(cd), crypt_get_cipher_mode(cd),
+						   crypt_get_volume_key_size(cd), &params,
+						   &dummy, &write_mbs, &rnd_iops, &write_iops);
+		}
+		check_signal(&r);
+		if (r == -EINTR)
+			goto out;
+
+		tune_flags_str(tcandidates[i], buf, sizeof(buf));
+		if (r < 0) {
+			log_std("%50s %20s %20s\n", buf, _("N/A"), _("N/A"));
+			/* without baseline there is nothing to compare with */
+			if (!tcandidates[i])
+				goto out;
+			continue;
+		}
+		log_std("%50s %14.1f MiB/s %15.0f IOPS\n", buf, seq_mbs, rnd_iops);
+
+		if (!tcandidates[i]) {
+			base_seq = seq_mbs;
+			base_rnd = rnd_iops;
+		}
+		if (base_seq <= 0. || base_rnd <= 0.)
+			continue;
+
+		/* Both patterns have the same weight */
+		score = (seq_mbs / base_seq + rnd_iops / base_rnd) / 2.;
+		if (!tcandidates[i] || score > best_score) {
+			best_score = score;
+			best = tcandidates[i];
+		}
+	}
+
+	if (best && (best_score - 1.) * 100. < TUNE_MIN_GAIN)
+		best = 0;
+
+	r = crypt_persistent_flags_get(cd, CRYPT_FLAGS_ACTIVATION, &flags);
+	if (r < 0)
+		goto out;
+
+	flags = (flags & ~TUNE_FLAGS) | best;
+	r = crypt_persistent_flags_set(cd, CRYPT_FLAGS_ACTIVATION, flags);
+	if (r < 0)
+		log_err(_("Cannot make activation flags persistent."));
+	else
+		log_std(_("Using %s performance options for device %s.\n"),
+			tune_flags_str(best, buf, sizeof(buf)), params.device);
 out:
 	crypt_free(cd);
 	return r;
@@ -2015,11 +2988,12 @@ static struct action_type {
 	{ "close",        action_close,        1, 1, N_("<name>"), N_("close device (remove mapping)") },
 	{ "resize",       action_resize,       1, 1, N_("<name>"), N_("resize active device") },
 	{ "status",       action_status,       1, 0, N_("<name>"), N_("show device status") },
-	{ "benchmark",    action_benchmark,    0, 0, N_("[--cipher <cipher>]"), N_("benchmark cipher") },
+	{ "benchmark",    action_benchmark,    0, 0, N_("[--cipher <cipher>] [--threads <n>] [--storage [<device>]]"), N_("benchmark cipher") },
 	{ "repair",       action_luksRepair,   1, 1, N_("<device>"), N_("try to repair on-disk metadata") },
 	{ "erase",        action_luksErase ,   1, 1, N_("<device>"), N_("erase all keyslots (remove encryption key)") },
 	{ "convert",      action_luksConvert,  1, 1, N_("<device>"), N_("convert LUKS from/to LUKS2 format") },
 	{ "config",       action_luksConfig,   1, 1, N_("<device>"), N_("set permanent configuration options for LUKS2") },
+	{ "tune",         action_tune,         1, 1, N_("<device>"), N_("tune and store dm-crypt performance options for LUKS2") },
 	{ "luksFormat",   action_luksFormat,   1, 1, N_("<device> [<new key file>]"), N_("formats a LUKS device") },
 	{ "luksAddKey",   action_luksAddKey,   1, 1, N_("<device> [<new key file>]"), N_("add key to LUKS device") },
 	{ "luksRemoveKey",action_luksRemoveKey,1, 1, N_("<device> [<key file>]"), N_("removes supplied key or key file from LUKS device") },
@@ -2028,6 +3002,7 @@ static struct action_type {
 	{ "luksKillSlot", action_luksKillSlot, 2, 1, N_("<device> <key slot>"), N_("wipes key with number <key slot> from LUKS device") },
 	{ "luksUUID",     action_luksUUID,     1, 0, N_("<device>"), N_("print UUID of LUKS device") },
 	{ "isLuks",       action_isLuks,       1, 0, N_("<device>"), N_("tests <device> for LUKS partition header") },
+	{ "luksVerifySlots",action_luksVerifySlots,1, 1, N_("<device> [<device>...]"), N_("verify that keyslots open with supplied passphrase") },
 	{ "luksDump",     action_luksDump,     1, 1, N_("<device>"), N_("dump LUKS partition information") },
 	{ "tcryptDump",   action_tcryptDump,   1, 1, N_("<device>"), N_("dump TCRYPT device information") },
 	{ "luksSuspend",  action_luksSuspend,  1, 1, N_("<device>"), N_("Suspend LUKS device and wipe key (all IOs are frozen)") },
@@ -2126,6 +3101,9 @@ static int run_action(struct action_type *action)
 		r = 0;
 	check_signal(&r);
 
+	if (opt_debug)
+		tool_trace_summary();
+
 	show_status(r);
 	return translate_errno(r);
 }
@@ -2148,6 +3126,7 @@ int main(int argc, const char **argv)
 		{ "hash",              'h',  POPT_ARG_STRING, &opt_hash,                0, N_("The hash used to create the encryption key from the passphrase"), NULL },
 		{ "verify-passphrase", 'y',  POPT_ARG_NONE, &opt_verify_passphrase,     0, N_("Verifies the passphrase by asking for it twice"), NULL },
 		{ "key-file",          'd',  POPT_ARG_STRING, &opt_key_file,            6, N_("Read the key from a file"), NULL },
+		{ "key-fd",            '\0', POPT_ARG_INT, &opt_key_fd,                 0, N_("Read the key from already open file descriptor"), N_("fd") },
 		{ "master-key-file",  '\0',  POPT_ARG_STRING, &opt_master_key_file,     0, N_("Read the volume (master) key from file."), NULL },
 		{ "dump-master-key",  '\0',  POPT_ARG_NONE, &opt_dump_master_key,       0, N_("Dump volume (master) key instead of keyslots info"), NULL },
 		{ "key-size",          's',  POPT_ARG_INT, &opt_key_size,               0, N_("The size of the encryption key"), N_("BITS") },
@@ -2163,6 +3142,8 @@ int main(int argc, const char **argv)
 		{ "batch-mode",        'q',  POPT_ARG_NONE, &opt_batch_mode,            0, N_("Do not ask for confirmation"), NULL },
 		{ "timeout",           't',  POPT_ARG_INT, &opt_timeout,                0, N_("Timeout for interactive passphrase prompt (in seconds)"), N_("secs") },
 		{ "progress-frequency",'\0', POPT_ARG_INT, &opt_progress_frequency,     0, N_("Progress line update (in seconds)"), N_("secs") },
+		{ "progress-json",     '\0', POPT_ARG_NONE, &opt_progress_json,         0, N_("Print progress as JSON objects"), NULL },
+		{ "progress-fd",       '\0', POPT_ARG_INT, &opt_progress_fd,            0, N_("Write JSON progress to file descriptor"), N_("fd") },
 		{ "tries",             'T',  POPT_ARG_INT, &opt_tries,                  0, N_("How often the input of the passphrase can be retried"), NULL },
 		{ "align-payload",     '\0', POPT_ARG_INT, &opt_align_payload,          0, N_("Align payload at <n> sector boundaries - for luksFormat"), N_("SECTORS") },
 		{ "header-backup-file",'\0', POPT_ARG_STRING, &opt_header_backup_file,  0, N_("File with LUKS header and keyslots backup"), NULL },
@@ -2176,6 +3157,7 @@ int main(int argc, const char **argv)
 		{ "tcrypt-hidden",     '\0', POPT_ARG_NONE, &opt_tcrypt_hidden,         0, N_("Use hidden header (hidden TCRYPT device)"), NULL },
 		{ "tcrypt-system",     '\0', POPT_ARG_NONE, &opt_tcrypt_system,         0, N_("Device is system TCRYPT drive (with bootloader)"), NULL },
 		{ "tcrypt-backup",     '\0', POPT_ARG_NONE, &opt_tcrypt_backup,         0, N_("Use backup (secondary) TCRYPT header"), NULL },
+		{ "tcrypt-chain-inline", '\0', POPT_ARG_NONE, &opt_tcrypt_chain_inline, 0, N_("Process TCRYPT cipher chain inline without per-layer workqueues (if supported)"), NULL },
 		{ "veracrypt",         '\0', POPT_ARG_NONE, &opt_veracrypt,             0, N_("Scan also for VeraCrypt compatible device"), NULL },
 		{ "veracrypt-pim",     '\0', POPT_ARG_INT, &opt_veracrypt_pim,          0, N_("Personal Iteration Multiplier for VeraCrypt compatible device"), NULL },
 		{ "veracrypt-query-pim", '\0', POPT_ARG_NONE, &opt_veracrypt_query_pim, 0, N_("Query Personal Iteration Multiplier for VeraCrypt compatible device"), NULL },
@@ -2183,6 +3165,9 @@ int main(int argc, const char **argv)
 		{ "force-password",    '\0', POPT_ARG_NONE, &opt_force_password,        0, N_("Disable password quality check (if enabled)"), NULL },
 		{ "perf-same_cpu_crypt",'\0', POPT_ARG_NONE, &opt_perf_same_cpu_crypt,  0, N_("Use dm-crypt same_cpu_crypt performance compatibility option"), NULL },
 		{ "perf-submit_from_crypt_cpus",'\0', POPT_ARG_NONE, &opt_perf_submit_from_crypt_cpus,0,N_("Use dm-crypt submit_from_crypt_cpus performance compatibility option"), NULL },
+		{ "perf-no_read_workqueue",'\0', POPT_ARG_NONE, &opt_perf_no_read_workqueue,0,N_("Bypass dm-crypt workqueue and process read requests synchronously"), NULL },
+		{ "perf-no_write_workqueue",'\0', POPT_ARG_NONE, &opt_perf_no_write_workqueue,0,N_("Bypass dm-crypt workqueue and process write requests synchronously"), NULL },
+		{ "perf-high_priority",'\0', POPT_ARG_NONE, &opt_perf_high_priority,0,N_("Use high priority dm-crypt workqueues and writer thread"), NULL },
 		{ "deferred",          '\0', POPT_ARG_NONE, &opt_deferred_remove,       0, N_("Device removal is deferred until the last user closes it"), NULL },
 		{ "iter-time",         'i',  POPT_ARG_INT, &opt_iteration_time,         0, N_("PBKDF iteration time for LUKS (in ms)"), N_("msecs") },
 		{ "pbkdf",             '\0', POPT_ARG_STRING, &opt_pbkdf,               0, N_("PBKDF algorithm (for LUKS2): argon2i, argon2id, pbkdf2"), NULL },
@@ -2203,6 +3188,12 @@ int main(int argc, const char **argv)
 		{ "label",	       '\0', POPT_ARG_STRING, &opt_label,               0, N_("Set label for the LUKS2 device"), NULL },
 		{ "subsystem",	       '\0', POPT_ARG_STRING, &opt_subsystem,           0, N_("Set subsystem label for the LUKS2 device"), NULL },
 		{ "unbound",           '\0', POPT_ARG_NONE, &opt_unbound,               0, N_("Create unbound (no assigned data segment) LUKS2 keyslot"), NULL },
+		{ "storage",           '\0', POPT_ARG_NONE, &opt_benchmark_storage,     0, N_("Benchmark through dm-crypt mapping (overwrites data on device)"), NULL },
+		{ "threads",           '\0', POPT_ARG_INT, &opt_benchmark_threads,      0, N_("Benchmark up to this number of concurrent threads"), N_("threads") },
+		{ "json",              '\0', POPT_ARG_NONE, &opt_json,                  0, N_("Print benchmark results in JSON format"), NULL },
+		{ "pbkdf-cache",       '\0', POPT_ARG_STRING, &opt_pbkdf_cache,         0, N_("File with cached PBKDF benchmark results"), NULL },
+		{ "keyslot-history",   '\0', POPT_ARG_STRING, &opt_keyslot_history,     0, N_("File with keyslot unlock history used to order keyslot trials"), NULL },
+		{ "retain-key",        '\0', POPT_ARG_INT, &opt_retain_key,             0, N_("Retain volume key in kernel keyring while suspended (in seconds)"), N_("secs") },
 		POPT_TABLEEND
 	};
 	poptContext popt_context;
@@ -2268,6 +3259,21 @@ int main(int argc, const char **argv)
 		usage(popt_context, EXIT_FAILURE, poptStrerror(r),
 		      poptBadOption(popt_context, POPT_BADOPTION_NOALIAS));
 
+	/* key descriptor is used as keyfile, but read without reopening it */
+	if (opt_key_fd >= 0) {
+		if (total_keyfiles)
+			usage(popt_context, EXIT_FAILURE,
+			      _("Options --key-file and --key-fd cannot be combined.\n"),
+			      poptGetInvocationName(popt_context));
+		snprintf(opt_key_fd_path, sizeof(opt_key_fd_path), "/dev/fd/%d", opt_key_fd);
+		opt_key_file = opt_key_fd_path;
+		total_keyfiles++;
+	}
+
+	/* progress file descriptor implies machine readable progress */
+	if (opt_progress_fd >= 0)
+		opt_progress_json = 1;
+
 	if (opt_version_mode) {
 		log_std("%s %s\n", PACKAGE_NAME, PACKAGE_VERSION);
 		poptFreeContext(popt_context);
@@ -2349,14 +3355,25 @@ int main(int argc, const char **argv)
 		      _("Option --shared is allowed only for open of plain device.\n"),
 		      poptGetInvocationName(popt_context));
 
-	if (opt_allow_discards && strcmp(aname, "open"))
+	if (opt_allow_discards && strcmp(aname, "open") &&
+	    !(opt_persistent && !strcmp(aname, "config")))
 		usage(popt_context, EXIT_FAILURE,
 		      _("Option --allow-discards is allowed only for open operation.\n"),
 		      poptGetInvocationName(popt_context));
 
-	if (opt_persistent && strcmp(aname, "open"))
+	if (opt_persistent && strcmp(aname, "open") && strcmp(aname, "config"))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Option --persistent is allowed only for open and config operation.\n"),
+		      poptGetInvocationName(popt_context));
+
+	if (opt_retain_key && strcmp(aname, "luksSuspend"))
 		usage(popt_context, EXIT_FAILURE,
-		      _("Option --persistent is allowed only for open operation.\n"),
+		      _("Option --retain-key is allowed only for luksSuspend operation.\n"),
+		      poptGetInvocationName(popt_context));
+
+	if (opt_retain_key < 0)
+		usage(popt_context, EXIT_FAILURE,
+		      _("Negative number for option not permitted."),
 		      poptGetInvocationName(popt_context));
 
 	if (opt_persistent && opt_test_passphrase)
@@ -2374,9 +3391,9 @@ int main(int argc, const char **argv)
 			"open and benchmark actions. To limit read from keyfile use --keyfile-size=(bytes)."),
 		      poptGetInvocationName(popt_context));
 
-	if (opt_integrity && strcmp(aname, "luksFormat"))
+	if (opt_integrity && strcmp(aname, "luksFormat") && strcmp(aname, "benchmark"))
 		usage(popt_context, EXIT_FAILURE,
-		      _("Option --integrity is allowed only for luksFormat (LUKS2).\n"),
+		      _("Option --integrity is allowed only for luksFormat (LUKS2) and benchmark.\n"),
 		      poptGetInvocationName(popt_context));
 
 	if (opt_integrity_no_wipe && !opt_integrity)
@@ -2459,6 +3476,11 @@ int main(int argc, const char **argv)
 		_("Option --tcrypt-hidden, --tcrypt-system or --tcrypt-backup is supported only for TCRYPT device.\n"),
 		poptGetInvocationName(popt_context));
 
+	if (opt_tcrypt_chain_inline && (strcmp(aname, "open") || strcmp(opt_type, "tcrypt")))
+		usage(popt_context, EXIT_FAILURE,
+		_("Option --tcrypt-chain-inline is supported only for open of TCRYPT device.\n"),
+		poptGetInvocationName(popt_context));
+
 	if (opt_tcrypt_hidden && opt_allow_discards)
 		usage(popt_context, EXIT_FAILURE,
 		_("Option --tcrypt-hidden cannot be combined with --allow-discards.\n"),
@@ -2514,6 +3536,7 @@ int main(int argc, const char **argv)
 		poptGetInvocationName(popt_context));
 
 	if (opt_sector_size != SECTOR_SIZE && strcmp(aname, "luksFormat") &&
+	    strcmp(aname, "benchmark") &&
 	    (strcmp(aname, "open") || strcmp(opt_type, "plain")))
 		usage(popt_context, EXIT_FAILURE,
 		      _("Sector size option is not supported for this command.\n"),
@@ -2525,6 +3548,26 @@ int main(int argc, const char **argv)
 		      _("Unsupported encryption sector size.\n"),
 		      poptGetInvocationName(popt_context));
 
+	if (opt_benchmark_storage && strcmp(aname, "benchmark"))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Option --storage is allowed only for benchmark.\n"),
+		      poptGetInvocationName(popt_context));
+
+	if (opt_benchmark_threads && (strcmp(aname, "benchmark") || opt_benchmark_storage))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Option --threads is allowed only for benchmark (without --storage).\n"),
+		      poptGetInvocationName(popt_context));
+
+	if (opt_json && (strcmp(aname, "benchmark") || opt_benchmark_storage || opt_benchmark_threads))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Option --json is allowed only for benchmark (without --storage and --threads).\n"),
+		      poptGetInvocationName(popt_context));
+
+	if (opt_benchmark_threads < 0 || opt_benchmark_threads > 1024)
+		usage(popt_context, EXIT_FAILURE,
+		      _("Invalid number of benchmark threads.\n"),
+		      poptGetInvocationName(popt_context));
+
 	if (opt_unbound && !opt_key_size)
 		usage(popt_context, EXIT_FAILURE,
 		      _("Key size is required with --unbound option.\n"),
@@ -2538,6 +3581,7 @@ int main(int argc, const char **argv)
 	if (opt_debug) {
 		opt_verbose = 1;
 		crypt_set_debug_level(-1);
+		crypt_set_trace_callback(NULL, tool_trace, NULL);
 		dbg_version_and_cmd(argc, argv);
 	}
 
@@ -2550,6 +3594,18 @@ int main(int argc, const char **argv)
 	if (opt_disable_keyring)
 		(void) crypt_volume_key_keyring(NULL, 0);
 
+	if (opt_pbkdf_cache && crypt_set_pbkdf_cache(opt_pbkdf_cache)) {
+		log_std(_("Cannot set PBKDF cache.\n"));
+		poptFreeContext(popt_context);
+		exit(EXIT_FAILURE);
+	}
+
+	if (opt_keyslot_history && crypt_set_keyslot_history(opt_keyslot_history)) {
+		log_std(_("Cannot set keyslot history.\n"));
+		poptFreeContext(popt_context);
+		exit(EXIT_FAILURE);
+	}
+
 	r = run_action(action);
 	poptFreeContext(popt_context);
 	return r;
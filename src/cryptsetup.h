@@ -59,7 +59,10 @@ extern int opt_debug;
 extern int opt_verbose;
 extern int opt_batch_mode;
 extern int opt_force_password;
+extern int opt_key_fd;
 extern int opt_progress_frequency;
+extern int opt_progress_json;
+extern int opt_progress_fd;
 
 
 /* Common tools */
@@ -67,6 +70,10 @@ void clogger(struct crypt_device *cd, int level, const char *file, int line,
 	     const char *format, ...)  __attribute__ ((format (printf, 5, 6)));
 void tool_log(int level, const char *msg, void *usrptr __attribute__((unused)));
 void quiet_log(int level, const char *msg, void *usrptr);
+void tool_trace(crypt_trace_phase phase, int end, uint64_t usec, uint64_t bytes,
+		void *usrptr __attribute__((unused)));
+void tool_trace_summary(void);
+int tools_monitor(const char *target, const char **names, int count, uint32_t interval);
 
 int yesDialog(const char *msg, void *usrptr __attribute__((unused)));
 void show_status(int errcode);
@@ -99,6 +106,11 @@ void tools_time_progress(uint64_t device_size, uint64_t bytes,
 			 struct timeval *start_time, struct timeval *end_time);
 int tools_wipe_progress(uint64_t size, uint64_t offset, void *usrptr);
 
+void tools_progress_init(struct crypt_device *cd, const char *operation);
+void tools_progress_account(uint64_t size, uint64_t offset);
+void tools_progress_io_error(void);
+void tools_progress_json(const struct crypt_progress *p);
+
 int tools_read_mk(const char *file, char **key, int keysize);
 int tools_write_mk(const char *file, const char *key, int keysize);
 
@@ -24,6 +24,16 @@
 #include <linux/fs.h>
 #include <arpa/inet.h>
 #include <uuid/uuid.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#ifdef HAVE_SYS_SYSMACROS_H
+# include <sys/sysmacros.h>     /* for major, minor */
+#endif
 
 #define PACKAGE_REENC "crypt_reencrypt"
 
@@ -50,12 +60,22 @@ static int opt_bsize = 4;
 static int opt_directio = 0;
 static int opt_fsync = 0;
 static int opt_write_log = 0;
+static int opt_checkpoint_interval = 0;
+static int opt_max_rate = 0;
+static int opt_max_iops = 0;
+static int opt_max_latency = 0;
+static const char *opt_io_priority = NULL;
+static const char *opt_used_map = NULL;
+static int opt_discard_unused = 0;
+static int opt_jobs = 0;
+static int opt_max_per_disk = 1;
 static int opt_tries = 3;
 static int opt_key_slot = CRYPT_ANY_SLOT;
 static int opt_key_size = 0;
 static int opt_new = 0;
 static int opt_keep_key = 0;
 static int opt_decrypt = 0;
+static int opt_userspace_crypto = 0;
 static const char *opt_header_device = NULL;
 
 static const char *opt_reduce_size_str = NULL;
@@ -68,6 +88,13 @@ static const char **action_argv;
 
 #define MAX_SLOT 32
 #define MAX_TOKEN 32
+
+/* Used data extent, offset relative to data area (mapped device) */
+struct used_extent {
+	uint64_t offset;
+	uint64_t length;
+};
+
 struct reenc_ctx {
 	char *device;
 	char *device_header;
@@ -81,6 +108,7 @@ struct reenc_ctx {
 
 	unsigned int stained:1;
 	unsigned int in_progress:1;
+	unsigned int checkpoint_hdr:1;	/* progress stored in LUKS2 metadata, no log */
 	enum { FORWARD = 0, BACKWARD = 1 } reencrypt_direction;
 	enum { REENCRYPT = 0, ENCRYPT = 1, DECRYPT = 2 } reencrypt_mode;
 
@@ -93,6 +121,7 @@ struct reenc_ctx {
 	char crypt_path_new[PATH_MAX];
 	int log_fd;
 	char log_buf[SECTOR_SIZE];
+	struct crypt_device *cd_checkpoint;
 
 	struct {
 		char *password;
@@ -102,6 +131,23 @@ struct reenc_ctx {
 
 	struct timeval start_time, end_time;
 	uint64_t resume_bytes;
+
+	/* sorted, non overlapping; NULL means all data are used */
+	struct used_extent *used;
+	size_t used_count;
+
+	/* userspace crypto engine, data device is accessed directly */
+	struct crypt_pool *pool;
+	uint64_t data_offset_org;	/* bytes */
+	uint64_t data_offset_new;	/* bytes */
+};
+
+/* Write end of progress pipe of a child in multi-device mode */
+static int progress_fd = -1;
+
+struct progress_msg {
+	uint64_t size;
+	uint64_t bytes;
 };
 
 char MAGIC[]   = {'L','U','K','S', 0xba, 0xbe};
@@ -321,10 +367,102 @@ static int create_empty_header(const char *new_file, const char *old_file,
 	return r;
 }
 
+static void close_log(struct reenc_ctx *rc);
+static int isLUKS2(const char *type);
+
+/*
+ * LUKS2 reencryption stores progress directly in the device header
+ * (protected by the offline-reencrypt requirement), every update is one
+ * atomic write of both header copies and no log file is needed for resume.
+ */
+static int write_checkpoint(struct reenc_ctx *rc)
+{
+	struct crypt_params_reencrypt_checkpoint cp = {
+		.offset = rc->device_offset,
+		.shift = rc->device_shift,
+		.direction = rc->reencrypt_direction,
+		.mode = rc->reencrypt_mode,
+	};
+
+	if (crypt_reencrypt_checkpoint_set(rc->cd_checkpoint, &cp) < 0) {
+		log_err(_("Cannot store reencryption checkpoint in LUKS2 header."));
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/* Load checkpoint from LUKS2 header, returns 0 if reencryption is in progress */
+static int load_checkpoint(struct reenc_ctx *rc)
+{
+	struct crypt_params_reencrypt_checkpoint cp;
+	struct crypt_device *cd = NULL;
+	int r;
+
+	if (!isLUKS2(rc->type) || opt_new || opt_decrypt)
+		return -ENOENT;
+
+	if ((r = crypt_init(&cd, hdr_device(rc))) ||
+	    (r = crypt_load(cd, CRYPT_LUKS2, NULL)) ||
+	    (r = crypt_reencrypt_checkpoint_get(cd, &cp))) {
+		crypt_free(cd);
+		return r;
+	}
+
+	if (cp.mode != REENCRYPT) {
+		crypt_free(cd);
+		return -EINVAL;
+	}
+
+	log_std(_("Reencryption checkpoint found in LUKS2 header, resuming reencryption.\n"));
+	log_dbg("Checkpoint: offset = %" PRIu64 ", shift = %" PRIu64 ", direction = %u.",
+		cp.offset, cp.shift, cp.direction);
+
+	rc->device_offset = cp.offset;
+	rc->device_shift = cp.shift;
+	rc->reencrypt_direction = cp.direction;
+	rc->reencrypt_mode = cp.mode;
+	rc->cd_checkpoint = cd;
+	rc->checkpoint_hdr = 1;
+	rc->in_progress = 1;
+
+	return 0;
+}
+
+/* Move progress from the log file to LUKS2 header with reencrypt flag set */
+static void start_checkpoint(struct reenc_ctx *rc)
+{
+	if (!isLUKS2(rc->type) || rc->reencrypt_mode != REENCRYPT || rc->checkpoint_hdr)
+		return;
+
+	if (crypt_init(&rc->cd_checkpoint, hdr_device(rc)) ||
+	    crypt_load(rc->cd_checkpoint, CRYPT_LUKS2, NULL))
+		goto err;
+
+	rc->checkpoint_hdr = 1;
+	if (write_checkpoint(rc)) {
+		rc->checkpoint_hdr = 0;
+		goto err;
+	}
+
+	log_dbg("Reencryption progress is stored in LUKS2 header.");
+	close_log(rc);
+	rc->log_fd = -1;
+	unlink(rc->log_file);
+	return;
+err:
+	log_dbg("Cannot use LUKS2 header checkpoint, using log file.");
+	crypt_free(rc->cd_checkpoint);
+	rc->cd_checkpoint = NULL;
+}
+
 static int write_log(struct reenc_ctx *rc)
 {
 	ssize_t r;
 
+	if (rc->checkpoint_hdr)
+		return write_checkpoint(rc);
+
 	memset(rc->log_buf, 0, SECTOR_SIZE);
 	snprintf(rc->log_buf, SECTOR_SIZE, "# LUKS reencryption log, DO NOT EDIT OR DELETE.\n"
 		"version = %d\nUUID = %s\ndirection = %d\nmode = %d\n"
@@ -448,34 +586,46 @@ static int open_log(struct reenc_ctx *rc)
 	return parse_log(rc);
 }
 
-static int activate_luks_headers(struct reenc_ctx *rc)
+static int header_passwords(struct reenc_ctx *rc,
+			    const char **pwd_old, size_t *pwd_old_len,
+			    const char **pwd_new, size_t *pwd_new_len)
 {
-	struct crypt_device *cd = NULL, *cd_new = NULL;
-	const char *pwd_old, *pwd_new, pwd_empty[] = "";
-	size_t pwd_old_len, pwd_new_len;
-	int r;
-
-	log_dbg("Activating LUKS devices from headers.");
+	static const char pwd_empty[] = "";
 
 	/* Never use real password for empty header processing */
 	if (rc->reencrypt_mode == REENCRYPT) {
-		pwd_old = rc->p[rc->keyslot].password;
-		pwd_old_len = rc->p[rc->keyslot].passwordLen;
-		pwd_new = pwd_old;
-		pwd_new_len = pwd_old_len;
+		*pwd_old = rc->p[rc->keyslot].password;
+		*pwd_old_len = rc->p[rc->keyslot].passwordLen;
+		*pwd_new = *pwd_old;
+		*pwd_new_len = *pwd_old_len;
 	} else if (rc->reencrypt_mode == DECRYPT) {
-		pwd_old = rc->p[rc->keyslot].password;
-		pwd_old_len = rc->p[rc->keyslot].passwordLen;
-		pwd_new = pwd_empty;
-		pwd_new_len = 0;
+		*pwd_old = rc->p[rc->keyslot].password;
+		*pwd_old_len = rc->p[rc->keyslot].passwordLen;
+		*pwd_new = pwd_empty;
+		*pwd_new_len = 0;
 	} else if (rc->reencrypt_mode == ENCRYPT) {
-		pwd_old = pwd_empty;
-		pwd_old_len = 0;
-		pwd_new = rc->p[rc->keyslot].password;
-		pwd_new_len = rc->p[rc->keyslot].passwordLen;
+		*pwd_old = pwd_empty;
+		*pwd_old_len = 0;
+		*pwd_new = rc->p[rc->keyslot].password;
+		*pwd_new_len = rc->p[rc->keyslot].passwordLen;
 	} else
 		return -EINVAL;
 
+	return 0;
+}
+
+static int activate_luks_headers(struct reenc_ctx *rc)
+{
+	struct crypt_device *cd = NULL, *cd_new = NULL;
+	const char *pwd_old, *pwd_new;
+	size_t pwd_old_len, pwd_new_len;
+	int r;
+
+	log_dbg("Activating LUKS devices from headers.");
+
+	if ((r = header_passwords(rc, &pwd_old, &pwd_old_len, &pwd_new, &pwd_new_len)))
+		return r;
+
 	if ((r = crypt_init(&cd, rc->header_file_org)) ||
 	    (r = crypt_load(cd, CRYPT_LUKS, NULL)) ||
 	    (r = crypt_set_data_device(cd, rc->device)))
@@ -495,7 +645,8 @@ static int activate_luks_headers(struct reenc_ctx *rc)
 	log_verbose(_("Activating temporary device using new LUKS header."));
 	if ((r = crypt_activate_by_passphrase(cd_new, rc->header_file_new,
 		opt_key_slot, pwd_new, pwd_new_len,
-		CRYPT_ACTIVATE_SHARED|CRYPT_ACTIVATE_PRIVATE)) < 0)
+		CRYPT_ACTIVATE_SHARED|CRYPT_ACTIVATE_PRIVATE|
+		(opt_discard_unused ? CRYPT_ACTIVATE_ALLOW_DISCARDS : 0))) < 0)
 		goto out;
 	r = 0;
 out:
@@ -924,6 +1075,24 @@ out:
 	return r;
 }
 
+static void copy_progress(struct reenc_ctx *rc, uint64_t bytes)
+{
+	struct progress_msg msg = {
+		.size = rc->device_size,
+		.bytes = bytes
+	};
+
+	if (progress_fd < 0) {
+		tools_time_progress(rc->device_size, bytes,
+				    &rc->start_time, &rc->end_time);
+		return;
+	}
+
+	/* message is smaller than PIPE_BUF, so written atomically */
+	if (write(progress_fd, &msg, sizeof(msg)) != sizeof(msg))
+		log_dbg("Cannot report progress.");
+}
+
 static ssize_t read_buf(int fd, void *buf, size_t count)
 {
 	size_t read_size = 0;
@@ -947,227 +1116,1072 @@ static ssize_t read_buf(int fd, void *buf, size_t count)
 	return (ssize_t)count;
 }
 
-static int copy_data_forward(struct reenc_ctx *rc, int fd_old, int fd_new,
-			     size_t block_size, void *buf, uint64_t *bytes)
+static int used_extent_cmp(const void *a, const void *b)
 {
-	ssize_t s1, s2;
+	const struct used_extent *e1 = a, *e2 = b;
 
-	log_dbg("Reencrypting in forward direction.");
+	if (e1->offset == e2->offset)
+		return 0;
+	return e1->offset < e2->offset ? -1 : 1;
+}
 
-	if (lseek64(fd_old, rc->device_offset, SEEK_SET) < 0 ||
-	    lseek64(fd_new, rc->device_offset, SEEK_SET) < 0) {
-		log_err(_("Cannot seek to device offset."));
-		return -EIO;
+/*
+ * Load map of used data extents. Every line contains offset and length
+ * (with optional size units) of the used area relative to the start
+ * of the data area, lines starting with '#' are ignored.
+ */
+static int load_used_map(struct reenc_ctx *rc, const char *path)
+{
+	struct used_extent *e = NULL, *tmp;
+	size_t count = 0, alloc = 0, i, j;
+	char line[256], str_offset[64], str_length[64];
+	unsigned int lineno = 0;
+	FILE *f;
+	int r = 0;
+
+	if (!(f = fopen(path, "r"))) {
+		log_err(_("Cannot open used extent map %s."), path);
+		return -EINVAL;
 	}
 
-	rc->resume_bytes = *bytes = rc->device_offset;
-
-	if (write_log(rc) < 0)
-		return -EIO;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
 
-	while (!quit && rc->device_offset < rc->device_size) {
-		s1 = read_buf(fd_old, buf, block_size);
-		if (s1 < 0 || ((size_t)s1 != block_size &&
-		    (rc->device_offset + s1) != rc->device_size)) {
-			log_dbg("Read error, expecting %zu, got %zd.",
-				block_size, s1);
-			return -EIO;
+		if (count == alloc) {
+			alloc = alloc ? alloc * 2 : 64;
+			if (!(tmp = realloc(e, alloc * sizeof(*e)))) {
+				r = -ENOMEM;
+				break;
+			}
+			e = tmp;
 		}
 
-		/* If device_size is forced, never write more than limit */
-		if ((s1 + rc->device_offset) > rc->device_size)
-			s1 = rc->device_size - rc->device_offset;
-
-		s2 = write(fd_new, buf, s1);
-		if (s2 < 0) {
-			log_dbg("Write error, expecting %zu, got %zd.",
-				block_size, s2);
-			return -EIO;
+		if (sscanf(line, "%63s %63s", str_offset, str_length) != 2 ||
+		    tools_string_to_size(NULL, str_offset, &e[count].offset) ||
+		    tools_string_to_size(NULL, str_length, &e[count].length) ||
+		    e[count].offset + e[count].length < e[count].offset) {
+			log_err(_("Invalid used extent map %s, line %u."), path, lineno);
+			r = -EINVAL;
+			break;
 		}
 
-		rc->device_offset += s1;
-		if (opt_write_log && write_log(rc) < 0)
-			return -EIO;
+		if (e[count].length)
+			count++;
+	}
+	fclose(f);
 
-		if (opt_fsync && fsync(fd_new) < 0) {
-			log_dbg("Write error, fsync.");
-			return -EIO;
-		}
+	if (r) {
+		free(e);
+		return r;
+	}
 
-		*bytes += (uint64_t)s2;
-		tools_time_progress(rc->device_size, *bytes,
-				    &rc->start_time, &rc->end_time);
+	/* Sort and merge overlapping or adjacent extents */
+	if (count)
+		qsort(e, count, sizeof(*e), used_extent_cmp);
+	for (i = 0, j = 0; i < count; i++) {
+		if (j && e[j - 1].offset + e[j - 1].length >= e[i].offset) {
+			if (e[i].offset + e[i].length > e[j - 1].offset + e[j - 1].length)
+				e[j - 1].length = e[i].offset + e[i].length - e[j - 1].offset;
+		} else
+			e[j++] = e[i];
 	}
 
-	return quit ? -EAGAIN : 0;
+	log_dbg("Loaded %zu used extents from %s.", j, path);
+
+	/* An empty map is still a map, everything is unused */
+	rc->used = e ?: malloc(sizeof(*e));
+	rc->used_count = j;
+
+	return rc->used ? 0 : -ENOMEM;
 }
 
-static int copy_data_backward(struct reenc_ctx *rc, int fd_old, int fd_new,
-			      size_t block_size, void *buf, uint64_t *bytes)
+/* Check if the block overlaps any used extent */
+static int block_used(const struct reenc_ctx *rc, uint64_t offset, uint64_t size)
 {
-	ssize_t s1, s2, working_block;
-	off64_t working_offset;
+	size_t lo = 0, hi = rc->used_count, mid;
 
-	log_dbg("Reencrypting in backward direction.");
+	if (!rc->used)
+		return 1;
 
-	if (!rc->in_progress) {
-		rc->device_offset = rc->device_size;
-		rc->resume_bytes = 0;
-		*bytes = 0;
-	} else {
-		rc->resume_bytes = rc->device_size - rc->device_offset;
-		*bytes = rc->resume_bytes;
+	/* first extent ending after block start */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (rc->used[mid].offset + rc->used[mid].length <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
-	if (write_log(rc) < 0)
-		return -EIO;
+	return lo < rc->used_count && rc->used[lo].offset < offset + size;
+}
 
-	/* dirty the device during ENCRYPT mode */
-	rc->stained = 1;
+/*
+ * Read-ahead of the old device. The reader thread fills COPY_BUFFERS aligned
+ * buffers in copy order, so reading of the next block overlaps with writing
+ * of the current one. Reading ahead is safe; the direction is selected so that
+ * the area written to the new device never overlaps not yet read old data.
+ */
+#define COPY_BUFFERS 2
 
-	while (!quit && rc->device_offset) {
-		if (rc->device_offset < block_size) {
-			working_offset = 0;
-			working_block = rc->device_offset;
-		} else {
-			working_offset = rc->device_offset - block_size;
-			working_block = block_size;
-		}
+struct copy_block {
+	void *buf;
+	off64_t offset;
+	ssize_t size;		/* bytes to write, negative on read error */
+	int unused;		/* not read, no used extent in block */
+};
 
-		if (lseek64(fd_old, working_offset, SEEK_SET) < 0 ||
-		    lseek64(fd_new, working_offset, SEEK_SET) < 0) {
-			log_err(_("Cannot seek to device offset."));
-			return -EIO;
-		}
+struct copy_reader {
+	struct reenc_ctx *rc;
+	int fd;
+	size_t block_size;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct copy_block block[COPY_BUFFERS];
+	unsigned int head, tail;	/* filled and consumed blocks */
+	int stop, done;
+};
 
-		s1 = read_buf(fd_old, buf, working_block);
-		if (s1 < 0 || (s1 != working_block)) {
-			log_dbg("Read error, expecting %zu, got %zd.",
-				block_size, s1);
-			return -EIO;
-		}
+/* Next block to read, returns 0 if there is no more data */
+static ssize_t copy_next_block(struct copy_reader *cr, uint64_t *offset)
+{
+	size_t block_size = cr->block_size;
 
-		s2 = write(fd_new, buf, working_block);
-		if (s2 < 0) {
-			log_dbg("Write error, expecting %zu, got %zd.",
-				block_size, s2);
-			return -EIO;
-		}
+	if (cr->rc->reencrypt_direction == FORWARD) {
+		if (*offset >= cr->rc->device_size)
+			return 0;
+		return block_size;
+	}
 
-		rc->device_offset -= s1;
-		if (opt_write_log && write_log(rc) < 0)
-			return -EIO;
+	if (!*offset)
+		return 0;
 
-		if (opt_fsync && fsync(fd_new) < 0) {
-			log_dbg("Write error, fsync.");
-			return -EIO;
+	if (*offset < block_size)
+		block_size = *offset;
+	*offset -= block_size;
+	return block_size;
+}
+
+/* Signals are handled in the main thread */
+static void thread_block_signals(void)
+{
+	sigset_t signals;
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+}
+
+static void *copy_reader_thread(void *arg)
+{
+	struct copy_reader *cr = arg;
+	struct copy_block *cb;
+	uint64_t offset = cr->rc->device_offset;
+	ssize_t working_block, s;
+	int stop;
+
+	thread_block_signals();
+
+	while ((working_block = copy_next_block(cr, &offset)) > 0) {
+		pthread_mutex_lock(&cr->lock);
+		while (!cr->stop && cr->head - cr->tail == COPY_BUFFERS)
+			pthread_cond_wait(&cr->cond, &cr->lock);
+		stop = cr->stop;
+		pthread_mutex_unlock(&cr->lock);
+		if (stop)
+			break;
+
+		cb = &cr->block[cr->head % COPY_BUFFERS];
+		cb->offset = offset;
+		cb->unused = !block_used(cr->rc, offset, working_block);
+
+		if (cb->unused)
+			s = working_block;
+		else if (lseek64(cr->fd, offset + cr->rc->data_offset_org, SEEK_SET) < 0) {
+			log_dbg("Cannot seek to device offset.");
+			s = -1;
+		} else
+			s = read_buf(cr->fd, cb->buf, working_block);
+
+		if (cr->rc->reencrypt_direction == FORWARD) {
+			if (s < 0 || ((size_t)s != cr->block_size &&
+			    (offset + s) != cr->rc->device_size)) {
+				log_dbg("Read error, expecting %zu, got %zd.",
+					cr->block_size, s);
+				s = -EIO;
+			}
+			/* If device_size is forced, never write more than limit */
+			else if ((s + offset) > cr->rc->device_size)
+				s = cr->rc->device_size - offset;
+			offset += working_block;
+		} else if (s < 0 || s != working_block) {
+			log_dbg("Read error, expecting %zu, got %zd.",
+				cr->block_size, s);
+			s = -EIO;
 		}
+		cb->size = s;
 
-		*bytes += (uint64_t)s2;
-		tools_time_progress(rc->device_size, *bytes,
-				    &rc->start_time, &rc->end_time);
+		pthread_mutex_lock(&cr->lock);
+		cr->head++;
+		pthread_cond_broadcast(&cr->cond);
+		pthread_mutex_unlock(&cr->lock);
+
+		if (s < 0)
+			break;
 	}
 
-	return quit ? -EAGAIN : 0;
+	pthread_mutex_lock(&cr->lock);
+	cr->done = 1;
+	pthread_cond_broadcast(&cr->cond);
+	pthread_mutex_unlock(&cr->lock);
+
+	return NULL;
 }
 
-static void zero_rest_of_device(int fd, size_t block_size, void *buf,
-				uint64_t *bytes, uint64_t offset)
+static int copy_reader_start(struct copy_reader *cr, struct reenc_ctx *rc,
+			     int fd, size_t block_size, void *buf)
 {
-	ssize_t s1, s2;
+	int i;
 
-	log_dbg("Zeroing rest of device.");
+	memset(cr, 0, sizeof(*cr));
+	cr->rc = rc;
+	cr->fd = fd;
+	cr->block_size = block_size;
+	for (i = 0; i < COPY_BUFFERS; i++)
+		cr->block[i].buf = (uint8_t *)buf + i * block_size;
 
-	if (lseek64(fd, offset, SEEK_SET) < 0) {
-		log_dbg(_("Cannot seek to device offset.\n"));
-		return;
+	if (pthread_mutex_init(&cr->lock, NULL))
+		return -ENOMEM;
+	if (pthread_cond_init(&cr->cond, NULL)) {
+		pthread_mutex_destroy(&cr->lock);
+		return -ENOMEM;
+	}
+	if (pthread_create(&cr->thread, NULL, copy_reader_thread, cr)) {
+		pthread_cond_destroy(&cr->cond);
+		pthread_mutex_destroy(&cr->lock);
+		return -ENOMEM;
 	}
 
-	memset(buf, 0, block_size);
-	s1 = block_size;
+	return 0;
+}
 
-	while (!quit && *bytes) {
-		if (*bytes < (uint64_t)s1)
-			s1 = *bytes;
+/* Wait for the next block read, returns NULL if there is no more data */
+static struct copy_block *copy_reader_get(struct copy_reader *cr)
+{
+	struct copy_block *cb = NULL;
 
-		s2 = write(fd, buf, s1);
-		if (s2 < 0) {
-			log_dbg("Write error, expecting %zu, got %zd.",
-				block_size, s2);
-			return;
-		}
+	pthread_mutex_lock(&cr->lock);
+	while (cr->head == cr->tail && !cr->done)
+		pthread_cond_wait(&cr->cond, &cr->lock);
+	if (cr->head != cr->tail)
+		cb = &cr->block[cr->tail % COPY_BUFFERS];
+	pthread_mutex_unlock(&cr->lock);
 
-		if (opt_fsync && fsync(fd) < 0) {
-			log_dbg("Write error, fsync.");
-			return;
-		}
+	return cb;
+}
 
-		*bytes -= s2;
-	}
+/* Return written block buffer to the reader */
+static void copy_reader_put(struct copy_reader *cr)
+{
+	pthread_mutex_lock(&cr->lock);
+	cr->tail++;
+	pthread_cond_broadcast(&cr->cond);
+	pthread_mutex_unlock(&cr->lock);
 }
 
-static int copy_data(struct reenc_ctx *rc)
+static void copy_reader_stop(struct copy_reader *cr)
 {
-	size_t block_size = opt_bsize * 1024 * 1024;
-	int fd_old = -1, fd_new = -1;
-	int r = -EINVAL;
-	void *buf = NULL;
-	uint64_t bytes = 0;
+	pthread_mutex_lock(&cr->lock);
+	cr->stop = 1;
+	pthread_cond_broadcast(&cr->cond);
+	pthread_mutex_unlock(&cr->lock);
+
+	pthread_join(cr->thread, NULL);
+	pthread_cond_destroy(&cr->cond);
+	pthread_mutex_destroy(&cr->lock);
+}
 
-	log_dbg("Data copy preparation.");
+/*
+ * Userspace crypto engine (--use-userspace-crypto). Instead of copying data
+ * between two temporary dm-crypt devices, ciphertext is read directly from
+ * the data device, decrypted with the old and encrypted with the new volume
+ * key by a pool of worker threads (every thread uses its own cipher contexts)
+ * and written back to the data device. Every block is split to sector aligned
+ * chunks processed in parallel.
+ */
+#define CRYPT_WORKERS_MAX 64
 
-	fd_old = open(rc->crypt_path_org, O_RDONLY | (opt_directio ? O_DIRECT : 0));
-	if (fd_old == -1) {
-		log_err(_("Cannot open temporary LUKS device."));
-		goto out;
-	}
+struct crypt_pool;
 
-	fd_new = open(rc->crypt_path_new, O_WRONLY | (opt_directio ? O_DIRECT : 0));
-	if (fd_new == -1) {
-		log_err(_("Cannot open temporary LUKS device."));
-		goto out;
-	}
+struct crypt_worker {
+	struct crypt_pool *pool;
+	pthread_t thread;
+	struct crypt_data_cipher *cipher_org, *cipher_new;
+	unsigned int generation;
+	char *buf;
+	uint64_t offset;
+	size_t length;
+	int decrypt;
+	int r;
+};
 
-	if (ioctl(fd_old, BLKGETSIZE64, &rc->device_size_org_real) < 0) {
-		log_err(_("Cannot get device size."));
-		goto out;
-	}
+struct crypt_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	unsigned int generation;	/* incremented for every submitted block */
+	unsigned int pending;		/* workers not yet finished the block */
+	int stop;
+	size_t align;
+	int count;			/* started workers */
+	struct crypt_worker w[CRYPT_WORKERS_MAX];
+};
 
-	if (ioctl(fd_new, BLKGETSIZE64, &rc->device_size_new_real) < 0) {
-		log_err(_("Cannot get device size."));
-		goto out;
-	}
+static void *crypt_worker_thread(void *arg)
+{
+	struct crypt_worker *w = arg;
+	struct crypt_pool *pool = w->pool;
+	int r;
 
-	if (opt_device_size)
-		rc->device_size = opt_device_size;
-	else if (rc->reencrypt_mode == DECRYPT)
-		rc->device_size = rc->device_size_org_real;
-	else
-		rc->device_size = rc->device_size_new_real;
+	thread_block_signals();
 
-	if (posix_memalign((void *)&buf, alignment(fd_new), block_size)) {
-		log_err(_("Allocation of aligned memory failed."));
-		r = -ENOMEM;
-		goto out;
-	}
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->stop && w->generation == pool->generation)
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		if (pool->stop)
+			break;
+		w->generation = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
 
-	set_int_handler(0);
-	tools_time_progress(rc->device_size, bytes,
-			    &rc->start_time, &rc->end_time);
+		r = 0;
+		if (w->length && w->decrypt)
+			r = crypt_data_cipher_decrypt(w->cipher_org, w->offset, w->buf, w->length);
+		if (!r && w->length)
+			r = crypt_data_cipher_encrypt(w->cipher_new, w->offset, w->buf, w->length);
+
+		pthread_mutex_lock(&pool->lock);
+		w->r = r;
+		if (!--pool->pending)
+			pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
 
-	if (rc->reencrypt_direction == FORWARD)
-		r = copy_data_forward(rc, fd_old, fd_new, block_size, buf, &bytes);
-	else
-		r = copy_data_backward(rc, fd_old, fd_new, block_size, buf, &bytes);
+	return NULL;
+}
 
-	/* Zero (wipe) rest of now plain-only device when decrypting.
-	 * (To not leave any sign of encryption here.) */
-	if (!r && rc->reencrypt_mode == DECRYPT &&
-	    rc->device_size_new_real > rc->device_size_org_real) {
-		bytes = rc->device_size_new_real - rc->device_size_org_real;
-		zero_rest_of_device(fd_new, block_size, buf, &bytes, rc->device_size_org_real);
+/*
+ * Reencrypt block at data area offset in place. Unused block (zeroes)
+ * is only encrypted with the new key.
+ */
+static int crypt_pool_run(struct crypt_pool *pool, void *buf, uint64_t offset,
+			  size_t length, int decrypt)
+{
+	size_t chunk, pos = 0;
+	int i, r = 0;
+
+	chunk = (length / pool->align + pool->count - 1) / pool->count * pool->align;
+	if (!chunk)
+		chunk = pool->align;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < pool->count; i++) {
+		pool->w[i].buf = (char *)buf + pos;
+		pool->w[i].offset = offset + pos;
+		pool->w[i].length = length - pos < chunk ? length - pos : chunk;
+		pool->w[i].decrypt = decrypt;
+		pool->w[i].r = 0;
+		pos += pool->w[i].length;
 	}
+	pool->pending = pool->count;
+	pool->generation++;
+	pthread_cond_broadcast(&pool->cond);
 
+	while (pool->pending)
+		pthread_cond_wait(&pool->cond, &pool->lock);
+
+	for (i = 0; i < pool->count && !r; i++)
+		r = pool->w[i].r;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (r)
+		log_dbg("Userspace reencryption of block at %" PRIu64 " failed (%d).", offset, r);
+	return r;
+}
+
+static void crypt_pool_free(struct crypt_pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	if (pool->count) {
+		pthread_mutex_lock(&pool->lock);
+		pool->stop = 1;
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+
+		for (i = 0; i < pool->count; i++)
+			pthread_join(pool->w[i].thread, NULL);
+	}
+
+	for (i = 0; i < CRYPT_WORKERS_MAX; i++) {
+		crypt_data_cipher_free(pool->w[i].cipher_org);
+		crypt_data_cipher_free(pool->w[i].cipher_new);
+	}
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+/* Load header with data device and unlock its volume key */
+static int header_volume_key(struct reenc_ctx *rc, const char *header,
+			     struct crypt_device **cd, const char *pwd, size_t pwd_len,
+			     char **key, size_t *key_size)
+{
+	int r;
+
+	if ((r = crypt_init(cd, header)) ||
+	    (r = crypt_load(*cd, CRYPT_LUKS, NULL)) ||
+	    (r = crypt_set_data_device(*cd, rc->device)))
+		return r;
+
+	*key_size = crypt_get_volume_key_size(*cd);
+	*key = crypt_safe_alloc(*key_size);
+	if (!*key)
+		return -ENOMEM;
+
+	r = crypt_volume_key_get(*cd, opt_key_slot, *key, key_size, pwd, pwd_len);
+	return r < 0 ? r : 0;
+}
+
+static int crypt_pool_init(struct reenc_ctx *rc)
+{
+	struct crypt_device *cd = NULL, *cd_new = NULL;
+	struct crypt_pool *pool;
+	const char *pwd_old, *pwd_new;
+	char *key = NULL, *key_new = NULL;
+	size_t pwd_old_len, pwd_new_len, key_size = 0, key_new_size = 0;
+	size_t sector_size;
+	long cpus;
+	int i, r;
+
+	log_dbg("Initializing userspace crypto engine.");
+
+	if ((r = header_passwords(rc, &pwd_old, &pwd_old_len, &pwd_new, &pwd_new_len)))
+		return r;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return -ENOMEM;
+
+	if (pthread_mutex_init(&pool->lock, NULL)) {
+		free(pool);
+		return -ENOMEM;
+	}
+	if (pthread_cond_init(&pool->cond, NULL)) {
+		pthread_mutex_destroy(&pool->lock);
+		free(pool);
+		return -ENOMEM;
+	}
+
+	if ((r = header_volume_key(rc, rc->header_file_org, &cd, pwd_old, pwd_old_len,
+				   &key, &key_size)) ||
+	    (r = header_volume_key(rc, rc->header_file_new, &cd_new, pwd_new, pwd_new_len,
+				   &key_new, &key_new_size)))
+		goto out;
+
+	rc->data_offset_org = crypt_get_data_offset(cd) * SECTOR_SIZE;
+	rc->data_offset_new = crypt_get_data_offset(cd_new) * SECTOR_SIZE;
+
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1)
+		cpus = 1;
+	else if (cpus > CRYPT_WORKERS_MAX)
+		cpus = CRYPT_WORKERS_MAX;
+
+	for (i = 0; i < cpus; i++) {
+		pool->w[i].pool = pool;
+		if ((r = crypt_data_cipher_init(cd, &pool->w[i].cipher_org, key, key_size)) ||
+		    (r = crypt_data_cipher_init(cd_new, &pool->w[i].cipher_new, key_new, key_new_size)))
+			goto out;
+	}
+
+	pool->align = crypt_data_cipher_sector_size(pool->w[0].cipher_org);
+	sector_size = crypt_data_cipher_sector_size(pool->w[0].cipher_new);
+	if (sector_size > pool->align)
+		pool->align = sector_size;
+
+	for (i = 0; i < cpus; i++) {
+		if (pthread_create(&pool->w[i].thread, NULL, crypt_worker_thread, &pool->w[i])) {
+			r = -ENOMEM;
+			goto out;
+		}
+		pool->count++;
+	}
+
+	log_dbg("Userspace crypto engine uses %d threads.", pool->count);
+	rc->pool = pool;
+	r = 0;
+out:
+	crypt_safe_free(key);
+	crypt_safe_free(key_new);
+	crypt_free(cd);
+	crypt_free(cd_new);
+	if (r < 0) {
+		crypt_pool_free(pool);
+		rc->data_offset_org = rc->data_offset_new = 0;
+		log_err(_("Initialization of userspace crypto engine failed."));
+	}
+	return r;
+}
+
+/*
+ * Throttling of the data copy, so reencryption uses only spare bandwidth.
+ * A token bucket limits throughput (--max-rate) and requests (--max-iops,
+ * one read and one write per block). With --max-latency, a delay between
+ * blocks doubles while the average request latency of the device (from its
+ * sysfs stat) exceeds the limit and decays when it drops back.
+ * At runtime SIGUSR1 halves and SIGUSR2 doubles the rate limits.
+ */
+#define THROTTLE_SHIFT_MAX	6
+#define THROTTLE_DELAY_MIN	10000		/* usec */
+#define THROTTLE_DELAY_MAX	1000000		/* usec */
+
+static volatile sig_atomic_t throttle_shift = 0;
+
+static void throttle_handler(int sig)
+{
+	if (sig == SIGUSR1 && throttle_shift < THROTTLE_SHIFT_MAX)
+		throttle_shift++;
+	else if (sig == SIGUSR2 && throttle_shift > -THROTTLE_SHIFT_MAX)
+		throttle_shift--;
+}
+
+struct copy_throttle {
+	uint64_t rate, iops;		/* configured limits, 0 is unlimited */
+	double byte_tokens, io_tokens;
+	struct timespec start, last;
+	uint64_t bytes;
+	int shift;
+
+	char stat_path[PATH_MAX];	/* empty if latency is not watched */
+	uint64_t stat_ios, stat_ticks;
+	struct timespec stat_last;
+	unsigned long delay;		/* usec */
+};
+
+static double time_diff(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1E9;
+}
+
+static void throttle_sleep(double sec)
+{
+	struct timespec ts;
+
+	if (sec <= 0)
+		return;
+
+	ts.tv_sec = (time_t)sec;
+	ts.tv_nsec = (long)((sec - ts.tv_sec) * 1E9);
+
+	/* interrupted by a signal, the caller checks quit */
+	(void)nanosleep(&ts, NULL);
+}
+
+static int throttle_read_stat(struct copy_throttle *ct, uint64_t *ios, uint64_t *ticks)
+{
+	unsigned long long rd_ios, rd_ticks, wr_ios, wr_ticks;
+	FILE *f;
+	int r;
+
+	if (!(f = fopen(ct->stat_path, "r")))
+		return -EINVAL;
+
+	r = fscanf(f, "%llu %*u %*u %llu %llu %*u %*u %llu",
+		   &rd_ios, &rd_ticks, &wr_ios, &wr_ticks);
+	fclose(f);
+	if (r != 4)
+		return -EINVAL;
+
+	*ios = rd_ios + wr_ios;
+	*ticks = rd_ticks + wr_ticks;
+	return 0;
+}
+
+static void throttle_init(struct copy_throttle *ct, const char *device)
+{
+	struct stat st;
+
+	memset(ct, 0, sizeof(*ct));
+	ct->rate = (uint64_t)opt_max_rate * 1024 * 1024;
+	ct->iops = (uint64_t)opt_max_iops;
+	clock_gettime(CLOCK_MONOTONIC, &ct->start);
+	ct->last = ct->stat_last = ct->start;
+
+	if (!opt_max_latency)
+		return;
+
+	if (stat(device, &st) < 0 || !S_ISBLK(st.st_mode) ||
+	    snprintf(ct->stat_path, sizeof(ct->stat_path), "/sys/dev/block/%u:%u/stat",
+		     major(st.st_rdev), minor(st.st_rdev)) < 0 ||
+	    throttle_read_stat(ct, &ct->stat_ios, &ct->stat_ticks)) {
+		log_verbose(_("Cannot read I/O statistics of device %s, latency limit ignored."), device);
+		ct->stat_path[0] = '\0';
+	}
+}
+
+/* Apply runtime adjustment requested by a signal */
+static void throttle_adjust(struct copy_throttle *ct, const struct timespec *now)
+{
+	int shift = throttle_shift;
+	double elapsed;
+
+	if (shift == ct->shift)
+		return;
+
+	/* Without configured limit use current throughput as the base */
+	elapsed = time_diff(&ct->start, now);
+	if (!ct->rate && shift > ct->shift && elapsed > 0)
+		ct->rate = (uint64_t)(ct->bytes / elapsed);
+
+	for (; ct->shift < shift; ct->shift++) {
+		ct->rate /= 2;
+		ct->iops /= 2;
+	}
+	for (; ct->shift > shift; ct->shift--) {
+		ct->rate *= 2;
+		ct->iops *= 2;
+	}
+
+	if (ct->rate && ct->rate < SECTOR_SIZE)
+		ct->rate = SECTOR_SIZE;
+	if (ct->iops && ct->iops < 1)
+		ct->iops = 1;
+
+	log_dbg("Throttle adjusted to %" PRIu64 " bytes/s, %" PRIu64 " IOPS.",
+		ct->rate, ct->iops);
+}
+
+/* Latency feedback: multiplicative increase, slow decay of the delay */
+static void throttle_latency(struct copy_throttle *ct, const struct timespec *now)
+{
+	uint64_t ios, ticks;
+
+	if (!ct->stat_path[0] || time_diff(&ct->stat_last, now) < 1.0)
+		return;
+	ct->stat_last = *now;
+
+	if (throttle_read_stat(ct, &ios, &ticks))
+		return;
+
+	if (ios > ct->stat_ios &&
+	    (ticks - ct->stat_ticks) / (ios - ct->stat_ios) > (uint64_t)opt_max_latency) {
+		ct->delay = ct->delay ? ct->delay * 2 : THROTTLE_DELAY_MIN;
+		if (ct->delay > THROTTLE_DELAY_MAX)
+			ct->delay = THROTTLE_DELAY_MAX;
+	} else if (ct->delay) {
+		ct->delay -= ct->delay / 4;
+		if (ct->delay < THROTTLE_DELAY_MIN / 10)
+			ct->delay = 0;
+	}
+
+	ct->stat_ios = ios;
+	ct->stat_ticks = ticks;
+}
+
+static double throttle_bucket(double *tokens, uint64_t limit, double elapsed, double size)
+{
+	double wait = 0;
+
+	/* burst of one second, but always allow one full request */
+	*tokens += elapsed * limit;
+	if (*tokens > (limit > size ? limit : size))
+		*tokens = limit > size ? limit : size;
+
+	if (*tokens < size)
+		wait = (size - *tokens) / limit;
+
+	*tokens -= size;
+	return wait;
+}
+
+/* Wait before writing the block of the specified size */
+static void throttle_wait(struct copy_throttle *ct, size_t size)
+{
+	struct timespec now;
+	double elapsed, wait = 0, wait_io = 0;
+
+	ct->bytes += size;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	throttle_adjust(ct, &now);
+	throttle_latency(ct, &now);
+
+	elapsed = time_diff(&ct->last, &now);
+	ct->last = now;
+
+	if (ct->rate)
+		wait = throttle_bucket(&ct->byte_tokens, ct->rate, elapsed, size);
+	if (ct->iops)
+		wait_io = throttle_bucket(&ct->io_tokens, ct->iops, elapsed, 2);
+	if (wait_io > wait)
+		wait = wait_io;
+
+	throttle_sleep(wait + ct->delay / 1E6);
+}
+
+static void throttle_handlers(int install)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = install ? throttle_handler : SIG_DFL;
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+}
+
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_WHO_PROCESS	1
+enum { IOPRIO_CLASS_NONE, IOPRIO_CLASS_RT, IOPRIO_CLASS_BE, IOPRIO_CLASS_IDLE };
+
+/* Parse "idle", "best-effort[:level]" or "realtime[:level]" */
+static int parse_io_priority(const char *str, int *ioprio)
+{
+	const char *level;
+	char *end;
+	long data = 4;
+	size_t len;
+	int class;
+
+	level = strchr(str, ':');
+	len = level ? (size_t)(level - str) : strlen(str);
+
+	if (len == 4 && !strncmp(str, "idle", len) && !level)
+		class = IOPRIO_CLASS_IDLE;
+	else if (len == 11 && !strncmp(str, "best-effort", len))
+		class = IOPRIO_CLASS_BE;
+	else if (len == 8 && !strncmp(str, "realtime", len))
+		class = IOPRIO_CLASS_RT;
+	else
+		return -EINVAL;
+
+	if (level) {
+		errno = 0;
+		data = strtol(level + 1, &end, 10);
+		if (errno || *end || end == level + 1 || data < 0 || data > 7)
+			return -EINVAL;
+	} else if (class == IOPRIO_CLASS_IDLE)
+		data = 0;
+
+	*ioprio = (class << IOPRIO_CLASS_SHIFT) | (int)data;
+	return 0;
+}
+
+/* The reader thread inherits the priority, set it before it is started */
+static int set_io_priority(void)
+{
+	int ioprio;
+
+	if (!opt_io_priority || parse_io_priority(opt_io_priority, &ioprio))
+		return 0;
+#ifdef SYS_ioprio_set
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio) < 0) {
+		log_err(_("Cannot set I/O priority %s."), opt_io_priority);
+		return -EINVAL;
+	}
+	log_dbg("I/O priority set to %s.", opt_io_priority);
+	return 0;
+#else
+	log_err(_("Setting I/O priority is not supported."));
+	return -ENOTSUP;
+#endif
+}
+
+/* Discard unused block on the new device, fails if discards are not supported */
+static int discard_block(int fd, uint64_t offset, uint64_t size)
+{
+	uint64_t range[2] = { offset, size };
+
+	if (ioctl(fd, BLKDISCARD, &range) < 0) {
+		log_dbg("Discard of block at %" PRIu64 " failed, writing zeroes.", offset);
+		return -errno;
+	}
+
+	return 0;
+}
+
+/*
+ * Commit written but not yet logged data: one fsync barrier (with --use-fsync)
+ * followed by the log update, so the log never points beyond synced data.
+ */
+static int copy_checkpoint(struct reenc_ctx *rc, int fd_new, uint64_t *pending)
+{
+	if (opt_fsync && fsync(fd_new) < 0) {
+		log_dbg("Write error, fsync.");
+		return -EIO;
+	}
+
+	if (rc->reencrypt_direction == FORWARD)
+		rc->device_offset += *pending;
+	else
+		rc->device_offset -= *pending;
+	*pending = 0;
+
+	if (opt_write_log && write_log(rc) < 0)
+		return -EIO;
+
+	return 0;
+}
+
+/*
+ * Write blocks in copy order. Data are committed after every block or,
+ * with --checkpoint-interval, after the specified amount of data
+ * and on interruption.
+ */
+static int copy_data_blocks(struct reenc_ctx *rc, int fd_old, int fd_new,
+			    size_t block_size, void *buf, uint64_t *bytes)
+{
+	struct copy_reader cr;
+	struct copy_block *cb;
+	struct copy_throttle ct;
+	uint64_t pending = 0, checkpoint = (uint64_t)opt_checkpoint_interval * 1024 * 1024;
+	ssize_t s2;
+	int r = 0;
+
+	throttle_init(&ct, rc->device);
+
+	if ((r = set_io_priority()))
+		return r;
+
+	if (copy_reader_start(&cr, rc, fd_old, block_size, buf)) {
+		log_err(_("Cannot create reader thread."));
+		return -ENOMEM;
+	}
+
+	while (!quit && (cb = copy_reader_get(&cr))) {
+		if (cb->size < 0) {
+			tools_progress_io_error();
+			r = -EIO;
+			break;
+		}
+
+		if (cb->unused && opt_discard_unused &&
+		    !discard_block(fd_new, cb->offset + rc->data_offset_new, cb->size))
+			s2 = cb->size;
+		else {
+			/* unused block gets fresh encrypted zeroes */
+			if (cb->unused)
+				memset(cb->buf, 0, cb->size);
+
+			if (rc->pool && crypt_pool_run(rc->pool, cb->buf, cb->offset,
+						       cb->size, !cb->unused)) {
+				r = -EIO;
+				break;
+			}
+
+			throttle_wait(&ct, cb->size);
+			if (quit)
+				break;
+
+			if (lseek64(fd_new, cb->offset + rc->data_offset_new, SEEK_SET) < 0) {
+				log_err(_("Cannot seek to device offset."));
+				r = -EIO;
+				break;
+			}
+
+			s2 = write(fd_new, cb->buf, cb->size);
+		}
+		if (s2 < 0) {
+			log_dbg("Write error, expecting %zu, got %zd.",
+				block_size, s2);
+			tools_progress_io_error();
+			r = -EIO;
+			break;
+		}
+
+		pending += cb->size;
+		copy_reader_put(&cr);
+
+		*bytes += (uint64_t)s2;
+		copy_progress(rc, *bytes);
+
+		if (pending >= checkpoint && (r = copy_checkpoint(rc, fd_new, &pending)))
+			break;
+	}
+
+	if (!r && pending)
+		r = copy_checkpoint(rc, fd_new, &pending);
+
+	copy_reader_stop(&cr);
+
+	if (r)
+		return r;
+	return quit ? -EAGAIN : 0;
+}
+
+static int copy_data_forward(struct reenc_ctx *rc, int fd_old, int fd_new,
+			     size_t block_size, void *buf, uint64_t *bytes)
+{
+	log_dbg("Reencrypting in forward direction.");
+
+	rc->resume_bytes = *bytes = rc->device_offset;
+
+	if (write_log(rc) < 0)
+		return -EIO;
+
+	return copy_data_blocks(rc, fd_old, fd_new, block_size, buf, bytes);
+}
+
+static int copy_data_backward(struct reenc_ctx *rc, int fd_old, int fd_new,
+			      size_t block_size, void *buf, uint64_t *bytes)
+{
+	log_dbg("Reencrypting in backward direction.");
+
+	if (!rc->in_progress) {
+		rc->device_offset = rc->device_size;
+		rc->resume_bytes = 0;
+		*bytes = 0;
+	} else {
+		rc->resume_bytes = rc->device_size - rc->device_offset;
+		*bytes = rc->resume_bytes;
+	}
+
+	if (write_log(rc) < 0)
+		return -EIO;
+
+	/* dirty the device during ENCRYPT mode */
+	rc->stained = 1;
+
+	return copy_data_blocks(rc, fd_old, fd_new, block_size, buf, bytes);
+}
+
+static void zero_rest_of_device(int fd, size_t block_size, void *buf,
+				uint64_t *bytes, uint64_t offset)
+{
+	ssize_t s1, s2;
+
+	log_dbg("Zeroing rest of device.");
+
+	if (lseek64(fd, offset, SEEK_SET) < 0) {
+		log_dbg(_("Cannot seek to device offset.\n"));
+		return;
+	}
+
+	memset(buf, 0, block_size);
+	s1 = block_size;
+
+	while (!quit && *bytes) {
+		if (*bytes < (uint64_t)s1)
+			s1 = *bytes;
+
+		s2 = write(fd, buf, s1);
+		if (s2 < 0) {
+			log_dbg("Write error, expecting %zu, got %zd.",
+				block_size, s2);
+			return;
+		}
+
+		if (opt_fsync && fsync(fd) < 0) {
+			log_dbg("Write error, fsync.");
+			return;
+		}
+
+		*bytes -= s2;
+	}
+}
+
+/* With userspace crypto both sides are data areas of the data device */
+static int copy_data_open(struct reenc_ctx *rc, int *fd_old, int *fd_new)
+{
+	const char *path_org = rc->pool ? rc->device : rc->crypt_path_org;
+	const char *path_new = rc->pool ? rc->device : rc->crypt_path_new;
+	uint64_t size;
+
+	*fd_old = open(path_org, O_RDONLY | (opt_directio ? O_DIRECT : 0));
+	if (*fd_old == -1) {
+		log_err(_("Cannot open temporary LUKS device."));
+		return -EINVAL;
+	}
+
+	*fd_new = open(path_new, O_WRONLY | (opt_directio ? O_DIRECT : 0));
+	if (*fd_new == -1) {
+		log_err(_("Cannot open temporary LUKS device."));
+		return -EINVAL;
+	}
+
+	if (!rc->pool) {
+		if (ioctl(*fd_old, BLKGETSIZE64, &rc->device_size_org_real) < 0 ||
+		    ioctl(*fd_new, BLKGETSIZE64, &rc->device_size_new_real) < 0) {
+			log_err(_("Cannot get device size."));
+			return -EINVAL;
+		}
+		return 0;
+	}
+
+	if (ioctl(*fd_old, BLKGETSIZE64, &size) < 0 ||
+	    size < rc->data_offset_org || size < rc->data_offset_new) {
+		log_err(_("Cannot get device size."));
+		return -EINVAL;
+	}
+
+	rc->device_size_org_real = size - rc->data_offset_org;
+	rc->device_size_new_real = size - rc->data_offset_new;
+	return 0;
+}
+
+static int copy_data(struct reenc_ctx *rc)
+{
+	size_t block_size = opt_bsize * 1024 * 1024;
+	int fd_old = -1, fd_new = -1;
+	int r = -EINVAL;
+	void *buf = NULL;
+	uint64_t bytes = 0;
+
+	log_dbg("Data copy preparation.");
+
+	if (copy_data_open(rc, &fd_old, &fd_new))
+		goto out;
+
+	if (opt_device_size)
+		rc->device_size = opt_device_size;
+	else if (rc->reencrypt_mode == DECRYPT)
+		rc->device_size = rc->device_size_org_real;
+	else
+		rc->device_size = rc->device_size_new_real;
+
+	if (posix_memalign((void *)&buf, alignment(fd_new), COPY_BUFFERS * block_size)) {
+		log_err(_("Allocation of aligned memory failed."));
+		r = -ENOMEM;
+		goto out;
+	}
+
+	set_int_handler(0);
+	throttle_handlers(1);
+	tools_progress_init(NULL, "reencrypt");
+	copy_progress(rc, bytes);
+
+	if (rc->reencrypt_direction == FORWARD)
+		r = copy_data_forward(rc, fd_old, fd_new, block_size, buf, &bytes);
+	else
+		r = copy_data_backward(rc, fd_old, fd_new, block_size, buf, &bytes);
+
+	/* Zero (wipe) rest of now plain-only device when decrypting.
+	 * (To not leave any sign of encryption here.) */
+	if (!r && rc->reencrypt_mode == DECRYPT &&
+	    rc->device_size_new_real > rc->device_size_org_real) {
+		bytes = rc->device_size_new_real - rc->device_size_org_real;
+		zero_rest_of_device(fd_new, block_size, buf, &bytes,
+				    rc->device_size_org_real + rc->data_offset_new);
+	}
+
+	throttle_handlers(0);
 	set_int_block(1);
 
 	if (r == -EAGAIN)
@@ -1394,6 +2408,9 @@ static int initialize_context(struct reenc_ctx *rc, const char *device)
 	if (device_check(rc, rc->device, CHECK_OPEN) < 0)
 		return -EINVAL;
 
+	if (opt_used_map && load_used_map(rc, opt_used_map))
+		return -EINVAL;
+
 	if (initialize_uuid(rc)) {
 		log_err(_("Device %s is not a valid LUKS device."), device);
 		return -EINVAL;
@@ -1429,7 +2446,10 @@ static int initialize_context(struct reenc_ctx *rc, const char *device)
 
 	remove_headers(rc);
 
-	if (open_log(rc) < 0) {
+	if (!load_checkpoint(rc)) {
+		/* stale log from interrupted switch to header checkpoint */
+		unlink(rc->log_file);
+	} else if (open_log(rc) < 0) {
 		log_err(_("Cannot open reencryption log file."));
 		return -EINVAL;
 	}
@@ -1467,6 +2487,7 @@ static void destroy_context(struct reenc_ctx *rc)
 
 	close_log(rc);
 	remove_headers(rc);
+	crypt_free(rc->cd_checkpoint);
 
 	if (!rc->stained) {
 		unlink(rc->log_file);
@@ -1478,9 +2499,11 @@ static void destroy_context(struct reenc_ctx *rc)
 	for (i = 0; i < MAX_SLOT; i++)
 		crypt_safe_free(rc->p[i].password);
 
+	crypt_pool_free(rc->pool);
 	free(rc->device);
 	free(rc->device_header);
 	free(rc->device_uuid);
+	free(rc->used);
 }
 
 static int luks2_change_pbkdf_params(struct reenc_ctx *rc)
@@ -1563,6 +2586,7 @@ static int run_reencrypt(const char *device)
 				goto out;
 			if ((r = device_check(&rc, hdr_device(&rc), MAKE_UNUSABLE)))
 				goto out;
+			start_checkpoint(&rc);
 		}
 	} else {
 		if ((r = initialize_passphrase(&rc, opt_decrypt ? rc.header_file_org : rc.header_file_new)))
@@ -1571,7 +2595,11 @@ static int run_reencrypt(const char *device)
 
 	if (!opt_keep_key) {
 		log_dbg("Running data area reencryption.");
-		if ((r = activate_luks_headers(&rc)))
+		if (opt_userspace_crypto)
+			r = crypt_pool_init(&rc);
+		else
+			r = activate_luks_headers(&rc);
+		if (r)
 			goto out;
 
 		if ((r = copy_data(&rc)))
@@ -1589,6 +2617,301 @@ out:
 	return r;
 }
 
+/*
+ * Multi-device mode. Every device is reencrypted in a separate child process
+ * (the tool keeps per-device state in globals), the parent schedules children
+ * so that no physical disk is used by more than --max-per-disk of them
+ * and prints aggregate progress reported by children through pipes.
+ */
+#define JOB_DISKS_MAX	16
+#define JOB_DEPTH_MAX	8
+
+struct reenc_job {
+	const char *device;
+	enum { JOB_PENDING = 0, JOB_RUNNING, JOB_DONE } state;
+	pid_t pid;
+	int fd;
+	dev_t disks[JOB_DISKS_MAX];
+	int disks_count;
+	struct progress_msg progress;
+	int status;
+};
+
+static int sysfs_read_devno(const char *path, dev_t *devno)
+{
+	unsigned int maj, min;
+	FILE *f;
+	int r;
+
+	if (!(f = fopen(path, "r")))
+		return -EINVAL;
+	r = fscanf(f, "%u:%u", &maj, &min);
+	fclose(f);
+	if (r != 2)
+		return -EINVAL;
+
+	*devno = makedev(maj, min);
+	return 0;
+}
+
+static void job_add_disk(struct reenc_job *job, dev_t devno)
+{
+	int i;
+
+	for (i = 0; i < job->disks_count; i++)
+		if (job->disks[i] == devno)
+			return;
+
+	if (job->disks_count < JOB_DISKS_MAX)
+		job->disks[job->disks_count++] = devno;
+}
+
+/* Walk sysfs slaves down to whole disks (partition is mapped to its disk) */
+static void job_find_disks(struct reenc_job *job, dev_t devno, int depth)
+{
+	char path[PATH_MAX];
+	struct dirent *entry;
+	struct stat st;
+	dev_t slave;
+	DIR *dir;
+	int slaves = 0;
+
+	if (depth > JOB_DEPTH_MAX)
+		return;
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/slaves",
+		     major(devno), minor(devno)) < 0)
+		return;
+
+	if ((dir = opendir(path))) {
+		while ((entry = readdir(dir))) {
+			if (entry->d_name[0] == '.')
+				continue;
+			if (snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/slaves/%s/dev",
+				     major(devno), minor(devno), entry->d_name) < 0 ||
+			    sysfs_read_devno(path, &slave))
+				continue;
+			job_find_disks(job, slave, depth + 1);
+			slaves++;
+		}
+		closedir(dir);
+	}
+
+	if (slaves)
+		return;
+
+	if (snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/partition",
+		     major(devno), minor(devno)) > 0 && !stat(path, &st) &&
+	    snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/../dev",
+		     major(devno), minor(devno)) > 0 && !sysfs_read_devno(path, &slave))
+		devno = slave;
+
+	job_add_disk(job, devno);
+}
+
+static int job_init(struct reenc_job *job, const char *device)
+{
+	struct stat st;
+
+	memset(job, 0, sizeof(*job));
+	job->device = device;
+	job->fd = -1;
+
+	if (stat(device, &st) < 0) {
+		log_err(_("Cannot access device %s."), device);
+		return -EINVAL;
+	}
+
+	/* image file shares the disk with its filesystem */
+	if (S_ISBLK(st.st_mode))
+		job_find_disks(job, st.st_rdev, 0);
+	else
+		job_add_disk(job, st.st_dev);
+
+	log_dbg("Device %s uses %d physical disk(s).", device, job->disks_count);
+	return 0;
+}
+
+static int job_can_start(const struct reenc_job *jobs, int count, const struct reenc_job *job)
+{
+	int i, j, k, users;
+
+	for (i = 0; i < job->disks_count; i++) {
+		users = 0;
+		for (j = 0; j < count; j++) {
+			if (jobs[j].state != JOB_RUNNING)
+				continue;
+			for (k = 0; k < jobs[j].disks_count; k++)
+				if (jobs[j].disks[k] == job->disks[i])
+					users++;
+		}
+		if (users >= opt_max_per_disk)
+			return 0;
+	}
+
+	return 1;
+}
+
+static int job_start(struct reenc_job *job)
+{
+	int fds[2], r;
+	pid_t pid;
+
+	if (pipe(fds) < 0)
+		return -errno;
+
+	pid = fork();
+	if (pid < 0) {
+		close(fds[0]);
+		close(fds[1]);
+		return -errno;
+	}
+
+	if (!pid) {
+		close(fds[0]);
+		progress_fd = fds[1];
+		r = run_reencrypt(job->device);
+		close(progress_fd);
+		exit(translate_errno(r));
+	}
+
+	close(fds[1]);
+	job->fd = fds[0];
+	job->pid = pid;
+	job->state = JOB_RUNNING;
+	log_verbose(_("Started reencryption of device %s."), job->device);
+
+	return 0;
+}
+
+static void job_finish(struct reenc_job *job)
+{
+	int status;
+
+	close(job->fd);
+	job->fd = -1;
+
+	while (waitpid(job->pid, &status, 0) < 0 && errno == EINTR)
+		;
+
+	job->status = WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+	job->state = JOB_DONE;
+
+	if (job->status)
+		log_err(_("Reencryption of device %s failed."), job->device);
+	else
+		log_verbose(_("Reencryption of device %s finished."), job->device);
+}
+
+static void job_read_progress(struct reenc_job *job)
+{
+	struct progress_msg msg;
+	ssize_t s;
+
+	while ((s = read(job->fd, &msg, sizeof(msg))) < 0 && errno == EINTR)
+		;
+
+	if (s == sizeof(msg))
+		job->progress = msg;
+	else
+		job_finish(job);
+}
+
+static int run_reencrypt_devices(const char **devices, int count)
+{
+	struct reenc_job *jobs;
+	struct pollfd *pfd;
+	struct timeval start_time = {}, end_time = {};
+	struct progress_msg total = {};
+	int i, running, nfds, failed = 0, r = 0;
+
+	jobs = calloc(count, sizeof(*jobs));
+	pfd = calloc(count, sizeof(*pfd));
+	if (!jobs || !pfd) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < count; i++)
+		if ((r = job_init(&jobs[i], devices[i])))
+			goto out;
+
+	tools_progress_init(NULL, "reencrypt");
+
+	/* children stop on their own, parent only stops starting new ones */
+	set_int_handler(0);
+
+	do {
+		for (i = 0, running = 0; i < count; i++) {
+			if (!quit && jobs[i].state == JOB_PENDING &&
+			    (!opt_jobs || running < opt_jobs) &&
+			    job_can_start(jobs, count, &jobs[i]) &&
+			    (r = job_start(&jobs[i]))) {
+				log_err(_("Cannot start reencryption of device %s."), jobs[i].device);
+				jobs[i].state = JOB_DONE;
+				jobs[i].status = EXIT_FAILURE;
+			}
+			if (jobs[i].state == JOB_RUNNING)
+				running++;
+		}
+
+		for (i = 0, nfds = 0; i < count; i++) {
+			if (jobs[i].state != JOB_RUNNING)
+				continue;
+			pfd[nfds].fd = jobs[i].fd;
+			pfd[nfds].events = POLLIN;
+			nfds++;
+		}
+
+		if (!nfds)
+			break;
+
+		if (poll(pfd, nfds, 1000) < 0 && errno != EINTR) {
+			r = -errno;
+			break;
+		}
+
+		for (i = 0, nfds = 0; i < count; i++) {
+			if (jobs[i].state != JOB_RUNNING)
+				continue;
+			if (pfd[nfds++].revents & (POLLIN | POLLHUP | POLLERR))
+				job_read_progress(&jobs[i]);
+		}
+
+		memset(&total, 0, sizeof(total));
+		for (i = 0; i < count; i++) {
+			total.size += jobs[i].progress.size;
+			total.bytes += jobs[i].progress.bytes;
+		}
+		if (total.size && total.bytes != total.size)
+			tools_time_progress(total.size, total.bytes, &start_time, &end_time);
+	} while (1);
+
+	/* error in parent, wait for running children anyway */
+	for (i = 0; i < count; i++)
+		if (jobs[i].state == JOB_RUNNING)
+			job_finish(&jobs[i]);
+
+	if (total.size)
+		tools_time_progress(total.size, total.size, &start_time, &end_time);
+
+	for (i = 0; i < count; i++)
+		if (jobs[i].state != JOB_DONE || jobs[i].status)
+			failed++;
+
+	if (failed) {
+		log_err(_("Reencryption of %d of %d devices did not finish."), failed, count);
+		if (!r)
+			r = quit ? -EAGAIN : -EINVAL;
+	}
+
+	set_int_block(1);
+out:
+	free(jobs);
+	free(pfd);
+	return r;
+}
+
 static void help(poptContext popt_context,
 		 enum poptCallbackReason reason __attribute__((unused)),
 		 struct poptOption *key,
@@ -1626,12 +2949,24 @@ int main(int argc, const char **argv)
 		{ "iter-time",         'i',  POPT_ARG_INT, &opt_iteration_time,         0, N_("PBKDF2 iteration time for LUKS (in ms)"), N_("msecs") },
 		{ "batch-mode",        'q',  POPT_ARG_NONE, &opt_batch_mode,            0, N_("Do not ask for confirmation"), NULL },
 		{ "progress-frequency",'\0', POPT_ARG_INT, &opt_progress_frequency,     0, N_("Progress line update (in seconds)"), N_("secs") },
+		{ "progress-json",     '\0', POPT_ARG_NONE, &opt_progress_json,         0, N_("Print progress as JSON objects"), NULL },
+		{ "progress-fd",       '\0', POPT_ARG_INT, &opt_progress_fd,            0, N_("Write JSON progress to file descriptor"), N_("fd") },
 		{ "tries",             'T',  POPT_ARG_INT, &opt_tries,                  0, N_("How often the input of the passphrase can be retried"), NULL },
 		{ "use-random",        '\0', POPT_ARG_NONE, &opt_random,                0, N_("Use /dev/random for generating volume key"), NULL },
 		{ "use-urandom",       '\0', POPT_ARG_NONE, &opt_urandom,               0, N_("Use /dev/urandom for generating volume key"), NULL },
 		{ "use-directio",      '\0', POPT_ARG_NONE, &opt_directio,              0, N_("Use direct-io when accessing devices"), NULL },
+		{ "use-userspace-crypto",'\0', POPT_ARG_NONE, &opt_userspace_crypto,    0, N_("Reencrypt data in userspace instead of temporary dm-crypt devices"), NULL },
 		{ "use-fsync",         '\0', POPT_ARG_NONE, &opt_fsync,                 0, N_("Use fsync after each block"), NULL },
 		{ "write-log",         '\0', POPT_ARG_NONE, &opt_write_log,             0, N_("Update log file after every block"), NULL },
+		{ "checkpoint-interval",'\0', POPT_ARG_INT, &opt_checkpoint_interval,   0, N_("Sync data and update log file only after this amount of data"), N_("MiB") },
+		{ "max-rate",          '\0', POPT_ARG_INT, &opt_max_rate,               0, N_("Limit reencryption throughput"), N_("MiB/s") },
+		{ "max-iops",          '\0', POPT_ARG_INT, &opt_max_iops,               0, N_("Limit reencryption I/O requests per second"), NULL },
+		{ "max-latency",       '\0', POPT_ARG_INT, &opt_max_latency,            0, N_("Back off while average device I/O latency exceeds limit"), N_("msecs") },
+		{ "used-map",          '\0', POPT_ARG_STRING, &opt_used_map,            0, N_("Reencrypt only data extents listed in file"), NULL },
+		{ "discard-unused",    '\0', POPT_ARG_NONE, &opt_discard_unused,        0, N_("Discard unused blocks instead of writing zeroes"), NULL },
+		{ "jobs",              '\0', POPT_ARG_INT, &opt_jobs,                   0, N_("Maximum number of devices reencrypted in parallel"), NULL },
+		{ "max-per-disk",      '\0', POPT_ARG_INT, &opt_max_per_disk,           0, N_("Maximum number of devices reencrypted in parallel on one physical disk"), NULL },
+		{ "io-priority",       '\0', POPT_ARG_STRING, &opt_io_priority,         0, N_("I/O scheduling class: idle, best-effort[:level], realtime[:level]"), NULL },
 		{ "key-slot",          'S',  POPT_ARG_INT, &opt_key_slot,               0, N_("Use only this slot (others will be disabled)"), NULL },
 		{ "keyfile-offset",   '\0',  POPT_ARG_LONG, &opt_keyfile_offset,        0, N_("Number of bytes to skip in keyfile"), N_("bytes") },
 		{ "keyfile-size",      'l',  POPT_ARG_LONG, &opt_keyfile_size,          0, N_("Limits the read from keyfile"), N_("bytes") },
@@ -1649,7 +2984,7 @@ int main(int argc, const char **argv)
 		POPT_TABLEEND
 	};
 	poptContext popt_context;
-	int r;
+	int r, ioprio, devices;
 
 	crypt_set_log_callback(NULL, tool_log, NULL);
 
@@ -1661,13 +2996,17 @@ int main(int argc, const char **argv)
 
 	popt_context = poptGetContext(PACKAGE, argc, argv, popt_options, 0);
 	poptSetOtherOptionHelp(popt_context,
-	                       _("[OPTION...] <device>"));
+	                       _("[OPTION...] <device> [<device>...]"));
 
 	while((r = poptGetNextOpt(popt_context)) > 0) ;
 	if (r < -1)
 		usage(popt_context, EXIT_FAILURE, poptStrerror(r),
 		      poptBadOption(popt_context, POPT_BADOPTION_NOALIAS));
 
+	/* progress file descriptor implies machine readable progress */
+	if (opt_progress_fd >= 0)
+		opt_progress_json = 1;
+
 	if (opt_version_mode) {
 		log_std("%s %s\n", PACKAGE_REENC, PACKAGE_VERSION);
 		poptFreeContext(popt_context);
@@ -1693,7 +3032,8 @@ int main(int argc, const char **argv)
 	if (opt_bsize < 0 || opt_key_size < 0 || opt_iteration_time < 0 ||
 	    opt_tries < 0 || opt_keyfile_offset < 0 || opt_key_size < 0 ||
 	    opt_pbkdf_iterations < 0 || opt_pbkdf_memory < 0 ||
-	    opt_pbkdf_parallel < 0) {
+	    opt_pbkdf_parallel < 0 || opt_checkpoint_interval < 0 ||
+	    opt_max_rate < 0 || opt_max_iops < 0 || opt_max_latency < 0) {
 		usage(popt_context, EXIT_FAILURE,
 		      _("Negative number for option not permitted."),
 		      poptGetInvocationName(popt_context));
@@ -1714,6 +3054,28 @@ int main(int argc, const char **argv)
 		      _("Only values between 1 MiB and 64 MiB allowed for reencryption block size."),
 		      poptGetInvocationName(popt_context));
 
+	if (opt_jobs < 0 || opt_max_per_disk < 1)
+		usage(popt_context, EXIT_FAILURE,
+		      _("Invalid parallel reencryption limit."),
+		      poptGetInvocationName(popt_context));
+
+	if (action_argv[1] && (!opt_key_file || opt_header_device || opt_uuid ||
+	    opt_used_map || opt_master_key_file || opt_device_size_str))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Reencryption of multiple devices requires --key-file and cannot be used "
+			"with --header, --uuid, --used-map, --master-key-file or --device-size."),
+		      poptGetInvocationName(popt_context));
+
+	if (opt_discard_unused && !opt_used_map)
+		usage(popt_context, EXIT_FAILURE,
+		      _("Option --discard-unused can be used only together with --used-map."),
+		      poptGetInvocationName(popt_context));
+
+	if (opt_io_priority && parse_io_priority(opt_io_priority, &ioprio))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Invalid I/O priority specification."),
+		      poptGetInvocationName(popt_context));
+
 	if (opt_key_size % 8)
 		usage(popt_context, EXIT_FAILURE,
 		      _("Key size must be a multiple of 8 bits"),
@@ -1774,7 +3136,13 @@ int main(int argc, const char **argv)
 		dbg_version_and_cmd(argc, argv);
 	}
 
-	r = run_reencrypt(action_argv[0]);
+	for (devices = 0; action_argv[devices]; devices++)
+		;
+
+	if (devices > 1)
+		r = run_reencrypt_devices(action_argv, devices);
+	else
+		r = run_reencrypt(action_argv[0]);
 
 	poptFreeContext(popt_context);
 
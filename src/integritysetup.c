@@ -20,6 +20,7 @@
  */
 
 #include "cryptsetup.h"
+#include <time.h>
 #include <uuid/uuid.h>
 
 #define PACKAGE_INTEGRITY "integritysetup"
@@ -27,6 +28,8 @@
 #define DEFAULT_TAG_SIZE 4
 #define DEFAULT_ALG_NAME "crc32c"
 #define MAX_KEY_SIZE 4096
+#define DEFAULT_BENCHMARK_SIZE (64 * 1024 * 1024)
+#define BENCHMARK_BLOCK_SIZE (64 * 1024)
 
 static const char *opt_journal_size_str = NULL;
 static uint64_t opt_journal_size = 0;
@@ -53,6 +56,15 @@ static int opt_journal_crypt_key_size = 0;
 
 static int opt_integrity_nojournal = 0;
 static int opt_integrity_recovery = 0;
+static int opt_integrity_bitmap = 0;
+static int opt_integrity_recalculate = 0;
+
+static int opt_bitmap_sectors_per_bit = 0;
+static int opt_bitmap_flush_time = 0;
+
+static const char *opt_profile = NULL;
+static const char *opt_benchmark_size_str = NULL;
+static uint64_t opt_benchmark_size = DEFAULT_BENCHMARK_SIZE;
 
 static int opt_version_mode = 0;
 
@@ -156,8 +168,9 @@ static int _wipe_data_device(struct crypt_device *cd, const char *integrity_key)
 
 	/* Wipe the device */
 	set_int_handler(0);
+	tools_progress_init(cd, "wipe");
 	r = crypt_wipe(cd, tmp_path, CRYPT_WIPE_ZERO, 0, 0, DEFAULT_WIPE_BLOCK,
-		       0, &tools_wipe_progress, NULL);
+		       CRYPT_WIPE_PARALLEL, &tools_wipe_progress, NULL);
 	if (crypt_deactivate(cd, tmp_name))
 		log_err(_("Cannot deactivate temporary device %s."), tmp_path);
 	set_int_block(0);
@@ -223,7 +236,11 @@ static int action_format(int arg)
 	if (!opt_batch_mode)
 		log_std(_("Formatted with tag size %u, internal integrity %s.\n"), opt_tag_size, opt_integrity);
 
-	if (!opt_no_wipe)
+	/* Tags are initialized by kernel in background after activation with recalculate */
+	if (opt_integrity_recalculate) {
+		if (!opt_batch_mode)
+			log_std(_("Skipping device wipe, activate device with --integrity-recalculate to initialize tags.\n"));
+	} else if (!opt_no_wipe)
 		r = _wipe_data_device(cd, integrity_key);
 out:
 	crypt_safe_free(integrity_key);
@@ -278,6 +295,10 @@ static int action_open(int arg)
 		activate_flags |= CRYPT_ACTIVATE_NO_JOURNAL;
 	if (opt_integrity_recovery)
 		activate_flags |= CRYPT_ACTIVATE_RECOVERY;
+	if (opt_integrity_bitmap)
+		activate_flags |= CRYPT_ACTIVATE_NO_JOURNAL_BITMAP;
+	if (opt_integrity_recalculate)
+		activate_flags |= CRYPT_ACTIVATE_RECALCULATE;
 
 	r = _read_keys(&integrity_key, &params);
 	if (r)
@@ -286,6 +307,10 @@ static int action_open(int arg)
 	if ((r = crypt_init(&cd, action_argv[0])))
 		goto out;
 
+	if (opt_integrity_bitmap &&
+	    (r = crypt_integrity_set_bitmap(cd, opt_bitmap_sectors_per_bit, opt_bitmap_flush_time)))
+		goto out;
+
 	r = crypt_load(cd, CRYPT_INTEGRITY, &params);
 	if (r)
 		goto out;
@@ -318,6 +343,7 @@ static int action_status(int arg)
 	struct crypt_active_device cad;
 	struct crypt_params_integrity ip = {};
 	struct crypt_device *cd = NULL;
+	uint32_t sectors_per_bit = 0, flush_time = 0;
 	char *backing_file;
 	const char *device;
 	int path = 0, r = 0;
@@ -373,12 +399,17 @@ static int action_status(int arg)
 		log_std("  sector size:  %u bytes\n", crypt_get_sector_size(cd));
 		log_std("  interleave sectors: %u\n", ip.interleave_sectors);
 		log_std("  size:    %" PRIu64 " sectors\n", cad.size);
-		log_std("  mode:    %s%s\n",
+		log_std("  mode:    %s%s%s\n",
 			cad.flags & CRYPT_ACTIVATE_READONLY ? "readonly" : "read/write",
-			cad.flags & CRYPT_ACTIVATE_RECOVERY ? " recovery" : "");
+			cad.flags & CRYPT_ACTIVATE_RECOVERY ? " recovery" : "",
+			cad.flags & CRYPT_ACTIVATE_RECALCULATE ? " recalculating" : "");
 		log_std("  failures: %" PRIu64 "\n",
 			crypt_get_active_integrity_failures(cd, action_argv[0]));
-		if (cad.flags & CRYPT_ACTIVATE_NO_JOURNAL) {
+		if (cad.flags & CRYPT_ACTIVATE_NO_JOURNAL_BITMAP) {
+			crypt_get_integrity_bitmap(cd, &sectors_per_bit, &flush_time);
+			log_std("  bitmap 512-byte sectors per bit: %u\n", sectors_per_bit);
+			log_std("  bitmap flush interval: %u ms\n", flush_time);
+		} else if (cad.flags & CRYPT_ACTIVATE_NO_JOURNAL) {
 			log_std("  journal: not active\n");
 		} else {
 			log_std("  journal size: %" PRIu64 " bytes\n", ip.journal_size);
@@ -415,6 +446,301 @@ static int action_dump(int arg)
 	return r;
 }
 
+/*
+ * Benchmark of dm-integrity parameters. Every configuration is formatted
+ * on the (overwritten) device, activated through a private temporary mapping
+ * and measured with sequential direct-io writes. The fastest configuration
+ * is recommended and can be stored as a profile for format and open.
+ */
+struct integrity_profile {
+	const char *integrity;
+	int journal;
+	uint32_t interleave_sectors;
+	uint32_t buffer_sectors;
+	uint32_t journal_watermark;
+	uint32_t journal_commit_time;
+};
+
+struct integrity_result {
+	struct integrity_profile p;
+	double mbs;		/* MiB/s */
+	double lat_avg, lat_max;	/* ms per write request */
+};
+
+static const char *benchmark_algs[] = { "crc32c", "sha256", NULL };
+static const uint32_t benchmark_interleave[] = { 32768, 65536, 0 };
+static const uint32_t benchmark_buffers[] = { 128, 1024, 0 };
+
+static double timespec_ms(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1E3 + (end->tv_nsec - start->tv_nsec) / 1E6;
+}
+
+static int _benchmark_write(const char *path, struct integrity_result *res)
+{
+	struct timespec start, t1, t2, end;
+	uint64_t written = 0;
+	unsigned long count = 0;
+	double lat, lat_sum = 0;
+	void *buf = NULL;
+	ssize_t s;
+	int fd, r = 0;
+
+	fd = open(path, O_WRONLY | O_DIRECT);
+	if (fd < 0)
+		return -EINVAL;
+
+	if (posix_memalign(&buf, 4096, BENCHMARK_BLOCK_SIZE)) {
+		close(fd);
+		return -ENOMEM;
+	}
+	memset(buf, 0x5a, BENCHMARK_BLOCK_SIZE);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while (!quit && written < opt_benchmark_size) {
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		s = write(fd, buf, BENCHMARK_BLOCK_SIZE);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		if (s != BENCHMARK_BLOCK_SIZE) {
+			/* device smaller than benchmark size */
+			if (written)
+				break;
+			r = -EIO;
+			goto out;
+		}
+		lat = timespec_ms(&t1, &t2);
+		lat_sum += lat;
+		if (lat > res->lat_max)
+			res->lat_max = lat;
+		written += s;
+		count++;
+	}
+
+	if (fsync(fd) < 0) {
+		r = -EIO;
+		goto out;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (quit) {
+		r = -EINTR;
+		goto out;
+	}
+
+	res->mbs = (double)written / 1024 / 1024 / (timespec_ms(&start, &end) / 1E3);
+	res->lat_avg = count ? lat_sum / count : 0;
+out:
+	free(buf);
+	close(fd);
+	return r;
+}
+
+static int _benchmark_one(const char *device, struct integrity_result *res)
+{
+	struct crypt_device *cd = NULL;
+	struct crypt_params_integrity params = {
+		.interleave_sectors = res->p.interleave_sectors,
+		.buffer_sectors = res->p.buffer_sectors,
+		.journal_watermark = res->p.journal_watermark,
+		.journal_commit_time = res->p.journal_commit_time,
+		.journal_size = opt_journal_size,
+		.tag_size = opt_tag_size,
+		.sector_size = opt_sector_size ?: SECTOR_SIZE,
+		.integrity = res->p.integrity,
+	};
+	char tmp_name[64], tmp_path[128], tmp_uuid[40];
+	uuid_t tmp_uuid_bin;
+	int r;
+
+	uuid_generate(tmp_uuid_bin);
+	uuid_unparse(tmp_uuid_bin, tmp_uuid);
+	if (snprintf(tmp_name, sizeof(tmp_name), "temporary-cryptsetup-%s", tmp_uuid) < 0 ||
+	    snprintf(tmp_path, sizeof(tmp_path), "%s/%s", crypt_get_dir(), tmp_name) < 0)
+		return -EINVAL;
+
+	if ((r = crypt_init(&cd, device)) ||
+	    (r = crypt_format(cd, CRYPT_INTEGRITY, NULL, NULL, NULL, NULL, 0, &params)))
+		goto out;
+
+	/* buffer and journal parameters are activation options */
+	if ((r = crypt_load(cd, CRYPT_INTEGRITY, &params)))
+		goto out;
+
+	r = crypt_activate_by_volume_key(cd, tmp_name, NULL, 0,
+		CRYPT_ACTIVATE_PRIVATE | (res->p.journal ? 0 : CRYPT_ACTIVATE_NO_JOURNAL));
+	if (r < 0)
+		goto out;
+
+	r = _benchmark_write(tmp_path, res);
+
+	if (crypt_deactivate(cd, tmp_name))
+		log_err(_("Cannot deactivate temporary device %s."), tmp_path);
+out:
+	crypt_free(cd);
+	return r;
+}
+
+static int _profile_write(const char *file, const struct integrity_profile *p)
+{
+	FILE *f;
+	int r;
+
+	if (!(f = fopen(file, "w"))) {
+		log_err(_("Cannot write profile file %s."), file);
+		return -EINVAL;
+	}
+
+	fprintf(f, "# integritysetup benchmark profile\n"
+		"integrity = %s\njournal = %d\ninterleave_sectors = %u\n"
+		"buffer_sectors = %u\njournal_watermark = %u\njournal_commit_time = %u\n",
+		p->integrity, p->journal, p->interleave_sectors, p->buffer_sectors,
+		p->journal_watermark, p->journal_commit_time);
+
+	r = fclose(f) ? -EIO : 0;
+	if (r)
+		log_err(_("Cannot write profile file %s."), file);
+	return r;
+}
+
+/* Use profile values for options not set on command line */
+static int _profile_load(const char *file, int format)
+{
+	static char integrity[MAX_CIPHER_LEN];
+	char line[256], str[MAX_CIPHER_LEN];
+	unsigned int u;
+	FILE *f;
+	int r = 0;
+
+	if (!(f = fopen(file, "r"))) {
+		log_err(_("Cannot read profile file %s."), file);
+		return -EINVAL;
+	}
+
+	while (!r && fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "integrity = %31s", str) == 1) {
+			if (!strcmp(opt_integrity, DEFAULT_ALG_NAME)) {
+				strcpy(integrity, str);
+				opt_integrity = integrity;
+			}
+		} else if (sscanf(line, "journal = %u", &u) == 1) {
+			if (!format && !u)
+				opt_integrity_nojournal = 1;
+		} else if (sscanf(line, "interleave_sectors = %u", &u) == 1) {
+			if (format && !opt_interleave_sectors)
+				opt_interleave_sectors = u;
+		} else if (sscanf(line, "buffer_sectors = %u", &u) == 1) {
+			if (!opt_buffer_sectors)
+				opt_buffer_sectors = u;
+		} else if (sscanf(line, "journal_watermark = %u", &u) == 1) {
+			if (!opt_journal_watermark)
+				opt_journal_watermark = u;
+		} else if (sscanf(line, "journal_commit_time = %u", &u) == 1) {
+			if (!opt_journal_commit_time)
+				opt_journal_commit_time = u;
+		} else
+			r = -EINVAL;
+	}
+	fclose(f);
+
+	if (r)
+		log_err(_("Invalid profile file %s."), file);
+	else
+		log_dbg("Loaded integrity profile %s.", file);
+	return r;
+}
+
+static int action_benchmark(int arg)
+{
+	struct integrity_result *res, *best = NULL;
+	const char *algs[2] = { opt_integrity, NULL }, **alg;
+	const uint32_t *interleave, *buffers;
+	int journal, count = 0, r = 0;
+	char *msg = NULL;
+
+	if (opt_integrity_key_file) {
+		log_err(_("Benchmark of keyed integrity algorithms is not supported."));
+		return -ENOTSUP;
+	}
+
+	/* explicitly requested algorithm is the only one tested */
+	alg = strcmp(opt_integrity, DEFAULT_ALG_NAME) ? algs : benchmark_algs;
+
+	if (!opt_batch_mode) {
+		if (asprintf(&msg, _("This will overwrite data on %s irrevocably."), action_argv[0]) == -1)
+			return -ENOMEM;
+		r = yesDialog(msg, NULL) ? 0 : -EPERM;
+		free(msg);
+		if (r < 0)
+			return r;
+	}
+
+	/* algorithms x journal modes x interleave x buffers */
+	res = calloc(2 * 2 * 2 * 2, sizeof(*res));
+	if (!res)
+		return -ENOMEM;
+
+	set_int_handler(0);
+	log_std(_("# Algorithm | journal | interleave | buffers |    write | latency avg/max\n"));
+
+	for (; *alg && !r; alg++)
+	for (journal = 1; journal >= 0 && !r; journal--)
+	for (interleave = benchmark_interleave; *interleave && !r; interleave++)
+	for (buffers = benchmark_buffers; *buffers && !r; buffers++) {
+		res[count].p.integrity = *alg;
+		res[count].p.journal = journal;
+		res[count].p.interleave_sectors = *interleave;
+		res[count].p.buffer_sectors = *buffers;
+		res[count].p.journal_watermark = opt_journal_watermark;
+		res[count].p.journal_commit_time = opt_journal_commit_time;
+
+		r = _benchmark_one(action_argv[0], &res[count]);
+		if (r == -ENOENT || r == -ENOTSUP) {
+			log_std("%11s | %7s | %10u | %7u |      N/A\n", *alg,
+				journal ? "yes" : "no", *interleave, *buffers);
+			r = 0;
+			continue;
+		} else if (r < 0)
+			break;
+
+		log_std("%11s | %7s | %10u | %7u | %5.1f MiB/s | %.2f/%.2f ms\n",
+			*alg, journal ? "yes" : "no", *interleave, *buffers,
+			res[count].mbs, res[count].lat_avg, res[count].lat_max);
+
+		/* journal is a safety choice, do not trade it for speed */
+		if (journal == !opt_integrity_nojournal &&
+		    (!best || res[count].mbs > best->mbs))
+			best = &res[count];
+		count++;
+	}
+
+	set_int_block(0);
+
+	if (r == -EINTR)
+		log_err(_("Benchmark interrupted."));
+	else if (r < 0)
+		log_err(_("Benchmark failed."));
+	else if (!best) {
+		log_err(_("No dm-integrity configuration could be tested."));
+		r = -ENOTSUP;
+	} else {
+		log_std(_("Recommended: --integrity %s --interleave-sectors %u --buffer-sectors %u%s\n"),
+			best->p.integrity, best->p.interleave_sectors, best->p.buffer_sectors,
+			best->p.journal ? "" : " --integrity-no-journal");
+		if (opt_profile)
+			r = _profile_write(opt_profile, &best->p);
+	}
+
+	free(res);
+	return r;
+}
+
+static int action_monitor(int arg __attribute__((unused)))
+{
+	return tools_monitor("integrity", action_argv, action_argc, 0);
+}
+
 static struct action_type {
 	const char *type;
 	int (*handler)(int);
@@ -427,6 +753,8 @@ static struct action_type {
 	{ "close",	action_close,  1, N_("<name>"),N_("close device (deactivate and remove mapping)") },
 	{ "status",	action_status, 1, N_("<name>"),N_("show active device status") },
 	{ "dump",	action_dump,   1, N_("<integrity_device>"),N_("show on-disk information") },
+	{ "benchmark",	action_benchmark, 1, N_("<integrity_device>"),N_("benchmark parameters (overwrites device)") },
+	{ "monitor",	action_monitor, 0, N_("[<name>...]"),N_("report new integrity failures of active devices") },
 	{ NULL, NULL, 0, NULL, NULL }
 };
 
@@ -486,6 +814,8 @@ int main(int argc, const char **argv)
 		{ "debug",              '\0', POPT_ARG_NONE, &opt_debug,              0, N_("Show debug messages"), NULL },
 		{ "batch-mode",          'q', POPT_ARG_NONE, &opt_batch_mode,         0, N_("Do not ask for confirmation"), NULL },
 		{ "progress-frequency", '\0', POPT_ARG_INT,  &opt_progress_frequency, 0, N_("Progress line update (in seconds)"), N_("secs") },
+		{ "progress-json",      '\0', POPT_ARG_NONE, &opt_progress_json,      0, N_("Print progress as JSON objects"), NULL },
+		{ "progress-fd",        '\0', POPT_ARG_INT,  &opt_progress_fd,        0, N_("Write JSON progress to file descriptor"), N_("fd") },
 		{ "no-wipe",            '\0', POPT_ARG_NONE, &opt_no_wipe,            0, N_("Do not wipe device after format"), NULL },
 
 		{ "journal-size",        'j', POPT_ARG_STRING,&opt_journal_size_str,  0, N_("Journal size"), N_("bytes") },
@@ -510,6 +840,13 @@ int main(int argc, const char **argv)
 
 		{ "integrity-no-journal",       'D', POPT_ARG_NONE,  &opt_integrity_nojournal, 0, N_("Disable journal for integrity device"), NULL },
 		{ "integrity-recovery-mode",    'R', POPT_ARG_NONE,  &opt_integrity_recovery,  0, N_("Recovery mode (no journal, no tag checking)"), NULL },
+		{ "integrity-bitmap-mode",      'B', POPT_ARG_NONE,  &opt_integrity_bitmap,    0, N_("Use bitmap to track changes and disable journal for integrity device"), NULL },
+		{ "integrity-recalculate",     '\0', POPT_ARG_NONE,  &opt_integrity_recalculate,0, N_("Recalculate initial tags automatically."), NULL },
+		{ "bitmap-sectors-per-bit",    '\0', POPT_ARG_INT,   &opt_bitmap_sectors_per_bit,0, N_("Number of 512-byte sectors per bit (bitmap mode)."), NULL },
+		{ "bitmap-flush-time",         '\0', POPT_ARG_INT,   &opt_bitmap_flush_time,   0, N_("Bitmap mode flush time"), N_("ms") },
+
+		{ "profile",                   '\0', POPT_ARG_STRING, &opt_profile,                  0, N_("Store benchmark result in or read parameters from profile file"), NULL },
+		{ "benchmark-size",            '\0', POPT_ARG_STRING, &opt_benchmark_size_str,       0, N_("Amount of data written for every benchmark configuration"), N_("bytes") },
 		POPT_TABLEEND
 	};
 	poptContext popt_context;
@@ -535,6 +872,10 @@ int main(int argc, const char **argv)
 		usage(popt_context, EXIT_FAILURE, poptStrerror(r),
 		      poptBadOption(popt_context, POPT_BADOPTION_NOALIAS));
 
+	/* progress file descriptor implies machine readable progress */
+	if (opt_progress_fd >= 0)
+		opt_progress_json = 1;
+
 	if (opt_version_mode) {
 		log_std("%s %s\n", PACKAGE_INTEGRITY, PACKAGE_VERSION);
 		poptFreeContext(popt_context);
@@ -583,25 +924,44 @@ int main(int argc, const char **argv)
 		      poptGetInvocationName(popt_context));
 	}
 
-	if (!strcmp(aname, "format") && opt_tag_size == 0)
+	if ((!strcmp(aname, "format") || !strcmp(aname, "benchmark")) && opt_tag_size == 0)
 		opt_tag_size = DEFAULT_TAG_SIZE;
 
 	if (opt_interleave_sectors < 0 || opt_journal_watermark < 0 ||
 	    opt_journal_commit_time < 0 || opt_tag_size < 0 ||
 	    opt_sector_size < 0 || opt_buffer_sectors < 0 ||
 	    opt_integrity_key_size < 0 || opt_journal_integrity_key_size < 0 ||
-	    opt_journal_crypt_key_size < 0)
+	    opt_journal_crypt_key_size < 0 || opt_bitmap_sectors_per_bit < 0 ||
+	    opt_bitmap_flush_time < 0)
                 usage(popt_context, EXIT_FAILURE,
                       _("Negative number for option not permitted."),
                       poptGetInvocationName(popt_context));
 
-	if (strcmp(aname, "format") && (opt_journal_size_str || opt_interleave_sectors ||
+	if (strcmp(aname, "format") && strcmp(aname, "benchmark") &&
+	    (opt_journal_size_str || opt_interleave_sectors ||
 		opt_sector_size || opt_tag_size || opt_no_wipe ))
 		usage(popt_context, EXIT_FAILURE,
 		      _("Options --journal-size, --interleave-sectors, --sector-size, --tag-size"
 		        " and --no-wipe can be used only for format action.\n"),
 		      poptGetInvocationName(popt_context));
 
+	if (opt_integrity_bitmap + opt_integrity_nojournal + opt_integrity_recovery > 1)
+		usage(popt_context, EXIT_FAILURE,
+		      _("Only one of --integrity-bitmap-mode, --integrity-no-journal and"
+			" --integrity-recovery-mode options can be used.\n"),
+		      poptGetInvocationName(popt_context));
+
+	if (!opt_integrity_bitmap && (opt_bitmap_sectors_per_bit || opt_bitmap_flush_time))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Options --bitmap-sectors-per-bit and --bitmap-flush-time"
+			" can be used only with --integrity-bitmap-mode.\n"),
+		      poptGetInvocationName(popt_context));
+
+	if (opt_integrity_recalculate && strcmp(aname, "format") && strcmp(aname, "open"))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Option --integrity-recalculate can be used only with format and open actions.\n"),
+		      poptGetInvocationName(popt_context));
+
 	if (opt_journal_size_str &&
 	    tools_string_to_size(NULL, opt_journal_size_str, &opt_journal_size))
 		usage(popt_context, EXIT_FAILURE, _("Invalid journal size specification."),
@@ -631,12 +991,30 @@ int main(int argc, const char **argv)
 		usage(popt_context, EXIT_FAILURE, _("Journal encryption algorithm must be specified if journal encryption key is used."),
 		      poptGetInvocationName(popt_context));
 
+	if (opt_benchmark_size_str &&
+	    (tools_string_to_size(NULL, opt_benchmark_size_str, &opt_benchmark_size) ||
+	     opt_benchmark_size < BENCHMARK_BLOCK_SIZE))
+		usage(popt_context, EXIT_FAILURE, _("Invalid benchmark size specification."),
+		      poptGetInvocationName(popt_context));
+
+	if (opt_profile && strcmp(aname, "benchmark") && strcmp(aname, "format") &&
+	    strcmp(aname, "open"))
+		usage(popt_context, EXIT_FAILURE,
+		      _("Option --profile can be used only with benchmark, format and open actions.\n"),
+		      poptGetInvocationName(popt_context));
+
 	if (opt_debug) {
 		opt_verbose = 1;
 		crypt_set_debug_level(-1);
 		dbg_version_and_cmd(argc, argv);
 	}
 
+	if (opt_profile && strcmp(aname, "benchmark") &&
+	    _profile_load(opt_profile, !strcmp(aname, "format"))) {
+		poptFreeContext(popt_context);
+		return EXIT_FAILURE;
+	}
+
 	r = run_action(action);
 	poptFreeContext(popt_context);
 	return r;
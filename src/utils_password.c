@@ -23,6 +23,7 @@
 #include <termios.h>
 
 int opt_force_password = 0;
+int opt_key_fd = -1;
 
 #if defined ENABLE_PWQUALITY
 #include <pwquality.h>
@@ -113,6 +114,20 @@ int tools_is_stdin(const char *key_file)
 	return strcmp(key_file, "-") ? 0 : 1;
 }
 
+/*
+ * Keyfile - is read directly from pre-opened descriptor (--key-fd).
+ */
+static int tools_is_key_fd(const char *key_file)
+{
+	char path[32];
+
+	if (opt_key_fd < 0 || !key_file)
+		return 0;
+
+	snprintf(path, sizeof(path), "/dev/fd/%d", opt_key_fd);
+	return strcmp(key_file, path) ? 0 : 1;
+}
+
 /* Password reading helpers */
 static int untimed_read(int fd, char *pass, size_t maxlen)
 {
@@ -282,6 +297,10 @@ int tools_get_key(const char *prompt,
 					keyfile_offset, keyfile_size_max,
 					key_file ? 0 : CRYPT_KEYFILE_STOP_EOL);
 		}
+	} else if (tools_is_key_fd(key_file)) {
+		log_dbg("Pre-opened descriptor %d passphrase entry requested.", opt_key_fd);
+		r = crypt_keyfile_fd_read(cd, opt_key_fd, key, key_size,
+					  keyfile_offset, keyfile_size_max, 0);
 	} else {
 		log_dbg("File descriptor passphrase entry requested.");
 		r = crypt_keyfile_device_read(cd, key_file, key, key_size,
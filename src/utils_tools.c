@@ -23,12 +23,15 @@
 
 #include "cryptsetup.h"
 #include <math.h>
+#include <poll.h>
 #include <signal.h>
 
 int opt_verbose = 0;
 int opt_debug = 0;
 int opt_batch_mode = 0;
 int opt_progress_frequency = 0;
+int opt_progress_json = 0;
+int opt_progress_fd = -1;
 
 /* interrupt handling */
 volatile int quit = 0;
@@ -137,6 +140,124 @@ void quiet_log(int level, const char *msg, void *usrptr)
 	tool_log(level, msg, usrptr);
 }
 
+/* Accumulated timing of traced library phases (debug only) */
+static struct {
+	uint64_t start;
+	uint64_t usec;
+	uint64_t bytes;
+	unsigned count;
+	unsigned depth;
+} trace_phases[CRYPT_TRACE_PHASES];
+
+void tool_trace(crypt_trace_phase phase, int end, uint64_t usec, uint64_t bytes,
+		void *usrptr __attribute__((unused)))
+{
+	if ((unsigned)phase >= CRYPT_TRACE_PHASES)
+		return;
+
+	if (!end) {
+		if (!trace_phases[phase].depth++)
+			trace_phases[phase].start = usec;
+		return;
+	}
+
+	if (!trace_phases[phase].depth)
+		return;
+
+	trace_phases[phase].bytes += bytes;
+	if (--trace_phases[phase].depth)
+		return;
+
+	trace_phases[phase].usec += usec - trace_phases[phase].start;
+	trace_phases[phase].count++;
+	log_dbg("Phase %s finished in %" PRIu64 " us.",
+		crypt_trace_phase_name(phase), usec - trace_phases[phase].start);
+}
+
+void tool_trace_summary(void)
+{
+	unsigned i, count = 0;
+
+	for (i = 0; i < CRYPT_TRACE_PHASES; i++)
+		count += trace_phases[i].count;
+	if (!count)
+		return;
+
+	log_dbg("Phase timing summary:");
+	for (i = 0; i < CRYPT_TRACE_PHASES; i++) {
+		if (!trace_phases[i].count)
+			continue;
+		log_dbg("  %-22s %3u x %10" PRIu64 " us %12" PRIu64 " bytes",
+			crypt_trace_phase_name(i), trace_phases[i].count,
+			trace_phases[i].usec, trace_phases[i].bytes);
+	}
+}
+
+struct monitor_filter {
+	const char *target;
+	const char **names;
+	int count;
+};
+
+static void tool_monitor_event(const struct crypt_monitor_event *ev, void *usrptr)
+{
+	struct monitor_filter *f = usrptr;
+	int i;
+
+	if (strcmp(ev->target, f->target))
+		return;
+
+	for (i = 0; i < f->count; i++)
+		if (!strcmp(ev->name, f->names[i]))
+			break;
+	if (f->count && i == f->count)
+		return;
+
+	if (ev->verity_corrupted)
+		log_std("%s: verity corruption detected.\n", ev->name);
+	else
+		log_std("%s: %" PRIu64 " integrity failures.\n", ev->name,
+			ev->integrity_failures);
+	fflush(stdout);
+}
+
+/*
+ * Wait for corruption events of target devices (all if count is 0)
+ * until interrupted.
+ */
+int tools_monitor(const char *target, const char **names, int count, uint32_t interval)
+{
+	struct monitor_filter f = { .target = target, .names = names, .count = count };
+	struct crypt_monitor *mon;
+	struct pollfd pfd = { .events = POLLIN };
+	int r;
+
+	r = crypt_monitor_init(&mon, interval);
+	if (r < 0) {
+		log_err(_("Cannot initialize device monitor."));
+		return r;
+	}
+
+	pfd.fd = crypt_monitor_fd(mon);
+	set_int_handler(0);
+
+	while (!quit) {
+		r = poll(&pfd, 1, -1);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0) {
+			r = -errno;
+			break;
+		}
+		r = crypt_monitor_dispatch(mon, tool_monitor_event, &f);
+		if (r < 0)
+			break;
+	}
+
+	crypt_monitor_free(mon);
+	return r < 0 ? r : 0;
+}
+
 int yesDialog(const char *msg, void *usrptr)
 {
 	const char *fail_msg = (const char *)usrptr;
@@ -363,6 +484,11 @@ void tools_time_progress(uint64_t device_size, uint64_t bytes,
 	int final = (bytes == device_size);
 	const char *eol;
 
+	if (opt_progress_json) {
+		tools_progress_account(device_size, bytes);
+		return;
+	}
+
 	if (opt_batch_mode)
 		return;
 
@@ -414,6 +540,105 @@ void tools_time_progress(uint64_t device_size, uint64_t bytes,
 	fflush(stdout);
 }
 
+/*
+ * Machine readable progress (--progress-json), one JSON object per line
+ * written to stdout or to --progress-fd. Telemetry comes from the library
+ * progress callback or, for operations processed by the tool itself,
+ * it is calculated from the plain progress reports.
+ */
+#define PROGRESS_RATE_WEIGHT 0.2
+
+static struct {
+	const char *operation;
+	int library;		/* library reports telemetry */
+	struct crypt_progress p;
+	struct timeval start, last, printed;
+	uint64_t last_offset;
+} progress_json;
+
+void tools_progress_json(const struct crypt_progress *p)
+{
+	struct timeval now;
+	double frequency = opt_progress_frequency ? (double)opt_progress_frequency : 1.0;
+	int fd = opt_progress_fd >= 0 ? opt_progress_fd : STDOUT_FILENO;
+
+	gettimeofday(&now, NULL);
+	if (p->offset != p->size && progress_json.printed.tv_sec &&
+	    time_diff(&progress_json.printed, &now) < frequency)
+		return;
+	progress_json.printed = now;
+
+	if (dprintf(fd, "{\"operation\":\"%s\",\"size\":%" PRIu64 ",\"offset\":%" PRIu64
+		    ",\"elapsed_ms\":%" PRIu64 ",\"rate\":%" PRIu64 ",\"rate_avg\":%" PRIu64
+		    ",\"eta_ms\":%" PRIu64 ",\"io_errors\":%" PRIu32 ",\"io_retries\":%" PRIu32 "}\n",
+		    p->operation ?: "unknown", p->size, p->offset, p->elapsed_usec / 1000,
+		    p->rate, p->rate_avg, p->eta_usec / 1000, p->io_errors, p->io_retries) < 0)
+		log_dbg("Cannot write progress.");
+}
+
+static void tools_progress_telemetry(const struct crypt_progress *p,
+				     void *usrptr __attribute__((unused)))
+{
+	tools_progress_json(p);
+}
+
+void tools_progress_init(struct crypt_device *cd, const char *operation)
+{
+	if (!opt_progress_json)
+		return;
+
+	memset(&progress_json, 0, sizeof(progress_json));
+	progress_json.operation = operation;
+
+	if (cd) {
+		crypt_set_progress_callback(cd, tools_progress_telemetry, NULL);
+		progress_json.library = 1;
+	}
+}
+
+void tools_progress_account(uint64_t size, uint64_t offset)
+{
+	struct crypt_progress *p = &progress_json.p;
+	struct timeval now;
+	double tdiff;
+	uint64_t bytes;
+
+	/* already reported through library callback */
+	if (progress_json.library)
+		return;
+
+	gettimeofday(&now, NULL);
+	if (!progress_json.start.tv_sec && !progress_json.start.tv_usec) {
+		progress_json.start = progress_json.last = now;
+		progress_json.last_offset = offset;
+	}
+
+	tdiff = time_diff(&progress_json.last, &now);
+	bytes = offset > progress_json.last_offset ? offset - progress_json.last_offset : 0;
+	if (tdiff > 0 && bytes) {
+		p->rate = (uint64_t)(bytes / tdiff);
+		p->rate_avg = p->rate_avg ?
+			(uint64_t)(p->rate_avg + PROGRESS_RATE_WEIGHT * ((double)p->rate - p->rate_avg)) :
+			p->rate;
+		progress_json.last = now;
+		progress_json.last_offset = offset;
+	}
+
+	p->operation = progress_json.operation;
+	p->size = size;
+	p->offset = offset;
+	p->elapsed_usec = (uint64_t)(time_diff(&progress_json.start, &now) * 1E6);
+	p->eta_usec = p->rate_avg && size > offset ?
+		(uint64_t)((double)(size - offset) / p->rate_avg * 1E6) : 0;
+
+	tools_progress_json(p);
+}
+
+void tools_progress_io_error(void)
+{
+	progress_json.p.io_errors++;
+}
+
 int tools_wipe_progress(uint64_t size, uint64_t offset, void *usrptr)
 {
 	static struct timeval start_time = {}, end_time = {};
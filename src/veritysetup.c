@@ -40,6 +40,14 @@ static int opt_restart_on_corruption = 0;
 static int opt_ignore_corruption = 0;
 static int opt_ignore_zero_blocks = 0;
 static int opt_check_at_most_once = 0;
+static int opt_use_tasklets = 0;
+static int opt_threads = 0;
+static int opt_sample = 0;
+static int opt_data_fd = -1;
+static int opt_preload = 0;
+static int opt_preload_leaves = 0;
+static int opt_preload_verify = 0;
+static int opt_scrub = 0;
 
 static int opt_version_mode = 0;
 
@@ -85,6 +93,20 @@ static int _prepare_format(struct crypt_params_verity *params,
 	return 0;
 }
 
+/* userspace hash options are set in context, not in verity params */
+static int _set_hash_options(struct crypt_device *cd)
+{
+	int r;
+
+	r = crypt_verity_set_threads(cd, opt_threads);
+	if (!r)
+		r = crypt_verity_set_sample(cd, opt_sample);
+	if (!r)
+		r = crypt_verity_set_data_fd(cd, opt_data_fd);
+
+	return r;
+}
+
 static int action_format(int arg)
 {
 	struct crypt_device *cd = NULL;
@@ -101,6 +123,18 @@ static int action_format(int arg)
 		log_dbg("Created hash image %s.", action_argv[1]);
 		close(r);
 	}
+	/* Streamed data are written to data image, create it if doesn't exist */
+	if (opt_data_fd >= 0) {
+		r = open(action_argv[0], O_WRONLY | O_EXCL | O_CREAT, S_IRUSR | S_IWUSR);
+		if (r < 0 && errno != EEXIST) {
+			log_err(_("Cannot create data image %s for writing."), action_argv[0]);
+			return -EINVAL;
+		} else if (r >= 0) {
+			log_dbg("Created data image %s.", action_argv[0]);
+			close(r);
+		}
+		flags |= CRYPT_VERITY_DATA_STREAM;
+	}
 	/* Try to create FEC image if doesn't exist */
 	if (fec_device) {
 		r = open(fec_device, O_WRONLY | O_EXCL | O_CREAT, S_IRUSR | S_IWUSR);
@@ -113,7 +147,8 @@ static int action_format(int arg)
 		}
 	}
 
-	if ((r = crypt_init(&cd, action_argv[1])))
+	if ((r = crypt_init(&cd, action_argv[1])) ||
+	    (r = _set_hash_options(cd)))
 		goto out;
 
 	if (!use_superblock)
@@ -123,6 +158,7 @@ static int action_format(int arg)
 	if (r < 0)
 		goto out;
 
+	tools_progress_init(cd, "verity-create");
 	r = crypt_format(cd, CRYPT_VERITY, NULL, NULL, opt_uuid, NULL, 0, &params);
 	if (!r)
 		crypt_dump(cd);
@@ -142,10 +178,12 @@ static int _activate(const char *dm_device,
 	struct crypt_params_verity params = {};
 	uint32_t activate_flags = CRYPT_ACTIVATE_READONLY;
 	char *root_hash_bytes = NULL;
+	uint64_t repaired = 0, unrecoverable = 0;
 	ssize_t hash_size;
 	int r;
 
-	if ((r = crypt_init(&cd, hash_device)))
+	if ((r = crypt_init(&cd, hash_device)) ||
+	    (r = _set_hash_options(cd)))
 		goto out;
 
 	if (opt_ignore_corruption)
@@ -156,6 +194,11 @@ static int _activate(const char *dm_device,
 		activate_flags |= CRYPT_ACTIVATE_IGNORE_ZERO_BLOCKS;
 	if (opt_check_at_most_once)
 		activate_flags |= CRYPT_ACTIVATE_CHECK_AT_MOST_ONCE;
+	if (opt_use_tasklets)
+		activate_flags |= CRYPT_ACTIVATE_TASKLETS;
+
+	if (flags & CRYPT_VERITY_CHECK_HASH)
+		tools_progress_init(cd, "verity-verify");
 
 	if (use_superblock) {
 		params.flags = flags;
@@ -182,10 +225,26 @@ static int _activate(const char *dm_device,
 		r = -EINVAL;
 		goto out;
 	}
+
+	if (!dm_device && opt_scrub) {
+		r = crypt_verity_verify_repair(cd, root_hash_bytes, hash_size,
+					       &repaired, &unrecoverable);
+		if (!r || r == -EPERM)
+			log_std(_("Repaired %" PRIu64 " blocks, %" PRIu64 " blocks cannot be repaired.\n"),
+				repaired, unrecoverable);
+		goto out;
+	}
+
 	r = crypt_activate_by_volume_key(cd, dm_device,
 					 root_hash_bytes,
 					 hash_size,
 					 activate_flags);
+	if (!r && (opt_preload || opt_preload_leaves || opt_preload_verify)) {
+		r = crypt_verity_preload(cd, dm_device, opt_preload_leaves,
+					 opt_preload_verify ? CRYPT_VERITY_PRELOAD_VERIFY : 0);
+		if (r < 0)
+			crypt_deactivate(cd, dm_device);
+	}
 out:
 	crypt_free(cd);
 	free(root_hash_bytes);
@@ -210,6 +269,162 @@ static int action_verify(int arg)
 			 CRYPT_VERITY_CHECK_HASH);
 }
 
+/* Changed data block ranges, one "offset length" pair (in data blocks) per line */
+static int _load_ranges(const char *path, struct crypt_verity_range **ranges, size_t *count)
+{
+	struct crypt_verity_range *tmp;
+	FILE *f;
+	char *line = NULL;
+	size_t size = 0, n = 0, alloc = 0;
+	unsigned long long offset, length;
+	char c;
+	int r = 0;
+
+	*ranges = NULL;
+	f = fopen(path, "r");
+	if (!f) {
+		log_err(_("Cannot open file %s."), path);
+		return -EINVAL;
+	}
+
+	while (getline(&line, &size, f) != -1) {
+		if (sscanf(line, " %c", &c) != 1 || c == '#')
+			continue;
+		if (sscanf(line, "%llu %llu", &offset, &length) != 2 || !length) {
+			log_err(_("Invalid range \"%s\" in %s."), strtok(line, "\n"), path);
+			r = -EINVAL;
+			break;
+		}
+		if (n == alloc) {
+			alloc = alloc ? 2 * alloc : 64;
+			tmp = realloc(*ranges, alloc * sizeof(*tmp));
+			if (!tmp) {
+				r = -ENOMEM;
+				break;
+			}
+			*ranges = tmp;
+		}
+		(*ranges)[n].offset = offset;
+		(*ranges)[n++].length = length;
+	}
+
+	if (!r && !n) {
+		log_err(_("No data block ranges in %s."), path);
+		r = -EINVAL;
+	}
+
+	if (r) {
+		free(*ranges);
+		*ranges = NULL;
+	} else
+		*count = n;
+	free(line);
+	fclose(f);
+	return r;
+}
+
+static int action_update(int arg)
+{
+	struct crypt_device *cd = NULL;
+	struct crypt_params_verity params = {};
+	struct crypt_verity_range *ranges = NULL;
+	char *root_hash = NULL;
+	size_t count = 0;
+	int r;
+
+	r = _load_ranges(action_argv[2], &ranges, &count);
+	if (r < 0)
+		return r;
+
+	if ((r = crypt_init(&cd, action_argv[1])) ||
+	    (r = _set_hash_options(cd)))
+		goto out;
+
+	if (use_superblock) {
+		params.hash_area_offset = hash_offset;
+		params.fec_area_offset = fec_offset;
+		params.fec_device = fec_device;
+		params.fec_roots = fec_roots;
+		r = crypt_load(cd, CRYPT_VERITY, &params);
+	} else {
+		r = _prepare_format(&params, action_argv[0], CRYPT_VERITY_NO_HEADER);
+		if (r < 0)
+			goto out;
+		r = crypt_format(cd, CRYPT_VERITY, NULL, NULL, NULL, NULL, 0, &params);
+	}
+	if (r < 0)
+		goto out;
+	r = crypt_set_data_device(cd, action_argv[0]);
+	if (r < 0)
+		goto out;
+
+	root_hash = malloc(crypt_get_volume_key_size(cd));
+	if (!root_hash) {
+		r = -ENOMEM;
+		goto out;
+	}
+
+	r = crypt_verity_update(cd, ranges, count, root_hash, crypt_get_volume_key_size(cd));
+	if (!r)
+		crypt_dump(cd);
+out:
+	crypt_free(cd);
+	free(root_hash);
+	free(ranges);
+	free(CONST_CAST(char*)params.salt);
+	return r;
+}
+
+static int action_repair(int arg)
+{
+	struct crypt_device *cd = NULL;
+	struct crypt_params_verity params = {};
+	struct crypt_verity_range *ranges = NULL;
+	unsigned int errors = 0;
+	size_t count = 0;
+	int r;
+
+	if (!fec_device) {
+		log_err(_("Option --fec-device is required for repair."));
+		return -EINVAL;
+	}
+
+	r = _load_ranges(action_argv[2], &ranges, &count);
+	if (r < 0)
+		return r;
+
+	if ((r = crypt_init(&cd, action_argv[1])) ||
+	    (r = _set_hash_options(cd)))
+		goto out;
+
+	if (use_superblock) {
+		params.hash_area_offset = hash_offset;
+		params.fec_area_offset = fec_offset;
+		params.fec_device = fec_device;
+		params.fec_roots = fec_roots;
+		r = crypt_load(cd, CRYPT_VERITY, &params);
+	} else {
+		r = _prepare_format(&params, action_argv[0], CRYPT_VERITY_NO_HEADER);
+		if (r < 0)
+			goto out;
+		r = crypt_format(cd, CRYPT_VERITY, NULL, NULL, NULL, NULL, 0, &params);
+	}
+	if (r < 0)
+		goto out;
+	r = crypt_set_data_device(cd, action_argv[0]);
+	if (r < 0)
+		goto out;
+
+	r = crypt_verity_repair(cd, ranges, count, &errors);
+	if (!r)
+		log_std(_("Repaired %u symbols.\n"), errors);
+out:
+	crypt_free(cd);
+	free(ranges);
+	free(CONST_CAST(char*)params.salt);
+	return r;
+}
+
 static int action_close(int arg)
 {
 	struct crypt_device *cd = NULL;
@@ -321,12 +536,14 @@ static int action_status(int arg)
 		if (cad.flags & (CRYPT_ACTIVATE_IGNORE_CORRUPTION|
 				 CRYPT_ACTIVATE_RESTART_ON_CORRUPTION|
 				 CRYPT_ACTIVATE_IGNORE_ZERO_BLOCKS|
-				 CRYPT_ACTIVATE_CHECK_AT_MOST_ONCE))
-			log_std("  flags:       %s%s%s%s\n",
+				 CRYPT_ACTIVATE_CHECK_AT_MOST_ONCE|
+				 CRYPT_ACTIVATE_TASKLETS))
+			log_std("  flags:       %s%s%s%s%s\n",
 				(cad.flags & CRYPT_ACTIVATE_IGNORE_CORRUPTION) ? "ignore_corruption " : "",
 				(cad.flags & CRYPT_ACTIVATE_RESTART_ON_CORRUPTION) ? "restart_on_corruption " : "",
 				(cad.flags & CRYPT_ACTIVATE_IGNORE_ZERO_BLOCKS) ? "ignore_zero_blocks " : "",
-				(cad.flags & CRYPT_ACTIVATE_CHECK_AT_MOST_ONCE) ? "check_at_most_once" : "");
+				(cad.flags & CRYPT_ACTIVATE_CHECK_AT_MOST_ONCE) ? "check_at_most_once " : "",
+				(cad.flags & CRYPT_ACTIVATE_TASKLETS) ? "try_verify_in_tasklet" : "");
 	}
 out:
 	crypt_free(cd);
@@ -353,6 +570,64 @@ static int action_dump(int arg)
 	return r;
 }
 
+static int action_benchmark(int arg)
+{
+	static const char *bhashes[] = { "sha1", "sha256", "sha512", NULL };
+	static const uint32_t bblocks[] = { 512, 1024, 4096, 0 };
+	static const uint32_t broots[] = { 2, 4, 8, 16, 24, 0 };
+	const char *opt_hashes[] = { hash_algorithm, NULL };
+	uint32_t opt_blocks[] = { data_block_size, 0 };
+	uint32_t opt_roots[] = { fec_roots, 0 };
+	const char **hash = hash_algorithm ? opt_hashes : bhashes;
+	const uint32_t *block = data_block_size != DEFAULT_VERITY_DATA_BLOCK ? opt_blocks : bblocks;
+	const uint32_t *roots = fec_roots != DEFAULT_VERITY_FEC_ROOTS ? opt_roots : broots;
+	unsigned threads[] = { 1, opt_threads > 1 ? opt_threads : 0 }, t;
+	double hash_mbs, tree_mbs, enc_mbs, dec_mbs;
+	int i, j, r = 0;
+
+	log_std(_("# Tests are approximate using memory only (no storage IO).\n"));
+	/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+	log_std(_("#      Hash |  Block | Threads |         Hashing |      Tree build\n"));
+	for (i = 0; hash[i]; i++)
+		for (j = 0; block[j]; j++)
+			for (t = 0; t < 2 && threads[t]; t++) {
+				r = crypt_benchmark_verity(NULL, hash[i], hash_type, block[j],
+							   DEFAULT_VERITY_SALT_SIZE, threads[t],
+							   &hash_mbs, &tree_mbs);
+				check_signal(&r);
+				if (r == -EINTR)
+					return r;
+				if (r < 0)
+					log_std("%11s %8u %9u %17s %17s\n", hash[i], block[j],
+						threads[t], _("N/A"), _("N/A"));
+				else
+					log_std("%11s %8u %9u %10.1f MiB/s  %10.1f MiB/s\n", hash[i],
+						block[j], threads[t], hash_mbs, tree_mbs);
+			}
+
+	/* TRANSLATORS: The string is header of a table and must be exactly (right side) aligned. */
+	log_std(_("# FEC roots | Threads |          Encode |          Decode\n"));
+	for (i = 0; roots[i]; i++)
+		for (t = 0; t < 2 && threads[t]; t++) {
+			r = crypt_benchmark_verity_fec(NULL, roots[i], threads[t], &enc_mbs, &dec_mbs);
+			check_signal(&r);
+			if (r == -EINTR)
+				return r;
+			if (r < 0)
+				log_std("%11u %9u %17s %17s\n", roots[i], threads[t], _("N/A"), _("N/A"));
+			else
+				log_std("%11u %9u %10.1f MiB/s  %10.1f MiB/s\n", roots[i],
+					threads[t], enc_mbs, dec_mbs);
+		}
+
+	return r < 0 ? r : 0;
+}
+
+static int action_monitor(int arg __attribute__((unused)))
+{
+	return tools_monitor("verity", action_argv, action_argc, 0);
+}
+
 static struct action_type {
 	const char *type;
 	int (*handler)(int);
@@ -362,10 +637,14 @@ static struct action_type {
 } action_types[] = {
 	{ "format",	action_format, 2, N_("<data_device> <hash_device>"),N_("format device") },
 	{ "verify",	action_verify, 3, N_("<data_device> <hash_device> <root_hash>"),N_("verify device") },
+	{ "update",	action_update, 3, N_("<data_device> <hash_device> <ranges_file>"),N_("update hash for changed data blocks") },
+	{ "repair",	action_repair, 3, N_("<data_device> <hash_device> <ranges_file>"),N_("repair corrupted blocks using FEC") },
 	{ "open",	action_open,   4, N_("<data_device> <name> <hash_device> <root_hash>"),N_("open device as <name>") },
 	{ "close",	action_close,  1, N_("<name>"),N_("close device (deactivate and remove mapping)") },
 	{ "status",	action_status, 1, N_("<name>"),N_("show active device status") },
 	{ "dump",	action_dump,   1, N_("<hash_device>"),N_("show on-disk information") },
+	{ "benchmark",	action_benchmark, 0, N_("<options>"),N_("benchmark hash and FEC") },
+	{ "monitor",	action_monitor, 0, N_("[<name>...]"),N_("report corruption of active devices") },
 	{ NULL, NULL, 0, NULL, NULL }
 };
 
@@ -441,10 +720,21 @@ int main(int argc, const char **argv)
 		{ "hash",            'h',  POPT_ARG_STRING, &hash_algorithm, 0, N_("Hash algorithm"), N_("string") },
 		{ "salt",            's',  POPT_ARG_STRING, &salt_string,    0, N_("Salt"), N_("hex string") },
 		{ "uuid",            '\0', POPT_ARG_STRING, &opt_uuid,       0, N_("UUID for device to use"), NULL },
+		{ "threads",         0,    POPT_ARG_INT,  &opt_threads,      0, N_("Number of threads used for hash calculation"), N_("number") },
+		{ "sample",          0,    POPT_ARG_INT,  &opt_sample,       0, N_("Verify only random sample of data"), N_("percent") },
+		{ "data-fd",         0,    POPT_ARG_INT,  &opt_data_fd,      0, N_("Read data to hash and store from file descriptor"), N_("fd") },
 		{ "restart-on-corruption", 0,POPT_ARG_NONE,&opt_restart_on_corruption, 0, N_("Restart kernel if corruption is detected"), NULL },
 		{ "ignore-corruption", 0,  POPT_ARG_NONE, &opt_ignore_corruption,  0, N_("Ignore corruption, log it only"), NULL },
 		{ "ignore-zero-blocks", 0, POPT_ARG_NONE, &opt_ignore_zero_blocks, 0, N_("Do not verify zeroed blocks"), NULL },
 		{ "check-at-most-once", 0, POPT_ARG_NONE, &opt_check_at_most_once, 0, N_("Verify data block only the first time it is read"), NULL },
+		{ "use-tasklets",    0,    POPT_ARG_NONE, &opt_use_tasklets, 0, N_("Always verify in tasklet if hash blocks are cached"), NULL },
+		{ "preload",         0,    POPT_ARG_NONE, &opt_preload,      0, N_("Preload hash levels above leaves after activation"), NULL },
+		{ "preload-leaves",  0,    POPT_ARG_INT,  &opt_preload_leaves, 0, N_("Preload also part of leaf hash level"), N_("percent") },
+		{ "preload-verify",  0,    POPT_ARG_NONE, &opt_preload_verify, 0, N_("Verify preloaded hash blocks against root hash"), NULL },
+		{ "scrub",           0,    POPT_ARG_NONE, &opt_scrub,        0, N_("Verify all blocks and repair corrupted ones using FEC device"), NULL },
+		{ "progress-frequency", 0, POPT_ARG_INT,  &opt_progress_frequency, 0, N_("Progress line update (in seconds)"), N_("secs") },
+		{ "progress-json",   '\0', POPT_ARG_NONE, &opt_progress_json, 0, N_("Print progress as JSON objects"), NULL },
+		{ "progress-fd",     '\0', POPT_ARG_INT,  &opt_progress_fd,   0, N_("Write JSON progress to file descriptor"), N_("fd") },
 		POPT_TABLEEND
 	};
 
@@ -494,6 +784,10 @@ int main(int argc, const char **argv)
 		usage(popt_context, EXIT_FAILURE, poptStrerror(r),
 		      poptBadOption(popt_context, POPT_BADOPTION_NOALIAS));
 
+	/* progress file descriptor implies machine readable progress */
+	if (opt_progress_fd >= 0)
+		opt_progress_json = 1;
+
 	if (opt_version_mode) {
 		log_std("%s %s\n", PACKAGE_VERITY, PACKAGE_VERSION);
 		poptFreeContext(popt_context);
@@ -542,12 +836,43 @@ int main(int argc, const char **argv)
 		      poptGetInvocationName(popt_context));
 	}
 
-	if (data_block_size < 0 || hash_block_size < 0 || hash_type < 0) {
+	if (data_block_size < 0 || hash_block_size < 0 || hash_type < 0 ||
+	    opt_threads < 0) {
 		usage(popt_context, EXIT_FAILURE,
 		      _("Negative number for option not permitted."),
 		      poptGetInvocationName(popt_context));
 	}
 
+	if (opt_threads > CRYPT_VERITY_THREADS_MAX)
+		usage(popt_context, EXIT_FAILURE,
+		      _("Option --threads is out of range.\n"),
+		      poptGetInvocationName(popt_context));
+
+	if (opt_sample && (opt_sample < 0 || opt_sample > 100 || strcmp(aname, "verify")))
+		usage(popt_context, EXIT_FAILURE,
+		_("Option --sample is allowed only for verify operation and must be in range 1-100.\n"),
+		poptGetInvocationName(popt_context));
+
+	if (opt_scrub && (opt_sample || strcmp(aname, "verify")))
+		usage(popt_context, EXIT_FAILURE,
+		_("Option --scrub is allowed only for verify operation and cannot be combined with --sample.\n"),
+		poptGetInvocationName(popt_context));
+
+	if ((opt_preload || opt_preload_leaves || opt_preload_verify) && strcmp(aname, "open"))
+		usage(popt_context, EXIT_FAILURE,
+		_("Option --preload, --preload-leaves or --preload-verify is allowed only for open operation.\n"),
+		poptGetInvocationName(popt_context));
+
+	if (opt_preload_leaves < 0 || opt_preload_leaves > 100)
+		usage(popt_context, EXIT_FAILURE,
+		_("Option --preload-leaves must be in range 0-100.\n"),
+		poptGetInvocationName(popt_context));
+
+	if (opt_data_fd >= 0 && strcmp(aname, "format"))
+		usage(popt_context, EXIT_FAILURE,
+		_("Option --data-fd is allowed only for format operation.\n"),
+		poptGetInvocationName(popt_context));
+
 	if ((opt_ignore_corruption || opt_restart_on_corruption || opt_ignore_zero_blocks) && strcmp(aname, "open"))
 		usage(popt_context, EXIT_FAILURE,
 		_("Option --ignore-corruption, --restart-on-corruption or --ignore-zero-blocks is allowed only for open operation.\n"),
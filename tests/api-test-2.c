@@ -29,6 +29,7 @@
 #include <sys/stat.h>
 #include <inttypes.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #ifdef KERNEL_KEYRING
 #include <linux/keyctl.h>
 #include <sys/syscall.h>
@@ -53,6 +54,7 @@ typedef int32_t key_serial_t;
 
 #define CDEVICE_1 "ctest1"
 #define CDEVICE_2 "ctest2"
+#define CDEVICE_3 "ctest3"
 #define CDEVICE_WRONG "O_o"
 #define H_DEVICE "head_ok"
 #define H_DEVICE_WRONG "head_wr"
@@ -241,6 +243,9 @@ static void _cleanup(void)
 	if (!stat(DMDIR CDEVICE_2, &st))
 		_system("dmsetup remove " CDEVICE_2, 0);
 
+	if (!stat(DMDIR CDEVICE_3, &st))
+		_system("dmsetup remove " CDEVICE_3, 0);
+
 	if (!stat(DEVICE_EMPTY, &st))
 		_system("dmsetup remove " DEVICE_EMPTY_name, 0);
 
@@ -543,6 +548,65 @@ static void SuspendDevice(void)
 	_remove_keyfiles();
 }
 
+static void SuspendRetainedKey(void)
+{
+#ifdef KERNEL_KEYRING
+	struct crypt_device *cd;
+	struct crypt_pbkdf_type pbkdf2 = {
+		.type = CRYPT_KDF_PBKDF2,
+		.hash = DEFAULT_LUKS1_HASH,
+		.iterations = 1000,
+		.flags = CRYPT_PBKDF_NO_BENCHMARK
+	};
+	const char *mk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	const char *mk_hex2 = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1e";
+	size_t key_size = strlen(mk_hex) / 2;
+	char key[128], key2[128];
+	int suspend_status;
+
+	crypt_decode_key(key, mk_hex, key_size);
+	crypt_decode_key(key2, mk_hex2, key_size);
+
+	OK_(crypt_init(&cd, DEVICE_2));
+	OK_(crypt_set_pbkdf_type(cd, &pbkdf2));
+	OK_(crypt_volume_key_keyring(cd, 0));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	OK_(crypt_activate_by_passphrase(cd, CDEVICE_1, 0, PASSPHRASE, strlen(PASSPHRASE), 0));
+
+	suspend_status = crypt_suspend_retain_key(cd, CDEVICE_1, 0);
+	if (suspend_status == -ENOTSUP) {
+		printf("WARNING: Suspend/Resume with retained key not supported, skipping test.\n");
+		OK_(crypt_deactivate(cd, CDEVICE_1));
+		crypt_free(cd);
+		return;
+	}
+
+	// retained key is consumed by resume
+	OK_(suspend_status);
+	OK_(crypt_resume_by_retained_key(cd, CDEVICE_1));
+	FAIL_(crypt_resume_by_retained_key(cd, CDEVICE_1), "not suspended");
+	// device now references logon key, it cannot be retained again
+	EQ_(crypt_suspend_retain_key(cd, CDEVICE_1, 0), -ENOTSUP);
+	OK_(crypt_suspend(cd, CDEVICE_1));
+	EQ_(crypt_resume_by_retained_key(cd, CDEVICE_1), -ENOENT);
+	EQ_(crypt_resume_by_passphrase(cd, CDEVICE_1, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE)), 0);
+
+	// volume key changed in header while suspended, retained key is stale
+	OK_(crypt_suspend_retain_key(cd, CDEVICE_1, 0));
+	EQ_(crypt_keyslot_add_by_key(cd, 1, key2, key_size, PASSPHRASE1, strlen(PASSPHRASE1), CRYPT_VOLUME_KEY_SET), 1);
+	EQ_(crypt_resume_by_retained_key(cd, CDEVICE_1), -ENOENT);
+	// stale key was removed
+	EQ_(crypt_resume_by_retained_key(cd, CDEVICE_1), -ENOENT);
+	FAIL_(crypt_resume_by_passphrase(cd, CDEVICE_1, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE)), "old volume key");
+	EQ_(crypt_resume_by_passphrase(cd, CDEVICE_1, CRYPT_ANY_SLOT, PASSPHRASE1, strlen(PASSPHRASE1)), 1);
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	crypt_free(cd);
+#else
+	printf("WARNING: cryptsetup compiled with kernel keyring service disabled, skipping test.\n");
+#endif
+}
+
 static void AddDeviceLuks2(void)
 {
 	struct crypt_device *cd;
@@ -2845,6 +2909,856 @@ static void Luks2Flags(void)
 	crypt_free(cd);
 }
 
+static void Luks2Probe(void)
+{
+	struct crypt_device *cd;
+	struct crypt_probe_result res[3];
+	const char *paths[3] = { DEVICE_1, DEVICE_EMPTY, DEVICE_WRONG };
+
+	OK_(crypt_probe_devices(paths, 3, res));
+	EQ_(res[0].status, 0);
+	OK_(strcmp(res[0].type, CRYPT_LUKS2));
+	EQ_(res[1].status, -ENOENT);
+	NULL_(res[1].type);
+	EQ_(res[2].status, -ENOENT);
+
+	OK_(crypt_init(&cd, DEVICE_1));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(strcmp(res[0].uuid, crypt_get_uuid(cd)));
+	crypt_free(cd);
+
+	FAIL_(crypt_probe_devices(NULL, 1, res), "no paths");
+}
+
+/* write (or check) sector number stamped into every sector of device */
+static int reenc_pattern(const char *device, uint64_t sectors, int write_pattern)
+{
+	uint64_t sector, i, *buf;
+	int fd, r = 0;
+
+	if (posix_memalign((void *)&buf, 4096, 4096))
+		return -ENOMEM;
+
+	fd = open(device, (write_pattern ? O_WRONLY : O_RDONLY) | O_DIRECT);
+	if (fd < 0) {
+		free(buf);
+		return -EINVAL;
+	}
+
+	for (sector = 0; !r && sector < sectors; sector += 8) {
+		if (write_pattern) {
+			for (i = 0; i < 8; i++)
+				buf[i * SECTOR_SIZE / sizeof(*buf)] = sector + i;
+			if (write(fd, buf, 4096) != 4096)
+				r = -EIO;
+		} else if (read(fd, buf, 4096) != 4096)
+			r = -EIO;
+		else for (i = 0; i < 8; i++)
+			if (buf[i * SECTOR_SIZE / sizeof(*buf)] != sector + i)
+				r = -EINVAL;
+	}
+
+	if (write_pattern && fsync(fd))
+		r = -EIO;
+	close(fd);
+	free(buf);
+	return r;
+}
+
+static int reenc_progress_stop(uint64_t size, uint64_t offset, void *usrptr)
+{
+	uint64_t *stop = usrptr;
+
+	return offset >= *stop;
+}
+
+/* simulated crash, no cleanup of library context in progress */
+static int reenc_progress_crash(uint64_t size, uint64_t offset, void *usrptr)
+{
+	uint64_t *stop = usrptr;
+
+	if (offset >= *stop)
+		kill(getpid(), SIGKILL);
+
+	return 0;
+}
+
+static void Luks2Reencryption(void)
+{
+	struct crypt_device *cd;
+	struct crypt_active_device cad;
+	struct crypt_pbkdf_type pbkdf2 = {
+		.type = CRYPT_KDF_PBKDF2,
+		.hash = DEFAULT_LUKS1_HASH,
+		.iterations = 1000,
+		.flags = CRYPT_PBKDF_NO_BENCHMARK
+	};
+	struct crypt_params_reencrypt rparams = {
+		.hotzone_size = 1024 * 1024
+	};
+	const char *mk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(mk_hex) / 2;
+	char key[128];
+	uint64_t sectors, stop;
+	uint32_t flags;
+	int keyslot, status;
+	pid_t pid;
+
+	crypt_decode_key(key, mk_hex, key_size);
+
+	OK_(crypt_init(&cd, DEVICE_2));
+	OK_(crypt_set_pbkdf_type(cd, &pbkdf2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	OK_(crypt_activate_by_passphrase(cd, CDEVICE_1, 0, PASSPHRASE, strlen(PASSPHRASE), 0));
+	OK_(crypt_get_active_device(cd, CDEVICE_1, &cad));
+	sectors = cad.size;
+	OK_(reenc_pattern(DMDIR CDEVICE_1, sectors, 1));
+
+	// init and interrupt after first hotzone
+	FAIL_(crypt_reencrypt(cd, NULL, NULL), "not initialized");
+	keyslot = crypt_reencrypt_init_by_passphrase(cd, CDEVICE_1, PASSPHRASE, strlen(PASSPHRASE),
+						     0, CRYPT_ANY_SLOT, NULL, NULL, &rparams);
+	OK_(keyslot < 0);
+	OK_(keyslot == 0);
+	OK_(crypt_persistent_flags_get(cd, CRYPT_FLAGS_REQUIREMENTS, &flags));
+	EQ_(flags & CRYPT_REQUIREMENT_ONLINE_REENCRYPT, CRYPT_REQUIREMENT_ONLINE_REENCRYPT);
+	stop = rparams.hotzone_size;
+	EQ_(crypt_reencrypt(cd, reenc_progress_stop, &stop), -EINTR);
+	OK_(reenc_pattern(DMDIR CDEVICE_1, sectors, 0));
+
+	// key wipe would not reach both segments
+	EQ_(crypt_suspend(cd, CDEVICE_1), -ENOTSUP);
+	EQ_(crypt_status(cd, CDEVICE_1), CRYPT_ACTIVE);
+#ifdef KERNEL_KEYRING
+	EQ_(crypt_suspend_retain_key(cd, CDEVICE_1, 0), -ENOTSUP);
+#endif
+	crypt_free(cd);
+
+	// inactive device is activated with both segments
+	OK_(crypt_init(&cd, DEVICE_2));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	FAIL_(crypt_activate_by_passphrase(cd, CDEVICE_1, CRYPT_ANY_SLOT, PASSPHRASE1, strlen(PASSPHRASE1), 0), "wrong passphrase");
+	OK_(crypt_activate_by_passphrase(cd, CDEVICE_1, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0));
+	OK_(reenc_pattern(DMDIR CDEVICE_1, sectors, 0));
+
+	// device left suspended by failed step is resumed by reload
+	OK_(_system("dmsetup suspend " CDEVICE_1, 1));
+	FAIL_(crypt_resume_by_passphrase(cd, CDEVICE_1, CRYPT_ANY_SLOT, PASSPHRASE1, strlen(PASSPHRASE1)), "wrong passphrase");
+	OK_(crypt_resume_by_passphrase(cd, CDEVICE_1, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE)) < 0);
+	FAIL_(crypt_resume_by_passphrase(cd, CDEVICE_1, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE)), "not suspended");
+	OK_(reenc_pattern(DMDIR CDEVICE_1, sectors, 0));
+	crypt_free(cd);
+
+	// crash in the middle, resume from new context
+	pid = fork();
+	if (pid == 0) {
+		crypt_set_log_callback(NULL, NULL, NULL);
+		stop = rparams.hotzone_size * 4;
+		if (crypt_init(&cd, DEVICE_2) || crypt_load(cd, CRYPT_LUKS2, NULL) ||
+		    crypt_reencrypt_init_by_passphrase(cd, CDEVICE_1, PASSPHRASE, strlen(PASSPHRASE),
+						       CRYPT_ANY_SLOT, CRYPT_ANY_SLOT, NULL, NULL, NULL) < 0)
+			_exit(EXIT_FAILURE);
+		crypt_reencrypt(cd, reenc_progress_crash, &stop);
+		_exit(EXIT_FAILURE);
+	}
+	OK_(pid < 0);
+	EQ_(waitpid(pid, &status, 0), pid);
+	OK_(!WIFSIGNALED(status));
+	EQ_(WTERMSIG(status), SIGKILL);
+
+	OK_(crypt_init(&cd, DEVICE_2));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(reenc_pattern(DMDIR CDEVICE_1, sectors, 0));
+	FAIL_(crypt_reencrypt_init_by_passphrase(cd, CDEVICE_1, PASSPHRASE1, strlen(PASSPHRASE1),
+						 CRYPT_ANY_SLOT, CRYPT_ANY_SLOT, NULL, NULL, NULL), "wrong passphrase");
+	EQ_(crypt_reencrypt_init_by_passphrase(cd, CDEVICE_1, PASSPHRASE, strlen(PASSPHRASE),
+					       CRYPT_ANY_SLOT, CRYPT_ANY_SLOT, NULL, NULL, NULL), keyslot);
+	OK_(crypt_reencrypt(cd, NULL, NULL));
+	OK_(reenc_pattern(DMDIR CDEVICE_1, sectors, 0));
+	OK_(crypt_persistent_flags_get(cd, CRYPT_FLAGS_REQUIREMENTS, &flags));
+	EQ_(flags & CRYPT_REQUIREMENT_ONLINE_REENCRYPT, 0);
+	FAIL_(crypt_volume_key_verify(cd, key, key_size), "old volume key");
+	crypt_free(cd);
+
+	// single segment again, suspend works
+	OK_(crypt_init(&cd, DEVICE_2));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	status = crypt_suspend(cd, CDEVICE_1);
+	if (status != -ENOTSUP) {
+		OK_(status);
+		OK_(crypt_resume_by_passphrase(cd, CDEVICE_1, keyslot, PASSPHRASE, strlen(PASSPHRASE)) < 0);
+		OK_(reenc_pattern(DMDIR CDEVICE_1, sectors, 0));
+	}
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	OK_(crypt_activate_by_passphrase(cd, CDEVICE_1, keyslot, PASSPHRASE, strlen(PASSPHRASE), 0));
+	OK_(reenc_pattern(DMDIR CDEVICE_1, sectors, 0));
+	OK_(crypt_deactivate(cd, CDEVICE_1));
+	crypt_free(cd);
+}
+
+static void digest_trace(crypt_trace_phase phase, int end, uint64_t usec,
+			 uint64_t bytes, void *usrptr)
+{
+	if (phase == CRYPT_TRACE_DIGEST_VERIFY && end)
+		(*(int *)usrptr)++;
+}
+
+static void Luks2DigestCache(void)
+{
+	struct crypt_device *cd;
+	struct crypt_pbkdf_type pbkdf2 = {
+		.type = CRYPT_KDF_PBKDF2,
+		.hash = DEFAULT_LUKS1_HASH,
+		.iterations = 1000,
+		.flags = CRYPT_PBKDF_NO_BENCHMARK
+	};
+	const char *mk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	const char *mk_hex2 = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1e";
+	size_t key_size = strlen(mk_hex) / 2;
+	char key[128], key2[128];
+	int verified = 0;
+
+	crypt_decode_key(key, mk_hex, key_size);
+	crypt_decode_key(key2, mk_hex2, key_size);
+
+	OK_(crypt_init(&cd, DEVICE_2));
+	OK_(crypt_set_pbkdf_type(cd, &pbkdf2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	remove(BACKUP_FILE);
+	OK_(crypt_header_backup(cd, CRYPT_LUKS2, BACKUP_FILE));
+	crypt_free(cd);
+
+	OK_(crypt_init(&cd, DEVICE_2));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(crypt_set_pbkdf_type(cd, &pbkdf2));
+	crypt_set_trace_callback(cd, digest_trace, &verified);
+
+	// only the first successful verification runs digest
+	OK_(crypt_volume_key_verify(cd, key, key_size));
+	EQ_(verified, 1);
+	OK_(crypt_volume_key_verify(cd, key, key_size));
+	EQ_(verified, 1);
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 0, PASSPHRASE, strlen(PASSPHRASE), 0), 0);
+	EQ_(verified, 1);
+
+	// failed verification is never cached
+	FAIL_(crypt_volume_key_verify(cd, key2, key_size), "key mismatch");
+	EQ_(verified, 2);
+	FAIL_(crypt_volume_key_verify(cd, key2, key_size), "key mismatch");
+	EQ_(verified, 3);
+
+	// new volume key digest, cached key must not match
+	EQ_(crypt_keyslot_add_by_key(cd, 1, key2, key_size, PASSPHRASE1, strlen(PASSPHRASE1), CRYPT_VOLUME_KEY_SET), 1);
+	verified = 0;
+	FAIL_(crypt_volume_key_verify(cd, key, key_size), "digest changed");
+	EQ_(verified, 1);
+	OK_(crypt_volume_key_verify(cd, key2, key_size));
+	EQ_(verified, 2);
+	OK_(crypt_volume_key_verify(cd, key2, key_size));
+	EQ_(verified, 2);
+	FAIL_(crypt_activate_by_passphrase(cd, NULL, 0, PASSPHRASE, strlen(PASSPHRASE), 0), "old volume key");
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 1, PASSPHRASE1, strlen(PASSPHRASE1), 0), 1);
+
+	// digest replaced by header restore in the same context
+	OK_(crypt_header_restore(cd, CRYPT_LUKS2, BACKUP_FILE));
+	verified = 0;
+	FAIL_(crypt_volume_key_verify(cd, key2, key_size), "digest restored");
+	EQ_(verified, 1);
+	OK_(crypt_volume_key_verify(cd, key, key_size));
+	EQ_(verified, 2);
+	FAIL_(crypt_activate_by_passphrase(cd, NULL, 1, PASSPHRASE1, strlen(PASSPHRASE1), 0), "keyslot restored");
+	EQ_(crypt_activate_by_passphrase(cd, NULL, 0, PASSPHRASE, strlen(PASSPHRASE), 0), 0);
+	crypt_free(cd);
+
+	remove(BACKUP_FILE);
+}
+
+static void Luks2ActivateBatch(void)
+{
+	struct crypt_device *cd1, *cd2, *cd3;
+	struct crypt_pbkdf_type pbkdf2 = {
+		.type = CRYPT_KDF_PBKDF2,
+		.hash = DEFAULT_LUKS1_HASH,
+		.iterations = 1000,
+		.flags = CRYPT_PBKDF_NO_BENCHMARK
+	};
+	struct crypt_params_plain pl_params = {
+		.hash = "sha256",
+	};
+	struct crypt_activate_request req[3];
+	const char *mk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(mk_hex) / 2;
+	char key[128];
+
+	crypt_decode_key(key, mk_hex, key_size);
+
+	OK_(crypt_init(&cd1, DEVICE_1));
+	OK_(crypt_set_pbkdf_type(cd1, &pbkdf2));
+	OK_(crypt_format(cd1, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd1, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_keyslot_add_by_volume_key(cd1, 3, key, key_size, PASSPHRASE1, strlen(PASSPHRASE1)), 3);
+
+	OK_(crypt_init(&cd2, DEVICE_2));
+	crypt_set_iteration_time(cd2, 1);
+	OK_(crypt_format(cd2, CRYPT_LUKS1, "aes", "cbc-essiv:sha256", NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd2, 1, NULL, 0, PASSPHRASE1, strlen(PASSPHRASE1)), 1);
+
+	OK_(crypt_init(&cd3, DEVICE_EMPTY));
+	OK_(crypt_format(cd3, CRYPT_PLAIN, "aes", "cbc-essiv:sha256", NULL, NULL, key_size, &pl_params));
+
+	memset(req, 0, sizeof(req));
+	req[0].cd = cd1;
+	req[0].name = CDEVICE_1;
+	req[0].keyslot = CRYPT_ANY_SLOT;
+	req[0].passphrase = PASSPHRASE1;
+	req[0].passphrase_size = strlen(PASSPHRASE1);
+	req[1].cd = cd2;
+	req[1].name = CDEVICE_2;
+	req[1].keyslot = CRYPT_ANY_SLOT;
+	req[1].passphrase = PASSPHRASE1;
+	req[1].passphrase_size = strlen(PASSPHRASE1);
+	req[2].cd = cd3;
+	req[2].name = CDEVICE_3;
+	req[2].volume_key = key;
+	req[2].volume_key_size = key_size;
+
+	FAIL_(crypt_activate_batch(NULL, 1), "no requests");
+	FAIL_(crypt_activate_batch(req, 0), "no requests");
+
+	// all requests succeed, unlocked keyslot is returned
+	OK_(crypt_activate_batch(req, 3));
+	EQ_(req[0].r, 3);
+	EQ_(req[1].r, 1);
+	EQ_(req[2].r, 0);
+	EQ_(crypt_status(cd1, CDEVICE_1), CRYPT_ACTIVE);
+	EQ_(crypt_status(cd2, CDEVICE_2), CRYPT_ACTIVE);
+	EQ_(crypt_status(cd3, CDEVICE_3), CRYPT_ACTIVE);
+
+	// active devices are rejected per request
+	EQ_(crypt_activate_batch(req, 3), -EEXIST);
+	EQ_(req[0].r, -EEXIST);
+	EQ_(req[1].r, -EEXIST);
+	EQ_(req[2].r, -EEXIST);
+	OK_(crypt_deactivate(cd1, CDEVICE_1));
+	OK_(crypt_deactivate(cd2, CDEVICE_2));
+	OK_(crypt_deactivate(cd3, CDEVICE_3));
+
+	// failed request does not stop the others
+	req[0].keyslot = 0;
+	EQ_(crypt_activate_batch(req, 3), -EPERM);
+	EQ_(req[0].r, -EPERM);
+	EQ_(req[1].r, 1);
+	EQ_(req[2].r, 0);
+	EQ_(crypt_status(cd1, CDEVICE_1), CRYPT_INACTIVE);
+	EQ_(crypt_status(cd2, CDEVICE_2), CRYPT_ACTIVE);
+	EQ_(crypt_status(cd3, CDEVICE_3), CRYPT_ACTIVE);
+	OK_(crypt_deactivate(cd2, CDEVICE_2));
+	OK_(crypt_deactivate(cd3, CDEVICE_3));
+
+	// one request per device handle
+	req[0].keyslot = CRYPT_ANY_SLOT;
+	req[1].cd = cd1;
+	EQ_(crypt_activate_batch(req, 2), -EINVAL);
+	EQ_(req[0].r, 3);
+	EQ_(req[1].r, -EINVAL);
+	EQ_(crypt_status(cd1, CDEVICE_1), CRYPT_ACTIVE);
+	EQ_(crypt_status(cd1, CDEVICE_2), CRYPT_INACTIVE);
+	OK_(crypt_deactivate(cd1, CDEVICE_1));
+
+	crypt_free(cd1);
+	crypt_free(cd2);
+	crypt_free(cd3);
+}
+
+static void DeactivateBatch(void)
+{
+	struct crypt_device *cd1, *cd2, *cd3;
+	struct crypt_params_plain pl_params = {
+		.hash = "sha256",
+	};
+	struct crypt_deactivate_request req[3];
+	const char *mk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(mk_hex) / 2;
+	char key[128];
+	int fd;
+
+	crypt_decode_key(key, mk_hex, key_size);
+
+	// CDEVICE_2 is stacked over CDEVICE_1, CDEVICE_3 is independent
+	OK_(crypt_init(&cd1, DEVICE_EMPTY));
+	OK_(crypt_format(cd1, CRYPT_PLAIN, "aes", "cbc-essiv:sha256", NULL, NULL, key_size, &pl_params));
+	OK_(crypt_activate_by_volume_key(cd1, CDEVICE_1, key, key_size, 0));
+	OK_(crypt_init(&cd2, DMDIR CDEVICE_1));
+	OK_(crypt_format(cd2, CRYPT_PLAIN, "aes", "cbc-essiv:sha256", NULL, NULL, key_size, &pl_params));
+	OK_(crypt_init(&cd3, DEVICE_ERROR));
+	OK_(crypt_format(cd3, CRYPT_PLAIN, "aes", "cbc-essiv:sha256", NULL, NULL, key_size, &pl_params));
+
+	memset(req, 0, sizeof(req));
+	req[0].cd = cd1;
+	req[0].name = CDEVICE_1;
+	req[1].cd = cd3;
+	req[1].name = CDEVICE_3;
+	req[2].name = CDEVICE_2;
+
+	FAIL_(crypt_deactivate_batch(NULL, 1), "no requests");
+	FAIL_(crypt_deactivate_batch(req, 0), "no requests");
+
+	// lower device is requested first, it is removed after its holder
+	OK_(crypt_activate_by_volume_key(cd2, CDEVICE_2, key, key_size, 0));
+	OK_(crypt_activate_by_volume_key(cd3, CDEVICE_3, key, key_size, 0));
+	OK_(crypt_deactivate_batch(req, 3));
+	EQ_(req[0].r, 0);
+	EQ_(req[1].r, 0);
+	EQ_(req[2].r, 0);
+	EQ_(crypt_status(cd1, CDEVICE_1), CRYPT_INACTIVE);
+	EQ_(crypt_status(cd2, CDEVICE_2), CRYPT_INACTIVE);
+	EQ_(crypt_status(cd3, CDEVICE_3), CRYPT_INACTIVE);
+
+	// inactive device fails only its own request
+	OK_(crypt_activate_by_volume_key(cd1, CDEVICE_1, key, key_size, 0));
+	OK_(crypt_activate_by_volume_key(cd3, CDEVICE_3, key, key_size, 0));
+	EQ_(crypt_deactivate_batch(req, 3), -ENODEV);
+	EQ_(req[0].r, 0);
+	EQ_(req[1].r, 0);
+	EQ_(req[2].r, -ENODEV);
+	EQ_(crypt_status(cd1, CDEVICE_1), CRYPT_INACTIVE);
+	EQ_(crypt_status(cd3, CDEVICE_3), CRYPT_INACTIVE);
+
+	// device held from outside of the batch stays busy
+	OK_(crypt_activate_by_volume_key(cd1, CDEVICE_1, key, key_size, 0));
+	OK_(crypt_activate_by_volume_key(cd3, CDEVICE_3, key, key_size, 0));
+	fd = open(DMDIR CDEVICE_1, O_RDONLY);
+	OK_(fd < 0);
+	EQ_(crypt_deactivate_batch(req, 2), -EBUSY);
+	EQ_(req[0].r, -EBUSY);
+	EQ_(req[1].r, 0);
+	EQ_(crypt_status(cd1, CDEVICE_1), CRYPT_BUSY);
+	EQ_(crypt_status(cd3, CDEVICE_3), CRYPT_INACTIVE);
+	close(fd);
+	OK_(crypt_deactivate_batch(req, 1));
+	EQ_(crypt_status(cd1, CDEVICE_1), CRYPT_INACTIVE);
+
+	crypt_free(cd1);
+	crypt_free(cd2);
+	crypt_free(cd3);
+}
+
+static void Luks2HeaderTransaction(void)
+{
+	struct crypt_device *cd, *cd2;
+	struct crypt_pbkdf_type pbkdf2 = {
+		.type = CRYPT_KDF_PBKDF2,
+		.hash = DEFAULT_LUKS1_HASH,
+		.iterations = 1000,
+		.flags = CRYPT_PBKDF_NO_BENCHMARK
+	};
+	const char *mk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(mk_hex) / 2;
+	char key[128];
+
+	crypt_decode_key(key, mk_hex, key_size);
+
+	OK_(crypt_init(&cd, DEVICE_2));
+	OK_(crypt_set_pbkdf_type(cd, &pbkdf2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+
+	FAIL_(crypt_header_transaction_commit(cd), "no transaction");
+	OK_(crypt_header_transaction_begin(cd));
+	FAIL_(crypt_header_transaction_begin(cd), "already started");
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 1, key, key_size, PASSPHRASE1, strlen(PASSPHRASE1)), 1);
+	OK_(crypt_keyslot_set_priority(cd, 0, CRYPT_SLOT_PRIORITY_PREFER));
+	EQ_(crypt_keyslot_status(cd, 1), CRYPT_SLOT_ACTIVE);
+
+	// nothing written before commit
+	OK_(crypt_init(&cd2, DEVICE_2));
+	OK_(crypt_load(cd2, CRYPT_LUKS2, NULL));
+	EQ_(crypt_keyslot_status(cd2, 1), CRYPT_SLOT_INACTIVE);
+	EQ_(crypt_keyslot_get_priority(cd2, 0), CRYPT_SLOT_PRIORITY_NORMAL);
+	crypt_free(cd2);
+
+	OK_(crypt_header_transaction_commit(cd));
+	OK_(crypt_init(&cd2, DEVICE_2));
+	OK_(crypt_load(cd2, CRYPT_LUKS2, NULL));
+	EQ_(crypt_keyslot_status(cd2, 1), CRYPT_SLOT_ACTIVE);
+	EQ_(crypt_keyslot_get_priority(cd2, 0), CRYPT_SLOT_PRIORITY_PREFER);
+	EQ_(crypt_activate_by_passphrase(cd2, NULL, 1, PASSPHRASE1, strlen(PASSPHRASE1), 0), 1);
+	crypt_free(cd2);
+
+	// failed operation discards all changes of transaction
+	OK_(crypt_header_transaction_begin(cd));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 2, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 2);
+	FAIL_(crypt_keyslot_add_by_passphrase(cd, 3, "wrong", 5, PASSPHRASE, strlen(PASSPHRASE)), "wrong passphrase");
+	FAIL_(crypt_header_transaction_commit(cd), "failed transaction");
+	EQ_(crypt_keyslot_status(cd, 1), CRYPT_SLOT_ACTIVE);
+	EQ_(crypt_keyslot_status(cd, 2), CRYPT_SLOT_INACTIVE);
+	EQ_(crypt_keyslot_status(cd, 3), CRYPT_SLOT_INACTIVE);
+	OK_(crypt_init(&cd2, DEVICE_2));
+	OK_(crypt_load(cd2, CRYPT_LUKS2, NULL));
+	EQ_(crypt_keyslot_status(cd2, 2), CRYPT_SLOT_INACTIVE);
+	crypt_free(cd2);
+
+	// without transaction header is written immediately again
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 2, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 2);
+	OK_(crypt_init(&cd2, DEVICE_2));
+	OK_(crypt_load(cd2, CRYPT_LUKS2, NULL));
+	EQ_(crypt_keyslot_status(cd2, 2), CRYPT_SLOT_ACTIVE);
+	crypt_free(cd2);
+	crypt_free(cd);
+
+	// LUKS1 is not supported
+	OK_(crypt_init(&cd, DEVICE_2));
+	crypt_set_iteration_time(cd, 1);
+	OK_(crypt_format(cd, CRYPT_LUKS1, "aes", "cbc-essiv:sha256", NULL, NULL, 32, NULL));
+	FAIL_(crypt_header_transaction_begin(cd), "LUKS1 device");
+	crypt_free(cd);
+}
+
+static void Luks2KeyslotAddBatch(void)
+{
+	struct crypt_device *cd, *cd2;
+	struct crypt_pbkdf_type pbkdf2 = {
+		.type = CRYPT_KDF_PBKDF2,
+		.hash = DEFAULT_LUKS1_HASH,
+		.iterations = 1000,
+		.flags = CRYPT_PBKDF_NO_BENCHMARK
+	};
+	struct crypt_keyslot_add_entry entries[3] = {
+		{ CRYPT_ANY_SLOT, PASSPHRASE1, strlen(PASSPHRASE1) },
+		{ 5, "batch5", 6 },
+		{ CRYPT_ANY_SLOT, "batchany", 8 }
+	};
+	const char *mk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(mk_hex) / 2;
+	char key[128];
+
+	crypt_decode_key(key, mk_hex, key_size);
+
+	OK_(crypt_init(&cd, DEVICE_2));
+	OK_(crypt_set_pbkdf_type(cd, &pbkdf2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+
+	FAIL_(crypt_keyslot_add_batch(cd, PASSPHRASE, strlen(PASSPHRASE), entries, 0), "no entries");
+	FAIL_(crypt_keyslot_add_batch(cd, NULL, 0, entries, 3), "no passphrase");
+
+	// explicit keyslots are reserved first
+	OK_(crypt_keyslot_add_batch(cd, PASSPHRASE, strlen(PASSPHRASE), entries, 3));
+	EQ_(entries[0].keyslot, 1);
+	EQ_(entries[1].keyslot, 5);
+	EQ_(entries[2].keyslot, 2);
+	EQ_(crypt_keyslot_status(cd, 1), CRYPT_SLOT_ACTIVE);
+	EQ_(crypt_keyslot_status(cd, 2), CRYPT_SLOT_ACTIVE);
+	EQ_(crypt_keyslot_status(cd, 5), CRYPT_SLOT_ACTIVE);
+	EQ_(crypt_keyslot_status(cd, 3), CRYPT_SLOT_INACTIVE);
+
+	OK_(crypt_init(&cd2, DEVICE_2));
+	OK_(crypt_load(cd2, CRYPT_LUKS2, NULL));
+	EQ_(crypt_activate_by_passphrase(cd2, NULL, CRYPT_ANY_SLOT, PASSPHRASE1, strlen(PASSPHRASE1), 0), 1);
+	EQ_(crypt_activate_by_passphrase(cd2, NULL, CRYPT_ANY_SLOT, "batch5", 6, 0), 5);
+	EQ_(crypt_activate_by_passphrase(cd2, NULL, CRYPT_ANY_SLOT, "batchany", 8, 0), 2);
+	crypt_free(cd2);
+
+	// wrong passphrase, nothing is added and keyslots are restored
+	entries[0].keyslot = CRYPT_ANY_SLOT;
+	entries[1].keyslot = 6;
+	entries[2].keyslot = CRYPT_ANY_SLOT;
+	FAIL_(crypt_keyslot_add_batch(cd, "wrong", 5, entries, 3), "wrong passphrase");
+	EQ_(entries[0].keyslot, CRYPT_ANY_SLOT);
+	EQ_(entries[1].keyslot, 6);
+	EQ_(entries[2].keyslot, CRYPT_ANY_SLOT);
+	EQ_(crypt_keyslot_status(cd, 3), CRYPT_SLOT_INACTIVE);
+	EQ_(crypt_keyslot_status(cd, 4), CRYPT_SLOT_INACTIVE);
+	EQ_(crypt_keyslot_status(cd, 6), CRYPT_SLOT_INACTIVE);
+
+	// requested keyslot collisions
+	entries[0].keyslot = 6;
+	FAIL_(crypt_keyslot_add_batch(cd, PASSPHRASE, strlen(PASSPHRASE), entries, 2), "same keyslot twice");
+	EQ_(entries[0].keyslot, 6);
+	EQ_(crypt_keyslot_status(cd, 6), CRYPT_SLOT_INACTIVE);
+	entries[0].keyslot = 5;
+	FAIL_(crypt_keyslot_add_batch(cd, PASSPHRASE, strlen(PASSPHRASE), entries, 2), "keyslot in use");
+	EQ_(crypt_keyslot_status(cd, 6), CRYPT_SLOT_INACTIVE);
+
+	OK_(crypt_init(&cd2, DEVICE_2));
+	OK_(crypt_load(cd2, CRYPT_LUKS2, NULL));
+	EQ_(crypt_keyslot_status(cd2, 3), CRYPT_SLOT_INACTIVE);
+	EQ_(crypt_keyslot_status(cd2, 6), CRYPT_SLOT_INACTIVE);
+	crypt_free(cd2);
+	crypt_free(cd);
+
+	// LUKS1 is not supported
+	OK_(crypt_init(&cd, DEVICE_2));
+	crypt_set_iteration_time(cd, 1);
+	OK_(crypt_format(cd, CRYPT_LUKS1, "aes", "cbc-essiv:sha256", NULL, key, key_size, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	entries[0].keyslot = CRYPT_ANY_SLOT;
+	FAIL_(crypt_keyslot_add_batch(cd, PASSPHRASE, strlen(PASSPHRASE), entries, 1), "LUKS1 device");
+	EQ_(crypt_keyslot_status(cd, 1), CRYPT_SLOT_INACTIVE);
+	crypt_free(cd);
+}
+
+static void KeyslotDestroyBatch(void)
+{
+	struct crypt_device *cd, *cd2;
+	struct crypt_pbkdf_type pbkdf2 = {
+		.type = CRYPT_KDF_PBKDF2,
+		.hash = DEFAULT_LUKS1_HASH,
+		.iterations = 1000,
+		.flags = CRYPT_PBKDF_NO_BENCHMARK
+	};
+	const char *mk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(mk_hex) / 2;
+	int keyslots[3];
+	char key[128];
+
+	crypt_decode_key(key, mk_hex, key_size);
+
+	// LUKS2
+	OK_(crypt_init(&cd, DEVICE_2));
+	OK_(crypt_set_pbkdf_type(cd, &pbkdf2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 1, key, key_size, PASSPHRASE1, strlen(PASSPHRASE1)), 1);
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 4, key, key_size, "slot4", 5), 4);
+
+	keyslots[0] = 1; keyslots[1] = 1;
+	FAIL_(crypt_keyslot_destroy_batch(cd, keyslots, 2), "duplicate keyslot");
+	keyslots[1] = crypt_keyslot_max(CRYPT_LUKS2);
+	FAIL_(crypt_keyslot_destroy_batch(cd, keyslots, 2), "invalid keyslot");
+	FAIL_(crypt_keyslot_destroy_batch(cd, keyslots, 0), "no keyslots");
+	EQ_(crypt_keyslot_status(cd, 1), CRYPT_SLOT_ACTIVE);
+
+	// inactive keyslot in request, nothing is destroyed
+	keyslots[0] = 4; keyslots[1] = 2; keyslots[2] = 1;
+	EQ_(crypt_keyslot_destroy_batch(cd, keyslots, 3), -ENOENT);
+	EQ_(crypt_keyslot_status(cd, 1), CRYPT_SLOT_ACTIVE);
+	EQ_(crypt_keyslot_status(cd, 4), CRYPT_SLOT_ACTIVE);
+
+	keyslots[1] = 1;
+	OK_(crypt_keyslot_destroy_batch(cd, keyslots, 2));
+	EQ_(crypt_keyslot_status(cd, 0), CRYPT_SLOT_ACTIVE_LAST);
+	EQ_(crypt_keyslot_status(cd, 1), CRYPT_SLOT_INACTIVE);
+	EQ_(crypt_keyslot_status(cd, 4), CRYPT_SLOT_INACTIVE);
+
+	OK_(crypt_init(&cd2, DEVICE_2));
+	OK_(crypt_load(cd2, CRYPT_LUKS2, NULL));
+	EQ_(crypt_keyslot_status(cd2, 0), CRYPT_SLOT_ACTIVE_LAST);
+	EQ_(crypt_keyslot_status(cd2, 1), CRYPT_SLOT_INACTIVE);
+	EQ_(crypt_keyslot_status(cd2, 4), CRYPT_SLOT_INACTIVE);
+	FAIL_(crypt_activate_by_passphrase(cd2, NULL, CRYPT_ANY_SLOT, PASSPHRASE1, strlen(PASSPHRASE1), 0), "destroyed keyslot");
+	FAIL_(crypt_activate_by_passphrase(cd2, NULL, CRYPT_ANY_SLOT, "slot4", 5, 0), "destroyed keyslot");
+	EQ_(crypt_activate_by_passphrase(cd2, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 0);
+	crypt_free(cd2);
+
+	// last keyslot can be destroyed as well
+	keyslots[0] = 0;
+	OK_(crypt_keyslot_destroy_batch(cd, keyslots, 1));
+	EQ_(crypt_keyslot_status(cd, 0), CRYPT_SLOT_INACTIVE);
+	crypt_free(cd);
+
+	// LUKS1
+	OK_(crypt_init(&cd, DEVICE_2));
+	crypt_set_iteration_time(cd, 1);
+	OK_(crypt_format(cd, CRYPT_LUKS1, "aes", "cbc-essiv:sha256", NULL, key, key_size, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 2, key, key_size, PASSPHRASE1, strlen(PASSPHRASE1)), 2);
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 7, key, key_size, "slot7", 5), 7);
+
+	// inactive LUKS1 keyslot is an error, nothing is destroyed
+	keyslots[0] = 2; keyslots[1] = 3;
+	FAIL_(crypt_keyslot_destroy_batch(cd, keyslots, 2), "inactive keyslot");
+	EQ_(crypt_keyslot_status(cd, 2), CRYPT_SLOT_ACTIVE);
+	keyslots[1] = 9;
+	FAIL_(crypt_keyslot_destroy_batch(cd, keyslots, 2), "invalid keyslot");
+
+	keyslots[0] = 7; keyslots[1] = 2;
+	OK_(crypt_keyslot_destroy_batch(cd, keyslots, 2));
+	EQ_(crypt_keyslot_status(cd, 0), CRYPT_SLOT_ACTIVE_LAST);
+	EQ_(crypt_keyslot_status(cd, 2), CRYPT_SLOT_INACTIVE);
+	EQ_(crypt_keyslot_status(cd, 7), CRYPT_SLOT_INACTIVE);
+
+	OK_(crypt_init(&cd2, DEVICE_2));
+	OK_(crypt_load(cd2, CRYPT_LUKS1, NULL));
+	EQ_(crypt_keyslot_status(cd2, 2), CRYPT_SLOT_INACTIVE);
+	EQ_(crypt_keyslot_status(cd2, 7), CRYPT_SLOT_INACTIVE);
+	FAIL_(crypt_activate_by_passphrase(cd2, NULL, CRYPT_ANY_SLOT, "slot7", 5, 0), "destroyed keyslot");
+	EQ_(crypt_activate_by_passphrase(cd2, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 0);
+	crypt_free(cd2);
+	crypt_free(cd);
+}
+
+static void Luks2ActivateSet(void)
+{
+	struct crypt_device *cd;
+	struct crypt_pbkdf_type pbkdf2 = {
+		.type = CRYPT_KDF_PBKDF2,
+		.hash = DEFAULT_LUKS1_HASH,
+		.iterations = 1000,
+		.flags = CRYPT_PBKDF_NO_BENCHMARK
+	};
+	struct crypt_activate_set_device set[3];
+	const char *mk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(mk_hex) / 2;
+	uint64_t offset, length;
+	char key[128], cmd[256];
+
+	crypt_decode_key(key, mk_hex, key_size);
+
+	OK_(crypt_init(&cd, DEVICE_1));
+	OK_(crypt_set_pbkdf_type(cd, &pbkdf2));
+	OK_(crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_keyslot_add_by_volume_key(cd, 2, key, key_size, PASSPHRASE1, strlen(PASSPHRASE1)), 2);
+	remove(BACKUP_FILE);
+	OK_(crypt_header_backup(cd, CRYPT_LUKS2, BACKUP_FILE));
+	crypt_free(cd);
+
+	// cloned header, keyslots share PBKDF parameters and salt
+	OK_(crypt_init(&cd, DEVICE_2));
+	OK_(crypt_header_restore(cd, CRYPT_LUKS2, BACKUP_FILE));
+	crypt_free(cd);
+
+	memset(set, 0, sizeof(set));
+	set[0].device = DEVICE_1;
+	set[0].name = CDEVICE_1;
+	set[1].device = DEVICE_2;
+	set[1].name = CDEVICE_2;
+	FAIL_(crypt_activate_set(set, 0, PASSPHRASE, strlen(PASSPHRASE), NULL, CRYPT_ANY_SLOT, 0), "empty set");
+	FAIL_(crypt_activate_set(set, 2, NULL, 0, NULL, CRYPT_ANY_SLOT, 0), "no passphrase");
+	set[1].name = NULL;
+	FAIL_(crypt_activate_set(set, 2, PASSPHRASE, strlen(PASSPHRASE), NULL, CRYPT_ANY_SLOT, 0), "no name");
+	set[1].name = CDEVICE_2;
+
+	OK_(crypt_activate_set(set, 2, PASSPHRASE1, strlen(PASSPHRASE1), NULL, CRYPT_ANY_SLOT, 0));
+	EQ_(set[0].r, 2);
+	EQ_(set[1].r, 2);
+	EQ_(crypt_status(NULL, CDEVICE_1), CRYPT_ACTIVE);
+	EQ_(crypt_status(NULL, CDEVICE_2), CRYPT_ACTIVE);
+	OK_(crypt_deactivate(NULL, CDEVICE_1));
+	OK_(crypt_deactivate(NULL, CDEVICE_2));
+
+	// wrong passphrase
+	EQ_(crypt_activate_set(set, 2, "wrong", 5, NULL, CRYPT_ANY_SLOT, 0), -EPERM);
+	EQ_(set[0].r, -EPERM);
+	EQ_(set[1].r, -EPERM);
+	EQ_(crypt_status(NULL, CDEVICE_1), CRYPT_INACTIVE);
+	EQ_(crypt_status(NULL, CDEVICE_2), CRYPT_INACTIVE);
+
+	// requested keyslot
+	EQ_(crypt_activate_set(set, 2, PASSPHRASE1, strlen(PASSPHRASE1), NULL, 0, 0), -EPERM);
+	OK_(crypt_activate_set(set, 2, PASSPHRASE, strlen(PASSPHRASE), NULL, 0, 0));
+	EQ_(set[0].r, 0);
+	EQ_(set[1].r, 0);
+	OK_(crypt_deactivate(NULL, CDEVICE_1));
+	OK_(crypt_deactivate(NULL, CDEVICE_2));
+
+	// shared derivation, volume key is still verified by digest of each device
+	OK_(crypt_init(&cd, DEVICE_2));
+	OK_(crypt_load(cd, CRYPT_LUKS2, NULL));
+	OK_(crypt_keyslot_area(cd, 2, &offset, &length));
+	crypt_free(cd);
+	snprintf(cmd, sizeof(cmd), "dd if=/dev/urandom of=%s bs=512 seek=%" PRIu64 " count=%" PRIu64 " oflag=direct 2>/dev/null",
+		 DEVICE_2, offset / 512, length / 512);
+	OK_(_system(cmd, 1));
+	EQ_(crypt_activate_set(set, 2, PASSPHRASE1, strlen(PASSPHRASE1), NULL, CRYPT_ANY_SLOT, 0), -EPERM);
+	EQ_(set[0].r, 2);
+	EQ_(set[1].r, -EPERM);
+	EQ_(crypt_status(NULL, CDEVICE_1), CRYPT_ACTIVE);
+	EQ_(crypt_status(NULL, CDEVICE_2), CRYPT_INACTIVE);
+	OK_(crypt_deactivate(NULL, CDEVICE_1));
+
+	// device without LUKS header does not stop the others
+	set[2].device = DEVICE_EMPTY;
+	set[2].name = CDEVICE_3;
+	FAIL_(crypt_activate_set(set, 3, PASSPHRASE, strlen(PASSPHRASE), NULL, CRYPT_ANY_SLOT, 0), "no header");
+	EQ_(set[0].r, 0);
+	EQ_(set[1].r, 0);
+	FAIL_(set[2].r, "no header");
+	EQ_(crypt_status(NULL, CDEVICE_1), CRYPT_ACTIVE);
+	EQ_(crypt_status(NULL, CDEVICE_2), CRYPT_ACTIVE);
+	EQ_(crypt_status(NULL, CDEVICE_3), CRYPT_INACTIVE);
+	OK_(crypt_deactivate(NULL, CDEVICE_1));
+	OK_(crypt_deactivate(NULL, CDEVICE_2));
+
+	remove(BACKUP_FILE);
+}
+
+static void KeyslotVerifyBatch(void)
+{
+	struct crypt_device *cd1, *cd2;
+	struct crypt_pbkdf_type pbkdf2 = {
+		.type = CRYPT_KDF_PBKDF2,
+		.hash = DEFAULT_LUKS1_HASH,
+		.iterations = 1000,
+		.flags = CRYPT_PBKDF_NO_BENCHMARK
+	};
+	struct crypt_keyslot_check req[7];
+	const char *mk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(mk_hex) / 2;
+	char key[128];
+	int i;
+
+	crypt_decode_key(key, mk_hex, key_size);
+
+	OK_(crypt_init(&cd1, DEVICE_1));
+	OK_(crypt_set_pbkdf_type(cd1, &pbkdf2));
+	OK_(crypt_format(cd1, CRYPT_LUKS2, "aes", "xts-plain64", NULL, key, key_size, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd1, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)), 0);
+	EQ_(crypt_keyslot_add_by_volume_key(cd1, 1, key, key_size, PASSPHRASE1, strlen(PASSPHRASE1)), 1);
+
+	OK_(crypt_init(&cd2, DEVICE_2));
+	crypt_set_iteration_time(cd2, 1);
+	OK_(crypt_format(cd2, CRYPT_LUKS1, "aes", "cbc-essiv:sha256", NULL, NULL, 32, NULL));
+	EQ_(crypt_keyslot_add_by_volume_key(cd2, 0, NULL, 0, PASSPHRASE, strlen(PASSPHRASE)), 0);
+
+	FAIL_(crypt_keyslot_verify_batch(NULL, 1), "no requests");
+	FAIL_(crypt_keyslot_verify_batch(req, 0), "no requests");
+
+	memset(req, 0, sizeof(req));
+	for (i = 0; i < 7; i++) {
+		req[i].cd = i < 4 ? cd1 : cd2;
+		req[i].passphrase = PASSPHRASE;
+		req[i].passphrase_size = strlen(PASSPHRASE);
+	}
+	req[1].keyslot = 1;
+	req[1].passphrase = PASSPHRASE1;
+	req[1].passphrase_size = strlen(PASSPHRASE1);
+	req[2].keyslot = 1;
+	req[3].keyslot = 5;
+	req[5].keyslot = 3;
+	req[6].cd = NULL;
+
+	// per check results, first failure is returned
+	EQ_(crypt_keyslot_verify_batch(req, 2), 0);
+	EQ_(req[0].r, 0);
+	EQ_(req[1].r, 0);
+	EQ_(crypt_keyslot_verify_batch(req, 7), -EPERM);
+	EQ_(req[0].r, 0);
+	EQ_(req[1].r, 0);
+	EQ_(req[2].r, -EPERM);
+	EQ_(req[3].r, -ENOENT);
+	EQ_(req[4].r, 0);
+	EQ_(req[5].r, -ENOENT);
+	EQ_(req[6].r, -EINVAL);
+	OK_(req[0].kdf_ms < 0.0);
+	OK_(req[3].kdf_ms != 0.0);
+
+	// nothing is activated
+	EQ_(crypt_status(cd1, CDEVICE_1), CRYPT_INACTIVE);
+	EQ_(crypt_status(cd2, CDEVICE_2), CRYPT_INACTIVE);
+
+	// handles stay usable
+	EQ_(crypt_activate_by_passphrase(cd1, NULL, CRYPT_ANY_SLOT, PASSPHRASE1, strlen(PASSPHRASE1), 0), 1);
+	EQ_(crypt_activate_by_passphrase(cd2, NULL, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0), 0);
+
+	crypt_free(cd1);
+	crypt_free(cd2);
+}
+
 static void int_handler(int sig __attribute__((__unused__)))
 {
 	_quit++;
@@ -2886,6 +3800,7 @@ int main(int argc, char *argv[])
 	RUN_(ResizeDeviceLuks2, "Luks device resize tests");
 	RUN_(UseLuks2Device, "Use pre-formated LUKS2 device");
 	RUN_(SuspendDevice, "Suspend/Resume test");
+	RUN_(SuspendRetainedKey, "Suspend/Resume with retained key test");
 	RUN_(UseTempVolumes, "Format and use temporary encrypted device");
 	RUN_(Tokens, "General tokens API tests");
 	RUN_(TokenActivationByKeyring, "Builtin kernel keyring token tests");
@@ -2896,6 +3811,16 @@ int main(int argc, char *argv[])
 	RUN_(Luks2Requirements, "Test LUKS2 requirements flags");
 	RUN_(Luks2Integrity, "Test LUKS2 with data integrity");
 	RUN_(Luks2Flags, "Test LUKS2 persistent flags");
+	RUN_(Luks2Probe, "Test fast signature probe");
+	RUN_(Luks2Reencryption, "Test LUKS2 online reencryption");
+	RUN_(Luks2DigestCache, "Test LUKS2 verified volume key cache");
+	RUN_(Luks2ActivateBatch, "Test batch activation");
+	RUN_(DeactivateBatch, "Test batch deactivation");
+	RUN_(Luks2HeaderTransaction, "Test LUKS2 header transactions");
+	RUN_(Luks2KeyslotAddBatch, "Test LUKS2 batch keyslot add");
+	RUN_(KeyslotDestroyBatch, "Test batch keyslot destroy");
+	RUN_(Luks2ActivateSet, "Test activation of LUKS2 device set");
+	RUN_(KeyslotVerifyBatch, "Test batch keyslot verification");
 out:
 	_cleanup();
 	return 0;
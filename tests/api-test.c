@@ -942,6 +942,46 @@ static void AddDeviceLuks(void)
 	_cleanup_dmdevices();
 }
 
+static void LuksKeyslotsParallel(void)
+{
+	struct crypt_device *cd;
+	const char *mk_hex = "bb21158c733229347bd4e681891e213d94c685be6a5b84818afe7a78a6de7a1a";
+	size_t key_size = strlen(mk_hex) / 2;
+	char key[128], key2[128];
+
+	crypt_decode_key(key, mk_hex, key_size);
+
+	// with more active keyslots (and CPUs) keys are derived concurrently
+	OK_(crypt_init(&cd, DEVICE_2));
+	crypt_set_iteration_time(cd, 1);
+	OK_(crypt_format(cd, CRYPT_LUKS1, "aes", "cbc-essiv:sha256", NULL, key, key_size, NULL));
+	EQ_(0, crypt_keyslot_add_by_volume_key(cd, 0, key, key_size, PASSPHRASE, strlen(PASSPHRASE)));
+	EQ_(1, crypt_keyslot_add_by_volume_key(cd, 1, key, key_size, KEY1, strlen(KEY1)));
+	EQ_(5, crypt_keyslot_add_by_volume_key(cd, 5, key, key_size, PASSPHRASE1, strlen(PASSPHRASE1)));
+	crypt_free(cd);
+
+	OK_(crypt_init(&cd, DEVICE_2));
+	OK_(crypt_load(cd, CRYPT_LUKS1, NULL));
+	EQ_(5, crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE1, strlen(PASSPHRASE1), 0));
+	EQ_(1, crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, KEY1, strlen(KEY1), 0));
+	EQ_(0, crypt_activate_by_passphrase(cd, CDEVICE_2, CRYPT_ANY_SLOT, PASSPHRASE, strlen(PASSPHRASE), 0));
+	EQ_(crypt_status(cd, CDEVICE_2), CRYPT_ACTIVE);
+	OK_(crypt_deactivate(cd, CDEVICE_2));
+	EQ_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, KEY2, strlen(KEY2), 0), -EPERM);
+
+	// two active keyslots left
+	OK_(crypt_keyslot_destroy(cd, 1));
+	EQ_(5, crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, PASSPHRASE1, strlen(PASSPHRASE1), 0));
+	FAIL_(crypt_activate_by_passphrase(cd, NULL, CRYPT_ANY_SLOT, KEY1, strlen(KEY1), 0), "keyslot destroyed");
+
+	if (!_fips_mode) {
+		key_size = sizeof(key2);
+		EQ_(5, crypt_volume_key_get(cd, CRYPT_ANY_SLOT, key2, &key_size, PASSPHRASE1, strlen(PASSPHRASE1)));
+		OK_(memcmp(key, key2, key_size));
+	}
+	crypt_free(cd);
+}
+
 static void UseTempVolumes(void)
 {
 	struct crypt_device *cd;
@@ -1765,6 +1805,7 @@ int main(int argc, char *argv[])
 	RUN_(AddDevicePlain, "plain device API creation exercise");
 	RUN_(HashDevicePlain, "plain device API hash test");
 	RUN_(AddDeviceLuks, "Format and use LUKS device");
+	RUN_(LuksKeyslotsParallel, "Unlock LUKS device with more keyslots");
 	RUN_(LuksHeaderLoad, "test header load");
 	RUN_(LuksHeaderRestore, "test LUKS header restore");
 	RUN_(LuksHeaderBackup, "test LUKS header backup");
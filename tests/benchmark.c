@@ -0,0 +1,605 @@
+/*
+ * cryptsetup internal hot paths performance benchmark
+ *
+ * Copyright (C) 2026, cryptsetup contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * All benchmarks use fixed sizes, parameters and data patterns, so results
+ * of different builds are directly comparable.
+ *
+ * Output is one tab separated line per benchmark:
+ *   <name> <iterations> <bytes per iteration> <total usec> <usec per iteration>
+ * lines starting with '#' are comments.
+ *
+ * Usage: benchmark [-d image_directory] [-w wipe_block_device] [-f filter]
+ *                  [-l max_depth:max_objects:max_time_ms]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <inttypes.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "internal.h"
+#include "af.h"
+#include "luks.h"
+#include "luks2/luks2_internal.h"
+#include "libcryptsetup.h"
+
+#define BENCH_IMAGE_SIZE	(32 * 1024 * 1024)
+#define BENCH_BUFFER_SIZE	(1024 * 1024)
+#define BENCH_KEY_SIZE		64
+
+static const char *opt_dir = "/dev/shm";
+static const char *opt_wipe_device = NULL;
+static const char *opt_filter = NULL;
+static struct crypt_metadata_limits *opt_limits = NULL;
+static int failed = 0;
+
+static uint64_t usec_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void fill_pattern(char *buf, size_t len, unsigned seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = (char)((i * 31 + seed) & 0xff);
+}
+
+static int skip(const char *name)
+{
+	return opt_filter && !strstr(name, opt_filter);
+}
+
+static void report(const char *name, unsigned iterations, uint64_t bytes, uint64_t usec)
+{
+	printf("%s\t%u\t%" PRIu64 "\t%" PRIu64 "\t%" PRIu64 "\n", name,
+	       iterations, bytes, usec, iterations ? usec / iterations : 0);
+	fflush(stdout);
+}
+
+static void report_fail(const char *name, int r)
+{
+	printf("# %s: FAILED (%d)\n", name, r);
+	fflush(stdout);
+	failed++;
+}
+
+static int create_image(const char *path, size_t size)
+{
+	int fd, r = 0;
+
+	fd = open(path, O_CREAT | O_TRUNC | O_RDWR, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		return -errno;
+	if (ftruncate(fd, size))
+		r = -errno;
+	close(fd);
+	return r;
+}
+
+/*
+ * KDF
+ */
+static void bench_kdf(const char *name, const char *kdf, const char *hash,
+		      uint32_t iterations, uint32_t memory, uint32_t parallel,
+		      unsigned loops)
+{
+	char password[] = "benchmark passphrase", salt[32], key[BENCH_KEY_SIZE];
+	uint64_t start;
+	unsigned i;
+	int r = 0;
+
+	if (skip(name))
+		return;
+
+	fill_pattern(salt, sizeof(salt), 1);
+
+	start = usec_now();
+	for (i = 0; i < loops && !r; i++)
+		r = crypt_pbkdf(kdf, hash, password, strlen(password), salt, sizeof(salt),
+				key, sizeof(key), iterations, memory, parallel);
+	if (r)
+		report_fail(name, r);
+	else
+		report(name, loops, sizeof(key), usec_now() - start);
+	crypt_backend_memzero(key, sizeof(key));
+}
+
+/*
+ * Anti-forensic splitter
+ */
+static void bench_af(unsigned stripes, unsigned loops)
+{
+	char *src, *dst;
+	uint64_t start;
+	unsigned i;
+	int r = 0;
+
+	if (skip("af-split") && skip("af-merge"))
+		return;
+
+	src = malloc(BENCH_KEY_SIZE);
+	dst = malloc((size_t)BENCH_KEY_SIZE * stripes);
+	if (!src || !dst) {
+		report_fail("af-split", -ENOMEM);
+		goto out;
+	}
+	fill_pattern(src, BENCH_KEY_SIZE, 2);
+
+	start = usec_now();
+	for (i = 0; i < loops && !r; i++)
+		r = AF_split(src, dst, BENCH_KEY_SIZE, stripes, "sha256");
+	if (r)
+		report_fail("af-split", r);
+	else if (!skip("af-split"))
+		report("af-split", loops, (uint64_t)BENCH_KEY_SIZE * stripes, usec_now() - start);
+
+	start = usec_now();
+	for (i = 0; i < loops && !r; i++)
+		r = AF_merge(dst, src, BENCH_KEY_SIZE, stripes, "sha256");
+	if (r)
+		report_fail("af-merge", r);
+	else if (!skip("af-merge"))
+		report("af-merge", loops, (uint64_t)BENCH_KEY_SIZE * stripes, usec_now() - start);
+out:
+	free(src);
+	free(dst);
+}
+
+/*
+ * Storage (sector) encryption wrapper
+ */
+static void bench_storage(const char *cipher, const char *mode, size_t key_size,
+			  size_t sector_size, unsigned loops)
+{
+	struct crypt_storage *s = NULL;
+	char name[64], key[BENCH_KEY_SIZE], *buf = NULL;
+	uint64_t start;
+	unsigned i;
+	int r;
+
+	snprintf(name, sizeof(name), "storage-%s-%s-%zu", cipher, mode, key_size * 8);
+	if (skip(name))
+		return;
+
+	fill_pattern(key, sizeof(key), 3);
+	r = crypt_storage_init_sector(&s, 0, sector_size, cipher, mode, key, key_size);
+	if (r < 0) {
+		report_fail(name, r);
+		return;
+	}
+
+	if (posix_memalign((void *)&buf, crypt_getpagesize(), BENCH_BUFFER_SIZE)) {
+		report_fail(name, -ENOMEM);
+		goto out;
+	}
+	fill_pattern(buf, BENCH_BUFFER_SIZE, 4);
+
+	start = usec_now();
+	for (i = 0; i < loops && !r; i++)
+		r = crypt_storage_encrypt(s, 0, BENCH_BUFFER_SIZE / SECTOR_SIZE, buf);
+	if (r) {
+		report_fail(name, r);
+		goto out;
+	}
+	strcat(name, "-enc");
+	report(name, loops, BENCH_BUFFER_SIZE, usec_now() - start);
+
+	start = usec_now();
+	for (i = 0; i < loops && !r; i++)
+		r = crypt_storage_decrypt(s, 0, BENCH_BUFFER_SIZE / SECTOR_SIZE, buf);
+	name[strlen(name) - 4] = '\0';
+	strcat(name, "-dec");
+	if (r)
+		report_fail(name, r);
+	else
+		report(name, loops, BENCH_BUFFER_SIZE, usec_now() - start);
+out:
+	crypt_storage_destroy(s);
+	free(buf);
+}
+
+/*
+ * LUKS2 header read (both copies, checksum and JSON validation)
+ */
+static void bench_luks2_hdr(unsigned loops)
+{
+	struct crypt_pbkdf_type pbkdf = {
+		.type = CRYPT_KDF_PBKDF2,
+		.hash = "sha256",
+		.iterations = 1000,
+		.flags = CRYPT_PBKDF_NO_BENCHMARK,
+	};
+	struct crypt_device *cd = NULL;
+	struct luks2_hdr hdr;
+	char key[BENCH_KEY_SIZE], path[PATH_MAX];
+	uint64_t start;
+	unsigned i;
+	int r;
+
+	if (skip("luks2-hdr-read"))
+		return;
+
+	snprintf(path, sizeof(path), "%s/cryptsetup-bench-luks2.img", opt_dir);
+	fill_pattern(key, sizeof(key), 5);
+
+	r = create_image(path, BENCH_IMAGE_SIZE);
+	if (!r)
+		r = crypt_init(&cd, path);
+	if (!r)
+		r = crypt_set_pbkdf_type(cd, &pbkdf);
+	if (!r)
+		r = crypt_format(cd, CRYPT_LUKS2, "aes", "xts-plain64", NULL,
+				 key, sizeof(key), NULL);
+	if (!r)
+		r = crypt_keyslot_add_by_volume_key(cd, 0, key, sizeof(key), "bench", 5);
+	if (r < 0) {
+		report_fail("luks2-hdr-read", r);
+		goto out;
+	}
+	r = 0;
+
+	start = usec_now();
+	for (i = 0; i < loops && !r; i++) {
+		memset(&hdr, 0, sizeof(hdr));
+		r = LUKS2_disk_hdr_read(cd, &hdr, crypt_metadata_device(cd), 0);
+		if (!r)
+			LUKS2_hdr_free(&hdr);
+	}
+	if (r)
+		report_fail("luks2-hdr-read", r);
+	else
+		report("luks2-hdr-read", loops, 2 * LUKS2_HDR_16K_LEN, usec_now() - start);
+out:
+	crypt_free(cd);
+	unlink(path);
+}
+
+/*
+ * LUKS2 JSON metadata parse and validation on generated worst-case input
+ * (filling the maximal JSON area), optionally with parser limits (-l).
+ */
+#define BENCH_JSON_AREA_SIZE	(4 * 1024 * 1024 - LUKS2_HDR_BIN_LEN)
+
+enum json_kind { JSON_MAX_SLOTS, JSON_DEEP, JSON_WIDE };
+
+/* Append formatted string if it fits, returns 0 when buffer is full */
+static int json_add(char *buf, size_t size, size_t *len, const char *fmt, ...)
+{
+	va_list ap;
+	int r;
+
+	va_start(ap, fmt);
+	r = vsnprintf(buf + *len, size - *len, fmt, ap);
+	va_end(ap);
+
+	if (r < 0 || (size_t)r >= size - *len) {
+		buf[*len] = '\0';
+		return 0;
+	}
+	*len += r;
+	return 1;
+}
+
+static int json_generate(char *buf, size_t size, enum json_kind kind)
+{
+	/* space reserved for closing sections */
+	size_t len = 0, reserve = 4096, i, j, n;
+
+	memset(buf, 0, size);
+	size -= reserve;
+
+	json_add(buf, size, &len, "{\"keyslots\":{");
+	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++)
+		json_add(buf, size, &len, "%s\"%zu\":{\"type\":\"luks2\",\"key_size\":64,"
+			"\"af\":{\"type\":\"luks1\",\"stripes\":4000,\"hash\":\"sha256\"},"
+			"\"area\":{\"type\":\"raw\",\"offset\":\"%zu\",\"size\":\"258048\","
+			"\"encryption\":\"aes-xts-plain64\",\"key_size\":64},"
+			"\"kdf\":{\"type\":\"pbkdf2\",\"hash\":\"sha256\",\"iterations\":1000,"
+			"\"salt\":\"AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA=\"}}",
+			i ? "," : "", i, 32768 + i * 258048);
+	json_add(buf, size, &len, "},\"tokens\":{");
+
+	for (i = 0; i < LUKS2_TOKENS_MAX; i++) {
+		json_add(buf, size, &len, "%s\"%zu\":{\"type\":\"bench\",\"keyslots\":[",
+			 i ? "," : "", i);
+		for (j = 0; j < LUKS2_KEYSLOTS_MAX; j++)
+			json_add(buf, size, &len, "%s\"%zu\"", j ? "," : "", j);
+		json_add(buf, size, &len, "],\"payload\":");
+
+		/* Payload of each token gets equal share of the remaining area */
+		reserve = len + (size - len) / (LUKS2_TOKENS_MAX - i) - 64;
+		if (kind == JSON_DEEP) {
+			n = (reserve - len) / 2;
+			for (j = 0; j < n; j++)
+				json_add(buf, size, &len, "[");
+			for (j = 0; j < n; j++)
+				json_add(buf, size, &len, "]");
+		} else if (kind == JSON_WIDE) {
+			json_add(buf, size, &len, "[0");
+			while (len < reserve)
+				if (!json_add(buf, size, &len, ",{\"a\":[0]}"))
+					break;
+			json_add(buf, size, &len, "]");
+		} else {
+			json_add(buf, size, &len, "\"");
+			while (len < reserve)
+				if (!json_add(buf, size, &len, "AAAAAAAAAAAAAAAA"))
+					break;
+			json_add(buf, size, &len, "\"");
+		}
+		json_add(buf, size, &len, "}");
+	}
+
+	size += 4096;
+	json_add(buf, size, &len, "},\"segments\":{\"0\":{\"type\":\"crypt\",\"offset\":\"16777216\","
+		"\"iv_tweak\":\"0\",\"size\":\"dynamic\",\"encryption\":\"aes-xts-plain64\","
+		"\"sector_size\":512}},\"digests\":{\"0\":{\"type\":\"pbkdf2\",\"keyslots\":[");
+	for (i = 0; i < LUKS2_KEYSLOTS_MAX; i++)
+		json_add(buf, size, &len, "%s\"%zu\"", i ? "," : "", i);
+	if (!json_add(buf, size, &len, "],\"segments\":[\"0\"],\"hash\":\"sha256\",\"iterations\":1000,"
+		"\"salt\":\"AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA=\","
+		"\"digest\":\"AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA=\"}},"
+		"\"config\":{\"json_size\":\"%d\",\"keyslots_size\":\"8388608\"}}",
+		BENCH_JSON_AREA_SIZE))
+		return -EINVAL;
+
+	return 0;
+}
+
+static void bench_luks2_json(const char *name, enum json_kind kind, unsigned loops,
+			     const struct crypt_metadata_limits *limits)
+{
+	struct crypt_device *cd = NULL;
+	json_object *jobj;
+	char *buf;
+	uint64_t start;
+	unsigned i, rejected = 0;
+	int r;
+
+	if (skip(name))
+		return;
+
+	if (!(buf = malloc(BENCH_JSON_AREA_SIZE))) {
+		report_fail(name, -ENOMEM);
+		return;
+	}
+
+	r = json_generate(buf, BENCH_JSON_AREA_SIZE, kind);
+	if (!r)
+		r = crypt_init(&cd, NULL);
+	if (!r)
+		r = crypt_set_metadata_limits(cd, limits);
+	if (r < 0) {
+		report_fail(name, r);
+		goto out;
+	}
+
+	start = usec_now();
+	for (i = 0; i < loops; i++) {
+		/* Generated headers are not fully valid, full validation cost is still paid */
+		jobj = parse_and_validate_json(cd, buf, BENCH_JSON_AREA_SIZE);
+		if (jobj)
+			json_object_put(jobj);
+		else
+			rejected++;
+	}
+	report(name, loops, BENCH_JSON_AREA_SIZE, usec_now() - start);
+	if (limits)
+		printf("# %s: %u of %u rejected by limits (depth %u, objects %u, time %u ms)\n",
+		       name, rejected, loops, limits->max_depth, limits->max_objects,
+		       limits->max_time_ms);
+out:
+	crypt_free(cd);
+	free(buf);
+}
+
+/*
+ * Verity hash tree creation (and FEC encoding) on image files
+ */
+static void bench_verity(const char *name, uint32_t fec_roots, unsigned loops)
+{
+	struct crypt_params_verity params = {
+		.hash_name = "sha256",
+		.salt = "0123456789abcdef0123456789abcdef",
+		.salt_size = 32,
+		.hash_type = 1,
+		.data_block_size = 4096,
+		.hash_block_size = 4096,
+		.data_size = BENCH_IMAGE_SIZE / 4096,
+		.flags = CRYPT_VERITY_CREATE_HASH,
+	};
+	struct crypt_device *cd;
+	char data[PATH_MAX], hash[PATH_MAX], fec[PATH_MAX], *buf = NULL;
+	uint64_t start, usec = 0;
+	unsigned i;
+	int fd, r;
+
+	if (skip(name))
+		return;
+
+	snprintf(data, sizeof(data), "%s/cryptsetup-bench-verity-data.img", opt_dir);
+	snprintf(hash, sizeof(hash), "%s/cryptsetup-bench-verity-hash.img", opt_dir);
+	snprintf(fec, sizeof(fec), "%s/cryptsetup-bench-verity-fec.img", opt_dir);
+	params.data_device = data;
+	if (fec_roots) {
+		params.fec_device = fec;
+		params.fec_roots = fec_roots;
+	}
+
+	/* Data pattern is fixed, sparse image would not hash real content */
+	r = -ENOMEM;
+	if (!(buf = malloc(BENCH_BUFFER_SIZE)))
+		goto out;
+	fill_pattern(buf, BENCH_BUFFER_SIZE, 6);
+	r = -EIO;
+	fd = open(data, O_CREAT | O_TRUNC | O_WRONLY, S_IRUSR | S_IWUSR);
+	if (fd < 0)
+		goto out;
+	for (i = 0; i < BENCH_IMAGE_SIZE / BENCH_BUFFER_SIZE; i++)
+		if (write(fd, buf, BENCH_BUFFER_SIZE) != BENCH_BUFFER_SIZE)
+			break;
+	close(fd);
+	if (i != BENCH_IMAGE_SIZE / BENCH_BUFFER_SIZE)
+		goto out;
+
+	r = 0;
+	for (i = 0; i < loops && !r; i++) {
+		r = create_image(hash, 0);
+		if (!r && fec_roots)
+			r = create_image(fec, 0);
+		if (!r)
+			r = crypt_init(&cd, hash);
+		if (r)
+			break;
+		start = usec_now();
+		r = crypt_format(cd, CRYPT_VERITY, NULL, NULL, NULL, NULL, 0, &params);
+		usec += usec_now() - start;
+		crypt_free(cd);
+	}
+out:
+	if (r)
+		report_fail(name, r);
+	else
+		report(name, loops, BENCH_IMAGE_SIZE, usec);
+	free(buf);
+	unlink(data);
+	unlink(hash);
+	unlink(fec);
+}
+
+/*
+ * Wipe throughput, only on explicitly given (scratch) block device
+ */
+static void bench_wipe(unsigned loops)
+{
+	struct crypt_device *cd = NULL;
+	uint64_t start;
+	unsigned i;
+	int r;
+
+	if (skip("wipe-zero"))
+		return;
+
+	if (!opt_wipe_device) {
+		printf("# wipe-zero: skipped, no scratch device (-w) specified\n");
+		return;
+	}
+
+	r = crypt_init(&cd, opt_wipe_device);
+	if (r < 0) {
+		report_fail("wipe-zero", r);
+		return;
+	}
+
+	start = usec_now();
+	for (i = 0; i < loops && !r; i++)
+		r = crypt_wipe(cd, opt_wipe_device, CRYPT_WIPE_ZERO, 0, BENCH_IMAGE_SIZE,
+			       BENCH_BUFFER_SIZE, 0, NULL, NULL);
+	if (r)
+		report_fail("wipe-zero", r);
+	else
+		report("wipe-zero", loops, BENCH_IMAGE_SIZE, usec_now() - start);
+	crypt_free(cd);
+}
+
+int main(int argc, char *argv[])
+{
+	struct crypt_metadata_limits limits = {};
+	struct stat st;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:w:f:l:")) != -1) {
+		switch (c) {
+		case 'd':
+			opt_dir = optarg;
+			break;
+		case 'w':
+			opt_wipe_device = optarg;
+			break;
+		case 'f':
+			opt_filter = optarg;
+			break;
+		case 'l':
+			if (sscanf(optarg, "%u:%u:%u", &limits.max_depth,
+				   &limits.max_objects, &limits.max_time_ms) != 3) {
+				fprintf(stderr, "Invalid limits specification.\n");
+				exit(EXIT_FAILURE);
+			}
+			opt_limits = &limits;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-d image_directory] [-w wipe_block_device] [-f filter]"
+				" [-l max_depth:max_objects:max_time_ms]\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (stat(opt_dir, &st) || !S_ISDIR(st.st_mode))
+		opt_dir = ".";
+
+	if (crypt_backend_init(NULL)) {
+		printf("# Crypto backend init error.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	printf("# cryptsetup %s benchmark, crypto backend %s, %u CPUs, images in %s\n",
+	       PACKAGE_VERSION, crypt_backend_version(), crypt_cpusonline(), opt_dir);
+	printf("# name\titerations\tbytes\tusec\tusec_per_iteration\n");
+
+	bench_kdf("pbkdf2-sha1-100000", "pbkdf2", "sha1", 100000, 0, 0, 10);
+	bench_kdf("pbkdf2-sha256-100000", "pbkdf2", "sha256", 100000, 0, 0, 10);
+	bench_kdf("pbkdf2-sha512-100000", "pbkdf2", "sha512", 100000, 0, 0, 10);
+	bench_kdf("argon2i-4-65536-1", "argon2i", NULL, 4, 65536, 1, 5);
+	bench_kdf("argon2id-4-65536-4", "argon2id", NULL, 4, 65536, 4, 5);
+
+	bench_af(LUKS_STRIPES, 100);
+
+	bench_storage("aes", "xts-plain64", 32, SECTOR_SIZE, 64);
+	bench_storage("aes", "xts-plain64", 64, SECTOR_SIZE, 64);
+	bench_storage("aes", "cbc-essiv:sha256", 32, SECTOR_SIZE, 64);
+	bench_storage("serpent", "xts-plain64", 64, SECTOR_SIZE, 16);
+
+	bench_luks2_hdr(200);
+
+	bench_luks2_json("luks2-json-max-slots", JSON_MAX_SLOTS, 5, opt_limits);
+	bench_luks2_json("luks2-json-deep", JSON_DEEP, 5, opt_limits);
+	bench_luks2_json("luks2-json-wide", JSON_WIDE, 5, opt_limits);
+
+	bench_verity("verity-create", 0, 3);
+	bench_verity("verity-create-fec", 2, 3);
+
+	bench_wipe(3);
+
+	crypt_backend_destroy();
+	exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
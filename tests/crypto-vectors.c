@@ -266,6 +266,102 @@ static int pbkdf_test_vectors(void)
 	return 0;
 }
 
+struct cipher_test_vector {
+	const char *name;
+	const char *mode;
+	const char *key;
+	unsigned int key_length;
+	const char *iv;
+	unsigned int iv_length;
+	const char *plaintext;
+	const char *ciphertext;
+	unsigned int data_length;
+};
+
+static struct cipher_test_vector cipher_test_vectors[] = {
+	/* FIPS-197 C.1 */
+	{
+		"aes", "ecb",
+		"\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f", 16,
+		NULL, 0,
+		"\x00\x11\x22\x33\x44\x55\x66\x77\x88\x99\xaa\xbb\xcc\xdd\xee\xff",
+		"\x69\xc4\xe0\xd8\x6a\x7b\x04\x30\xd8\xcd\xb7\x80\x70\xb4\xc5\x5a", 16
+	},
+	/* NIST SP800-38A F.2.1 */
+	{
+		"aes", "cbc",
+		"\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c", 16,
+		"\x00\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0a\x0b\x0c\x0d\x0e\x0f", 16,
+		"\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a"
+		"\xae\x2d\x8a\x57\x1e\x03\xac\x9c\x9e\xb7\x6f\xac\x45\xaf\x8e\x51",
+		"\x76\x49\xab\xac\x81\x19\xb2\x46\xce\xe9\x8e\x9b\x12\xe9\x19\x7d"
+		"\x50\x86\xcb\x9b\x50\x72\x19\xee\x95\xdb\x11\x3a\x91\x76\x78\xb2", 32
+	},
+	/* NIST SP800-38A F.5.1 */
+	{
+		"aes", "ctr",
+		"\x2b\x7e\x15\x16\x28\xae\xd2\xa6\xab\xf7\x15\x88\x09\xcf\x4f\x3c", 16,
+		"\xf0\xf1\xf2\xf3\xf4\xf5\xf6\xf7\xf8\xf9\xfa\xfb\xfc\xfd\xfe\xff", 16,
+		"\x6b\xc1\xbe\xe2\x2e\x40\x9f\x96\xe9\x3d\x7e\x11\x73\x93\x17\x2a",
+		"\x87\x4d\x61\x91\xb6\x20\xe3\x26\x1b\xef\x68\x64\x99\x0d\xb6\xce", 16
+	},
+	/* IEEE 1619 XTS-AES-128 vector 1 */
+	{
+		"aes", "xts",
+		"\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+		"\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00", 32,
+		"\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00", 16,
+		"\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00"
+		"\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00",
+		"\x91\x7c\xf6\x9e\xbd\x68\xb2\xec\x9b\x9f\xe9\xa3\xea\xdd\xa6\x92"
+		"\xcd\x43\xd2\xf5\x95\x98\xed\x85\x8c\x02\xc2\x65\x2f\xbf\x92\x2e", 32
+	},
+};
+
+static int crypt_cipher_test_vectors(void)
+{
+	char result[256];
+	unsigned int i;
+	struct cipher_test_vector *vec;
+	struct crypt_cipher *cipher;
+	int r;
+
+	for (i = 0; i < (sizeof(cipher_test_vectors) / sizeof(*cipher_test_vectors)); i++) {
+		vec = &cipher_test_vectors[i];
+		printf("CIPHER vector %02d %s-%s ", i, vec->name, vec->mode);
+		r = crypt_cipher_init(&cipher, vec->name, vec->mode, vec->key, vec->key_length);
+		if (r == -ENOTSUP || r == -ENOENT) {
+			printf("[N/A]\n");
+			continue;
+		}
+		if (r ||
+		    crypt_cipher_encrypt(cipher, vec->plaintext, result, vec->data_length,
+					 vec->iv, vec->iv_length)) {
+			printf("crypto backend [FAILED].\n");
+			if (!r)
+				crypt_cipher_destroy(cipher);
+			return -EINVAL;
+		}
+		if (memcmp(result, vec->ciphertext, vec->data_length)) {
+			printf("expected output [FAILED].\n");
+			printhex(" got", result, vec->data_length);
+			printhex("want", vec->ciphertext, vec->data_length);
+			crypt_cipher_destroy(cipher);
+			return -EINVAL;
+		}
+		if (crypt_cipher_decrypt(cipher, vec->ciphertext, result, vec->data_length,
+					 vec->iv, vec->iv_length) ||
+		    memcmp(result, vec->plaintext, vec->data_length)) {
+			printf("decryption [FAILED].\n");
+			crypt_cipher_destroy(cipher);
+			return -EINVAL;
+		}
+		crypt_cipher_destroy(cipher);
+		printf("[OK]\n");
+	}
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	if (crypt_backend_init(NULL)) {
@@ -277,6 +373,9 @@ int main(int argc, char *argv[])
 	if (pbkdf_test_vectors())
 		exit(EXIT_FAILURE);
 
+	if (crypt_cipher_test_vectors())
+		exit(EXIT_FAILURE);
+
 	crypt_backend_destroy();
 	exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,96 @@
+/*
+ * cryptsetup online reencryption helper for compat tests
+ *
+ * Copyright (C) 2026, cryptsetup contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Usage: online-reencrypt <device> <name> <hotzone size> [<crash offset>]
+ *
+ * Passphrase is read from the first line of standard input, <name> "-"
+ * reencrypts inactive device. With <crash offset> (in bytes) the process
+ * kills itself (SIGKILL) once reencryption passes the offset.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "libcryptsetup.h"
+
+static uint64_t crash_offset = 0;
+
+static int progress(uint64_t size, uint64_t offset, void *usrptr)
+{
+	if (crash_offset && offset >= crash_offset)
+		kill(getpid(), SIGKILL);
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct crypt_device *cd = NULL;
+	struct crypt_pbkdf_type pbkdf = {
+		.type = CRYPT_KDF_PBKDF2,
+		.hash = "sha256",
+		.iterations = 1000,
+		.flags = CRYPT_PBKDF_NO_BENCHMARK
+	};
+	struct crypt_params_reencrypt params = {};
+	const char *name;
+	char passphrase[512];
+	size_t len;
+	int r;
+
+	if (argc < 4 || argc > 5) {
+		fprintf(stderr, "Usage: %s <device> <name> <hotzone size> [<crash offset>]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	name = strcmp(argv[2], "-") ? argv[2] : NULL;
+	params.hotzone_size = strtoull(argv[3], NULL, 10);
+	if (argc == 5)
+		crash_offset = strtoull(argv[4], NULL, 10);
+
+	if (!fgets(passphrase, sizeof(passphrase), stdin))
+		return EXIT_FAILURE;
+	len = strcspn(passphrase, "\n");
+
+	r = crypt_init(&cd, argv[1]);
+	if (!r)
+		r = crypt_load(cd, CRYPT_LUKS2, NULL);
+	if (!r)
+		r = crypt_set_pbkdf_type(cd, &pbkdf);
+	if (!r) {
+		r = crypt_reencrypt_init_by_passphrase(cd, name, passphrase, len,
+				CRYPT_ANY_SLOT, CRYPT_ANY_SLOT, NULL, NULL, &params);
+		if (r >= 0)
+			r = crypt_reencrypt(cd, progress, NULL);
+	}
+
+	if (r < 0)
+		fprintf(stderr, "Reencryption failed: %s.\n", strerror(-r));
+
+	crypt_free(cd);
+	memset(passphrase, 0, sizeof(passphrase));
+
+	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
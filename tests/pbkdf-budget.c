@@ -0,0 +1,250 @@
+/*
+ * cryptsetup Argon2 memory budget test
+ *
+ * Copyright (C) 2026, cryptsetup contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+
+#include "crypto_backend.h"
+
+#define BUDGET_FILE	"pbkdf-budget-test.key"
+#define BUDGET_MB	64
+#define COST_KB		(40 * 1024)	/* two derivations do not fit */
+#define THREADS		4
+
+static int semid = -1;
+
+static struct {
+	pthread_mutex_t lock;
+	int stop, min_free;
+} sampler = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.min_free = BUDGET_MB,
+};
+
+static int derive(const char *type, size_t salt_length, uint32_t memory)
+{
+	char key[32];
+
+	return argon2(type, "budget", 6, "0123456789abcdef", salt_length,
+		      key, sizeof(key), 1, memory, 1);
+}
+
+static int sem_free_units(void)
+{
+	return semctl(semid, 0, GETVAL);
+}
+
+static void *derive_thread(void *arg)
+{
+	int *r = arg;
+
+	*r = derive("argon2id", 16, COST_KB);
+	return NULL;
+}
+
+static void *sample_thread(void *arg)
+{
+	int units;
+
+	pthread_mutex_lock(&sampler.lock);
+	while (!sampler.stop) {
+		pthread_mutex_unlock(&sampler.lock);
+		units = sem_free_units();
+		pthread_mutex_lock(&sampler.lock);
+		if (units >= 0 && units < sampler.min_free)
+			sampler.min_free = units;
+	}
+	pthread_mutex_unlock(&sampler.lock);
+
+	return NULL;
+}
+
+static void remove_budget(void)
+{
+	key_t key;
+	int id;
+
+	key = ftok(BUDGET_FILE, 'K');
+	if (key != (key_t)-1 && (id = semget(key, 0, 0)) >= 0)
+		semctl(id, 0, IPC_RMID);
+	unlink(BUDGET_FILE);
+}
+
+static int open_budget(void)
+{
+	key_t key;
+
+	if (crypt_argon2_set_budget(BUDGET_MB * 1024, BUDGET_FILE)) {
+		printf("Cannot create shared budget.\n");
+		return -EINVAL;
+	}
+
+	key = ftok(BUDGET_FILE, 'K');
+	if (key == (key_t)-1 || (semid = semget(key, 0, 0)) < 0) {
+		printf("Cannot open shared budget semaphore.\n");
+		return -EINVAL;
+	}
+
+	if (sem_free_units() != BUDGET_MB) {
+		printf("Unexpected shared budget size %d.\n", sem_free_units());
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Concurrent derivations never take more than the budget */
+static int test_limit(void)
+{
+	pthread_t poller, threads[THREADS];
+	int i, r = 0, ret[THREADS];
+
+	printf("Budget limit ");
+	if (pthread_create(&poller, NULL, sample_thread, NULL))
+		return -EINVAL;
+
+	for (i = 0; i < THREADS; i++)
+		if (pthread_create(&threads[i], NULL, derive_thread, &ret[i]))
+			return -EINVAL;
+	for (i = 0; i < THREADS; i++) {
+		pthread_join(threads[i], NULL);
+		if (ret[i])
+			r = -EINVAL;
+	}
+
+	pthread_mutex_lock(&sampler.lock);
+	sampler.stop = 1;
+	pthread_mutex_unlock(&sampler.lock);
+	pthread_join(poller, NULL);
+
+	if (r) {
+		printf("derivation [FAILED].\n");
+		return r;
+	}
+
+	if (sampler.min_free != BUDGET_MB - COST_KB / 1024) {
+		printf("free units %d [FAILED].\n", sampler.min_free);
+		return -EINVAL;
+	}
+
+	if (sem_free_units() != BUDGET_MB) {
+		printf("units not returned [FAILED].\n");
+		return -EINVAL;
+	}
+
+	printf("[OK]\n");
+	return 0;
+}
+
+/* Units held by other process block derivation */
+static int test_shared(void)
+{
+	struct sembuf op = { .sem_num = 0, .sem_op = -(BUDGET_MB - 4), .sem_flg = SEM_UNDO };
+	pthread_t thread;
+	int r = -1;
+
+	printf("Shared budget ");
+	if (semop(semid, &op, 1))
+		return -errno;
+
+	if (pthread_create(&thread, NULL, derive_thread, &r))
+		return -EINVAL;
+
+	usleep(500000);
+	if (sem_free_units() != 4 || semctl(semid, 0, GETNCNT) != 1) {
+		printf("not waiting [FAILED].\n");
+		return -EINVAL;
+	}
+
+	op.sem_op = BUDGET_MB - 4;
+	if (semop(semid, &op, 1))
+		return -errno;
+	pthread_join(thread, NULL);
+
+	if (r || sem_free_units() != BUDGET_MB) {
+		printf("[FAILED].\n");
+		return -EINVAL;
+	}
+
+	printf("[OK]\n");
+	return 0;
+}
+
+/* Admission is released even if derivation fails */
+static int test_error(void)
+{
+	printf("Budget release on error ");
+
+	if (!derive("argon2x", 16, COST_KB) || sem_free_units() != BUDGET_MB) {
+		printf("unknown type [FAILED].\n");
+		return -EINVAL;
+	}
+
+	if (!derive("argon2i", 4, COST_KB) || sem_free_units() != BUDGET_MB) {
+		printf("short salt [FAILED].\n");
+		return -EINVAL;
+	}
+
+	/* whole budget fits only if nothing is accounted as running */
+	alarm(30);
+	if (derive("argon2id", 16, BUDGET_MB * 1024) || sem_free_units() != BUDGET_MB) {
+		printf("whole budget [FAILED].\n");
+		return -EINVAL;
+	}
+	alarm(0);
+
+	printf("[OK]\n");
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int r;
+
+	if (crypt_backend_init(NULL)) {
+		printf("Crypto backend init error.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (derive("argon2id", 16, 1024)) {
+		printf("Argon2 not available, test skipped.\n");
+		crypt_backend_destroy();
+		exit(77);
+	}
+
+	remove_budget();
+	r = open_budget();
+	if (!r)
+		r = test_limit();
+	if (!r)
+		r = test_shared();
+	if (!r)
+		r = test_error();
+	remove_budget();
+
+	crypt_backend_destroy();
+	exit(r ? EXIT_FAILURE : EXIT_SUCCESS);
+}